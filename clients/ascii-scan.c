@@ -0,0 +1,63 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ascii-scan.h"
+
+#define ONES	0x0101010101010101ULL
+#define HIGHS	0x8080808080808080ULL
+
+/*
+ * Length of the run of printable ASCII (0x20 to 0x7e) at the start of
+ * data.  Eight bytes are tested at a time: a byte below 0x20 borrows
+ * into its high bit when 0x20 is subtracted, a byte above 0x7e has it
+ * set after adding one, or already had it.  Carries and borrows only
+ * run from a byte that did match towards the more significant ones, so
+ * the lowest flagged byte is always the first one that stops the run.
+ */
+size_t
+ascii_printable_run(const char *data, size_t length)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	size_t i = 0;
+	uint64_t w, stop;
+
+	while (i + sizeof w <= length) {
+		memcpy(&w, p + i, sizeof w);
+		stop = (((w - ONES * 0x20) & ~w) | ((w + ONES) | w)) & HIGHS;
+		if (stop) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return i + __builtin_ctzll(stop) / 8;
+#else
+			break;
+#endif
+		}
+		i += sizeof w;
+	}
+
+	while (i < length && p[i] >= 0x20 && p[i] < 0x7f)
+		i++;
+
+	return i;
+}
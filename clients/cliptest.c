@@ -28,6 +28,10 @@
  *	clip box size: mouse right drag, keys: i j k l
  *	surface orientation: mouse wheel, keys: n m
  *	surface transform disable key: r
+ *
+ * "cliptest -b [name]" instead times the clipper, the region operations
+ * of damage accumulation and the matrix code on fixed inputs, see
+ * benchmark().
  */
 
 #include <stdint.h>
@@ -44,13 +48,22 @@
 #include <float.h>
 #include <assert.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <linux/input.h>
 #include <wayland-client.h>
 
 #include "window.h"
+#include "../shared/matrix.h"
 
 typedef float GLfloat;
 
+/* The GL renderer uses the scalar clipper.  cliptest also carries an
+ * SSE2 one, so that the benchmark can tell whether it would pay off. */
+static int use_sse2;
+
 struct geometry {
 	pixman_box32_t clip;
 
@@ -124,6 +137,144 @@ float_difference(GLfloat a, GLfloat b)
 	return diff;
 }
 
+#ifdef __SSE2__
+
+/* float_difference() on four lanes at once. */
+static __m128
+float_difference_sse2(__m128 a, __m128 b)
+{
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 max_diff = _mm_set1_ps(4.0f * FLT_MIN);
+	const __m128 max_rel_diff = _mm_set1_ps(4.0e-5);
+	__m128 diff = _mm_sub_ps(a, b);
+	__m128 adiff = _mm_andnot_ps(sign, diff);
+	__m128 m, equal;
+
+	m = _mm_max_ps(_mm_andnot_ps(sign, a), _mm_andnot_ps(sign, b));
+	equal = _mm_or_ps(_mm_cmple_ps(adiff, max_diff),
+			  _mm_cmple_ps(adiff, _mm_mul_ps(m, max_rel_diff)));
+
+	return _mm_andnot_ps(equal, diff);
+}
+
+/* For each lane, the line segment (p1u, p1v)-(p2u, p2v) intersects the
+ * line u = c.  Compute the v coordinate of the intersection, exactly
+ * like clip_intersect_y() (u = x) or clip_intersect_x() (u = y).
+ */
+static __m128
+clip_intersect_sse2(__m128 p1u, __m128 p1v, __m128 p2u, __m128 p2v,
+		    __m128 c)
+{
+	__m128 diff = float_difference_sse2(p1u, p2u);
+	__m128 parallel = _mm_cmpeq_ps(diff, _mm_setzero_ps());
+	__m128 a, v;
+
+	/* The division by zero in the parallel lanes is masked out. */
+	a = _mm_div_ps(_mm_sub_ps(c, p2u), diff);
+	v = _mm_add_ps(p2v, _mm_mul_ps(_mm_sub_ps(p1v, p2v), a));
+
+	return _mm_or_ps(_mm_and_ps(parallel, p2v),
+			 _mm_andnot_ps(parallel, v));
+}
+
+/* Clip the polygon against one side of the clip box, the line u = c
+ * where u is x if axis is 0 and y if axis is 1.  The inside is u >= c
+ * if ge is set, u < c otherwise.  The inside tests and the
+ * intersection of every edge with the line are computed four vertices
+ * at a time; only emitting the output vertices is scalar.  Produces
+ * the same vertices as the scalar clip_polygon_*() code.
+ */
+static int
+clip_polygon_sse2(const struct polygon8 *src, GLfloat *dst_x, GLfloat *dst_y,
+		  int axis, int ge, GLfloat c)
+{
+	const GLfloat *su = axis ? src->y : src->x;
+	const GLfloat *sv = axis ? src->x : src->y;
+	GLfloat iv[8];
+	__m128 u[2], v[2], pu, pv, in, vc = _mm_set1_ps(c);
+	int i, n = src->n, all, in_bits = 0, prev_in, cur_in, k = 0;
+
+	if (n == 0)
+		return 0;
+
+	u[0] = _mm_loadu_ps(su);
+	v[0] = _mm_loadu_ps(sv);
+	u[1] = _mm_loadu_ps(su + 4);
+	v[1] = _mm_loadu_ps(sv + 4);
+
+	for (i = 0; i < n; i += 4) {
+		if (ge)
+			in = _mm_cmpge_ps(u[i / 4], vc);
+		else
+			in = _mm_cmplt_ps(u[i / 4], vc);
+		in_bits |= _mm_movemask_ps(in) << i;
+	}
+
+	/* Nothing to clip on this side: the common case of a surface
+	 * rectangle crossing only some of the sides of the clip box. */
+	all = (1 << n) - 1;
+	in_bits &= all;
+	if (in_bits == all) {
+		memcpy(dst_x, src->x, n * sizeof *dst_x);
+		memcpy(dst_y, src->y, n * sizeof *dst_y);
+		return n;
+	}
+	if (in_bits == 0)
+		return 0;
+
+	for (i = 0; i < n; i += 4) {
+		/* The previous vertex of each vertex: shift the lanes up
+		 * by one, wrapping around to the last vertex. */
+		if (i == 0) {
+			pu = _mm_castsi128_ps(_mm_slli_si128(
+					_mm_castps_si128(u[0]), 4));
+			pv = _mm_castsi128_ps(_mm_slli_si128(
+					_mm_castps_si128(v[0]), 4));
+			pu = _mm_move_ss(pu, _mm_set_ss(su[n - 1]));
+			pv = _mm_move_ss(pv, _mm_set_ss(sv[n - 1]));
+		} else {
+			pu = _mm_or_ps(
+				_mm_castsi128_ps(_mm_slli_si128(
+					_mm_castps_si128(u[1]), 4)),
+				_mm_castsi128_ps(_mm_srli_si128(
+					_mm_castps_si128(u[0]), 12)));
+			pv = _mm_or_ps(
+				_mm_castsi128_ps(_mm_slli_si128(
+					_mm_castps_si128(v[1]), 4)),
+				_mm_castsi128_ps(_mm_srli_si128(
+					_mm_castps_si128(v[0]), 12)));
+		}
+
+		_mm_storeu_ps(iv + i, clip_intersect_sse2(pu, pv,
+							  u[i / 4], v[i / 4],
+							  vc));
+	}
+
+	prev_in = (in_bits >> (n - 1)) & 1;
+	for (i = 0; i < n; i++) {
+		cur_in = (in_bits >> i) & 1;
+
+		/* crossing the line, emit the intersection point */
+		if (cur_in != prev_in) {
+			dst_x[k] = axis ? iv[i] : c;
+			dst_y[k] = axis ? c : iv[i];
+			k++;
+		}
+
+		if (cur_in) {
+			dst_x[k] = src->x[i];
+			dst_y[k] = src->y[i];
+			k++;
+		}
+
+		prev_in = cur_in;
+	}
+
+	return k;
+}
+
+#endif
+
 /* A line segment (p1x, p1y)-(p2x, p2y) intersects the line x = x_arg.
  * Compute the y coordinate of the intersection.
  */
@@ -415,10 +566,24 @@ calculate_edges(struct weston_surface *es, pixman_box32_t *rect,
 	 * http://www.codeguru.com/cpp/misc/misc/graphics/article.php/c8965/Polygon-Clipping.htm
 	 * but without looking at any of that code.
 	 */
-	polygon.n = clip_polygon_left(&ctx, &surf, polygon.x, polygon.y);
-	surf.n = clip_polygon_right(&ctx, &polygon, surf.x, surf.y);
-	polygon.n = clip_polygon_top(&ctx, &surf, polygon.x, polygon.y);
-	surf.n = clip_polygon_bottom(&ctx, &polygon, surf.x, surf.y);
+#ifdef __SSE2__
+	if (use_sse2) {
+		polygon.n = clip_polygon_sse2(&surf, polygon.x, polygon.y,
+					      0, 1, ctx.clip.x1);
+		surf.n = clip_polygon_sse2(&polygon, surf.x, surf.y,
+					   0, 0, ctx.clip.x2);
+		polygon.n = clip_polygon_sse2(&surf, polygon.x, polygon.y,
+					      1, 1, ctx.clip.y1);
+		surf.n = clip_polygon_sse2(&polygon, surf.x, surf.y,
+					   1, 0, ctx.clip.y2);
+	} else
+#endif
+	{
+		polygon.n = clip_polygon_left(&ctx, &surf, polygon.x, polygon.y);
+		surf.n = clip_polygon_right(&ctx, &polygon, surf.x, surf.y);
+		polygon.n = clip_polygon_top(&ctx, &surf, polygon.x, polygon.y);
+		surf.n = clip_polygon_bottom(&ctx, &polygon, surf.x, surf.y);
+	}
 
 	/* Get rid of duplicate vertices */
 	ex[0] = surf.x[0];
@@ -844,39 +1009,257 @@ read_timer(void)
 	       1e-9 * (t.tv_nsec - begin_time.tv_nsec);
 }
 
-static int
-benchmark(void)
+/* Clip boxes against surfaces as the GL renderer sees them on a
+ * 1920x1080 output: damage of a blinking cursor, a scrolled terminal,
+ * a full frame of video and a whole window, against surfaces rotated by
+ * phi (0 is untransformed) and centered on the origin like in the
+ * interactive view. */
+static const struct {
+	pixman_box32_t clip;
+	pixman_box32_t surf;
+	float phi;
+} clip_inputs[] = {
+	{ { 412, 300, 420, 316 }, { -640, -400, 640, 400 }, 0.0f },
+	{ { 412, 300, 420, 316 }, { -640, -400, 640, 400 }, 0.1f },
+	{ { 0, 16, 1280, 784 }, { -640, -400, 640, 400 }, 0.0f },
+	{ { 0, 16, 1280, 784 }, { -640, -400, 640, 400 }, 0.3f },
+	{ { -960, -540, 960, 540 }, { -960, -540, 960, 540 }, 0.0f },
+	{ { -960, -540, 960, 540 }, { -320, -240, 320, 240 }, 0.785f },
+	{ { -100, -100, 100, 100 }, { -320, -240, 320, 240 }, 1.2f },
+	{ { 500, 500, 700, 700 }, { -320, -240, 320, 240 }, 0.5f },
+};
+
+/* A stack of surfaces, topmost first, and the damage of each at one
+ * repaint: a translucent notification, a terminal with a cursor blink
+ * and a scrolled line, a video player, a panel with its clock and the
+ * background. */
+static const struct {
+	int32_t x, y, width, height;
+	int opaque;
+	pixman_box32_t damage[2];
+	int damage_count;
+} region_inputs[] = {
+	{ 1400, 40, 400, 120, 0, { { 0, 0, 400, 120 } }, 1 },
+	{ 200, 150, 900, 600, 1,
+	  { { 412, 300, 420, 316 }, { 0, 584, 900, 600 } }, 2 },
+	{ 700, 400, 1280, 720, 1, { { 0, 0, 1280, 720 } }, 1 },
+	{ 0, 0, 1920, 32, 1, { { 1820, 8, 1900, 24 } }, 1 },
+	{ 0, 0, 1920, 1080, 1, { { 0, 0, 0, 0 } }, 0 },
+};
+
+static void
+benchmark_report(const char *name, unsigned long ops, double t)
+{
+	printf("%-12s %10lu ops %10.1f ns/op\n", name, ops, t * 1e9 / ops);
+}
+
+static void
+benchmark_clip(const char *name, int rounds)
 {
 	struct weston_surface surface;
 	struct geometry geom;
 	GLfloat ex[8], ey[8];
-	int i;
+	unsigned int i;
+	int r, total = 0;
 	double t;
-	const int N = 1000000;
 
-	geom.clip.x1 = -19;
-	geom.clip.y1 = -19;
+	surface.geometry = &geom;
+
+	reset_timer();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < ARRAY_LENGTH(clip_inputs); i++) {
+			geom.clip = clip_inputs[i].clip;
+			geom.surf = clip_inputs[i].surf;
+			geometry_set_phi(&geom, clip_inputs[i].phi);
+			surface.transform.enabled = clip_inputs[i].phi != 0.0f;
+			total += calculate_edges(&surface, &geom.clip,
+						 &geom.surf, ex, ey);
+		}
+	}
+	t = read_timer();
+
+	/* keep the clipper from being optimized away */
+	if (total < 0)
+		printf("%d\n", total);
+
+	benchmark_report(name,
+			 (unsigned long) rounds * ARRAY_LENGTH(clip_inputs), t);
+}
+
+#ifdef __SSE2__
+/* The SSE2 clipper must produce exactly the same polygons. */
+static int
+benchmark_verify(void)
+{
+	struct weston_surface surface;
+	struct geometry geom;
+	GLfloat ex[2][8], ey[2][8];
+	int i, k, count[2], mismatches = 0;
+
 	geom.clip.x2 = 19;
 	geom.clip.y2 = 19;
-
 	geom.surf.x1 = -20;
 	geom.surf.y1 = -20;
 	geom.surf.x2 = 20;
 	geom.surf.y2 = 20;
 
-	geometry_set_phi(&geom, 0.0);
-
 	surface.transform.enabled = 1;
 	surface.geometry = &geom;
 
-	reset_timer();
-	for (i = 0; i < N; i++) {
+	for (i = 0; i < 100000; i++) {
 		geometry_set_phi(&geom, (float)i / 360.0f);
-		calculate_edges(&surface, &geom.clip, &geom.surf, ex, ey);
+		geom.clip.x1 = -19 + i % 17;
+		geom.clip.y1 = -19 + i % 13;
+
+		for (k = 0; k < 2; k++) {
+			use_sse2 = k;
+			count[k] = calculate_edges(&surface, &geom.clip,
+						   &geom.surf, ex[k], ey[k]);
+		}
+
+		if (count[0] != count[1] ||
+		    memcmp(ex[0], ex[1], count[0] * sizeof ex[0][0]) ||
+		    memcmp(ey[0], ey[1], count[0] * sizeof ey[0][0]))
+			mismatches++;
+	}
+
+	return mismatches;
+}
+#endif
+
+/* The region operations of compositor_accumulate_damage() for one
+ * plane: each surface's damage is moved to output coordinates, loses
+ * what the opaque surfaces above cover, and is added to the plane's
+ * damage, which the repaint then clips to the output. */
+static void
+benchmark_region(const char *name, int rounds)
+{
+	pixman_region32_t damage, opaque, clip, plane_damage;
+	unsigned int i;
+	int r;
+	double t;
+
+	pixman_region32_init(&damage);
+	pixman_region32_init(&clip);
+	pixman_region32_init(&plane_damage);
+
+	reset_timer();
+	for (r = 0; r < rounds; r++) {
+		pixman_region32_init(&opaque);
+		for (i = 0; i < ARRAY_LENGTH(region_inputs); i++) {
+			pixman_region32_fini(&damage);
+			pixman_region32_init_rects(&damage,
+						   region_inputs[i].damage,
+						   region_inputs[i].damage_count);
+			pixman_region32_translate(&damage,
+						  region_inputs[i].x,
+						  region_inputs[i].y);
+			pixman_region32_subtract(&damage, &damage, &opaque);
+			pixman_region32_union(&plane_damage, &plane_damage,
+					      &damage);
+			pixman_region32_copy(&clip, &opaque);
+			if (region_inputs[i].opaque)
+				pixman_region32_union_rect(&opaque, &opaque,
+							   region_inputs[i].x,
+							   region_inputs[i].y,
+							   region_inputs[i].width,
+							   region_inputs[i].height);
+		}
+		pixman_region32_fini(&opaque);
+
+		pixman_region32_intersect_rect(&plane_damage, &plane_damage,
+					       0, 0, 1920, 1080);
+		pixman_region32_clear(&plane_damage);
 	}
 	t = read_timer();
 
-	printf("%d calls took %g s, average %g us/call\n", N, t, t / N * 1e6);
+	pixman_region32_fini(&damage);
+	pixman_region32_fini(&clip);
+	pixman_region32_fini(&plane_damage);
+
+	benchmark_report(name,
+			 (unsigned long) rounds * ARRAY_LENGTH(region_inputs),
+			 t);
+}
+
+/* What weston_surface_update_transform() and the renderers do for a
+ * rotated surface: build its matrix from a translation, a rotation and
+ * another translation, invert it, and transform the four corners. */
+static void
+benchmark_matrix(const char *name, int rounds)
+{
+	struct weston_matrix m, rotation, inverse;
+	struct weston_vector v;
+	float sum = 0.0f;
+	int r, i;
+	double t;
+
+	weston_matrix_init(&rotation);
+	weston_matrix_rotate_xy(&rotation, cos(0.3), sin(0.3));
+
+	reset_timer();
+	for (r = 0; r < rounds; r++) {
+		weston_matrix_init(&m);
+		weston_matrix_translate(&m, -320.0f, -240.0f, 0.0f);
+		weston_matrix_multiply(&m, &rotation);
+		weston_matrix_translate(&m, 960.0f + r % 7, 540.0f, 0.0f);
+		weston_matrix_invert(&inverse, &m);
+
+		for (i = 0; i < 4; i++) {
+			v.f[0] = i & 1 ? 640.0f : 0.0f;
+			v.f[1] = i & 2 ? 480.0f : 0.0f;
+			v.f[2] = 0.0f;
+			v.f[3] = 1.0f;
+			weston_matrix_transform(&m, &v);
+			sum += v.f[0];
+		}
+	}
+	t = read_timer();
+
+	/* keep the matrix code from being optimized away */
+	if (sum == -1.0f)
+		printf("%f\n", sum);
+
+	benchmark_report(name, rounds, t);
+}
+
+/* Times the kernels above on their fixed inputs.  An op is one call of
+ * calculate_edges(), the damage of one surface, or one matrix built,
+ * inverted and applied.  Only the benchmarks whose name starts with
+ * filter are run, all of them if it is NULL. */
+static int
+benchmark(const char *filter)
+{
+	static const struct {
+		const char *name;
+		void (*run)(const char *name, int rounds);
+		int sse2;
+		int rounds;
+	} benchmarks[] = {
+		{ "clip", benchmark_clip, 0, 500000 },
+#ifdef __SSE2__
+		{ "clip-sse2", benchmark_clip, 1, 500000 },
+#endif
+		{ "region", benchmark_region, 0, 200000 },
+		{ "matrix", benchmark_matrix, 0, 1000000 },
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(benchmarks); i++) {
+		if (filter && strncmp(benchmarks[i].name, filter,
+				      strlen(filter)) != 0)
+			continue;
+		use_sse2 = benchmarks[i].sse2;
+		benchmarks[i].run(benchmarks[i].name, benchmarks[i].rounds);
+	}
+
+#ifdef __SSE2__
+	if ((!filter || strncmp("clip", filter, strlen(filter)) == 0) &&
+	    benchmark_verify() != 0) {
+		printf("sse2 results differ from scalar results\n");
+		return 1;
+	}
+#endif
 
 	return 0;
 }
@@ -887,8 +1270,9 @@ main(int argc, char *argv[])
 	struct display *d;
 	struct cliptest *cliptest;
 
-	if (argc > 1)
-		return benchmark();
+	if (argc > 1 && (strcmp(argv[1], "-b") == 0 ||
+			 strcmp(argv[1], "--benchmark") == 0))
+		return benchmark(argv[2]);
 
 	d = display_create(&argc, argv);
 	if (d == NULL) {
@@ -40,6 +40,7 @@
 #include <wayland-client.h>
 #include "window.h"
 #include "../shared/cairo-util.h"
+#include "../shared/image-loader.h"
 #include "../shared/config-parser.h"
 
 #include "desktop-shell-client-protocol.h"
@@ -72,12 +73,27 @@ struct panel {
 	struct widget *widget;
 	struct wl_list launcher_list;
 	struct panel_clock *clock;
+
+	/* What this redraw draws, in surface coordinates: all of the
+	 * panel, or for a partial redraw the stale area and the clock if
+	 * it ticked.  Child widgets only draw inside it. */
+	struct rectangle redraw_area;
 };
 
 struct background {
 	struct surface base;
 	struct window *window;
 	struct widget *widget;
+
+	/* The image is loaded once, off the main thread, and until it
+	 * is there the background color is shown.  Scaled backgrounds
+	 * ask for the allocation size, see load_image_scaled(). */
+	cairo_surface_t *image;
+	int image_width, image_height;
+	struct image_load *load;
+	int load_width, load_height;
+	struct task load_task;
+	int load_failed;
 };
 
 struct output {
@@ -104,6 +120,7 @@ struct panel_clock {
 	struct panel *panel;
 	struct task clock_task;
 	int clock_fd;
+	int dirty;
 };
 
 struct unlock_dialog {
@@ -197,6 +214,30 @@ panel_launcher_activate(struct panel_launcher *widget)
 	}
 }
 
+/* Returns a cairo context clipped to what the panel redraws, or NULL
+ * if that misses the allocation of the widget. */
+static cairo_t *
+panel_cairo_create(struct panel *panel, struct rectangle *allocation,
+		   cairo_surface_t **surface)
+{
+	struct rectangle *area = &panel->redraw_area;
+	cairo_t *cr;
+
+	if (area->width <= 0 || area->height <= 0 ||
+	    allocation->x >= area->x + area->width ||
+	    allocation->y >= area->y + area->height ||
+	    area->x >= allocation->x + allocation->width ||
+	    area->y >= allocation->y + allocation->height)
+		return NULL;
+
+	*surface = window_get_surface(panel->window);
+	cr = cairo_create(*surface);
+	cairo_rectangle(cr, area->x, area->y, area->width, area->height);
+	cairo_clip(cr);
+
+	return cr;
+}
+
 static void
 panel_launcher_redraw_handler(struct widget *widget, void *data)
 {
@@ -205,10 +246,11 @@ panel_launcher_redraw_handler(struct widget *widget, void *data)
 	struct rectangle allocation;
 	cairo_t *cr;
 
-	surface = window_get_surface(launcher->panel->window);
-	cr = cairo_create(surface);
-
 	widget_get_allocation(widget, &allocation);
+	cr = panel_cairo_create(launcher->panel, &allocation, &surface);
+	if (!cr)
+		return;
+
 	if (launcher->pressed) {
 		allocation.x++;
 		allocation.y++;
@@ -225,6 +267,7 @@ panel_launcher_redraw_handler(struct widget *widget, void *data)
 	}
 
 	cairo_destroy(cr);
+	cairo_surface_destroy(surface);
 }
 
 static int
@@ -254,9 +297,26 @@ panel_redraw_handler(struct widget *widget, void *data)
 	cairo_surface_t *surface;
 	cairo_t *cr;
 	struct panel *panel = data;
+	struct rectangle *area = &panel->redraw_area, clock;
+
+	if (widget_redraw_is_partial(widget)) {
+		widget_get_stale_area(widget, area);
+		if (panel->clock && panel->clock->dirty) {
+			widget_get_allocation(panel->clock->widget, &clock);
+			rectangle_union(area, &clock);
+		}
+		if (area->width <= 0 || area->height <= 0)
+			return;
+		widget_add_damage(widget, area->x, area->y,
+				  area->width, area->height);
+	} else {
+		widget_get_allocation(widget, area);
+	}
 
 	surface = window_get_surface(panel->window);
 	cr = cairo_create(surface);
+	cairo_rectangle(cr, area->x, area->y, area->width, area->height);
+	cairo_clip(cr);
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	set_hex_color(cr, key_panel_color);
 	cairo_paint(cr);
@@ -302,18 +362,6 @@ panel_launcher_button_handler(struct widget *widget,
 		panel_launcher_activate(launcher);
 }
 
-static void
-clock_func(struct task *task, uint32_t events)
-{
-	struct panel_clock *clock =
-		container_of(task, struct panel_clock, clock_task);
-	uint64_t exp;
-
-	if (read(clock->clock_fd, &exp, sizeof exp) != sizeof exp)
-		abort();
-	widget_schedule_redraw(clock->widget);
-}
-
 static void
 panel_clock_redraw_handler(struct widget *widget, void *data)
 {
@@ -335,8 +383,11 @@ panel_clock_redraw_handler(struct widget *widget, void *data)
 	if (allocation.width == 0)
 		return;
 
-	surface = window_get_surface(clock->panel->window);
-	cr = cairo_create(surface);
+	clock->dirty = 0;
+	cr = panel_cairo_create(clock->panel, &allocation, &surface);
+	if (!cr)
+		return;
+
 	cairo_select_font_face(cr, "sans",
 			       CAIRO_FONT_SLANT_NORMAL,
 			       CAIRO_FONT_WEIGHT_NORMAL);
@@ -352,18 +403,24 @@ panel_clock_redraw_handler(struct widget *widget, void *data)
 	cairo_set_source_rgb(cr, 1, 1, 1);
 	cairo_show_text(cr, string);
 	cairo_destroy(cr);
+	cairo_surface_destroy(surface);
 }
 
+/* Arms the timer for the start of the next minute of the wall clock,
+ * which is when the time shown changes. */
 static int
 clock_timer_reset(struct panel_clock *clock)
 {
 	struct itimerspec its;
+	struct timespec now;
 
-	its.it_interval.tv_sec = 60;
+	clock_gettime(CLOCK_REALTIME, &now);
+	its.it_interval.tv_sec = 0;
 	its.it_interval.tv_nsec = 0;
-	its.it_value.tv_sec = 60;
+	its.it_value.tv_sec = now.tv_sec - now.tv_sec % 60 + 60;
 	its.it_value.tv_nsec = 0;
-	if (timerfd_settime(clock->clock_fd, 0, &its, NULL) < 0) {
+	if (timerfd_settime(clock->clock_fd, TFD_TIMER_ABSTIME,
+			    &its, NULL) < 0) {
 		fprintf(stderr, "could not set timerfd\n: %m");
 		return -1;
 	}
@@ -371,6 +428,29 @@ clock_timer_reset(struct panel_clock *clock)
 	return 0;
 }
 
+static void
+clock_timer_stop(struct panel_clock *clock)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof its);
+	timerfd_settime(clock->clock_fd, 0, &its, NULL);
+}
+
+static void
+clock_func(struct task *task, uint32_t events)
+{
+	struct panel_clock *clock =
+		container_of(task, struct panel_clock, clock_task);
+	uint64_t exp;
+
+	if (read(clock->clock_fd, &exp, sizeof exp) != sizeof exp)
+		abort();
+	clock_timer_reset(clock);
+	clock->dirty = 1;
+	widget_schedule_partial_redraw(clock->widget);
+}
+
 static void
 panel_destroy_clock(struct panel_clock *clock)
 {
@@ -387,7 +467,7 @@ panel_add_clock(struct panel *panel)
 	struct panel_clock *clock;
 	int timerfd;
 
-	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	timerfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
 	if (timerfd < 0) {
 		fprintf(stderr, "could not create timerfd\n: %m");
 		return;
@@ -625,6 +705,59 @@ enum {
 	BACKGROUND_TILE
 };
 
+static void
+background_load_func(struct task *task, uint32_t events)
+{
+	struct background *background =
+		container_of(task, struct background, load_task);
+	struct display *display = window_get_display(background->window);
+	cairo_surface_t *image;
+
+	display_unwatch_fd(display, image_load_get_fd(background->load));
+	image = load_cairo_surface_finish(background->load);
+	background->load = NULL;
+
+	if (image == NULL) {
+		/* an older, smaller one is still better than nothing */
+		if (background->image == NULL)
+			background->load_failed = 1;
+		return;
+	}
+
+	if (background->image)
+		cairo_surface_destroy(background->image);
+	background->image = image;
+	background->image_width = background->load_width;
+	background->image_height = background->load_height;
+	widget_schedule_redraw(background->widget);
+}
+
+static void
+background_load(struct background *background, int width, int height)
+{
+	struct display *display = window_get_display(background->window);
+
+	if (background->load || background->load_failed)
+		return;
+	if (background->image &&
+	    width <= background->image_width &&
+	    height <= background->image_height)
+		return;
+
+	background->load = image_load_start(key_background_image,
+					    width, height);
+	if (background->load == NULL) {
+		background->load_failed = 1;
+		return;
+	}
+
+	background->load_width = width;
+	background->load_height = height;
+	background->load_task.run = background_load_func;
+	display_watch_fd(display, image_load_get_fd(background->load),
+			 EPOLLIN, &background->load_task);
+}
+
 static void
 background_draw(struct widget *widget, void *data)
 {
@@ -647,9 +780,6 @@ background_draw(struct widget *widget, void *data)
 	cairo_paint(cr);
 
 	widget_get_allocation(widget, &allocation);
-	image = NULL;
-	if (key_background_image)
-		image = load_cairo_surface(key_background_image);
 
 	if (strcmp(key_background_type, "scale") == 0)
 		type = BACKGROUND_SCALE;
@@ -659,6 +789,13 @@ background_draw(struct widget *widget, void *data)
 		fprintf(stderr, "invalid background-type: %s\n",
 			key_background_type);
 
+	if (key_background_image && type == BACKGROUND_SCALE)
+		background_load(background,
+				allocation.width, allocation.height);
+	else if (key_background_image && type != -1)
+		background_load(background, 0, 0);
+	image = background->image;
+
 	if (image && type != -1) {
 		pattern = cairo_pattern_create_for_surface(image);
 		switch (type) {
@@ -676,7 +813,6 @@ background_draw(struct widget *widget, void *data)
 		}
 		cairo_set_source(cr, pattern);
 		cairo_pattern_destroy (pattern);
-		cairo_surface_destroy(image);
 	} else {
 		set_hex_color(cr, key_background_color);
 	}
@@ -931,15 +1067,54 @@ desktop_shell_grab_cursor(void *data,
 	}
 }
 
+/* Nothing on the panels is seen while idle, so the clocks stop until
+ * the desktop is back, and then show the time right away. */
+static void
+desktop_shell_idle(void *data, struct desktop_shell *desktop_shell,
+		   uint32_t idle)
+{
+	struct desktop *desktop = data;
+	struct panel_clock *clock;
+	struct output *output;
+
+	wl_list_for_each(output, &desktop->outputs, link) {
+		if (!output->panel || !output->panel->clock)
+			continue;
+
+		clock = output->panel->clock;
+		if (idle) {
+			clock_timer_stop(clock);
+		} else {
+			clock_timer_reset(clock);
+			clock->dirty = 1;
+			widget_schedule_partial_redraw(clock->widget);
+		}
+	}
+}
+
 static const struct desktop_shell_listener listener = {
 	desktop_shell_configure,
 	desktop_shell_prepare_lock_surface,
-	desktop_shell_grab_cursor
+	desktop_shell_grab_cursor,
+	desktop_shell_idle
 };
 
 static void
 background_destroy(struct background *background)
 {
+	struct display *display = window_get_display(background->window);
+	cairo_surface_t *image;
+
+	if (background->load) {
+		display_unwatch_fd(display,
+				   image_load_get_fd(background->load));
+		image = load_cairo_surface_finish(background->load);
+		if (image)
+			cairo_surface_destroy(image);
+	}
+	if (background->image)
+		cairo_surface_destroy(background->image);
+
 	widget_destroy(background->widget);
 	window_destroy(background->window);
 
@@ -1044,7 +1219,7 @@ global_handler(struct display *display, uint32_t id,
 
 	if (!strcmp(interface, "desktop_shell")) {
 		desktop->shell = display_bind(desktop->display,
-					      id, &desktop_shell_interface, 1);
+					      id, &desktop_shell_interface, 2);
 		desktop_shell_add_listener(desktop->shell, &listener, desktop);
 	} else if (!strcmp(interface, "wl_output")) {
 		create_output(desktop, id);
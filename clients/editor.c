@@ -40,6 +40,8 @@ struct text_entry {
 	struct widget *widget;
 	struct window *window;
 	char *text;
+	char *sent_text;	/* surrounding text the input method has */
+	int send_updates;	/* model takes update_surrounding_text */
 	int active;
 	uint32_t cursor;
 	uint32_t anchor;
@@ -69,6 +71,7 @@ struct text_entry {
 
 struct editor {
 	struct text_model_factory *text_model_factory;
+	uint32_t text_model_factory_version;
 	struct display *display;
 	struct window *window;
 	struct widget *widget;
@@ -126,6 +129,7 @@ static void text_entry_delete_text(struct text_entry *entry,
 static void text_entry_delete_selected_text(struct text_entry *entry);
 static void text_entry_reset_preedit(struct text_entry *entry);
 static void text_entry_commit_and_reset(struct text_entry *entry);
+static void text_entry_update(struct text_entry *entry);
 
 static void
 text_model_commit_string(void *data,
@@ -366,6 +370,11 @@ text_model_enter(void *data,
 
 	entry->active = 1;
 
+	/* a new input method context, which needs all of the text */
+	free(entry->sent_text);
+	entry->sent_text = NULL;
+	text_entry_update(entry);
+
 	widget_schedule_redraw(entry->widget);
 }
 
@@ -419,6 +428,7 @@ text_entry_create(struct editor *editor, const char *text)
 	entry->cursor = strlen(text);
 	entry->anchor = entry->cursor;
 	entry->model = text_model_factory_create_text_model(editor->text_model_factory);
+	entry->send_updates = editor->text_model_factory_version >= 2;
 	text_model_add_listener(entry->model, &text_model_listener, entry);
 
 	widget_set_redraw_handler(entry->widget, text_entry_redraw_handler);
@@ -434,6 +444,7 @@ text_entry_destroy(struct text_entry *entry)
 	text_model_destroy(entry->model);
 	g_clear_object(&entry->layout);
 	free(entry->text);
+	free(entry->sent_text);
 	free(entry);
 }
 
@@ -586,6 +597,58 @@ text_entry_update_layout(struct text_entry *entry)
 	pango_attr_list_unref(attr_list);
 }
 
+/* Sends the surrounding text as the change from what was sent last:
+ * the bytes between the common start and end of the two, moved back
+ * to character boundaries.  A version 1 model only takes the whole
+ * text. */
+static void
+text_entry_send_surrounding_text(struct text_entry *entry)
+{
+	const char *old = entry->sent_text, *new = entry->text;
+	size_t old_len, new_len, start = 0, end = 0;
+	char *changed;
+
+	if (!entry->send_updates) {
+		text_model_set_surrounding_text(entry->model,
+						entry->text,
+						entry->cursor,
+						entry->anchor);
+		return;
+	}
+
+	if (!old) {
+		text_model_set_surrounding_text(entry->model,
+						entry->text,
+						entry->cursor,
+						entry->anchor);
+		entry->sent_text = strdup(entry->text);
+		return;
+	}
+
+	old_len = strlen(old);
+	new_len = strlen(new);
+	while (start < old_len && start < new_len && old[start] == new[start])
+		start++;
+	while (start > 0 && (new[start] & 0xc0) == 0x80)
+		start--;
+	while (end < old_len - start && end < new_len - start &&
+	       old[old_len - end - 1] == new[new_len - end - 1])
+		end++;
+	while (end > 0 && (new[new_len - end] & 0xc0) == 0x80)
+		end--;
+
+	changed = strndup(new + start, new_len - start - end);
+	text_model_update_surrounding_text(entry->model,
+					   start, old_len - start - end,
+					   changed,
+					   entry->cursor,
+					   entry->anchor);
+	free(changed);
+
+	free(entry->sent_text);
+	entry->sent_text = strdup(entry->text);
+}
+
 static void
 text_entry_update(struct text_entry *entry)
 {
@@ -593,10 +656,7 @@ text_entry_update(struct text_entry *entry)
 				    TEXT_MODEL_CONTENT_HINT_NONE,
 				    entry->content_purpose);
 
-	text_model_set_surrounding_text(entry->model,
-					entry->text,
-					entry->cursor,
-					entry->anchor);
+	text_entry_send_surrounding_text(entry);
 
 	text_model_commit(entry->model);
 }
@@ -1033,9 +1093,11 @@ global_handler(struct display *display, uint32_t name,
 	struct editor *editor = data;
 
 	if (!strcmp(interface, "text_model_factory")) {
+		editor->text_model_factory_version = version < 2 ? version : 2;
 		editor->text_model_factory =
 			display_bind(display, name,
-				     &text_model_factory_interface, 1);
+				     &text_model_factory_interface,
+				     editor->text_model_factory_version);
 	}
 }
 
@@ -40,6 +40,32 @@
 #include "window.h"
 #include "../shared/cairo-util.h"
 
+/*
+ * Large images are drawn from a pyramid of levels, each half the size
+ * of the one below, cut into tiles.  Level 0 is the loaded image
+ * itself; the tiles of the others are made from the level below the
+ * first time they are in view and kept, least recently drawn dropped
+ * first, while they fit in TILE_CACHE_SIZE.  A redraw makes at most
+ * TILES_PER_REDRAW of them and shows a coarser tile meanwhile; partial
+ * redraws then fill in and damage only the tiles made since.
+ */
+#define TILE_SIZE		256
+#define TILE_CACHE_SIZE		(64 * 1024 * 1024)
+#define TILES_PER_REDRAW	8
+
+struct image_tile {
+	struct wl_list link;		/* image.tile_list, newest first */
+	cairo_surface_t *surface;
+	int level, tx, ty;
+	size_t size;
+};
+
+struct image_level {
+	int32_t width, height;
+	int tiles_x, tiles_y;
+	struct image_tile **tiles;	/* NULL for level 0 */
+};
+
 struct image {
 	struct window *window;
 	struct widget *widget;
@@ -58,6 +84,15 @@ struct image {
 
 	bool initialized;
 	cairo_matrix_t matrix;
+
+	struct image_level *levels;
+	int level_count;
+	struct wl_list tile_list;
+	size_t tile_cache_size;
+	int tiles_made;			/* by this redraw */
+	bool missing;			/* tiles in view left to make */
+	struct task refine_task;
+	bool refine_pending;
 };
 
 static double
@@ -101,29 +136,363 @@ clamp_view(struct image *image)
 	}
 }
 
+static int
+image_init_levels(struct image *image)
+{
+	struct image_level *level;
+	int32_t width = image->width, height = image->height;
+	int i, count = 1;
+
+	while (width > TILE_SIZE || height > TILE_SIZE) {
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+		count++;
+	}
+
+	image->levels = calloc(count, sizeof *image->levels);
+	if (image->levels == NULL)
+		return -1;
+	image->level_count = count;
+
+	width = image->width;
+	height = image->height;
+	for (i = 0; i < count; i++) {
+		level = &image->levels[i];
+		level->width = width;
+		level->height = height;
+		level->tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+		level->tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+		if (i > 0) {
+			level->tiles = calloc(level->tiles_x * level->tiles_y,
+					      sizeof *level->tiles);
+			if (level->tiles == NULL)
+				return -1;
+		}
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+	}
+
+	return 0;
+}
+
+static void
+image_tile_destroy(struct image *image, struct image_tile *tile)
+{
+	struct image_level *level = &image->levels[tile->level];
+
+	level->tiles[tile->ty * level->tiles_x + tile->tx] = NULL;
+	image->tile_cache_size -= tile->size;
+	wl_list_remove(&tile->link);
+	cairo_surface_destroy(tile->surface);
+	free(tile);
+}
+
+static void
+image_fini_levels(struct image *image)
+{
+	struct image_tile *tile, *next;
+	int i;
+
+	wl_list_for_each_safe(tile, next, &image->tile_list, link)
+		image_tile_destroy(image, tile);
+
+	for (i = 0; i < image->level_count; i++)
+		free(image->levels[i].tiles);
+	free(image->levels);
+}
+
+static cairo_surface_t *
+image_get_tile(struct image *image, int level, int tx, int ty, bool make);
+
+/* Scales the part of level - 1 under the tile down by half.  An odd
+ * last row or column of the level below is padded out. */
+static cairo_surface_t *
+image_make_tile(struct image *image, int level, int tx, int ty)
+{
+	struct image_level *below = &image->levels[level - 1];
+	cairo_surface_t *surface, *source;
+	cairo_pattern_t *pattern;
+	cairo_t *cr;
+	int32_t width, height;
+	int x, y;
+
+	width = image->levels[level].width - tx * TILE_SIZE;
+	height = image->levels[level].height - ty * TILE_SIZE;
+	surface = cairo_image_surface_create(
+		cairo_image_surface_get_format(image->image),
+		width < TILE_SIZE ? width : TILE_SIZE,
+		height < TILE_SIZE ? height : TILE_SIZE);
+
+	cr = cairo_create(surface);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_scale(cr, 0.5, 0.5);
+	cairo_translate(cr, -2 * tx * TILE_SIZE, -2 * ty * TILE_SIZE);
+
+	if (level == 1) {
+		cairo_set_source_surface(cr, image->image, 0, 0);
+		cairo_pattern_set_extend(cairo_get_source(cr),
+					 CAIRO_EXTEND_PAD);
+		cairo_paint(cr);
+		cairo_destroy(cr);
+		return surface;
+	}
+
+	for (y = 2 * ty; y < 2 * ty + 2 && y < below->tiles_y; y++) {
+		for (x = 2 * tx; x < 2 * tx + 2 && x < below->tiles_x; x++) {
+			source = image_get_tile(image, level - 1, x, y, true);
+			if (source == NULL)
+				continue;
+
+			/* whole pixels of this tile, even at an odd edge */
+			width = cairo_image_surface_get_width(source);
+			height = cairo_image_surface_get_height(source);
+			cairo_save(cr);
+			cairo_rectangle(cr, x * TILE_SIZE, y * TILE_SIZE,
+					(width + 1) & ~1, (height + 1) & ~1);
+			cairo_clip(cr);
+			pattern = cairo_pattern_create_for_surface(source);
+			cairo_pattern_set_extend(pattern, CAIRO_EXTEND_PAD);
+			cairo_set_source(cr, pattern);
+			cairo_pattern_destroy(pattern);
+			cairo_translate(cr, x * TILE_SIZE, y * TILE_SIZE);
+			cairo_paint(cr);
+			cairo_restore(cr);
+			cairo_surface_destroy(source);
+		}
+	}
+
+	cairo_destroy(cr);
+
+	return surface;
+}
+
+/* Returns a reference to the tile, made if it isn't there and make is
+ * set, or NULL. */
+static cairo_surface_t *
+image_get_tile(struct image *image, int level, int tx, int ty, bool make)
+{
+	struct image_level *l = &image->levels[level];
+	struct image_tile *tile, *oldest;
+
+	tile = l->tiles[ty * l->tiles_x + tx];
+	if (tile) {
+		wl_list_remove(&tile->link);
+		wl_list_insert(&image->tile_list, &tile->link);
+		return cairo_surface_reference(tile->surface);
+	}
+
+	if (!make)
+		return NULL;
+
+	tile = malloc(sizeof *tile);
+	if (tile == NULL)
+		return NULL;
+
+	tile->surface = image_make_tile(image, level, tx, ty);
+	tile->level = level;
+	tile->tx = tx;
+	tile->ty = ty;
+	tile->size = cairo_image_surface_get_stride(tile->surface) *
+		cairo_image_surface_get_height(tile->surface);
+	l->tiles[ty * l->tiles_x + tx] = tile;
+	wl_list_insert(&image->tile_list, &tile->link);
+	image->tile_cache_size += tile->size;
+	image->tiles_made++;
+
+	while (image->tile_cache_size > TILE_CACHE_SIZE) {
+		oldest = container_of(image->tile_list.prev,
+				      struct image_tile, link);
+		if (oldest == tile)
+			break;
+		image_tile_destroy(image, oldest);
+	}
+
+	return cairo_surface_reference(tile->surface);
+}
+
+/* The finest level that is drawn scaled down, if at all. */
+static int
+image_pick_level(struct image *image)
+{
+	double scale = get_scale(image);
+	int level = 0;
+
+	while (level + 1 < image->level_count && scale * (2 << level) <= 1.0)
+		level++;
+
+	return level;
+}
+
+/* The tiles of level in view, [tx1, tx2) by [ty1, ty2). */
+static void
+image_visible_tiles(struct image *image, int level,
+		    struct rectangle *allocation,
+		    int *tx1, int *ty1, int *tx2, int *ty2)
+{
+	struct image_level *l = &image->levels[level];
+	double size = get_scale(image) * (1 << level) * TILE_SIZE;
+
+	*tx1 = floor(-image->matrix.x0 / size);
+	*ty1 = floor(-image->matrix.y0 / size);
+	*tx2 = ceil((allocation->width - image->matrix.x0) / size);
+	*ty2 = ceil((allocation->height - image->matrix.y0) / size);
+
+	if (*tx1 < 0)
+		*tx1 = 0;
+	if (*ty1 < 0)
+		*ty1 = 0;
+	if (*tx2 > l->tiles_x)
+		*tx2 = l->tiles_x;
+	if (*ty2 > l->tiles_y)
+		*ty2 = l->tiles_y;
+}
+
+/* Where the tile is on the window surface. */
+static void
+image_tile_rectangle(struct image *image, int level, int tx, int ty,
+		     struct rectangle *allocation, struct rectangle *r)
+{
+	struct image_level *l = &image->levels[level];
+	double scale = get_scale(image) * (1 << level);
+	double x1, y1, x2, y2;
+
+	x1 = tx * TILE_SIZE;
+	y1 = ty * TILE_SIZE;
+	x2 = x1 + TILE_SIZE < l->width ? x1 + TILE_SIZE : l->width;
+	y2 = y1 + TILE_SIZE < l->height ? y1 + TILE_SIZE : l->height;
+
+	r->x = floor(allocation->x + image->matrix.x0 + x1 * scale);
+	r->y = floor(allocation->y + image->matrix.y0 + y1 * scale);
+	r->width = ceil(allocation->x + image->matrix.x0 + x2 * scale) - r->x;
+	r->height = ceil(allocation->y + image->matrix.y0 + y2 * scale) - r->y;
+}
+
+/* Makes the missing tiles in view, as many as a redraw may, and adds
+ * where they are to area if it is given.  Sets image->missing if any
+ * are left. */
+static void
+image_make_tiles(struct image *image, int level,
+		 struct rectangle *allocation, struct rectangle *area)
+{
+	struct image_level *l = &image->levels[level];
+	cairo_surface_t *tile;
+	struct rectangle r;
+	int tx, ty, tx1, ty1, tx2, ty2;
+
+	image->missing = false;
+	if (level == 0)
+		return;
+
+	image_visible_tiles(image, level, allocation, &tx1, &ty1, &tx2, &ty2);
+	for (ty = ty1; ty < ty2; ty++) {
+		for (tx = tx1; tx < tx2; tx++) {
+			if (l->tiles[ty * l->tiles_x + tx])
+				continue;
+			if (image->tiles_made >= TILES_PER_REDRAW) {
+				image->missing = true;
+				continue;
+			}
+
+			tile = image_get_tile(image, level, tx, ty, true);
+			if (tile == NULL)
+				continue;
+			cairo_surface_destroy(tile);
+
+			if (area) {
+				image_tile_rectangle(image, level, tx, ty,
+						     allocation, &r);
+				rectangle_union(area, &r);
+			}
+		}
+	}
+}
+
+/* Draws a tile, or the part of a coarser one under it until it is
+ * made.  cr is in level 0 coordinates. */
+static void
+image_draw_tile(struct image *image, cairo_t *cr, int level, int tx, int ty)
+{
+	struct image_level *l = &image->levels[level];
+	cairo_surface_t *tile = NULL;
+	int coarse, shift = 0;
+
+	for (coarse = level; coarse < image->level_count; coarse++) {
+		shift = coarse - level;
+		tile = image_get_tile(image, coarse,
+				      tx >> shift, ty >> shift, false);
+		if (tile)
+			break;
+	}
+	if (tile == NULL)
+		return;
+
+	cairo_save(cr);
+	cairo_scale(cr, 1 << level, 1 << level);
+	cairo_rectangle(cr, tx * TILE_SIZE, ty * TILE_SIZE,
+			l->width - tx * TILE_SIZE < TILE_SIZE ?
+			l->width - tx * TILE_SIZE : TILE_SIZE,
+			l->height - ty * TILE_SIZE < TILE_SIZE ?
+			l->height - ty * TILE_SIZE : TILE_SIZE);
+	cairo_clip(cr);
+	cairo_scale(cr, 1 << shift, 1 << shift);
+	cairo_set_source_surface(cr, tile, (tx >> shift) * TILE_SIZE,
+				 (ty >> shift) * TILE_SIZE);
+	cairo_paint(cr);
+	cairo_restore(cr);
+
+	cairo_surface_destroy(tile);
+}
+
+static void
+image_draw(struct image *image, cairo_t *cr, int level,
+	   struct rectangle *allocation, struct rectangle *area)
+{
+	struct rectangle r;
+	int tx, ty, tx1, ty1, tx2, ty2;
+
+	if (level == 0) {
+		cairo_set_source_surface(cr, image->image, 0, 0);
+		cairo_paint(cr);
+		return;
+	}
+
+	image_visible_tiles(image, level, allocation, &tx1, &ty1, &tx2, &ty2);
+	for (ty = ty1; ty < ty2; ty++) {
+		for (tx = tx1; tx < tx2; tx++) {
+			image_tile_rectangle(image, level, tx, ty,
+					     allocation, &r);
+			if (r.x >= area->x + area->width ||
+			    r.y >= area->y + area->height ||
+			    r.x + r.width <= area->x ||
+			    r.y + r.height <= area->y)
+				continue;
+			image_draw_tile(image, cr, level, tx, ty);
+		}
+	}
+}
+
+static void
+refine_task_run(struct task *task, uint32_t events)
+{
+	struct image *image = container_of(task, struct image, refine_task);
+
+	image->refine_pending = false;
+	widget_schedule_partial_redraw(image->widget);
+}
+
 static void
 redraw_handler(struct widget *widget, void *data)
 {
 	struct image *image = data;
-	struct rectangle allocation;
+	struct rectangle allocation, area, stale;
 	cairo_t *cr;
 	cairo_surface_t *surface;
 	double width, height, doc_aspect, window_aspect, scale;
 	cairo_matrix_t matrix;
 	cairo_matrix_t translate;
+	int level;
 
-	surface = window_get_surface(image->window);
-	cr = cairo_create(surface);
 	widget_get_allocation(image->widget, &allocation);
-	cairo_rectangle(cr, allocation.x, allocation.y,
-			allocation.width, allocation.height);
-	cairo_clip(cr);
-	cairo_push_group(cr);
-	cairo_translate(cr, allocation.x, allocation.y);
-
-	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-	cairo_set_source_rgba(cr, 0, 0, 0, 1);
-	cairo_paint(cr);
 
 	if (!image->initialized) {
 		image->initialized = true;
@@ -144,20 +513,54 @@ redraw_handler(struct widget *widget, void *data)
 		clamp_view(image);
 	}
 
+	level = image_pick_level(image);
+	image->tiles_made = 0;
+
+	/* A partial redraw only fills in the tiles made now, and what is
+	 * stale on this buffer. */
+	if (widget_redraw_is_partial(widget)) {
+		area.width = 0;
+		area.height = 0;
+		image_make_tiles(image, level, &allocation, &area);
+		widget_get_stale_area(widget, &stale);
+		rectangle_union(&area, &stale);
+		if (area.width <= 0 || area.height <= 0)
+			goto out;
+		widget_add_damage(widget, area.x, area.y,
+				  area.width, area.height);
+	} else {
+		area = allocation;
+		image_make_tiles(image, level, &allocation, NULL);
+	}
+
+	surface = window_get_surface(image->window);
+	cr = cairo_create(surface);
+	cairo_rectangle(cr, allocation.x, allocation.y,
+			allocation.width, allocation.height);
+	cairo_clip(cr);
+	cairo_rectangle(cr, area.x, area.y, area.width, area.height);
+	cairo_clip(cr);
+
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_rgba(cr, 0, 0, 0, 1);
+	cairo_paint(cr);
+
 	matrix = image->matrix;
 	cairo_matrix_init_translate(&translate, allocation.x, allocation.y);
 	cairo_matrix_multiply(&matrix, &matrix, &translate);
 	cairo_set_matrix(cr, &matrix);
 
-	cairo_set_source_surface(cr, image->image, 0, 0);
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-	cairo_paint(cr);
+	image_draw(image, cr, level, &allocation, &area);
 
-	cairo_pop_group_to_source(cr);
-	cairo_paint(cr);
 	cairo_destroy(cr);
-
 	cairo_surface_destroy(surface);
+
+out:
+	if (image->missing && !image->refine_pending) {
+		image->refine_pending = true;
+		display_defer(image->display, &image->refine_task);
+	}
 }
 
 static void
@@ -345,6 +748,10 @@ close_handler(struct window *window, void *data)
 	if (*image->image_counter == 0)
 		display_exit(image->display);
 
+	if (image->refine_pending)
+		wl_list_remove(&image->refine_task.link);
+	image_fini_levels(image);
+
 	widget_destroy(image->widget);
 	window_destroy(image->window);
 
@@ -377,6 +784,18 @@ image_create(struct display *display, const char *filename,
 		return NULL;
 	}
 
+	image->width = cairo_image_surface_get_width(image->image);
+	image->height = cairo_image_surface_get_height(image->image);
+	wl_list_init(&image->tile_list);
+	image->refine_task.run = refine_task_run;
+	if (image_init_levels(image) < 0) {
+		fprintf(stderr, "out of memory for the tiles of %s\n", b);
+		image_fini_levels(image);
+		cairo_surface_destroy(image->image);
+		free(image);
+		return NULL;
+	}
+
 	image->window = window_create(display);
 	image->widget = frame_create(image->window, image);
 	window_set_title(image->window, title);
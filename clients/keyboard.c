@@ -48,6 +48,7 @@ struct virtual_keyboard {
 	char *surrounding_text;
 	struct window *window;
 	struct widget *widget;
+	const struct layout *layout;	/* the panel is sized for */
 };
 
 enum key_type {
@@ -189,6 +190,18 @@ struct keyboard {
 	struct widget *widget;
 
 	enum keyboard_state state;
+
+	int pressed;			/* key held down, or -1 */
+	struct rectangle dirty;		/* keys to draw again */
+
+	/* All keys drawn up and down, from which a redraw copies only
+	 * the keys that changed.  Drawn again when the labels change. */
+	struct {
+		cairo_surface_t *up, *down;
+		const struct layout *layout;
+		enum keyboard_state state;
+		uint32_t preedit_style;
+	} cache;
 };
 
 static const char *
@@ -255,33 +268,47 @@ get_current_layout(struct virtual_keyboard *keyboard)
 }
 
 static void
-redraw_handler(struct widget *widget, void *data)
+key_get_rectangle(const struct layout *layout, int index,
+		  struct rectangle *r)
+{
+	unsigned int row = 0, col = 0;
+	int i;
+
+	for (i = 0; i < index; ++i) {
+		col += layout->keys[i].width;
+		if (col >= layout->columns) {
+			row += 1;
+			col = 0;
+		}
+	}
+
+	r->x = col * key_width;
+	r->y = row * key_height;
+	r->width = layout->keys[index].width * key_width;
+	r->height = key_height;
+}
+
+static cairo_surface_t *
+draw_keys(struct keyboard *keyboard, const struct layout *layout, int down)
 {
-	struct keyboard *keyboard = data;
 	cairo_surface_t *surface;
-	struct rectangle allocation;
 	cairo_t *cr;
 	unsigned int i;
 	unsigned int row = 0, col = 0;
-	const struct layout *layout;
-
-	layout = get_current_layout(keyboard->keyboard);
-
-	surface = window_get_surface(keyboard->window);
-	widget_get_allocation(keyboard->widget, &allocation);
 
+	surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+					     layout->columns * key_width,
+					     layout->rows * key_height);
 	cr = cairo_create(surface);
-	cairo_rectangle(cr, allocation.x, allocation.y, allocation.width, allocation.height);
-	cairo_clip(cr);
 
 	cairo_select_font_face(cr, "sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
 	cairo_set_font_size(cr, 16);
 
-	cairo_translate(cr, allocation.x, allocation.y);
-
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-	cairo_set_source_rgba(cr, 1, 1, 1, 0.75);
-	cairo_rectangle(cr, 0, 0, layout->columns * key_width, layout->rows * key_height);
+	if (down)
+		cairo_set_source_rgba(cr, 0.6, 0.6, 0.6, 0.9);
+	else
+		cairo_set_source_rgba(cr, 1, 1, 1, 0.75);
 	cairo_paint(cr);
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
@@ -297,7 +324,102 @@ redraw_handler(struct widget *widget, void *data)
 	}
 
 	cairo_destroy(cr);
+
+	return surface;
+}
+
+/* Returns 0 if the cached keys had to be drawn again. */
+static int
+keyboard_update_cache(struct keyboard *keyboard, const struct layout *layout)
+{
+	if (keyboard->cache.up &&
+	    keyboard->cache.layout == layout &&
+	    keyboard->cache.state == keyboard->state &&
+	    keyboard->cache.preedit_style ==
+	    keyboard->keyboard->preedit_style)
+		return 1;
+
+	if (keyboard->cache.up) {
+		cairo_surface_destroy(keyboard->cache.up);
+		cairo_surface_destroy(keyboard->cache.down);
+	}
+
+	keyboard->cache.up = draw_keys(keyboard, layout, 0);
+	keyboard->cache.down = draw_keys(keyboard, layout, 1);
+	keyboard->cache.layout = layout;
+	keyboard->cache.state = keyboard->state;
+	keyboard->cache.preedit_style = keyboard->keyboard->preedit_style;
+
+	return 0;
+}
+
+static void
+paint_keys(cairo_t *cr, cairo_surface_t *keys, const struct rectangle *r)
+{
+	cairo_set_source_surface(cr, keys, 0, 0);
+	cairo_rectangle(cr, r->x, r->y, r->width, r->height);
+	cairo_fill(cr);
+}
+
+static void
+redraw_handler(struct widget *widget, void *data)
+{
+	struct keyboard *keyboard = data;
+	cairo_surface_t *surface;
+	struct rectangle allocation, area, stale, key;
+	cairo_t *cr;
+	const struct layout *layout;
+
+	layout = get_current_layout(keyboard->keyboard);
+	if (keyboard->pressed >= (int) layout->count)
+		keyboard->pressed = -1;
+
+	surface = window_get_surface(keyboard->window);
+	widget_get_allocation(keyboard->widget, &allocation);
+
+	area.x = 0;
+	area.y = 0;
+	area.width = layout->columns * key_width;
+	area.height = layout->rows * key_height;
+
+	/* A partial redraw copies the keys that went up or down since
+	 * the last one and what is stale on this buffer, and damages only
+	 * those. */
+	if (keyboard_update_cache(keyboard, layout) &&
+	    widget_redraw_is_partial(widget)) {
+		widget_get_stale_area(widget, &stale);
+		stale.x -= allocation.x;
+		stale.y -= allocation.y;
+		rectangle_union(&keyboard->dirty, &stale);
+		area = keyboard->dirty;
+		if (area.width <= 0 || area.height <= 0)
+			goto out;
+	}
+	widget_add_damage(widget, allocation.x + area.x,
+			  allocation.y + area.y, area.width, area.height);
+
+	cr = cairo_create(surface);
+	cairo_rectangle(cr, allocation.x, allocation.y, allocation.width, allocation.height);
+	cairo_clip(cr);
+	cairo_translate(cr, allocation.x, allocation.y);
+	cairo_rectangle(cr, 0, 0,
+			layout->columns * key_width, layout->rows * key_height);
+	cairo_clip(cr);
+	cairo_rectangle(cr, area.x, area.y, area.width, area.height);
+	cairo_clip(cr);
+
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	paint_keys(cr, keyboard->cache.up, &area);
+	if (keyboard->pressed >= 0) {
+		key_get_rectangle(layout, keyboard->pressed, &key);
+		paint_keys(cr, keyboard->cache.down, &key);
+	}
+
+	cairo_destroy(cr);
+out:
 	cairo_surface_destroy(surface);
+	keyboard->dirty.width = 0;
+	keyboard->dirty.height = 0;
 }
 
 static void
@@ -460,7 +582,7 @@ button_handler(struct widget *widget,
 	       enum wl_pointer_button_state state, void *data)
 {
 	struct keyboard *keyboard = data;
-	struct rectangle allocation;
+	struct rectangle allocation, key;
 	int32_t x, y;
 	int row, col;
 	unsigned int i;
@@ -488,7 +610,20 @@ button_handler(struct widget *widget,
 		}
 	}
 
-	widget_schedule_redraw(widget);
+	/* Only the keys going up or down are drawn again, unless the
+	 * labels changed, which redraw_handler() notices. */
+	if (keyboard->pressed >= 0) {
+		key_get_rectangle(layout, keyboard->pressed, &key);
+		rectangle_union(&keyboard->dirty, &key);
+		keyboard->pressed = -1;
+	}
+	if (i < layout->count && state == WL_POINTER_BUTTON_STATE_PRESSED) {
+		keyboard->pressed = i;
+		key_get_rectangle(layout, i, &key);
+		rectangle_union(&keyboard->dirty, &key);
+	}
+
+	widget_schedule_partial_redraw(widget);
 }
 
 static void
@@ -566,6 +701,12 @@ input_method_context_commit(void *data,
 	if (keyboard->surrounding_text)
 		fprintf(stderr, "Surrounding text updated: %s\n", keyboard->surrounding_text);
 
+	/* Commits come with every change of the text, the panel only
+	 * changes with the content purpose. */
+	if (layout == keyboard->layout)
+		return;
+
+	keyboard->layout = layout;
 	window_schedule_resize(keyboard->window,
 			       layout->columns * key_width,
 			       layout->rows * key_height);
@@ -573,12 +714,46 @@ input_method_context_commit(void *data,
 	widget_schedule_redraw(keyboard->widget);
 }
 
+static void
+input_method_context_surrounding_text_update(void *data,
+					     struct input_method_context *context,
+					     uint32_t index,
+					     uint32_t length,
+					     const char *text,
+					     uint32_t cursor,
+					     uint32_t anchor)
+{
+	struct virtual_keyboard *keyboard = data;
+	char *old = keyboard->surrounding_text, *new;
+	size_t old_len, text_len;
+
+	if (!old)
+		return;
+
+	old_len = strlen(old);
+	if (index > old_len || length > old_len - index)
+		return;
+
+	text_len = strlen(text);
+	new = malloc(old_len - length + text_len + 1);
+	if (!new)
+		return;
+
+	memcpy(new, old, index);
+	memcpy(new + index, text, text_len);
+	strcpy(new + index + text_len, old + index + length);
+
+	free(old);
+	keyboard->surrounding_text = new;
+}
+
 static const struct input_method_context_listener input_method_context_listener = {
 	input_method_context_surrounding_text,
 	input_method_context_reset,
 	input_method_context_content_type,
 	input_method_context_invoke_action,
-	input_method_context_commit
+	input_method_context_commit,
+	input_method_context_surrounding_text_update
 };
 
 static void
@@ -644,7 +819,7 @@ global_handler(struct display *display, uint32_t name,
 	} else if (!strcmp(interface, "input_method")) {
 		keyboard->input_method =
 			display_bind(display, name,
-				     &input_method_interface, 1);
+				     &input_method_interface, 2);
 		input_method_add_listener(keyboard->input_method, &input_method_listener, keyboard);
 	}
 }
@@ -662,6 +837,7 @@ keyboard_create(struct output *output, struct virtual_keyboard *virtual_keyboard
 	memset(keyboard, 0, sizeof *keyboard);
 
 	keyboard->keyboard = virtual_keyboard;
+	keyboard->pressed = -1;
 	keyboard->window = window_create_custom(virtual_keyboard->display);
 	keyboard->widget = window_add_widget(keyboard->window, keyboard);
 	virtual_keyboard->window = keyboard->window;
@@ -677,6 +853,7 @@ keyboard_create(struct output *output, struct virtual_keyboard *virtual_keyboard
 	window_schedule_resize(keyboard->window,
 			       layout->columns * key_width,
 			       layout->rows * key_height);
+	virtual_keyboard->layout = layout;
 
 
 	ips = input_panel_get_input_panel_surface(virtual_keyboard->input_panel,
@@ -36,6 +36,13 @@
 
 #include <GLES2/gl2.h>
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#ifndef EGL_EXT_swap_buffers_with_damage
+#define EGL_EXT_swap_buffers_with_damage 1
+typedef EGLBoolean (EGLAPIENTRYP PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC)
+	(EGLDisplay dpy, EGLSurface surface, EGLint *rects, EGLint n_rects);
+#endif
 
 struct window;
 struct seat;
@@ -56,6 +63,8 @@ struct display {
 		EGLDisplay dpy;
 		EGLContext ctx;
 		EGLConfig conf;
+		int has_buffer_age;
+		PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC swap_buffers_with_damage;
 	} egl;
 	struct window *window;
 };
@@ -64,6 +73,14 @@ struct geometry {
 	int width, height;
 };
 
+/* x, y, width, height from the bottom left, as EGL and GL want them */
+struct box {
+	EGLint r[4];
+};
+
+/* frames of triangle positions kept for EGL_EXT_buffer_age */
+#define BOX_HISTORY 4
+
 struct window {
 	struct display *display;
 	struct geometry geometry, window_size;
@@ -79,6 +96,11 @@ struct window {
 	EGLSurface egl_surface;
 	struct wl_callback *callback;
 	int fullscreen, configured, opaque;
+
+	/* where the triangle was in the last frames, newest first */
+	struct box box[BOX_HISTORY];
+	int box_count;
+	struct geometry box_size;
 };
 
 static const char *vert_shader_text =
@@ -120,6 +142,7 @@ init_egl(struct display *display, int opaque)
 
 	EGLint major, minor, n;
 	EGLBoolean ret;
+	const char *extensions;
 
 	if (opaque)
 		config_attribs[9] = 0;
@@ -141,6 +164,13 @@ init_egl(struct display *display, int opaque)
 					    EGL_NO_CONTEXT, context_attribs);
 	assert(display->egl.ctx);
 
+	extensions = eglQueryString(display->egl.dpy, EGL_EXTENSIONS);
+	if (extensions && strstr(extensions, "EGL_EXT_buffer_age"))
+		display->egl.has_buffer_age = 1;
+	if (extensions &&
+	    strstr(extensions, "EGL_EXT_swap_buffers_with_damage"))
+		display->egl.swap_buffers_with_damage = (void *)
+			eglGetProcAddress("eglSwapBuffersWithDamageEXT");
 }
 
 static void
@@ -341,10 +371,47 @@ destroy_surface(struct window *window)
 
 static const struct wl_callback_listener frame_listener;
 
+static void
+box_union(struct box *b, const struct box *c)
+{
+	EGLint x1, y1;
+
+	x1 = b->r[0] + b->r[2];
+	y1 = b->r[1] + b->r[3];
+	if (c->r[0] + c->r[2] > x1)
+		x1 = c->r[0] + c->r[2];
+	if (c->r[1] + c->r[3] > y1)
+		y1 = c->r[1] + c->r[3];
+	if (c->r[0] < b->r[0])
+		b->r[0] = c->r[0];
+	if (c->r[1] < b->r[1])
+		b->r[1] = c->r[1];
+	b->r[2] = x1 - b->r[0];
+	b->r[3] = y1 - b->r[1];
+}
+
+/*
+ * The triangle spins around the y axis, so it always fits in the
+ * middle half of the window vertically, and horizontally shrinks with
+ * the cosine of the angle.  A pixel of margin covers the rounding.
+ */
+static void
+triangle_box(struct window *window, GLfloat angle, struct box *b)
+{
+	int w = window->geometry.width, h = window->geometry.height;
+	int half = w * fabs(cos(angle)) / 4 + 1;
+
+	b->r[0] = w / 2 - half;
+	b->r[1] = h / 4 - 1;
+	b->r[2] = 2 * half;
+	b->r[3] = h / 2 + 2;
+}
+
 static void
 redraw(void *data, struct wl_callback *callback, uint32_t time)
 {
 	struct window *window = data;
+	struct display *display = window->display;
 	static const GLfloat verts[3][2] = {
 		{ -0.5, -0.5 },
 		{  0.5, -0.5 },
@@ -365,6 +432,9 @@ redraw(void *data, struct wl_callback *callback, uint32_t time)
 	static const int32_t speed_div = 5;
 	static uint32_t start_time = 0;
 	struct wl_region *region;
+	struct box box, redraw, damage;
+	EGLint age = 0;
+	int i;
 
 	assert(window->callback == callback);
 	window->callback = NULL;
@@ -389,6 +459,41 @@ redraw(void *data, struct wl_callback *callback, uint32_t time)
 	glUniformMatrix4fv(window->gl.rotation_uniform, 1, GL_FALSE,
 			   (GLfloat *) rotation);
 
+	if (window->box_size.width != window->geometry.width ||
+	    window->box_size.height != window->geometry.height) {
+		window->box_size = window->geometry;
+		window->box_count = 0;
+	}
+
+	/* The buffer has the frame from age frames ago: everything the
+	 * triangle covered since then needs drawing, and what it covered
+	 * in this frame and the last one is the damage. */
+	triangle_box(window, angle, &box);
+	if (display->egl.has_buffer_age &&
+	    !eglQuerySurface(display->egl.dpy, window->egl_surface,
+			     EGL_BUFFER_AGE_EXT, &age))
+		age = 0;
+
+	redraw = box;
+	if (age > 0 && age <= window->box_count) {
+		for (i = 0; i < age; i++)
+			box_union(&redraw, &window->box[i]);
+		glEnable(GL_SCISSOR_TEST);
+		glScissor(redraw.r[0], redraw.r[1], redraw.r[2], redraw.r[3]);
+	}
+
+	damage = box;
+	if (window->box_count > 0)
+		box_union(&damage, &window->box[0]);
+	else
+		damage.r[2] = 0;
+
+	for (i = BOX_HISTORY - 1; i > 0; i--)
+		window->box[i] = window->box[i - 1];
+	window->box[0] = box;
+	if (window->box_count < BOX_HISTORY)
+		window->box_count++;
+
 	glClearColor(0.0, 0.0, 0.0, 0.5);
 	glClear(GL_COLOR_BUFFER_BIT);
 
@@ -401,6 +506,7 @@ redraw(void *data, struct wl_callback *callback, uint32_t time)
 
 	glDisableVertexAttribArray(window->gl.pos);
 	glDisableVertexAttribArray(window->gl.col);
+	glDisable(GL_SCISSOR_TEST);
 
 	if (window->opaque || window->fullscreen) {
 		region = wl_compositor_create_region(window->display->compositor);
@@ -416,7 +522,12 @@ redraw(void *data, struct wl_callback *callback, uint32_t time)
 	window->callback = wl_surface_frame(window->surface);
 	wl_callback_add_listener(window->callback, &frame_listener, window);
 
-	eglSwapBuffers(window->display->egl.dpy, window->egl_surface);
+	if (display->egl.swap_buffers_with_damage && damage.r[2] > 0)
+		display->egl.swap_buffers_with_damage(display->egl.dpy,
+						      window->egl_surface,
+						      damage.r, 1);
+	else
+		eglSwapBuffers(display->egl.dpy, window->egl_surface);
 }
 
 static const struct wl_callback_listener frame_listener = {
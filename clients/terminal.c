@@ -31,13 +31,16 @@
 #include <time.h>
 #include <pty.h>
 #include <ctype.h>
+#include <errno.h>
 #include <cairo.h>
+#include <pixman.h>
 #include <sys/epoll.h>
 
 #include <wayland-client.h>
 
 #include "../shared/config-parser.h"
 #include "window.h"
+#include "ascii-scan.h"
 
 static int option_fullscreen;
 static char *option_font = "mono";
@@ -67,6 +70,7 @@ terminal_run(struct terminal *terminal, const char *path);
 /* Buffer sizes */
 #define MAX_RESPONSE		256
 #define MAX_ESCAPE		255
+#define TERMINAL_READ_BUDGET	(256 * 1024)
 
 /* Terminal modes */
 #define MODE_SHOW_CURSOR	0x00000001
@@ -418,6 +422,23 @@ struct terminal {
 	int selection_start_row, selection_start_col;
 	int selection_end_row, selection_end_col;
 	struct wl_list link;
+
+	/* what is on the screen, so redraw_handler() only draws the
+	 * cells that changed since */
+	struct drawn_cell *drawn;
+	struct row_span *dirty;
+	int drawn_valid;
+	int drawn_cursor_row, drawn_cursor_column;
+
+	/* atlas slot of each cell in this redraw, -1 to go through
+	 * cairo_show_glyphs() */
+	struct glyph_atlas *atlas;
+	int *atlas_slot;
+
+	/* rows scrolled up between margins since the last redraw,
+	 * scroll_mixed if the margins changed in between */
+	int scroll_top, scroll_bottom;
+	int scroll_pending, scroll_mixed;
 };
 
 /* Create default tab stops, every 8 characters */
@@ -515,6 +536,40 @@ union decoded_attr {
 	uint32_t key;
 };
 
+struct drawn_cell {
+	union utf8_char c;
+	union decoded_attr attr;
+};
+
+/* the columns start to end - 1 of a row need drawing */
+struct row_span {
+	int start, end;
+};
+
+/* Cells rendered once, background and all, and copied from there.
+ * The entries hash (character, decoded attribute) to a slot of the
+ * atlas; when the slots run out it starts over. */
+#define ATLAS_COLUMNS		32
+#define ATLAS_ROWS		32
+#define ATLAS_SLOTS		(ATLAS_COLUMNS * ATLAS_ROWS)
+#define ATLAS_HASH_SIZE		(2 * ATLAS_SLOTS)
+
+struct atlas_entry {
+	union utf8_char c;
+	uint32_t key;
+	int slot;	/* -1 while empty */
+	int fits;	/* the ink stays inside the cell */
+};
+
+struct glyph_atlas {
+	int cell_width, cell_height;
+	cairo_surface_t *surface;
+	pixman_image_t *image;
+	int count;
+	uint32_t generation;	/* bumped when it starts over */
+	struct atlas_entry table[ATLAS_HASH_SIZE];
+};
+
 static void
 terminal_decode_attr(struct terminal *terminal, int row, int col,
 		     union decoded_attr *decoded)
@@ -643,6 +698,15 @@ terminal_scroll_window(struct terminal *terminal, int d)
 static void
 terminal_scroll(struct terminal *terminal, int d)
 {
+	if (terminal->scroll_pending == 0) {
+		terminal->scroll_top = terminal->margin_top;
+		terminal->scroll_bottom = terminal->margin_bottom;
+	} else if (terminal->scroll_top != terminal->margin_top ||
+		   terminal->scroll_bottom != terminal->margin_bottom) {
+		terminal->scroll_mixed = 1;
+	}
+	terminal->scroll_pending += d;
+
 	if(terminal->margin_top == 0 && terminal->margin_bottom == terminal->height - 1)
 		terminal_scroll_buffer(terminal, d);
 	else
@@ -743,6 +807,17 @@ terminal_resize_cells(struct terminal *terminal, int width, int height)
 	terminal->tab_ruler = tab_ruler;
 	terminal_init_tabs(terminal);
 
+	free(terminal->drawn);
+	free(terminal->dirty);
+	free(terminal->atlas_slot);
+	terminal->drawn = malloc(width * height * sizeof *terminal->drawn);
+	terminal->dirty = malloc(height * sizeof *terminal->dirty);
+	terminal->atlas_slot =
+		malloc(width * height * sizeof *terminal->atlas_slot);
+	terminal->drawn_valid = 0;
+	terminal->scroll_pending = 0;
+	terminal->scroll_mixed = 0;
+
 	/* Update the window size */
 	ws.ws_row = terminal->height;
 	ws.ws_col = terminal->width;
@@ -914,15 +989,459 @@ glyph_run_add(struct glyph_run *run, int x, int y, union utf8_char *c)
 	run->count += num_glyphs;
 }
 
+static struct glyph_atlas *
+glyph_atlas_create(struct terminal *terminal)
+{
+	struct glyph_atlas *atlas;
+	int i;
+
+	atlas = malloc(sizeof *atlas);
+	if (atlas == NULL)
+		return NULL;
+
+	atlas->cell_width = terminal->extents.max_x_advance;
+	atlas->cell_height = terminal->extents.height;
+	atlas->surface =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+					   ATLAS_COLUMNS * atlas->cell_width,
+					   ATLAS_ROWS * atlas->cell_height);
+	if (cairo_surface_status(atlas->surface) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(atlas->surface);
+		free(atlas);
+		return NULL;
+	}
+
+	atlas->image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+		cairo_image_surface_get_width(atlas->surface),
+		cairo_image_surface_get_height(atlas->surface),
+		(uint32_t *) cairo_image_surface_get_data(atlas->surface),
+		cairo_image_surface_get_stride(atlas->surface));
+
+	atlas->count = 0;
+	atlas->generation = 0;
+	for (i = 0; i < ATLAS_HASH_SIZE; i++)
+		atlas->table[i].slot = -1;
+
+	return atlas;
+}
+
+/* Draws a cell the way redraw_handler() would, at the slot. */
+static int
+glyph_atlas_render(struct terminal *terminal, struct glyph_atlas *atlas,
+		   int slot, union utf8_char c, union decoded_attr attr)
+{
+	cairo_glyph_t glyphs[8], *g = glyphs;
+	int i, x, y, fits, num_glyphs = ARRAY_LENGTH(glyphs);
+	cairo_scaled_font_t *font;
+	cairo_text_extents_t ink;
+	cairo_t *cr;
+
+	if (attr.attr.a & (ATTRMASK_BOLD | ATTRMASK_BLINK))
+		font = terminal->font_bold;
+	else
+		font = terminal->font_normal;
+
+	if (cairo_scaled_font_text_to_glyphs(font, 0,
+					     terminal->extents.ascent,
+					     (char *) c.byte, 4,
+					     &g, &num_glyphs,
+					     NULL, NULL, NULL) !=
+	    CAIRO_STATUS_SUCCESS)
+		return 0;
+
+	/* anything reaching into the neighbours is left to cairo */
+	cairo_scaled_font_glyph_extents(font, g, num_glyphs, &ink);
+	fits = (ink.width == 0 && ink.height == 0) ||
+		(ink.x_bearing >= 0 && ink.y_bearing >= 0 &&
+		 ink.x_bearing + ink.width <= atlas->cell_width &&
+		 ink.y_bearing + ink.height <= atlas->cell_height);
+	if (!(attr.attr.a & ATTRMASK_CONCEALED) &&
+	    (attr.attr.a & ATTRMASK_UNDERLINE) &&
+	    terminal->extents.ascent + 2 > atlas->cell_height)
+		fits = 0;
+	if (!fits)
+		goto out;
+
+	x = (slot % ATLAS_COLUMNS) * atlas->cell_width;
+	y = (slot / ATLAS_COLUMNS) * atlas->cell_height;
+	for (i = 0; i < num_glyphs; i++) {
+		g[i].x += x;
+		g[i].y += y;
+	}
+
+	cr = cairo_create(atlas->surface);
+	cairo_rectangle(cr, x, y, atlas->cell_width, atlas->cell_height);
+	cairo_clip(cr);
+
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	terminal_set_color(terminal, cr, attr.attr.bg);
+	cairo_paint(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+
+	terminal_set_color(terminal, cr, attr.attr.fg);
+	if (attr.attr.a & ATTRMASK_UNDERLINE) {
+		cairo_set_line_width(cr, 1.0);
+		cairo_move_to(cr, x, y + terminal->extents.ascent + 1.5);
+		cairo_line_to(cr, x + atlas->cell_width,
+			      y + terminal->extents.ascent + 1.5);
+		cairo_stroke(cr);
+	}
+	if (!(attr.attr.a & ATTRMASK_CONCEALED)) {
+		cairo_set_scaled_font(cr, font);
+		cairo_show_glyphs(cr, g, num_glyphs);
+	}
+	cairo_destroy(cr);
+	cairo_surface_flush(atlas->surface);
+
+ out:
+	if (g != glyphs)
+		cairo_glyph_free(g);
+
+	return fits;
+}
+
+/* The slot holding the cell, or -1 if it can't come from the atlas. */
+static int
+glyph_atlas_lookup(struct terminal *terminal, struct glyph_atlas *atlas,
+		   union utf8_char c, union decoded_attr attr)
+{
+	struct atlas_entry *entry;
+	uint32_t hash;
+	int i;
+
+	hash = (c.ch * 0x9e3779b1) ^ (attr.key * 0x85ebca6b);
+	hash ^= hash >> 15;
+	for (i = 0; i < ATLAS_HASH_SIZE; i++) {
+		entry = &atlas->table[(hash + i) & (ATLAS_HASH_SIZE - 1)];
+		if (entry->slot < 0)
+			break;
+		if (entry->c.ch == c.ch && entry->key == attr.key)
+			return entry->fits ? entry->slot : -1;
+	}
+
+	if (atlas->count == ATLAS_SLOTS) {
+		for (i = 0; i < ATLAS_HASH_SIZE; i++)
+			atlas->table[i].slot = -1;
+		atlas->count = 0;
+		atlas->generation++;
+		entry = &atlas->table[hash & (ATLAS_HASH_SIZE - 1)];
+	}
+
+	entry->c = c;
+	entry->key = attr.key;
+	entry->slot = atlas->count++;
+	entry->fits = glyph_atlas_render(terminal, atlas, entry->slot,
+					 c, attr);
+
+	return entry->fits ? entry->slot : -1;
+}
+
+/*
+ * Looks up the cells to draw and the neighbours drawn with them in the
+ * atlas.  A cell next to one whose glyph overhangs it has to be drawn
+ * by cairo, in order.  Returns 0 if the atlas can't be used at all.
+ */
+static int
+terminal_atlas_prepare(struct terminal *terminal, cairo_surface_t *surface,
+		       struct rectangle *allocation,
+		       int side_margin, int top_margin)
+{
+	struct glyph_atlas *atlas = terminal->atlas;
+	union decoded_attr attr;
+	union utf8_char *p_row;
+	int row, col, start, end, *slot, pass;
+	uint32_t generation;
+
+	/* the EGL path has cairo-gl's glyph cache */
+	if (cairo_surface_get_type(surface) != CAIRO_SURFACE_TYPE_IMAGE ||
+	    terminal->extents.max_x_advance !=
+	    (int) terminal->extents.max_x_advance ||
+	    terminal->extents.height != (int) terminal->extents.height ||
+	    side_margin < 0 || top_margin < 0 ||
+	    allocation->x + allocation->width >
+	    cairo_image_surface_get_width(surface) ||
+	    allocation->y + allocation->height >
+	    cairo_image_surface_get_height(surface))
+		return 0;
+
+	if (atlas == NULL) {
+		atlas = glyph_atlas_create(terminal);
+		if (atlas == NULL)
+			return 0;
+		terminal->atlas = atlas;
+	}
+
+	/* starting over reuses the slots looked up before, so look
+	 * them up again in the fresh atlas; a second time this redraw
+	 * has more cells than the atlas */
+	for (pass = 0; pass < 2; pass++) {
+		generation = atlas->generation;
+		for (row = 0; row < terminal->height; row++) {
+			start = terminal->dirty[row].start;
+			end = terminal->dirty[row].end;
+			if (start >= end)
+				continue;
+			if (start > 0)
+				start--;
+			if (end < terminal->width)
+				end++;
+
+			p_row = terminal_get_row(terminal, row);
+			slot = &terminal->atlas_slot[row * terminal->width];
+			for (col = start; col < end; col++) {
+				terminal_decode_attr(terminal, row, col,
+						     &attr);
+				slot[col] = glyph_atlas_lookup(terminal, atlas,
+							       p_row[col],
+							       attr);
+			}
+		}
+
+		if (atlas->generation == generation)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int
+terminal_cell_from_atlas(struct terminal *terminal, int row, int col)
+{
+	int *slot = &terminal->atlas_slot[row * terminal->width];
+
+	if (slot[col] < 0 ||
+	    (col > 0 && slot[col - 1] < 0) ||
+	    (col < terminal->width - 1 && slot[col + 1] < 0))
+		return 0;
+
+	/* the outline cursor goes on top */
+	if (row == terminal->row && col == terminal->column &&
+	    (terminal->mode & MODE_SHOW_CURSOR) &&
+	    !window_has_focus(terminal->window))
+		return 0;
+
+	return 1;
+}
+
+/* Copies the dirty cells that come from the atlas into the surface,
+ * x, y being the top left corner of the cells. */
+static void
+terminal_atlas_blit(struct terminal *terminal, cairo_surface_t *surface,
+		    int x, int y)
+{
+	struct glyph_atlas *atlas = terminal->atlas;
+	pixman_image_t *image;
+	int row, col, slot, w, h;
+
+	w = atlas->cell_width;
+	h = atlas->cell_height;
+
+	cairo_surface_flush(surface);
+	image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+		cairo_image_surface_get_width(surface),
+		cairo_image_surface_get_height(surface),
+		(uint32_t *) cairo_image_surface_get_data(surface),
+		cairo_image_surface_get_stride(surface));
+
+	for (row = 0; row < terminal->height; row++) {
+		for (col = terminal->dirty[row].start;
+		     col < terminal->dirty[row].end; col++) {
+			if (!terminal_cell_from_atlas(terminal, row, col))
+				continue;
+			slot = terminal->atlas_slot[row * terminal->width + col];
+			pixman_image_composite32(PIXMAN_OP_SRC,
+						 atlas->image, NULL, image,
+						 (slot % ATLAS_COLUMNS) * w,
+						 (slot / ATLAS_COLUMNS) * h,
+						 0, 0,
+						 x + col * w, y + row * h,
+						 w, h);
+		}
+	}
+
+	pixman_image_unref(image);
+	cairo_surface_mark_dirty(surface);
+}
+
+
+static void
+terminal_dirty_cell(struct terminal *terminal, int row, int col)
+{
+	struct row_span *span;
+
+	if (row < 0 || row >= terminal->height ||
+	    col < 0 || col >= terminal->width)
+		return;
+
+	span = &terminal->dirty[row];
+	if (span->start > col)
+		span->start = col;
+	if (span->end < col + 1)
+		span->end = col + 1;
+}
+
+/*
+ * Compares the cells with what was drawn last time and leaves the
+ * columns to draw again in terminal->dirty.  Returns the number of rows
+ * with anything to draw.
+ */
+static int
+terminal_update_dirty(struct terminal *terminal, int partial)
+{
+	struct drawn_cell *drawn;
+	union utf8_char *p_row;
+	union decoded_attr attr;
+	int row, col, count;
+
+	for (row = 0; row < terminal->height; row++) {
+		p_row = terminal_get_row(terminal, row);
+		drawn = &terminal->drawn[row * terminal->width];
+		terminal->dirty[row].start = terminal->width;
+		terminal->dirty[row].end = 0;
+		for (col = 0; col < terminal->width; col++) {
+			terminal_decode_attr(terminal, row, col, &attr);
+			if (partial && drawn[col].c.ch == p_row[col].ch &&
+			    drawn[col].attr.key == attr.key)
+				continue;
+
+			drawn[col].c = p_row[col];
+			drawn[col].attr = attr;
+			terminal_dirty_cell(terminal, row, col);
+		}
+	}
+
+	/* the outline cursor of an unfocused terminal isn't in the
+	 * attributes */
+	if (partial) {
+		terminal_dirty_cell(terminal, terminal->drawn_cursor_row,
+				    terminal->drawn_cursor_column);
+		terminal_dirty_cell(terminal, terminal->row, terminal->column);
+	}
+	terminal->drawn_cursor_row = terminal->row;
+	terminal->drawn_cursor_column = terminal->column;
+	terminal->drawn_valid = 1;
+
+	count = 0;
+	for (row = 0; row < terminal->height; row++)
+		if (terminal->dirty[row].start < terminal->dirty[row].end)
+			count++;
+
+	return count;
+}
+
+/*
+ * Moves the pixels of the rows scrolled since the last redraw in the
+ * buffer, which still has the last frame, and the record of what was
+ * drawn along with them.  Only the rows scrolled in are then left to
+ * draw.  x, y is the top left corner of the cells on the surface.
+ */
+static void
+terminal_blit_scroll(struct terminal *terminal, cairo_surface_t *surface,
+		     int x, int y)
+{
+	int top, rows, d, h, width, stride, i, lines;
+	struct drawn_cell *drawn;
+	unsigned char *data, *src, *dst;
+
+	top = terminal->scroll_top;
+	rows = terminal->scroll_bottom - top + 1;
+	d = terminal->scroll_pending;
+	h = terminal->extents.height;
+	terminal->scroll_pending = 0;
+
+	if (terminal->scroll_mixed || d == 0 || abs(d) >= rows) {
+		terminal->scroll_mixed = 0;
+		return;
+	}
+
+	/* whole pixel rows only */
+	if (h != terminal->extents.height ||
+	    cairo_surface_get_type(surface) != CAIRO_SURFACE_TYPE_IMAGE)
+		return;
+
+	width = ceil(terminal->width * terminal->extents.max_x_advance);
+	if (x + width > cairo_image_surface_get_width(surface))
+		width = cairo_image_surface_get_width(surface) - x;
+	if (y < 0 || x < 0 || width <= 0 ||
+	    y + (top + rows) * h > cairo_image_surface_get_height(surface))
+		return;
+
+	cairo_surface_flush(surface);
+	data = cairo_image_surface_get_data(surface);
+	stride = cairo_image_surface_get_stride(surface);
+	lines = (rows - abs(d)) * h;
+	if (d > 0) {
+		dst = data + (y + top * h) * stride + x * 4;
+		src = dst + d * h * stride;
+		for (i = 0; i < lines; i++)
+			memcpy(dst + i * stride, src + i * stride, width * 4);
+	} else {
+		src = data + (y + top * h) * stride + x * 4;
+		dst = src - d * h * stride;
+		for (i = lines - 1; i >= 0; i--)
+			memcpy(dst + i * stride, src + i * stride, width * 4);
+	}
+	cairo_surface_mark_dirty(surface);
+	widget_add_damage(terminal->widget, x, y + top * h, width, rows * h);
+
+	/* key ~0 is no decoded attribute, the rows scrolled in get drawn */
+	drawn = &terminal->drawn[top * terminal->width];
+	if (d > 0) {
+		memmove(drawn, drawn + d * terminal->width,
+			(rows - d) * terminal->width * sizeof *drawn);
+		drawn += (rows - d) * terminal->width;
+	} else {
+		memmove(drawn - d * terminal->width, drawn,
+			(rows + d) * terminal->width * sizeof *drawn);
+	}
+	for (i = 0; i < abs(d) * terminal->width; i++)
+		drawn[i].attr.key = ~0;
+
+	if (terminal->drawn_cursor_row >= top &&
+	    terminal->drawn_cursor_row < top + rows)
+		terminal->drawn_cursor_row -= d;
+}
+
+/* Forgets what was drawn in the cells in area, so they get drawn
+ * again.  x, y is the top left corner of the cells on the surface. */
+static void
+terminal_invalidate_area(struct terminal *terminal, struct rectangle *area,
+			 int x, int y)
+{
+	int row, col, row0, row1, col0, col1;
+
+	if (area->width <= 0 || area->height <= 0)
+		return;
+
+	col0 = floor((area->x - x) / terminal->extents.max_x_advance);
+	col1 = ceil((area->x + area->width - x) /
+		    terminal->extents.max_x_advance);
+	row0 = floor((area->y - y) / terminal->extents.height);
+	row1 = ceil((area->y + area->height - y) / terminal->extents.height);
+	if (col0 < 0)
+		col0 = 0;
+	if (col1 > terminal->width)
+		col1 = terminal->width;
+	if (row0 < 0)
+		row0 = 0;
+	if (row1 > terminal->height)
+		row1 = terminal->height;
+
+	for (row = row0; row < row1; row++)
+		for (col = col0; col < col1; col++)
+			terminal->drawn[row * terminal->width + col].attr.key =
+				~0;
+}
 
 static void
 redraw_handler(struct widget *widget, void *data)
 {
 	struct terminal *terminal = data;
-	struct rectangle allocation;
+	struct rectangle allocation, stale;
 	cairo_t *cr;
 	int top_margin, side_margin;
 	int row, col, cursor_x, cursor_y;
+	int start, end, partial, x, y, width, atlas, *slot;
 	union utf8_char *p_row;
 	union decoded_attr attr;
 	int text_x, text_y;
@@ -933,10 +1452,51 @@ redraw_handler(struct widget *widget, void *data)
 
 	surface = window_get_surface(terminal->window);
 	widget_get_allocation(terminal->widget, &allocation);
+
+	extents = terminal->extents;
+	side_margin = (allocation.width - terminal->width * extents.max_x_advance) / 2;
+	top_margin = (allocation.height - terminal->height * extents.height) / 2;
+
+	partial = widget_redraw_is_partial(widget) && terminal->drawn_valid;
+	if (partial) {
+		terminal_blit_scroll(terminal, surface,
+				     allocation.x + side_margin,
+				     allocation.y + top_margin);
+		widget_get_stale_area(widget, &stale);
+		terminal_invalidate_area(terminal, &stale,
+					 allocation.x + side_margin,
+					 allocation.y + top_margin);
+	}
+	terminal->scroll_pending = 0;
+	terminal->scroll_mixed = 0;
+	if (terminal_update_dirty(terminal, partial) == 0)
+		goto out;
+
+	atlas = terminal_atlas_prepare(terminal, surface, &allocation,
+				       side_margin, top_margin);
+
 	cr = cairo_create(surface);
 	cairo_rectangle(cr, allocation.x, allocation.y,
 			allocation.width, allocation.height);
 	cairo_clip(cr);
+
+	if (partial) {
+		for (row = 0; row < terminal->height; row++) {
+			start = terminal->dirty[row].start;
+			end = terminal->dirty[row].end;
+			if (start >= end)
+				continue;
+
+			x = allocation.x + side_margin +
+				start * extents.max_x_advance;
+			y = allocation.y + top_margin + row * extents.height;
+			width = (end - start) * extents.max_x_advance;
+			cairo_rectangle(cr, x, y, width, extents.height);
+			widget_add_damage(widget, x, y, width, extents.height);
+		}
+		cairo_clip(cr);
+	}
+
 	cairo_push_group(cr);
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
@@ -945,16 +1505,17 @@ redraw_handler(struct widget *widget, void *data)
 
 	cairo_set_scaled_font(cr, terminal->font_normal);
 
-	extents = terminal->extents;
-	side_margin = (allocation.width - terminal->width * extents.max_x_advance) / 2;
-	top_margin = (allocation.height - terminal->height * extents.height) / 2;
-
 	cairo_set_line_width(cr, 1.0);
 	cairo_translate(cr, allocation.x + side_margin,
 			allocation.y + top_margin);
 	/* paint the background */
 	for (row = 0; row < terminal->height; row++) {
-		for (col = 0; col < terminal->width; col++) {
+		start = terminal->dirty[row].start;
+		end = terminal->dirty[row].end;
+		for (col = start; col < end; col++) {
+			if (atlas && terminal_cell_from_atlas(terminal, row, col))
+				continue;
+
 			/* get the attributes for this character cell */
 			terminal_decode_attr(terminal, row, col, &attr);
 
@@ -974,11 +1535,33 @@ redraw_handler(struct widget *widget, void *data)
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 
-	/* paint the foreground */
+	/* paint the foreground, with the glyphs next to what changed
+	 * as those may reach into it */
 	glyph_run_init(&run, terminal, cr);
 	for (row = 0; row < terminal->height; row++) {
+		start = terminal->dirty[row].start;
+		end = terminal->dirty[row].end;
+		if (start >= end)
+			continue;
+		if (start > 0)
+			start--;
+		if (end < terminal->width)
+			end++;
+
 		p_row = terminal_get_row(terminal, row);
-		for (col = 0; col < terminal->width; col++) {
+		slot = &terminal->atlas_slot[row * terminal->width];
+		for (col = start; col < end; col++) {
+			/* the atlas has the cells it draws, neighbours only
+			 * matter if they overhang */
+			if (atlas && (col < terminal->dirty[row].start ||
+				      col >= terminal->dirty[row].end)) {
+				if (slot[col] >= 0)
+					continue;
+			} else if (atlas &&
+				   terminal_cell_from_atlas(terminal, row, col)) {
+				continue;
+			}
+
 			/* get the attributes for this character cell */
 			terminal_decode_attr(terminal, row, col, &attr);
 
@@ -1018,6 +1601,12 @@ redraw_handler(struct widget *widget, void *data)
 	cairo_pop_group_to_source(cr);
 	cairo_paint(cr);
 	cairo_destroy(cr);
+
+	if (atlas)
+		terminal_atlas_blit(terminal, surface,
+				    allocation.x + side_margin,
+				    allocation.y + top_margin);
+ out:
 	cairo_surface_destroy(surface);
 
 	if (terminal->send_cursor_position) {
@@ -1862,6 +2451,48 @@ handle_char(struct terminal *terminal, union utf8_char utf8)
 		terminal->last_char = utf8;
 }
 
+/* A run of printable ASCII with no escape in progress, written as
+ * handle_char would, a row at a time. */
+static void
+handle_ascii_run(struct terminal *terminal, const char *data, size_t length)
+{
+	union utf8_char *row, utf8;
+	struct attr *attr_row;
+	size_t i, n;
+
+	while (length > 0) {
+		if (terminal->column >= terminal->width) {
+			/* the right margin is handle_char's business */
+			utf8.ch = 0;
+			utf8.byte[0] = *data;
+			handle_char(terminal, utf8);
+			data++;
+			length--;
+			continue;
+		}
+
+		n = terminal->width - terminal->column;
+		if (n > length)
+			n = length;
+
+		row = terminal_get_row(terminal, terminal->row) +
+			terminal->column;
+		attr_row = terminal_get_attr_row(terminal, terminal->row) +
+			terminal->column;
+		for (i = 0; i < n; i++) {
+			utf8.ch = 0;
+			utf8.byte[0] = data[i];
+			row[i] = utf8;
+		}
+		attr_init(attr_row, terminal->curr_attr, n);
+
+		terminal->last_char = row[n - 1];
+		terminal->column += n;
+		data += n;
+		length -= n;
+	}
+}
+
 static void
 escape_append_utf8(struct terminal *terminal, union utf8_char utf8)
 {
@@ -1888,8 +2519,26 @@ terminal_data(struct terminal *terminal, const char *data, size_t length)
 	unsigned int i;
 	union utf8_char utf8;
 	enum utf8_state parser_state;
+	size_t run;
 
 	for (i = 0; i < length; i++) {
+		/* Plain text goes around the state machines, unless the
+		 * character set or insert mode need it to go one by one. */
+		if (terminal->state == escape_state_normal &&
+		    (terminal->state_machine.state == utf8state_start ||
+		     terminal->state_machine.state == utf8state_accept ||
+		     terminal->state_machine.state == utf8state_reject) &&
+		    terminal->cs[0].match.byte[0] == 0 &&
+		    !(terminal->mode & MODE_IRM)) {
+			run = ascii_printable_run(data + i, length - i);
+			if (run > 0) {
+				handle_ascii_run(terminal, data + i, run);
+				i += run;
+				if (i == length)
+					break;
+			}
+		}
+
 		parser_state =
 			utf8_next_char(&terminal->state_machine, data[i]);
 		switch(parser_state) {
@@ -2028,8 +2677,6 @@ terminal_data(struct terminal *terminal, const char *data, size_t length)
 			handle_char(terminal, utf8);
 		} /* if */
 	} /* for */
-
-	window_schedule_redraw(terminal->window);
 }
 
 static void
@@ -2595,6 +3242,14 @@ terminal_destroy(struct terminal *terminal)
 	if (wl_list_empty(&terminal_list))
 		display_exit(terminal->display);
 
+	if (terminal->atlas) {
+		pixman_image_unref(terminal->atlas->image);
+		cairo_surface_destroy(terminal->atlas->surface);
+		free(terminal->atlas);
+	}
+	free(terminal->atlas_slot);
+	free(terminal->drawn);
+	free(terminal->dirty);
 	free(terminal);
 }
 
@@ -2603,19 +3258,42 @@ io_handler(struct task *task, uint32_t events)
 {
 	struct terminal *terminal =
 		container_of(task, struct terminal, io_task);
-	char buffer[256];
-	int len;
+	char buffer[4096];
+	size_t total = 0;
+	ssize_t len;
 
 	if (events & EPOLLHUP) {
 		terminal_destroy(terminal);
 		return;
 	}
 
-	len = read(terminal->master, buffer, sizeof buffer);
-	if (len < 0)
-		terminal_destroy(terminal);
-	else
+	/* Parse everything the pty has for us and draw once; the redraw
+	 * waits for the frame callback, so output arriving faster than
+	 * the display refreshes only costs parsing.  The bounds keep a
+	 * flood from starving input and frame events, the rest is read
+	 * on the next wakeup.  At least one read is done, so a slow
+	 * iteration can't starve the pty either. */
+	while (total == 0 ||
+	       (total < TERMINAL_READ_BUDGET &&
+		!display_task_budget_expired(terminal->display))) {
+		len = read(terminal->master, buffer, sizeof buffer);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			break;
+		if (len < 0) {
+			terminal_destroy(terminal);
+			return;
+		}
+		if (len == 0)
+			break;
+
 		terminal_data(terminal, buffer, len);
+		total += len;
+	}
+
+	if (total > 0)
+		widget_schedule_partial_redraw(terminal->widget);
 }
 
 static int
@@ -2640,8 +3318,9 @@ terminal_run(struct terminal *terminal, const char *path)
 	terminal->master = master;
 	fcntl(master, F_SETFL, O_NONBLOCK);
 	terminal->io_task.run = io_handler;
-	display_watch_fd(terminal->display, terminal->master,
-			 EPOLLIN | EPOLLHUP, &terminal->io_task);
+	display_watch_fd_priority(terminal->display, terminal->master,
+				  EPOLLIN | EPOLLHUP, &terminal->io_task,
+				  TASK_PRIORITY_LOW);
 
 	window_set_fullscreen(terminal->window, option_fullscreen);
 	if (!window_is_fullscreen(terminal->window))
@@ -0,0 +1,235 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+
+#include "perf-counters-client-protocol.h"
+
+/* Prints the perf_counters of each output every interval seconds,
+ * the frame rate from the difference to the previous sample.  Needs
+ * perf-counters.so loaded in the compositor, which only lets the copy
+ * it launches from its debug binding bind the counters. */
+
+struct output {
+	struct wl_list link;
+	struct wl_output *output;
+	char *model;
+	uint32_t frames;
+	int sampled;
+};
+
+struct perf {
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct perf_counters *counters;
+	uint32_t counters_version;
+	struct wl_list output_list;
+	int interval;
+	int once;
+	int clients;
+};
+
+static void
+output_handle_geometry(void *data, struct wl_output *wl_output,
+		       int32_t x, int32_t y,
+		       int32_t physical_width, int32_t physical_height,
+		       int32_t subpixel,
+		       const char *make, const char *model,
+		       int32_t output_transform)
+{
+	struct output *output = data;
+
+	free(output->model);
+	output->model = strdup(model);
+}
+
+static void
+output_handle_mode(void *data, struct wl_output *wl_output,
+		   uint32_t flags, int32_t width, int32_t height,
+		   int32_t refresh)
+{
+}
+
+static const struct wl_output_listener output_listener = {
+	output_handle_geometry,
+	output_handle_mode
+};
+
+static void
+counters_handle_counters(void *data, struct perf_counters *counters,
+			 struct wl_output *wl_output,
+			 uint32_t frames, uint32_t frames_idle,
+			 uint32_t frames_missed,
+			 uint32_t repaint_avg, uint32_t repaint_p99,
+			 uint32_t primary, uint32_t cursor,
+			 uint32_t scanout, uint32_t overlay,
+			 uint32_t upload_kib,
+			 uint32_t input_latency_avg,
+			 uint32_t input_latency_max,
+			 uint32_t slab_allocs, uint32_t slab_live)
+{
+	struct perf *perf = data;
+	struct output *output = wl_output_get_user_data(wl_output);
+	double fps = 0.0;
+
+	if (output->sampled)
+		fps = (double) (frames - output->frames) / perf->interval;
+	output->frames = frames;
+	output->sampled = 1;
+
+	printf("%-12.12s %6.1f %8u %8u %6u %6u %5u %4u %4u %4u %9u %6u %6u "
+	       "%9u %6u\n",
+	       output->model ? output->model : "?", fps, frames,
+	       frames_idle, frames_missed, repaint_avg, repaint_p99,
+	       primary, cursor, scanout, overlay, upload_kib,
+	       input_latency_avg, input_latency_max, slab_allocs, slab_live);
+}
+
+static void
+counters_handle_client(void *data, struct perf_counters *counters,
+		       uint32_t pid, uint32_t requests, uint32_t throttled)
+{
+	printf("client %-6u %9u requests %9u throttled\n",
+	       pid, requests, throttled);
+}
+
+static const struct perf_counters_listener counters_listener = {
+	counters_handle_counters,
+	counters_handle_client
+};
+
+static void
+registry_handle_global(void *data, struct wl_registry *registry,
+		       uint32_t name, const char *interface,
+		       uint32_t version)
+{
+	struct perf *perf = data;
+	struct output *output;
+
+	if (strcmp(interface, "wl_output") == 0) {
+		output = calloc(1, sizeof *output);
+		if (!output)
+			return;
+		output->output = wl_registry_bind(registry, name,
+						  &wl_output_interface, 1);
+		wl_output_add_listener(output->output,
+				       &output_listener, output);
+		wl_list_insert(perf->output_list.prev, &output->link);
+	} else if (strcmp(interface, "perf_counters") == 0) {
+		perf->counters_version = version < 2 ? version : 2;
+		perf->counters = wl_registry_bind(registry, name,
+						  &perf_counters_interface,
+						  perf->counters_version);
+		perf_counters_add_listener(perf->counters,
+					   &counters_listener, perf);
+	}
+}
+
+static const struct wl_registry_listener registry_listener = {
+	registry_handle_global
+};
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-1] [-c] [-i seconds]\n"
+		"  -1          print one sample and exit\n"
+		"  -c          also print the request counts of clients\n"
+		"  -i seconds  interval between samples, default 1\n",
+		name);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct perf perf;
+	struct output *output;
+	int opt;
+
+	memset(&perf, 0, sizeof perf);
+	perf.interval = 1;
+
+	while ((opt = getopt(argc, argv, "1ci:")) != -1) {
+		switch (opt) {
+		case '1':
+			perf.once = 1;
+			break;
+		case 'c':
+			perf.clients = 1;
+			break;
+		case 'i':
+			perf.interval = atoi(optarg);
+			if (perf.interval <= 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	perf.display = wl_display_connect(NULL);
+	if (!perf.display) {
+		fprintf(stderr, "failed to create display: %m\n");
+		return EXIT_FAILURE;
+	}
+
+	wl_list_init(&perf.output_list);
+	perf.registry = wl_display_get_registry(perf.display);
+	wl_registry_add_listener(perf.registry, &registry_listener, &perf);
+	wl_display_roundtrip(perf.display);
+	wl_display_roundtrip(perf.display);
+
+	if (!perf.counters) {
+		fprintf(stderr, "perf_counters not available, load "
+			"perf-counters.so into weston and start it with "
+			"the debug binding P\n");
+		return EXIT_FAILURE;
+	}
+
+	for (;;) {
+		printf("%-12s %6s %8s %8s %6s %6s %5s %4s %4s %4s %9s %6s %6s "
+		       "%9s %6s\n",
+		       "OUTPUT", "FPS", "FRAMES", "IDLE", "MISSED", "AVG",
+		       "P99", "PRIM", "CURS", "SCAN", "OVL", "UPLOAD_KB",
+		       "INPUT", "IN_MAX", "ALLOCS", "LIVE");
+		wl_list_for_each(output, &perf.output_list, link)
+			perf_counters_sample(perf.counters, output->output);
+		if (perf.clients && perf.counters_version >= 2)
+			perf_counters_sample_clients(perf.counters);
+		if (wl_display_roundtrip(perf.display) < 0)
+			return EXIT_FAILURE;
+		fflush(stdout);
+
+		if (perf.once)
+			break;
+		sleep(perf.interval);
+		printf("\n");
+	}
+
+	return EXIT_SUCCESS;
+}
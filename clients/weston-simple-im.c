@@ -146,12 +146,26 @@ input_method_context_commit(void *data,
 {
 }
 
+static void
+input_method_context_surrounding_text_update(void *data,
+					     struct input_method_context *context,
+					     uint32_t index,
+					     uint32_t length,
+					     const char *text,
+					     uint32_t cursor,
+					     uint32_t anchor)
+{
+	fprintf(stderr, "Surrounding text changed at %u: %u bytes by %s\n",
+		index, length, text);
+}
+
 static const struct input_method_context_listener input_method_context_listener = {
 	input_method_context_surrounding_text,
 	input_method_context_reset,
 	input_method_context_content_type,
 	input_method_context_invoke_action,
-	input_method_context_commit
+	input_method_context_commit,
+	input_method_context_surrounding_text_update
 };
 
 static void
@@ -297,6 +311,10 @@ input_method_activate(void *data,
 	wl_keyboard_add_listener(keyboard->keyboard,
 				 &input_method_keyboard_listener,
 				 keyboard);
+
+	/* Keys outside compose sequences are passed on unchanged, so the
+	 * compositor can send those straight to the application. */
+	input_method_context_set_compose_only(context);
 }
 
 static void
@@ -327,7 +345,7 @@ registry_handle_global(void *data, struct wl_registry *registry,
 	if (!strcmp(interface, "input_method")) {
 		keyboard->input_method =
 			wl_registry_bind(registry, name,
-					 &input_method_interface, 1);
+					 &input_method_interface, 2);
 		input_method_add_listener(keyboard->input_method,
 					  &input_method_listener, keyboard);
 	}
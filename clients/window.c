@@ -53,6 +53,12 @@
 #include <EGL/eglext.h>
 
 #include <cairo-gl.h>
+
+#ifndef EGL_EXT_swap_buffers_with_damage
+#define EGL_EXT_swap_buffers_with_damage 1
+typedef EGLBoolean (EGLAPIENTRYP PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC)
+	(EGLDisplay dpy, EGLSurface surface, EGLint *rects, EGLint n_rects);
+#endif
 #else /* HAVE_CAIRO_EGL */
 typedef void *EGLDisplay;
 typedef void *EGLConfig;
@@ -94,6 +100,10 @@ struct display {
 	EGLConfig argb_config;
 	EGLContext argb_ctx;
 	cairo_device_t *argb_device;
+#ifdef HAVE_CAIRO_EGL
+	int has_egl_buffer_age;
+	PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC swap_buffers_with_damage;
+#endif
 	uint32_t serial;
 
 	int display_fd;
@@ -102,6 +112,7 @@ struct display {
 
 	int epoll_fd;
 	struct wl_list deferred_list;
+	uint32_t dispatch_start;
 
 	int running;
 
@@ -160,11 +171,21 @@ struct toysurface {
 
 	/*
 	 * Post the surface to the server, returning the server allocation
-	 * rectangle. The Cairo surface from prepare() must be destroyed
-	 * after calling this.
+	 * rectangle. damage is what changed since the last swap, NULL
+	 * for everything. The Cairo surface from prepare() must be
+	 * destroyed after calling this.
 	 */
 	void (*swap)(struct toysurface *base,
-		     struct rectangle *server_allocation);
+		     struct rectangle *server_allocation,
+		     struct rectangle *damage);
+
+	/*
+	 * Whether the surface from the last prepare(), called with
+	 * SURFACE_HINT_PRESERVE, still has what was on it at the last
+	 * swap(), except for stale.  That is what changed in the swaps
+	 * since this buffer was last drawn, and has to be drawn again.
+	 */
+	int (*preserved)(struct toysurface *base, struct rectangle *stale);
 
 	/*
 	 * Make the toysurface current with the given EGL context.
@@ -202,6 +223,12 @@ struct surface {
 	enum wl_output_transform buffer_transform;
 
 	cairo_surface_t *cairo_surface;
+
+	/* see widget_schedule_partial_redraw() */
+	int redraw_full;
+	int partial;
+	struct rectangle damage;
+	struct rectangle stale;
 };
 
 struct window {
@@ -378,13 +405,30 @@ struct tooltip {
 	float x, y;
 };
 
+/*
+ * A pool maps its whole reserve up front, so growing it only takes
+ * an ftruncate() and a wl_shm_pool.resize and the memory the buffers
+ * already live in stays put.  Buffers are carved out of the free
+ * ranges and give them back when they are destroyed.
+ */
 struct shm_pool {
 	struct wl_shm_pool *pool;
+	int fd;
 	size_t size;
-	size_t used;
+	size_t reserve;
 	void *data;
+	int refcount;
+	struct wl_list free_list;	/* struct shm_range, by offset */
+};
+
+struct shm_range {
+	struct wl_list link;
+	size_t offset, size;
 };
 
+#define SHM_POOL_ALIGN		64
+#define SHM_POOL_RESERVE	(sizeof(void *) > 4 ? 256 << 20 : 32 << 20)
+
 enum {
 	CURSOR_DEFAULT = 100,
 	CURSOR_UNSET
@@ -408,8 +452,38 @@ enum window_location {
 
 static const cairo_user_data_key_t shm_surface_data_key;
 
+void
+rectangle_union(struct rectangle *r, const struct rectangle *s)
+{
+	int32_t x2, y2;
+
+	if (s->width <= 0 || s->height <= 0)
+		return;
+
+	if (r->width <= 0 || r->height <= 0) {
+		*r = *s;
+		return;
+	}
+
+	x2 = r->x + r->width;
+	if (x2 < s->x + s->width)
+		x2 = s->x + s->width;
+	y2 = r->y + r->height;
+	if (y2 < s->y + s->height)
+		y2 = s->y + s->height;
+	if (r->x > s->x)
+		r->x = s->x;
+	if (r->y > s->y)
+		r->y = s->y;
+	r->width = x2 - r->x;
+	r->height = y2 - r->y;
+}
+
 #ifdef HAVE_CAIRO_EGL
 
+/* swaps remembered for EGL_EXT_buffer_age */
+#define EGL_DAMAGE_HISTORY 4
+
 struct egl_window_surface {
 	struct toysurface base;
 	cairo_surface_t *cairo_surface;
@@ -417,6 +491,12 @@ struct egl_window_surface {
 	struct wl_surface *surface;
 	struct wl_egl_window *egl_window;
 	EGLSurface egl_surface;
+
+	/* the damage of the last swaps, newest first, a width of -1 for
+	 * all of it */
+	struct rectangle damage[EGL_DAMAGE_HISTORY];
+	int width, height;
+	EGLint age;
 };
 
 static struct egl_window_surface *
@@ -430,25 +510,87 @@ egl_window_surface_prepare(struct toysurface *base, int dx, int dy,
 			   int width, int height, uint32_t flags)
 {
 	struct egl_window_surface *surface = to_egl_window_surface(base);
+	struct display *display = surface->display;
 
 	wl_egl_window_resize(surface->egl_window, width, height, dx, dy);
 	cairo_gl_surface_set_size(surface->cairo_surface, width, height);
 
+	/* a new size means new buffers */
+	surface->age = 0;
+	if ((flags & SURFACE_HINT_PRESERVE) && display->has_egl_buffer_age &&
+	    width == surface->width && height == surface->height &&
+	    base->acquire(base, NULL) == 0) {
+		if (!eglQuerySurface(display->dpy, surface->egl_surface,
+				     EGL_BUFFER_AGE_EXT, &surface->age))
+			surface->age = 0;
+		base->release(base);
+	}
+	surface->width = width;
+	surface->height = height;
+
 	return cairo_surface_reference(surface->cairo_surface);
 }
 
 static void
 egl_window_surface_swap(struct toysurface *base,
-			struct rectangle *server_allocation)
+			struct rectangle *server_allocation,
+			struct rectangle *damage)
 {
 	struct egl_window_surface *surface = to_egl_window_surface(base);
+	struct display *display = surface->display;
+	EGLint rect[4];
+	int i;
+
+	for (i = EGL_DAMAGE_HISTORY - 1; i > 0; i--)
+		surface->damage[i] = surface->damage[i - 1];
+	if (damage)
+		surface->damage[0] = *damage;
+	else
+		surface->damage[0].width = -1;
+
+	if (damage && display->swap_buffers_with_damage) {
+		/* the extension counts from the bottom */
+		rect[0] = damage->x;
+		rect[1] = surface->height - damage->y - damage->height;
+		rect[2] = damage->width;
+		rect[3] = damage->height;
+
+		cairo_surface_flush(surface->cairo_surface);
+		if (base->acquire(base, NULL) == 0) {
+			display->swap_buffers_with_damage(display->dpy,
+							  surface->egl_surface,
+							  rect, 1);
+			base->release(base);
+		}
+	} else {
+		cairo_gl_surface_swapbuffers(surface->cairo_surface);
+	}
 
-	cairo_gl_surface_swapbuffers(surface->cairo_surface);
 	wl_egl_window_get_attached_size(surface->egl_window,
 					&server_allocation->width,
 					&server_allocation->height);
 }
 
+static int
+egl_window_surface_preserved(struct toysurface *base,
+			     struct rectangle *stale)
+{
+	struct egl_window_surface *surface = to_egl_window_surface(base);
+	int i;
+
+	if (surface->age < 1 || surface->age > EGL_DAMAGE_HISTORY)
+		return 0;
+
+	/* the buffer has the frame from age swaps ago */
+	for (i = 0; i < surface->age - 1; i++) {
+		if (surface->damage[i].width < 0)
+			return 0;
+		rectangle_union(stale, &surface->damage[i]);
+	}
+
+	return 1;
+}
+
 static int
 egl_window_surface_acquire(struct toysurface *base, EGLContext ctx)
 {
@@ -523,12 +665,15 @@ egl_window_surface_create(struct display *display,
 
 	surface->base.prepare = egl_window_surface_prepare;
 	surface->base.swap = egl_window_surface_swap;
+	surface->base.preserved = egl_window_surface_preserved;
 	surface->base.acquire = egl_window_surface_acquire;
 	surface->base.release = egl_window_surface_release;
 	surface->base.destroy = egl_window_surface_destroy;
 
 	surface->display = display;
 	surface->surface = wl_surface;
+	surface->width = rectangle->width;
+	surface->height = rectangle->height;
 
 	surface->egl_window = wl_egl_window_create(surface->surface,
 						   rectangle->width,
@@ -564,6 +709,7 @@ egl_window_surface_create(struct display *display,
 struct shm_surface_data {
 	struct wl_buffer *buffer;
 	struct shm_pool *pool;
+	size_t offset, length;
 };
 
 struct wl_buffer *
@@ -578,7 +724,10 @@ display_get_buffer_for_surface(struct display *display,
 }
 
 static void
-shm_pool_destroy(struct shm_pool *pool);
+shm_pool_free(struct shm_pool *pool, size_t offset, size_t size);
+
+static void
+shm_pool_unref(struct shm_pool *pool);
 
 static void
 shm_surface_data_destroy(void *p)
@@ -586,85 +735,200 @@ shm_surface_data_destroy(void *p)
 	struct shm_surface_data *data = p;
 
 	wl_buffer_destroy(data->buffer);
-	if (data->pool)
-		shm_pool_destroy(data->pool);
+	shm_pool_free(data->pool, data->offset, data->length);
+	shm_pool_unref(data->pool);
 
 	free(data);
 }
 
-static struct wl_shm_pool *
-make_shm_pool(struct display *display, int size, void **data)
+static size_t
+shm_pool_align(size_t size)
 {
-	struct wl_shm_pool *pool;
-	int fd;
+	return (size + SHM_POOL_ALIGN - 1) & ~(size_t) (SHM_POOL_ALIGN - 1);
+}
+
+static struct shm_pool *
+shm_pool_create(struct display *display, size_t size, size_t reserve)
+{
+	struct shm_pool *pool;
+	struct shm_range *range;
 
-	fd = os_create_anonymous_file(size);
-	if (fd < 0) {
-		fprintf(stderr, "creating a buffer file for %d B failed: %m\n",
+	pool = malloc(sizeof *pool);
+	range = malloc(sizeof *range);
+	if (!pool || !range)
+		goto err_free;
+
+	size = shm_pool_align(size);
+	if (reserve < size)
+		reserve = size;
+
+	pool->fd = os_create_anonymous_file(size);
+	if (pool->fd < 0) {
+		fprintf(stderr, "creating a buffer file for %zu B failed: %m\n",
 			size);
-		return NULL;
+		goto err_free;
 	}
 
-	*data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (*data == MAP_FAILED) {
+	/* past the end of the file until the pool grows into it */
+	pool->data = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  pool->fd, 0);
+	if (pool->data == MAP_FAILED) {
 		fprintf(stderr, "mmap failed: %m\n");
-		close(fd);
-		return NULL;
+		goto err_close;
 	}
 
-	pool = wl_shm_create_pool(display->shm, fd, size);
+	pool->pool = wl_shm_create_pool(display->shm, pool->fd, size);
+	pool->size = size;
+	pool->reserve = reserve;
+	pool->refcount = 1;
 
-	close(fd);
+	wl_list_init(&pool->free_list);
+	range->offset = 0;
+	range->size = size;
+	wl_list_insert(&pool->free_list, &range->link);
 
 	return pool;
+
+err_close:
+	close(pool->fd);
+err_free:
+	free(range);
+	free(pool);
+	return NULL;
 }
 
-static struct shm_pool *
-shm_pool_create(struct display *display, size_t size)
+/* Grows the pool by at least size bytes, all of it free. */
+static int
+shm_pool_grow(struct shm_pool *pool, size_t size)
 {
-	struct shm_pool *pool = malloc(sizeof *pool);
+	struct shm_range *range;
+	size_t new_size;
 
-	if (!pool)
-		return NULL;
+	new_size = pool->size + size;
+	if (new_size > pool->reserve || new_size > INT32_MAX)
+		return -1;
 
-	pool->pool = make_shm_pool(display, size, &pool->data);
-	if (!pool->pool) {
-		free(pool);
-		return NULL;
-	}
+	if (ftruncate(pool->fd, new_size) < 0)
+		return -1;
+	wl_shm_pool_resize(pool->pool, new_size);
 
-	pool->size = size;
-	pool->used = 0;
+	range = container_of(pool->free_list.prev, struct shm_range, link);
+	if (!wl_list_empty(&pool->free_list) &&
+	    range->offset + range->size == pool->size) {
+		range->size += new_size - pool->size;
+	} else {
+		range = malloc(sizeof *range);
+		if (!range)
+			return -1;
+		range->offset = pool->size;
+		range->size = new_size - pool->size;
+		wl_list_insert(pool->free_list.prev, &range->link);
+	}
+	pool->size = new_size;
 
-	return pool;
+	return 0;
 }
 
+/*
+ * First fit from the free ranges, growing the pool when none is big
+ * enough.  With slack, the pool grows by twice what it lacks, so a
+ * window being resized doesn't resize the pool on every frame.
+ */
 static void *
-shm_pool_allocate(struct shm_pool *pool, size_t size, int *offset)
+shm_pool_allocate(struct shm_pool *pool, size_t size, int slack,
+		  int *offset)
 {
-	if (pool->used + size > pool->size)
+	struct shm_range *range, *last;
+	size_t grow;
+
+	size = shm_pool_align(size);
+
+	wl_list_for_each(range, &pool->free_list, link)
+		if (range->size >= size)
+			goto found;
+
+	grow = size;
+	if (!wl_list_empty(&pool->free_list)) {
+		last = container_of(pool->free_list.prev,
+				    struct shm_range, link);
+		if (last->offset + last->size == pool->size)
+			grow -= last->size;
+	}
+	if ((!slack || shm_pool_grow(pool, 2 * grow) < 0) &&
+	    shm_pool_grow(pool, grow) < 0)
 		return NULL;
 
-	*offset = pool->used;
-	pool->used += size;
+	range = container_of(pool->free_list.prev, struct shm_range, link);
+
+found:
+	*offset = range->offset;
+	range->offset += size;
+	range->size -= size;
+	if (range->size == 0) {
+		wl_list_remove(&range->link);
+		free(range);
+	}
+	pool->refcount++;
 
 	return (char *) pool->data + *offset;
 }
 
-/* destroy the pool. this does not unmap the memory though */
 static void
-shm_pool_destroy(struct shm_pool *pool)
+shm_pool_free(struct shm_pool *pool, size_t offset, size_t size)
 {
-	munmap(pool->data, pool->size);
-	wl_shm_pool_destroy(pool->pool);
-	free(pool);
+	struct shm_range *range, *next, *prev;
+	size_t start, end;
+
+	size = shm_pool_align(size);
+
+	wl_list_for_each(next, &pool->free_list, link)
+		if (next->offset > offset)
+			break;
+	prev = container_of(next->link.prev, struct shm_range, link);
+
+	if (&prev->link != &pool->free_list &&
+	    prev->offset + prev->size == offset) {
+		range = prev;
+		range->size += size;
+	} else {
+		range = malloc(sizeof *range);
+		if (!range)
+			return;	/* leaked until the pool goes */
+		range->offset = offset;
+		range->size = size;
+		wl_list_insert(&prev->link, &range->link);
+	}
+
+	if (&next->link != &pool->free_list &&
+	    range->offset + range->size == next->offset) {
+		range->size += next->size;
+		wl_list_remove(&next->link);
+		free(next);
+	}
+
+	/* the pool can't shrink, but the pages in the middle of what
+	 * is free don't need to take up memory */
+	start = (offset + 4095) & ~(size_t) 4095;
+	end = (offset + size) & ~(size_t) 4095;
+	if (end > start)
+		fallocate(pool->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  start, end - start);
 }
 
-/* Start allocating from the beginning of the pool again */
 static void
-shm_pool_reset(struct shm_pool *pool)
+shm_pool_unref(struct shm_pool *pool)
 {
-	pool->used = 0;
+	struct shm_range *range, *next;
+
+	if (--pool->refcount > 0)
+		return;
+
+	wl_list_for_each_safe(range, next, &pool->free_list, link)
+		free(range);
+	munmap(pool->data, pool->reserve);
+	wl_shm_pool_destroy(pool->pool);
+	close(pool->fd);
+	free(pool);
 }
 
 static int
@@ -695,14 +959,18 @@ display_create_shm_surface_from_pool(struct display *display,
 	stride = cairo_format_stride_for_width (CAIRO_FORMAT_ARGB32,
 						rectangle->width);
 	length = stride * rectangle->height;
-	data->pool = NULL;
-	map = shm_pool_allocate(pool, length, &offset);
+	map = shm_pool_allocate(pool, length,
+				flags & SURFACE_HINT_RESIZE, &offset);
 
 	if (!map) {
 		free(data);
 		return NULL;
 	}
 
+	data->pool = pool;
+	data->offset = offset;
+	data->length = length;
+
 	surface = cairo_image_surface_create_for_data (map,
 						       CAIRO_FORMAT_ARGB32,
 						       rectangle->width,
@@ -725,50 +993,39 @@ display_create_shm_surface_from_pool(struct display *display,
 	return surface;
 }
 
+/* From pool if it has room, otherwise from a pool of its own. */
 static cairo_surface_t *
 display_create_shm_surface(struct display *display,
 			   struct rectangle *rectangle, uint32_t flags,
-			   struct shm_pool *alternate_pool,
+			   struct shm_pool *pool,
 			   struct shm_surface_data **data_ret)
 {
-	struct shm_surface_data *data;
-	struct shm_pool *pool;
-	cairo_surface_t *surface;
+	cairo_surface_t *surface = NULL;
 
-	if (alternate_pool) {
-		shm_pool_reset(alternate_pool);
+	if (pool)
 		surface = display_create_shm_surface_from_pool(display,
 							       rectangle,
-							       flags,
-							       alternate_pool);
-		if (surface) {
-			data = cairo_surface_get_user_data(surface,
-							   &shm_surface_data_key);
-			goto out;
-		}
-	}
-
-	pool = shm_pool_create(display,
-			       data_length_for_shm_surface(rectangle));
-	if (!pool)
-		return NULL;
-
-	surface =
-		display_create_shm_surface_from_pool(display, rectangle,
-						     flags, pool);
+							       flags, pool);
 
 	if (!surface) {
-		shm_pool_destroy(pool);
-		return NULL;
-	}
+		pool = shm_pool_create(display,
+				       data_length_for_shm_surface(rectangle),
+				       0);
+		if (!pool)
+			return NULL;
 
-	/* make sure we destroy the pool when the surface is destroyed */
-	data = cairo_surface_get_user_data(surface, &shm_surface_data_key);
-	data->pool = pool;
+		surface = display_create_shm_surface_from_pool(display,
+							       rectangle,
+							       flags, pool);
+		/* the surface keeps it */
+		shm_pool_unref(pool);
+		if (!surface)
+			return NULL;
+	}
 
-out:
 	if (data_ret)
-		*data_ret = data;
+		*data_ret = cairo_surface_get_user_data(surface,
+							&shm_surface_data_key);
 
 	return surface;
 }
@@ -803,10 +1060,15 @@ struct shm_surface_leaf {
 	/* 'data' is automatically destroyed, when 'cairo_surface' is */
 	struct shm_surface_data *data;
 
-	struct shm_pool *resize_pool;
 	int busy;
+
+	/* what was swapped from the other leaves since this one was */
+	struct rectangle stale;
 };
 
+/* one while the compositor releases early, more while it holds on */
+#define MAX_LEAVES 3
+
 static void
 shm_surface_leaf_release(struct shm_surface_leaf *leaf)
 {
@@ -814,9 +1076,6 @@ shm_surface_leaf_release(struct shm_surface_leaf *leaf)
 		cairo_surface_destroy(leaf->cairo_surface);
 	/* leaf->data already destroyed via cairo private */
 
-	if (leaf->resize_pool)
-		shm_pool_destroy(leaf->resize_pool);
-
 	memset(leaf, 0, sizeof *leaf);
 }
 
@@ -827,8 +1086,15 @@ struct shm_surface {
 	uint32_t flags;
 	int dx, dy;
 
-	struct shm_surface_leaf leaf[2];
+	/* the leaves' buffers come from here, see shm_pool_allocate() */
+	struct shm_pool *pool;
+
+	struct shm_surface_leaf leaf[MAX_LEAVES];
 	struct shm_surface_leaf *current;
+
+	/* the leaf swapped last, it has the latest contents */
+	struct shm_surface_leaf *last;
+	int preserved;
 };
 
 static struct shm_surface *
@@ -841,59 +1107,103 @@ static void
 shm_surface_buffer_release(void *data, struct wl_buffer *buffer)
 {
 	struct shm_surface *surface = data;
+	struct shm_surface_leaf *leaf;
+	int i, busy = 0;
 
-	if (surface->leaf[0].data->buffer == buffer)
-		surface->leaf[0].busy = 0;
-	else if (surface->leaf[1].data->buffer == buffer)
-		surface->leaf[1].busy = 0;
-	else
-		assert(0 && "shm_surface_buffer_release: unknown buffer");
+	for (i = 0; i < MAX_LEAVES; i++) {
+		leaf = &surface->leaf[i];
+		if (leaf->cairo_surface && leaf->data->buffer == buffer)
+			leaf->busy = 0;
+		busy |= leaf->busy;
+	}
 
-	if (!surface->leaf[0].busy && !surface->leaf[1].busy)
-		shm_surface_leaf_release(&surface->leaf[1]);
+	/* Once the compositor has let go of everything, the buffer with
+	 * the latest contents is all it takes to keep drawing, into the
+	 * same buffer as long as it keeps releasing them early. */
+	if (busy)
+		return;
+
+	for (i = 0; i < MAX_LEAVES; i++) {
+		leaf = &surface->leaf[i];
+		if (leaf != surface->last && leaf != surface->current &&
+		    leaf->cairo_surface)
+			shm_surface_leaf_release(leaf);
+	}
 }
 
 static const struct wl_buffer_listener shm_surface_buffer_listener = {
 	shm_surface_buffer_release
 };
 
+/* Brings leaf up to date by copying what changed from the last one. */
+static void
+shm_surface_leaf_repair(struct shm_surface_leaf *leaf,
+			struct shm_surface_leaf *last)
+{
+	cairo_t *cr;
+
+	if (leaf->stale.width <= 0 || leaf->stale.height <= 0)
+		return;
+
+	cr = cairo_create(leaf->cairo_surface);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(cr, last->cairo_surface, 0, 0);
+	cairo_rectangle(cr, leaf->stale.x, leaf->stale.y,
+			leaf->stale.width, leaf->stale.height);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+
+	leaf->stale.width = 0;
+	leaf->stale.height = 0;
+}
+
 static cairo_surface_t *
 shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		    int width, int height, uint32_t flags)
 {
-	int resize_hint = !!(flags & SURFACE_HINT_RESIZE);
 	struct shm_surface *surface = to_shm_surface(base);
 	struct rectangle rect = { 0, 0, width, height };
-	struct shm_surface_leaf *leaf;
+	struct shm_surface_leaf *leaf = NULL, *l;
+	int i, score, best = 0;
 
 	surface->dx = dx;
 	surface->dy = dy;
 
-	/* See shm_surface_buffer_release() */
-	if (!surface->leaf[0].busy && !surface->leaf[1].busy &&
-	    surface->leaf[1].cairo_surface) {
-		fprintf(stderr, "window.c:%s: TODO: release leaf[1]\n",
-			__func__);
+	/*
+	 * Pick a buffer the compositor isn't holding: the one swapped
+	 * last needs nothing copied, one of the right size only what
+	 * changed since it was used, and another one is reallocated.
+	 */
+	for (i = 0; i < MAX_LEAVES; i++) {
+		l = &surface->leaf[i];
+		if (l->busy)
+			continue;
+
+		if (l == surface->last)
+			score = 4;
+		else if (l->cairo_surface &&
+			 cairo_image_surface_get_width(l->cairo_surface) ==
+			 width &&
+			 cairo_image_surface_get_height(l->cairo_surface) ==
+			 height)
+			score = 3;
+		else if (!l->cairo_surface)
+			score = 2;
+		else
+			score = 1;
+
+		if (score > best) {
+			best = score;
+			leaf = l;
+		}
 	}
 
-	/* pick a free buffer from the two */
-	if (!surface->leaf[0].busy)
-		leaf = &surface->leaf[0];
-	else if (!surface->leaf[1].busy)
-		leaf = &surface->leaf[1];
-	else {
-		fprintf(stderr, "%s: both buffers are held by the server.\n",
+	if (!leaf) {
+		fprintf(stderr, "%s: all buffers are held by the server.\n",
 			__func__);
 		return NULL;
 	}
 
-	if (!resize_hint && leaf->resize_pool) {
-		cairo_surface_destroy(leaf->cairo_surface);
-		leaf->cairo_surface = NULL;
-		shm_pool_destroy(leaf->resize_pool);
-		leaf->resize_pool = NULL;
-	}
-
 	if (leaf->cairo_surface &&
 	    cairo_image_surface_get_width(leaf->cairo_surface) == width &&
 	    cairo_image_surface_get_height(leaf->cairo_surface) == height)
@@ -902,53 +1212,92 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 	if (leaf->cairo_surface)
 		cairo_surface_destroy(leaf->cairo_surface);
 
-	if (resize_hint && !leaf->resize_pool) {
-		/* Create a big pool to allocate from, while continuously
-		 * resizing. Mmapping a new pool in the server
-		 * is relatively expensive, so reusing a pool performs
-		 * better, but may temporarily reserve unneeded memory.
-		 */
-		/* We should probably base this number on the output size. */
-		leaf->resize_pool = shm_pool_create(surface->display,
-						    6 * 1024 * 1024);
-	}
+	if (!surface->pool)
+		surface->pool =
+			shm_pool_create(surface->display,
+					data_length_for_shm_surface(&rect),
+					SHM_POOL_RESERVE);
 
 	leaf->cairo_surface =
 		display_create_shm_surface(surface->display, &rect,
-					   surface->flags,
-					   leaf->resize_pool,
-					   &leaf->data);
+					   surface->flags |
+					   (flags & SURFACE_HINT_RESIZE),
+					   surface->pool, &leaf->data);
+	if (!leaf->cairo_surface)
+		return NULL;
 	wl_buffer_add_listener(leaf->data->buffer,
 			       &shm_surface_buffer_listener, surface);
+	leaf->stale = rect;
+	if (surface->last == leaf)
+		surface->last = NULL;
 
 out:
 	surface->current = leaf;
 
+	surface->preserved = 0;
+	if ((flags & SURFACE_HINT_PRESERVE) && surface->last == leaf) {
+		surface->preserved = 1;
+	} else if ((flags & SURFACE_HINT_PRESERVE) && surface->last &&
+		   cairo_image_surface_get_width(surface->last->cairo_surface) ==
+		   width &&
+		   cairo_image_surface_get_height(surface->last->cairo_surface) ==
+		   height) {
+		shm_surface_leaf_repair(leaf, surface->last);
+		surface->preserved = 1;
+	}
+
 	return cairo_surface_reference(leaf->cairo_surface);
 }
 
 static void
 shm_surface_swap(struct toysurface *base,
-		 struct rectangle *server_allocation)
+		 struct rectangle *server_allocation,
+		 struct rectangle *damage)
 {
 	struct shm_surface *surface = to_shm_surface(base);
 	struct shm_surface_leaf *leaf = surface->current;
+	struct shm_surface_leaf *other;
+	struct rectangle all = { 0, 0 };
+	int i;
 
 	server_allocation->width =
 		cairo_image_surface_get_width(leaf->cairo_surface);
 	server_allocation->height =
 		cairo_image_surface_get_height(leaf->cairo_surface);
 
+	all.width = server_allocation->width;
+	all.height = server_allocation->height;
+	if (damage == NULL)
+		damage = &all;
+
 	wl_surface_attach(surface->surface, leaf->data->buffer,
 			  surface->dx, surface->dy);
-	wl_surface_damage(surface->surface, 0, 0,
-			  server_allocation->width, server_allocation->height);
+	if (damage->width > 0 && damage->height > 0)
+		wl_surface_damage(surface->surface, damage->x, damage->y,
+				  damage->width, damage->height);
 	wl_surface_commit(surface->surface);
 
+	for (i = 0; i < MAX_LEAVES; i++) {
+		other = &surface->leaf[i];
+		if (other != leaf && other->cairo_surface)
+			rectangle_union(&other->stale, damage);
+	}
+	leaf->stale.width = 0;
+	leaf->stale.height = 0;
+	surface->last = leaf;
+
 	leaf->busy = 1;
 	surface->current = NULL;
 }
 
+static int
+shm_surface_preserved(struct toysurface *base, struct rectangle *stale)
+{
+	struct shm_surface *surface = to_shm_surface(base);
+
+	return surface->preserved;
+}
+
 static int
 shm_surface_acquire(struct toysurface *base, EGLContext ctx)
 {
@@ -964,9 +1313,12 @@ static void
 shm_surface_destroy(struct toysurface *base)
 {
 	struct shm_surface *surface = to_shm_surface(base);
+	int i;
 
-	shm_surface_leaf_release(&surface->leaf[0]);
-	shm_surface_leaf_release(&surface->leaf[1]);
+	for (i = 0; i < MAX_LEAVES; i++)
+		shm_surface_leaf_release(&surface->leaf[i]);
+	if (surface->pool)
+		shm_pool_unref(surface->pool);
 
 	free(surface);
 }
@@ -983,6 +1335,7 @@ shm_surface_create(struct display *display, struct wl_surface *wl_surface,
 
 	surface->base.prepare = shm_surface_prepare;
 	surface->base.swap = shm_surface_swap;
+	surface->base.preserved = shm_surface_preserved;
 	surface->base.acquire = shm_surface_acquire;
 	surface->base.release = shm_surface_release;
 	surface->base.destroy = shm_surface_destroy;
@@ -1166,7 +1519,11 @@ surface_flush(struct surface *surface)
 	}
 
 	surface->toysurface->swap(surface->toysurface,
-				  &surface->server_allocation);
+				  &surface->server_allocation,
+				  surface->partial ? &surface->damage : NULL);
+	surface->partial = 0;
+	surface->damage.width = 0;
+	surface->damage.height = 0;
 
 	cairo_surface_destroy(surface->cairo_surface);
 	surface->cairo_surface = NULL;
@@ -1244,6 +1601,9 @@ window_create_main_surface(struct window *window)
 	if (window->resizing)
 		flags |= SURFACE_HINT_RESIZE;
 
+	if (surface->partial)
+		flags |= SURFACE_HINT_PRESERVE;
+
 	if (window->resize_edges & WINDOW_RESIZING_LEFT)
 		dx = surface->server_allocation.width -
 			surface->allocation.width;
@@ -2065,7 +2425,8 @@ frame_redraw_handler(struct widget *widget, void *data)
 	struct theme *t = window->display->theme;
 	uint32_t flags = 0;
 
-	if (window->type == TYPE_FULLSCREEN)
+	/* any change to the frame asks for a full redraw */
+	if (window->type == TYPE_FULLSCREEN || widget_redraw_is_partial(widget))
 		return;
 
 	cr = widget_cairo_create(widget);
@@ -3340,6 +3701,9 @@ widget_redraw(struct widget *widget)
 		widget_redraw(child);
 }
 
+static void
+window_schedule_redraw_task(struct window *window);
+
 static void
 frame_callback(void *data, struct wl_callback *callback, uint32_t time)
 {
@@ -3350,7 +3714,7 @@ frame_callback(void *data, struct wl_callback *callback, uint32_t time)
 	window->frame_cb = 0;
 	window->redraw_scheduled = 0;
 	if (window->redraw_needed)
-		window_schedule_redraw(window);
+		window_schedule_redraw_task(window);
 }
 
 static const struct wl_callback_listener listener = {
@@ -3361,10 +3725,26 @@ static void
 idle_redraw(struct task *task, uint32_t events)
 {
 	struct window *window = container_of(task, struct window, redraw_task);
+	struct surface *surface;
 
 	if (window->resize_needed)
 		idle_resize(window);
 
+	/* The surface contents have to be known to be kept before the
+	 * redraw handlers decide on a partial redraw. */
+	surface = window->main_surface;
+	surface->partial = !surface->redraw_full &&
+		surface->buffer_transform == WL_OUTPUT_TRANSFORM_NORMAL;
+	surface->redraw_full = 0;
+	surface->stale.width = 0;
+	surface->stale.height = 0;
+	if (surface->partial) {
+		widget_get_cairo_surface(surface->widget);
+		surface->partial =
+			surface->toysurface->preserved(surface->toysurface,
+						       &surface->stale);
+	}
+
 	widget_redraw(window->main_surface->widget);
 	window->redraw_needed = 0;
 	wl_list_init(&window->redraw_task.link);
@@ -3374,8 +3754,8 @@ idle_redraw(struct task *task, uint32_t events)
 	window_flush(window);
 }
 
-void
-window_schedule_redraw(struct window *window)
+static void
+window_schedule_redraw_task(struct window *window)
 {
 	window->redraw_needed = 1;
 	if (window->configure_requests)
@@ -3387,6 +3767,40 @@ window_schedule_redraw(struct window *window)
 	}
 }
 
+void
+window_schedule_redraw(struct window *window)
+{
+	window->main_surface->redraw_full = 1;
+	window_schedule_redraw_task(window);
+}
+
+void
+widget_schedule_partial_redraw(struct widget *widget)
+{
+	window_schedule_redraw_task(widget->window);
+}
+
+int
+widget_redraw_is_partial(struct widget *widget)
+{
+	return widget->surface->partial;
+}
+
+void
+widget_get_stale_area(struct widget *widget, struct rectangle *stale)
+{
+	*stale = widget->surface->stale;
+}
+
+void
+widget_add_damage(struct widget *widget,
+		  int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct rectangle r = { x, y, width, height };
+
+	rectangle_union(&widget->surface->damage, &r);
+}
+
 int
 window_is_fullscreen(struct window *window)
 {
@@ -3402,7 +3816,7 @@ configure_request_completed(void *data, struct wl_callback *callback, uint32_t
 	window->configure_requests--;
 
 	if (!window->configure_requests)
-		window_schedule_redraw(window);
+		window_schedule_redraw_task(window);
 }
 
 static struct wl_callback_listener configure_request_listener = {
@@ -4133,8 +4547,8 @@ display_add_input(struct display *d, uint32_t id)
 	input->repeat_timer_fd = timerfd_create(CLOCK_MONOTONIC,
 						TFD_CLOEXEC | TFD_NONBLOCK);
 	input->repeat_task.run = keyboard_repeat_func;
-	display_watch_fd(d, input->repeat_timer_fd,
-			 EPOLLIN, &input->repeat_task);
+	display_watch_fd_priority(d, input->repeat_timer_fd, EPOLLIN,
+				  &input->repeat_task, TASK_PRIORITY_HIGH);
 }
 
 static void
@@ -4252,6 +4666,7 @@ init_egl(struct display *d)
 {
 	EGLint major, minor;
 	EGLint n;
+	const char *extensions;
 
 #ifdef USE_CAIRO_GLESV2
 #  define GL_BIT EGL_OPENGL_ES2_BIT
@@ -4316,6 +4731,14 @@ init_egl(struct display *d)
 		return -1;
 	}
 
+	extensions = eglQueryString(d->dpy, EGL_EXTENSIONS);
+	if (extensions && strstr(extensions, "EGL_EXT_buffer_age"))
+		d->has_egl_buffer_age = 1;
+	if (extensions &&
+	    strstr(extensions, "EGL_EXT_swap_buffers_with_damage"))
+		d->swap_buffers_with_damage = (void *)
+			eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+
 	return 0;
 }
 
@@ -4404,8 +4827,9 @@ display_create(int *argc, char *argv[])
 	d->epoll_fd = os_epoll_create_cloexec();
 	d->display_fd = wl_display_get_fd(d->display);
 	d->display_task.run = handle_display_data;
-	display_watch_fd(d, d->display_fd, EPOLLIN | EPOLLERR | EPOLLHUP,
-			 &d->display_task);
+	display_watch_fd_priority(d, d->display_fd,
+				  EPOLLIN | EPOLLERR | EPOLLHUP,
+				  &d->display_task, TASK_PRIORITY_HIGH);
 
 	wl_list_init(&d->deferred_list);
 	wl_list_init(&d->input_list);
@@ -4607,28 +5031,50 @@ display_defer(struct display *display, struct task *task)
 }
 
 void
-display_watch_fd(struct display *display,
-		 int fd, uint32_t events, struct task *task)
+display_watch_fd_priority(struct display *display, int fd, uint32_t events,
+			  struct task *task, enum task_priority priority)
 {
 	struct epoll_event ep;
 
+	task->priority = priority;
 	ep.events = events;
 	ep.data.ptr = task;
 	epoll_ctl(display->epoll_fd, EPOLL_CTL_ADD, fd, &ep);
 }
 
+void
+display_watch_fd(struct display *display,
+		 int fd, uint32_t events, struct task *task)
+{
+	display_watch_fd_priority(display, fd, events, task,
+				  TASK_PRIORITY_NORMAL);
+}
+
 void
 display_unwatch_fd(struct display *display, int fd)
 {
 	epoll_ctl(display->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
 }
 
+/* half a frame at 60 Hz */
+#define DISPLAY_TASK_BUDGET_MS 8
+
+static uint32_t
+display_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 void
 display_run(struct display *display)
 {
 	struct task *task;
 	struct epoll_event ep[16];
-	int i, count, ret;
+	int i, p, count, ret;
 
 	display->running = 1;
 	while (1) {
@@ -4658,13 +5104,28 @@ display_run(struct display *display)
 
 		count = epoll_wait(display->epoll_fd,
 				   ep, ARRAY_LENGTH(ep), -1);
-		for (i = 0; i < count; i++) {
-			task = ep[i].data.ptr;
-			task->run(task, ep[i].events);
+		display->dispatch_start = display_time_ms();
+		for (p = 0; p < TASK_PRIORITY_COUNT; p++) {
+			for (i = 0; i < count; i++) {
+				task = ep[i].data.ptr;
+				if (task->priority == p)
+					task->run(task, ep[i].events);
+			}
 		}
 	}
 }
 
+/* Tells handlers that do an unbounded amount of work per wakeup, like
+ * reading a busy fd, to leave the rest for the next loop iteration.
+ * That one flushes requests, runs the deferred redraws and handles
+ * the display fd before getting back to them. */
+int
+display_task_budget_expired(struct display *display)
+{
+	return display_time_ms() - display->dispatch_start >=
+		DISPLAY_TASK_BUDGET_MS;
+}
+
 void
 display_exit(struct display *display)
 {
@@ -40,9 +40,20 @@ struct display;
 struct input;
 struct output;
 
+/* Of the fds that are ready at once, the tasks of higher priority run
+ * first.  Input and frame events come in on the display fd, which is
+ * high priority, so a busy low priority fd can't hold them up. */
+enum task_priority {
+	TASK_PRIORITY_HIGH,
+	TASK_PRIORITY_NORMAL,
+	TASK_PRIORITY_LOW,
+	TASK_PRIORITY_COUNT
+};
+
 struct task {
 	void (*run)(struct task *task, uint32_t events);
 	struct wl_list link;
+	enum task_priority priority;
 };
 
 struct rectangle {
@@ -52,6 +63,9 @@ struct rectangle {
 	int32_t height;
 };
 
+void
+rectangle_union(struct rectangle *r, const struct rectangle *s);
+
 struct display *
 display_create(int *argc, char *argv[]);
 
@@ -127,6 +141,7 @@ display_release_window_surface(struct display *display,
 #define SURFACE_SHM    0x02
 
 #define SURFACE_HINT_RESIZE 0x10
+#define SURFACE_HINT_PRESERVE 0x20
 
 cairo_surface_t *
 display_create_surface(struct display *display,
@@ -148,6 +163,13 @@ void
 display_watch_fd(struct display *display,
 		 int fd, uint32_t events, struct task *task);
 
+void
+display_watch_fd_priority(struct display *display, int fd, uint32_t events,
+			  struct task *task, enum task_priority priority);
+
+int
+display_task_budget_expired(struct display *display);
+
 void
 display_unwatch_fd(struct display *display, int fd);
 
@@ -410,6 +432,28 @@ widget_set_axis_handler(struct widget *widget,
 void
 widget_schedule_redraw(struct widget *widget);
 
+/*
+ * A partial redraw keeps what is on the surface.  Redraw handlers that
+ * see widget_redraw_is_partial() draw only what changed and report it
+ * with widget_add_damage(), in surface coordinates.  When anything asks
+ * for a plain redraw before it runs, or the surface contents could not
+ * be kept, it is a full redraw instead.  With more than one buffer, a
+ * partial redraw also draws the stale area again: what changed on the
+ * other buffers since this one was used.
+ */
+void
+widget_schedule_partial_redraw(struct widget *widget);
+
+int
+widget_redraw_is_partial(struct widget *widget);
+
+void
+widget_get_stale_area(struct widget *widget, struct rectangle *stale);
+
+void
+widget_add_damage(struct widget *widget,
+		  int32_t x, int32_t y, int32_t width, int32_t height);
+
 struct widget *
 frame_create(struct window *window, void *data);
 
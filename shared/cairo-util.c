@@ -36,6 +36,14 @@
 
 #define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
 
+/* the shadow is the frame rectangle moved and grown by these, with
+ * corners of SHADOW_MARGIN */
+#define SHADOW_OFFSET	2
+#define SHADOW_GROW	8
+#define SHADOW_MARGIN	64
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
 void
 surface_flush_device(cairo_surface_t *surface)
 {
@@ -295,25 +303,76 @@ rounded_rect(cairo_t *cr, int x0, int y0, int x1, int y1, int radius)
 	cairo_close_path(cr);
 }
 
-cairo_surface_t *
-load_cairo_surface(const char *filename)
+static const cairo_user_data_key_t pixman_image_key;
+
+static void
+surface_image_destroy(void *data)
 {
-	pixman_image_t *image;
+	pixman_image_unref(data);
+}
+
+/* The surface holds the reference to image, and shares its pixels. */
+static cairo_surface_t *
+surface_from_pixman_image(pixman_image_t *image)
+{
+	cairo_surface_t *surface;
 	int width, height, stride;
 	void *data;
 
-	image = load_image(filename);
-	if (image == NULL) {
+	if (image == NULL)
 		return NULL;
-	}
 
 	data = pixman_image_get_data(image);
 	width = pixman_image_get_width(image);
 	height = pixman_image_get_height(image);
 	stride = pixman_image_get_stride(image);
 
-	return cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
-						   width, height, stride);
+	surface = cairo_image_surface_create_for_data(data,
+						      CAIRO_FORMAT_ARGB32,
+						      width, height, stride);
+	if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ||
+	    cairo_surface_set_user_data(surface, &pixman_image_key, image,
+					surface_image_destroy) !=
+	    CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surface);
+		pixman_image_unref(image);
+		return NULL;
+	}
+
+	return surface;
+}
+
+cairo_surface_t *
+load_cairo_surface(const char *filename)
+{
+	return surface_from_pixman_image(load_image(filename));
+}
+
+cairo_surface_t *
+load_cairo_surface_finish(struct image_load *load)
+{
+	return surface_from_pixman_image(image_load_finish(load));
+}
+
+static void
+theme_draw_frame(struct theme *t, cairo_t *cr, int width, int height,
+		 uint32_t flags);
+
+static cairo_surface_t *
+theme_create_pieces(struct theme *t, uint32_t flags)
+{
+	cairo_surface_t *surface;
+	cairo_t *cr;
+
+	surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+					     t->piece_left + 1 + t->piece_right,
+					     t->piece_top + 1 + t->piece_bottom);
+	cr = cairo_create(surface);
+	theme_draw_frame(t, cr, cairo_image_surface_get_width(surface),
+			 cairo_image_surface_get_height(surface), flags);
+	cairo_destroy(cr);
+
+	return surface;
 }
 
 struct theme *
@@ -361,6 +420,18 @@ theme_create(void)
 	cairo_fill(cr);
 	cairo_destroy(cr);
 
+	/* where either the shadow or the frame still changes */
+	t->piece_left = MAX(SHADOW_OFFSET + SHADOW_MARGIN,
+			    t->margin + t->width);
+	t->piece_right = MAX(SHADOW_MARGIN - SHADOW_OFFSET - SHADOW_GROW,
+			     t->margin + t->width);
+	t->piece_top = MAX(SHADOW_OFFSET + SHADOW_MARGIN,
+			   t->margin + t->titlebar_height);
+	t->piece_bottom = MAX(SHADOW_MARGIN - SHADOW_OFFSET - SHADOW_GROW,
+			      t->margin + t->width);
+	t->frame_pieces[0] = theme_create_pieces(t, 0);
+	t->frame_pieces[1] = theme_create_pieces(t, THEME_FRAME_ACTIVE);
+
 	return t;
 }
 
@@ -370,18 +441,17 @@ theme_destroy(struct theme *t)
 	cairo_surface_destroy(t->active_frame);
 	cairo_surface_destroy(t->inactive_frame);
 	cairo_surface_destroy(t->shadow);
+	cairo_surface_destroy(t->frame_pieces[0]);
+	cairo_surface_destroy(t->frame_pieces[1]);
 	free(t);
 }
 
-void
-theme_render_frame(struct theme *t,
-		   cairo_t *cr, int width, int height,
-		   const char *title, uint32_t flags)
+static void
+theme_draw_frame(struct theme *t, cairo_t *cr, int width, int height,
+		 uint32_t flags)
 {
-	cairo_text_extents_t extents;
-	cairo_font_extents_t font_extents;
 	cairo_surface_t *source;
-	int x, y, margin;
+	int margin;
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	cairo_set_source_rgba(cr, 0, 0, 0, 0);
@@ -392,8 +462,9 @@ theme_render_frame(struct theme *t,
 	else {
 		cairo_set_source_rgba(cr, 0, 0, 0, 0.45);
 		tile_mask(cr, t->shadow,
-			  2, 2, width + 8, height + 8,
-			  64, 64);
+			  SHADOW_OFFSET, SHADOW_OFFSET,
+			  width + SHADOW_GROW, height + SHADOW_GROW,
+			  SHADOW_MARGIN, SHADOW_MARGIN);
 		margin = t->margin;
 	}
 
@@ -406,6 +477,75 @@ theme_render_frame(struct theme *t,
 		    margin, margin,
 		    width - margin * 2, height - margin * 2,
 		    t->width, t->titlebar_height);
+}
+
+/* The frame from its pieces, corners as they are and the pixel between
+ * them stretched, replacing what was there. */
+static void
+theme_blit_frame(struct theme *t, cairo_t *cr, int width, int height,
+		 uint32_t flags)
+{
+	cairo_pattern_t *pattern;
+	cairo_matrix_t matrix;
+	const int sx[4] = {
+		0, t->piece_left, t->piece_left + 1,
+		t->piece_left + 1 + t->piece_right
+	};
+	const int sy[4] = {
+		0, t->piece_top, t->piece_top + 1,
+		t->piece_top + 1 + t->piece_bottom
+	};
+	const int dx[4] = { 0, t->piece_left, width - t->piece_right, width };
+	const int dy[4] = { 0, t->piece_top, height - t->piece_bottom, height };
+	int i, j;
+
+	pattern = cairo_pattern_create_for_surface(
+		t->frame_pieces[(flags & THEME_FRAME_ACTIVE) ? 1 : 0]);
+	cairo_pattern_set_filter(pattern, CAIRO_FILTER_NEAREST);
+	cairo_pattern_set_extend(pattern, CAIRO_EXTEND_PAD);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source(cr, pattern);
+	cairo_pattern_destroy(pattern);
+
+	for (j = 0; j < 3; j++)
+		for (i = 0; i < 3; i++) {
+			if (dx[i + 1] == dx[i] || dy[j + 1] == dy[j])
+				continue;
+
+			cairo_matrix_init_translate(&matrix, sx[i], sy[j]);
+			cairo_matrix_scale(&matrix,
+					   (double) (sx[i + 1] - sx[i]) /
+					   (dx[i + 1] - dx[i]),
+					   (double) (sy[j + 1] - sy[j]) /
+					   (dy[j + 1] - dy[j]));
+			cairo_matrix_translate(&matrix, -dx[i], -dy[j]);
+			cairo_pattern_set_matrix(pattern, &matrix);
+			cairo_rectangle(cr, dx[i], dy[j],
+					dx[i + 1] - dx[i], dy[j + 1] - dy[j]);
+			cairo_fill(cr);
+		}
+}
+
+void
+theme_render_frame(struct theme *t,
+		   cairo_t *cr, int width, int height,
+		   const char *title, uint32_t flags)
+{
+	cairo_text_extents_t extents;
+	cairo_font_extents_t font_extents;
+	int x, y, margin;
+
+	if (flags & THEME_FRAME_MAXIMIZED) {
+		theme_draw_frame(t, cr, width, height, flags);
+		margin = 0;
+	} else {
+		if (width >= t->piece_left + t->piece_right &&
+		    height >= t->piece_top + t->piece_bottom)
+			theme_blit_frame(t, cr, width, height, flags);
+		else
+			theme_draw_frame(t, cr, width, height, flags);
+		margin = t->margin;
+	}
 
 	cairo_rectangle (cr, margin + t->width, margin,
 			 width - (margin + t->width) * 2,
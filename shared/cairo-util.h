@@ -45,6 +45,12 @@ rounded_rect(cairo_t *cr, int x0, int y0, int x1, int y1, int radius);
 cairo_surface_t *
 load_cairo_surface(const char *filename);
 
+/* image_load_finish(), for a load started with image_load_start() */
+struct image_load;
+
+cairo_surface_t *
+load_cairo_surface_finish(struct image_load *load);
+
 struct theme {
 	cairo_surface_t *active_frame;
 	cairo_surface_t *inactive_frame;
@@ -53,6 +59,13 @@ struct theme {
 	int margin;
 	int width;
 	int titlebar_height;
+
+	/* Shadow and frame of each of inactive and active, drawn once
+	 * as small as they get, with the corners piece_* wide and one
+	 * pixel between them to stretch.  Frames are drawn from these
+	 * in nine pieces. */
+	cairo_surface_t *frame_pieces[2];
+	int piece_left, piece_right, piece_top, piece_bottom;
 };
 
 struct theme *
@@ -25,9 +25,42 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <ctype.h>
+#include <sys/stat.h>
 
 #include "config-parser.h"
 
+/*
+ * weston.ini is parsed once into a weston_config: the entries in file
+ * order, grouped by section for weston_config_apply().  The parse is
+ * cached by path and file identity, so the backend and the modules all
+ * share it, and the file is only read again when it changed or on
+ * config_cache_reload().
+ */
+
+struct config_entry {
+	char *key;
+	char *value;		/* as after '=', without the newline */
+};
+
+struct config_section_range {
+	char *name;
+	int first;		/* into entries */
+	int count;
+};
+
+struct weston_config {
+	struct config_entry *entries;
+	int num_entries, entries_alloc;
+	struct config_section_range *sections;
+	int num_sections, sections_alloc;
+};
+
+static struct {
+	char *path;
+	struct stat st;
+	struct weston_config *config;
+} config_cache;
+
 static int
 handle_key(const struct config_key *key, const char *value)
 {
@@ -38,7 +71,7 @@ handle_key(const struct config_key *key, const char *value)
 	switch (key->type) {
 	case CONFIG_KEY_INTEGER:
 		i = strtol(value, &end, 0);
-		if (*end != '\n') {
+		if (*end != '\0') {
 			fprintf(stderr, "invalid integer: %s\n", value);
 			return -1;
 		}
@@ -47,7 +80,7 @@ handle_key(const struct config_key *key, const char *value)
 
 	case CONFIG_KEY_UNSIGNED_INTEGER:
 		ui = strtoul(value, &end, 0);
-		if (*end != '\n') {
+		if (*end != '\0') {
 			fprintf(stderr, "invalid integer: %s\n", value);
 			return -1;
 		}
@@ -67,9 +100,9 @@ handle_key(const struct config_key *key, const char *value)
 		return 0;
 
 	case CONFIG_KEY_BOOLEAN:
-		if (strcmp(value, "false\n") == 0)
+		if (strcmp(value, "false") == 0)
 			*(int *)key->data = 0;
-		else if (strcmp(value, "true\n") == 0)
+		else if (strcmp(value, "true") == 0)
 			*(int *)key->data = 1;
 		else {
 			fprintf(stderr, "invalid bool: %s\n", value);
@@ -85,20 +118,87 @@ handle_key(const struct config_key *key, const char *value)
 	return -1;
 }
 
-int
-parse_config_file(const char *path,
-		  const struct config_section *sections, int num_sections,
-		  void *data)
+/* Makes room for one more of the count elements in *array. */
+static int
+config_grow(void **array, int count, int *alloc, size_t size)
 {
+	void *p;
+	int n;
+
+	if (count < *alloc)
+		return 0;
+
+	n = *alloc ? *alloc * 2 : 16;
+	p = realloc(*array, n * size);
+	if (p == NULL)
+		return -1;
+	*array = p;
+	*alloc = n;
+
+	return 0;
+}
+
+static int
+config_add_section(struct weston_config *config, const char *name)
+{
+	struct config_section_range *section;
+
+	if (config_grow((void **) &config->sections, config->num_sections,
+			&config->sections_alloc, sizeof *section) < 0)
+		return -1;
+
+	section = &config->sections[config->num_sections];
+	section->name = strdup(name);
+	if (section->name == NULL)
+		return -1;
+	section->first = config->num_entries;
+	section->count = 0;
+	config->num_sections++;
+
+	return 0;
+}
+
+static int
+config_add_entry(struct weston_config *config,
+		 const char *key, const char *value)
+{
+	struct config_section_range *section;
+	struct config_entry *entry;
+
+	if (config_grow((void **) &config->entries, config->num_entries,
+			&config->entries_alloc, sizeof *entry) < 0)
+		return -1;
+
+	section = &config->sections[config->num_sections - 1];
+	entry = &config->entries[config->num_entries];
+	entry->key = strdup(key);
+	entry->value = strdup(value);
+	config->num_entries++;
+	section->count++;
+	if (entry->key == NULL || entry->value == NULL)
+		return -1;
+
+	return 0;
+}
+
+struct weston_config *
+weston_config_parse(const char *path)
+{
+	struct weston_config *config;
 	FILE *fp;
 	char line[512], *p;
-	const struct config_section *current = NULL;
-	int i;
+	int in_section = 0;
 
 	fp = fopen(path, "r");
 	if (fp == NULL) {
 		fprintf(stderr, "couldn't open %s\n", path);
-		return -1;
+		return NULL;
+	}
+
+	config = calloc(1, sizeof *config);
+	if (config == NULL) {
+		fclose(fp);
+		return NULL;
 	}
 
 	while (fgets(line, sizeof line, fp)) {
@@ -109,48 +209,218 @@ parse_config_file(const char *path,
 			if (!p || p[1] != '\n') {
 				fprintf(stderr, "malformed "
 					"section header: %s\n", line);
-				fclose(fp);
-				return -1;
+				goto err;
 			}
-			if (current && current->done)
-				current->done(data);
 			p[0] = '\0';
-			for (i = 0; i < num_sections; i++) {
-				if (strcmp(sections[i].name, &line[1]) == 0) {
-					current = &sections[i];
-					break;
-				}
-			}
-			if (i == num_sections)
-				current = NULL;
+			if (config_add_section(config, &line[1]) < 0)
+				goto err;
+			in_section = 1;
 		} else if (p = strchr(line, '='), p != NULL) {
-			if (current == NULL)
+			if (!in_section)
 				continue;
 			p[0] = '\0';
-			for (i = 0; i < current->num_keys; i++) {
-				if (strcmp(current->keys[i].name, line) == 0) {
-					if (handle_key(&current->keys[i], &p[1]) < 0) {
-						fclose(fp);
-						return -1;
-					}
-					break;
-				}
-			}
+			p[strcspn(&p[1], "\n") + 1] = '\0';
+			if (config_add_entry(config, line, &p[1]) < 0)
+				goto err;
 		} else {
 			fprintf(stderr, "malformed config line: %s\n", line);
-			fclose(fp);
-			return -1;
+			goto err;
 		}
 	}
 
-	if (current && current->done)
-		current->done(data);
+	fclose(fp);
+
+	return config;
 
+err:
 	fclose(fp);
+	weston_config_destroy(config);
+
+	return NULL;
+}
+
+void
+weston_config_destroy(struct weston_config *config)
+{
+	int i;
+
+	if (config == NULL)
+		return;
+
+	for (i = 0; i < config->num_entries; i++) {
+		free(config->entries[i].key);
+		free(config->entries[i].value);
+	}
+	for (i = 0; i < config->num_sections; i++)
+		free(config->sections[i].name);
+	free(config->entries);
+	free(config->sections);
+	free(config);
+}
+
+/* Sets the keys of sections from config, calling done at the end of
+ * each section that has it, sections and keys in file order. */
+int
+weston_config_apply(struct weston_config *config,
+		    const struct config_section *sections, int num_sections,
+		    void *data)
+{
+	const struct config_section *current;
+	const struct config_section_range *range;
+	const struct config_entry *entry;
+	int i, j, k;
+
+	for (i = 0; i < config->num_sections; i++) {
+		range = &config->sections[i];
+		for (j = 0; j < num_sections; j++)
+			if (strcmp(sections[j].name, range->name) == 0)
+				break;
+		if (j == num_sections)
+			continue;
+
+		current = &sections[j];
+		for (j = 0; j < range->count; j++) {
+			entry = &config->entries[range->first + j];
+			for (k = 0; k < current->num_keys; k++) {
+				if (strcmp(current->keys[k].name,
+					   entry->key) != 0)
+					continue;
+				if (handle_key(&current->keys[k],
+					       entry->value) < 0)
+					return -1;
+				break;
+			}
+		}
+
+		if (current->done)
+			current->done(data);
+	}
 
 	return 0;
 }
 
+/* The shared parse of path, read again only if the file changed. */
+struct weston_config *
+config_cache_get(const char *path)
+{
+	struct weston_config *config, *old;
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		fprintf(stderr, "couldn't open %s\n", path);
+		return NULL;
+	}
+
+	if (config_cache.config && strcmp(config_cache.path, path) == 0 &&
+	    config_cache.st.st_dev == st.st_dev &&
+	    config_cache.st.st_ino == st.st_ino &&
+	    config_cache.st.st_size == st.st_size &&
+	    config_cache.st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+	    config_cache.st.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+		return config_cache.config;
+
+	config = config_cache_reload(path, &old);
+	weston_config_destroy(old);
+
+	return config;
+}
+
+/* Reads path again even if it looks unchanged, and makes that the
+ * shared parse.  The one it replaces, if any, is handed to the caller
+ * in *old to diff against and destroy.  If the file does not parse,
+ * the shared parse stays as it was and NULL is returned. */
+struct weston_config *
+config_cache_reload(const char *path, struct weston_config **old)
+{
+	struct weston_config *config;
+	struct stat st;
+	char *copy;
+
+	*old = NULL;
+
+	if (stat(path, &st) < 0) {
+		fprintf(stderr, "couldn't open %s\n", path);
+		return NULL;
+	}
+
+	config = weston_config_parse(path);
+	copy = strdup(path);
+	if (config == NULL || copy == NULL) {
+		weston_config_destroy(config);
+		free(copy);
+		return NULL;
+	}
+
+	*old = config_cache.config;
+	free(config_cache.path);
+	config_cache.path = copy;
+	config_cache.st = st;
+	config_cache.config = config;
+
+	return config;
+}
+
+/* The index of the next section named name from i on, or num_sections. */
+static int
+config_next_section(struct weston_config *config, int i, const char *name)
+{
+	if (config == NULL)
+		return 0;
+
+	while (i < config->num_sections &&
+	       strcmp(config->sections[i].name, name) != 0)
+		i++;
+
+	return i;
+}
+
+/* Whether the sections named section, in file order, have the same
+ * keys and values in a and b.  NULL is an empty file. */
+int
+weston_config_section_equal(struct weston_config *a, struct weston_config *b,
+			    const char *section)
+{
+	const struct config_section_range *x, *y;
+	int i, j, k;
+
+	i = config_next_section(a, 0, section);
+	j = config_next_section(b, 0, section);
+	while ((a && i < a->num_sections) || (b && j < b->num_sections)) {
+		if (!a || i == a->num_sections || !b || j == b->num_sections)
+			return 0;
+
+		x = &a->sections[i];
+		y = &b->sections[j];
+		if (x->count != y->count)
+			return 0;
+		for (k = 0; k < x->count; k++)
+			if (strcmp(a->entries[x->first + k].key,
+				   b->entries[y->first + k].key) != 0 ||
+			    strcmp(a->entries[x->first + k].value,
+				   b->entries[y->first + k].value) != 0)
+				return 0;
+
+		i = config_next_section(a, i + 1, section);
+		j = config_next_section(b, j + 1, section);
+	}
+
+	return 1;
+}
+
+int
+parse_config_file(const char *path,
+		  const struct config_section *sections, int num_sections,
+		  void *data)
+{
+	struct weston_config *config;
+
+	config = config_cache_get(path);
+	if (config == NULL)
+		return -1;
+
+	return weston_config_apply(config, sections, num_sections, data);
+}
+
 char *
 config_file_path(const char *name)
 {
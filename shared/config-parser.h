@@ -52,6 +52,29 @@ parse_config_file(const char *path,
 		  const struct config_section *sections, int num_sections,
 		  void *data);
 
+struct weston_config;
+
+struct weston_config *
+weston_config_parse(const char *path);
+
+void
+weston_config_destroy(struct weston_config *config);
+
+int
+weston_config_apply(struct weston_config *config,
+		    const struct config_section *sections, int num_sections,
+		    void *data);
+
+int
+weston_config_section_equal(struct weston_config *a, struct weston_config *b,
+			    const char *section);
+
+struct weston_config *
+config_cache_get(const char *path);
+
+struct weston_config *
+config_cache_reload(const char *path, struct weston_config **old);
+
 char *
 config_file_path(const char *name);
 
@@ -21,11 +21,21 @@
  * OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include "../config.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <jpeglib.h>
 #include <png.h>
 #include <pixman.h>
@@ -72,7 +82,7 @@ pixman_image_destroy_func(pixman_image_t *image, void *data)
 }
 
 static pixman_image_t *
-load_jpeg(FILE *fp)
+load_jpeg(FILE *fp, int width, int height)
 {
 	struct jpeg_decompress_struct cinfo;
 	struct jpeg_error_mgr jerr;
@@ -94,7 +104,27 @@ load_jpeg(FILE *fp)
 
 	jpeg_read_header(&cinfo, TRUE);
 
+	/* libjpeg-turbo writes our pixel format itself */
+#ifdef JCS_EXTENSIONS
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	cinfo.out_color_space = JCS_EXT_BGRA;
+#else
+	cinfo.out_color_space = JCS_EXT_ARGB;
+#endif
+#else
 	cinfo.out_color_space = JCS_RGB;
+#endif
+
+	/* Scaling in the IDCT by 1/2, 1/4 or 1/8 skips most of the
+	 * decoding work, as long as it stays at least the size asked
+	 * for. */
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = 1;
+	while (width > 0 && height > 0 && cinfo.scale_denom < 8 &&
+	       cinfo.image_width / (cinfo.scale_denom * 2) >= (unsigned) width &&
+	       cinfo.image_height / (cinfo.scale_denom * 2) >= (unsigned) height)
+		cinfo.scale_denom *= 2;
+
 	jpeg_start_decompress(&cinfo);
 
 	stride = cinfo.output_width * 4;
@@ -110,6 +140,8 @@ load_jpeg(FILE *fp)
 			rows[i] = data + (first + i) * stride;
 
 		jpeg_read_scanlines(&cinfo, rows, ARRAY_LENGTH(rows));
+		if (cinfo.out_color_space != JCS_RGB)
+			continue;
 		for (i = 0; first + i < cinfo.output_scanline; i++)
 			swizzle_row(rows[i], cinfo.output_width);
 	}
@@ -129,43 +161,34 @@ load_jpeg(FILE *fp)
 	return pixman_image;
 }
 
-static inline int
-multiply_alpha(int alpha, int color)
-{
-    int temp = (alpha * color) + 0x80;
-
-    return ((temp + (temp >> 8)) >> 8);
-}
-
+/*
+ * libpng hands us pixels in our own format, see load_png(), so they
+ * are premultiplied in place, red and blue in one multiplication, and
+ * opaque ones are left alone.  The rounding is the usual
+ * t = a * c + 0x80, (t + (t >> 8)) >> 8 for each channel.
+ */
 static void
 premultiply_data(png_structp   png,
 		 png_row_infop row_info,
 		 png_bytep     data)
 {
-    unsigned int i;
-    png_bytep p;
-
-    for (i = 0, p = data; i < row_info->rowbytes; i += 4, p += 4) {
-	png_byte  alpha = p[3];
-	uint32_t w;
-
-	if (alpha == 0) {
-		w = 0;
-	} else {
-		png_byte red   = p[0];
-		png_byte green = p[1];
-		png_byte blue  = p[2];
-
-		if (alpha != 0xff) {
-			red   = multiply_alpha(alpha, red);
-			green = multiply_alpha(alpha, green);
-			blue  = multiply_alpha(alpha, blue);
-		}
-		w = (alpha << 24) | (red << 16) | (green << 8) | (blue << 0);
+	uint32_t *p = (uint32_t *) data;
+	uint32_t *end = p + row_info->rowbytes / 4;
+	uint32_t w, a, rb, g;
+
+	for (; p < end; p++) {
+		w = *p;
+		a = w >> 24;
+		if (a == 0xff)
+			continue;
+
+		rb = (w & 0x00ff00ff) * a + 0x00800080;
+		rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+		g = (w & 0x0000ff00) * a + 0x00008000;
+		g = ((g + ((g >> 8) & 0x0000ff00)) >> 8) & 0x0000ff00;
+
+		*p = (a << 24) | rb | g;
 	}
-
-	* (uint32_t *) p = w;
-    }
 }
 
 static void
@@ -184,7 +207,7 @@ png_error_callback(png_structp png, png_const_charp error_msg)
 }
 
 static pixman_image_t *
-load_png(FILE *fp)
+load_png(FILE *fp, int width_hint, int height_hint)
 {
 	png_struct *png;
 	png_info *info;
@@ -243,7 +266,14 @@ load_png(FILE *fp)
 	if (interlace != PNG_INTERLACE_NONE)
 		png_set_interlace_handling(png);
 
+	/* a8r8g8b8 in memory */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	png_set_bgr(png);
 	png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+#else
+	png_set_swap_alpha(png);
+	png_set_filler(png, 0xff, PNG_FILLER_BEFORE);
+#endif
 	png_set_read_user_transform_fn(png, premultiply_data);
 	png_read_update_info(png, info);
 	png_get_IHDR(png, info,
@@ -286,7 +316,7 @@ load_png(FILE *fp)
 #ifdef HAVE_WEBP
 
 static pixman_image_t *
-load_webp(FILE *fp)
+load_webp(FILE *fp, int width, int height)
 {
 	WebPDecoderConfig config;
 	uint8_t buffer[16 * 1024];
@@ -355,7 +385,7 @@ load_webp(FILE *fp)
 struct image_loader {
 	unsigned char header[4];
 	int header_size;
-	pixman_image_t *(*load)(FILE *fp);
+	pixman_image_t *(*load)(FILE *fp, int width, int height);
 };
 
 static const struct image_loader loaders[] = {
@@ -366,8 +396,8 @@ static const struct image_loader loaders[] = {
 #endif
 };
 
-pixman_image_t *
-load_image(const char *filename)
+static pixman_image_t *
+decode_image(const char *filename, int width, int height)
 {
 	pixman_image_t *image;
 	unsigned char header[4];
@@ -387,7 +417,7 @@ load_image(const char *filename)
 	for (i = 0; i < ARRAY_LENGTH(loaders); i++) {
 		if (memcmp(header, loaders[i].header,
 			   loaders[i].header_size) == 0) {
-			image = loaders[i].load(fp);
+			image = loaders[i].load(fp, width, height);
 			break;
 		}
 	}
@@ -403,3 +433,309 @@ load_image(const char *filename)
 
 	return image;
 }
+
+/*
+ * Decoded images are kept in files under $XDG_RUNTIME_DIR, one for
+ * each file and requested size, so every client after the first maps
+ * the pixels instead of decoding them, and they share the pages.  A
+ * file starts with a header, then the path, then the pixels at
+ * IMAGE_CACHE_ALIGN.  It is only used while the mtime and size of the
+ * image file match, and replaced by rename(2) so readers never see a
+ * partial one.
+ */
+#define IMAGE_CACHE_MAGIC 0x31434957	/* "WIC1" */
+#define IMAGE_CACHE_ALIGN 4096
+
+struct image_cache_header {
+	uint32_t magic;
+	uint32_t format;
+	int32_t width, height, stride;
+	int32_t request_width, request_height;
+	uint32_t path_length;
+	uint64_t mtime;
+	uint64_t size;
+};
+
+struct image_cache_map {
+	void *data;
+	size_t length;
+};
+
+static uint64_t
+image_cache_mtime(const struct stat *st)
+{
+	return (uint64_t) st->st_mtim.tv_sec * 1000000000 +
+		st->st_mtim.tv_nsec;
+}
+
+static char *
+image_cache_name(const char *path, int width, int height)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	int32_t size[2] = { width, height };
+	const unsigned char *p;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	char *name;
+	size_t i;
+
+	if (dir == NULL)
+		return NULL;
+
+	/* FNV-1a */
+	for (p = (const unsigned char *) path; *p; p++)
+		hash = (hash ^ *p) * 0x100000001b3ull;
+	for (i = 0, p = (const unsigned char *) size; i < sizeof size; i++)
+		hash = (hash ^ p[i]) * 0x100000001b3ull;
+
+	if (asprintf(&name, "%s/weston-image-cache", dir) < 0)
+		return NULL;
+	if (mkdir(name, 0700) < 0 && errno != EEXIST) {
+		free(name);
+		return NULL;
+	}
+	free(name);
+
+	if (asprintf(&name, "%s/weston-image-cache/%016llx",
+		     dir, (unsigned long long) hash) < 0)
+		return NULL;
+
+	return name;
+}
+
+static void
+image_cache_destroy_func(pixman_image_t *image, void *data)
+{
+	struct image_cache_map *map = data;
+
+	munmap(map->data, map->length);
+	free(map);
+}
+
+static pixman_image_t *
+image_cache_load(const char *name, const char *path, const struct stat *st,
+		 int width, int height)
+{
+	struct image_cache_header header;
+	struct image_cache_map *map;
+	pixman_image_t *image;
+	struct stat cache_st;
+	char cache_path[PATH_MAX];
+	size_t length;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	length = strlen(path);
+	if (fstat(fd, &cache_st) < 0 ||
+	    pread(fd, &header, sizeof header, 0) != sizeof header ||
+	    header.magic != IMAGE_CACHE_MAGIC ||
+	    header.format != PIXMAN_a8r8g8b8 ||
+	    header.request_width != width ||
+	    header.request_height != height ||
+	    header.mtime != image_cache_mtime(st) ||
+	    header.size != (uint64_t) st->st_size ||
+	    header.path_length != length || length >= sizeof cache_path ||
+	    header.width <= 0 || header.height <= 0 ||
+	    header.stride < header.width * 4 ||
+	    (uint64_t) cache_st.st_size < IMAGE_CACHE_ALIGN +
+		(uint64_t) header.stride * header.height ||
+	    pread(fd, cache_path, length, sizeof header) != (ssize_t) length ||
+	    memcmp(cache_path, path, length) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	map = malloc(sizeof *map);
+	if (map == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	map->length = IMAGE_CACHE_ALIGN +
+		(size_t) header.stride * header.height;
+	map->data = mmap(NULL, map->length, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map->data == MAP_FAILED) {
+		free(map);
+		return NULL;
+	}
+
+	/* read-only: the loaders' callers only ever read images */
+	image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+					 header.width, header.height,
+					 (uint32_t *) ((char *) map->data +
+						       IMAGE_CACHE_ALIGN),
+					 header.stride);
+	if (image == NULL) {
+		munmap(map->data, map->length);
+		free(map);
+		return NULL;
+	}
+	pixman_image_set_destroy_function(image, image_cache_destroy_func, map);
+
+	return image;
+}
+
+static void
+image_cache_store(const char *name, const char *path, const struct stat *st,
+		  int width, int height, pixman_image_t *image)
+{
+	struct image_cache_header header;
+	char *tmp;
+	size_t length;
+	int fd;
+
+	if (pixman_image_get_format(image) != PIXMAN_a8r8g8b8)
+		return;
+
+	memset(&header, 0, sizeof header);
+	header.magic = IMAGE_CACHE_MAGIC;
+	header.format = PIXMAN_a8r8g8b8;
+	header.width = pixman_image_get_width(image);
+	header.height = pixman_image_get_height(image);
+	header.stride = pixman_image_get_stride(image);
+	header.request_width = width;
+	header.request_height = height;
+	header.path_length = strlen(path);
+	header.mtime = image_cache_mtime(st);
+	header.size = st->st_size;
+
+	length = (size_t) header.stride * header.height;
+	if (sizeof header + header.path_length > IMAGE_CACHE_ALIGN)
+		return;
+
+	if (asprintf(&tmp, "%s.XXXXXX", name) < 0)
+		return;
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		free(tmp);
+		return;
+	}
+
+	if (pwrite(fd, &header, sizeof header, 0) != sizeof header ||
+	    pwrite(fd, path, header.path_length, sizeof header) !=
+	    (ssize_t) header.path_length ||
+	    pwrite(fd, pixman_image_get_data(image), length,
+		   IMAGE_CACHE_ALIGN) != (ssize_t) length ||
+	    rename(tmp, name) < 0)
+		unlink(tmp);
+
+	close(fd);
+	free(tmp);
+}
+
+pixman_image_t *
+load_image_scaled(const char *filename, int width, int height)
+{
+	pixman_image_t *image;
+	struct stat st;
+	char *path, *name = NULL;
+
+	path = realpath(filename, NULL);
+	if (path && stat(path, &st) == 0)
+		name = image_cache_name(path, width, height);
+
+	if (name) {
+		image = image_cache_load(name, path, &st, width, height);
+		if (image) {
+			free(name);
+			free(path);
+			return image;
+		}
+	}
+
+	image = decode_image(filename, width, height);
+
+	if (name && image)
+		image_cache_store(name, path, &st, width, height, image);
+
+	free(name);
+	free(path);
+
+	return image;
+}
+
+pixman_image_t *
+load_image(const char *filename)
+{
+	return load_image_scaled(filename, 0, 0);
+}
+
+struct image_load {
+	char *filename;
+	int width, height;
+	pixman_image_t *image;
+	pthread_t thread;
+	int fd;
+};
+
+static void *
+image_load_thread(void *data)
+{
+	struct image_load *load = data;
+	uint64_t one = 1;
+
+	load->image = load_image_scaled(load->filename,
+					load->width, load->height);
+	if (write(load->fd, &one, sizeof one) < 0)
+		fprintf(stderr, "image loader: failed to wake up: %m\n");
+
+	return NULL;
+}
+
+struct image_load *
+image_load_start(const char *filename, int width, int height)
+{
+	struct image_load *load;
+
+	load = malloc(sizeof *load);
+	if (load == NULL)
+		return NULL;
+
+	load->filename = strdup(filename);
+	load->width = width;
+	load->height = height;
+	load->image = NULL;
+	load->fd = eventfd(0, EFD_CLOEXEC);
+	if (load->filename == NULL || load->fd < 0) {
+		if (load->fd >= 0)
+			close(load->fd);
+		free(load->filename);
+		free(load);
+		return NULL;
+	}
+
+	if (pthread_create(&load->thread, NULL,
+			   image_load_thread, load) != 0) {
+		fprintf(stderr, "image loader: no thread, "
+			"loading %s right away\n", filename);
+		load->thread = pthread_self();
+		image_load_thread(load);
+	}
+
+	return load;
+}
+
+int
+image_load_get_fd(struct image_load *load)
+{
+	return load->fd;
+}
+
+pixman_image_t *
+image_load_finish(struct image_load *load)
+{
+	pixman_image_t *image;
+
+	if (!pthread_equal(load->thread, pthread_self()))
+		pthread_join(load->thread, NULL);
+
+	image = load->image;
+	close(load->fd);
+	free(load->filename);
+	free(load);
+
+	return image;
+}
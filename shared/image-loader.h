@@ -28,4 +28,25 @@
 pixman_image_t *
 load_image(const char *filename);
 
+/* Formats that can scale while decoding, JPEG, come out as small as
+ * they can while still at least width x height. */
+pixman_image_t *
+load_image_scaled(const char *filename, int width, int height);
+
+/*
+ * Loads an image on a thread of its own.  The fd turns readable when
+ * it is done, and image_load_finish() then returns the image, or NULL
+ * if it couldn't be loaded.  Finishing early waits for the thread.
+ */
+struct image_load;
+
+struct image_load *
+image_load_start(const char *filename, int width, int height);
+
+int
+image_load_get_fd(struct image_load *load);
+
+pixman_image_t *
+image_load_finish(struct image_load *load);
+
 #endif
@@ -54,15 +54,74 @@ weston_matrix_init(struct weston_matrix *matrix)
 	memcpy(matrix, &identity, sizeof identity);
 }
 
+/*
+ * The type bits say which of the API calls built a matrix, and so which
+ * entries can differ from the identity:
+ *
+ *  - none: the identity
+ *  - TRANSLATE, SCALE: the diagonal and the translation column
+ *  - and ROTATE: also the upper left 2x2, as rotate_xy only turns
+ *    the x-y plane
+ *  - OTHER: anything
+ *
+ * Products keep to the class of their factors, so multiply and invert
+ * only touch those entries, with the same arithmetic as the general
+ * code, unless a factor is OTHER.
+ */
+#define MATRIX_AFFINE_XY \
+	(WESTON_MATRIX_TRANSFORM_TRANSLATE | WESTON_MATRIX_TRANSFORM_SCALE | \
+	 WESTON_MATRIX_TRANSFORM_ROTATE)
+
 /* m <- n * m, that is, m is multiplied on the LEFT. */
 WL_EXPORT void
 weston_matrix_multiply(struct weston_matrix *m, const struct weston_matrix *n)
 {
 	struct weston_matrix tmp;
 	const float *row, *column;
+	unsigned int type = m->type | n->type;
+	float m0, m1, m4, m5, m12, m13;
 	div_t d;
 	int i, j;
 
+	if (n->type == 0)
+		return;
+
+	if (m->type == 0) {
+		memcpy(m, n, sizeof *m);
+		return;
+	}
+
+	if (!(type & ~(WESTON_MATRIX_TRANSFORM_TRANSLATE |
+		       WESTON_MATRIX_TRANSFORM_SCALE))) {
+		m->d[12] = n->d[0] * m->d[12] + n->d[12];
+		m->d[13] = n->d[5] * m->d[13] + n->d[13];
+		m->d[14] = n->d[10] * m->d[14] + n->d[14];
+		m->d[0] *= n->d[0];
+		m->d[5] *= n->d[5];
+		m->d[10] *= n->d[10];
+		m->type = type;
+		return;
+	}
+
+	if (!(type & ~MATRIX_AFFINE_XY)) {
+		m0 = m->d[0];
+		m1 = m->d[1];
+		m4 = m->d[4];
+		m5 = m->d[5];
+		m12 = m->d[12];
+		m13 = m->d[13];
+		m->d[0] = n->d[0] * m0 + n->d[4] * m1;
+		m->d[1] = n->d[1] * m0 + n->d[5] * m1;
+		m->d[4] = n->d[0] * m4 + n->d[4] * m5;
+		m->d[5] = n->d[1] * m4 + n->d[5] * m5;
+		m->d[12] = n->d[0] * m12 + n->d[4] * m13 + n->d[12];
+		m->d[13] = n->d[1] * m12 + n->d[5] * m13 + n->d[13];
+		m->d[14] = n->d[10] * m->d[14] + n->d[14];
+		m->d[10] *= n->d[10];
+		m->type = type;
+		return;
+	}
+
 	for (i = 0; i < 16; i++) {
 		tmp.d[i] = 0;
 		d = div(i, 4);
@@ -251,6 +310,39 @@ inverse_transform(const double *LU, const unsigned *p, float *v)
 		v[j] = b[j];
 }
 
+/* Inverse of a matrix of the classes above other than OTHER: the 2x2
+ * block, then the translation through it, and z on its own. */
+static int
+matrix_invert_affine_xy(struct weston_matrix *inverse,
+			const struct weston_matrix *matrix)
+{
+	struct weston_matrix copy = *matrix;	/* inverse may be matrix */
+	const float *m = copy.d;
+	double det, i0, i1, i4, i5;
+
+	det = (double) m[0] * m[5] - (double) m[4] * m[1];
+	if (fabs(det) < 1e-9 || fabs(m[10]) < 1e-9)
+		return -1;
+
+	i0 = m[5] / det;
+	i1 = -m[1] / det;
+	i4 = -m[4] / det;
+	i5 = m[0] / det;
+
+	weston_matrix_init(inverse);
+	inverse->d[0] = i0;
+	inverse->d[1] = i1;
+	inverse->d[4] = i4;
+	inverse->d[5] = i5;
+	inverse->d[10] = 1.0 / m[10];
+	inverse->d[12] = -(i0 * m[12] + i4 * m[13]);
+	inverse->d[13] = -(i1 * m[12] + i5 * m[13]);
+	inverse->d[14] = -m[14] / (double) m[10];
+	inverse->type = copy.type;
+
+	return 0;
+}
+
 WL_EXPORT int
 weston_matrix_invert(struct weston_matrix *inverse,
 		     const struct weston_matrix *matrix)
@@ -258,6 +350,27 @@ weston_matrix_invert(struct weston_matrix *inverse,
 	double LU[16];		/* column-major */
 	unsigned perm[4];	/* permutation */
 	unsigned c;
+	float x, y, z;
+
+	if (matrix->type == 0) {
+		weston_matrix_init(inverse);
+		return 0;
+	}
+
+	if (matrix->type == WESTON_MATRIX_TRANSFORM_TRANSLATE) {
+		x = matrix->d[12];
+		y = matrix->d[13];
+		z = matrix->d[14];
+		weston_matrix_init(inverse);
+		inverse->d[12] = -x;
+		inverse->d[13] = -y;
+		inverse->d[14] = -z;
+		inverse->type = WESTON_MATRIX_TRANSFORM_TRANSLATE;
+		return 0;
+	}
+
+	if (!(matrix->type & ~MATRIX_AFFINE_XY))
+		return matrix_invert_affine_xy(inverse, matrix);
 
 	if (matrix_invert(LU, perm, matrix) < 0)
 		return -1;
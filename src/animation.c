@@ -41,15 +41,41 @@ weston_spring_init(struct weston_spring *spring,
 	spring->target = target;
 }
 
+static void
+matrix2_multiply(double *r, const double *m)
+{
+	double r0 = r[0] * m[0] + r[1] * m[2];
+	double r1 = r[0] * m[1] + r[1] * m[3];
+	double r2 = r[2] * m[0] + r[3] * m[2];
+	double r3 = r[2] * m[1] + r[3] * m[3];
+
+	r[0] = r0;
+	r[1] = r1;
+	r[2] = r2;
+	r[3] = r3;
+}
+
+/*
+ * The spring moves in fixed 4 ms steps.  Relative to the target, each
+ * step is linear in the last two positions:
+ *
+ *	e' = (2 - a - b) e - (1 - b) e_prev
+ *
+ * with a = k h^2 / 10 and b = (1 + friction) h^2.  Any number of steps
+ * is then one power of that 2x2 step matrix, taken by squaring, so
+ * catching up after a stall costs a handful of multiplications rather
+ * than one iteration per step.
+ */
 WL_EXPORT void
 weston_spring_update(struct weston_spring *spring, uint32_t msec)
 {
-	double force, v, current, step;
+	double step = 0.01, a, b, e, e_prev;
+	double m[4], r[4] = { 1.0, 0.0, 0.0, 1.0 };
+	uint32_t n;
 
-	/* Limit the number of executions of the loop below by ensuring that
-	 * the timestamp for last update of the spring is no more than 1s ago.
-	 * This handles the case where time moves backwards or forwards in
-	 * large jumps.
+	/* Limit the number of steps by ensuring that the timestamp for
+	 * last update of the spring is no more than 1s ago.  This handles
+	 * the case where time moves backwards or forwards in large jumps.
 	 */
 	if (msec - spring->timestamp > 1000) {
 		weston_log("unexpectedly large timestamp jump (from %u to %u)\n",
@@ -57,36 +83,29 @@ weston_spring_update(struct weston_spring *spring, uint32_t msec)
 		spring->timestamp = msec - 1000;
 	}
 
-	step = 0.01;
-	while (4 < msec - spring->timestamp) {
-		current = spring->current;
-		v = current - spring->previous;
-		force = spring->k * (spring->target - current) / 10.0 +
-			(spring->previous - current) - v * spring->friction;
-
-		spring->current =
-			current + (current - spring->previous) +
-			force * step * step;
-		spring->previous = current;
-
-#if 0
-		if (spring->current >= 1.0) {
-#ifdef TWEENER_BOUNCE
-			spring->current = 2.0 - spring->current;
-			spring->previous = 2.0 - spring->previous;
-#else
-			spring->current = 1.0;
-			spring->previous = 1.0;
-#endif
-		}
-
-		if (spring->current <= 0.0) {
-			spring->current = 0.0;
-			spring->previous = 0.0;
-		}
-#endif
-		spring->timestamp += 4;
+	if (msec - spring->timestamp <= 4)
+		return;
+
+	n = (msec - spring->timestamp - 1) / 4;
+	spring->timestamp += n * 4;
+
+	a = spring->k * step * step / 10.0;
+	b = (1.0 + spring->friction) * step * step;
+	m[0] = 2.0 - a - b;
+	m[1] = b - 1.0;
+	m[2] = 1.0;
+	m[3] = 0.0;
+
+	for (; n > 0; n >>= 1) {
+		if (n & 1)
+			matrix2_multiply(r, m);
+		matrix2_multiply(m, m);
 	}
+
+	e = spring->current - spring->target;
+	e_prev = spring->previous - spring->target;
+	spring->current = spring->target + r[0] * e + r[1] * e_prev;
+	spring->previous = spring->target + r[2] * e + r[3] * e_prev;
 }
 
 WL_EXPORT int
@@ -21,6 +21,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "compositor.h"
 
@@ -32,8 +33,108 @@ struct weston_binding {
 	void *handler;
 	void *data;
 	struct wl_list link;
+	struct weston_binding_table *table;
+	struct weston_binding *hash_next;
 };
 
+#define BINDING_TABLE_MIN_SIZE 64
+
+/* Only one of key, button and axis is set, depending on the list. */
+static uint32_t
+binding_code(struct weston_binding *binding)
+{
+	return binding->key | binding->button | binding->axis;
+}
+
+static uint32_t
+binding_hash(uint32_t code, uint32_t modifier)
+{
+	return (code * 2654435761u) ^ (modifier * 40503u);
+}
+
+/*
+ * Builds the hash of the bindings in list.  The chains keep the order
+ * of the list, which is the order the handlers run in.  It is only
+ * called on the first event after a binding was added or destroyed, so
+ * a handler adding bindings doesn't change the chain being walked.
+ */
+static void
+binding_table_update(struct weston_binding_table *table,
+		     struct wl_list *list)
+{
+	struct weston_binding *binding, **buckets;
+	uint32_t size, count, h;
+
+	if (!table->dirty && table->buckets)
+		return;
+
+	count = wl_list_length(list);
+	size = BINDING_TABLE_MIN_SIZE;
+	while (size < count * 2)
+		size *= 2;
+
+	if (size != table->mask + 1 || !table->buckets) {
+		buckets = realloc(table->buckets, size * sizeof *buckets);
+		if (buckets == NULL)
+			return;
+		table->buckets = buckets;
+		table->mask = size - 1;
+	}
+	memset(table->buckets, 0, size * sizeof *table->buckets);
+
+	wl_list_for_each_reverse(binding, list, link) {
+		h = binding_hash(binding_code(binding), binding->modifier) &
+			table->mask;
+		binding->hash_next = table->buckets[h];
+		table->buckets[h] = binding;
+	}
+
+	table->dirty = 0;
+}
+
+/* The first binding for code and modifier, NULL for the many keys
+ * that have no binding. */
+static struct weston_binding *
+binding_table_lookup(struct weston_binding_table *table,
+		     struct wl_list *list, uint32_t code, uint32_t modifier)
+{
+	struct weston_binding *binding;
+
+	binding_table_update(table, list);
+	if (table->buckets == NULL)
+		return NULL;
+
+	binding = table->buckets[binding_hash(code, modifier) & table->mask];
+	while (binding && (binding_code(binding) != code ||
+			   binding->modifier != modifier))
+		binding = binding->hash_next;
+
+	return binding;
+}
+
+static struct weston_binding *
+binding_next(struct weston_binding *binding)
+{
+	uint32_t code = binding_code(binding);
+	uint32_t modifier = binding->modifier;
+
+	binding = binding->hash_next;
+	while (binding && (binding_code(binding) != code ||
+			   binding->modifier != modifier))
+		binding = binding->hash_next;
+
+	return binding;
+}
+
+WL_EXPORT void
+weston_binding_table_release(struct weston_binding_table *table)
+{
+	free(table->buckets);
+	table->buckets = NULL;
+	table->mask = 0;
+	table->dirty = 0;
+}
+
 static struct weston_binding *
 weston_compositor_add_binding(struct weston_compositor *compositor,
 			      uint32_t key, uint32_t button, uint32_t axis,
@@ -51,6 +152,8 @@ weston_compositor_add_binding(struct weston_compositor *compositor,
 	binding->modifier = modifier;
 	binding->handler = handler;
 	binding->data = data;
+	binding->table = NULL;
+	binding->hash_next = NULL;
 
 	return binding;
 }
@@ -69,6 +172,8 @@ weston_compositor_add_key_binding(struct weston_compositor *compositor,
 		return NULL;
 
 	wl_list_insert(compositor->key_binding_list.prev, &binding->link);
+	binding->table = &compositor->key_binding_table;
+	binding->table->dirty = 1;
 
 	return binding;
 }
@@ -87,6 +192,8 @@ weston_compositor_add_button_binding(struct weston_compositor *compositor,
 		return NULL;
 
 	wl_list_insert(compositor->button_binding_list.prev, &binding->link);
+	binding->table = &compositor->button_binding_table;
+	binding->table->dirty = 1;
 
 	return binding;
 }
@@ -105,6 +212,8 @@ weston_compositor_add_axis_binding(struct weston_compositor *compositor,
 		return NULL;
 
 	wl_list_insert(compositor->axis_binding_list.prev, &binding->link);
+	binding->table = &compositor->axis_binding_table;
+	binding->table->dirty = 1;
 
 	return binding;
 }
@@ -128,6 +237,8 @@ weston_compositor_add_debug_binding(struct weston_compositor *compositor,
 WL_EXPORT void
 weston_binding_destroy(struct weston_binding *binding)
 {
+	if (binding->table)
+		binding->table->dirty = 1;
 	wl_list_remove(&binding->link);
 	free(binding);
 }
@@ -216,18 +327,19 @@ weston_compositor_run_key_binding(struct weston_compositor *compositor,
 	if (state == WL_KEYBOARD_KEY_STATE_RELEASED)
 		return;
 
-	wl_list_for_each(b, &compositor->key_binding_list, link) {
-		if (b->key == key && b->modifier == seat->modifier_state) {
-			weston_key_binding_handler_t handler = b->handler;
-			handler(&seat->seat, time, key, b->data);
-
-			/* If this was a key binding and it didn't
-			 * install a keyboard grab, install one now to
-			 * swallow the key release. */
-			if (seat->seat.keyboard->grab ==
-			    &seat->seat.keyboard->default_grab)
-				install_binding_grab(&seat->seat, time, key);
-		}
+	b = binding_table_lookup(&compositor->key_binding_table,
+				 &compositor->key_binding_list,
+				 key, seat->modifier_state);
+	for (; b; b = binding_next(b)) {
+		weston_key_binding_handler_t handler = b->handler;
+		handler(&seat->seat, time, key, b->data);
+
+		/* If this was a key binding and it didn't
+		 * install a keyboard grab, install one now to
+		 * swallow the key release. */
+		if (seat->seat.keyboard->grab ==
+		    &seat->seat.keyboard->default_grab)
+			install_binding_grab(&seat->seat, time, key);
 	}
 }
 
@@ -242,11 +354,12 @@ weston_compositor_run_button_binding(struct weston_compositor *compositor,
 	if (state == WL_POINTER_BUTTON_STATE_RELEASED)
 		return;
 
-	wl_list_for_each(b, &compositor->button_binding_list, link) {
-		if (b->button == button && b->modifier == seat->modifier_state) {
-			weston_button_binding_handler_t handler = b->handler;
-			handler(&seat->seat, time, button, b->data);
-		}
+	b = binding_table_lookup(&compositor->button_binding_table,
+				 &compositor->button_binding_list,
+				 button, seat->modifier_state);
+	for (; b; b = binding_next(b)) {
+		weston_button_binding_handler_t handler = b->handler;
+		handler(&seat->seat, time, button, b->data);
 	}
 }
 
@@ -258,12 +371,13 @@ weston_compositor_run_axis_binding(struct weston_compositor *compositor,
 {
 	struct weston_binding *b;
 
-	wl_list_for_each(b, &compositor->axis_binding_list, link) {
-		if (b->axis == axis && b->modifier == seat->modifier_state) {
-			weston_axis_binding_handler_t handler = b->handler;
-			handler(&seat->seat, time, axis, value, b->data);
-			return 1;
-		}
+	b = binding_table_lookup(&compositor->axis_binding_table,
+				 &compositor->axis_binding_list,
+				 axis, seat->modifier_state);
+	if (b) {
+		weston_axis_binding_handler_t handler = b->handler;
+		handler(&seat->seat, time, axis, value, b->data);
+		return 1;
 	}
 
 	return 0;
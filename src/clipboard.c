@@ -27,15 +27,29 @@
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/uio.h>
+#include <sys/sendfile.h>
 
 #include "compositor.h"
+#include "../shared/os-compatibility.h"
 
+/* most bytes moved per wakeup, in either direction */
+#define CLIPBOARD_CHUNK (64 * 1024)
+
+/*
+ * The contents are kept in an anonymous file rather than on the heap
+ * and are moved with splice() from the source pipe into it and from it
+ * into the pipes of pasting clients.  Clients that catch up with the
+ * data still being read wait for more on client_list.
+ */
 struct clipboard_source {
 	struct wl_data_source base;
-	struct wl_array contents;
+	int fd;
+	size_t size;
 	struct clipboard *clipboard;
 	struct wl_event_source *event_source;
+	struct wl_list client_list;
 	uint32_t serial;
 	int refcount;
 };
@@ -48,6 +62,8 @@ struct clipboard {
 };
 
 static void clipboard_client_create(struct clipboard_source *source, int fd);
+static void clipboard_source_wake_clients(struct clipboard_source *source);
+static void clipboard_source_drop_clients(struct clipboard_source *source);
 
 static void
 clipboard_source_unref(struct clipboard_source *source)
@@ -65,34 +81,65 @@ clipboard_source_unref(struct clipboard_source *source)
 	s = source->base.mime_types.data;
 	free(*s);
 	wl_array_release(&source->base.mime_types);
-	wl_array_release(&source->contents);
+	close(source->fd);
 	free(source);
 }
 
+static ssize_t
+clipboard_source_read(struct clipboard_source *source, int fd)
+{
+	char buffer[4096];
+	loff_t offset;
+	ssize_t len;
+
+	offset = source->size;
+	len = splice(fd, NULL, source->fd, &offset, CLIPBOARD_CHUNK,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (len >= 0 || errno != EINVAL)
+		return len;
+
+	/* the file system can't splice, copy it */
+	len = read(fd, buffer, sizeof buffer);
+	if (len > 0 && pwrite(source->fd, buffer, len, source->size) != len)
+		return -1;
+
+	return len;
+}
+
 static int
 clipboard_source_data(int fd, uint32_t mask, void *data)
 {
 	struct clipboard_source *source = data;
 	struct clipboard *clipboard = source->clipboard;
-	char *p;
-	int len, size;
+	int max_size = clipboard->seat->compositor->clipboard_max_size;
+	ssize_t len;
 
-	if (source->contents.alloc - source->contents.size < 1024) {
-		wl_array_add(&source->contents, 1024);
-		source->contents.size -= 1024;
+	len = clipboard_source_read(source, fd);
+	if (len < 0 && errno == EAGAIN)
+		return 1;
+
+	if (len > 0 && source->size + len > (size_t) max_size << 20) {
+		weston_log("clipboard: selection larger than %d MiB, "
+			   "not keeping it\n", max_size);
+		len = -1;
 	}
 
-	p = source->contents.data + source->contents.size;
-	size = source->contents.alloc - source->contents.size;
-	len = read(fd, p, size);
-	if (len == 0) {
-		wl_event_source_remove(source->event_source);
-		source->event_source = NULL;
-	} else if (len < 0) {
+	if (len > 0) {
+		source->size += len;
+		clipboard_source_wake_clients(source);
+		return 1;
+	}
+
+	wl_event_source_remove(source->event_source);
+	source->event_source = NULL;
+	close(fd);
+	if (len < 0) {
+		/* pasting clients would get a truncated copy */
+		clipboard_source_drop_clients(source);
 		clipboard_source_unref(source);
 		clipboard->source = NULL;
 	} else {
-		source->contents.size += len;
+		clipboard_source_wake_clients(source);
 	}
 
 	return 1;
@@ -134,7 +181,20 @@ clipboard_source_create(struct clipboard *clipboard,
 	char **s;
 
 	source = malloc(sizeof *source);
-	wl_array_init(&source->contents);
+	if (source == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	source->fd = os_create_anonymous_file(0);
+	if (source->fd < 0) {
+		close(fd);
+		free(source);
+		return NULL;
+	}
+
+	source->size = 0;
+	wl_list_init(&source->client_list);
 	wl_array_init(&source->base.mime_types);
 	source->base.accept = clipboard_source_accept;
 	source->base.send = clipboard_source_send;
@@ -157,31 +217,89 @@ clipboard_source_create(struct clipboard *clipboard,
 
 struct clipboard_client {
 	struct wl_event_source *event_source;
+	struct wl_list link;
+	int fd;
 	size_t offset;
 	struct clipboard_source *source;
 };
 
+static void
+clipboard_source_wake_clients(struct clipboard_source *source)
+{
+	struct clipboard_client *client;
+
+	wl_list_for_each(client, &source->client_list, link)
+		wl_event_source_fd_update(client->event_source,
+					  WL_EVENT_WRITABLE);
+}
+
+static ssize_t
+clipboard_client_write(struct clipboard_client *client, size_t size)
+{
+	loff_t offset;
+	ssize_t len;
+
+	if (size > CLIPBOARD_CHUNK)
+		size = CLIPBOARD_CHUNK;
+
+	offset = client->offset;
+	len = splice(client->source->fd, &offset, client->fd, NULL, size,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (len >= 0 || errno != EINVAL)
+		return len;
+
+	/* not a pipe, sendfile() takes any destination */
+	offset = client->offset;
+	return sendfile(client->fd, client->source->fd, &offset, size);
+}
+
+static void
+clipboard_client_destroy(struct clipboard_client *client)
+{
+	close(client->fd);
+	wl_event_source_remove(client->event_source);
+	wl_list_remove(&client->link);
+	clipboard_source_unref(client->source);
+	free(client);
+}
+
+static void
+clipboard_source_drop_clients(struct clipboard_source *source)
+{
+	struct clipboard_client *client, *next;
+
+	wl_list_for_each_safe(client, next, &source->client_list, link)
+		clipboard_client_destroy(client);
+}
+
 static int
 clipboard_client_data(int fd, uint32_t mask, void *data)
 {
 	struct clipboard_client *client = data;
-	char *p;
-	size_t size;
-	int len;
-
-	size = client->source->contents.size;
-	p = client->source->contents.data;
-	len = write(fd, p + client->offset, size - client->offset);
-	if (len > 0)
+	struct clipboard_source *source = client->source;
+	ssize_t len;
+
+	if (client->offset < source->size) {
+		len = clipboard_client_write(client,
+					     source->size - client->offset);
+		if (len < 0 && errno == EAGAIN)
+			return 1;
+		if (len <= 0) {
+			clipboard_client_destroy(client);
+			return 1;
+		}
 		client->offset += len;
-
-	if (client->offset == size || len <= 0) {
-		close(fd);
-		wl_event_source_remove(client->event_source);
-		clipboard_source_unref(client->source);
-		free(client);
 	}
 
+	if (client->offset < source->size)
+		return 1;
+
+	if (source->event_source == NULL)
+		clipboard_client_destroy(client);
+	else
+		/* caught up, wait for the source to read more */
+		wl_event_source_fd_update(client->event_source, 0);
+
 	return 1;
 }
 
@@ -194,10 +312,17 @@ clipboard_client_create(struct clipboard_source *source, int fd)
 		wl_display_get_event_loop(seat->compositor->wl_display);
 
 	client = malloc(sizeof *client);
+	if (client == NULL) {
+		close(fd);
+		return;
+	}
 
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	client->fd = fd;
 	client->offset = 0;
 	client->source = source;
 	source->refcount++;
+	wl_list_insert(&source->client_list, &client->link);
 	client->event_source =
 		wl_event_loop_add_fd(loop, fd, WL_EVENT_WRITABLE,
 				     clipboard_client_data, client);
@@ -229,10 +354,14 @@ clipboard_set_selection(struct wl_listener *listener, void *data)
 
 	clipboard->source = NULL;
 
+	if (seat->compositor->clipboard_max_size == 0)
+		return;
+
 	mime_types = source->mime_types.data;
 
 	if (pipe2(p, O_CLOEXEC) == -1)
 		return;
+	fcntl(p[0], F_SETFL, O_NONBLOCK);
 
 	source->send(source, mime_types[0], p[1]);
 
@@ -23,6 +23,10 @@
 
 #define _GNU_SOURCE
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,7 +34,10 @@
 #include <unistd.h>
 #include <linux/input.h>
 #include <assert.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -42,14 +49,22 @@
 
 #include "compositor.h"
 #include "gl-renderer.h"
+#ifdef ENABLE_EGL
+#include <EGL/eglext.h>
+#include "weston-egl-ext.h"
+#endif
 #include "pixman-renderer.h"
 #include "udev-seat.h"
+#include "evdev.h"
 #include "launcher-util.h"
+#include "trace.h"
+#include "presentation-server-protocol.h"
 
 static int option_current_mode = 0;
 static char *output_name;
 static char *output_mode;
 static char *output_transform;
+static char *output_clone;
 static struct wl_list configured_output_list;
 
 enum output_config {
@@ -64,6 +79,7 @@ enum output_config {
 struct drm_configured_output {
 	char *name;
 	char *mode;
+	char *clone;
 	uint32_t transform;
 	int32_t width, height;
 	drmModeModeInfo crtc_mode;
@@ -75,7 +91,6 @@ struct drm_compositor {
 	struct weston_compositor base;
 
 	struct udev *udev;
-	struct wl_event_source *drm_source;
 
 	struct udev_monitor *udev_monitor;
 	struct wl_event_source *udev_drm_source;
@@ -85,10 +100,8 @@ struct drm_compositor {
 		int fd;
 	} drm;
 	struct gbm_device *gbm;
-	uint32_t *crtcs;
-	int num_crtcs;
-	uint32_t crtc_allocator;
-	uint32_t connector_allocator;
+	struct drm_gpu *primary_gpu;
+	struct wl_list gpu_list;
 	struct tty *tty;
 
 	/* we need these parameters in order to not fail drmModeAddFB2()
@@ -106,8 +119,70 @@ struct drm_compositor {
 	int cursors_are_broken;
 
 	int use_pixman;
+	int atomic_modeset;
+
+#ifdef ENABLE_EGL
+	/* for importing YUV client buffers plane by plane, see
+	 * drm_import_yuv_buffer() */
+	PFNEGLQUERYWAYLANDBUFFERWL query_buffer;
+	PFNEGLCREATEIMAGEKHRPROC create_image;
+	PFNEGLDESTROYIMAGEKHRPROC destroy_image;
+#endif
 
 	uint32_t prev_state;
+
+	struct wl_listener config_listener;
+};
+
+/*
+ * A DRM device with outputs on it.  The primary GPU, the one in
+ * drm_compositor.drm, renders everything.  Outputs of secondary GPUs
+ * show what was rendered for them as PRIME buffers imported into
+ * their device or, where that fails, copied into dumb buffers of it.
+ * Every device has its own event source, so a slow one never holds
+ * back the page flips of another.
+ */
+struct drm_gpu {
+	struct drm_compositor *compositor;
+	struct wl_list link;
+
+	int id;
+	int fd;
+	struct wl_event_source *source;
+
+	uint32_t *crtcs;
+	int num_crtcs;
+	uint32_t crtc_allocator;
+	uint32_t connector_allocator;
+
+	int prime_import;
+
+	/* hotplug probing, see struct drm_probe */
+	struct drm_probe *probe;
+	struct udev_device *probe_pending;
+	int probe_fd;
+	struct wl_event_source *probe_source;
+	drmModeConnector **probed;
+	int count_probed;
+};
+
+/*
+ * Plane properties used by the atomic commit path, looked up by name
+ * once per plane.
+ */
+enum drm_plane_prop {
+	PLANE_PROP_TYPE,
+	PLANE_PROP_FB_ID,
+	PLANE_PROP_CRTC_ID,
+	PLANE_PROP_SRC_X,
+	PLANE_PROP_SRC_Y,
+	PLANE_PROP_SRC_W,
+	PLANE_PROP_SRC_H,
+	PLANE_PROP_CRTC_X,
+	PLANE_PROP_CRTC_Y,
+	PLANE_PROP_CRTC_W,
+	PLANE_PROP_CRTC_H,
+	PLANE_PROP_COUNT
 };
 
 struct drm_mode {
@@ -122,10 +197,13 @@ struct drm_fb {
 	uint32_t fb_id, stride, handle, size;
 	int fd;
 	int is_client_buffer;
+	int is_imported;
 	struct weston_buffer_reference buffer_ref;
 
 	/* Used by gbm fbs */
 	struct gbm_bo *bo;
+	/* the other planes of a YUV client buffer, bo being the first */
+	struct gbm_bo *planes[2];
 
 	/* Used by dumb fbs */
 	void *map;
@@ -134,6 +212,7 @@ struct drm_fb {
 struct drm_output {
 	struct weston_output   base;
 
+	struct drm_gpu *gpu;
 	char *name;
 	uint32_t crtc_id;
 	int pipe;
@@ -142,6 +221,17 @@ struct drm_output {
 
 	int vblank_pending;
 	int page_flip_pending;
+	int atomic_pending;
+
+	uint32_t primary_plane_id;
+	uint32_t primary_props[PLANE_PROP_COUNT];
+	uint32_t cursor_plane_id;
+	uint32_t cursor_props[PLANE_PROP_COUNT];
+	uint32_t cursor_fb_id[2];
+
+	/* Formats the primary plane can scan out client buffers in. */
+	uint32_t scanout_formats[16];
+	int count_scanout_formats;
 
 	struct gbm_surface *surface;
 	struct gbm_bo *cursor_bo[2];
@@ -151,11 +241,25 @@ struct drm_output {
 	int current_cursor;
 	struct drm_fb *current, *next;
 	struct backlight *backlight;
+	struct backlight_controller *backlight_controller;
 
 	struct drm_fb *dumb[2];
 	pixman_image_t *image[2];
 	int current_image;
 	pixman_region32_t previous_damage;
+
+	/* Secondary GPU outputs without PRIME read each gl frame back
+	 * into the dumb buffers. */
+	int copy_frames;
+	pixman_region32_t copy_damage;
+	struct wl_listener frame_listener;
+	struct wl_event_source *lost_frame_source;
+
+	/* The crtc's gamma ramp as we found it, followed by room for the
+	 * faded one, three channels of gamma_size entries each. */
+	uint16_t *gamma;
+	uint32_t gamma_size;
+	float fade;
 };
 
 /*
@@ -180,24 +284,70 @@ struct drm_sprite {
 	uint32_t dest_x, dest_y;
 	uint32_t dest_w, dest_h;
 
+	uint32_t props[PLANE_PROP_COUNT];
+
+	/* set while the sprite scales the frames of a clone */
+	struct drm_clone *clone;
+
 	uint32_t formats[];
 };
 
+/*
+ * A connector whose [output] section has clone=NAME shows the frames
+ * of output NAME on a crtc of its own, rather than being an output
+ * that renders the same scene once more.  The clone flips to the
+ * source's framebuffers as they are, or has a sprite scale them when
+ * its mode is of another size.  A framebuffer goes back to the
+ * renderer only once the source and all its clones stopped showing
+ * it, see drm_output_release_shown_fb().
+ */
+struct drm_clone {
+	struct wl_list link;		/* clone_list */
+	struct drm_output *source;
+	char *name;
+	uint32_t crtc_id;
+	int pipe;
+	uint32_t connector_id;
+	drmModeCrtcPtr original_crtc;
+	drmModeModeInfo mode;
+
+	int mode_set;
+	int flip_pending;
+	/* freed once its pending flip is done */
+	int destroyed;
+	struct drm_fb *current, *next;
+
+	/* with a mode of another size than the source's */
+	struct drm_sprite *sprite;
+	struct drm_fb *black;
+};
+
+/* Flip and vblank events only come with the pointer they were queued
+ * with, so clones are told from outputs by being on this list. */
+static struct wl_list clone_list;
+
 static const char default_seat[] = "seat0";
 
 static void
 drm_output_set_cursor(struct drm_output *output);
 
+#ifdef HAVE_DRM_ATOMIC
+static int
+drm_output_repaint_atomic(struct drm_output *output);
+
+static int
+drm_output_test_sprites(struct drm_output *output);
+#endif
+
 static int
 drm_sprite_crtc_supported(struct weston_output *output_base, uint32_t supported)
 {
-	struct weston_compositor *ec = output_base->compositor;
-	struct drm_compositor *c =(struct drm_compositor *) ec;
 	struct drm_output *output = (struct drm_output *) output_base;
+	struct drm_gpu *gpu = output->gpu;
 	int crtc;
 
-	for (crtc = 0; crtc < c->num_crtcs; crtc++) {
-		if (c->crtcs[crtc] != output->crtc_id)
+	for (crtc = 0; crtc < gpu->num_crtcs; crtc++) {
+		if (gpu->crtcs[crtc] != output->crtc_id)
 			continue;
 
 		if (supported & (1 << crtc))
@@ -211,10 +361,21 @@ static void
 drm_fb_destroy_callback(struct gbm_bo *bo, void *data)
 {
 	struct drm_fb *fb = data;
-	struct gbm_device *gbm = gbm_bo_get_device(bo);
+	struct drm_gem_close close_arg;
+	unsigned int i;
 
 	if (fb->fb_id)
-		drmModeRmFB(gbm_device_get_fd(gbm), fb->fb_id);
+		drmModeRmFB(fb->fd, fb->fb_id);
+
+	for (i = 0; i < ARRAY_LENGTH(fb->planes); i++)
+		if (fb->planes[i])
+			gbm_bo_destroy(fb->planes[i]);
+
+	if (fb->is_imported) {
+		memset(&close_arg, 0, sizeof close_arg);
+		close_arg.handle = fb->handle;
+		drmIoctl(fb->fd, DRM_IOCTL_GEM_CLOSE, &close_arg);
+	}
 
 	weston_buffer_reference(&fb->buffer_ref, NULL);
 
@@ -222,7 +383,7 @@ drm_fb_destroy_callback(struct gbm_bo *bo, void *data)
 }
 
 static struct drm_fb *
-drm_fb_create_dumb(struct drm_compositor *ec, unsigned width, unsigned height)
+drm_fb_create_dumb(int fd, unsigned width, unsigned height)
 {
 	struct drm_fb *fb;
 	int ret;
@@ -239,16 +400,16 @@ drm_fb_create_dumb(struct drm_compositor *ec, unsigned width, unsigned height)
 	create_arg.width = width;
 	create_arg.height = height;
 
-	ret = drmIoctl(ec->drm.fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_arg);
+	ret = drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_arg);
 	if (ret)
 		goto err_fb;
 
 	fb->handle = create_arg.handle;
 	fb->stride = create_arg.pitch;
 	fb->size = create_arg.size;
-	fb->fd = ec->drm.fd;
+	fb->fd = fd;
 
-	ret = drmModeAddFB(ec->drm.fd, width, height, 24, 32,
+	ret = drmModeAddFB(fd, width, height, 24, 32,
 			   fb->stride, fb->handle, &fb->fb_id);
 	if (ret)
 		goto err_bo;
@@ -261,18 +422,18 @@ drm_fb_create_dumb(struct drm_compositor *ec, unsigned width, unsigned height)
 		goto err_add_fb;
 
 	fb->map = mmap(0, fb->size, PROT_WRITE,
-		       MAP_SHARED, ec->drm.fd, map_arg.offset);
+		       MAP_SHARED, fd, map_arg.offset);
 	if (fb->map == MAP_FAILED)
 		goto err_add_fb;
 
 	return fb;
 
 err_add_fb:
-	drmModeRmFB(ec->drm.fd, fb->fb_id);
+	drmModeRmFB(fd, fb->fb_id);
 err_bo:
 	memset(&destroy_arg, 0, sizeof(destroy_arg));
 	destroy_arg.handle = create_arg.handle;
-	drmIoctl(ec->drm.fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_arg);
+	drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_arg);
 err_fb:
 	free(fb);
 	return NULL;
@@ -349,7 +510,8 @@ drm_fb_get_from_bo(struct gbm_bo *bo,
 		}
 	}
 
-	if (ret)
+	/* AddFB takes the depth 24, 32 bpp layout to be XRGB8888 */
+	if (ret && (format == 0 || format == GBM_FORMAT_XRGB8888))
 		ret = drmModeAddFB(compositor->drm.fd, width, height, 24, 32,
 				   fb->stride, fb->handle, &fb->fb_id);
 
@@ -367,6 +529,212 @@ err_free:
 	return NULL;
 }
 
+#ifdef ENABLE_EGL
+/*
+ * gbm only imports client buffers of a single plane.  For the YUV
+ * buffers the GL renderer samples plane by plane, import the image of
+ * each plane on its own and tell the layout from their sizes.  gbm
+ * cannot tell where in a bo a plane starts, so buffers with planes
+ * sharing one bo are left to the renderer.  Returns the number of
+ * planes, their bos in bos and the fourcc of the buffer in format, or
+ * 0 for buffers that are not YUV or cannot be imported.
+ */
+static int
+drm_import_yuv_buffer(struct drm_compositor *c, struct wl_buffer *buffer,
+		      struct gbm_bo **bos, uint32_t *format)
+{
+	EGLDisplay display = gl_renderer_display(&c->base);
+	EGLint attribs[] = { EGL_WAYLAND_PLANE_WL, 0, EGL_NONE };
+	EGLint texture_format, width, height;
+	EGLImageKHR image;
+	int i, j, count;
+
+	if (!c->query_buffer || !c->create_image ||
+	    !c->query_buffer(display, buffer,
+			     EGL_TEXTURE_FORMAT, &texture_format) ||
+	    !c->query_buffer(display, buffer, EGL_WIDTH, &width) ||
+	    !c->query_buffer(display, buffer, EGL_HEIGHT, &height))
+		return 0;
+
+	switch (texture_format) {
+	case EGL_TEXTURE_Y_XUXV_WL:
+		/* packed, the image of the Y plane is the whole buffer */
+		count = 1;
+		break;
+	case EGL_TEXTURE_Y_UV_WL:
+		count = 2;
+		break;
+	case EGL_TEXTURE_Y_U_V_WL:
+		count = 3;
+		break;
+	default:
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		attribs[1] = i;
+		image = c->create_image(display, EGL_NO_CONTEXT,
+					EGL_WAYLAND_BUFFER_WL,
+					(EGLClientBuffer) buffer, attribs);
+		if (image == EGL_NO_IMAGE_KHR)
+			goto err;
+
+		bos[i] = gbm_bo_import(c->gbm, GBM_BO_IMPORT_EGL_IMAGE,
+				       image, GBM_BO_USE_SCANOUT);
+		c->destroy_image(display, image);
+		if (!bos[i])
+			goto err;
+
+		for (j = 0; j < i; j++)
+			if (gbm_bo_get_handle(bos[j]).u32 ==
+			    gbm_bo_get_handle(bos[i]).u32) {
+				i++;
+				goto err;
+			}
+	}
+
+	if (count == 1)
+		*format = DRM_FORMAT_YUYV;
+	else if (gbm_bo_get_height(bos[1]) < (uint32_t) height)
+		*format = count == 2 ? DRM_FORMAT_NV12 : DRM_FORMAT_YUV420;
+	else if (count == 2)
+		*format = DRM_FORMAT_NV16;
+	else if (gbm_bo_get_width(bos[1]) < (uint32_t) width)
+		*format = DRM_FORMAT_YUV422;
+	else
+		*format = DRM_FORMAT_YUV444;
+
+	return count;
+
+err:
+	while (i--)
+		gbm_bo_destroy(bos[i]);
+
+	return 0;
+}
+#else
+static int
+drm_import_yuv_buffer(struct drm_compositor *c, struct wl_buffer *buffer,
+		      struct gbm_bo **bos, uint32_t *format)
+{
+	return 0;
+}
+#endif
+
+/* Like drm_fb_get_from_bo(), for the planes of a YUV buffer imported
+ * with drm_import_yuv_buffer().  The fb takes the bos, and is
+ * destroyed with the first. */
+static struct drm_fb *
+drm_fb_get_from_yuv_bos(struct gbm_bo **bos, int count,
+			struct drm_compositor *compositor, uint32_t format)
+{
+	struct drm_fb *fb;
+	uint32_t width, height;
+	uint32_t handles[4], pitches[4], offsets[4];
+	int i, ret;
+
+	if (compositor->no_addfb2)
+		return NULL;
+
+	fb = calloc(1, sizeof *fb);
+	if (!fb)
+		return NULL;
+
+	fb->bo = bos[0];
+	width = gbm_bo_get_width(bos[0]);
+	height = gbm_bo_get_height(bos[0]);
+	fb->stride = gbm_bo_get_stride(bos[0]);
+	fb->handle = gbm_bo_get_handle(bos[0]).u32;
+	fb->size = fb->stride * height;
+	fb->fd = compositor->drm.fd;
+
+	if (compositor->min_width > width || width > compositor->max_width ||
+	    compositor->min_height > height ||
+	    height > compositor->max_height) {
+		weston_log("bo geometry out of bounds\n");
+		goto err_free;
+	}
+
+	for (i = 0; i < count; i++) {
+		handles[i] = gbm_bo_get_handle(bos[i]).u32;
+		pitches[i] = gbm_bo_get_stride(bos[i]);
+		offsets[i] = 0;
+	}
+
+	ret = drmModeAddFB2(compositor->drm.fd, width, height,
+			    format, handles, pitches, offsets,
+			    &fb->fb_id, 0);
+	if (ret) {
+		weston_log("addfb2 of a YUV buffer failed: %m\n");
+		goto err_free;
+	}
+
+	for (i = 1; i < count; i++)
+		fb->planes[i - 1] = bos[i];
+	gbm_bo_set_user_data(bos[0], fb, drm_fb_destroy_callback);
+
+	return fb;
+
+err_free:
+	free(fb);
+	return NULL;
+}
+
+/* Shares bo, rendered on the primary GPU for an output of a secondary
+ * one, with that device.  Like the fbs of primary outputs, the fb
+ * lives as long as the bo. */
+static struct drm_fb *
+drm_fb_import_bo(struct gbm_bo *bo, struct drm_gpu *gpu)
+{
+	struct drm_fb *fb = gbm_bo_get_user_data(bo);
+	struct drm_gem_close close_arg;
+	int prime_fd = -1, ret = -1;
+
+	if (fb)
+		return fb;
+
+	fb = calloc(1, sizeof *fb);
+	if (!fb)
+		return NULL;
+
+	fb->bo = bo;
+	fb->stride = gbm_bo_get_stride(bo);
+	fb->size = fb->stride * gbm_bo_get_height(bo);
+	fb->fd = gpu->fd;
+
+#ifdef HAVE_GBM_BO_GET_FD
+	prime_fd = gbm_bo_get_fd(bo);
+#endif
+	if (prime_fd >= 0) {
+		ret = drmPrimeFDToHandle(gpu->fd, prime_fd, &fb->handle);
+		close(prime_fd);
+	}
+	if (ret)
+		goto err_free;
+
+	fb->is_imported = 1;
+	ret = drmModeAddFB(gpu->fd,
+			   gbm_bo_get_width(bo), gbm_bo_get_height(bo),
+			   24, 32, fb->stride, fb->handle, &fb->fb_id);
+	if (ret) {
+		memset(&close_arg, 0, sizeof close_arg);
+		close_arg.handle = fb->handle;
+		drmIoctl(gpu->fd, DRM_IOCTL_GEM_CLOSE, &close_arg);
+		goto err_free;
+	}
+
+	gbm_bo_set_user_data(bo, fb, drm_fb_destroy_callback);
+
+	return fb;
+
+err_free:
+	weston_log("failed to import frame into card%d: %m, "
+		   "copying frames instead\n", gpu->id);
+	gpu->prime_import = 0;
+	free(fb);
+	return NULL;
+}
+
 static void
 drm_fb_set_buffer(struct drm_fb *fb, struct wl_buffer *buffer)
 {
@@ -390,8 +758,63 @@ drm_output_release_fb(struct drm_output *output, struct drm_fb *fb)
 		if (fb->is_client_buffer)
 			gbm_bo_destroy(fb->bo);
 		else
-			gbm_surface_release_buffer(output->surface,
-						   output->current->bo);
+			gbm_surface_release_buffer(output->surface, fb->bo);
+	}
+}
+
+static int
+drm_fb_on_clone(struct drm_output *output, struct drm_fb *fb)
+{
+	struct drm_clone *clone;
+
+	wl_list_for_each(clone, &clone_list, link)
+		if (clone->source == output &&
+		    (clone->current == fb || clone->next == fb))
+			return 1;
+
+	return 0;
+}
+
+static int
+drm_output_has_clones(struct drm_output *output)
+{
+	struct drm_clone *clone;
+
+	wl_list_for_each(clone, &clone_list, link)
+		if (clone->source == output)
+			return 1;
+
+	return 0;
+}
+
+/* Releases fb unless output or one of its clones still shows it or
+ * is about to. */
+static void
+drm_output_release_shown_fb(struct drm_output *output, struct drm_fb *fb)
+{
+	if (!fb || fb == output->current || fb == output->next ||
+	    drm_fb_on_clone(output, fb))
+		return;
+
+	drm_output_release_fb(output, fb);
+}
+
+/* Alpha formats can be scanned out as their opaque twin when the
+ * surface is fully opaque. */
+static uint32_t
+drm_format_opaque_twin(uint32_t format)
+{
+	switch (format) {
+	case GBM_FORMAT_ARGB8888:
+		return GBM_FORMAT_XRGB8888;
+	case GBM_FORMAT_ABGR8888:
+		return GBM_FORMAT_XBGR8888;
+	case GBM_FORMAT_RGBA8888:
+		return GBM_FORMAT_RGBX8888;
+	case GBM_FORMAT_BGRA8888:
+		return GBM_FORMAT_BGRX8888;
+	default:
+		return 0;
 	}
 }
 
@@ -399,32 +822,40 @@ static uint32_t
 drm_output_check_scanout_format(struct drm_output *output,
 				struct weston_surface *es, struct gbm_bo *bo)
 {
-	uint32_t format;
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	uint32_t format, opaque;
 	pixman_region32_t r;
+	int i;
 
 	format = gbm_bo_get_format(bo);
 
-	switch (format) {
-	case GBM_FORMAT_XRGB8888:
-		return format;
-	case GBM_FORMAT_ARGB8888:
-		/* We can only scanout an ARGB buffer if the surface's
-		 * opaque region covers the whole output */
-		pixman_region32_init(&r);
-		pixman_region32_subtract(&r, &output->base.region,
-					 &es->opaque);
+	opaque = drm_format_opaque_twin(format);
+	if (opaque) {
+		/* We can only scanout an alpha buffer if the surface's
+		 * opaque region covers the whole surface */
+		pixman_region32_init_rect(&r, 0, 0,
+					  es->geometry.width,
+					  es->geometry.height);
+		pixman_region32_subtract(&r, &r, &es->opaque);
 
 		if (!pixman_region32_not_empty(&r))
-			format = GBM_FORMAT_XRGB8888;
+			format = opaque;
 		else
 			format = 0;
 
 		pixman_region32_fini(&r);
+	}
 
-		return format;
-	default:
+	/* without AddFB2 only the legacy depth 24 layout goes */
+	if (c->no_addfb2 && format != GBM_FORMAT_XRGB8888)
 		return 0;
-	}
+
+	for (i = 0; i < output->count_scanout_formats; i++)
+		if (output->scanout_formats[i] == format)
+			return format;
+
+	return 0;
 }
 
 static struct weston_plane *
@@ -435,16 +866,28 @@ drm_output_prepare_scanout_surface(struct weston_output *_output,
 	struct drm_compositor *c =
 		(struct drm_compositor *) output->base.compositor;
 	struct wl_buffer *buffer = es->buffer_ref.buffer;
+	pixman_box32_t *box;
 	struct gbm_bo *bo;
 	uint32_t format;
 
-	if (es->geometry.x != output->base.x ||
-	    es->geometry.y != output->base.y ||
-	    buffer == NULL || c->gbm == NULL ||
+	if (buffer == NULL || c->gbm == NULL || wl_buffer_is_shm(buffer) ||
 	    buffer->width != output->base.current->width ||
 	    buffer->height != output->base.current->height ||
 	    output->base.transform != es->buffer_transform ||
-	    es->transform.enabled)
+	    es->alpha != 1.0f)
+		return NULL;
+
+	/* A pure translation is fine as long as the surface ends up
+	 * exactly covering the output. */
+	if (es->transform.enabled &&
+	    es->transform.matrix.type & ~WESTON_MATRIX_TRANSFORM_TRANSLATE)
+		return NULL;
+
+	box = pixman_region32_extents(&es->transform.boundingbox);
+	if (box->x1 != output->base.x ||
+	    box->y1 != output->base.y ||
+	    box->x2 != output->base.x + output->base.width ||
+	    box->y2 != output->base.y + output->base.height)
 		return NULL;
 
 	bo = gbm_bo_import(c->gbm, GBM_BO_IMPORT_WL_BUFFER,
@@ -471,6 +914,36 @@ drm_output_prepare_scanout_surface(struct weston_output *_output,
 	return &output->fb_plane;
 }
 
+static int
+drm_output_init_copy(struct drm_output *output);
+
+/* The frame rendered for an output went nowhere; have the repaint
+ * loop go round again instead of waiting for a page flip. */
+static void
+drm_output_finish_lost_frame(void *data)
+{
+	struct drm_output *output = data;
+
+	output->lost_frame_source = NULL;
+	weston_output_damage(&output->base);
+	weston_output_discard_feedback(&output->base);
+	weston_output_finish_frame(&output->base,
+				   weston_compositor_get_time());
+}
+
+static void
+drm_output_lose_frame(struct drm_output *output)
+{
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(output->base.compositor->wl_display);
+
+	if (!output->lost_frame_source)
+		output->lost_frame_source =
+			wl_event_loop_add_idle(loop,
+					       drm_output_finish_lost_frame,
+					       output);
+}
+
 static void
 drm_output_render_gl(struct drm_output *output, pixman_region32_t *damage)
 {
@@ -478,6 +951,14 @@ drm_output_render_gl(struct drm_output *output, pixman_region32_t *damage)
 		(struct drm_compositor *) output->base.compositor;
 	struct gbm_bo *bo;
 
+	if (output->copy_frames) {
+		/* all that changed since this dumb buffer was written */
+		output->current_image ^= 1;
+		pixman_region32_union(&output->copy_damage, damage,
+				      &output->previous_damage);
+		pixman_region32_copy(&output->previous_damage, damage);
+	}
+
 	c->base.renderer->repaint_output(&output->base, damage);
 
 	bo = gbm_surface_lock_front_buffer(output->surface);
@@ -486,10 +967,23 @@ drm_output_render_gl(struct drm_output *output, pixman_region32_t *damage)
 		return;
 	}
 
-	output->next = drm_fb_get_from_bo(bo, c, GBM_FORMAT_XRGB8888);
+	if (output->copy_frames) {
+		/* read back by drm_output_copy_frame already */
+		gbm_surface_release_buffer(output->surface, bo);
+		output->next = output->dumb[output->current_image];
+		return;
+	}
+
+	if (output->gpu != c->primary_gpu)
+		output->next = drm_fb_import_bo(bo, output->gpu);
+	else
+		output->next = drm_fb_get_from_bo(bo, c, GBM_FORMAT_XRGB8888);
 	if (!output->next) {
 		weston_log("failed to get drm_fb for bo\n");
 		gbm_surface_release_buffer(output->surface, bo);
+		if (output->gpu != c->primary_gpu &&
+		    drm_output_init_copy(output) == 0)
+			drm_output_lose_frame(output);
 		return;
 	}
 }
@@ -535,54 +1029,256 @@ drm_output_render(struct drm_output *output, pixman_region32_t *damage)
 				 &c->base.primary_plane.damage, damage);
 }
 
-static void
-drm_output_repaint(struct weston_output *output_base,
-		   pixman_region32_t *damage)
+/* Takes a sprite the clone's crtc can use to scale the source's
+ * frames, with a black framebuffer of the clone's mode under it. */
+static int
+drm_clone_reserve_sprite(struct drm_clone *clone)
 {
-	struct drm_output *output = (struct drm_output *) output_base;
-	struct drm_compositor *compositor =
-		(struct drm_compositor *) output->base.compositor;
+	struct drm_output *source = clone->source;
+	struct drm_compositor *c =
+		(struct drm_compositor *) source->base.compositor;
 	struct drm_sprite *s;
-	struct drm_mode *mode;
-	int ret = 0;
+	uint32_t i;
 
-	if (!output->next)
-		drm_output_render(output, damage);
-	if (!output->next)
-		return;
+	/* Sprites are planes of the primary GPU. */
+	if (source->gpu != c->primary_gpu)
+		return -1;
 
-	mode = container_of(output->base.current, struct drm_mode, base);
-	if (!output->current) {
-		ret = drmModeSetCrtc(compositor->drm.fd, output->crtc_id,
-				     output->next->fb_id, 0, 0,
-				     &output->connector_id, 1,
-				     &mode->mode_info);
-		if (ret) {
-			weston_log("set mode failed: %m\n");
-			return;
-		}
-	}
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->clone || s->current || s->next ||
+		    !(s->possible_crtcs & (1 << clone->pipe)))
+			continue;
 
-	if (drmModePageFlip(compositor->drm.fd, output->crtc_id,
-			    output->next->fb_id,
-			    DRM_MODE_PAGE_FLIP_EVENT, output) < 0) {
-		weston_log("queueing pageflip failed: %m\n");
+		for (i = 0; i < s->count_formats; i++)
+			if (s->formats[i] == GBM_FORMAT_XRGB8888)
+				break;
+		if (i == s->count_formats)
+			continue;
+
+		clone->black = drm_fb_create_dumb(source->gpu->fd,
+						  clone->mode.hdisplay,
+						  clone->mode.vdisplay);
+		if (!clone->black)
+			return -1;
+		memset(clone->black->map, 0, clone->black->size);
+
+		s->clone = clone;
+		clone->sprite = s;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+static int
+drm_clone_show(struct drm_clone *clone, struct drm_fb *fb)
+{
+	struct drm_output *source = clone->source;
+	int fd = source->gpu->fd;
+	int32_t width = source->base.current->width;
+	int32_t height = source->base.current->height;
+	int32_t mode_width = clone->mode.hdisplay;
+	int32_t mode_height = clone->mode.vdisplay;
+	int32_t x = 0, y = 0, w = mode_width, h = mode_height;
+	struct drm_fb *old;
+	drmVBlank vbl = {
+		.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT,
+		.request.sequence = 1,
+	};
+	int scaled;
+
+	scaled = width != mode_width || height != mode_height;
+	if (scaled && !clone->sprite && drm_clone_reserve_sprite(clone) < 0)
+		return -1;
+
+	if (!clone->mode_set) {
+		if (clone->sprite && !scaled)
+			drmModeSetPlane(fd, clone->sprite->plane_id,
+					clone->crtc_id, 0, 0,
+					0, 0, 0, 0, 0, 0, 0, 0);
+
+		if (drmModeSetCrtc(fd, clone->crtc_id,
+				   scaled ? clone->black->fb_id : fb->fb_id,
+				   0, 0, &clone->connector_id, 1,
+				   &clone->mode) < 0) {
+			weston_log("set mode of clone %s failed: %m\n",
+				   clone->name);
+			return -1;
+		}
+		clone->mode_set = 1;
+
+		/* on screen already, no flip to wait for */
+		if (!scaled) {
+			old = clone->current;
+			clone->current = fb;
+			drm_output_release_shown_fb(source, old);
+			return 0;
+		}
+	}
+
+	if (!scaled) {
+		if (drmModePageFlip(fd, clone->crtc_id, fb->fb_id,
+				    DRM_MODE_PAGE_FLIP_EVENT, clone) < 0) {
+			weston_log("queueing pageflip of clone %s failed: %m\n",
+				   clone->name);
+			return -1;
+		}
+	} else {
+		/* keep the aspect ratio, black bars fill the rest */
+		if ((int64_t) width * mode_height >
+		    (int64_t) height * mode_width) {
+			h = (int64_t) height * mode_width / width;
+			y = (mode_height - h) / 2;
+		} else {
+			w = (int64_t) width * mode_height / height;
+			x = (mode_width - w) / 2;
+		}
+
+		if (drmModeSetPlane(fd, clone->sprite->plane_id,
+				    clone->crtc_id, fb->fb_id, 0,
+				    x, y, w, h,
+				    0, 0, width << 16, height << 16) < 0) {
+			weston_log("setplane of clone %s failed: %m\n",
+				   clone->name);
+			return -1;
+		}
+
+		if (clone->pipe > 0)
+			vbl.request.type |= DRM_VBLANK_SECONDARY;
+		vbl.request.signal = (unsigned long) clone;
+		if (drmWaitVBlank(fd, &vbl) < 0) {
+			/* It still takes effect, only we won't be told
+			 * when. */
+			old = clone->current;
+			clone->current = fb;
+			drm_output_release_shown_fb(source, old);
+			return 0;
+		}
+	}
+
+	clone->next = fb;
+	clone->flip_pending = 1;
+
+	return 0;
+}
+
+/* The flip or sprite update of a clone took effect: release what it
+ * showed before, and catch up with the source if that moved on while
+ * the flip was pending. */
+static void
+drm_clone_frame_done(struct drm_clone *clone)
+{
+	struct drm_output *source = clone->source;
+	struct drm_fb *old = clone->current, *latest;
+
+	clone->flip_pending = 0;
+	if (clone->destroyed) {
+		wl_list_remove(&clone->link);
+		free(clone);
+		return;
+	}
+
+	clone->current = clone->next;
+	clone->next = NULL;
+	drm_output_release_shown_fb(source, old);
+
+	latest = source->next ? source->next : source->current;
+	if (latest && latest != clone->current)
+		drm_clone_show(clone, latest);
+}
+
+static struct drm_clone *
+drm_clone_from_event(void *data)
+{
+	struct drm_clone *clone;
+
+	wl_list_for_each(clone, &clone_list, link)
+		if (clone == data)
+			return clone;
+
+	return NULL;
+}
+
+/* Clones still flipping to an earlier frame skip this one, and catch
+ * up when their flip is done. */
+static void
+drm_output_repaint_clones(struct drm_output *output)
+{
+	struct drm_clone *clone;
+
+	wl_list_for_each(clone, &clone_list, link)
+		if (clone->source == output && !clone->flip_pending)
+			drm_clone_show(clone, output->next);
+}
+
+static void
+drm_output_repaint(struct weston_output *output_base,
+		   pixman_region32_t *damage)
+{
+	struct drm_output *output = (struct drm_output *) output_base;
+	struct drm_compositor *compositor =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_sprite *s;
+	struct drm_mode *mode;
+	drmVBlank vbl = {
+		.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT,
+		.request.sequence = 1,
+	};
+	int ret = 0, sprites = 0;
+
+	if (!output->next)
+		drm_output_render(output, damage);
+	if (!output->next)
+		return;
+
+	mode = container_of(output->base.current, struct drm_mode, base);
+	if (!output->current) {
+		ret = drmModeSetCrtc(output->gpu->fd, output->crtc_id,
+				     output->next->fb_id, 0, 0,
+				     &output->connector_id, 1,
+				     &mode->mode_info);
+		if (ret) {
+			weston_log("set mode failed: %m\n");
+			return;
+		}
+	}
+
+#ifdef HAVE_DRM_ATOMIC
+	/* Primary, sprite and cursor planes go in as one state; fall
+	 * back to the legacy ioctls if the kernel rejects it. */
+	if (compositor->atomic_modeset && output->primary_plane_id &&
+	    drm_output_repaint_atomic(output) == 0) {
+		WESTON_TRACE_INSTANT(WESTON_TRACE_FLIP, "page_flip_queued",
+				     output->crtc_id);
+		drm_output_repaint_clones(output);
+		return;
+	}
+#endif
+
+	if (drmModePageFlip(output->gpu->fd, output->crtc_id,
+			    output->next->fb_id,
+			    DRM_MODE_PAGE_FLIP_EVENT, output) < 0) {
+		weston_log("queueing pageflip failed: %m\n");
 		return;
 	}
 
 	output->page_flip_pending = 1;
+	WESTON_TRACE_INSTANT(WESTON_TRACE_FLIP, "page_flip_queued",
+			     output->crtc_id);
+	drm_output_repaint_clones(output);
 
 	drm_output_set_cursor(output);
 
+	/* Sprites are planes of the primary GPU. */
+	if (output->gpu != compositor->primary_gpu)
+		return;
+
 	/*
 	 * Now, update all the sprite surfaces
 	 */
 	wl_list_for_each(s, &compositor->sprite_list, link) {
 		uint32_t flags = 0, fb_id = 0;
-		drmVBlank vbl = {
-			.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT,
-			.request.sequence = 1,
-		};
 
 		if ((!s->current && !s->next) ||
 		    !drm_sprite_crtc_supported(output_base, s->possible_crtcs))
@@ -601,45 +1297,85 @@ drm_output_repaint(struct weston_output *output_base,
 			weston_log("setplane failed: %d: %s\n",
 				ret, strerror(errno));
 
-		if (output->pipe > 0)
-			vbl.request.type |= DRM_VBLANK_SECONDARY;
+		s->output = output;
+		sprites++;
+	}
 
-		/*
-		 * Queue a vblank signal so we know when the surface
-		 * becomes active on the display or has been replaced.
-		 */
-		vbl.request.signal = (unsigned long)s;
-		ret = drmWaitVBlank(compositor->drm.fd, &vbl);
-		if (ret) {
-			weston_log("vblank event request failed: %d: %s\n",
-				ret, strerror(errno));
-		}
+	if (sprites == 0)
+		return;
 
-		s->output = output;
-		output->vblank_pending = 1;
+	/*
+	 * Queue one vblank signal for all sprites of the output, so we
+	 * know when their surfaces become active on the display or have
+	 * been replaced.
+	 */
+	if (output->pipe > 0)
+		vbl.request.type |= DRM_VBLANK_SECONDARY;
+	vbl.request.signal = (unsigned long) output;
+	ret = drmWaitVBlank(compositor->drm.fd, &vbl);
+	if (ret) {
+		weston_log("vblank event request failed: %d: %s\n",
+			ret, strerror(errno));
+		return;
+	}
+
+	output->vblank_pending = 1;
+}
+
+/* The sprites set on output for the frame now on screen: release what
+ * they showed before. */
+static void
+drm_output_sprites_done(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_sprite *s;
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->output != output)
+			continue;
+
+		drm_output_release_fb(output, s->current);
+		s->current = s->next;
+		s->next = NULL;
 	}
+}
 
-	return;
+/* The last of the flip and the sprite vblank of a frame came in; the
+ * kernel timestamped it at the start of the vblank it took effect in. */
+static void
+drm_output_frame_done(struct drm_output *output, unsigned int frame,
+		      unsigned int sec, unsigned int usec)
+{
+	struct timespec stamp;
+
+	stamp.tv_sec = sec;
+	stamp.tv_nsec = usec * 1000;
+	weston_output_present(&output->base, &stamp, frame,
+			      PRESENTATION_FEEDBACK_KIND_VSYNC |
+			      PRESENTATION_FEEDBACK_KIND_HW_CLOCK |
+			      PRESENTATION_FEEDBACK_KIND_HW_COMPLETION);
+	weston_output_finish_frame(&output->base, sec * 1000 + usec / 1000);
 }
 
 static void
 vblank_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec,
 	       void *data)
 {
-	struct drm_sprite *s = (struct drm_sprite *)data;
-	struct drm_output *output = s->output;
-	uint32_t msecs;
+	struct drm_output *output = (struct drm_output *) data;
+	struct drm_clone *clone;
 
-	output->vblank_pending = 0;
+	clone = drm_clone_from_event(data);
+	if (clone) {
+		drm_clone_frame_done(clone);
+		return;
+	}
 
-	drm_output_release_fb(output, s->current);
-	s->current = s->next;
-	s->next = NULL;
+	output->vblank_pending = 0;
+	drm_output_sprites_done(output);
 
-	if (!output->page_flip_pending) {
-		msecs = sec * 1000 + usec / 1000;
-		weston_output_finish_frame(&output->base, msecs);
-	}
+	if (!output->page_flip_pending)
+		drm_output_frame_done(output, frame, sec, usec);
 }
 
 static void
@@ -647,25 +1383,39 @@ page_flip_handler(int fd, unsigned int frame,
 		  unsigned int sec, unsigned int usec, void *data)
 {
 	struct drm_output *output = (struct drm_output *) data;
-	uint32_t msecs;
+	struct drm_clone *clone;
+	struct drm_fb *old;
+
+	clone = drm_clone_from_event(data);
+	if (clone) {
+		drm_clone_frame_done(clone);
+		return;
+	}
+
+	WESTON_TRACE_INSTANT(WESTON_TRACE_FLIP, "page_flip_done", frame);
 
 	output->page_flip_pending = 0;
 
-	drm_output_release_fb(output, output->current);
+	old = output->current;
 	output->current = output->next;
 	output->next = NULL;
+	drm_output_release_shown_fb(output, old);
 
-	if (!output->vblank_pending) {
-		msecs = sec * 1000 + usec / 1000;
-		weston_output_finish_frame(&output->base, msecs);
+	/* Sprites committed atomically with the primary plane flip
+	 * together with it, there is no separate vblank event. */
+	if (output->atomic_pending) {
+		output->atomic_pending = 0;
+		drm_output_sprites_done(output);
 	}
+
+	if (!output->vblank_pending)
+		drm_output_frame_done(output, frame, sec, usec);
 }
 
 static uint32_t
-drm_output_check_sprite_format(struct drm_sprite *s,
-			       struct weston_surface *es, struct gbm_bo *bo)
+drm_surface_sprite_format(struct weston_surface *es, struct gbm_bo *bo)
 {
-	uint32_t i, format;
+	uint32_t format;
 
 	format = gbm_bo_get_format(bo);
 
@@ -683,13 +1433,47 @@ drm_output_check_sprite_format(struct drm_sprite *s,
 		pixman_region32_fini(&r);
 	}
 
+	return format;
+}
+
+static int
+drm_sprite_has_format(struct drm_sprite *s, uint32_t format)
+{
+	uint32_t i;
+
 	for (i = 0; i < s->count_formats; i++)
 		if (s->formats[i] == format)
-			return format;
+			return 1;
 
 	return 0;
 }
 
+/* A sprite of output that is free and scans out format. */
+static struct drm_sprite *
+drm_output_find_sprite(struct drm_output *output, uint32_t format)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_sprite *s;
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->clone || s->next ||
+		    !drm_sprite_crtc_supported(&output->base,
+					       s->possible_crtcs))
+			continue;
+
+		/* With atomic commits a sprite is only released in the
+		 * page flip of the output that last showed it. */
+		if (c->atomic_modeset && s->current && s->output != output)
+			continue;
+
+		if (format == 0 || drm_sprite_has_format(s, format))
+			return s;
+	}
+
+	return NULL;
+}
+
 static int
 drm_surface_transform_supported(struct weston_surface *es)
 {
@@ -703,12 +1487,13 @@ drm_output_prepare_overlay_surface(struct weston_output *output_base,
 {
 	struct weston_compositor *ec = output_base->compositor;
 	struct drm_compositor *c =(struct drm_compositor *) ec;
+	struct drm_output *output = (struct drm_output *) output_base;
 	struct drm_sprite *s;
-	int found = 0;
-	struct gbm_bo *bo;
+	struct gbm_bo *bo, *planes[3];
 	pixman_region32_t dest_rect, src_rect;
 	pixman_box32_t *box, tbox;
 	uint32_t format;
+	int i, count = 0;
 	wl_fixed_t sx1, sy1, sx2, sy2;
 
 	if (c->gbm == NULL)
@@ -735,36 +1520,35 @@ drm_output_prepare_overlay_surface(struct weston_output *output_base,
 	if (!drm_surface_transform_supported(es))
 		return NULL;
 
-	wl_list_for_each(s, &c->sprite_list, link) {
-		if (!drm_sprite_crtc_supported(output_base, s->possible_crtcs))
-			continue;
-
-		if (!s->next) {
-			found = 1;
-			break;
-		}
-	}
-
 	/* No sprites available */
-	if (!found)
-		return NULL;
-
-	bo = gbm_bo_import(c->gbm, GBM_BO_IMPORT_WL_BUFFER,
-			   es->buffer_ref.buffer, GBM_BO_USE_SCANOUT);
-	if (!bo)
+	if (!drm_output_find_sprite(output, 0))
 		return NULL;
 
-	format = drm_output_check_sprite_format(s, es, bo);
-	if (format == 0) {
-		gbm_bo_destroy(bo);
-		return NULL;
+	/* Video often comes in YUV buffers the GL renderer would have
+	 * to convert with a shader pass per frame; a sprite that takes
+	 * the format converts and scales them for free. */
+	count = drm_import_yuv_buffer(c, es->buffer_ref.buffer,
+				      planes, &format);
+	if (count > 0) {
+		bo = planes[0];
+	} else {
+		bo = gbm_bo_import(c->gbm, GBM_BO_IMPORT_WL_BUFFER,
+				   es->buffer_ref.buffer, GBM_BO_USE_SCANOUT);
+		if (!bo)
+			return NULL;
+		format = drm_surface_sprite_format(es, bo);
 	}
 
-	s->next = drm_fb_get_from_bo(bo, c, format);
-	if (!s->next) {
-		gbm_bo_destroy(bo);
-		return NULL;
-	}
+	s = drm_output_find_sprite(output, format);
+	if (s == NULL)
+		goto err_bo;
+
+	if (count > 0)
+		s->next = drm_fb_get_from_yuv_bos(planes, count, c, format);
+	else
+		s->next = drm_fb_get_from_bo(bo, c, format);
+	if (!s->next)
+		goto err_bo;
 
 	drm_fb_set_buffer(s->next, es->buffer_ref.buffer);
 
@@ -829,7 +1613,27 @@ drm_output_prepare_overlay_surface(struct weston_output *output_base,
 	s->src_h = (tbox.y2 - tbox.y1) << 8;
 	pixman_region32_fini(&src_rect);
 
+	s->output = output;
+
+#ifdef HAVE_DRM_ATOMIC
+	/* Ask the kernel whether the sprites assigned so far, including
+	 * this one, can be shown together; if not, composite the surface
+	 * instead of finding out at page flip time. */
+	if (c->atomic_modeset && drm_output_test_sprites(output) < 0) {
+		drm_output_release_fb(output, s->next);
+		s->next = NULL;
+		return NULL;
+	}
+#endif
+
 	return &s->plane;
+
+err_bo:
+	for (i = 1; i < count; i++)
+		gbm_bo_destroy(planes[i]);
+	gbm_bo_destroy(bo);
+
+	return NULL;
 }
 
 static struct weston_plane *
@@ -840,7 +1644,7 @@ drm_output_prepare_cursor_surface(struct weston_output *output_base,
 		(struct drm_compositor *) output_base->compositor;
 	struct drm_output *output = (struct drm_output *) output_base;
 
-	if (c->gbm == NULL)
+	if (c->gbm == NULL || output->gpu != c->primary_gpu)
 		return NULL;
 	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL)
 		return NULL;
@@ -860,40 +1664,57 @@ drm_output_prepare_cursor_surface(struct weston_output *output_base,
 	return &output->cursor_plane;
 }
 
+/* Copy the cursor surface into the next cursor bo if it was damaged.
+ * Returns 1 if the bo changed and needs to be set on the crtc. */
+static int
+drm_output_update_cursor_bo(struct drm_output *output,
+			    struct weston_surface *es)
+{
+	uint32_t buf[64 * 64];
+	struct gbm_bo *bo;
+	unsigned char *s;
+	int32_t stride;
+	int i;
+
+	if (!es->buffer_ref.buffer ||
+	    !pixman_region32_not_empty(&output->cursor_plane.damage))
+		return 0;
+
+	pixman_region32_fini(&output->cursor_plane.damage);
+	pixman_region32_init(&output->cursor_plane.damage);
+	output->current_cursor ^= 1;
+	bo = output->cursor_bo[output->current_cursor];
+	memset(buf, 0, sizeof buf);
+	stride = wl_shm_buffer_get_stride(es->buffer_ref.buffer);
+	s = wl_shm_buffer_get_data(es->buffer_ref.buffer);
+	for (i = 0; i < es->geometry.height; i++)
+		memcpy(buf + i * 64, s + i * stride,
+		       es->geometry.width * 4);
+
+	if (gbm_bo_write(bo, buf, sizeof buf) < 0)
+		weston_log("failed update cursor: %m\n");
+
+	return 1;
+}
+
 static void
 drm_output_set_cursor(struct drm_output *output)
 {
 	struct weston_surface *es = output->cursor_surface;
 	struct drm_compositor *c =
 		(struct drm_compositor *) output->base.compositor;
-	EGLint handle, stride;
+	EGLint handle;
 	struct gbm_bo *bo;
-	uint32_t buf[64 * 64];
-	unsigned char *s;
-	int i, x, y;
+	int x, y;
 
 	output->cursor_surface = NULL;
 	if (es == NULL) {
-		drmModeSetCursor(c->drm.fd, output->crtc_id, 0, 0, 0);
+		drmModeSetCursor(output->gpu->fd, output->crtc_id, 0, 0, 0);
 		return;
 	}
 
-	if (es->buffer_ref.buffer &&
-	    pixman_region32_not_empty(&output->cursor_plane.damage)) {
-		pixman_region32_fini(&output->cursor_plane.damage);
-		pixman_region32_init(&output->cursor_plane.damage);
-		output->current_cursor ^= 1;
+	if (drm_output_update_cursor_bo(output, es)) {
 		bo = output->cursor_bo[output->current_cursor];
-		memset(buf, 0, sizeof buf);
-		stride = wl_shm_buffer_get_stride(es->buffer_ref.buffer);
-		s = wl_shm_buffer_get_data(es->buffer_ref.buffer);
-		for (i = 0; i < es->geometry.height; i++)
-			memcpy(buf + i * 64, s + i * stride,
-			       es->geometry.width * 4);
-
-		if (gbm_bo_write(bo, buf, sizeof buf) < 0)
-			weston_log("failed update cursor: %m\n");
-
 		handle = gbm_bo_get_handle(bo).s32;
 		if (drmModeSetCursor(c->drm.fd,
 				     output->crtc_id, handle, 64, 64)) {
@@ -902,17 +1723,448 @@ drm_output_set_cursor(struct drm_output *output)
 		}
 	}
 
-	x = es->geometry.x - output->base.x;
-	y = es->geometry.y - output->base.y;
-	if (output->cursor_plane.x != x || output->cursor_plane.y != y) {
-		if (drmModeMoveCursor(c->drm.fd, output->crtc_id, x, y)) {
-			weston_log("failed to move cursor: %m\n");
-			c->cursors_are_broken = 1;
-		}
+	x = es->geometry.x - output->base.x;
+	y = es->geometry.y - output->base.y;
+	if (output->cursor_plane.x != x || output->cursor_plane.y != y) {
+		if (drmModeMoveCursor(c->drm.fd, output->crtc_id, x, y)) {
+			weston_log("failed to move cursor: %m\n");
+			c->cursors_are_broken = 1;
+		}
+
+		output->cursor_plane.x = x;
+		output->cursor_plane.y = y;
+	}
+}
+
+/* Pointer motion that keeps the cursor inside the output it was
+ * assigned to at the last repaint only needs the hardware cursor
+ * moved.  The atomic path owns the cursor plane, so it repaints. */
+static int
+drm_output_move_cursor(struct weston_output *output_base,
+		       struct weston_surface *es)
+{
+	struct drm_output *output = (struct drm_output *) output_base;
+	struct drm_compositor *c =
+		(struct drm_compositor *) output_base->compositor;
+	int x, y;
+
+	if (es->plane != &output->cursor_plane ||
+	    output->cursor_plane_id || c->cursors_are_broken)
+		return -1;
+
+	x = es->geometry.x - output->base.x;
+	y = es->geometry.y - output->base.y;
+	if (x < 0 || y < 0 ||
+	    x + es->geometry.width > output->base.current->width ||
+	    y + es->geometry.height > output->base.current->height)
+		return -1;
+
+	if (output->cursor_plane.x == x && output->cursor_plane.y == y)
+		return 0;
+
+	if (drmModeMoveCursor(c->drm.fd, output->crtc_id, x, y)) {
+		weston_log("failed to move cursor: %m\n");
+		c->cursors_are_broken = 1;
+		return -1;
+	}
+
+	output->cursor_plane.x = x;
+	output->cursor_plane.y = y;
+
+	return 0;
+}
+
+#ifdef HAVE_DRM_ATOMIC
+static const char * const plane_prop_names[PLANE_PROP_COUNT] = {
+	[PLANE_PROP_TYPE] = "type",
+	[PLANE_PROP_FB_ID] = "FB_ID",
+	[PLANE_PROP_CRTC_ID] = "CRTC_ID",
+	[PLANE_PROP_SRC_X] = "SRC_X",
+	[PLANE_PROP_SRC_Y] = "SRC_Y",
+	[PLANE_PROP_SRC_W] = "SRC_W",
+	[PLANE_PROP_SRC_H] = "SRC_H",
+	[PLANE_PROP_CRTC_X] = "CRTC_X",
+	[PLANE_PROP_CRTC_Y] = "CRTC_Y",
+	[PLANE_PROP_CRTC_W] = "CRTC_W",
+	[PLANE_PROP_CRTC_H] = "CRTC_H",
+};
+
+static int
+drm_plane_get_props(int fd, uint32_t plane_id, uint32_t *props,
+		    uint64_t *type)
+{
+	drmModeObjectPropertiesPtr obj;
+	drmModePropertyPtr prop;
+	uint32_t i;
+	int j, found = 0;
+
+	memset(props, 0, PLANE_PROP_COUNT * sizeof *props);
+
+	obj = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!obj)
+		return -1;
+
+	for (i = 0; i < obj->count_props; i++) {
+		prop = drmModeGetProperty(fd, obj->props[i]);
+		if (!prop)
+			continue;
+
+		for (j = 0; j < PLANE_PROP_COUNT; j++) {
+			if (strcmp(prop->name, plane_prop_names[j]))
+				continue;
+
+			props[j] = prop->prop_id;
+			if (j == PLANE_PROP_TYPE)
+				*type = obj->prop_values[i];
+			found++;
+			break;
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(obj);
+
+	return found == PLANE_PROP_COUNT ? 0 : -1;
+}
+
+static int
+drm_plane_add_state(drmModeAtomicReq *req, uint32_t plane_id,
+		    const uint32_t *props, const uint64_t *values)
+{
+	int i;
+
+	for (i = PLANE_PROP_FB_ID; i < PLANE_PROP_COUNT; i++)
+		if (drmModeAtomicAddProperty(req, plane_id,
+					     props[i], values[i]) < 0)
+			return -1;
+
+	return 0;
+}
+
+static int
+drm_output_add_sprites_state(struct drm_output *output,
+			     drmModeAtomicReq *req)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	uint64_t values[PLANE_PROP_COUNT];
+	struct drm_sprite *s;
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->output != output || (!s->current && !s->next))
+			continue;
+
+		/* All zeroes disables the plane. */
+		memset(values, 0, sizeof values);
+		if (s->next && !c->sprites_hidden) {
+			values[PLANE_PROP_FB_ID] = s->next->fb_id;
+			values[PLANE_PROP_CRTC_ID] = output->crtc_id;
+			values[PLANE_PROP_SRC_X] = s->src_x;
+			values[PLANE_PROP_SRC_Y] = s->src_y;
+			values[PLANE_PROP_SRC_W] = s->src_w;
+			values[PLANE_PROP_SRC_H] = s->src_h;
+			values[PLANE_PROP_CRTC_X] = s->dest_x;
+			values[PLANE_PROP_CRTC_Y] = s->dest_y;
+			values[PLANE_PROP_CRTC_W] = s->dest_w;
+			values[PLANE_PROP_CRTC_H] = s->dest_h;
+		}
+
+		if (drm_plane_add_state(req, s->plane_id, s->props, values) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Only adds the cursor to req; the cursor state of the output changes
+ * once the commit went through, see drm_output_commit_cursor_state().
+ * Sets *bo_updated if the next cursor bo was written for it. */
+static int
+drm_output_add_cursor_state(struct drm_output *output,
+			    drmModeAtomicReq *req, int *bo_updated)
+{
+	struct weston_surface *es = output->cursor_surface;
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	uint64_t values[PLANE_PROP_COUNT];
+	struct gbm_bo *bo;
+	uint32_t *fb_id;
+	int x, y;
+
+	memset(values, 0, sizeof values);
+
+	if (es) {
+		*bo_updated = drm_output_update_cursor_bo(output, es);
+
+		bo = output->cursor_bo[output->current_cursor];
+		fb_id = &output->cursor_fb_id[output->current_cursor];
+		if (*fb_id == 0 &&
+		    drmModeAddFB(c->drm.fd, 64, 64, 32, 32,
+				 gbm_bo_get_stride(bo),
+				 gbm_bo_get_handle(bo).u32, fb_id)) {
+			weston_log("failed to create cursor fb: %m\n");
+			c->cursors_are_broken = 1;
+			*fb_id = 0;
+		}
+
+		x = es->geometry.x - output->base.x;
+		y = es->geometry.y - output->base.y;
+
+		if (*fb_id) {
+			values[PLANE_PROP_FB_ID] = *fb_id;
+			values[PLANE_PROP_CRTC_ID] = output->crtc_id;
+			values[PLANE_PROP_SRC_W] = 64 << 16;
+			values[PLANE_PROP_SRC_H] = 64 << 16;
+			/* CRTC_X/Y are signed, the cursor may hang off
+			 * the top left edge. */
+			values[PLANE_PROP_CRTC_X] = (uint64_t) (int64_t) x;
+			values[PLANE_PROP_CRTC_Y] = (uint64_t) (int64_t) y;
+			values[PLANE_PROP_CRTC_W] = 64;
+			values[PLANE_PROP_CRTC_H] = 64;
+		}
+	}
+
+	return drm_plane_add_state(req, output->cursor_plane_id,
+				   output->cursor_props, values);
+}
+
+static void
+drm_output_commit_cursor_state(struct drm_output *output)
+{
+	struct weston_surface *es = output->cursor_surface;
+
+	output->cursor_surface = NULL;
+	if (es) {
+		output->cursor_plane.x = es->geometry.x - output->base.x;
+		output->cursor_plane.y = es->geometry.y - output->base.y;
+	}
+}
+
+/* The legacy fallback is to write the cursor bo again. */
+static void
+drm_output_revert_cursor_bo(struct drm_output *output)
+{
+	struct weston_surface *es = output->cursor_surface;
+
+	output->current_cursor ^= 1;
+	pixman_region32_union_rect(&output->cursor_plane.damage,
+				   &output->cursor_plane.damage,
+				   es->geometry.x, es->geometry.y,
+				   es->geometry.width, es->geometry.height);
+}
+
+static int
+drm_output_repaint_atomic(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_mode *mode =
+		container_of(output->base.current, struct drm_mode, base);
+	uint64_t values[PLANE_PROP_COUNT];
+	drmModeAtomicReq *req;
+	int ret, cursor_bo_updated = 0;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	memset(values, 0, sizeof values);
+	values[PLANE_PROP_FB_ID] = output->next->fb_id;
+	values[PLANE_PROP_CRTC_ID] = output->crtc_id;
+	values[PLANE_PROP_SRC_W] = mode->mode_info.hdisplay << 16;
+	values[PLANE_PROP_SRC_H] = mode->mode_info.vdisplay << 16;
+	values[PLANE_PROP_CRTC_W] = mode->mode_info.hdisplay;
+	values[PLANE_PROP_CRTC_H] = mode->mode_info.vdisplay;
+
+	ret = drm_plane_add_state(req, output->primary_plane_id,
+				  output->primary_props, values);
+	if (ret == 0)
+		ret = drm_output_add_sprites_state(output, req);
+	if (ret == 0 && output->cursor_plane_id)
+		ret = drm_output_add_cursor_state(output, req,
+						  &cursor_bo_updated);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(c->drm.fd, req,
+					  DRM_MODE_ATOMIC_NONBLOCK |
+					  DRM_MODE_PAGE_FLIP_EVENT, output);
+	drmModeAtomicFree(req);
+
+	if (ret) {
+		weston_log("atomic commit failed: %m\n");
+		if (cursor_bo_updated)
+			drm_output_revert_cursor_bo(output);
+		return -1;
+	}
+
+	if (output->cursor_plane_id)
+		drm_output_commit_cursor_state(output);
+	else
+		drm_output_set_cursor(output);
+
+	output->page_flip_pending = 1;
+	output->atomic_pending = 1;
+
+	return 0;
+}
+
+/*
+ * Check the sprite configuration currently assigned to the output with
+ * a test-only commit.  The primary and cursor planes are left out and
+ * so keep their current state.
+ */
+static int
+drm_output_test_sprites(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	drmModeAtomicReq *req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	ret = drm_output_add_sprites_state(output, req);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(c->drm.fd, req,
+					  DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	drmModeAtomicFree(req);
+
+	return ret ? -1 : 0;
+}
+
+static void
+drm_output_find_planes(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	drmModePlaneRes *plane_res;
+	drmModePlane *plane;
+	uint32_t props[PLANE_PROP_COUNT];
+	uint32_t i, j, plane_id;
+	uint64_t type;
+
+	plane_res = drmModeGetPlaneResources(c->drm.fd);
+	if (!plane_res)
+		return;
+
+	for (i = 0; i < plane_res->count_planes; i++) {
+		plane = drmModeGetPlane(c->drm.fd, plane_res->planes[i]);
+		if (!plane)
+			continue;
+
+		plane_id = plane->plane_id;
+
+		if (!(plane->possible_crtcs & (1 << output->pipe)) ||
+		    drm_plane_get_props(c->drm.fd, plane_id,
+					props, &type) < 0) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		if (type == DRM_PLANE_TYPE_PRIMARY &&
+		    !output->primary_plane_id) {
+			output->primary_plane_id = plane_id;
+			memcpy(output->primary_props, props, sizeof props);
+
+			output->count_scanout_formats = 0;
+			for (j = 0; j < plane->count_formats &&
+			     j < ARRAY_LENGTH(output->scanout_formats); j++)
+				output->scanout_formats[j] = plane->formats[j];
+			output->count_scanout_formats = j;
+		} else if (type == DRM_PLANE_TYPE_CURSOR &&
+			   !output->cursor_plane_id) {
+			output->cursor_plane_id = plane_id;
+			memcpy(output->cursor_props, props, sizeof props);
+		}
+
+		drmModeFreePlane(plane);
+	}
+
+	free(plane_res->planes);
+	free(plane_res);
+}
+#endif
+
+/* Largest number of sprites per output we rank surfaces for. */
+#define DRM_MAX_SPRITE_CANDIDATES 8
+
+/*
+ * Estimate the composition work saved per frame by putting a surface
+ * on a sprite: its visible area times the number of recent frames that
+ * damaged it.  A surface that never changes scores zero, since the
+ * primary plane does not get redrawn for it either way.
+ */
+static uint64_t
+drm_surface_overlay_score(struct weston_output *output,
+			  struct weston_surface *es)
+{
+	pixman_region32_t visible;
+	pixman_box32_t *box;
+	uint64_t area;
+
+	if (es->buffer_ref.buffer == NULL ||
+	    wl_buffer_is_shm(es->buffer_ref.buffer) ||
+	    es->output_mask != (1u << output->id))
+		return 0;
+
+	pixman_region32_init(&visible);
+	pixman_region32_intersect(&visible, &es->transform.boundingbox,
+				  &output->region);
+	box = pixman_region32_extents(&visible);
+	area = (uint64_t) (box->x2 - box->x1) * (box->y2 - box->y1);
+	pixman_region32_fini(&visible);
+
+	return area * __builtin_popcount(es->damage_history);
+}
+
+/*
+ * Rank the surfaces on the output by overlay score and return the
+ * lowest score that still makes it into the top N, N being the number
+ * of sprites the crtc can use.  Surfaces below it are left to the
+ * renderer rather than taking a sprite a busier surface further down
+ * the stack could use.
+ */
+static uint64_t
+drm_output_overlay_threshold(struct weston_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->compositor;
+	uint64_t top[DRM_MAX_SPRITE_CANDIDATES], score;
+	struct weston_surface *es;
+	struct drm_sprite *s;
+	int i, n = 0, count = 0;
+
+	if (c->sprites_are_broken)
+		return UINT64_MAX;
+
+	wl_list_for_each(s, &c->sprite_list, link)
+		if (!s->clone &&
+		    drm_sprite_crtc_supported(output, s->possible_crtcs) &&
+		    n < DRM_MAX_SPRITE_CANDIDATES)
+			n++;
+
+	if (n == 0)
+		return UINT64_MAX;
 
-		output->cursor_plane.x = x;
-		output->cursor_plane.y = y;
+	wl_list_for_each(es, &c->base.surface_list, link) {
+		score = drm_surface_overlay_score(output, es);
+		if (score == 0)
+			continue;
+
+		if (count == n && score <= top[n - 1])
+			continue;
+
+		/* insert into the top n, kept sorted highest first */
+		if (count < n)
+			count++;
+		for (i = count - 1; i > 0 && top[i - 1] < score; i--)
+			top[i] = top[i - 1];
+		top[i] = score;
 	}
+
+	return count < n ? 1 : top[n - 1];
 }
 
 static void
@@ -923,6 +2175,8 @@ drm_assign_planes(struct weston_output *output)
 	struct weston_surface *es, *next;
 	pixman_region32_t overlap, surface_overlap;
 	struct weston_plane *primary, *next_plane;
+	enum weston_plane_kind kind;
+	uint64_t threshold;
 
 	/*
 	 * Find a surface for each sprite in the output using some heuristics:
@@ -931,12 +2185,23 @@ drm_assign_planes(struct weston_output *output)
 	 * 3) opacity (though some hw might support alpha blending)
 	 * 4) clipping (this can be fixed with color keys)
 	 *
+	 * Size and frequency of update are combined into a score, see
+	 * drm_surface_overlay_score(), and only the best scoring surfaces
+	 * are tried on sprites.
+	 *
 	 * The idea is to save on blitting since this should save power.
 	 * If we can get a large video surface on the sprite for example,
 	 * the main display surface may not need to update at all, and
 	 * the client buffer can be used directly for the sprite surface
 	 * as we do for flipping full screen surfaces.
 	 */
+	threshold = drm_output_overlay_threshold(output);
+	memset(output->stats.planes, 0, sizeof output->stats.planes);
+
+	/* the repaint that took the last one may have been skipped as
+	 * idle, and its surface may be gone since */
+	((struct drm_output *) output)->cursor_surface = NULL;
+
 	pixman_region32_init(&overlap);
 	primary = &c->base.primary_plane;
 	wl_list_for_each_safe(es, next, &c->base.surface_list, link) {
@@ -950,22 +2215,48 @@ drm_assign_planes(struct weston_output *output)
 		else
 			es->keep_buffer = 0;
 
+		/* Planes of the primary GPU can't show anything on the
+		 * outputs of another, and clones only get what is
+		 * rendered. */
+		if (((struct drm_output *) output)->gpu != c->primary_gpu ||
+		    drm_output_has_clones((struct drm_output *) output)) {
+			if (es->output_mask & (1u << output->id)) {
+				weston_surface_move_to_plane(es, primary);
+				es->plane_kind = WESTON_PLANE_KIND_PRIMARY;
+				output->stats.planes[WESTON_PLANE_KIND_PRIMARY]++;
+			}
+			continue;
+		}
+
 		pixman_region32_init(&surface_overlap);
 		pixman_region32_intersect(&surface_overlap, &overlap,
 					  &es->transform.boundingbox);
 
 		next_plane = NULL;
+		kind = WESTON_PLANE_KIND_PRIMARY;
 		if (pixman_region32_not_empty(&surface_overlap))
 			next_plane = primary;
-		if (next_plane == NULL)
+		if (next_plane == NULL) {
 			next_plane = drm_output_prepare_cursor_surface(output, es);
-		if (next_plane == NULL)
+			kind = WESTON_PLANE_KIND_CURSOR;
+		}
+		if (next_plane == NULL) {
 			next_plane = drm_output_prepare_scanout_surface(output, es);
-		if (next_plane == NULL)
+			kind = WESTON_PLANE_KIND_SCANOUT;
+		}
+		if (next_plane == NULL &&
+		    drm_surface_overlay_score(output, es) >= threshold) {
 			next_plane = drm_output_prepare_overlay_surface(output, es);
-		if (next_plane == NULL)
+			kind = WESTON_PLANE_KIND_OVERLAY;
+		}
+		if (next_plane == NULL || next_plane == primary) {
 			next_plane = primary;
+			kind = WESTON_PLANE_KIND_PRIMARY;
+		}
 		weston_surface_move_to_plane(es, next_plane);
+		es->plane_kind = kind;
+		if (es->output_mask & (1u << output->id))
+			output->stats.planes[kind]++;
 		if (next_plane == primary)
 			pixman_region32_union(&overlap, &overlap,
 					      &es->transform.boundingbox);
@@ -977,6 +2268,124 @@ drm_assign_planes(struct weston_output *output)
 
 static void
 drm_output_fini_pixman(struct drm_output *output);
+static void
+drm_output_fini_copy(struct drm_output *output);
+
+static int
+drm_output_set_gamma(struct drm_output *output, uint16_t *ramp)
+{
+	uint32_t size = output->gamma_size;
+
+	return drmModeCrtcSetGamma(output->gpu->fd, output->crtc_id, size,
+				   ramp, ramp + size, ramp + 2 * size);
+}
+
+/* Fades by scaling the gamma ramp, which costs nothing at repaint
+ * time.  While in another vt the fade is only recorded and
+ * drm_compositor_set_modes() loads it on the way back. */
+static int
+drm_output_set_fade(struct weston_output *output_base, float fade)
+{
+	struct drm_output *output = (struct drm_output *) output_base;
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	uint32_t i, count = 3 * output->gamma_size;
+	uint16_t *faded;
+	float scale;
+
+	if (!output->gamma)
+		return -1;
+
+	output->fade = fade;
+	if (!c->base.focus)
+		return 0;
+
+	if (fade == 0.0)
+		faded = output->gamma;
+	else {
+		faded = output->gamma + count;
+		scale = 1.0 - fade;
+		for (i = 0; i < count; i++)
+			faded[i] = output->gamma[i] * scale;
+	}
+
+	if (drm_output_set_gamma(output, faded) < 0) {
+		weston_log("failed to set gamma on %s, "
+			   "fading in the renderer: %m\n", output->name);
+		free(output->gamma);
+		output->gamma = NULL;
+		output->base.set_fade = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+drm_clone_destroy(struct drm_clone *clone)
+{
+	struct drm_output *source = clone->source;
+	struct drm_gpu *gpu = source->gpu;
+	drmModeCrtcPtr origcrtc = clone->original_crtc;
+	struct drm_fb *current = clone->current, *next = clone->next;
+
+	if (clone->sprite) {
+		drmModeSetPlane(gpu->fd, clone->sprite->plane_id,
+				clone->crtc_id, 0, 0,
+				0, 0, 0, 0, 0, 0, 0, 0);
+		clone->sprite->clone = NULL;
+	}
+
+	if (origcrtc) {
+		drmModeSetCrtc(gpu->fd, origcrtc->crtc_id,
+			       origcrtc->buffer_id, origcrtc->x, origcrtc->y,
+			       &clone->connector_id, 1, &origcrtc->mode);
+		drmModeFreeCrtc(origcrtc);
+	}
+
+	if (clone->black)
+		drm_fb_destroy_dumb(clone->black);
+
+	gpu->crtc_allocator &= ~(1 << clone->crtc_id);
+	gpu->connector_allocator &= ~(1 << clone->connector_id);
+
+	weston_log("clone %s of %s destroyed\n", clone->name, source->name);
+	free(clone->name);
+
+	clone->current = clone->next = NULL;
+	if (clone->flip_pending) {
+		clone->destroyed = 1;
+		clone->source = NULL;
+	} else {
+		wl_list_remove(&clone->link);
+		free(clone);
+	}
+
+	drm_output_release_shown_fb(source, current);
+	drm_output_release_shown_fb(source, next);
+}
+
+/* Turns the clones of output off until it is repainted in its new
+ * mode, when they get set to it. */
+static void
+drm_output_detach_clones(struct drm_output *output)
+{
+	struct drm_clone *clone;
+	int fd = output->gpu->fd;
+
+	wl_list_for_each(clone, &clone_list, link) {
+		if (clone->source != output)
+			continue;
+
+		if (clone->sprite)
+			drmModeSetPlane(fd, clone->sprite->plane_id,
+					clone->crtc_id, 0, 0,
+					0, 0, 0, 0, 0, 0, 0, 0);
+		drmModeSetCrtc(fd, clone->crtc_id, 0, 0, 0, NULL, 0, NULL);
+		clone->current = clone->next = NULL;
+		clone->mode_set = 0;
+	}
+}
 
 static void
 drm_output_destroy(struct weston_output *output_base)
@@ -984,26 +2393,46 @@ drm_output_destroy(struct weston_output *output_base)
 	struct drm_output *output = (struct drm_output *) output_base;
 	struct drm_compositor *c =
 		(struct drm_compositor *) output->base.compositor;
+	struct drm_gpu *gpu = output->gpu;
 	drmModeCrtcPtr origcrtc = output->original_crtc;
+	struct drm_clone *clone, *next;
+	int i;
+
+	wl_list_for_each_safe(clone, next, &clone_list, link)
+		if (clone->source == output)
+			drm_clone_destroy(clone);
 
-	if (output->backlight)
+	if (output->backlight) {
+		backlight_controller_destroy(output->backlight_controller);
 		backlight_destroy(output->backlight);
+	}
 
 	/* Turn off hardware cursor */
-	drmModeSetCursor(c->drm.fd, output->crtc_id, 0, 0, 0);
+	drmModeSetCursor(gpu->fd, output->crtc_id, 0, 0, 0);
+	for (i = 0; i < 2; i++)
+		if (output->cursor_fb_id[i])
+			drmModeRmFB(c->drm.fd, output->cursor_fb_id[i]);
 
 	/* Restore original CRTC state */
-	drmModeSetCrtc(c->drm.fd, origcrtc->crtc_id, origcrtc->buffer_id,
+	if (output->gamma) {
+		drm_output_set_gamma(output, output->gamma);
+		free(output->gamma);
+	}
+	drmModeSetCrtc(gpu->fd, origcrtc->crtc_id, origcrtc->buffer_id,
 		       origcrtc->x, origcrtc->y,
 		       &output->connector_id, 1, &origcrtc->mode);
 	drmModeFreeCrtc(origcrtc);
 
-	c->crtc_allocator &= ~(1 << output->crtc_id);
-	c->connector_allocator &= ~(1 << output->connector_id);
+	gpu->crtc_allocator &= ~(1 << output->crtc_id);
+	gpu->connector_allocator &= ~(1 << output->connector_id);
+
+	if (output->lost_frame_source)
+		wl_event_source_remove(output->lost_frame_source);
 
 	if (c->use_pixman) {
 		drm_output_fini_pixman(output);
 	} else {
+		drm_output_fini_copy(output);
 		gl_renderer_output_destroy(output_base);
 		gbm_surface_destroy(output->surface);
 	}
@@ -1084,6 +2513,7 @@ drm_output_switch_mode(struct weston_output *output_base, struct weston_mode *mo
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 
 	/* reset rendering stuff. */
+	drm_output_detach_clones(output);
 	drm_output_release_fb(output, output->current);
 	drm_output_release_fb(output, output->next);
 	output->current = output->next = NULL;
@@ -1096,6 +2526,7 @@ drm_output_switch_mode(struct weston_output *output_base, struct weston_mode *mo
 			return -1;
 		}
 	} else {
+		drm_output_fini_copy(output);
 		gl_renderer_output_destroy(&output->base);
 		gbm_surface_destroy(output->surface);
 
@@ -1123,33 +2554,135 @@ on_drm_input(int fd, uint32_t mask, void *data)
 	return 1;
 }
 
+/* Frames for secondary GPUs are exported from gbm as dma-bufs. */
 static int
-init_drm(struct drm_compositor *ec, struct udev_device *device)
+drm_gpu_can_import(int fd)
+{
+#ifdef HAVE_GBM_BO_GET_FD
+	uint64_t cap;
+
+	if (drmGetCap(fd, DRM_CAP_PRIME, &cap) == 0 &&
+	    (cap & DRM_PRIME_CAP_IMPORT))
+		return 1;
+#endif
+
+	return 0;
+}
+
+static struct drm_gpu *
+drm_gpu_create(struct drm_compositor *ec, struct udev_device *device)
 {
+	struct drm_gpu *gpu;
 	const char *filename, *sysnum;
-	int fd;
+
+	gpu = calloc(1, sizeof *gpu);
+	if (gpu == NULL)
+		return NULL;
+
+	gpu->compositor = ec;
+	gpu->fd = -1;
+	gpu->probe_fd = -1;
 
 	sysnum = udev_device_get_sysnum(device);
 	if (sysnum)
-		ec->drm.id = atoi(sysnum);
-	if (!sysnum || ec->drm.id < 0) {
+		gpu->id = atoi(sysnum);
+	if (!sysnum || gpu->id < 0) {
 		weston_log("cannot get device sysnum\n");
-		return -1;
+		free(gpu);
+		return NULL;
 	}
 
 	filename = udev_device_get_devnode(device);
-	fd = open(filename, O_RDWR | O_CLOEXEC);
-	if (fd < 0) {
+	gpu->fd = open(filename, O_RDWR | O_CLOEXEC);
+	if (gpu->fd < 0) {
 		/* Probably permissions error */
 		weston_log("couldn't open %s, skipping\n",
 			udev_device_get_devnode(device));
-		return -1;
+		free(gpu);
+		return NULL;
 	}
 
 	weston_log("using %s\n", filename);
 
-	ec->drm.fd = fd;
+	gpu->prime_import = drm_gpu_can_import(gpu->fd);
+
+	wl_list_insert(ec->gpu_list.prev, &gpu->link);
 
+	return gpu;
+}
+
+static void
+drm_probe_cancel(struct drm_gpu *gpu);
+
+static void
+drm_gpu_destroy(struct drm_gpu *gpu)
+{
+	int i;
+
+	drm_probe_cancel(gpu);
+	if (gpu->probe_source)
+		wl_event_source_remove(gpu->probe_source);
+	if (gpu->probe_fd >= 0)
+		close(gpu->probe_fd);
+	for (i = 0; i < gpu->count_probed; i++)
+		if (gpu->probed[i])
+			drmModeFreeConnector(gpu->probed[i]);
+	free(gpu->probed);
+
+	if (gpu->source)
+		wl_event_source_remove(gpu->source);
+	if (weston_launcher_drm_set_master(&gpu->compositor->base,
+					   gpu->fd, 0) < 0)
+		weston_log("failed to drop master: %m\n");
+	close(gpu->fd);
+
+	wl_list_remove(&gpu->link);
+	free(gpu->crtcs);
+	free(gpu);
+}
+
+static int
+drm_gpu_add_source(struct drm_gpu *gpu)
+{
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(gpu->compositor->base.wl_display);
+
+	gpu->source = wl_event_loop_add_fd(loop, gpu->fd, WL_EVENT_READABLE,
+					   on_drm_input, gpu);
+
+	return gpu->source ? 0 : -1;
+}
+
+static int
+init_drm(struct drm_compositor *ec, struct udev_device *device)
+{
+	struct drm_gpu *gpu;
+	uint64_t cap;
+	int fd;
+
+	gpu = drm_gpu_create(ec, device);
+	if (gpu == NULL)
+		return -1;
+
+	ec->primary_gpu = gpu;
+	ec->drm.id = gpu->id;
+	ec->drm.fd = fd = gpu->fd;
+
+	/* Flip and vblank event timestamps are on the realtime clock
+	 * unless the kernel says otherwise. */
+	ec->base.presentation_clock = CLOCK_REALTIME;
+#ifdef DRM_CAP_TIMESTAMP_MONOTONIC
+	if (drmGetCap(fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) == 0 && cap == 1)
+		ec->base.presentation_clock = CLOCK_MONOTONIC;
+#endif
+
+#ifdef HAVE_DRM_ATOMIC
+	/* Also exposes the primary and cursor planes as planes. */
+	if (drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0)
+		ec->atomic_modeset = 1;
+#endif
+	weston_log("atomic modesetting %s\n",
+		   ec->atomic_modeset ? "enabled" : "not supported");
 
 	return 0;
 }
@@ -1168,6 +2701,13 @@ init_egl(struct drm_compositor *ec)
 		return -1;
 	}
 
+#ifdef ENABLE_EGL
+	ec->query_buffer =
+		(void *) eglGetProcAddress("eglQueryWaylandBufferWL");
+	ec->create_image = (void *) eglGetProcAddress("eglCreateImageKHR");
+	ec->destroy_image = (void *) eglGetProcAddress("eglDestroyImageKHR");
+#endif
+
 	return 0;
 }
 
@@ -1248,12 +2788,15 @@ drm_get_backlight(struct drm_output *output)
 	return (uint32_t) norm;
 }
 
+/* How long changes of the backlight fade for, ms. */
+#define DRM_BACKLIGHT_RAMP_MS 200
+
 /* values accepted are between 0-255 range */
 static void
 drm_set_backlight(struct weston_output *output_base, uint32_t value)
 {
 	struct drm_output *output = (struct drm_output *) output_base;
-	long max_brightness, new_brightness;
+	long new_brightness;
 
 	if (!output->backlight)
 		return;
@@ -1261,12 +2804,17 @@ drm_set_backlight(struct weston_output *output_base, uint32_t value)
 	if (value > 255)
 		return;
 
-	max_brightness = backlight_get_max_brightness(output->backlight);
-
 	/* get denormalized value */
-	new_brightness = (value * max_brightness) / 255;
-
-	backlight_set_brightness(output->backlight, new_brightness);
+	new_brightness = (value * output->backlight->max_brightness) / 255;
+
+	/* Writes to the sysfs file can take a while, leave them to the
+	 * controller thread when there is one. */
+	if (output->backlight_controller)
+		backlight_controller_set(output->backlight_controller,
+					 new_brightness,
+					 DRM_BACKLIGHT_RAMP_MS);
+	else
+		backlight_set_brightness(output->backlight, new_brightness);
 }
 
 static drmModePropertyPtr
@@ -1290,30 +2838,41 @@ drm_get_prop(int fd, drmModeConnectorPtr connector, const char *name)
 }
 
 static void
-drm_set_dpms(struct weston_output *output_base, enum dpms_enum level)
+drm_connector_set_dpms(int fd, uint32_t connector_id, enum dpms_enum level)
 {
-	struct drm_output *output = (struct drm_output *) output_base;
-	struct weston_compositor *ec = output_base->compositor;
-	struct drm_compositor *c = (struct drm_compositor *) ec;
 	drmModeConnectorPtr connector;
 	drmModePropertyPtr prop;
 
-	connector = drmModeGetConnector(c->drm.fd, output->connector_id);
+	connector = drmModeGetConnector(fd, connector_id);
 	if (!connector)
 		return;
 
-	prop = drm_get_prop(c->drm.fd, connector, "DPMS");
+	prop = drm_get_prop(fd, connector, "DPMS");
 	if (!prop) {
 		drmModeFreeConnector(connector);
 		return;
 	}
 
-	drmModeConnectorSetProperty(c->drm.fd, connector->connector_id,
+	drmModeConnectorSetProperty(fd, connector->connector_id,
 				    prop->prop_id, level);
 	drmModeFreeProperty(prop);
 	drmModeFreeConnector(connector);
 }
 
+static void
+drm_set_dpms(struct weston_output *output_base, enum dpms_enum level)
+{
+	struct drm_output *output = (struct drm_output *) output_base;
+	struct drm_clone *clone;
+
+	drm_connector_set_dpms(output->gpu->fd, output->connector_id, level);
+
+	wl_list_for_each(clone, &clone_list, link)
+		if (clone->source == output)
+			drm_connector_set_dpms(output->gpu->fd,
+					       clone->connector_id, level);
+}
+
 static const char *connector_type_names[] = {
 	"None",
 	"VGA",
@@ -1333,7 +2892,7 @@ static const char *connector_type_names[] = {
 };
 
 static int
-find_crtc_for_connector(struct drm_compositor *ec,
+find_crtc_for_connector(struct drm_gpu *gpu,
 			drmModeRes *resources, drmModeConnector *connector)
 {
 	drmModeEncoder *encoder;
@@ -1341,7 +2900,7 @@ find_crtc_for_connector(struct drm_compositor *ec,
 	int i, j;
 
 	for (j = 0; j < connector->count_encoders; j++) {
-		encoder = drmModeGetEncoder(ec->drm.fd, connector->encoders[j]);
+		encoder = drmModeGetEncoder(gpu->fd, connector->encoders[j]);
 		if (encoder == NULL) {
 			weston_log("Failed to get encoder.\n");
 			return -1;
@@ -1351,7 +2910,7 @@ find_crtc_for_connector(struct drm_compositor *ec,
 
 		for (i = 0; i < resources->count_crtcs; i++) {
 			if (possible_crtcs & (1 << i) &&
-			    !(ec->crtc_allocator & (1 << resources->crtcs[i])))
+			    !(gpu->crtc_allocator & (1 << resources->crtcs[i])))
 				return i;
 		}
 	}
@@ -1359,6 +2918,116 @@ find_crtc_for_connector(struct drm_compositor *ec,
 	return -1;
 }
 
+/* Reads the frame the gl renderer is about to swap into the dumb
+ * buffer of the secondary GPU that will show it. */
+static void
+drm_output_copy_frame(struct wl_listener *listener, void *data)
+{
+	struct drm_output *output =
+		container_of(listener, struct drm_output, frame_listener);
+	struct weston_compositor *ec = output->base.compositor;
+	struct drm_fb *fb = output->dumb[output->current_image];
+	int32_t width = output->base.current->width;
+	int32_t height = output->base.current->height;
+	pixman_box32_t *box;
+	uint32_t *rows;
+	int32_t x1, y1, x2, y2, y;
+
+	box = pixman_region32_extents(&output->copy_damage);
+	if (output->base.transform == WL_OUTPUT_TRANSFORM_NORMAL &&
+	    pixman_region32_not_empty(&output->copy_damage)) {
+		x1 = box->x1 - output->base.x;
+		y1 = box->y1 - output->base.y;
+		x2 = box->x2 - output->base.x;
+		y2 = box->y2 - output->base.y;
+		if (x1 < 0)
+			x1 = 0;
+		if (y1 < 0)
+			y1 = 0;
+		if (x2 > width)
+			x2 = width;
+		if (y2 > height)
+			y2 = height;
+	} else {
+		x1 = 0;
+		y1 = 0;
+		x2 = width;
+		y2 = height;
+	}
+	if (x2 <= x1 || y2 <= y1)
+		return;
+
+	rows = malloc((x2 - x1) * (y2 - y1) * 4);
+	if (rows == NULL)
+		return;
+
+	/* gl reads bottom row first */
+	if (ec->renderer->read_pixels(&output->base, PIXMAN_a8r8g8b8, rows,
+				      x1, height - y2,
+				      x2 - x1, y2 - y1) == 0)
+		for (y = y1; y < y2; y++)
+			memcpy((char *) fb->map + y * fb->stride + x1 * 4,
+			       rows + (y2 - 1 - y) * (x2 - x1),
+			       (x2 - x1) * 4);
+
+	free(rows);
+}
+
+static void
+drm_output_fini_copy(struct drm_output *output)
+{
+	unsigned int i;
+
+	if (!output->copy_frames)
+		return;
+
+	wl_list_remove(&output->frame_listener.link);
+	pixman_region32_fini(&output->previous_damage);
+	pixman_region32_fini(&output->copy_damage);
+
+	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+		drm_fb_destroy_dumb(output->dumb[i]);
+		output->dumb[i] = NULL;
+	}
+
+	output->copy_frames = 0;
+}
+
+/* Without PRIME, frames for a secondary GPU output go through dumb
+ * buffers of that device. */
+static int
+drm_output_init_copy(struct drm_output *output)
+{
+	int w = output->base.current->width;
+	int h = output->base.current->height;
+	unsigned int i;
+
+	if (output->copy_frames)
+		return 0;
+
+	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+		output->dumb[i] = drm_fb_create_dumb(output->gpu->fd, w, h);
+		if (!output->dumb[i]) {
+			weston_log("failed to create frame copy buffers "
+				   "for %s\n", output->name);
+			while (i--) {
+				drm_fb_destroy_dumb(output->dumb[i]);
+				output->dumb[i] = NULL;
+			}
+			return -1;
+		}
+	}
+
+	pixman_region32_init_rect(&output->previous_damage,
+				  output->base.x, output->base.y, w, h);
+	pixman_region32_init(&output->copy_damage);
+	output->frame_listener.notify = drm_output_copy_frame;
+	wl_signal_add(&output->base.frame_signal, &output->frame_listener);
+	output->copy_frames = 1;
+
+	return 0;
+}
+
 /* Init output state that depends on gl or gbm */
 static int
 drm_output_init_egl(struct drm_output *output, struct drm_compositor *ec)
@@ -1382,6 +3051,18 @@ drm_output_init_egl(struct drm_output *output, struct drm_compositor *ec)
 		return -1;
 	}
 
+	/* The cursor bos would be on the wrong device. */
+	if (output->gpu != ec->primary_gpu) {
+		if (!output->gpu->prime_import &&
+		    drm_output_init_copy(output) < 0) {
+			gl_renderer_output_destroy(&output->base);
+			gbm_surface_destroy(output->surface);
+			return -1;
+		}
+
+		return 0;
+	}
+
 	flags = GBM_BO_USE_CURSOR_64X64 | GBM_BO_USE_WRITE;
 
 	for (i = 0; i < 2; i++) {
@@ -1411,7 +3092,7 @@ drm_output_init_pixman(struct drm_output *output, struct drm_compositor *c)
 	/* FIXME error checking */
 
 	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
-		output->dumb[i] = drm_fb_create_dumb(c, w, h);
+		output->dumb[i] = drm_fb_create_dumb(output->gpu->fd, w, h);
 		if (!output->dumb[i])
 			goto err;
 
@@ -1445,40 +3126,170 @@ err:
 	return -1;
 }
 
-static void
-drm_output_fini_pixman(struct drm_output *output)
-{
-	unsigned int i;
+static void
+drm_output_fini_pixman(struct drm_output *output)
+{
+	unsigned int i;
+
+	pixman_renderer_output_destroy(&output->base);
+	pixman_region32_fini(&output->previous_damage);
+
+	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+		drm_fb_destroy_dumb(output->dumb[i]);
+		pixman_image_unref(output->image[i]);
+		output->dumb[i] = NULL;
+		output->image[i] = NULL;
+	}
+}
+
+static void
+drm_connector_get_name(drmModeConnector *connector, char *name, size_t size)
+{
+	const char *type_name;
+
+	if (connector->connector_type < ARRAY_LENGTH(connector_type_names))
+		type_name = connector_type_names[connector->connector_type];
+	else
+		type_name = "UNKNOWN";
+	snprintf(name, size, "%s%d", type_name, connector->connector_type_id);
+}
+
+static struct drm_configured_output *
+drm_connector_get_config(drmModeConnector *connector)
+{
+	struct drm_configured_output *o;
+	char name[32];
+
+	drm_connector_get_name(connector, name, sizeof name);
+	wl_list_for_each(o, &configured_output_list, link)
+		if (strcmp(o->name, name) == 0)
+			return o;
+
+	return NULL;
+}
+
+static int
+drm_connector_is_clone(drmModeConnector *connector)
+{
+	struct drm_configured_output *o;
+
+	o = drm_connector_get_config(connector);
+
+	return o && o->clone && o->config != OUTPUT_CONFIG_OFF;
+}
+
+/* Sets connector up as a clone of the output o->clone names, in a mode
+ * of the source's size if it has one, otherwise in the configured or
+ * preferred mode with the source's frames scaled to it. */
+static int
+drm_clone_create(struct drm_gpu *gpu, drmModeRes *resources,
+		 drmModeConnector *connector, struct drm_configured_output *o)
+{
+	struct drm_compositor *ec = gpu->compositor;
+	struct drm_output *source;
+	struct drm_clone *clone;
+	drmModeModeInfo *mode = NULL, *configured = NULL, *preferred = NULL;
+	char name[32];
+	int i;
+
+	wl_list_for_each(source, &ec->base.output_list, base.link)
+		if (source->gpu == gpu && strcmp(source->name, o->clone) == 0)
+			break;
+	if (&source->base.link == &ec->base.output_list) {
+		weston_log("no output %s on the same gpu to clone for %s\n",
+			   o->clone, o->name);
+		return -1;
+	}
+
+	for (i = 0; i < connector->count_modes; i++) {
+		if (connector->modes[i].hdisplay ==
+		    source->base.current->width &&
+		    connector->modes[i].vdisplay ==
+		    source->base.current->height) {
+			mode = &connector->modes[i];
+			break;
+		}
+		if (o->config == OUTPUT_CONFIG_MODE && !configured &&
+		    connector->modes[i].hdisplay == o->width &&
+		    connector->modes[i].vdisplay == o->height)
+			configured = &connector->modes[i];
+		if (connector->modes[i].type & DRM_MODE_TYPE_PREFERRED &&
+		    !preferred)
+			preferred = &connector->modes[i];
+	}
+	if (!mode)
+		mode = configured ? configured : preferred;
+	if (!mode && connector->count_modes > 0)
+		mode = &connector->modes[0];
+	if (!mode) {
+		weston_log("no available modes for clone %s\n", o->name);
+		return -1;
+	}
+
+	i = find_crtc_for_connector(gpu, resources, connector);
+	if (i < 0) {
+		weston_log("No usable crtc/encoder pair for clone %s.\n",
+			   o->name);
+		return -1;
+	}
+
+	clone = calloc(1, sizeof *clone);
+	if (clone == NULL)
+		return -1;
+
+	drm_connector_get_name(connector, name, sizeof name);
+	clone->name = strdup(name);
+	clone->source = source;
+	clone->crtc_id = resources->crtcs[i];
+	clone->pipe = i;
+	clone->connector_id = connector->connector_id;
+	clone->mode = *mode;
+
+	if ((mode->hdisplay != source->base.current->width ||
+	     mode->vdisplay != source->base.current->height) &&
+	    drm_clone_reserve_sprite(clone) < 0) {
+		weston_log("no sprite to scale %s to %dx%d for clone %s\n",
+			   source->name, mode->hdisplay, mode->vdisplay,
+			   clone->name);
+		free(clone->name);
+		free(clone);
+		return -1;
+	}
+
+	gpu->crtc_allocator |= (1 << clone->crtc_id);
+	gpu->connector_allocator |= (1 << clone->connector_id);
+	clone->original_crtc = drmModeGetCrtc(gpu->fd, clone->crtc_id);
+
+	wl_list_insert(&clone_list, &clone->link);
 
-	pixman_renderer_output_destroy(&output->base);
-	pixman_region32_fini(&output->previous_damage);
+	weston_log("%s clones %s at %dx%d%s\n", clone->name, source->name,
+		   mode->hdisplay, mode->vdisplay,
+		   clone->sprite ? ", scaled" : "");
 
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
-		drm_fb_destroy_dumb(output->dumb[i]);
-		pixman_image_unref(output->image[i]);
-		output->dumb[i] = NULL;
-		output->image[i] = NULL;
-	}
+	/* the clone is set to the next frame */
+	weston_output_damage(&source->base);
+
+	return 0;
 }
 
 static int
-create_output_for_connector(struct drm_compositor *ec,
+create_output_for_connector(struct drm_gpu *gpu,
 			    drmModeRes *resources,
 			    drmModeConnector *connector,
 			    int x, int y, struct udev_device *drm_device)
 {
+	struct drm_compositor *ec = gpu->compositor;
 	struct drm_output *output;
 	struct drm_mode *drm_mode, *next, *preferred, *current, *configured;
 	struct weston_mode *m;
-	struct drm_configured_output *o = NULL, *temp;
+	struct drm_configured_output *o = NULL;
 	drmModeEncoder *encoder;
 	drmModeModeInfo crtc_mode;
 	drmModeCrtc *crtc;
 	int i;
 	char name[32];
-	const char *type_name;
 
-	i = find_crtc_for_connector(ec, resources, connector);
+	i = find_crtc_for_connector(gpu, resources, connector);
 	if (i < 0) {
 		weston_log("No usable crtc/encoder pair for connector.\n");
 		return -1;
@@ -1489,32 +3300,43 @@ create_output_for_connector(struct drm_compositor *ec,
 		return -1;
 
 	memset(output, 0, sizeof *output);
+	output->gpu = gpu;
 	output->base.subpixel = drm_subpixel_to_wayland(connector->subpixel);
 	output->base.make = "unknown";
 	output->base.model = "unknown";
 	wl_list_init(&output->base.mode_list);
 
-	if (connector->connector_type < ARRAY_LENGTH(connector_type_names))
-		type_name = connector_type_names[connector->connector_type];
-	else
-		type_name = "UNKNOWN";
-	snprintf(name, 32, "%s%d", type_name, connector->connector_type_id);
+	drm_connector_get_name(connector, name, sizeof name);
 	output->name = strdup(name);
 
 	output->crtc_id = resources->crtcs[i];
 	output->pipe = i;
-	ec->crtc_allocator |= (1 << output->crtc_id);
+	gpu->crtc_allocator |= (1 << output->crtc_id);
 	output->connector_id = connector->connector_id;
-	ec->connector_allocator |= (1 << output->connector_id);
-
-	output->original_crtc = drmModeGetCrtc(ec->drm.fd, output->crtc_id);
+	gpu->connector_allocator |= (1 << output->connector_id);
+
+	output->original_crtc = drmModeGetCrtc(gpu->fd, output->crtc_id);
+	if (output->original_crtc && output->original_crtc->gamma_size > 0) {
+		output->gamma_size = output->original_crtc->gamma_size;
+		output->gamma = malloc(6 * output->gamma_size *
+				       sizeof output->gamma[0]);
+		if (output->gamma &&
+		    drmModeCrtcGetGamma(gpu->fd, output->crtc_id,
+					output->gamma_size, output->gamma,
+					output->gamma + output->gamma_size,
+					output->gamma +
+					2 * output->gamma_size) < 0) {
+			free(output->gamma);
+			output->gamma = NULL;
+		}
+	}
 
 	/* Get the current mode on the crtc that's currently driving
 	 * this connector. */
-	encoder = drmModeGetEncoder(ec->drm.fd, connector->encoder_id);
+	encoder = drmModeGetEncoder(gpu->fd, connector->encoder_id);
 	memset(&crtc_mode, 0, sizeof crtc_mode);
 	if (encoder != NULL) {
-		crtc = drmModeGetCrtc(ec->drm.fd, encoder->crtc_id);
+		crtc = drmModeGetCrtc(gpu->fd, encoder->crtc_id);
 		drmModeFreeEncoder(encoder);
 		if (crtc == NULL)
 			goto err_free;
@@ -1533,20 +3355,14 @@ create_output_for_connector(struct drm_compositor *ec,
 	current = NULL;
 	configured = NULL;
 
-	wl_list_for_each(temp, &configured_output_list, link) {
-		if (strcmp(temp->name, output->name) == 0) {
-			if (temp->mode)
-				weston_log("%s mode \"%s\" in config\n",
-							temp->name, temp->mode);
-			o = temp;
-			break;
-		}
-	}
+	o = drm_connector_get_config(connector);
+	if (o && o->mode)
+		weston_log("%s mode \"%s\" in config\n", o->name, o->mode);
 
 	if (o && o->config == OUTPUT_CONFIG_OFF) {
 		weston_log("Disabling output %s\n", o->name);
 
-		drmModeSetCrtc(ec->drm.fd, output->crtc_id,
+		drmModeSetCrtc(gpu->fd, output->crtc_id,
 							0, 0, 0, 0, 0, NULL);
 		goto err_free;
 	}
@@ -1594,6 +3410,16 @@ create_output_for_connector(struct drm_compositor *ec,
 
 	output->base.current->flags |= WL_OUTPUT_MODE_CURRENT;
 
+	/* Without plane information all we know the primary plane
+	 * takes is what we render to. */
+	output->scanout_formats[0] = GBM_FORMAT_XRGB8888;
+	output->count_scanout_formats = 1;
+
+#ifdef HAVE_DRM_ATOMIC
+	if (ec->atomic_modeset && gpu == ec->primary_gpu)
+		drm_output_find_planes(output);
+#endif
+
 	weston_output_init(&output->base, &ec->base, x, y,
 			   connector->mmWidth, connector->mmHeight,
 			   o ? o->transform : WL_OUTPUT_TRANSFORM_NORMAL);
@@ -1613,6 +3439,8 @@ create_output_for_connector(struct drm_compositor *ec,
 	if (output->backlight) {
 		output->base.set_backlight = drm_set_backlight;
 		output->base.backlight_current = drm_get_backlight(output);
+		output->backlight_controller =
+			backlight_controller_create(output->backlight);
 	}
 
 	wl_list_insert(ec->base.output_list.prev, &output->base.link);
@@ -1621,7 +3449,11 @@ create_output_for_connector(struct drm_compositor *ec,
 	output->base.repaint = drm_output_repaint;
 	output->base.destroy = drm_output_destroy;
 	output->base.assign_planes = drm_assign_planes;
+	output->base.idle_skip = 1;
+	output->base.move_cursor = drm_output_move_cursor;
 	output->base.set_dpms = drm_set_dpms;
+	if (output->gamma)
+		output->base.set_fade = drm_output_set_fade;
 	output->base.switch_mode = drm_output_switch_mode;
 
 	weston_plane_init(&output->cursor_plane, 0, 0);
@@ -1633,6 +3465,20 @@ create_output_for_connector(struct drm_compositor *ec,
 
 	weston_log("Output %s, (connector %d, crtc %d)\n",
 		   output->name, output->connector_id, output->crtc_id);
+	if (gpu != ec->primary_gpu)
+		weston_log_continue("  on card%d, frames %s\n", gpu->id,
+				    ec->use_pixman ? "drawn in place" :
+				    output->copy_frames ? "copied" :
+				    "shared through PRIME");
+	if (output->primary_plane_id)
+		weston_log_continue("  primary plane %d, cursor plane %d\n",
+				    output->primary_plane_id,
+				    output->cursor_plane_id);
+	weston_log_continue("  scanout formats:");
+	for (i = 0; i < output->count_scanout_formats; i++)
+		weston_log_continue(" %.4s",
+				    (const char *) &output->scanout_formats[i]);
+	weston_log_continue("\n");
 	wl_list_for_each(m, &output->base.mode_list, link)
 		weston_log_continue("  mode %dx%d@%.1f%s%s%s\n",
 				    m->width, m->height, m->refresh / 1000.0,
@@ -1654,9 +3500,10 @@ err_free:
 		free(drm_mode);
 	}
 
+	free(output->gamma);
 	drmModeFreeCrtc(output->original_crtc);
-	ec->crtc_allocator &= ~(1 << output->crtc_id);
-	ec->connector_allocator &= ~(1 << output->connector_id);
+	gpu->crtc_allocator &= ~(1 << output->crtc_id);
+	gpu->connector_allocator &= ~(1 << output->connector_id);
 	free(output->name);
 	free(output);
 
@@ -1669,7 +3516,11 @@ create_sprites(struct drm_compositor *ec)
 	struct drm_sprite *sprite;
 	drmModePlaneRes *plane_res;
 	drmModePlane *plane;
+	uint32_t props[PLANE_PROP_COUNT];
 	uint32_t i;
+#ifdef HAVE_DRM_ATOMIC
+	uint64_t type;
+#endif
 
 	plane_res = drmModeGetPlaneResources(ec->drm.fd);
 	if (!plane_res) {
@@ -1683,6 +3534,18 @@ create_sprites(struct drm_compositor *ec)
 		if (!plane)
 			continue;
 
+		memset(props, 0, sizeof props);
+#ifdef HAVE_DRM_ATOMIC
+		/* Primary and cursor planes belong to their output. */
+		if (ec->atomic_modeset &&
+		    (drm_plane_get_props(ec->drm.fd, plane->plane_id,
+					 props, &type) < 0 ||
+		     type != DRM_PLANE_TYPE_OVERLAY)) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+#endif
+
 		sprite = malloc(sizeof(*sprite) + ((sizeof(uint32_t)) *
 						   plane->count_formats));
 		if (!sprite) {
@@ -1700,6 +3563,7 @@ create_sprites(struct drm_compositor *ec)
 		sprite->next = NULL;
 		sprite->compositor = ec;
 		sprite->count_formats = plane->count_formats;
+		memcpy(sprite->props, props, sizeof props);
 		memcpy(sprite->formats, plane->formats,
 		       plane->count_formats * sizeof(plane->formats[0]));
 		drmModeFreePlane(plane);
@@ -1735,45 +3599,69 @@ destroy_sprites(struct drm_compositor *compositor)
 	}
 }
 
+/* Outputs of a secondary GPU go to the right of what is there.
+ * Clones are set up in a second pass, once the outputs they show
+ * exist; one whose source is missing becomes an output of its own. */
 static int
-create_outputs(struct drm_compositor *ec, uint32_t option_connector,
+create_outputs(struct drm_gpu *gpu, uint32_t option_connector,
 	       struct udev_device *drm_device)
 {
+	struct drm_compositor *ec = gpu->compositor;
+	struct weston_output *last;
 	drmModeConnector *connector;
 	drmModeRes *resources;
-	int i;
+	int i, pass, is_clone;
 	int x = 0, y = 0;
 
-	resources = drmModeGetResources(ec->drm.fd);
+	resources = drmModeGetResources(gpu->fd);
 	if (!resources) {
 		weston_log("drmModeGetResources failed\n");
 		return -1;
 	}
 
-	ec->crtcs = calloc(resources->count_crtcs, sizeof(uint32_t));
-	if (!ec->crtcs) {
+	gpu->crtcs = calloc(resources->count_crtcs, sizeof(uint32_t));
+	if (!gpu->crtcs) {
 		drmModeFreeResources(resources);
 		return -1;
 	}
 
-	ec->min_width  = resources->min_width;
-	ec->max_width  = resources->max_width;
-	ec->min_height = resources->min_height;
-	ec->max_height = resources->max_height;
+	if (gpu == ec->primary_gpu) {
+		ec->min_width  = resources->min_width;
+		ec->max_width  = resources->max_width;
+		ec->min_height = resources->min_height;
+		ec->max_height = resources->max_height;
+	}
+
+	gpu->num_crtcs = resources->count_crtcs;
+	memcpy(gpu->crtcs, resources->crtcs,
+	       sizeof(uint32_t) * gpu->num_crtcs);
 
-	ec->num_crtcs = resources->count_crtcs;
-	memcpy(ec->crtcs, resources->crtcs, sizeof(uint32_t) * ec->num_crtcs);
+	if (!wl_list_empty(&ec->base.output_list)) {
+		last = container_of(ec->base.output_list.prev,
+				    struct weston_output, link);
+		x = last->x + last->width;
+	}
 
+	for (pass = 0; pass < 2; pass++)
 	for (i = 0; i < resources->count_connectors; i++) {
-		connector = drmModeGetConnector(ec->drm.fd,
+		connector = drmModeGetConnector(gpu->fd,
 						resources->connectors[i]);
 		if (connector == NULL)
 			continue;
 
+		is_clone = drm_connector_is_clone(connector);
 		if (connector->connection == DRM_MODE_CONNECTED &&
 		    (option_connector == 0 ||
-		     connector->connector_id == option_connector)) {
-			if (create_output_for_connector(ec, resources,
+		     connector->connector_id == option_connector) &&
+		    is_clone == pass) {
+			if (is_clone &&
+			    drm_clone_create(gpu, resources, connector,
+					     drm_connector_get_config(connector)) == 0) {
+				drmModeFreeConnector(connector);
+				continue;
+			}
+
+			if (create_output_for_connector(gpu, resources,
 							connector, x, y,
 							drm_device) < 0) {
 				drmModeFreeConnector(connector);
@@ -1788,71 +3676,178 @@ create_outputs(struct drm_compositor *ec, uint32_t option_connector,
 		drmModeFreeConnector(connector);
 	}
 
-	if (wl_list_empty(&ec->base.output_list)) {
-		weston_log("No currently active connector found.\n");
-		drmModeFreeResources(resources);
-		return -1;
-	}
-
 	drmModeFreeResources(resources);
 
 	return 0;
 }
 
+/*
+ * drmModeGetConnector makes the kernel probe the connector, which can
+ * mean reading its EDID over DDC for most of 100 ms.  On hotplug that
+ * runs on a thread of its own, and the main loop only creates and
+ * destroys outputs once everything has been read.  Hotplugs coming in
+ * while a probe runs are folded into one more probe after it.
+ */
+struct drm_probe {
+	struct drm_gpu *gpu;
+	struct udev_device *device;
+	pthread_t thread;
+
+	drmModeRes *resources;
+	drmModeConnector **connectors;
+	int count_connectors;
+};
+
 static void
-update_outputs(struct drm_compositor *ec, struct udev_device *drm_device)
+drm_probe_destroy(struct drm_probe *probe)
 {
-	drmModeConnector *connector;
-	drmModeRes *resources;
+	int i;
+
+	for (i = 0; i < probe->count_connectors; i++)
+		if (probe->connectors[i])
+			drmModeFreeConnector(probe->connectors[i]);
+	free(probe->connectors);
+	if (probe->resources)
+		drmModeFreeResources(probe->resources);
+	udev_device_unref(probe->device);
+	free(probe);
+}
+
+static void *
+drm_probe_run(void *data)
+{
+	struct drm_probe *probe = data;
+	struct drm_gpu *gpu = probe->gpu;
+	uint64_t one = 1;
+	sigset_t mask;
+	int i, count;
+
+	/* Leave all signal handling to the main thread's signalfds. */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	probe->resources = drmModeGetResources(gpu->fd);
+	if (probe->resources) {
+		count = probe->resources->count_connectors;
+		probe->connectors = calloc(count, sizeof *probe->connectors);
+		if (probe->connectors)
+			probe->count_connectors = count;
+	}
+
+	for (i = 0; i < probe->count_connectors; i++)
+		probe->connectors[i] =
+			drmModeGetConnector(gpu->fd,
+					    probe->resources->connectors[i]);
+
+	if (write(gpu->probe_fd, &one, sizeof one) < 0)
+		weston_log("failed to wake compositor after probe: %m\n");
+
+	return NULL;
+}
+
+static void
+drm_probe_start(struct drm_gpu *gpu, struct udev_device *device)
+{
+	struct drm_probe *probe;
+
+	probe = calloc(1, sizeof *probe);
+	if (probe == NULL)
+		return;
+
+	probe->gpu = gpu;
+	probe->device = udev_device_ref(device);
+	if (pthread_create(&probe->thread, NULL, drm_probe_run, probe) != 0) {
+		weston_log("failed to start connector probe thread\n");
+		drm_probe_destroy(probe);
+		return;
+	}
+
+	gpu->probe = probe;
+}
+
+/* Waits for a running probe and throws its result away. */
+static void
+drm_probe_cancel(struct drm_gpu *gpu)
+{
+	if (gpu->probe) {
+		pthread_join(gpu->probe->thread, NULL);
+		drm_probe_destroy(gpu->probe);
+		gpu->probe = NULL;
+	}
+	if (gpu->probe_pending) {
+		udev_device_unref(gpu->probe_pending);
+		gpu->probe_pending = NULL;
+	}
+}
+
+static drmModeConnector *
+drm_gpu_find_probed(struct drm_gpu *gpu, uint32_t connector_id)
+{
+	int i;
+
+	for (i = 0; i < gpu->count_probed; i++)
+		if (gpu->probed[i] &&
+		    gpu->probed[i]->connector_id == connector_id)
+			return gpu->probed[i];
+
+	return NULL;
+}
+
+/* A connector whose monitor was swapped between two probes, without a
+ * disconnect seen in between, shows up as changed modes or size. */
+static int
+drm_connector_changed(drmModeConnector *old, drmModeConnector *new)
+{
+	return old->connection != new->connection ||
+	       old->mmWidth != new->mmWidth ||
+	       old->mmHeight != new->mmHeight ||
+	       old->count_modes != new->count_modes ||
+	       memcmp(old->modes, new->modes,
+		      new->count_modes * sizeof new->modes[0]) != 0;
+}
+
+static void
+update_outputs(struct drm_gpu *gpu, struct drm_probe *probe)
+{
+	struct drm_compositor *ec = gpu->compositor;
+	drmModeConnector *connector, *old;
 	struct drm_output *output, *next;
+	struct drm_clone *clone, *clone_next;
+	struct weston_output *last;
 	int x = 0, y = 0;
 	int x_offset = 0, y_offset = 0;
-	uint32_t connected = 0, disconnects = 0;
+	uint32_t connected = 0, changed = 0, disconnects = 0;
 	int i;
 
-	resources = drmModeGetResources(ec->drm.fd);
-	if (!resources) {
+	if (!probe->resources) {
 		weston_log("drmModeGetResources failed\n");
 		return;
 	}
 
-	/* collect new connects */
-	for (i = 0; i < resources->count_connectors; i++) {
-		int connector_id = resources->connectors[i];
-
-		connector = drmModeGetConnector(ec->drm.fd, connector_id);
-		if (connector == NULL)
-			continue;
-
-		if (connector->connection != DRM_MODE_CONNECTED) {
-			drmModeFreeConnector(connector);
+	for (i = 0; i < probe->count_connectors; i++) {
+		connector = probe->connectors[i];
+		if (connector == NULL ||
+		    connector->connection != DRM_MODE_CONNECTED)
 			continue;
-		}
 
-		connected |= (1 << connector_id);
+		connected |= (1 << connector->connector_id);
 
-		if (!(ec->connector_allocator & (1 << connector_id))) {
-			struct weston_output *last =
-				container_of(ec->base.output_list.prev,
-					     struct weston_output, link);
+		old = drm_gpu_find_probed(gpu, connector->connector_id);
+		if (old && drm_connector_changed(old, connector))
+			changed |= (1 << connector->connector_id);
+	}
 
-			/* XXX: not yet needed, we die with 0 outputs */
-			if (!wl_list_empty(&ec->base.output_list))
-				x = last->x + last->width;
-			else
-				x = 0;
-			y = 0;
-			create_output_for_connector(ec, resources,
-						    connector, x, y,
-						    drm_device);
-			weston_log("connector %d connected\n", connector_id);
+	/* outputs of changed connectors are created anew below */
+	disconnects = gpu->connector_allocator & (~connected | changed);
+	wl_list_for_each_safe(clone, clone_next, &clone_list, link) {
+		if (clone->destroyed || clone->source->gpu != gpu ||
+		    !(disconnects & (1 << clone->connector_id)))
+			continue;
 
-		}
-		drmModeFreeConnector(connector);
+		disconnects &= ~(1 << clone->connector_id);
+		drm_clone_destroy(clone);
 	}
-	drmModeFreeResources(resources);
 
-	disconnects = ec->connector_allocator & ~connected;
 	if (disconnects) {
 		wl_list_for_each_safe(output, next, &ec->base.output_list,
 				      base.link) {
@@ -1862,29 +3857,134 @@ update_outputs(struct drm_compositor *ec, struct udev_device *drm_device)
 						 output->base.y - y_offset);
 			}
 
-			if (disconnects & (1 << output->connector_id)) {
+			if (output->gpu == gpu &&
+			    disconnects & (1 << output->connector_id)) {
 				disconnects &= ~(1 << output->connector_id);
-				weston_log("connector %d disconnected\n",
-				       output->connector_id);
+				weston_log("connector %d %s\n",
+					   output->connector_id,
+					   changed & (1 << output->connector_id) ?
+					   "changed" : "disconnected");
 				x_offset += output->base.width;
 				drm_output_destroy(&output->base);
 			}
 		}
 	}
 
+	/* collect new connects, connectors with outputs were not changed */
+	for (i = 0; i < probe->count_connectors; i++) {
+		connector = probe->connectors[i];
+		if (connector == NULL ||
+		    connector->connection != DRM_MODE_CONNECTED ||
+		    gpu->connector_allocator & (1 << connector->connector_id))
+			continue;
+
+		if (drm_connector_is_clone(connector) &&
+		    drm_clone_create(gpu, probe->resources, connector,
+				     drm_connector_get_config(connector)) == 0) {
+			weston_log("connector %d connected\n",
+				   connector->connector_id);
+			continue;
+		}
+
+		last = container_of(ec->base.output_list.prev,
+				    struct weston_output, link);
+
+		/* XXX: not yet needed, we die with 0 outputs */
+		if (!wl_list_empty(&ec->base.output_list))
+			x = last->x + last->width;
+		else
+			x = 0;
+		y = 0;
+		create_output_for_connector(gpu, probe->resources,
+					    connector, x, y, probe->device);
+		weston_log("connector %d connected\n",
+			   connector->connector_id);
+	}
+
+	/* keep the connectors to compare the next probe with */
+	for (i = 0; i < gpu->count_probed; i++)
+		if (gpu->probed[i])
+			drmModeFreeConnector(gpu->probed[i]);
+	free(gpu->probed);
+	gpu->probed = probe->connectors;
+	gpu->count_probed = probe->count_connectors;
+	probe->connectors = NULL;
+	probe->count_connectors = 0;
+
 	/* FIXME: handle zero outputs, without terminating */	
-	if (ec->connector_allocator == 0)
+	if (wl_list_empty(&ec->base.output_list))
 		wl_display_terminate(ec->base.wl_display);
 }
 
 static int
-udev_event_is_hotplug(struct drm_compositor *ec, struct udev_device *device)
+drm_probe_done(int fd, uint32_t mask, void *data)
+{
+	struct drm_gpu *gpu = data;
+	struct drm_probe *probe = gpu->probe;
+	struct udev_device *pending;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) < 0 || probe == NULL)
+		return 1;
+
+	pthread_join(probe->thread, NULL);
+	gpu->probe = NULL;
+	update_outputs(gpu, probe);
+	drm_probe_destroy(probe);
+
+	pending = gpu->probe_pending;
+	gpu->probe_pending = NULL;
+	if (pending) {
+		drm_probe_start(gpu, pending);
+		udev_device_unref(pending);
+	}
+
+	return 1;
+}
+
+static void
+drm_gpu_hotplug(struct drm_gpu *gpu, struct udev_device *device)
+{
+	struct wl_event_loop *loop;
+
+	if (gpu->probe_fd < 0) {
+		gpu->probe_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (gpu->probe_fd < 0) {
+			weston_log("failed to create probe eventfd: %m\n");
+			return;
+		}
+
+		loop = wl_display_get_event_loop(
+			gpu->compositor->base.wl_display);
+		gpu->probe_source =
+			wl_event_loop_add_fd(loop, gpu->probe_fd,
+					     WL_EVENT_READABLE,
+					     drm_probe_done, gpu);
+		if (gpu->probe_source == NULL) {
+			close(gpu->probe_fd);
+			gpu->probe_fd = -1;
+			return;
+		}
+	}
+
+	if (gpu->probe) {
+		if (gpu->probe_pending)
+			udev_device_unref(gpu->probe_pending);
+		gpu->probe_pending = udev_device_ref(device);
+		return;
+	}
+
+	drm_probe_start(gpu, device);
+}
+
+static int
+udev_event_is_hotplug(struct drm_gpu *gpu, struct udev_device *device)
 {
 	const char *sysnum;
 	const char *val;
 
 	sysnum = udev_device_get_sysnum(device);
-	if (!sysnum || atoi(sysnum) != ec->drm.id)
+	if (!sysnum || atoi(sysnum) != gpu->id)
 		return 0;
 
 	val = udev_device_get_property_value(device, "HOTPLUG");
@@ -1899,11 +3999,15 @@ udev_drm_event(int fd, uint32_t mask, void *data)
 {
 	struct drm_compositor *ec = data;
 	struct udev_device *event;
+	struct drm_gpu *gpu;
 
 	event = udev_monitor_receive_device(ec->udev_monitor);
 
-	if (udev_event_is_hotplug(ec, event))
-		update_outputs(ec, event);
+	wl_list_for_each(gpu, &ec->gpu_list, link)
+		if (udev_event_is_hotplug(gpu, event)) {
+			drm_gpu_hotplug(gpu, event);
+			break;
+		}
 
 	udev_device_unref(event);
 
@@ -1914,9 +4018,11 @@ static void
 drm_restore(struct weston_compositor *ec)
 {
 	struct drm_compositor *d = (struct drm_compositor *) ec;
+	struct drm_gpu *gpu;
 
-	if (weston_launcher_drm_set_master(&d->base, d->drm.fd, 0) < 0)
-		weston_log("failed to drop master: %m\n");
+	wl_list_for_each(gpu, &d->gpu_list, link)
+		if (weston_launcher_drm_set_master(&d->base, gpu->fd, 0) < 0)
+			weston_log("failed to drop master: %m\n");
 	tty_reset(d->tty);
 }
 
@@ -1925,6 +4031,7 @@ drm_free_configured_output(struct drm_configured_output *output)
 {
 	free(output->name);
 	free(output->mode);
+	free(output->clone);
 	free(output);
 }
 
@@ -1934,14 +4041,16 @@ drm_destroy(struct weston_compositor *ec)
 	struct drm_compositor *d = (struct drm_compositor *) ec;
 	struct udev_seat *seat, *next;
 	struct drm_configured_output *o, *n;
+	struct drm_gpu *gpu, *gpu_next;
 
 	wl_list_for_each_safe(seat, next, &ec->seat_list, base.link)
 		udev_seat_destroy(seat);
+	evdev_config_release();
 	wl_list_for_each_safe(o, n, &configured_output_list, link)
 		drm_free_configured_output(o);
+	wl_list_remove(&d->config_listener.link);
 
 	wl_event_source_remove(d->udev_drm_source);
-	wl_event_source_remove(d->drm_source);
 
 	weston_compositor_shutdown(ec);
 
@@ -1952,41 +4061,93 @@ drm_destroy(struct weston_compositor *ec)
 	if (d->gbm)
 		gbm_device_destroy(d->gbm);
 
-	if (weston_launcher_drm_set_master(&d->base, d->drm.fd, 0) < 0)
-		weston_log("failed to drop master: %m\n");
+	wl_list_for_each_safe(gpu, gpu_next, &d->gpu_list, link)
+		drm_gpu_destroy(gpu);
 	tty_destroy(d->tty);
 
 	free(d);
 }
 
+/* Whether the crtc still scans out our last frame in our mode, which
+ * it does when we come back from a vt nobody else set a mode on. */
+static int
+drm_output_crtc_unchanged(struct drm_output *output)
+{
+	struct drm_mode *drm_mode = (struct drm_mode *) output->base.current;
+	drmModeModeInfo *mode = &drm_mode->mode_info;
+	drmModeCrtcPtr crtc;
+	int unchanged;
+
+	crtc = drmModeGetCrtc(output->gpu->fd, output->crtc_id);
+	if (!crtc)
+		return 0;
+
+	unchanged = crtc->buffer_id == output->current->fb_id &&
+		crtc->x == 0 && crtc->y == 0 && crtc->mode_valid &&
+		crtc->mode.clock == mode->clock &&
+		crtc->mode.hdisplay == mode->hdisplay &&
+		crtc->mode.vdisplay == mode->vdisplay &&
+		crtc->mode.htotal == mode->htotal &&
+		crtc->mode.vtotal == mode->vtotal &&
+		crtc->mode.flags == mode->flags;
+	drmModeFreeCrtc(crtc);
+
+	return unchanged;
+}
+
+/* Sets the modes again after a vt switch.  An output whose crtc was
+ * left alone keeps its mode and frame, and only needs the cursor and
+ * sprites, which were turned off when leaving, put back by a repaint of
+ * what changed meanwhile.  Any other output is set and fully damaged. */
 static void
 drm_compositor_set_modes(struct drm_compositor *compositor)
 {
 	struct drm_output *output;
 	struct drm_mode *drm_mode;
+	struct drm_clone *clone;
 	int ret;
 
+	/* set again at the next repaint of their source */
+	wl_list_for_each(clone, &clone_list, link)
+		clone->mode_set = 0;
+
 	wl_list_for_each(output, &compositor->base.output_list, base.link) {
+		/* the ramp was restored when leaving, fade it again */
+		if (output->base.set_fade)
+			drm_output_set_fade(&output->base, output->fade);
+
 		if (!output->current) {
 			/* If something that would cause the output to
 			 * switch mode happened while in another vt, we
 			 * might not have a current drm_fb. In that case,
 			 * schedule a repaint and let drm_output_repaint
 			 * handle setting the mode. */
-			weston_output_schedule_repaint(&output->base);
+			weston_output_damage(&output->base);
 			continue;
 		}
 
-		drm_mode = (struct drm_mode *) output->base.current;
-		ret = drmModeSetCrtc(compositor->drm.fd, output->crtc_id,
-				     output->current->fb_id, 0, 0,
-				     &output->connector_id, 1,
-				     &drm_mode->mode_info);
-		if (ret < 0) {
-			weston_log(
-				"failed to set mode %dx%d for output at %d,%d: %m\n",
-				drm_mode->base.width, drm_mode->base.height, 
-				output->base.x, output->base.y);
+		pixman_region32_union_rect(&output->cursor_plane.damage,
+					   &output->cursor_plane.damage,
+					   0, 0, 64, 64);
+		output->cursor_plane.x = INT32_MIN;
+		output->cursor_plane.y = INT32_MIN;
+
+		if (drm_output_crtc_unchanged(output)) {
+			output->base.dirty = 1;
+			weston_output_schedule_repaint(&output->base);
+		} else {
+			drm_mode = (struct drm_mode *) output->base.current;
+			ret = drmModeSetCrtc(output->gpu->fd, output->crtc_id,
+					     output->current->fb_id, 0, 0,
+					     &output->connector_id, 1,
+					     &drm_mode->mode_info);
+			if (ret < 0)
+				weston_log("failed to set mode %dx%d for "
+					   "output at %d,%d: %m\n",
+					   drm_mode->base.width,
+					   drm_mode->base.height,
+					   output->base.x, output->base.y);
+			weston_output_damage(&output->base);
 		}
 	}
 }
@@ -1998,18 +4159,22 @@ vt_func(struct weston_compositor *compositor, int event)
 	struct udev_seat *seat;
 	struct drm_sprite *sprite;
 	struct drm_output *output;
+	struct drm_gpu *gpu;
 
 	switch (event) {
 	case TTY_ENTER_VT:
 		weston_log("entering VT\n");
 		compositor->focus = 1;
-		if (weston_launcher_drm_set_master(&ec->base, ec->drm.fd, 1)) {
-			weston_log("failed to set master: %m\n");
-			wl_display_terminate(compositor->wl_display);
-		}
+		wl_list_for_each(gpu, &ec->gpu_list, link)
+			if (weston_launcher_drm_set_master(&ec->base,
+							   gpu->fd, 1)) {
+				weston_log("failed to set master: %m\n");
+				if (gpu == ec->primary_gpu)
+					wl_display_terminate(
+						compositor->wl_display);
+			}
 		compositor->state = ec->prev_state;
 		drm_compositor_set_modes(ec);
-		weston_compositor_damage_all(compositor);
 		wl_list_for_each(seat, &compositor->seat_list, base.link)
 			udev_seat_enable(seat, ec->udev);
 		break;
@@ -2032,7 +4197,14 @@ vt_func(struct weston_compositor *compositor, int event)
 
 		wl_list_for_each(output, &ec->base.output_list, base.link) {
 			output->base.repaint_needed = 0;
-			drmModeSetCursor(ec->drm.fd, output->crtc_id, 0, 0, 0);
+			drmModeSetCursor(output->gpu->fd, output->crtc_id,
+					 0, 0, 0);
+
+			/* Don't leave the next session or the console
+			 * faded out; the fade is loaded again by
+			 * drm_compositor_set_modes() when coming back. */
+			if (output->gamma && output->fade != 0.0)
+				drm_output_set_gamma(output, output->gamma);
 		}
 
 		output = container_of(ec->base.output_list.next,
@@ -2044,8 +4216,10 @@ vt_func(struct weston_compositor *compositor, int event)
 					output->crtc_id, 0, 0,
 					0, 0, 0, 0, 0, 0, 0, 0);
 
-		if (weston_launcher_drm_set_master(&ec->base, ec->drm.fd, 0) < 0)
-			weston_log("failed to drop master: %m\n");
+		wl_list_for_each(gpu, &ec->gpu_list, link)
+			if (weston_launcher_drm_set_master(&ec->base,
+							   gpu->fd, 0) < 0)
+				weston_log("failed to drop master: %m\n");
 
 		break;
 	};
@@ -2115,6 +4289,54 @@ find_primary_gpu(struct drm_compositor *ec, const char *seat)
 	return drm_device;
 }
 
+/*
+ * Bring up the outputs of the other DRM devices of the seat, rendered
+ * on the primary GPU.  A device that fails is skipped.
+ */
+static void
+create_secondary_gpus(struct drm_compositor *ec, const char *seat,
+		      struct udev_device *primary)
+{
+	struct udev_enumerate *e;
+	struct udev_list_entry *entry;
+	const char *path, *device_seat;
+	struct udev_device *device;
+	struct drm_gpu *gpu;
+
+	e = udev_enumerate_new(ec->udev);
+	udev_enumerate_add_match_subsystem(e, "drm");
+	udev_enumerate_add_match_sysname(e, "card[0-9]*");
+
+	udev_enumerate_scan_devices(e);
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(e)) {
+		path = udev_list_entry_get_name(entry);
+		if (!strcmp(path, udev_device_get_syspath(primary)))
+			continue;
+
+		device = udev_device_new_from_syspath(ec->udev, path);
+		if (!device)
+			continue;
+		device_seat = udev_device_get_property_value(device, "ID_SEAT");
+		if (!device_seat)
+			device_seat = default_seat;
+		if (strcmp(device_seat, seat)) {
+			udev_device_unref(device);
+			continue;
+		}
+
+		gpu = drm_gpu_create(ec, device);
+		if (gpu && (create_outputs(gpu, 0, device) < 0 ||
+			    drm_gpu_add_source(gpu) < 0)) {
+			weston_log("failed to use %s\n", path);
+			drm_gpu_destroy(gpu);
+		}
+
+		udev_device_unref(device);
+	}
+
+	udev_enumerate_unref(e);
+}
+
 static void
 planes_binding(struct wl_seat *seat, uint32_t time, uint32_t key, void *data)
 {
@@ -2135,15 +4357,20 @@ planes_binding(struct wl_seat *seat, uint32_t time, uint32_t key, void *data)
 	}
 }
 
+static void
+drm_config_reloaded(struct wl_listener *listener, void *data);
+
 static struct weston_compositor *
 drm_compositor_create(struct wl_display *display,
 		      int connector, const char *seat, int tty, int pixman,
+		      int secondary_gpus,
 		      int *argc, char *argv[], const char *config_file)
 {
 	struct drm_compositor *ec;
 	struct udev_device *drm_device;
 	struct wl_event_loop *loop;
 	struct udev_seat *udev_seat, *next;
+	struct drm_gpu *gpu, *gpu_next;
 	const char *path;
 	uint32_t key;
 
@@ -2155,10 +4382,13 @@ drm_compositor_create(struct wl_display *display,
 	memset(ec, 0, sizeof *ec);
 
 	/* KMS support for sprites is not complete yet, so disable the
-	 * functionality for now. */
+	 * functionality for now.  With atomic modesetting every sprite
+	 * assignment is checked with a test-only commit, which makes
+	 * them safe to use, so they are enabled again below. */
 	ec->sprites_are_broken = 1;
 
 	ec->use_pixman = pixman;
+	wl_list_init(&ec->gpu_list);
 
 	if (weston_compositor_init(&ec->base, display, argc, argv,
 				   config_file) < 0) {
@@ -2166,6 +4396,9 @@ drm_compositor_create(struct wl_display *display,
 		goto err_base;
 	}
 
+	ec->config_listener.notify = drm_config_reloaded;
+	wl_signal_add(&ec->base.config_signal, &ec->config_listener);
+
 	/* Check if we run drm-backend using weston-launch */
 	if (ec->base.launcher_sock == -1) {
 		weston_log("fatal: drm backend should be run "
@@ -2197,6 +4430,10 @@ drm_compositor_create(struct wl_display *display,
 		weston_log("failed to initialize kms\n");
 		goto err_udev_dev;
 	}
+	weston_log_startup_phase("kms");
+
+	if (ec->atomic_modeset)
+		ec->sprites_are_broken = 0;
 
 	if (ec->use_pixman) {
 		if (init_pixman(ec) < 0) {
@@ -2209,6 +4446,7 @@ drm_compositor_create(struct wl_display *display,
 			goto err_udev_dev;
 		}
 	}
+	weston_log_startup_phase("renderer");
 
 	ec->base.destroy = drm_destroy;
 	ec->base.restore = drm_restore;
@@ -2224,23 +4462,32 @@ drm_compositor_create(struct wl_display *display,
 
 	wl_list_init(&ec->sprite_list);
 	create_sprites(ec);
+	wl_list_init(&clone_list);
 
-	if (create_outputs(ec, connector, drm_device) < 0) {
+	if (create_outputs(ec->primary_gpu, connector, drm_device) < 0) {
 		weston_log("failed to create output for %s\n", path);
 		goto err_sprite;
 	}
 
+	if (secondary_gpus && connector == 0)
+		create_secondary_gpus(ec, seat, drm_device);
+
+	if (wl_list_empty(&ec->base.output_list)) {
+		weston_log("No currently active connector found.\n");
+		goto err_sprite;
+	}
+	weston_log_startup_phase("outputs");
+
 	path = NULL;
 
 	if (udev_seat_create(&ec->base, ec->udev, seat) == NULL) {
 		weston_log("failed to create input devices\n");
 		goto err_sprite;
 	}
+	weston_log_startup_phase("input");
 
 	loop = wl_display_get_event_loop(ec->base.wl_display);
-	ec->drm_source =
-		wl_event_loop_add_fd(loop, ec->drm.fd,
-				     WL_EVENT_READABLE, on_drm_input, ec);
+	drm_gpu_add_source(ec->primary_gpu);
 
 	ec->udev_monitor = udev_monitor_new_from_netlink(ec->udev, "udev");
 	if (ec->udev_monitor == NULL) {
@@ -2274,7 +4521,6 @@ err_udev_monitor:
 	wl_event_source_remove(ec->udev_drm_source);
 	udev_monitor_unref(ec->udev_monitor);
 err_drm_source:
-	wl_event_source_remove(ec->drm_source);
 	wl_list_for_each_safe(udev_seat, next, &ec->base.seat_list, base.link)
 		udev_seat_destroy(udev_seat);
 err_sprite:
@@ -2284,8 +4530,8 @@ err_sprite:
 err_udev_dev:
 	udev_device_unref(drm_device);
 err_tty:
-	if (weston_launcher_drm_set_master(&ec->base, ec->drm.fd, 0) < 0)
-		weston_log("failed to drop master: %m\n");
+	wl_list_for_each_safe(gpu, gpu_next, &ec->gpu_list, link)
+		drm_gpu_destroy(gpu);
 	tty_destroy(ec->tty);
 err_udev:
 	udev_unref(ec->udev);
@@ -2397,20 +4643,24 @@ output_section_done(void *data)
 	output = malloc(sizeof *output);
 
 	if (!output || !output_name || (output_name[0] == 'X') ||
-					(!output_mode && !output_transform)) {
+	    (!output_mode && !output_transform && !output_clone)) {
 		free(output_name);
 		free(output_mode);
 		free(output_transform);
+		free(output_clone);
 		free(output);
 		output_name = NULL;
 		output_mode = NULL;
 		output_transform = NULL;
+		output_clone = NULL;
 		return;
 	}
 
 	output->config = OUTPUT_CONFIG_INVALID;
 	output->name = output_name;
 	output->mode = output_mode;
+	output->clone = output_clone;
+	output_clone = NULL;
 
 	if (output_mode) {
 		if (strcmp(output_mode, "off") == 0)
@@ -2440,11 +4690,87 @@ output_section_done(void *data)
 	output_transform = NULL;
 }
 
+static void
+drm_read_output_config(const char *config_file)
+{
+	const struct config_key drm_config_keys[] = {
+		{ "name", CONFIG_KEY_STRING, &output_name },
+		{ "mode", CONFIG_KEY_STRING, &output_mode },
+		{ "transform", CONFIG_KEY_STRING, &output_transform },
+		{ "clone", CONFIG_KEY_STRING, &output_clone },
+	};
+
+	const struct config_section config_section[] = {
+		{ "output", drm_config_keys,
+		ARRAY_LENGTH(drm_config_keys), output_section_done },
+	};
+
+	parse_config_file(config_file, config_section,
+				ARRAY_LENGTH(config_section), NULL);
+}
+
+static void
+drm_output_apply_config(struct drm_output *output,
+			struct drm_configured_output *o)
+{
+	struct weston_mode mode;
+
+	weston_output_set_transform(&output->base, o->transform);
+
+	if (o->config == OUTPUT_CONFIG_MODE &&
+	    (o->width != output->base.current->width ||
+	     o->height != output->base.current->height)) {
+		memset(&mode, 0, sizeof mode);
+		mode.width = o->width;
+		mode.height = o->height;
+		if (weston_output_switch_mode(&output->base, &mode) < 0)
+			weston_log("failed to switch %s to %s\n",
+				   output->name, o->mode);
+		else
+			weston_log("switched %s to %s\n",
+				   output->name, o->mode);
+	} else if (o->config == OUTPUT_CONFIG_OFF ||
+		   o->config == OUTPUT_CONFIG_MODELINE) {
+		weston_log("mode \"%s\" of %s needs a restart\n",
+			   o->mode, output->name);
+	}
+}
+
+/* Outputs switch to new WIDTHxHEIGHT modes and transforms of their
+ * [output] sections; outputs going off, or to a modeline, still need
+ * a restart. */
+static void
+drm_config_reloaded(struct wl_listener *listener, void *data)
+{
+	struct weston_compositor *ec = data;
+	struct drm_configured_output *o, *n;
+	struct drm_output *output;
+
+	if (!weston_compositor_config_changed(ec, "output"))
+		return;
+
+	wl_list_for_each_safe(o, n, &configured_output_list, link)
+		drm_free_configured_output(o);
+	wl_list_init(&configured_output_list);
+	drm_read_output_config(ec->config_file);
+
+	wl_list_for_each(output, &ec->output_list, base.link) {
+		wl_list_for_each(o, &configured_output_list, link)
+			if (strcmp(o->name, output->name) == 0)
+				break;
+		if (&o->link == &configured_output_list)
+			weston_output_set_transform(&output->base,
+						    WL_OUTPUT_TRANSFORM_NORMAL);
+		else
+			drm_output_apply_config(output, o);
+	}
+}
+
 WL_EXPORT struct weston_compositor *
 backend_init(struct wl_display *display, int *argc, char *argv[],
 	     const char *config_file)
 {
-	int connector = 0, tty = 0, use_pixman = 0;
+	int connector = 0, tty = 0, use_pixman = 0, secondary_gpus = 0;
 	const char *seat = default_seat;
 
 	const struct weston_option drm_options[] = {
@@ -2453,26 +4779,16 @@ backend_init(struct wl_display *display, int *argc, char *argv[],
 		{ WESTON_OPTION_INTEGER, "tty", 0, &tty },
 		{ WESTON_OPTION_BOOLEAN, "current-mode", 0, &option_current_mode },
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &use_pixman },
+		{ WESTON_OPTION_BOOLEAN, "secondary-gpus", 0, &secondary_gpus },
 	};
 
 	parse_options(drm_options, ARRAY_LENGTH(drm_options), argc, argv);
 
 	wl_list_init(&configured_output_list);
+	drm_read_output_config(config_file);
 
-	const struct config_key drm_config_keys[] = {
-		{ "name", CONFIG_KEY_STRING, &output_name },
-		{ "mode", CONFIG_KEY_STRING, &output_mode },
-		{ "transform", CONFIG_KEY_STRING, &output_transform },
-	};
-
-	const struct config_section config_section[] = {
-		{ "output", drm_config_keys,
-		ARRAY_LENGTH(drm_config_keys), output_section_done },
-	};
-
-	parse_config_file(config_file, config_section,
-				ARRAY_LENGTH(config_section), NULL);
+	evdev_config_parse(config_file);
 
 	return drm_compositor_create(display, connector, seat, tty, use_pixman,
-				     argc, argv, config_file);
+				     secondary_gpus, argc, argv, config_file);
 }
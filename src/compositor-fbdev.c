@@ -34,6 +34,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <linux/fb.h>
 #include <linux/input.h>
 
@@ -45,6 +46,7 @@
 #include "launcher-util.h"
 #include "pixman-renderer.h"
 #include "udev-seat.h"
+#include "evdev.h"
 
 struct fbdev_compositor {
 	struct weston_compositor base;
@@ -81,10 +83,19 @@ struct fbdev_output {
 	struct fbdev_screeninfo fb_info;
 	void *fb; /* length is fb_info.buffer_length */
 
+	/* Page flipping by panning between two halves of a frame buffer
+	 * with a virtual height of twice the visible one.  The fd is kept
+	 * open for FBIOPAN_DISPLAY; buffer_damage is what changed since
+	 * the back buffer was last drawn. */
+	int double_buffered;
+	int fb_fd;
+	struct fb_var_screeninfo pan_info;
+	pixman_image_t *hw_buffers[2];
+	int back;
+	pixman_region32_t buffer_damage;
+
 	/* pixman details. */
 	pixman_image_t *hw_surface;
-	pixman_image_t *shadow_surface;
-	void *shadow_buf;
 	uint8_t depth;
 };
 
@@ -122,65 +133,71 @@ to_fbdev_compositor(struct weston_compositor *base)
 	return container_of(base, struct fbdev_compositor, base);
 }
 
+static int
+fbdev_output_pan(struct fbdev_output *output, int buffer)
+{
+	output->pan_info.xoffset = 0;
+	output->pan_info.yoffset = buffer * output->fb_info.y_resolution;
+	output->pan_info.activate = FB_ACTIVATE_VBL;
+
+	return ioctl(output->fb_fd, FBIOPAN_DISPLAY, &output->pan_info);
+}
+
+static int
+fbdev_output_repaint_double_buffered(struct fbdev_output *output,
+                                     pixman_region32_t *damage)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	pixman_region32_t region;
+
+	/* The back buffer holds the frame before last, so bring it up to
+	 * date with what changed in the last frame, as well as the new
+	 * damage. */
+	pixman_region32_init(&region);
+	pixman_region32_union(&region, damage, &output->buffer_damage);
+
+	pixman_renderer_output_set_buffer(&output->base,
+	                                  output->hw_buffers[output->back]);
+	ec->renderer->repaint_output(&output->base, &region);
+
+	pixman_region32_fini(&region);
+
+	if (fbdev_output_pan(output, output->back) < 0) {
+		weston_log("Panning frame buffer failed, "
+		           "falling back to single buffering: %s\n",
+		           strerror(errno));
+		output->double_buffered = 0;
+		fbdev_output_pan(output, 0);
+		return -1;
+	}
+
+	output->back ^= 1;
+	pixman_region32_copy(&output->buffer_damage, damage);
+
+	return 0;
+}
+
 static void
 fbdev_output_repaint(struct weston_output *base, pixman_region32_t *damage)
 {
 	struct fbdev_output *output = to_fbdev_output(base);
 	struct weston_compositor *ec = output->base.compositor;
-	pixman_box32_t *rects;
-	int nrects, i, src_x, src_y, x1, y1, x2, y2, width, height;
 
-	/* Repaint the damaged region onto the back buffer. */
-	pixman_renderer_output_set_buffer(base, output->shadow_surface);
-	ec->renderer->repaint_output(base, damage);
+	if (output->double_buffered) {
+		if (fbdev_output_repaint_double_buffered(output, damage) == 0)
+			goto out;
 
-	/* Transform and composite onto the frame buffer. */
-	width = pixman_image_get_width(output->shadow_surface);
-	height = pixman_image_get_height(output->shadow_surface);
-	rects = pixman_region32_rectangles(damage, &nrects);
-
-	for (i = 0; i < nrects; i++) {
-		switch (base->transform) {
-		default:
-		case WL_OUTPUT_TRANSFORM_NORMAL:
-			x1 = rects[i].x1;
-			x2 = rects[i].x2;
-			y1 = rects[i].y1;
-			y2 = rects[i].y2;
-			break;
-		case WL_OUTPUT_TRANSFORM_180:
-			x1 = width - rects[i].x2;
-			x2 = width - rects[i].x1;
-			y1 = height - rects[i].y2;
-			y2 = height - rects[i].y1;
-			break;
-		case WL_OUTPUT_TRANSFORM_90:
-			x1 = height - rects[i].y2;
-			x2 = height - rects[i].y1;
-			y1 = rects[i].x1;
-			y2 = rects[i].x2;
-			break;
-		case WL_OUTPUT_TRANSFORM_270:
-			x1 = rects[i].y1;
-			x2 = rects[i].y2;
-			y1 = width - rects[i].x2;
-			y2 = width - rects[i].x1;
-			break;
-		}
-		src_x = x1;
-		src_y = y1;
-
-		pixman_image_composite32(PIXMAN_OP_SRC,
-			output->shadow_surface, /* src */
-			NULL /* mask */,
-			output->hw_surface, /* dest */
-			src_x, src_y, /* src_x, src_y */
-			0, 0, /* mask_x, mask_y */
-			x1, y1, /* dest_x, dest_y */
-			x2 - x1, /* width */
-			y2 - y1 /* height */);
+		/* Panning failed and we are back on buffer 0, which
+		 * may be stale; redraw all of it. */
+		pixman_region32_copy(damage, &base->region);
 	}
 
+	/* Repaint the damaged region straight into the frame buffer, the
+	 * renderer applies the output transform as it copies. */
+	pixman_renderer_output_set_buffer(base, output->hw_surface);
+	ec->renderer->repaint_output(base, damage);
+
+out:
 	/* Update the damage region. */
 	pixman_region32_subtract(&ec->primary_plane.damage,
 	                         &ec->primary_plane.damage, damage);
@@ -188,7 +205,9 @@ fbdev_output_repaint(struct weston_output *base, pixman_region32_t *damage)
 	/* Schedule the end of the frame. We do not sync this to the frame
 	 * buffer clock because users who want that should be using the DRM
 	 * compositor. FBIO_WAITFORVSYNC blocks and FB_ACTIVATE_VBL requires
-	 * panning, which is broken in most kernel drivers.
+	 * panning, which is broken in most kernel drivers; where it works,
+	 * the double buffered path above queues the pan for the next
+	 * vblank, but still cannot tell when it happened.
 	 *
 	 * Finish the frame synchronised to the specified refresh rate. The
 	 * refresh rate is given in mHz and the interval in ms. */
@@ -412,7 +431,48 @@ fbdev_frame_buffer_open(struct fbdev_output *output, const char *fb_dev,
 	return fd;
 }
 
-/* Closes the FD on success or failure. */
+/* Set up a virtual height of twice the visible one, if the frame
+ * buffer memory allows and the driver can pan. */
+static int
+fbdev_frame_buffer_enable_panning(struct fbdev_output *output, int fd)
+{
+	struct fb_var_screeninfo varinfo;
+	struct fb_fix_screeninfo fixinfo;
+	size_t frame_length;
+
+	frame_length = output->fb_info.line_length *
+	               output->fb_info.y_resolution;
+	if (output->fb_info.buffer_length < 2 * frame_length)
+		return -1;
+
+	if (ioctl(fd, FBIOGET_FSCREENINFO, &fixinfo) < 0 ||
+	    ioctl(fd, FBIOGET_VSCREENINFO, &varinfo) < 0 ||
+	    fixinfo.ypanstep == 0)
+		return -1;
+
+	if (varinfo.yres_virtual < 2 * varinfo.yres) {
+		varinfo.yres_virtual = 2 * varinfo.yres;
+		varinfo.xoffset = 0;
+		varinfo.yoffset = 0;
+		varinfo.activate = FB_ACTIVATE_NOW;
+		if (ioctl(fd, FBIOPUT_VSCREENINFO, &varinfo) < 0 ||
+		    ioctl(fd, FBIOGET_VSCREENINFO, &varinfo) < 0 ||
+		    varinfo.yres_virtual < 2 * varinfo.yres)
+			return -1;
+	}
+
+	/* Some drivers take the virtual size but still cannot pan. */
+	varinfo.xoffset = 0;
+	varinfo.yoffset = 0;
+	if (ioctl(fd, FBIOPAN_DISPLAY, &varinfo) < 0)
+		return -1;
+
+	output->pan_info = varinfo;
+
+	return 0;
+}
+
+/* Closes the FD on success or failure, unless it is kept for panning. */
 static int
 fbdev_frame_buffer_map(struct fbdev_output *output, int fd)
 {
@@ -442,6 +502,36 @@ fbdev_frame_buffer_map(struct fbdev_output *output, int fd)
 		goto out_unmap;
 	}
 
+	if (fbdev_frame_buffer_enable_panning(output, fd) == 0) {
+		output->hw_buffers[0] = pixman_image_ref(output->hw_surface);
+		output->hw_buffers[1] =
+			pixman_image_create_bits(output->fb_info.pixel_format,
+			                         output->fb_info.x_resolution,
+			                         output->fb_info.y_resolution,
+			                         (uint32_t *) ((uint8_t *) output->fb +
+			                         output->fb_info.line_length *
+			                         output->fb_info.y_resolution),
+			                         output->fb_info.line_length);
+	}
+
+	if (output->hw_buffers[1] != NULL) {
+		weston_log("Frame buffer panning available, "
+		           "rendering double buffered.\n");
+		output->double_buffered = 1;
+		output->fb_fd = fd;
+		fd = -1;
+		output->back = 1;
+
+		/* Neither buffer holds anything useful yet. */
+		pixman_region32_fini(&output->buffer_damage);
+		pixman_region32_init_rect(&output->buffer_damage, 0, 0,
+		                          output->fb_info.x_resolution,
+		                          output->fb_info.y_resolution);
+	} else if (output->hw_buffers[0] != NULL) {
+		pixman_image_unref(output->hw_buffers[0]);
+		output->hw_buffers[0] = NULL;
+	}
+
 	/* Success! */
 	retval = 0;
 
@@ -459,8 +549,24 @@ out_close:
 static void
 fbdev_frame_buffer_destroy(struct fbdev_output *output)
 {
+	int i;
+
 	weston_log("Destroying fbdev frame buffer.\n");
 
+	if (output->double_buffered)
+		fbdev_output_pan(output, 0);
+	output->double_buffered = 0;
+
+	for (i = 0; i < 2; i++) {
+		if (output->hw_buffers[i] != NULL)
+			pixman_image_unref(output->hw_buffers[i]);
+		output->hw_buffers[i] = NULL;
+	}
+
+	if (output->fb_fd >= 0)
+		close(output->fb_fd);
+	output->fb_fd = -1;
+
 	if (munmap(output->fb, output->fb_info.buffer_length) < 0)
 		weston_log("Failed to munmap frame buffer: %s\n",
 		           strerror(errno));
@@ -476,11 +582,7 @@ fbdev_output_create(struct fbdev_compositor *compositor,
                     const char *device)
 {
 	struct fbdev_output *output;
-	pixman_transform_t transform;
 	int fb_fd;
-	int shadow_width, shadow_height;
-	int width, height;
-	unsigned int bytes_per_pixel;
 	struct wl_event_loop *loop;
 
 	weston_log("Creating fbdev output.\n");
@@ -491,6 +593,8 @@ fbdev_output_create(struct fbdev_compositor *compositor,
 
 	output->compositor = compositor;
 	output->device = device;
+	output->fb_fd = -1;
+	pixman_region32_init(&output->buffer_damage);
 
 	/* Create the frame buffer. */
 	fb_fd = fbdev_frame_buffer_open(output, device, &output->fb_info);
@@ -531,70 +635,8 @@ fbdev_output_create(struct fbdev_compositor *compositor,
 	                   output->fb_info.height_mm,
 	                   WL_OUTPUT_TRANSFORM_NORMAL);
 
-	width = output->fb_info.x_resolution;
-	height = output->fb_info.y_resolution;
-
-	pixman_transform_init_identity(&transform);
-	switch (output->base.transform) {
-	default:
-	case WL_OUTPUT_TRANSFORM_NORMAL:
-		shadow_width = width;
-		shadow_height = height;
-		pixman_transform_rotate(&transform,
-			NULL, 0, 0);
-		pixman_transform_translate(&transform, NULL,
-			0, 0);
-		break;
-	case WL_OUTPUT_TRANSFORM_180:
-		shadow_width = width;
-		shadow_height = height;
-		pixman_transform_rotate(&transform,
-			NULL, -pixman_fixed_1, 0);
-		pixman_transform_translate(NULL, &transform,
-			pixman_int_to_fixed(shadow_width),
-			pixman_int_to_fixed(shadow_height));
-		break;
-	case WL_OUTPUT_TRANSFORM_270:
-		shadow_width = height;
-		shadow_height = width;
-		pixman_transform_rotate(&transform,
-			NULL, 0, pixman_fixed_1);
-		pixman_transform_translate(&transform,
-			NULL,
-			pixman_int_to_fixed(shadow_width),
-			0);
-		break;
-	case WL_OUTPUT_TRANSFORM_90:
-		shadow_width = height;
-		shadow_height = width;
-		pixman_transform_rotate(&transform,
-			NULL, 0, -pixman_fixed_1);
-		pixman_transform_translate(&transform,
-			NULL,
-			0,
-			pixman_int_to_fixed(shadow_height));
-		break;
-	}
-
-	bytes_per_pixel = output->fb_info.bits_per_pixel / 8;
-
-	output->shadow_buf = malloc(width * height * bytes_per_pixel);
-	output->shadow_surface =
-		pixman_image_create_bits(output->fb_info.pixel_format,
-		                         shadow_width, shadow_height,
-		                         output->shadow_buf,
-		                         shadow_width * bytes_per_pixel);
-	if (output->shadow_buf == NULL || output->shadow_surface == NULL) {
-		weston_log("Failed to create surface for frame buffer.\n");
-		goto out_hw_surface;
-	}
-
-	/* No need in transform for normal output */
-	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL)
-		pixman_image_set_transform(output->shadow_surface, &transform);
-
 	if (pixman_renderer_output_create(&output->base) < 0)
-		goto out_shadow_surface;
+		goto out_hw_surface;
 
 	loop = wl_display_get_event_loop(compositor->base.wl_display);
 	output->finish_frame_timer =
@@ -609,16 +651,13 @@ fbdev_output_create(struct fbdev_compositor *compositor,
 
 	return 0;
 
-out_shadow_surface:
-	pixman_image_unref(output->shadow_surface);
-	output->shadow_surface = NULL;
 out_hw_surface:
-	free(output->shadow_buf);
 	pixman_image_unref(output->hw_surface);
 	output->hw_surface = NULL;
 	weston_output_destroy(&output->base);
 	fbdev_frame_buffer_destroy(output);
 out_free:
+	pixman_region32_fini(&output->buffer_damage);
 	free(output);
 
 	return -1;
@@ -637,15 +676,7 @@ fbdev_output_destroy(struct weston_output *base)
 	if (base->renderer_state != NULL)
 		pixman_renderer_output_destroy(base);
 
-	if (output->shadow_surface != NULL) {
-		pixman_image_unref(output->shadow_surface);
-		output->shadow_surface = NULL;
-	}
-
-	if (output->shadow_buf != NULL) {
-		free(output->shadow_buf);
-		output->shadow_buf = NULL;
-	}
+	pixman_region32_fini(&output->buffer_damage);
 
 	/* Remove the output. */
 	wl_list_remove(&output->base.link);
@@ -700,7 +731,7 @@ fbdev_output_reenable(struct fbdev_compositor *compositor,
 		}
 
 		/* Remove and re-add the output so that resources depending on
-		 * the frame buffer X/Y resolution (such as the shadow buffer)
+		 * the frame buffer X/Y resolution (such as the renderer state)
 		 * are re-initialised. */
 		fbdev_output_destroy(base);
 		fbdev_output_create(compositor, output->device);
@@ -747,6 +778,7 @@ fbdev_compositor_destroy(struct weston_compositor *base)
 	/* Destroy all inputs. */
 	wl_list_for_each_safe(seat, next, &compositor->base.seat_list, base.link)
 		udev_seat_destroy(seat);
+	evdev_config_release();
 
 	/* Destroy the output. */
 	weston_compositor_shutdown(&compositor->base);
@@ -914,6 +946,8 @@ backend_init(struct wl_display *display, int *argc, char *argv[],
 
 	parse_options(fbdev_options, ARRAY_LENGTH(fbdev_options), argc, argv);
 
+	evdev_config_parse(config_file);
+
 	return fbdev_compositor_create(display, argc, argv, config_file,
 	                               &param);
 }
@@ -27,49 +27,153 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include "compositor.h"
+#include "pixman-renderer.h"
+
+/* bucket i counts repaints of [2^i, 2^(i+1)) us, the first one below
+ * 2 us and the last everything longer */
+#define HEADLESS_HISTOGRAM_BUCKETS 24
 
 struct headless_compositor {
 	struct weston_compositor base;
 	struct weston_seat fake_seat;
+	int use_pixman;
+	/* finish frames right after the repaint instead of at 60 Hz */
+	int fast_clock;
 };
 
 struct headless_output {
 	struct weston_output base;
 	struct weston_mode mode;
 	struct wl_event_source *finish_frame_timer;
+	pixman_image_t *image;
+
+	struct {
+		uint32_t count;
+		uint64_t total, min, max;	/* ns */
+		struct timespec first, last;
+		uint32_t buckets[HEADLESS_HISTOGRAM_BUCKETS];
+	} stats;
 };
 
 
-static int
-finish_frame_handler(void *data)
+static void
+headless_output_finish_frame(struct weston_output *output)
 {
-	struct weston_output *output = data;
 	uint32_t msec;
 	struct timeval tv;
 
 	gettimeofday(&tv, NULL);
 	msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
 	weston_output_finish_frame(output, msec);
+}
+
+static int
+finish_frame_handler(void *data)
+{
+	headless_output_finish_frame(data);
 
 	return 1;
 }
 
+static void
+finish_frame_idle(void *data)
+{
+	headless_output_finish_frame(data);
+}
+
+static uint64_t
+timespec_sub_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (uint64_t) (a->tv_sec - b->tv_sec) * 1000000000 +
+		a->tv_nsec - b->tv_nsec;
+}
+
+static void
+headless_output_account(struct headless_output *output,
+			const struct timespec *start,
+			const struct timespec *end)
+{
+	uint64_t ns = timespec_sub_ns(end, start), us = ns / 1000;
+	int i;
+
+	if (output->stats.count == 0) {
+		output->stats.first = *start;
+		output->stats.min = ns;
+	}
+	output->stats.last = *end;
+	output->stats.count++;
+	output->stats.total += ns;
+	if (ns < output->stats.min)
+		output->stats.min = ns;
+	if (ns > output->stats.max)
+		output->stats.max = ns;
+
+	for (i = 0; i < HEADLESS_HISTOGRAM_BUCKETS - 1 && us >= 2; i++)
+		us >>= 1;
+	output->stats.buckets[i]++;
+}
+
+static void
+headless_output_dump_stats(struct headless_output *output)
+{
+	uint64_t elapsed;
+	int i;
+
+	if (output->stats.count == 0)
+		return;
+
+	elapsed = timespec_sub_ns(&output->stats.last, &output->stats.first);
+	weston_log("headless: %u repaints in %.3f s, %.1f per second\n",
+		   output->stats.count, elapsed / 1e9,
+		   elapsed ? output->stats.count * 1e9 / elapsed : 0.0);
+	weston_log_continue(STAMP_SPACE "repaint min %.3f ms, "
+			    "mean %.3f ms, max %.3f ms\n",
+			    output->stats.min / 1e6,
+			    output->stats.total / 1e6 / output->stats.count,
+			    output->stats.max / 1e6);
+
+	for (i = 0; i < HEADLESS_HISTOGRAM_BUCKETS; i++) {
+		if (output->stats.buckets[i] == 0)
+			continue;
+		weston_log_continue(STAMP_SPACE "%8u us %s %8u\n",
+				    i ? 1u << i : 0,
+				    i < HEADLESS_HISTOGRAM_BUCKETS - 1 ?
+				    "-" : "+",
+				    output->stats.buckets[i]);
+	}
+}
+
 static void
 headless_output_repaint(struct weston_output *output_base,
 		       pixman_region32_t *damage)
 {
 	struct headless_output *output = (struct headless_output *) output_base;
 	struct weston_compositor *ec = output->base.compositor;
+	struct headless_compositor *c = (struct headless_compositor *) ec;
+	struct wl_event_loop *loop;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	ec->renderer->repaint_output(&output->base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	headless_output_account(output, &start, &end);
+
+	if (c->fast_clock) {
+		/* after what clients sent meanwhile has been handled */
+		loop = wl_display_get_event_loop(ec->wl_display);
+		wl_event_loop_add_idle(loop, finish_frame_idle, output);
+	} else {
+		wl_event_source_timer_update(output->finish_frame_timer, 16);
+	}
 
 	return;
 }
@@ -78,6 +182,15 @@ static void
 headless_output_destroy(struct weston_output *output_base)
 {
 	struct headless_output *output = (struct headless_output *) output_base;
+	struct headless_compositor *c =
+		(struct headless_compositor *) output->base.compositor;
+
+	headless_output_dump_stats(output);
+
+	if (c->use_pixman) {
+		pixman_renderer_output_destroy(output_base);
+		pixman_image_unref(output->image);
+	}
 
 	wl_event_source_remove(output->finish_frame_timer);
 	free(output);
@@ -118,6 +231,23 @@ headless_compositor_create_output(struct headless_compositor *c,
 	output->finish_frame_timer =
 		wl_event_loop_add_timer(loop, finish_frame_handler, output);
 
+	if (c->use_pixman) {
+		output->image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+							 width, height,
+							 NULL, 0);
+		if (output->image == NULL ||
+		    pixman_renderer_output_create(&output->base) < 0) {
+			weston_log("headless: failed to create pixman output\n");
+			if (output->image)
+				pixman_image_unref(output->image);
+			wl_event_source_remove(output->finish_frame_timer);
+			free(output);
+			return -1;
+		}
+		pixman_renderer_output_set_buffer(&output->base,
+						  output->image);
+	}
+
 	output->base.origin = output->base.current;
 	output->base.repaint = headless_output_repaint;
 	output->base.destroy = headless_output_destroy;
@@ -152,6 +282,7 @@ headless_destroy(struct weston_compositor *ec)
 static struct weston_compositor *
 headless_compositor_create(struct wl_display *display,
 			  int width, int height, const char *display_name,
+			  int use_pixman, const char *clock,
 			  int *argc, char *argv[], const char *config_file)
 {
 	struct headless_compositor *c;
@@ -167,18 +298,35 @@ headless_compositor_create(struct wl_display *display,
 		goto err_free;
 
 	weston_seat_init(&c->fake_seat, &c->base);
+	/* for the wl_test pointer requests of the test clients */
+	weston_seat_init_pointer(&c->fake_seat);
 
 	c->base.destroy = headless_destroy;
 	c->base.restore = headless_restore;
 
-	if (headless_compositor_create_output(c, width, height) < 0)
-		goto err_compositor;
+	c->use_pixman = use_pixman;
+	if (clock && strcmp(clock, "fast") == 0)
+		c->fast_clock = 1;
+	else if (clock && strcmp(clock, "timer") != 0)
+		weston_log("headless: unknown clock \"%s\", "
+			   "using the timer\n", clock);
+
+	if (use_pixman) {
+		if (pixman_renderer_init(&c->base) < 0)
+			goto err_compositor;
+	} else {
+		if (noop_renderer_init(&c->base) < 0)
+			goto err_compositor;
+	}
 
-	if (noop_renderer_init(&c->base) < 0)
-		goto err_compositor;
+	if (headless_compositor_create_output(c, width, height) < 0)
+		goto err_renderer;
 
 	return &c->base;
 
+err_renderer:
+	c->base.renderer->destroy(&c->base);
+
 err_compositor:
 	weston_compositor_shutdown(&c->base);
 err_free:
@@ -192,15 +340,20 @@ backend_init(struct wl_display *display, int *argc, char *argv[],
 {
 	int width = 1024, height = 640;
 	char *display_name = NULL;
+	int use_pixman = 0;
+	char *clock = NULL;
 
 	const struct weston_option headless_options[] = {
 		{ WESTON_OPTION_INTEGER, "width", 0, &width },
 		{ WESTON_OPTION_INTEGER, "height", 0, &height },
+		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &use_pixman },
+		{ WESTON_OPTION_STRING, "clock", 0, &clock },
 	};
 
 	parse_options(headless_options,
 		      ARRAY_LENGTH(headless_options), argc, argv);
 
 	return headless_compositor_create(display, width, height, display_name,
-					 argc, argv, config_file);
+					  use_pixman, clock,
+					  argc, argv, config_file);
 }
@@ -27,6 +27,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <linux/input.h>
 
 #include <freerdp/freerdp.h>
@@ -42,6 +46,17 @@
 
 #define MAX_FREERDP_FDS 32
 
+/* damage is split on a grid of RDP_TILE_SIZE tiles aligned to the output */
+#define RDP_TILE_SIZE 64
+/* below this many damaged pixels codec framing costs more than it saves */
+#define RDP_RAW_TILE_AREA (16 * 16)
+/* tiles using more distinct colours than this are taken as photographic */
+#define RDP_TILE_MAX_COLORS 16
+
+#ifndef min
+#define min(a, b) (((a) > (b)) ? (b) : (a))
+#endif
+
 struct rdp_compositor_config {
 	int width;
 	int height;
@@ -52,6 +67,7 @@ struct rdp_compositor_config {
 	char *server_key;
 	char *extra_modes;
 	int env_socket;
+	int broadcast;
 };
 
 struct rdp_output;
@@ -68,6 +84,9 @@ struct rdp_compositor {
 	char *server_key;
 	char *rdp_key;
 	int tls_enabled;
+
+	int broadcast;
+	struct wl_list broadcasts;
 };
 
 enum peer_item_flags {
@@ -91,6 +110,136 @@ struct rdp_output {
 	struct wl_list peers;
 };
 
+enum rdp_tile_codec {
+	RDP_TILE_SKIP = 0,
+	RDP_TILE_RAW,
+	RDP_TILE_NSC,
+	RDP_TILE_RFX
+};
+
+/*
+ * Codec contexts and scratch buffers for one stream of surface bits.
+ * Every peer coded on its own has one, and so does every broadcast
+ * group. Finished commands go to emit, which either sends them to the
+ * peer or records them into a broadcast frame.
+ */
+struct rdp_codecs {
+	BOOL rfx, nsc;
+	RFX_CONTEXT *rfx_context;
+	wStream *encode_stream;
+	RFX_RECT *rfx_rects;
+	NSC_CONTEXT *nsc_context;
+
+	/* content hash of every tile as last sent to the client, 0 when
+	 * the client does not have it */
+	uint64_t *tile_hashes;
+	int tiles_width, tiles_height;
+
+	/* bottom-up staging buffer for raw surface bits */
+	BYTE *raw_buffer;
+	size_t raw_size;
+	UINT32 frame_bytes;
+
+	void (*emit)(struct rdp_codecs *codecs, SURFACE_BITS_COMMAND *cmd,
+		     enum rdp_tile_codec codec);
+	void *emit_data;
+};
+
+struct rdp_peer_stats {
+	uint32_t frames;
+	uint32_t coalesced;
+	uint32_t dropped;
+	uint64_t bytes;
+	uint64_t encode_usec;
+	uint32_t max_encode_usec;
+};
+
+/* frames a broadcast peer may have queued before it is resynced */
+#define RDP_FRAME_QUEUE_LENGTH 4
+
+/*
+ * A broadcast frame holds surface bits coded once for a whole group.
+ * The codec ids are per connection, so they are filled in as each
+ * peer sends the frame. width and height give the desktop size the
+ * commands were coded for.
+ */
+struct rdp_frame_cmd {
+	SURFACE_BITS_COMMAND cmd;
+	enum rdp_tile_codec codec;
+	size_t offset;
+};
+
+struct rdp_frame {
+	int refcount;
+	int failed;
+	int width, height;
+
+	struct rdp_frame_cmd *cmds;
+	int count, alloc;
+	BYTE *data;
+	size_t size, data_alloc;
+};
+
+/*
+ * Every activated peer gets a thread doing its encoding and sending.
+ * The repaint only copies the damage into pending_image and merges it
+ * into pending_damage, so the queue is one frame deep: when the peer
+ * falls behind, new damage coalesces with what it has not picked up
+ * yet. Everything but image is protected by mutex; image is the
+ * thread's private copy of what the client should show.
+ *
+ * freerdp peers are not thread safe, so send_mutex is held around
+ * everything that goes through the peer: each of the thread's sends,
+ * but not the encoding between them, and on the main thread the
+ * dispatch of the peer's input, with the handlers and replies it
+ * runs.  It is recursive so that the handlers can
+ * take it again.  The thread never closes the peer itself, it asks
+ * the main loop to through the peer's close_fd.
+ *
+ * Broadcast peers do not encode: their thread only sends the frames
+ * their group puts in queue.
+ */
+struct rdp_peer_encoder {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_mutex_t send_mutex;
+	pthread_cond_t cond;
+	int running;
+	int quit;
+
+	pixman_image_t *pending_image;
+	pixman_region32_t pending_damage;
+	int flush_cache;
+	int resize_width, resize_height;
+
+	struct rdp_frame *queue[RDP_FRAME_QUEUE_LENGTH];
+	int queue_head, queue_length;
+
+	pixman_image_t *image;
+	struct rdp_peer_stats stats;
+};
+
+/*
+ * In broadcast mode peers accepting the same codecs share a group
+ * whose thread codes the output damage once per frame and queues the
+ * result on every member. Peers that just connected, or fell so far
+ * behind that their queue overflowed, wait in joining until the group
+ * codes them a keyframe from its image at the next frame boundary.
+ * The lists and frame refcounts are protected by encoder.mutex, which
+ * nests outside the members' own mutex. npeers is only touched from
+ * the main thread.
+ */
+struct rdp_broadcast {
+	struct rdp_peer_encoder encoder;
+	struct rdp_codecs codecs;
+
+	struct wl_list members;
+	struct wl_list joining;
+	int npeers;
+
+	struct wl_list link;
+};
+
 struct rdp_peer_context {
 	rdpContext _p;
 	struct rdp_compositor *rdpCompositor;
@@ -99,10 +248,17 @@ struct rdp_peer_context {
 	int fds[MAX_FREERDP_FDS];
 	struct wl_event_source *events[MAX_FREERDP_FDS];
 
-	RFX_CONTEXT *rfx_context;
-	wStream *encode_stream;
-	RFX_RECT *rfx_rects;
-	NSC_CONTEXT *nsc_context;
+	struct rdp_codecs codecs;
+	struct rdp_peer_encoder encoder;
+
+	/* eventfd the encoder thread signals to have the peer closed */
+	int close_fd;
+	struct wl_event_source *close_source;
+
+	/* the group a broadcast peer belongs to, with the link in its
+	 * members or joining list */
+	struct rdp_broadcast *broadcast;
+	struct wl_list broadcast_link;
 
 	struct rdp_peers_item item;
 };
@@ -119,43 +275,107 @@ rdp_compositor_config_init(struct rdp_compositor_config *config) {
 	config->server_key = NULL;
 	config->extra_modes = NULL;
 	config->env_socket = 0;
+	config->broadcast = 0;
+}
+
+static void
+rdp_codecs_reset_tile_cache(struct rdp_codecs *codecs, int width, int height)
+{
+	free(codecs->tile_hashes);
+
+	codecs->tiles_width = (width + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE;
+	codecs->tiles_height = (height + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE;
+	codecs->tile_hashes = calloc(codecs->tiles_width * codecs->tiles_height,
+			sizeof *codecs->tile_hashes);
+	if(!codecs->tile_hashes) {
+		/* without a cache every damaged tile is simply sent */
+		codecs->tiles_width = 0;
+		codecs->tiles_height = 0;
+	}
 }
 
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_codecs_flush_tile_cache(struct rdp_codecs *codecs)
+{
+	if(codecs->tile_hashes)
+		memset(codecs->tile_hashes, 0, codecs->tiles_width *
+				codecs->tiles_height * sizeof *codecs->tile_hashes);
+}
+
+static int
+rdp_codecs_init(struct rdp_codecs *codecs, BOOL rfx, BOOL nsc, int width, int height)
+{
+	memset(codecs, 0, sizeof *codecs);
+	codecs->rfx = rfx;
+	codecs->nsc = nsc;
+
+	codecs->rfx_context = rfx_context_new();
+	codecs->nsc_context = nsc_context_new();
+	codecs->encode_stream = stream_new(65536);
+	codecs->raw_size = width * RDP_TILE_SIZE * 4;
+	codecs->raw_buffer = malloc(codecs->raw_size);
+	if(!codecs->rfx_context || !codecs->nsc_context ||
+			!codecs->encode_stream || !codecs->raw_buffer)
+		return -1;
+
+	codecs->rfx_context->mode = RLGR3;
+	codecs->rfx_context->width = width;
+	codecs->rfx_context->height = height;
+	rfx_context_set_pixel_format(codecs->rfx_context, RDP_PIXEL_FORMAT_B8G8R8A8);
+
+	rdp_codecs_reset_tile_cache(codecs, width, height);
+
+	return 0;
+}
+
+static void
+rdp_codecs_release(struct rdp_codecs *codecs)
+{
+	if(codecs->encode_stream)
+		stream_free(codecs->encode_stream);
+	if(codecs->nsc_context)
+		nsc_context_free(codecs->nsc_context);
+	if(codecs->rfx_context)
+		rfx_context_free(codecs->rfx_context);
+	free(codecs->rfx_rects);
+	free(codecs->tile_hashes);
+	free(codecs->raw_buffer);
+	memset(codecs, 0, sizeof *codecs);
+}
+
+static void
+rdp_refresh_rfx(struct rdp_codecs *codecs, pixman_region32_t *damage, pixman_image_t *image)
 {
 	int width, height, nrects, i;
 	pixman_box32_t *region, *rects;
 	uint32_t *ptr;
 	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	SURFACE_BITS_COMMAND cmd;
 
-	stream_clear(context->encode_stream);
-	stream_set_pos(context->encode_stream, 0);
+	stream_clear(codecs->encode_stream);
+	stream_set_pos(codecs->encode_stream, 0);
 
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->RemoteFxCodecId;
-	cmd->width = width;
-	cmd->height = height;
+	memset(&cmd, 0, sizeof cmd);
+	cmd.destLeft = damage->extents.x1;
+	cmd.destTop = damage->extents.y1;
+	cmd.destRight = damage->extents.x2;
+	cmd.destBottom = damage->extents.y2;
+	cmd.bpp = 32;
+	cmd.width = width;
+	cmd.height = height;
 
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
 	rects = pixman_region32_rectangles(damage, &nrects);
-	context->rfx_rects = realloc(context->rfx_rects, nrects * sizeof *rfxRect);
+	codecs->rfx_rects = realloc(codecs->rfx_rects, nrects * sizeof *rfxRect);
 
 	for (i = 0; i < nrects; i++) {
 		region = &rects[i];
-		rfxRect = &context->rfx_rects[i];
+		rfxRect = &codecs->rfx_rects[i];
 
 		rfxRect->x = (region->x1 - damage->extents.x1);
 		rfxRect->y = (region->y1 - damage->extents.y1);
@@ -163,127 +383,1058 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 		rfxRect->height = (region->y2 - region->y1);
 	}
 
-	rfx_compose_message(context->rfx_context, context->encode_stream, context->rfx_rects, nrects,
+	rfx_compose_message(codecs->rfx_context, codecs->encode_stream, codecs->rfx_rects, nrects,
 			(BYTE *)ptr, width, height,
 			pixman_image_get_stride(image)
 	);
 
-	cmd->bitmapDataLength = stream_get_length(context->encode_stream);
-	cmd->bitmapData = stream_get_head(context->encode_stream);
+	cmd.bitmapDataLength = stream_get_length(codecs->encode_stream);
+	cmd.bitmapData = stream_get_head(codecs->encode_stream);
+	codecs->frame_bytes += cmd.bitmapDataLength;
 
-	update->SurfaceBits(update->context, cmd);
+	codecs->emit(codecs, &cmd, RDP_TILE_RFX);
 }
 
 
 static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_refresh_nsc(struct rdp_codecs *codecs, pixman_region32_t *damage, pixman_image_t *image)
 {
 	int width, height;
 	uint32_t *ptr;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	SURFACE_BITS_COMMAND cmd;
 
-	stream_clear(context->encode_stream);
-	stream_set_pos(context->encode_stream, 0);
+	stream_clear(codecs->encode_stream);
+	stream_set_pos(codecs->encode_stream, 0);
 
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->NSCodecId;
-	cmd->width = width;
-	cmd->height = height;
+	memset(&cmd, 0, sizeof cmd);
+	cmd.destLeft = damage->extents.x1;
+	cmd.destTop = damage->extents.y1;
+	cmd.destRight = damage->extents.x2;
+	cmd.destBottom = damage->extents.y2;
+	cmd.bpp = 32;
+	cmd.width = width;
+	cmd.height = height;
 
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
-	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
-			cmd->width,	cmd->height,
+	nsc_compose_message(codecs->nsc_context, codecs->encode_stream, (BYTE *)ptr,
+			cmd.width,	cmd.height,
 			pixman_image_get_stride(image));
-	cmd->bitmapDataLength = stream_get_length(context->encode_stream);
-	cmd->bitmapData = stream_get_head(context->encode_stream);
-	update->SurfaceBits(update->context, cmd);
+	cmd.bitmapDataLength = stream_get_length(codecs->encode_stream);
+	cmd.bitmapData = stream_get_head(codecs->encode_stream);
+	codecs->frame_bytes += cmd.bitmapDataLength;
+	codecs->emit(codecs, &cmd, RDP_TILE_NSC);
 }
 
 static void
-rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_peer *peer)
+rdp_refresh_raw(struct rdp_codecs *codecs, pixman_region32_t *region, pixman_image_t *image)
 {
-	pixman_image_t *tile;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
+	SURFACE_BITS_COMMAND cmd;
 	pixman_box32_t *extends = pixman_region32_extents(region);
+	int stride = pixman_image_get_stride(image);
+	int y, pitch;
+	BYTE *src, *dst;
+
+	memset(&cmd, 0, sizeof cmd);
+	cmd.bpp = 32;
+	cmd.width = (extends->x2 - extends->x1);
+	cmd.height = (extends->y2 - extends->y1);
+	cmd.bitmapDataLength = cmd.width * cmd.height * 4;
+
+	if(cmd.bitmapDataLength > codecs->raw_size) {
+		dst = realloc(codecs->raw_buffer, cmd.bitmapDataLength);
+		if(!dst)
+			return;
+		codecs->raw_buffer = dst;
+		codecs->raw_size = cmd.bitmapDataLength;
+	}
 
-	cmd->bpp = 32;
-	cmd->codecID = 0;
-	cmd->width = (extends->x2 - extends->x1);
-	cmd->height = (extends->y2 - extends->y1);;
-	cmd->bitmapDataLength = cmd->width * cmd->height * 4;
-	tile = pixman_image_create_bits(PIXMAN_x8r8g8b8, cmd->width, cmd->height, 0, cmd->width * 4);
-	pixman_image_composite32(PIXMAN_OP_SRC,	image, NULL, /* op, src, mask */
-		tile, extends->x1, extends->y1, /* dest, src_x, src_y */
-		0, 0, /* mask_x, mask_y */
-		0, 0, /* dest_x, dest_y */
-		cmd->width, cmd->height /* width, height */
-	);
-	freerdp_image_flip((BYTE *)pixman_image_get_data(tile),
-			(BYTE *)pixman_image_get_data(tile),
-			cmd->width, cmd->height, cmd->bpp
-	);
-	cmd->bitmapData = (BYTE *)pixman_image_get_data(tile);
-	cmd->destLeft = extends->x1;
-	cmd->destTop = extends->y1;
-	cmd->destRight = extends->x2;
-	cmd->destBottom = extends->y2;
-	update->SurfaceBits(peer->context, cmd);
-	pixman_image_unref(tile);
+	/* raw surface bits are bottom-up, flip while copying out */
+	pitch = cmd.width * 4;
+	src = (BYTE *)pixman_image_get_data(image) + extends->y1 * stride + extends->x1 * 4;
+	dst = codecs->raw_buffer + (cmd.height - 1) * pitch;
+	for(y = 0; y < cmd.height; y++, src += stride, dst -= pitch)
+		memcpy(dst, src, pitch);
+
+	cmd.bitmapData = codecs->raw_buffer;
+	cmd.destLeft = extends->x1;
+	cmd.destTop = extends->y1;
+	cmd.destRight = extends->x2;
+	cmd.destBottom = extends->y2;
+	codecs->frame_bytes += cmd.bitmapDataLength;
+	codecs->emit(codecs, &cmd, RDP_TILE_RAW);
+}
+
+static uint64_t
+rdp_tile_hash(pixman_image_t *image, pixman_box32_t *box)
+{
+	int stride = pixman_image_get_stride(image) / sizeof(uint32_t);
+	uint32_t *ptr = pixman_image_get_data(image) + box->y1 * stride;
+	uint64_t hash = 14695981039346656037ULL;
+	int x, y;
+
+	/* FNV-1a over the pixels, ignoring the unused x8 byte */
+	for(y = box->y1; y < box->y2; y++, ptr += stride) {
+		for(x = box->x1; x < box->x2; x++) {
+			hash ^= ptr[x] & 0x00ffffff;
+			hash *= 1099511628211ULL;
+		}
+	}
+
+	/* 0 is reserved for tiles the client has not received */
+	return hash | 1;
+}
+
+static enum rdp_tile_codec
+rdp_tile_classify(pixman_image_t *image, pixman_box32_t *box, struct rdp_codecs *codecs)
+{
+	int stride = pixman_image_get_stride(image) / sizeof(uint32_t);
+	uint32_t *ptr = pixman_image_get_data(image) + box->y1 * stride;
+	uint32_t colors[RDP_TILE_MAX_COLORS], pixel, last;
+	int x, y, i, ncolors;
+
+	if((box->x2 - box->x1) * (box->y2 - box->y1) < RDP_RAW_TILE_AREA)
+		return RDP_TILE_RAW;
+
+	ncolors = 0;
+	last = 0;
+	for(y = box->y1; y < box->y2; y++, ptr += stride) {
+		for(x = box->x1; x < box->x2; x++) {
+			pixel = ptr[x] & 0x00ffffff;
+			if(ncolors && pixel == last)
+				continue;
+			last = pixel;
+
+			for(i = 0; i < ncolors; i++) {
+				if(colors[i] == pixel)
+					break;
+			}
+			if(i < ncolors)
+				continue;
+			if(ncolors == RDP_TILE_MAX_COLORS)
+				goto photo;
+			colors[ncolors++] = pixel;
+		}
+	}
+
+	if(ncolors == 1) {
+		/* flat colour: RemoteFX encodes it in a handful of bytes */
+		if(codecs->rfx)
+			return RDP_TILE_RFX;
+		if(codecs->nsc)
+			return RDP_TILE_NSC;
+		return RDP_TILE_RAW;
+	}
+
+	/* few colours with hard edges is text or widgets, which the
+	 * RemoteFX quantisation would smear */
+	if(codecs->nsc)
+		return RDP_TILE_NSC;
+	return RDP_TILE_RAW;
+
+photo:
+	if(codecs->rfx)
+		return RDP_TILE_RFX;
+	if(codecs->nsc)
+		return RDP_TILE_NSC;
+	return RDP_TILE_RAW;
+}
+
+static enum rdp_tile_codec
+rdp_tile_codec(struct rdp_codecs *codecs, pixman_region32_t *region,
+		pixman_image_t *image, pixman_box32_t *tile, int tx, int ty)
+{
+	pixman_region32_t tile_damage;
+	enum rdp_tile_codec codec;
+	uint64_t hash, *cached;
+
+	if(pixman_region32_contains_rectangle(region, tile) == PIXMAN_REGION_OUT)
+		return RDP_TILE_SKIP;
+
+	if(tx < codecs->tiles_width && ty < codecs->tiles_height) {
+		cached = &codecs->tile_hashes[ty * codecs->tiles_width + tx];
+		hash = rdp_tile_hash(image, tile);
+		if(*cached == hash)
+			return RDP_TILE_SKIP;
+		*cached = hash;
+	}
+
+	pixman_region32_init_rect(&tile_damage, tile->x1, tile->y1,
+			tile->x2 - tile->x1, tile->y2 - tile->y1);
+	pixman_region32_intersect(&tile_damage, &tile_damage, region);
+	codec = rdp_tile_classify(image, pixman_region32_extents(&tile_damage), codecs);
+	pixman_region32_fini(&tile_damage);
+
+	return codec;
 }
 
 static void
-rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
+rdp_refresh_run(struct rdp_codecs *codecs, pixman_region32_t *region,
+		pixman_image_t *image, pixman_box32_t *run, enum rdp_tile_codec codec)
 {
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
-	struct rdp_output *output = context->rdpCompositor->output;
-	rdpSettings *settings = peer->settings;
+	pixman_region32_t damage;
+
+	pixman_region32_init_rect(&damage, run->x1, run->y1,
+			run->x2 - run->x1, run->y2 - run->y1);
+	pixman_region32_intersect(&damage, &damage, region);
+
+	switch(codec) {
+	case RDP_TILE_RFX:
+		rdp_refresh_rfx(codecs, &damage, image);
+		break;
+	case RDP_TILE_NSC:
+		rdp_refresh_nsc(codecs, &damage, image);
+		break;
+	case RDP_TILE_RAW:
+		rdp_refresh_raw(codecs, &damage, image);
+		break;
+	case RDP_TILE_SKIP:
+		break;
+	}
+
+	pixman_region32_fini(&damage);
+}
+
+static void
+rdp_refresh_region(struct rdp_codecs *codecs, pixman_region32_t *region,
+		pixman_image_t *image)
+{
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
 	pixman_box32_t *extents = pixman_region32_extents(region);
+	pixman_box32_t tile, run;
+	enum rdp_tile_codec codec, run_codec;
+	int tx, ty, tx1, tx2, ty1, ty2;
+
+	tx1 = extents->x1 > 0 ? extents->x1 / RDP_TILE_SIZE : 0;
+	ty1 = extents->y1 > 0 ? extents->y1 / RDP_TILE_SIZE : 0;
+	tx2 = (min(extents->x2, width) + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE;
+	ty2 = (min(extents->y2, height) + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE;
+
+	/* Unchanged tiles are dropped, the others are coded according to
+	 * their content; horizontal runs of tiles wanting the same codec
+	 * go out as a single surface bits command. */
+	for(ty = ty1; ty < ty2; ty++) {
+		tile.y1 = ty * RDP_TILE_SIZE;
+		tile.y2 = min(tile.y1 + RDP_TILE_SIZE, height);
+		run = tile;
+		run_codec = RDP_TILE_SKIP;
+
+		for(tx = tx1; tx < tx2; tx++) {
+			tile.x1 = tx * RDP_TILE_SIZE;
+			tile.x2 = min(tile.x1 + RDP_TILE_SIZE, width);
+
+			codec = rdp_tile_codec(codecs, region, image, &tile, tx, ty);
+			if(codec == run_codec) {
+				run.x2 = tile.x2;
+				continue;
+			}
+
+			rdp_refresh_run(codecs, region, image, &run, run_codec);
+			run = tile;
+			run_codec = codec;
+		}
+		rdp_refresh_run(codecs, region, image, &run, run_codec);
+	}
+}
+
+static UINT32
+rdp_peer_codec_id(freerdp_peer *peer, enum rdp_tile_codec codec)
+{
+	switch(codec) {
+	case RDP_TILE_RFX:
+		return peer->settings->RemoteFxCodecId;
+	case RDP_TILE_NSC:
+		return peer->settings->NSCodecId;
+	default:
+		return 0;
+	}
+}
+
+/* Only the send itself is under send_mutex, the main loop must not
+ * wait for the encoding. */
+static void
+rdp_peer_emit(struct rdp_codecs *codecs, SURFACE_BITS_COMMAND *cmd,
+		enum rdp_tile_codec codec)
+{
+	RdpPeerContext *context = codecs->emit_data;
+	freerdp_peer *peer = context->item.peer;
+
+	cmd->codecID = rdp_peer_codec_id(peer, codec);
+	pthread_mutex_lock(&context->encoder.send_mutex);
+	peer->update->SurfaceBits(peer->context, cmd);
+	pthread_mutex_unlock(&context->encoder.send_mutex);
+}
+
+static struct rdp_frame *
+rdp_frame_create(int width, int height)
+{
+	struct rdp_frame *frame;
+
+	frame = calloc(1, sizeof *frame);
+	if (!frame)
+		return NULL;
+
+	frame->refcount = 1;
+	frame->width = width;
+	frame->height = height;
+
+	return frame;
+}
+
+/* called with the group's mutex held */
+static void
+rdp_frame_unref(struct rdp_frame *frame)
+{
+	if (--frame->refcount > 0)
+		return;
+
+	free(frame->cmds);
+	free(frame->data);
+	free(frame);
+}
+
+static void
+rdp_frame_emit(struct rdp_codecs *codecs, SURFACE_BITS_COMMAND *cmd,
+		enum rdp_tile_codec codec)
+{
+	struct rdp_frame *frame = codecs->emit_data;
+	struct rdp_frame_cmd *cmds;
+	BYTE *data;
+	size_t size;
+	int alloc;
+
+	if (frame->failed)
+		return;
+
+	if (frame->count == frame->alloc) {
+		alloc = frame->alloc ? frame->alloc * 2 : 16;
+		cmds = realloc(frame->cmds, alloc * sizeof *cmds);
+		if (!cmds)
+			goto err;
+		frame->cmds = cmds;
+		frame->alloc = alloc;
+	}
+
+	if (frame->size + cmd->bitmapDataLength > frame->data_alloc) {
+		size = frame->data_alloc ? frame->data_alloc : 65536;
+		while (size < frame->size + cmd->bitmapDataLength)
+			size *= 2;
+		data = realloc(frame->data, size);
+		if (!data)
+			goto err;
+		frame->data = data;
+		frame->data_alloc = size;
+	}
+
+	memcpy(frame->data + frame->size, cmd->bitmapData, cmd->bitmapDataLength);
+	frame->cmds[frame->count].cmd = *cmd;
+	frame->cmds[frame->count].cmd.bitmapData = NULL;
+	frame->cmds[frame->count].codec = codec;
+	frame->cmds[frame->count].offset = frame->size;
+	frame->count++;
+	frame->size += cmd->bitmapDataLength;
+	return;
+
+err:
+	/* a frame with holes would corrupt the clients, they get
+	 * resynced instead */
+	frame->failed = 1;
+}
+
+static void
+copy_region(pixman_image_t *dst, pixman_image_t *src, pixman_region32_t *region)
+{
+	pixman_box32_t *rects;
+	int i, nrects;
+
+	rects = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; i++)
+		pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst,
+					 rects[i].x1, rects[i].y1, 0, 0,
+					 rects[i].x1, rects[i].y1,
+					 rects[i].x2 - rects[i].x1,
+					 rects[i].y2 - rects[i].y1);
+}
+
+static uint32_t
+timespec_sub_usec(struct timespec *a, struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000 +
+		(a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+static void
+rdp_encoder_init(struct rdp_peer_encoder *encoder)
+{
+	pthread_mutexattr_t attr;
+
+	memset(encoder, 0, sizeof *encoder);
+	pthread_mutex_init(&encoder->mutex, NULL);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&encoder->send_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_cond_init(&encoder->cond, NULL);
+	pixman_region32_init(&encoder->pending_damage);
+}
+
+static int
+rdp_encoder_prepare(struct rdp_peer_encoder *encoder, pixman_image_t *shadow)
+{
+	int width = pixman_image_get_width(shadow);
+	int height = pixman_image_get_height(shadow);
+
+	encoder->pending_image =
+		pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, NULL, 0);
+	encoder->image =
+		pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, NULL, 0);
+	if (!encoder->pending_image || !encoder->image)
+		return -1;
+
+	pixman_image_composite32(PIXMAN_OP_SRC, shadow, NULL,
+				 encoder->pending_image,
+				 0, 0, 0, 0, 0, 0, width, height);
+	pixman_image_composite32(PIXMAN_OP_SRC, shadow, NULL,
+				 encoder->image,
+				 0, 0, 0, 0, 0, 0, width, height);
+
+	return 0;
+}
+
+static int
+rdp_encoder_start(struct rdp_peer_encoder *encoder,
+		  void *(*func)(void *), void *data)
+{
+	if (pthread_create(&encoder->thread, NULL, func, data) != 0) {
+		weston_log("unable to start the rdp encoder thread\n");
+		return -1;
+	}
+	encoder->running = 1;
+
+	return 0;
+}
+
+static void
+rdp_encoder_release(struct rdp_peer_encoder *encoder)
+{
+	if (encoder->running) {
+		pthread_mutex_lock(&encoder->mutex);
+		encoder->quit = 1;
+		pthread_cond_signal(&encoder->cond);
+		pthread_mutex_unlock(&encoder->mutex);
+		pthread_join(encoder->thread, NULL);
+		encoder->running = 0;
+	}
+
+	pixman_region32_fini(&encoder->pending_damage);
+	if (encoder->pending_image)
+		pixman_image_unref(encoder->pending_image);
+	if (encoder->image)
+		pixman_image_unref(encoder->image);
+	pthread_mutex_destroy(&encoder->mutex);
+	pthread_mutex_destroy(&encoder->send_mutex);
+	pthread_cond_destroy(&encoder->cond);
+}
+
+static void
+rdp_encoder_queue_damage(struct rdp_peer_encoder *encoder, pixman_image_t *shadow,
+			 pixman_region32_t *damage)
+{
+	pixman_region32_t region;
+
+	pixman_region32_init_rect(&region, 0, 0,
+				  pixman_image_get_width(encoder->pending_image),
+				  pixman_image_get_height(encoder->pending_image));
+	pixman_region32_intersect(&region, &region, damage);
+
+	pthread_mutex_lock(&encoder->mutex);
+	if (pixman_region32_not_empty(&encoder->pending_damage))
+		encoder->stats.coalesced++;
+	copy_region(encoder->pending_image, shadow, &region);
+	pixman_region32_union(&encoder->pending_damage,
+			      &encoder->pending_damage, &region);
+	pthread_cond_signal(&encoder->cond);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	pixman_region32_fini(&region);
+}
+
+static void
+rdp_encoder_queue_resize(struct rdp_peer_encoder *encoder, pixman_image_t *shadow)
+{
+	int width = pixman_image_get_width(shadow);
+	int height = pixman_image_get_height(shadow);
+	pixman_image_t *pending;
 
-	int regionSz = (extents->x2 - extents->x1) * (extents->y2 - extents->y1);
+	pending = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, NULL, 0);
+	if (!pending)
+		return;
+
+	pthread_mutex_lock(&encoder->mutex);
+	pixman_image_unref(encoder->pending_image);
+	encoder->pending_image = pending;
+	pixman_image_composite32(PIXMAN_OP_SRC, shadow, NULL, pending,
+				 0, 0, 0, 0, 0, 0, width, height);
+	pixman_region32_fini(&encoder->pending_damage);
+	pixman_region32_init_rect(&encoder->pending_damage, 0, 0, width, height);
+	encoder->resize_width = width;
+	encoder->resize_height = height;
+	pthread_cond_signal(&encoder->cond);
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+/* Called from the encoder thread, the close happens on the main
+ * loop. */
+static void
+rdp_peer_request_close(RdpPeerContext *context)
+{
+	uint64_t one = 1;
+
+	if (write(context->close_fd, &one, sizeof one) != sizeof one)
+		weston_log("unable to close rdp peer %p: %m\n",
+			   context->item.peer);
+}
+
+static int
+rdp_peer_close_handler(int fd, uint32_t mask, void *data)
+{
+	RdpPeerContext *context = data;
+	freerdp_peer *peer = context->item.peer;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) != sizeof count)
+		return 0;
+
+	pthread_mutex_lock(&context->encoder.send_mutex);
+	peer->Close(peer);
+	pthread_mutex_unlock(&context->encoder.send_mutex);
+
+	return 0;
+}
+
+static void *
+rdp_peer_encoder_thread(void *data)
+{
+	RdpPeerContext *context = data;
+	struct rdp_peer_encoder *encoder = &context->encoder;
+	freerdp_peer *peer = context->item.peer;
+	pixman_region32_t damage;
+	pixman_image_t *image;
+	struct timespec start, end;
+	int width, height, flush_cache, close_peer = 0;
+	uint32_t usec;
+
+	pixman_region32_init(&damage);
+
+	pthread_mutex_lock(&encoder->mutex);
+	while (1) {
+		while (!encoder->quit && !encoder->resize_width &&
+		       !pixman_region32_not_empty(&encoder->pending_damage))
+			pthread_cond_wait(&encoder->cond, &encoder->mutex);
+		if (encoder->quit)
+			break;
+
+		width = encoder->resize_width;
+		height = encoder->resize_height;
+		encoder->resize_width = 0;
+		encoder->resize_height = 0;
+		flush_cache = encoder->flush_cache;
+		encoder->flush_cache = 0;
+
+		if (width) {
+			/* too bad this peer does not support desktop resize */
+			close_peer = !peer->settings->DesktopResize;
+			if (close_peer)
+				break;
+			image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+							 width, height, NULL, 0);
+			if (!image) {
+				weston_log("out of memory resizing rdp peer %p "
+					   "to %dx%d, closing it\n",
+					   peer, width, height);
+				close_peer = 1;
+				break;
+			}
+			pixman_image_unref(encoder->image);
+			encoder->image = image;
+		}
+
+		copy_region(encoder->image, encoder->pending_image,
+			    &encoder->pending_damage);
+		pixman_region32_copy(&damage, &encoder->pending_damage);
+		pixman_region32_fini(&encoder->pending_damage);
+		pixman_region32_init(&encoder->pending_damage);
+		pthread_mutex_unlock(&encoder->mutex);
+
+		if (width) {
+			peer->settings->DesktopWidth = width;
+			peer->settings->DesktopHeight = height;
+			pthread_mutex_lock(&encoder->send_mutex);
+			peer->update->DesktopResize(peer->context);
+			pthread_mutex_unlock(&encoder->send_mutex);
+			rdp_codecs_reset_tile_cache(&context->codecs, width, height);
+		} else if (flush_cache) {
+			rdp_codecs_flush_tile_cache(&context->codecs);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		context->codecs.frame_bytes = 0;
+		rdp_refresh_region(&context->codecs, &damage, encoder->image);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		usec = timespec_sub_usec(&end, &start);
+
+		pthread_mutex_lock(&encoder->mutex);
+		encoder->stats.frames++;
+		encoder->stats.bytes += context->codecs.frame_bytes;
+		encoder->stats.encode_usec += usec;
+		if (usec > encoder->stats.max_encode_usec)
+			encoder->stats.max_encode_usec = usec;
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	if (close_peer)
+		rdp_peer_request_close(context);
+	pixman_region32_fini(&damage);
+
+	return NULL;
+}
+
+static void
+rdp_peer_send_frame(RdpPeerContext *context, struct rdp_frame *frame)
+{
+	freerdp_peer *peer = context->item.peer;
+	SURFACE_BITS_COMMAND cmd;
+	int i;
+
+	pthread_mutex_lock(&context->encoder.send_mutex);
+	for (i = 0; i < frame->count; i++) {
+		cmd = frame->cmds[i].cmd;
+		cmd.codecID = rdp_peer_codec_id(peer, frame->cmds[i].codec);
+		cmd.bitmapData = frame->data + frame->cmds[i].offset;
+		peer->update->SurfaceBits(peer->context, &cmd);
+	}
+	pthread_mutex_unlock(&context->encoder.send_mutex);
+}
+
+static void *
+rdp_peer_broadcast_thread(void *data)
+{
+	RdpPeerContext *context = data;
+	struct rdp_peer_encoder *encoder = &context->encoder;
+	struct rdp_broadcast *broadcast = context->broadcast;
+	freerdp_peer *peer = context->item.peer;
+	rdpSettings *settings = peer->settings;
+	struct rdp_frame *frame;
+	struct timespec start, end;
+	int close_peer = 0;
+	uint32_t usec;
+	size_t size;
+
+	pthread_mutex_lock(&encoder->mutex);
+	while (1) {
+		while (!encoder->quit && !encoder->queue_length)
+			pthread_cond_wait(&encoder->cond, &encoder->mutex);
+		if (encoder->quit)
+			break;
 
-	if(regionSz > 64 * 64) {
-		if(settings->RemoteFxCodec)
-			rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
-		else if(settings->NSCodec)
-			rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
-		else
-			rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+		frame = encoder->queue[encoder->queue_head];
+		encoder->queue_head = (encoder->queue_head + 1) % RDP_FRAME_QUEUE_LENGTH;
+		encoder->queue_length--;
+		pthread_mutex_unlock(&encoder->mutex);
+
+		if (frame->width != (int)settings->DesktopWidth ||
+		    frame->height != (int)settings->DesktopHeight) {
+			/* too bad this peer does not support desktop resize */
+			close_peer = !settings->DesktopResize;
+			if (!close_peer) {
+				settings->DesktopWidth = frame->width;
+				settings->DesktopHeight = frame->height;
+				pthread_mutex_lock(&encoder->send_mutex);
+				peer->update->DesktopResize(peer->context);
+				pthread_mutex_unlock(&encoder->send_mutex);
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (!close_peer)
+			rdp_peer_send_frame(context, frame);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		usec = timespec_sub_usec(&end, &start);
+		size = frame->size;
+
+		pthread_mutex_lock(&broadcast->encoder.mutex);
+		rdp_frame_unref(frame);
+		pthread_mutex_unlock(&broadcast->encoder.mutex);
+
+		pthread_mutex_lock(&encoder->mutex);
+		if (close_peer)
+			break;
+		encoder->stats.frames++;
+		encoder->stats.bytes += size;
+		encoder->stats.encode_usec += usec;
+		if (usec > encoder->stats.max_encode_usec)
+			encoder->stats.max_encode_usec = usec;
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	if (close_peer)
+		rdp_peer_request_close(context);
+
+	return NULL;
+}
+
+/* called with the group's mutex held */
+static void
+rdp_peer_drop_frames(RdpPeerContext *context)
+{
+	struct rdp_peer_encoder *encoder = &context->encoder;
+
+	pthread_mutex_lock(&encoder->mutex);
+	while (encoder->queue_length) {
+		rdp_frame_unref(encoder->queue[encoder->queue_head]);
+		encoder->queue_head = (encoder->queue_head + 1) % RDP_FRAME_QUEUE_LENGTH;
+		encoder->queue_length--;
+		encoder->stats.dropped++;
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+/* called with the group's mutex held */
+static int
+rdp_peer_push_frame(RdpPeerContext *context, struct rdp_frame *frame)
+{
+	struct rdp_peer_encoder *encoder = &context->encoder;
+	int ret = 0;
+
+	pthread_mutex_lock(&encoder->mutex);
+	if (encoder->queue_length < RDP_FRAME_QUEUE_LENGTH) {
+		frame->refcount++;
+		encoder->queue[(encoder->queue_head + encoder->queue_length) %
+			       RDP_FRAME_QUEUE_LENGTH] = frame;
+		encoder->queue_length++;
+		pthread_cond_signal(&encoder->cond);
 	} else {
-		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+		encoder->stats.dropped++;
+		ret = -1;
 	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return ret;
 }
 
+/* called with the group's mutex held */
+static void
+rdp_broadcast_resync(struct rdp_broadcast *broadcast, RdpPeerContext *context)
+{
+	rdp_peer_drop_frames(context);
+	wl_list_remove(&context->broadcast_link);
+	wl_list_insert(broadcast->joining.prev, &context->broadcast_link);
+}
+
+static struct rdp_frame *
+rdp_broadcast_keyframe(struct rdp_broadcast *broadcast)
+{
+	pixman_image_t *image = broadcast->encoder.image;
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	struct rdp_codecs codecs;
+	struct rdp_frame *frame;
+	pixman_region32_t region;
+
+	frame = rdp_frame_create(width, height);
+	if (!frame)
+		return NULL;
+
+	/* fresh codec contexts, so the RemoteFX headers go out again,
+	 * and an empty tile cache so every tile is sent */
+	if (rdp_codecs_init(&codecs, broadcast->codecs.rfx,
+			    broadcast->codecs.nsc, width, height) < 0) {
+		frame->failed = 1;
+	} else {
+		codecs.emit = rdp_frame_emit;
+		codecs.emit_data = frame;
+		pixman_region32_init_rect(&region, 0, 0, width, height);
+		rdp_refresh_region(&codecs, &region, image);
+		pixman_region32_fini(&region);
+	}
+	rdp_codecs_release(&codecs);
+
+	return frame;
+}
+
+static void *
+rdp_broadcast_thread(void *data)
+{
+	struct rdp_broadcast *broadcast = data;
+	struct rdp_peer_encoder *encoder = &broadcast->encoder;
+	RdpPeerContext *peer, *next;
+	struct rdp_frame *frame, *keyframe;
+	struct wl_list joining;
+	pixman_region32_t damage;
+	pixman_image_t *image;
+	struct timespec start, end;
+	int width, height;
+	uint32_t usec;
+
+	pixman_region32_init(&damage);
+	wl_list_init(&joining);
+
+	pthread_mutex_lock(&encoder->mutex);
+	while (1) {
+		while (!encoder->quit && !encoder->resize_width &&
+		       !pixman_region32_not_empty(&encoder->pending_damage) &&
+		       wl_list_empty(&broadcast->joining))
+			pthread_cond_wait(&encoder->cond, &encoder->mutex);
+		if (encoder->quit)
+			break;
+
+		width = encoder->resize_width;
+		height = encoder->resize_height;
+		encoder->resize_width = 0;
+		encoder->resize_height = 0;
+		if (width) {
+			image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+							 width, height, NULL, 0);
+			if (image) {
+				pixman_image_unref(encoder->image);
+				encoder->image = image;
+			}
+		}
+
+		copy_region(encoder->image, encoder->pending_image,
+			    &encoder->pending_damage);
+		pixman_region32_copy(&damage, &encoder->pending_damage);
+		pixman_region32_fini(&encoder->pending_damage);
+		pixman_region32_init(&encoder->pending_damage);
+		wl_list_insert_list(&joining, &broadcast->joining);
+		wl_list_init(&broadcast->joining);
+		pthread_mutex_unlock(&encoder->mutex);
+
+		width = pixman_image_get_width(encoder->image);
+		height = pixman_image_get_height(encoder->image);
+		if (width != broadcast->codecs.rfx_context->width ||
+		    height != broadcast->codecs.rfx_context->height) {
+			broadcast->codecs.rfx_context->width = width;
+			broadcast->codecs.rfx_context->height = height;
+			rdp_codecs_reset_tile_cache(&broadcast->codecs, width, height);
+		}
+
+		frame = NULL;
+		usec = 0;
+		if (pixman_region32_not_empty(&damage)) {
+			frame = rdp_frame_create(width, height);
+			if (frame) {
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				broadcast->codecs.emit_data = frame;
+				rdp_refresh_region(&broadcast->codecs, &damage,
+						   encoder->image);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				usec = timespec_sub_usec(&end, &start);
+			}
+		}
+
+		/* the joiners start from the image as it is after frame */
+		keyframe = NULL;
+		if (!wl_list_empty(&joining))
+			keyframe = rdp_broadcast_keyframe(broadcast);
+
+		pthread_mutex_lock(&encoder->mutex);
+		if (frame) {
+			wl_list_for_each_safe(peer, next, &broadcast->members,
+					      broadcast_link) {
+				if (frame->failed ||
+				    rdp_peer_push_frame(peer, frame) < 0)
+					rdp_broadcast_resync(broadcast, peer);
+			}
+
+			encoder->stats.frames++;
+			encoder->stats.bytes += frame->size;
+			encoder->stats.encode_usec += usec;
+			if (usec > encoder->stats.max_encode_usec)
+				encoder->stats.max_encode_usec = usec;
+			rdp_frame_unref(frame);
+		}
+
+		wl_list_for_each_safe(peer, next, &joining, broadcast_link) {
+			wl_list_remove(&peer->broadcast_link);
+			if (keyframe && !keyframe->failed &&
+			    rdp_peer_push_frame(peer, keyframe) == 0)
+				wl_list_insert(broadcast->members.prev,
+					       &peer->broadcast_link);
+			else
+				wl_list_insert(broadcast->joining.prev,
+					       &peer->broadcast_link);
+		}
+		if (keyframe)
+			rdp_frame_unref(keyframe);
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	pixman_region32_fini(&damage);
+
+	return NULL;
+}
+
+static struct rdp_broadcast *
+rdp_broadcast_get(struct rdp_compositor *c, rdpSettings *settings)
+{
+	struct rdp_broadcast *broadcast;
+	pixman_image_t *shadow = c->output->shadow_surface;
+
+	wl_list_for_each(broadcast, &c->broadcasts, link) {
+		if (broadcast->codecs.rfx == settings->RemoteFxCodec &&
+		    broadcast->codecs.nsc == settings->NSCodec)
+			return broadcast;
+	}
+
+	broadcast = malloc(sizeof *broadcast);
+	if (!broadcast)
+		return NULL;
+
+	rdp_encoder_init(&broadcast->encoder);
+	wl_list_init(&broadcast->members);
+	wl_list_init(&broadcast->joining);
+	broadcast->npeers = 0;
+	if (rdp_codecs_init(&broadcast->codecs, settings->RemoteFxCodec,
+			    settings->NSCodec, pixman_image_get_width(shadow),
+			    pixman_image_get_height(shadow)) < 0 ||
+	    rdp_encoder_prepare(&broadcast->encoder, shadow) < 0 ||
+	    rdp_encoder_start(&broadcast->encoder,
+			      rdp_broadcast_thread, broadcast) < 0) {
+		rdp_encoder_release(&broadcast->encoder);
+		rdp_codecs_release(&broadcast->codecs);
+		free(broadcast);
+		return NULL;
+	}
+	broadcast->codecs.emit = rdp_frame_emit;
+
+	wl_list_insert(&c->broadcasts, &broadcast->link);
+
+	return broadcast;
+}
+
+static void
+rdp_broadcast_destroy(struct rdp_broadcast *broadcast)
+{
+	rdp_encoder_release(&broadcast->encoder);
+	rdp_codecs_release(&broadcast->codecs);
+	wl_list_remove(&broadcast->link);
+	free(broadcast);
+}
+
+static int
+rdp_peer_encoder_start(RdpPeerContext *context, pixman_image_t *shadow)
+{
+	struct rdp_compositor *c = context->rdpCompositor;
+	struct rdp_peer_encoder *encoder = &context->encoder;
+	rdpSettings *settings = context->item.peer->settings;
+	struct rdp_broadcast *broadcast;
+	pixman_region32_t region;
+	int width = pixman_image_get_width(shadow);
+	int height = pixman_image_get_height(shadow);
+
+	if (c->broadcast) {
+		broadcast = rdp_broadcast_get(c, settings);
+		if (!broadcast)
+			return -1;
+
+		context->broadcast = broadcast;
+		if (rdp_encoder_start(encoder, rdp_peer_broadcast_thread,
+				      context) < 0) {
+			context->broadcast = NULL;
+			return -1;
+		}
+
+		/* an idle group gets no damage, bring its image up to date */
+		if (!broadcast->npeers) {
+			pixman_region32_init_rect(&region, 0, 0, width, height);
+			rdp_encoder_queue_damage(&broadcast->encoder, shadow, &region);
+			pixman_region32_fini(&region);
+		}
+
+		pthread_mutex_lock(&broadcast->encoder.mutex);
+		wl_list_insert(broadcast->joining.prev, &context->broadcast_link);
+		pthread_cond_signal(&broadcast->encoder.cond);
+		pthread_mutex_unlock(&broadcast->encoder.mutex);
+		broadcast->npeers++;
+
+		return 0;
+	}
+
+	if (rdp_codecs_init(&context->codecs, settings->RemoteFxCodec,
+			    settings->NSCodec, width, height) < 0 ||
+	    rdp_encoder_prepare(encoder, shadow) < 0)
+		return -1;
+	context->codecs.emit = rdp_peer_emit;
+	context->codecs.emit_data = context;
+
+	/* the client starts out with nothing, send it everything */
+	pixman_region32_fini(&encoder->pending_damage);
+	pixman_region32_init_rect(&encoder->pending_damage, 0, 0, width, height);
+
+	return rdp_encoder_start(encoder, rdp_peer_encoder_thread, context);
+}
+
+static void
+rdp_peer_encoder_stop(RdpPeerContext *context)
+{
+	struct rdp_broadcast *broadcast = context->broadcast;
+
+	rdp_encoder_release(&context->encoder);
+
+	/* the thread is gone, whatever the group still queued is ours */
+	if (broadcast) {
+		pthread_mutex_lock(&broadcast->encoder.mutex);
+		wl_list_remove(&context->broadcast_link);
+		wl_list_init(&context->broadcast_link);
+		while (context->encoder.queue_length) {
+			rdp_frame_unref(context->encoder.queue[context->encoder.queue_head]);
+			context->encoder.queue_head = (context->encoder.queue_head + 1) %
+				RDP_FRAME_QUEUE_LENGTH;
+			context->encoder.queue_length--;
+		}
+		pthread_mutex_unlock(&broadcast->encoder.mutex);
+		broadcast->npeers--;
+	}
+
+	rdp_codecs_release(&context->codecs);
+}
 
 static void
 rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage)
 {
 	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 	struct weston_compositor *ec = output->base.compositor;
+	struct rdp_compositor *c = (struct rdp_compositor *)ec;
 	struct rdp_peers_item *outputPeer;
+	struct rdp_broadcast *broadcast;
+	RdpPeerContext *peerCtx;
 
 	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
 	ec->renderer->repaint_output(&output->base, damage);
 
 	wl_list_for_each(outputPeer, &output->peers, link) {
+		peerCtx = (RdpPeerContext *)outputPeer->peer->context;
 		if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
-				(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
+				(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED) &&
+				!peerCtx->broadcast)
 		{
-			rdp_peer_refresh_region(damage, outputPeer->peer);
+			rdp_encoder_queue_damage(&peerCtx->encoder,
+					output->shadow_surface, damage);
 		}
 	}
 
+	wl_list_for_each(broadcast, &c->broadcasts, link) {
+		if (broadcast->npeers)
+			rdp_encoder_queue_damage(&broadcast->encoder,
+					output->shadow_surface, damage);
+	}
+
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
@@ -328,7 +1479,10 @@ find_matching_mode(struct weston_output *output, struct weston_mode *target) {
 static int
 rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode) {
 	struct rdp_output *rdpOutput = container_of(output, struct rdp_output, base);
+	struct rdp_compositor *c = (struct rdp_compositor *)output->compositor;
 	struct rdp_peers_item *rdpPeer;
+	struct rdp_broadcast *broadcast;
+	RdpPeerContext *peerCtx;
 	rdpSettings *settings;
 	pixman_image_t *new_shadow_buffer;
 	struct weston_mode *local_mode;
@@ -356,7 +1510,19 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode) {
 	pixman_image_unref(rdpOutput->shadow_surface);
 	rdpOutput->shadow_surface = new_shadow_buffer;
 
+	/* broadcast peers resize when a frame of the new size reaches them */
+	wl_list_for_each(broadcast, &c->broadcasts, link)
+		rdp_encoder_queue_resize(&broadcast->encoder, new_shadow_buffer);
+
 	wl_list_for_each(rdpPeer, &rdpOutput->peers, link) {
+		peerCtx = (RdpPeerContext *)rdpPeer->peer->context;
+		if(peerCtx->encoder.running) {
+			/* the encoder thread owns the connection from now on */
+			if(!peerCtx->broadcast)
+				rdp_encoder_queue_resize(&peerCtx->encoder, new_shadow_buffer);
+			continue;
+		}
+
 		settings = rdpPeer->peer->settings;
 		if(!settings->DesktopResize) {
 			/* too bad this peer does not support desktop resize */
@@ -493,6 +1659,10 @@ static void
 rdp_destroy(struct weston_compositor *ec)
 {
 	struct rdp_compositor *c = (struct rdp_compositor *) ec;
+	struct rdp_broadcast *broadcast, *next;
+
+	wl_list_for_each_safe(broadcast, next, &c->broadcasts, link)
+		rdp_broadcast_destroy(broadcast);
 
 	weston_seat_release(&c->main_seat);
 
@@ -547,16 +1717,14 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	context->item.peer = client;
 	context->item.flags = 0;
 
-	context->rfx_context = rfx_context_new();
-	context->rfx_context->mode = RLGR3;
-	context->rfx_context->width = client->settings->DesktopWidth;
-	context->rfx_context->height = client->settings->DesktopHeight;
-	rfx_context_set_pixel_format(context->rfx_context, RDP_PIXEL_FORMAT_B8G8R8A8);
-
-	context->nsc_context = nsc_context_new();
-	rfx_context_set_pixel_format(context->rfx_context, RDP_PIXEL_FORMAT_B8G8R8A8);
-
-	context->encode_stream = stream_new(65536);
+	/* the codecs are only known once the capabilities are exchanged,
+	 * they are set up in post connect */
+	memset(&context->codecs, 0, sizeof context->codecs);
+	rdp_encoder_init(&context->encoder);
+	context->close_fd = -1;
+	context->close_source = NULL;
+	context->broadcast = NULL;
+	wl_list_init(&context->broadcast_link);
 }
 
 static void
@@ -572,20 +1740,29 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 			wl_event_source_remove(context->events[i]);
 	}
 
+	rdp_peer_encoder_stop(context);
+
+	if(context->close_source)
+		wl_event_source_remove(context->close_source);
+	if(context->close_fd != -1)
+		close(context->close_fd);
+
 	if(context->item.flags & RDP_PEER_ACTIVATED)
 		weston_seat_release(&context->item.seat);
-	stream_free(context->encode_stream);
-	nsc_context_free(context->nsc_context);
-	rfx_context_free(context->rfx_context);
-	free(context->rfx_rects);
 }
 
 
 static int
 rdp_client_activity(int fd, uint32_t mask, void *data) {
 	freerdp_peer* client = (freerdp_peer *)data;
+	RdpPeerContext *peerCtx = (RdpPeerContext *)client->context;
+	BOOL ret;
+
+	pthread_mutex_lock(&peerCtx->encoder.send_mutex);
+	ret = client->CheckFileDescriptor(client);
+	pthread_mutex_unlock(&peerCtx->encoder.send_mutex);
 
-	if (!client->CheckFileDescriptor(client)) {
+	if (!ret) {
 		weston_log("unable to checkDescriptor for %p\n", client);
 		goto out_clean;
 	}
@@ -692,6 +1869,9 @@ xf_peer_post_connect(freerdp_peer* client)
 
 		keymap = xkb_keymap_new_from_names(xkbContext, &xkbRuleNames, 0);
 	}
+	if(rdp_peer_encoder_start(peerCtx, output->shadow_surface) < 0)
+		return FALSE;
+
 	weston_seat_init_keyboard(&peerCtx->item.seat, keymap);
 	weston_seat_init_pointer(&peerCtx->item.seat);
 
@@ -763,17 +1943,32 @@ xf_input_synchronize_event(rdpInput *input, UINT32 flags)
 	pixman_region32_t damage;
 
 	/* disable pointer on the client side */
+	pthread_mutex_lock(&peerCtx->encoder.send_mutex);
 	pointer->pointer_system.type = SYSPTR_NULL;
 	pointer->PointerSystem(client->context, &pointer->pointer_system);
+	pthread_mutex_unlock(&peerCtx->encoder.send_mutex);
 
-	/* sends a full refresh */
+	if(!peerCtx->encoder.running)
+		return;
+
+	/* sends a full refresh, the client may have lost anything we sent */
 	box.x1 = 0;
 	box.y1 = 0;
 	box.x2 = output->base.width;
 	box.y2 = output->base.height;
 	pixman_region32_init_with_extents(&damage, &box);
 
-	rdp_peer_refresh_region(&damage, client);
+	if(peerCtx->broadcast) {
+		pthread_mutex_lock(&peerCtx->broadcast->encoder.mutex);
+		rdp_broadcast_resync(peerCtx->broadcast, peerCtx);
+		pthread_cond_signal(&peerCtx->broadcast->encoder.cond);
+		pthread_mutex_unlock(&peerCtx->broadcast->encoder.mutex);
+	} else {
+		pthread_mutex_lock(&peerCtx->encoder.mutex);
+		peerCtx->encoder.flush_cache = 1;
+		pthread_mutex_unlock(&peerCtx->encoder.mutex);
+		rdp_encoder_queue_damage(&peerCtx->encoder, output->shadow_surface, &damage);
+	}
 
 	pixman_region32_fini(&damage);
 }
@@ -808,8 +2003,16 @@ xf_input_unicode_keyboard_event(rdpInput *input, UINT16 flags, UINT16 code)
 static void
 xf_suppress_output(rdpContext *context, BYTE allow, RECTANGLE_16 *area) {
 	RdpPeerContext *peerContext = (RdpPeerContext *)context;
-	if(allow)
+	if(allow) {
+		/* damage was not sent while suppressed, forget what the
+		 * client is supposed to show */
+		if(!(peerContext->item.flags & RDP_PEER_OUTPUT_ENABLED)) {
+			pthread_mutex_lock(&peerContext->encoder.mutex);
+			peerContext->encoder.flush_cache = 1;
+			pthread_mutex_unlock(&peerContext->encoder.mutex);
+		}
 		peerContext->item.flags |= RDP_PEER_OUTPUT_ENABLED;
+	}
 	else
 		peerContext->item.flags &= (~RDP_PEER_OUTPUT_ENABLED);
 }
@@ -866,6 +2069,14 @@ rdp_peer_init(freerdp_peer *client, struct rdp_compositor *c)
 	}
 
 	loop = wl_display_get_event_loop(c->base.wl_display);
+	peerCtx->close_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (peerCtx->close_fd < 0) {
+		weston_log("unable to create the rdp peer close eventfd: %m\n");
+		return -1;
+	}
+	peerCtx->close_source = wl_event_loop_add_fd(loop, peerCtx->close_fd,
+			WL_EVENT_READABLE, rdp_peer_close_handler, peerCtx);
+
 	for(i = 0; i < rcount; i++) {
 		fd = (int)(long)(rfds[i]);
 
@@ -891,6 +2102,45 @@ rdp_incoming_peer(freerdp_listener *instance, freerdp_peer *client)
 		return;
 }
 
+static void
+rdp_log_stats(const char *name, void *id, struct rdp_peer_encoder *encoder)
+{
+	struct rdp_peer_stats stats;
+
+	pthread_mutex_lock(&encoder->mutex);
+	stats = encoder->stats;
+	pthread_mutex_unlock(&encoder->mutex);
+
+	if(!stats.frames)
+		return;
+	weston_log("rdp %s %p: %u frames, %u coalesced, %u dropped, "
+		"%llu bytes/frame, %.2f ms average, %.2f ms max\n", name, id,
+		stats.frames, stats.coalesced, stats.dropped,
+		(unsigned long long)(stats.bytes / stats.frames),
+		stats.encode_usec / 1000.0 / stats.frames,
+		stats.max_encode_usec / 1000.0);
+}
+
+static void
+rdp_stats_binding(struct wl_seat *seat, uint32_t time, uint32_t key, void *data)
+{
+	struct rdp_compositor *c = data;
+	struct rdp_peers_item *item;
+	struct rdp_broadcast *broadcast;
+	RdpPeerContext *peerCtx;
+
+	/* times are encode and send for peers coded on their own, send
+	 * only for broadcast peers and encode only for groups */
+	wl_list_for_each(broadcast, &c->broadcasts, link)
+		rdp_log_stats("group", broadcast, &broadcast->encoder);
+
+	wl_list_for_each(item, &c->output->peers, link) {
+		peerCtx = (RdpPeerContext *)item->peer->context;
+		if(peerCtx->encoder.running)
+			rdp_log_stats("peer", item->peer, &peerCtx->encoder);
+	}
+}
+
 static struct weston_compositor *
 rdp_compositor_create(struct wl_display *display,
 		struct rdp_compositor_config *config,
@@ -914,6 +2164,8 @@ rdp_compositor_create(struct wl_display *display,
 	c->base.destroy = rdp_destroy;
 	c->base.restore = rdp_restore;
 	c->rdp_key = config->rdp_key ? strdup(config->rdp_key) : NULL;
+	c->broadcast = config->broadcast;
+	wl_list_init(&c->broadcasts);
 
 	/* activate TLS only if certificate/key are available */
 	if(config->server_cert && config->server_key) {
@@ -931,6 +2183,9 @@ rdp_compositor_create(struct wl_display *display,
 	if (rdp_compositor_create_output(c, config->width, config->height, config->extra_modes) < 0)
 		goto err_compositor;
 
+	weston_compositor_add_debug_binding(&c->base, KEY_E,
+					    rdp_stats_binding, c);
+
 	if(!config->env_socket) {
 		c->listener = freerdp_listener_new();
 		c->listener->PeerAccepted = rdp_incoming_peer;
@@ -996,7 +2251,8 @@ backend_init(struct wl_display *display, int *argc, char *argv[],
 		{ WESTON_OPTION_INTEGER, "port", 0, &config.port },
 		{ WESTON_OPTION_STRING,  "rdp4-key", 0, &config.rdp_key },
 		{ WESTON_OPTION_STRING,  "rdp-tls-cert", 0, &config.server_cert },
-		{ WESTON_OPTION_STRING,  "rdp-tls-key", 0, &config.server_key }
+		{ WESTON_OPTION_STRING,  "rdp-tls-key", 0, &config.server_key },
+		{ WESTON_OPTION_BOOLEAN, "rdp-broadcast", 0, &config.broadcast }
 	};
 
 	parse_options(rdp_options, ARRAY_LENGTH(rdp_options), argc, argv);
@@ -46,6 +46,7 @@
 #include "compositor.h"
 #include "gl-renderer.h"
 #include "evdev.h"
+#include "udev-seat.h"
 
 /*
  * Dispmanx API offers alpha-blended overlays for hardware compositing.
@@ -114,6 +115,15 @@ struct rpi_resource {
 	VC_IMAGE_TYPE_T ifmt;
 };
 
+/* Dispmanx resources the elements no longer use, kept for reuse by
+ * size and format, see rpi_resource_realloc(). */
+#define RPI_RESOURCE_POOL_SIZE 8
+
+struct rpi_pooled_resource {
+	struct wl_list link;
+	struct rpi_resource resource;
+};
+
 struct rpi_element {
 	struct wl_list link;
 	struct weston_plane plane;
@@ -155,15 +165,6 @@ struct rpi_output {
 	struct wl_list old_element_list; /* struct rpi_element */
 };
 
-struct rpi_seat {
-	struct weston_seat base;
-	struct wl_list devices_list;
-
-	struct udev_monitor *udev_monitor;
-	struct wl_event_source *udev_monitor_source;
-	char *seat_id;
-};
-
 struct rpi_compositor {
 	struct weston_compositor base;
 	uint32_t prev_state;
@@ -173,6 +174,9 @@ struct rpi_compositor {
 
 	int max_planes; /* per output, really */
 	int single_buffer;
+
+	struct wl_list resource_pool; /* most recently released first */
+	int resource_pool_count;
 };
 
 static inline struct rpi_output *
@@ -181,12 +185,6 @@ to_rpi_output(struct weston_output *base)
 	return container_of(base, struct rpi_output, base);
 }
 
-static inline struct rpi_seat *
-to_rpi_seat(struct weston_seat *base)
-{
-	return container_of(base, struct rpi_seat, base);
-}
-
 static inline struct rpi_compositor *
 to_rpi_compositor(struct weston_compositor *base)
 {
@@ -206,18 +204,88 @@ rpi_resource_init(struct rpi_resource *resource)
 }
 
 static void
-rpi_resource_release(struct rpi_resource *resource)
+rpi_resource_delete(struct rpi_resource *resource)
 {
+	vc_dispmanx_resource_delete(resource->handle);
+	DBG("resource %p delete\n", resource);
+	resource->handle = DISPMANX_NO_HANDLE;
+}
+
+/* Only for resources no update in flight refers to any more. */
+static void
+rpi_resource_release(struct rpi_compositor *compositor,
+		     struct rpi_resource *resource)
+{
+	struct rpi_pooled_resource *pooled;
+
 	if (resource->handle == DISPMANX_NO_HANDLE)
 		return;
 
-	vc_dispmanx_resource_delete(resource->handle);
-	DBG("resource %p release\n", resource);
+	pooled = malloc(sizeof *pooled);
+	if (!pooled) {
+		rpi_resource_delete(resource);
+		return;
+	}
+
+	pooled->resource = *resource;
+	wl_list_insert(&compositor->resource_pool, &pooled->link);
+	DBG("resource %p release to pool\n", resource);
 	resource->handle = DISPMANX_NO_HANDLE;
+
+	if (++compositor->resource_pool_count > RPI_RESOURCE_POOL_SIZE) {
+		pooled = container_of(compositor->resource_pool.prev,
+				      struct rpi_pooled_resource, link);
+		wl_list_remove(&pooled->link);
+		rpi_resource_delete(&pooled->resource);
+		free(pooled);
+		compositor->resource_pool_count--;
+	}
 }
 
+static void
+rpi_resource_pool_release(struct rpi_compositor *compositor)
+{
+	struct rpi_pooled_resource *pooled, *next;
+
+	wl_list_for_each_safe(pooled, next, &compositor->resource_pool, link) {
+		rpi_resource_delete(&pooled->resource);
+		free(pooled);
+	}
+	wl_list_init(&compositor->resource_pool);
+	compositor->resource_pool_count = 0;
+}
+
+/* Menus and tooltips come and go with the same sizes, take theirs
+ * from the pool instead of the VideoCore allocator. */
 static int
-rpi_resource_realloc(struct rpi_resource *resource, VC_IMAGE_TYPE_T ifmt,
+rpi_resource_pool_take(struct rpi_compositor *compositor,
+		       struct rpi_resource *resource, VC_IMAGE_TYPE_T ifmt,
+		       int width, int height, int stride, int buffer_height)
+{
+	struct rpi_pooled_resource *pooled;
+
+	wl_list_for_each(pooled, &compositor->resource_pool, link) {
+		if (pooled->resource.width != width ||
+		    pooled->resource.height != height ||
+		    pooled->resource.stride != stride ||
+		    pooled->resource.buffer_height != buffer_height ||
+		    pooled->resource.ifmt != ifmt)
+			continue;
+
+		*resource = pooled->resource;
+		wl_list_remove(&pooled->link);
+		free(pooled);
+		compositor->resource_pool_count--;
+		DBG("resource %p taken from pool\n", resource);
+		return 0;
+	}
+
+	return -1;
+}
+
+static int
+rpi_resource_realloc(struct rpi_compositor *compositor,
+		     struct rpi_resource *resource, VC_IMAGE_TYPE_T ifmt,
 		     int width, int height, int stride, int buffer_height)
 {
 	uint32_t dummy;
@@ -230,7 +298,11 @@ rpi_resource_realloc(struct rpi_resource *resource, VC_IMAGE_TYPE_T ifmt,
 	    resource->ifmt == ifmt)
 		return 0;
 
-	rpi_resource_release(resource);
+	rpi_resource_release(compositor, resource);
+
+	if (rpi_resource_pool_take(compositor, resource, ifmt, width, height,
+				   stride, buffer_height) == 0)
+		return 0;
 
 	/* NOTE: if stride is not a multiple of 16 pixels in bytes,
 	 * the vc_image_* functions may break. Dispmanx elements
@@ -269,7 +341,8 @@ shm_buffer_get_vc_format(struct wl_buffer *buffer)
 }
 
 static int
-rpi_resource_update(struct rpi_resource *resource, struct wl_buffer *buffer,
+rpi_resource_update(struct rpi_compositor *compositor,
+		    struct rpi_resource *resource, struct wl_buffer *buffer,
 		    pixman_region32_t *region)
 {
 	pixman_region32_t write_region;
@@ -294,7 +367,7 @@ rpi_resource_update(struct rpi_resource *resource, struct wl_buffer *buffer,
 	stride = wl_shm_buffer_get_stride(buffer);
 	pixels = wl_shm_buffer_get_data(buffer);
 
-	if (rpi_resource_realloc(resource, ifmt, width, height,
+	if (rpi_resource_realloc(compositor, resource, ifmt, width, height,
 				 stride, height) < 0)
 		return -1;
 
@@ -419,8 +492,10 @@ rpi_element_destroy(struct rpi_element *element)
 		weston_log("ERROR rpi: destroying on-screen element\n");
 
 	pixman_region32_fini(&element->prev_damage);
-	rpi_resource_release(&element->resources[0]);
-	rpi_resource_release(&element->resources[1]);
+	rpi_resource_release(element->output->compositor,
+			     &element->resources[0]);
+	rpi_resource_release(element->output->compositor,
+			     &element->resources[1]);
 	DBG("element %p destroyed (%u)\n", element, element->handle);
 
 	free(element);
@@ -445,6 +520,7 @@ static int
 rpi_element_damage(struct rpi_element *element, struct wl_buffer *buffer,
 		   pixman_region32_t *damage)
 {
+	struct rpi_compositor *compositor = element->output->compositor;
 	pixman_region32_t upload;
 	int ret;
 
@@ -454,11 +530,13 @@ rpi_element_damage(struct rpi_element *element, struct wl_buffer *buffer,
 	DBG("element %p update resource %p\n", element, element->back);
 
 	if (element->single_buffer) {
-		ret = rpi_resource_update(element->back, buffer, damage);
+		ret = rpi_resource_update(compositor, element->back,
+					  buffer, damage);
 	} else {
 		pixman_region32_init(&upload);
 		pixman_region32_union(&upload, &element->prev_damage, damage);
-		ret = rpi_resource_update(element->back, buffer, &upload);
+		ret = rpi_resource_update(compositor, element->back,
+					  buffer, &upload);
 		pixman_region32_fini(&upload);
 	}
 
@@ -912,14 +990,23 @@ rpi_output_repaint(struct weston_output *base, pixman_region32_t *damage)
 
 	/* XXX: if there is anything to composite in GL,
 	 * framerate seems to suffer */
-	/* XXX: optimise the renderer for the case of nothing to render */
 	/* XXX: if nothing to render, remove the element...
 	 * but how, is destroying the EGLSurface a bad performance hit?
 	 */
-	compositor->base.renderer->repaint_output(&output->base, damage);
 
-	pixman_region32_subtract(&primary_plane->damage,
-				 &primary_plane->damage, damage);
+	/* With every change on dispmanx elements, the GL buffer shown
+	 * is still right: skip drawing and swapping it, the update
+	 * submitted above completes the frame.  Someone waiting for the
+	 * frame, like the screenshooter, needs it drawn though. */
+	if (!pixman_region32_not_empty(damage) &&
+	    wl_list_empty(&output->base.frame_signal.listener_list)) {
+		DBG("%s: nothing for GL\n", __func__);
+	} else {
+		compositor->base.renderer->repaint_output(&output->base,
+							  damage);
+		pixman_region32_subtract(&primary_plane->damage,
+					 &primary_plane->damage, damage);
+	}
 
 	/* Move the list of elements into the old_element_list. */
 	wl_list_insert_list(&output->old_element_list, &output->element_list);
@@ -1105,247 +1192,21 @@ out_free:
 	return -1;
 }
 
-static void
-rpi_led_update(struct weston_seat *seat_base, enum weston_led leds)
-{
-	struct rpi_seat *seat = to_rpi_seat(seat_base);
-	struct evdev_device *device;
-
-	wl_list_for_each(device, &seat->devices_list, link)
-		evdev_led_update(device, leds);
-}
-
 static const char default_seat[] = "seat0";
 
-static void
-device_added(struct udev_device *udev_device, struct rpi_seat *master)
-{
-	struct evdev_device *device;
-	const char *devnode;
-	const char *device_seat;
-	int fd;
-
-	device_seat = udev_device_get_property_value(udev_device, "ID_SEAT");
-	if (!device_seat)
-		device_seat = default_seat;
-
-	if (strcmp(device_seat, master->seat_id))
-		return;
-
-	devnode = udev_device_get_devnode(udev_device);
-
-	/* Use non-blocking mode so that we can loop on read on
-	 * evdev_device_data() until all events on the fd are
-	 * read.  mtdev_get() also expects this. */
-	fd = open(devnode, O_RDWR | O_NONBLOCK | O_CLOEXEC);
-	if (fd < 0) {
-		weston_log("opening input device '%s' failed.\n", devnode);
-		return;
-	}
-
-	device = evdev_device_create(&master->base, devnode, fd);
-	if (!device) {
-		close(fd);
-		weston_log("not using input device '%s'.\n", devnode);
-		return;
-	}
-
-	wl_list_insert(master->devices_list.prev, &device->link);
-}
-
-static void
-evdev_add_devices(struct udev *udev, struct weston_seat *seat_base)
-{
-	struct rpi_seat *seat = to_rpi_seat(seat_base);
-	struct udev_enumerate *e;
-	struct udev_list_entry *entry;
-	struct udev_device *device;
-	const char *path, *sysname;
-
-	e = udev_enumerate_new(udev);
-	udev_enumerate_add_match_subsystem(e, "input");
-	udev_enumerate_scan_devices(e);
-	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(e)) {
-		path = udev_list_entry_get_name(entry);
-		device = udev_device_new_from_syspath(udev, path);
-
-		sysname = udev_device_get_sysname(device);
-		if (strncmp("event", sysname, 5) != 0) {
-			udev_device_unref(device);
-			continue;
-		}
-
-		device_added(device, seat);
-
-		udev_device_unref(device);
-	}
-	udev_enumerate_unref(e);
-
-	evdev_notify_keyboard_focus(&seat->base, &seat->devices_list);
-
-	if (wl_list_empty(&seat->devices_list)) {
-		weston_log(
-			"warning: no input devices on entering Weston. "
-			"Possible causes:\n"
-			"\t- no permissions to read /dev/input/event*\n"
-			"\t- seats misconfigured "
-			"(Weston backend option 'seat', "
-			"udev device property ID_SEAT)\n");
-	}
-}
-
-static int
-evdev_udev_handler(int fd, uint32_t mask, void *data)
-{
-	struct rpi_seat *seat = data;
-	struct udev_device *udev_device;
-	struct evdev_device *device, *next;
-	const char *action;
-	const char *devnode;
-
-	udev_device = udev_monitor_receive_device(seat->udev_monitor);
-	if (!udev_device)
-		return 1;
-
-	action = udev_device_get_action(udev_device);
-	if (!action)
-		goto out;
-
-	if (strncmp("event", udev_device_get_sysname(udev_device), 5) != 0)
-		goto out;
-
-	if (!strcmp(action, "add")) {
-		device_added(udev_device, seat);
-	}
-	else if (!strcmp(action, "remove")) {
-		devnode = udev_device_get_devnode(udev_device);
-		wl_list_for_each_safe(device, next, &seat->devices_list, link)
-			if (!strcmp(device->devnode, devnode)) {
-				weston_log("input device %s, %s removed\n",
-					   device->devname, device->devnode);
-				evdev_device_destroy(device);
-				break;
-			}
-	}
-
-out:
-	udev_device_unref(udev_device);
-
-	return 0;
-}
-
-static int
-evdev_enable_udev_monitor(struct udev *udev, struct weston_seat *seat_base)
-{
-	struct rpi_seat *master = to_rpi_seat(seat_base);
-	struct wl_event_loop *loop;
-	struct weston_compositor *c = master->base.compositor;
-	int fd;
-
-	master->udev_monitor = udev_monitor_new_from_netlink(udev, "udev");
-	if (!master->udev_monitor) {
-		weston_log("udev: failed to create the udev monitor\n");
-		return 0;
-	}
-
-	udev_monitor_filter_add_match_subsystem_devtype(master->udev_monitor,
-			"input", NULL);
-
-	if (udev_monitor_enable_receiving(master->udev_monitor)) {
-		weston_log("udev: failed to bind the udev monitor\n");
-		udev_monitor_unref(master->udev_monitor);
-		return 0;
-	}
-
-	loop = wl_display_get_event_loop(c->wl_display);
-	fd = udev_monitor_get_fd(master->udev_monitor);
-	master->udev_monitor_source =
-		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
-				     evdev_udev_handler, master);
-	if (!master->udev_monitor_source) {
-		udev_monitor_unref(master->udev_monitor);
-		return 0;
-	}
-
-	return 1;
-}
-
-static void
-evdev_disable_udev_monitor(struct weston_seat *seat_base)
-{
-	struct rpi_seat *seat = to_rpi_seat(seat_base);
-
-	if (!seat->udev_monitor)
-		return;
-
-	udev_monitor_unref(seat->udev_monitor);
-	seat->udev_monitor = NULL;
-	wl_event_source_remove(seat->udev_monitor_source);
-	seat->udev_monitor_source = NULL;
-}
-
-static void
-evdev_input_create(struct weston_compositor *c, struct udev *udev,
-		   const char *seat_id)
-{
-	struct rpi_seat *seat;
-
-	seat = malloc(sizeof *seat);
-	if (seat == NULL)
-		return;
-
-	memset(seat, 0, sizeof *seat);
-	weston_seat_init(&seat->base, c);
-	seat->base.led_update = rpi_led_update;
-
-	wl_list_init(&seat->devices_list);
-	seat->seat_id = strdup(seat_id);
-	if (!evdev_enable_udev_monitor(udev, &seat->base)) {
-		free(seat->seat_id);
-		free(seat);
-		return;
-	}
-
-	evdev_add_devices(udev, &seat->base);
-}
-
-static void
-evdev_remove_devices(struct weston_seat *seat_base)
-{
-	struct rpi_seat *seat = to_rpi_seat(seat_base);
-	struct evdev_device *device, *next;
-
-	wl_list_for_each_safe(device, next, &seat->devices_list, link)
-		evdev_device_destroy(device);
-
-	if (seat->base.seat.keyboard)
-		notify_keyboard_focus_out(&seat->base);
-}
-
-static void
-evdev_input_destroy(struct weston_seat *seat_base)
-{
-	struct rpi_seat *seat = to_rpi_seat(seat_base);
-
-	evdev_remove_devices(seat_base);
-	evdev_disable_udev_monitor(&seat->base);
-
-	weston_seat_release(seat_base);
-	free(seat->seat_id);
-	free(seat);
-}
-
 static void
 rpi_compositor_destroy(struct weston_compositor *base)
 {
 	struct rpi_compositor *compositor = to_rpi_compositor(base);
-	struct weston_seat *seat, *next;
+	struct udev_seat *seat, *next;
 
-	wl_list_for_each_safe(seat, next, &compositor->base.seat_list, link)
-		evdev_input_destroy(seat);
+	wl_list_for_each_safe(seat, next, &compositor->base.seat_list, base.link)
+		udev_seat_destroy(seat);
+	evdev_config_release();
 
 	/* destroys outputs, too */
 	weston_compositor_shutdown(&compositor->base);
+	rpi_resource_pool_release(compositor);
 
 	compositor->base.renderer->destroy(&compositor->base);
 	tty_destroy(compositor->tty);
@@ -1358,7 +1219,7 @@ static void
 vt_func(struct weston_compositor *base, int event)
 {
 	struct rpi_compositor *compositor = to_rpi_compositor(base);
-	struct weston_seat *seat;
+	struct udev_seat *seat;
 	struct weston_output *output;
 
 	switch (event) {
@@ -1367,17 +1228,13 @@ vt_func(struct weston_compositor *base, int event)
 		compositor->base.focus = 1;
 		compositor->base.state = compositor->prev_state;
 		weston_compositor_damage_all(&compositor->base);
-		wl_list_for_each(seat, &compositor->base.seat_list, link) {
-			evdev_add_devices(compositor->udev, seat);
-			evdev_enable_udev_monitor(compositor->udev, seat);
-		}
+		wl_list_for_each(seat, &compositor->base.seat_list, base.link)
+			udev_seat_enable(seat, compositor->udev);
 		break;
 	case TTY_LEAVE_VT:
 		weston_log("leaving VT\n");
-		wl_list_for_each(seat, &compositor->base.seat_list, link) {
-			evdev_disable_udev_monitor(seat);
-			evdev_remove_devices(seat);
-		}
+		wl_list_for_each(seat, &compositor->base.seat_list, base.link)
+			udev_seat_disable(seat);
 
 		compositor->base.focus = 0;
 		compositor->prev_state = compositor->base.state;
@@ -1469,6 +1326,7 @@ rpi_compositor_create(struct wl_display *display, int *argc, char *argv[],
 	compositor->prev_state = WESTON_COMPOSITOR_ACTIVE;
 	compositor->max_planes = int_max(param->max_planes, 0);
 	compositor->single_buffer = param->single_buffer;
+	wl_list_init(&compositor->resource_pool);
 
 	weston_log("Maximum number of additional Dispmanx planes: %d\n",
 		   compositor->max_planes);
@@ -1496,7 +1354,7 @@ rpi_compositor_create(struct wl_display *display, int *argc, char *argv[],
 	if (rpi_output_create(compositor) < 0)
 		goto out_gl;
 
-	evdev_input_create(&compositor->base, compositor->udev, seat);
+	udev_seat_create(&compositor->base, compositor->udev, seat);
 
 	return &compositor->base;
 
@@ -1554,5 +1412,7 @@ backend_init(struct wl_display *display, int *argc, char *argv[],
 
 	parse_options(rpi_options, ARRAY_LENGTH(rpi_options), argc, argv);
 
+	evdev_config_parse(config_file);
+
 	return rpi_compositor_create(display, argc, argv, config_file, &param);
 }
@@ -38,7 +38,9 @@
 
 #include "compositor.h"
 #include "gl-renderer.h"
+#include "pixman-renderer.h"
 #include "../shared/image-loader.h"
+#include "../shared/os-compatibility.h"
 
 struct wayland_compositor {
 	struct weston_compositor	 base;
@@ -48,6 +50,7 @@ struct wayland_compositor {
 		struct wl_registry *registry;
 		struct wl_compositor *compositor;
 		struct wl_shell *shell;
+		struct wl_shm *shm;
 		struct wl_output *output;
 
 		struct {
@@ -63,6 +66,8 @@ struct wayland_compositor {
 	} border;
 
 	struct wl_list input_list;
+
+	int use_pixman;
 };
 
 struct wayland_output {
@@ -73,6 +78,25 @@ struct wayland_output {
 		struct wl_egl_window	*egl_window;
 	} parent;
 	struct weston_mode	mode;
+
+	/* with use-pixman, struct wayland_shm_buffer */
+	struct wl_list shm_buffer_list;
+};
+
+/*
+ * Each buffer keeps the damage it hasn't been drawn with yet, so only
+ * that is copied into it, and the parent is only told about what
+ * changed since the last frame.
+ */
+struct wayland_shm_buffer {
+	struct wayland_output *output;
+	struct wl_list link;
+	struct wl_buffer *buffer;
+	void *data;
+	size_t size;
+	pixman_image_t *image;
+	pixman_region32_t damage;
+	int busy;
 };
 
 struct wayland_input {
@@ -145,13 +169,149 @@ wayland_output_repaint(struct weston_output *output_base,
 }
 
 static void
-wayland_output_destroy(struct weston_output *output_base)
+shm_buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct wayland_shm_buffer *sb = data;
+
+	sb->busy = 0;
+}
+
+static const struct wl_buffer_listener shm_buffer_listener = {
+	shm_buffer_release
+};
+
+static void
+wayland_shm_buffer_destroy(struct wayland_shm_buffer *sb)
+{
+	pixman_image_unref(sb->image);
+	wl_buffer_destroy(sb->buffer);
+	munmap(sb->data, sb->size);
+	pixman_region32_fini(&sb->damage);
+	wl_list_remove(&sb->link);
+	free(sb);
+}
+
+static struct wayland_shm_buffer *
+wayland_output_get_shm_buffer(struct wayland_output *output)
+{
+	struct wayland_compositor *c =
+		(struct wayland_compositor *) output->base.compositor;
+	struct wayland_shm_buffer *sb;
+	struct wl_shm_pool *pool;
+	int width, height, stride, fd;
+
+	wl_list_for_each(sb, &output->shm_buffer_list, link)
+		if (!sb->busy)
+			return sb;
+
+	sb = malloc(sizeof *sb);
+	if (sb == NULL)
+		return NULL;
+
+	width = output->mode.width;
+	height = output->mode.height;
+	stride = width * 4;
+	sb->output = output;
+	sb->size = stride * height;
+	sb->busy = 0;
+
+	fd = os_create_anonymous_file(sb->size);
+	if (fd < 0) {
+		weston_log("creating a buffer file for %zu B failed: %m\n",
+			   sb->size);
+		free(sb);
+		return NULL;
+	}
+
+	sb->data = mmap(NULL, sb->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (sb->data == MAP_FAILED) {
+		weston_log("mmap failed: %m\n");
+		close(fd);
+		free(sb);
+		return NULL;
+	}
+
+	pool = wl_shm_create_pool(c->parent.shm, fd, sb->size);
+	sb->buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
+					       stride,
+					       WL_SHM_FORMAT_XRGB8888);
+	wl_buffer_add_listener(sb->buffer, &shm_buffer_listener, sb);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	sb->image = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height,
+					     sb->data, stride);
+
+	/* nothing has been drawn into it yet */
+	pixman_region32_init(&sb->damage);
+	pixman_region32_copy(&sb->damage, &output->base.region);
+
+	wl_list_insert(&output->shm_buffer_list, &sb->link);
+
+	return sb;
+}
+
+static void
+wayland_output_repaint_pixman(struct weston_output *output_base,
+			      pixman_region32_t *damage)
 {
 	struct wayland_output *output = (struct wayland_output *) output_base;
+	struct weston_compositor *ec = output->base.compositor;
+	struct wayland_shm_buffer *sb;
+	struct wl_callback *callback;
+	pixman_box32_t *rects;
+	int i, nrects;
 
-	gl_renderer_output_destroy(output_base);
+	callback = wl_surface_frame(output->parent.surface);
+	wl_callback_add_listener(callback, &frame_listener, output);
 
-	wl_egl_window_destroy(output->parent.egl_window);
+	wl_list_for_each(sb, &output->shm_buffer_list, link)
+		pixman_region32_union(&sb->damage, &sb->damage, damage);
+
+	sb = wayland_output_get_shm_buffer(output);
+	if (sb == NULL) {
+		/* try again next frame */
+		wl_surface_commit(output->parent.surface);
+		return;
+	}
+
+	pixman_renderer_output_set_buffer(output_base, sb->image);
+	ec->renderer->repaint_output(output_base, &sb->damage);
+	pixman_region32_fini(&sb->damage);
+	pixman_region32_init(&sb->damage);
+
+	pixman_region32_subtract(&ec->primary_plane.damage,
+				 &ec->primary_plane.damage, damage);
+
+	wl_surface_attach(output->parent.surface, sb->buffer, 0, 0);
+	rects = pixman_region32_rectangles(damage, &nrects);
+	for (i = 0; i < nrects; i++)
+		wl_surface_damage(output->parent.surface,
+				  rects[i].x1 - output->base.x,
+				  rects[i].y1 - output->base.y,
+				  rects[i].x2 - rects[i].x1,
+				  rects[i].y2 - rects[i].y1);
+	wl_surface_commit(output->parent.surface);
+	sb->busy = 1;
+}
+
+static void
+wayland_output_destroy(struct weston_output *output_base)
+{
+	struct wayland_output *output = (struct wayland_output *) output_base;
+	struct wayland_compositor *c =
+		(struct wayland_compositor *) output->base.compositor;
+	struct wayland_shm_buffer *sb, *next;
+
+	if (c->use_pixman) {
+		pixman_renderer_output_destroy(output_base);
+		wl_list_for_each_safe(sb, next, &output->shm_buffer_list, link)
+			wayland_shm_buffer_destroy(sb);
+	} else {
+		gl_renderer_output_destroy(output_base);
+		wl_egl_window_destroy(output->parent.egl_window);
+	}
 	free(output);
 
 	return;
@@ -191,6 +351,13 @@ wayland_compositor_create_output(struct wayland_compositor *c,
 		wl_compositor_create_surface(c->parent.compositor);
 	wl_surface_set_user_data(output->parent.surface, output);
 
+	wl_list_init(&output->shm_buffer_list);
+	if (c->use_pixman) {
+		if (pixman_renderer_output_create(&output->base) < 0)
+			goto cleanup_output;
+		goto create_shell_surface;
+	}
+
 	output->parent.egl_window =
 		wl_egl_window_create(output->parent.surface,
 				     width + c->border.left + c->border.right,
@@ -204,6 +371,7 @@ wayland_compositor_create_output(struct wayland_compositor *c,
 			output->parent.egl_window) < 0)
 		goto cleanup_window;
 
+create_shell_surface:
 	output->parent.shell_surface =
 		wl_shell_get_shell_surface(c->parent.shell,
 					   output->parent.surface);
@@ -212,7 +380,10 @@ wayland_compositor_create_output(struct wayland_compositor *c,
 	wl_shell_surface_set_toplevel(output->parent.shell_surface);
 
 	output->base.origin = output->base.current;
-	output->base.repaint = wayland_output_repaint;
+	if (c->use_pixman)
+		output->base.repaint = wayland_output_repaint_pixman;
+	else
+		output->base.repaint = wayland_output_repaint;
 	output->base.destroy = wayland_output_destroy;
 	output->base.assign_planes = NULL;
 	output->base.set_backlight = NULL;
@@ -578,6 +749,10 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 		c->parent.shell =
 			wl_registry_bind(registry, name,
 					 &wl_shell_interface, 1);
+	} else if (strcmp(interface, "wl_shm") == 0) {
+		c->parent.shm =
+			wl_registry_bind(registry, name,
+					 &wl_shm_interface, 1);
 	} else if (strcmp(interface, "wl_seat") == 0) {
 		display_add_seat(c, name);
 	}
@@ -622,7 +797,7 @@ wayland_destroy(struct weston_compositor *ec)
 }
 
 static struct weston_compositor *
-wayland_compositor_create(struct wl_display *display,
+wayland_compositor_create(struct wl_display *display, int use_pixman,
 			  int width, int height, const char *display_name,
 			  int *argc, char *argv[], const char *config_file)
 {
@@ -653,26 +828,39 @@ wayland_compositor_create(struct wl_display *display,
 	wl_display_dispatch(c->parent.wl_display);
 
 	c->base.wl_display = display;
-	if (gl_renderer_create(&c->base, c->parent.wl_display,
-			gl_renderer_alpha_attribs,
-			NULL) < 0)
-		goto err_display;
+	c->use_pixman = use_pixman;
+	if (c->use_pixman) {
+		/* no border, it is drawn by the gl renderer */
+		if (c->parent.shm == NULL) {
+			weston_log("parent compositor has no wl_shm\n");
+			goto err_display;
+		}
+		if (pixman_renderer_init(&c->base) < 0)
+			goto err_display;
+	} else {
+		if (gl_renderer_create(&c->base, c->parent.wl_display,
+				gl_renderer_alpha_attribs,
+				NULL) < 0)
+			goto err_display;
+
+		c->border.top = 30;
+		c->border.bottom = 24;
+		c->border.left = 25;
+		c->border.right = 26;
+	}
+	weston_log("Using %s renderer\n", use_pixman ? "pixman" : "gl");
 
 	c->base.destroy = wayland_destroy;
 	c->base.restore = wayland_restore;
 
-	c->border.top = 30;
-	c->border.bottom = 24;
-	c->border.left = 25;
-	c->border.right = 26;
-
 	/* requires border fields */
 	if (wayland_compositor_create_output(c, width, height) < 0)
 		goto err_gl;
 
 	/* requires gl_renderer_output_state_create called
 	 * by wayland_compositor_create_output */
-	create_border(c);
+	if (!c->use_pixman)
+		create_border(c);
 
 	loop = wl_display_get_event_loop(c->base.wl_display);
 
@@ -704,16 +892,19 @@ backend_init(struct wl_display *display, int *argc, char *argv[],
 {
 	int width = 1024, height = 640;
 	char *display_name = NULL;
+	int use_pixman = 0;
 
 	const struct weston_option wayland_options[] = {
 		{ WESTON_OPTION_INTEGER, "width", 0, &width },
 		{ WESTON_OPTION_INTEGER, "height", 0, &height },
 		{ WESTON_OPTION_STRING, "display", 0, &display_name },
+		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &use_pixman },
 	};
 
 	parse_options(wayland_options,
 		      ARRAY_LENGTH(wayland_options), argc, argv);
 
-	return wayland_compositor_create(display, width, height, display_name,
+	return wayland_compositor_create(display, use_pixman,
+					 width, height, display_name,
 					 argc, argv, config_file);
 }
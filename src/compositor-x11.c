@@ -83,6 +83,7 @@ struct x11_compositor {
 	struct xkb_keymap	*xkb_keymap;
 	unsigned int		 has_xkb;
 	uint8_t			 xkb_event_base;
+	uint8_t			 shm_event_base;
 	int			 use_pixman;
 
 	int			 has_net_wm_state_fullscreen;
@@ -125,6 +126,12 @@ struct x11_output {
 	int			shm_id;
 	void		       *buf;
 	uint8_t			depth;
+
+	/* The last put of a frame asks for an MIT-SHM completion
+	 * event.  The frame finishes once that has arrived and a
+	 * refresh period has passed, whichever is later. */
+	int			shm_pending;
+	int			frame_due;
 };
 
 static struct xkb_keymap *
@@ -340,6 +347,19 @@ x11_output_repaint_gl(struct weston_output *output_base,
 	wl_event_source_timer_update(output->finish_frame_timer, 10);
 }
 
+static void
+x11_output_put_shm(struct x11_compositor *c, struct x11_output *output,
+		   pixman_box32_t *b, int send_event)
+{
+	xcb_shm_put_image(c->conn, output->window, output->gc,
+			  pixman_image_get_width(output->hw_surface),
+			  pixman_image_get_height(output->hw_surface),
+			  b->x1, b->y1, b->x2 - b->x1, b->y2 - b->y1,
+			  b->x1, b->y1, output->depth,
+			  XCB_IMAGE_FORMAT_Z_PIXMAP, send_event,
+			  output->segment, 0);
+}
+
 static void
 x11_output_repaint_shm(struct weston_output *output_base,
 		       pixman_region32_t *damage)
@@ -347,45 +367,97 @@ x11_output_repaint_shm(struct weston_output *output_base,
 	struct x11_output *output = (struct x11_output *)output_base;
 	struct weston_compositor *ec = output->base.compositor;
 	struct x11_compositor *c = (struct x11_compositor *)ec;
-	xcb_void_cookie_t cookie;
-	xcb_generic_error_t *err;
+	pixman_region32_t region;
+	pixman_box32_t *rects, rect, b, last;
+	int i, nrects, width, height, have_last = 0;
 
 	pixman_renderer_output_set_buffer(output_base, output->hw_surface);
 	ec->renderer->repaint_output(output_base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
-	cookie = xcb_shm_put_image_checked(c->conn, output->window, output->gc,
-					pixman_image_get_width(output->hw_surface),
-					pixman_image_get_height(output->hw_surface),
-					0, 0,
-					pixman_image_get_width(output->hw_surface),
-					pixman_image_get_height(output->hw_surface),
-					0, 0, output->depth, XCB_IMAGE_FORMAT_Z_PIXMAP,
-					0, output->segment, 0);
-	err = xcb_request_check(c->conn, cookie);
-	if (err != NULL) {
-		weston_log("Failed to put shm image, err: %d\n", err->error_code);
-		free(err);
+
+	/* Only the damage goes to the server, and errors come back
+	 * as events, so there is no round trip. */
+	width = pixman_image_get_width(output->hw_surface);
+	height = pixman_image_get_height(output->hw_surface);
+	pixman_region32_init(&region);
+	pixman_region32_intersect(&region, damage, &output->base.region);
+	rects = pixman_region32_rectangles(&region, &nrects);
+	for (i = 0; i < nrects; i++) {
+		rect.x1 = rects[i].x1 - output->base.x;
+		rect.y1 = rects[i].y1 - output->base.y;
+		rect.x2 = rects[i].x2 - output->base.x;
+		rect.y2 = rects[i].y2 - output->base.y;
+		b = weston_transformed_rect(output->base.width,
+					    output->base.height,
+					    output->base.transform, rect);
+		if (b.x1 < 0)
+			b.x1 = 0;
+		if (b.y1 < 0)
+			b.y1 = 0;
+		if (b.x2 > width)
+			b.x2 = width;
+		if (b.y2 > height)
+			b.y2 = height;
+		if (b.x1 >= b.x2 || b.y1 >= b.y2)
+			continue;
+
+		if (have_last)
+			x11_output_put_shm(c, output, &last, 0);
+		last = b;
+		have_last = 1;
 	}
+	pixman_region32_fini(&region);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 10);
+	if (have_last) {
+		x11_output_put_shm(c, output, &last, 1);
+		output->shm_pending = 1;
+		xcb_flush(c->conn);
+	}
+
+	output->frame_due = 0;
+	wl_event_source_timer_update(output->finish_frame_timer,
+				     1000000 / output->mode.refresh);
 }
 
-static int
-finish_frame_handler(void *data)
+static void
+x11_output_finish_frame(struct x11_output *output)
 {
-	struct x11_output *output = data;
 	uint32_t msec;
 	struct timeval tv;
-	
+
 	gettimeofday(&tv, NULL);
 	msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
 	weston_output_finish_frame(&output->base, msec);
+}
+
+static int
+finish_frame_handler(void *data)
+{
+	struct x11_output *output = data;
+
+	/* the server is still reading from the buffer */
+	if (output->shm_pending) {
+		output->frame_due = 1;
+		return 1;
+	}
+
+	x11_output_finish_frame(output);
 
 	return 1;
 }
 
+static void
+x11_output_shm_completion(struct x11_output *output)
+{
+	output->shm_pending = 0;
+	if (output->frame_due) {
+		output->frame_due = 0;
+		x11_output_finish_frame(output);
+	}
+}
+
 static void
 x11_output_deinit_shm(struct x11_compositor *c, struct x11_output *output)
 {
@@ -594,6 +666,7 @@ x11_output_init_shm(struct x11_compositor *c, struct x11_output *output,
 		errno = ENOENT;
 		return -1;
 	}
+	c->shm_event_base = ext->first_event;
 
 	iter = xcb_setup_roots_iterator(xcb_get_setup(c->conn));
 	visual_type = find_visual_by_id(iter.data, iter.data->root_visual);
@@ -1074,6 +1147,9 @@ x11_compositor_handle_event(int fd, uint32_t mask, void *data)
 	xcb_keymap_notify_event_t *keymap_notify;
 	xcb_focus_in_event_t *focus_in;
 	xcb_expose_event_t *expose;
+	xcb_shm_completion_event_t *completion;
+	xcb_generic_error_t *error;
+	pixman_box32_t box;
 	xcb_atom_t atom;
 	uint32_t *k;
 	uint32_t i, set;
@@ -1183,9 +1259,31 @@ x11_compositor_handle_event(int fd, uint32_t mask, void *data)
 		case XCB_EXPOSE:
 			expose = (xcb_expose_event_t *) event;
 			output = x11_compositor_find_output(c, expose->window);
+			if (c->use_pixman) {
+				/* the image still has it, no need to redraw */
+				box.x1 = expose->x;
+				box.y1 = expose->y;
+				box.x2 = expose->x + expose->width;
+				box.y2 = expose->y + expose->height;
+				x11_output_put_shm(c, output, &box, 0);
+				xcb_flush(c->conn);
+				break;
+			}
 			weston_output_schedule_repaint(&output->base);
 			break;
 
+		case 0:
+			error = (xcb_generic_error_t *) event;
+			weston_log("x11 error %d, request %d.%d\n",
+				   error->error_code, error->major_code,
+				   error->minor_code);
+			/* don't wait for completions that won't come */
+			wl_list_for_each(output, &c->base.output_list,
+					 base.link)
+				if (output->shm_pending)
+					x11_output_shm_completion(output);
+			break;
+
 		case XCB_ENTER_NOTIFY:
 			x11_compositor_deliver_enter_event(c, event);
 			break;
@@ -1226,6 +1324,15 @@ x11_compositor_handle_event(int fd, uint32_t mask, void *data)
 			break;
 		}
 
+		if (c->use_pixman &&
+		    response_type == c->shm_event_base + XCB_SHM_COMPLETION) {
+			completion = (xcb_shm_completion_event_t *) event;
+			output = x11_compositor_find_output(c,
+							    completion->drawable);
+			if (output)
+				x11_output_shm_completion(output);
+		}
+
 #ifdef HAVE_XCB_XKB
 		if (c->has_xkb &&
 		    response_type == c->xkb_event_base) {
@@ -26,6 +26,7 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -40,12 +41,14 @@
 #include <sys/socket.h>
 #include <sys/utsname.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 #include <math.h>
 #include <linux/input.h>
 #include <dlfcn.h>
 #include <signal.h>
 #include <setjmp.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -56,10 +59,15 @@
 
 #include <wayland-server.h>
 #include "compositor.h"
+#include "trace.h"
+#include "presentation-server-protocol.h"
 #include "../shared/os-compatibility.h"
 #include "git-version.h"
 #include "version.h"
 
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#define min(a, b) (((a) > (b)) ? (b) : (a))
+
 static struct wl_list child_process_list;
 static struct weston_compositor *segv_compositor;
 
@@ -93,19 +101,13 @@ sigchld_handler(int signal_number, void *data)
 static void
 weston_output_transform_init(struct weston_output *output, uint32_t transform);
 
-WL_EXPORT int
-weston_output_switch_mode(struct weston_output *output, struct weston_mode *mode)
+/* Updates what derives from the output's mode and transform, after a
+ * change to either. */
+static void
+weston_output_geometry_changed(struct weston_output *output)
 {
 	struct weston_seat *seat;
 	pixman_region32_t old_output_region;
-	int ret;
-
-	if (!output->switch_mode)
-		return -1;
-
-	ret = output->switch_mode(output, mode);
-	if (ret < 0)
-		return ret;
 
 	pixman_region32_init(&old_output_region);
 	pixman_region32_copy(&old_output_region, &output->region);
@@ -147,10 +149,51 @@ weston_output_switch_mode(struct weston_output *output, struct weston_mode *mode
 	}
 
 	pixman_region32_fini(&old_output_region);
+}
+
+WL_EXPORT int
+weston_output_switch_mode(struct weston_output *output, struct weston_mode *mode)
+{
+	int ret;
+
+	if (!output->switch_mode)
+		return -1;
+
+	ret = output->switch_mode(output, mode);
+	if (ret < 0)
+		return ret;
+
+	weston_output_geometry_changed(output);
 
 	return ret;
 }
 
+/* Rotates or flips the output at run time; the renderer follows the
+ * output matrix, so backends need not know. */
+WL_EXPORT void
+weston_output_set_transform(struct weston_output *output,
+			    uint32_t transform)
+{
+	struct wl_resource *resource;
+
+	if (output->transform == transform)
+		return;
+
+	output->transform = transform;
+	weston_output_geometry_changed(output);
+	weston_output_damage(output);
+
+	wl_list_for_each(resource, &output->resource_list, link)
+		wl_output_send_geometry(resource,
+					output->x,
+					output->y,
+					output->mm_width,
+					output->mm_height,
+					output->subpixel,
+					output->make, output->model,
+					output->transform);
+}
+
 WL_EXPORT void
 weston_watch_process(struct weston_process *process)
 {
@@ -187,6 +230,84 @@ child_client_exec(int sockfd, const char *path)
 			path);
 }
 
+/*
+ * A client started before the compositor is up, so that it loads and
+ * initialises while the backend does.  It waits on its end of the
+ * socket until weston_client_launch() of the same path takes it over.
+ */
+static struct {
+	struct weston_process process;
+	const char *path;
+	int fd;
+} prelaunched = { .fd = -1 };
+
+static void
+prelaunched_sigchld(struct weston_process *process, int status)
+{
+	weston_log("prelaunched '%s' exited\n", prelaunched.path);
+	close(prelaunched.fd);
+	prelaunched.fd = -1;
+}
+
+static void
+weston_client_prelaunch(const char *path, const char *socket_name)
+{
+	int sv[2];
+	pid_t pid;
+
+	weston_log("prelaunching '%s'\n", path);
+
+	if (os_socketpair_cloexec(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return;
+
+	pid = fork();
+	if (pid == -1) {
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	}
+
+	if (pid == 0) {
+		/* set in the compositor only once the backend is up */
+		setenv("WAYLAND_DISPLAY", socket_name, 1);
+		child_client_exec(sv[1], path);
+		exit(-1);
+	}
+
+	close(sv[1]);
+
+	prelaunched.path = path;
+	prelaunched.fd = sv[0];
+	prelaunched.process.pid = pid;
+	prelaunched.process.cleanup = prelaunched_sigchld;
+	weston_watch_process(&prelaunched.process);
+}
+
+static struct wl_client *
+weston_client_adopt_prelaunched(struct weston_compositor *compositor,
+				struct weston_process *proc,
+				const char *path,
+				weston_process_cleanup_func_t cleanup)
+{
+	struct wl_client *client;
+
+	if (prelaunched.fd < 0 || strcmp(path, prelaunched.path) != 0)
+		return NULL;
+
+	client = wl_client_create(compositor->wl_display, prelaunched.fd);
+	if (!client)
+		return NULL;
+
+	wl_list_remove(&prelaunched.process.link);
+	prelaunched.fd = -1;
+
+	proc->pid = prelaunched.process.pid;
+	proc->cleanup = cleanup;
+	weston_watch_process(proc);
+
+	return client;
+}
+
 WL_EXPORT struct wl_client *
 weston_client_launch(struct weston_compositor *compositor,
 		     struct weston_process *proc,
@@ -197,6 +318,11 @@ weston_client_launch(struct weston_compositor *compositor,
 	pid_t pid;
 	struct wl_client *client;
 
+	client = weston_client_adopt_prelaunched(compositor, proc,
+						 path, cleanup);
+	if (client)
+		return client;
+
 	weston_log("launching '%s'\n", path);
 
 	if (os_socketpair_cloexec(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
@@ -262,6 +388,34 @@ region_init_infinite(pixman_region32_t *region)
 				  UINT32_MAX, UINT32_MAX);
 }
 
+static void
+surface_pending_region_free(pixman_region32_t **region)
+{
+	if (*region == NULL)
+		return;
+
+	pixman_region32_fini(*region);
+	free(*region);
+	*region = NULL;
+}
+
+/* Copies region into *slot, allocating it the first time. */
+static int
+surface_pending_region_copy(pixman_region32_t **slot,
+			    pixman_region32_t *region)
+{
+	if (*slot == NULL) {
+		*slot = malloc(sizeof **slot);
+		if (*slot == NULL)
+			return -1;
+		pixman_region32_init(*slot);
+	}
+
+	pixman_region32_copy(*slot, region);
+
+	return 0;
+}
+
 WL_EXPORT struct weston_surface *
 weston_surface_create(struct weston_compositor *compositor)
 {
@@ -275,6 +429,7 @@ weston_surface_create(struct weston_compositor *compositor)
 
 	wl_list_init(&surface->link);
 	wl_list_init(&surface->layer_link);
+	wl_list_init(&surface->hidden_link);
 
 	surface->surface.resource.client = NULL;
 
@@ -298,6 +453,7 @@ weston_surface_create(struct weston_compositor *compositor)
 	region_init_infinite(&surface->input);
 	pixman_region32_init(&surface->transform.opaque);
 	wl_list_init(&surface->frame_callback_list);
+	wl_list_init(&surface->feedback_list);
 
 	wl_list_init(&surface->geometry.transformation_list);
 	wl_list_insert(&surface->geometry.transformation_list,
@@ -310,9 +466,10 @@ weston_surface_create(struct weston_compositor *compositor)
 	surface->pending.buffer_destroy_listener.notify =
 		surface_handle_pending_buffer_destroy;
 	pixman_region32_init(&surface->pending.damage);
-	pixman_region32_init(&surface->pending.opaque);
-	region_init_infinite(&surface->pending.input);
+	surface->pending.opaque_dirty = 1;
+	surface->pending.input_dirty = 1;
 	wl_list_init(&surface->pending.frame_callback_list);
+	wl_list_init(&surface->pending.feedback_list);
 
 	return surface;
 }
@@ -328,7 +485,11 @@ WL_EXPORT void
 weston_surface_to_global_float(struct weston_surface *surface,
 			       float sx, float sy, float *x, float *y)
 {
-	if (surface->transform.enabled) {
+	if (surface->transform.enabled &&
+	    surface->transform.integer_translation) {
+		*x = sx + surface->transform.offset_x;
+		*y = sy + surface->transform.offset_y;
+	} else if (surface->transform.enabled) {
 		struct weston_vector v = { { sx, sy, 0.0f, 1.0f } };
 
 		weston_matrix_transform(&surface->transform.matrix, &v);
@@ -588,6 +749,136 @@ surface_compute_bbox(struct weston_surface *surface, int32_t sx, int32_t sy,
 				  ceilf(max_x) - int_x, ceilf(max_y) - int_y);
 }
 
+/* Damage of a rotated surface is covered with boxes this tall, and
+ * damage of more rectangles than the limit as its extents, see
+ * surface_transform_damage(). */
+#define TRANSFORMED_DAMAGE_BAND		32
+#define TRANSFORMED_DAMAGE_MAX_RECTS	16
+
+/* Extends [*min_x, *max_x] by the x extents of the part of the convex
+ * polygon v between y0 and y1: its vertices in that band and the
+ * points where its edges cross the band's edges. */
+static void
+polygon_band_extents(float v[][2], int n, float y0, float y1,
+		     float *min_x, float *max_x)
+{
+	float x, band[2] = { y0, y1 };
+	int i, j, k;
+
+	for (i = 0; i < n; i++) {
+		j = (i + 1) % n;
+
+		if (v[i][1] >= y0 && v[i][1] <= y1) {
+			*min_x = min(*min_x, v[i][0]);
+			*max_x = max(*max_x, v[i][0]);
+		}
+
+		for (k = 0; k < 2; k++) {
+			if ((v[i][1] - band[k]) * (v[j][1] - band[k]) >= 0)
+				continue;
+			x = v[i][0] + (band[k] - v[i][1]) *
+				(v[j][0] - v[i][0]) / (v[j][1] - v[i][1]);
+			*min_x = min(*min_x, x);
+			*max_x = max(*max_x, x);
+		}
+	}
+}
+
+/* Adds the global area box of surface covers to region.  Scaled and
+ * translated boxes stay boxes; rotated ones are covered band by band,
+ * so the corners of their bounding box are left out. */
+static void
+surface_cover_box(struct weston_surface *surface, pixman_box32_t *box,
+		  pixman_region32_t *region)
+{
+	float v[4][2], min_x, max_x, min_y, max_y, y, y1;
+	int32_t s[4][2] = {
+		{ box->x1, box->y1 },
+		{ box->x2, box->y1 },
+		{ box->x2, box->y2 },
+		{ box->x1, box->y2 }
+	};
+	int i;
+
+	if (box->x1 == box->x2 || box->y1 == box->y2)
+		return;
+
+	for (i = 0; i < 4; i++)
+		weston_surface_to_global_float(surface, s[i][0], s[i][1],
+					       &v[i][0], &v[i][1]);
+
+	min_y = max_y = v[0][1];
+	for (i = 1; i < 4; i++) {
+		min_y = min(min_y, v[i][1]);
+		max_y = max(max_y, v[i][1]);
+	}
+	min_y = floorf(min_y);
+	max_y = ceilf(max_y);
+
+	if (surface->transform.matrix.type < WESTON_MATRIX_TRANSFORM_ROTATE) {
+		min_x = min(v[0][0], v[2][0]);
+		max_x = max(v[0][0], v[2][0]);
+		pixman_region32_union_rect(region, region,
+					   floorf(min_x), min_y,
+					   ceilf(max_x) - floorf(min_x),
+					   max_y - min_y);
+		return;
+	}
+
+	for (y = min_y; y < max_y; y = y1) {
+		y1 = min(y + TRANSFORMED_DAMAGE_BAND, max_y);
+		min_x = HUGE_VALF;
+		max_x = -HUGE_VALF;
+		polygon_band_extents(v, 4, y, y1, &min_x, &max_x);
+		if (min_x >= max_x)
+			continue;
+		pixman_region32_union_rect(region, region,
+					   floorf(min_x), y,
+					   ceilf(max_x) - floorf(min_x),
+					   y1 - y);
+	}
+}
+
+/* Turns the surface coordinate damage of a transformed surface into
+ * the global area its rectangles cover, rather than the bounding box
+ * of all of it. */
+static void
+surface_transform_damage(struct weston_surface *surface,
+			 pixman_region32_t *damage)
+{
+	pixman_region32_t global;
+	pixman_box32_t *rects;
+	int i, n;
+
+	pixman_region32_init(&global);
+
+	rects = pixman_region32_rectangles(damage, &n);
+	if (n > TRANSFORMED_DAMAGE_MAX_RECTS) {
+		rects = pixman_region32_extents(damage);
+		n = 1;
+	}
+
+	for (i = 0; i < n; i++)
+		surface_cover_box(surface, &rects[i], &global);
+
+	pixman_region32_copy(damage, &global);
+	pixman_region32_fini(&global);
+}
+
+/* pick grid cells are this many pixels square, or grown so that the
+ * grid has no more than PICK_GRID_MAX_CELLS of them */
+#define PICK_GRID_CELL_SIZE	128
+#define PICK_GRID_MAX_CELLS	4096
+
+/* What is under a point may have changed, the grid needs a rebuild and
+ * the seats repicking when the output is next repainted. */
+static void
+weston_compositor_pick_dirty(struct weston_compositor *compositor)
+{
+	compositor->pick_grid.dirty = 1;
+	compositor->pick_generation++;
+}
+
 static void
 weston_surface_update_transform_disable(struct weston_surface *surface)
 {
@@ -608,6 +899,10 @@ weston_surface_update_transform_disable(struct weston_surface *surface)
 	surface->transform.inverse.d[12] = -surface->geometry.x;
 	surface->transform.inverse.d[13] = -surface->geometry.y;
 
+	surface->transform.integer_translation = 1;
+	surface->transform.offset_x = surface->geometry.x;
+	surface->transform.offset_y = surface->geometry.y;
+
 	pixman_region32_init_rect(&surface->transform.boundingbox,
 				  surface->geometry.x,
 				  surface->geometry.y,
@@ -652,10 +947,28 @@ weston_surface_update_transform_enable(struct weston_surface *surface)
 		return -1;
 	}
 
+	/* Parented surfaces and workspace slides mostly just move the
+	 * surface by whole pixels. */
+	surface->transform.integer_translation =
+		!(matrix->type & ~WESTON_MATRIX_TRANSFORM_TRANSLATE) &&
+		matrix->d[12] == (int32_t) matrix->d[12] &&
+		matrix->d[13] == (int32_t) matrix->d[13];
+	surface->transform.offset_x = matrix->d[12];
+	surface->transform.offset_y = matrix->d[13];
+
 	surface_compute_bbox(surface, 0, 0, surface->geometry.width,
 			     surface->geometry.height,
 			     &surface->transform.boundingbox);
 
+	if (surface->transform.integer_translation &&
+	    surface->alpha == 1.0) {
+		pixman_region32_copy(&surface->transform.opaque,
+				     &surface->opaque);
+		pixman_region32_translate(&surface->transform.opaque,
+					  surface->transform.offset_x,
+					  surface->transform.offset_y);
+	}
+
 	return 0;
 }
 
@@ -693,6 +1006,11 @@ weston_surface_update_transform(struct weston_surface *surface)
 	weston_surface_damage_below(surface);
 
 	weston_surface_assign_output(surface);
+
+	/* Cursors and drag icons take no input, moving them leaves the
+	 * pick grid as it is. */
+	if (pixman_region32_not_empty(&surface->input))
+		weston_compositor_pick_dirty(surface->compositor);
 }
 
 WL_EXPORT void
@@ -724,6 +1042,13 @@ weston_surface_to_global_fixed(struct weston_surface *surface,
 {
 	float xf, yf;
 
+	if (surface->transform.enabled &&
+	    surface->transform.integer_translation) {
+		*x = sx + wl_fixed_from_int(surface->transform.offset_x);
+		*y = sy + wl_fixed_from_int(surface->transform.offset_y);
+		return;
+	}
+
 	weston_surface_to_global_float(surface,
 	                               wl_fixed_to_double(sx),
 				       wl_fixed_to_double(sy),
@@ -736,7 +1061,11 @@ WL_EXPORT void
 weston_surface_from_global_float(struct weston_surface *surface,
 				 float x, float y, float *sx, float *sy)
 {
-	if (surface->transform.enabled) {
+	if (surface->transform.enabled &&
+	    surface->transform.integer_translation) {
+		*sx = x - surface->transform.offset_x;
+		*sy = y - surface->transform.offset_y;
+	} else if (surface->transform.enabled) {
 		struct weston_vector v = { { x, y, 0.0f, 1.0f } };
 
 		weston_matrix_transform(&surface->transform.inverse, &v);
@@ -765,6 +1094,13 @@ weston_surface_from_global_fixed(struct weston_surface *surface,
 {
 	float sxf, syf;
 
+	if (surface->transform.enabled &&
+	    surface->transform.integer_translation) {
+		*sx = x - wl_fixed_from_int(surface->transform.offset_x);
+		*sy = y - wl_fixed_from_int(surface->transform.offset_y);
+		return;
+	}
+
 	weston_surface_from_global_float(surface,
 					 wl_fixed_to_double(x),
 					 wl_fixed_to_double(y),
@@ -858,6 +1194,64 @@ weston_surface_set_transform_parent(struct weston_surface *surface,
 	weston_surface_geometry_dirty(surface);
 }
 
+/* Sets the opaque region the next commit applies, empty if region is
+ * NULL.  Returns -1 if out of memory, leaving it empty. */
+WL_EXPORT int
+weston_surface_set_pending_opaque(struct weston_surface *surface,
+				  pixman_region32_t *region)
+{
+	int ret = 0;
+
+	surface->pending.opaque_dirty = 1;
+
+	if (region && pixman_region32_not_empty(region))
+		ret = surface_pending_region_copy(&surface->pending.opaque,
+						  region);
+	else
+		surface_pending_region_free(&surface->pending.opaque);
+
+	if (ret < 0)
+		surface_pending_region_free(&surface->pending.opaque);
+
+	return ret;
+}
+
+/* Sets the input region the next commit applies, infinite if region
+ * is NULL.  Returns -1 if out of memory, leaving it infinite. */
+WL_EXPORT int
+weston_surface_set_pending_input(struct weston_surface *surface,
+				 pixman_region32_t *region)
+{
+	int ret = 0;
+
+	surface->pending.input_dirty = 1;
+
+	if (region)
+		ret = surface_pending_region_copy(&surface->pending.input,
+						  region);
+	else
+		surface_pending_region_free(&surface->pending.input);
+
+	if (ret < 0)
+		surface_pending_region_free(&surface->pending.input);
+
+	return ret;
+}
+
+/* For surfaces that must never get input, like cursors. */
+WL_EXPORT int
+weston_surface_clear_pending_input(struct weston_surface *surface)
+{
+	pixman_region32_t empty;
+	int ret;
+
+	pixman_region32_init(&empty);
+	ret = weston_surface_set_pending_input(surface, &empty);
+	pixman_region32_fini(&empty);
+
+	return ret;
+}
+
 WL_EXPORT int
 weston_surface_is_mapped(struct weston_surface *surface)
 {
@@ -905,22 +1299,213 @@ weston_compositor_get_time(void)
        return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+/*
+ * Returns 0 for surfaces that can never be picked, 1 and the global
+ * box for those whose input region lies within their bounding box,
+ * and 2 for any others, which need testing wherever the point is.
+ */
+static int
+pick_grid_surface_box(struct weston_surface *surface, pixman_box32_t *box)
+{
+	pixman_box32_t *input;
+
+	if (!pixman_region32_not_empty(&surface->input))
+		return 0;
+
+	/* the bounding box is stale until the transform is updated */
+	if (surface->transform.dirty)
+		return 2;
+
+	input = pixman_region32_extents(&surface->input);
+	if (input->x1 < 0 || input->y1 < 0 ||
+	    input->x2 > surface->geometry.width ||
+	    input->y2 > surface->geometry.height)
+		return 2;
+
+	/* a pixel of slack for points on the edges */
+	*box = *pixman_region32_extents(&surface->transform.boundingbox);
+	box->x1 -= 1;
+	box->y1 -= 1;
+	box->x2 += 1;
+	box->y2 += 1;
+
+	return 1;
+}
+
+static void
+pick_grid_cell_range(struct weston_pick_grid *grid, pixman_box32_t *box,
+		     int *c1, int *r1, int *c2, int *r2)
+{
+	*c1 = (box->x1 - grid->x) / grid->cell_size;
+	*r1 = (box->y1 - grid->y) / grid->cell_size;
+	*c2 = (box->x2 - 1 - grid->x) / grid->cell_size;
+	*r2 = (box->y2 - 1 - grid->y) / grid->cell_size;
+}
+
+static void
+pick_grid_update(struct weston_compositor *compositor)
+{
+	struct weston_pick_grid *grid = &compositor->pick_grid;
+	struct weston_surface *surface, **entry;
+	pixman_box32_t box, extents;
+	int i, n, c, r, c1, r1, c2, r2, type, bounded = 0;
+	int *cells;
+
+	grid->dirty = 0;
+	grid->unbounded.size = 0;
+	grid->entries.size = 0;
+	grid->cells.size = 0;
+
+	wl_list_for_each(surface, &compositor->surface_list, link) {
+		type = pick_grid_surface_box(surface, &box);
+		if (type == 2) {
+			entry = wl_array_add(&grid->unbounded, sizeof *entry);
+			if (!entry)
+				goto fail;
+			*entry = surface;
+		} else if (type == 1 && bounded++ == 0) {
+			extents = box;
+		} else if (type == 1) {
+			extents.x1 = box.x1 < extents.x1 ? box.x1 : extents.x1;
+			extents.y1 = box.y1 < extents.y1 ? box.y1 : extents.y1;
+			extents.x2 = box.x2 > extents.x2 ? box.x2 : extents.x2;
+			extents.y2 = box.y2 > extents.y2 ? box.y2 : extents.y2;
+		}
+	}
+
+	grid->columns = 0;
+	grid->rows = 0;
+	if (bounded == 0)
+		return;
+
+	grid->x = extents.x1;
+	grid->y = extents.y1;
+	grid->cell_size = PICK_GRID_CELL_SIZE;
+	do {
+		grid->columns = (extents.x2 - extents.x1 +
+				 grid->cell_size - 1) / grid->cell_size;
+		grid->rows = (extents.y2 - extents.y1 +
+			      grid->cell_size - 1) / grid->cell_size;
+		if (grid->columns * grid->rows <= PICK_GRID_MAX_CELLS)
+			break;
+		grid->cell_size *= 2;
+	} while (1);
+
+	n = grid->columns * grid->rows;
+	cells = wl_array_add(&grid->cells, (n + 1) * sizeof *cells);
+	if (!cells)
+		goto fail;
+	memset(cells, 0, (n + 1) * sizeof *cells);
+
+	/* count the candidates of each cell, then fill them in stacking
+	 * order using cells[i] as the cursor into cell i */
+	wl_list_for_each(surface, &compositor->surface_list, link) {
+		type = pick_grid_surface_box(surface, &box);
+		if (type == 0)
+			continue;
+		if (type == 2) {
+			c1 = r1 = 0;
+			c2 = grid->columns - 1;
+			r2 = grid->rows - 1;
+		} else {
+			pick_grid_cell_range(grid, &box, &c1, &r1, &c2, &r2);
+		}
+		for (r = r1; r <= r2; r++)
+			for (c = c1; c <= c2; c++)
+				cells[r * grid->columns + c + 1]++;
+	}
+
+	for (i = 0; i < n; i++)
+		cells[i + 1] += cells[i];
+
+	if (!wl_array_add(&grid->entries, cells[n] * sizeof *entry))
+		goto fail;
+	entry = grid->entries.data;
+
+	wl_list_for_each(surface, &compositor->surface_list, link) {
+		type = pick_grid_surface_box(surface, &box);
+		if (type == 0)
+			continue;
+		if (type == 2) {
+			c1 = r1 = 0;
+			c2 = grid->columns - 1;
+			r2 = grid->rows - 1;
+		} else {
+			pick_grid_cell_range(grid, &box, &c1, &r1, &c2, &r2);
+		}
+		for (r = r1; r <= r2; r++)
+			for (c = c1; c <= c2; c++)
+				entry[cells[r * grid->columns + c]++] = surface;
+	}
+
+	/* the cursors ended up at the start of the next cell */
+	for (i = n; i > 0; i--)
+		cells[i] = cells[i - 1];
+	cells[0] = 0;
+
+	return;
+
+fail:
+	/* fall back to testing every surface */
+	weston_log("failed to allocate the pick grid\n");
+	grid->dirty = 1;
+}
+
+static int
+pick_surface_test(struct weston_surface *surface,
+		  wl_fixed_t x, wl_fixed_t y,
+		  wl_fixed_t *sx, wl_fixed_t *sy)
+{
+	weston_surface_from_global_fixed(surface, x, y, sx, sy);
+
+	return pixman_region32_contains_point(&surface->input,
+					      wl_fixed_to_int(*sx),
+					      wl_fixed_to_int(*sy),
+					      NULL);
+}
+
 static struct weston_surface *
 weston_compositor_pick_surface(struct weston_compositor *compositor,
 			       wl_fixed_t x, wl_fixed_t y,
 			       wl_fixed_t *sx, wl_fixed_t *sy)
 {
-	struct weston_surface *surface;
+	struct weston_pick_grid *grid = &compositor->pick_grid;
+	struct weston_surface *surface, **entry, **end;
+	int c, r, *cells;
 
-	wl_list_for_each(surface, &compositor->surface_list, link) {
-		weston_surface_from_global_fixed(surface, x, y, sx, sy);
-		if (pixman_region32_contains_point(&surface->input,
-						   wl_fixed_to_int(*sx),
-						   wl_fixed_to_int(*sy),
-						   NULL))
-			return surface;
+	if (grid->dirty)
+		pick_grid_update(compositor);
+
+	if (grid->dirty) {
+		wl_list_for_each(surface, &compositor->surface_list, link)
+			if (pick_surface_test(surface, x, y, sx, sy))
+				return surface;
+
+		return NULL;
+	}
+
+	c = (int) floor(wl_fixed_to_double(x) - grid->x);
+	r = (int) floor(wl_fixed_to_double(y) - grid->y);
+	if (c >= 0 && r >= 0 &&
+	    c < grid->columns * grid->cell_size &&
+	    r < grid->rows * grid->cell_size) {
+		cells = grid->cells.data;
+		c /= grid->cell_size;
+		r /= grid->cell_size;
+		entry = (struct weston_surface **) grid->entries.data +
+			cells[r * grid->columns + c];
+		end = (struct weston_surface **) grid->entries.data +
+			cells[r * grid->columns + c + 1];
+	} else {
+		/* outside of all bounding boxes */
+		entry = grid->unbounded.data;
+		end = entry + grid->unbounded.size / sizeof *entry;
 	}
 
+	for (; entry < end; entry++)
+		if (pick_surface_test(*entry, x, y, sx, sy))
+			return *entry;
+
 	return NULL;
 }
 
@@ -955,6 +1540,8 @@ weston_device_repick(struct weston_seat *seat)
 						 pointer->y,
 					         &pointer->grab->x,
 					         &pointer->grab->y);
+
+	seat->pick_generation = seat->compositor->pick_generation;
 }
 
 static void
@@ -965,8 +1552,11 @@ weston_compositor_repick(struct weston_compositor *compositor)
 	if (!compositor->focus)
 		return;
 
+	/* pointer motion repicks by itself, so only the seats that
+	 * picked before the last change need a look */
 	wl_list_for_each(seat, &compositor->seat_list, link)
-		weston_device_repick(seat);
+		if (seat->pick_generation != compositor->pick_generation)
+			weston_device_repick(seat);
 }
 
 WL_EXPORT void
@@ -975,8 +1565,13 @@ weston_surface_unmap(struct weston_surface *surface)
 	struct weston_seat *seat;
 
 	weston_surface_damage_below(surface);
+	weston_surface_set_hidden(surface, 0);
 	surface->output = NULL;
 	wl_list_remove(&surface->layer_link);
+	wl_list_remove(&surface->link);
+	wl_list_init(&surface->link);
+	weston_compositor_stacking_dirty(surface->compositor);
+	weston_compositor_pick_dirty(surface->compositor);
 
 	wl_list_for_each(seat, &surface->compositor->seat_list, link) {
 		if (seat->seat.keyboard &&
@@ -993,10 +1588,58 @@ weston_surface_unmap(struct weston_surface *surface)
 	weston_surface_schedule_repaint(surface);
 }
 
-struct weston_frame_callback {
-	struct wl_resource resource;
-	struct wl_list link;
-};
+/*
+ * A shell hides the surfaces of a layer it takes out of the layer
+ * list while they stay mapped, as on an inactive workspace.  They
+ * leave their planes, and keep their output so that their frame
+ * callbacks still go out, at the occluded rate.  The surface list
+ * unhides a surface when it finds it in a layer again.
+ */
+WL_EXPORT void
+weston_surface_set_hidden(struct weston_surface *surface, int hidden)
+{
+	struct weston_compositor *ec = surface->compositor;
+
+	if (!!surface->hidden == !!hidden)
+		return;
+
+	surface->hidden = hidden;
+	wl_list_remove(&surface->hidden_link);
+	if (hidden) {
+		wl_list_insert(&ec->hidden_surface_list,
+			       &surface->hidden_link);
+		weston_surface_move_to_plane(surface, &ec->primary_plane);
+	} else {
+		wl_list_init(&surface->hidden_link);
+	}
+}
+
+struct weston_frame_callback {
+	struct wl_resource resource;
+	struct wl_list link;
+};
+
+struct weston_presentation_feedback {
+	struct wl_resource resource;
+	struct wl_list link;
+	uint32_t flags;		/* known when a repaint takes it */
+};
+
+static void
+weston_presentation_feedback_discard_list(struct wl_list *list)
+{
+	struct weston_presentation_feedback *feedback, *next;
+
+	wl_list_for_each_safe(feedback, next, list, link) {
+		presentation_feedback_send_discarded(&feedback->resource);
+		wl_resource_destroy(&feedback->resource);
+	}
+}
+
+/* A frame callback per surface per frame, and regions around most
+ * surface commits. */
+static struct weston_slab frame_callback_slab;
+static struct weston_slab region_slab;
 
 static void
 destroy_surface(struct wl_resource *resource)
@@ -1015,9 +1658,11 @@ destroy_surface(struct wl_resource *resource)
 	wl_list_for_each_safe(cb, next,
 			      &surface->pending.frame_callback_list, link)
 		wl_resource_destroy(&cb->resource);
+	weston_presentation_feedback_discard_list(&surface->pending.feedback_list);
+	weston_presentation_feedback_discard_list(&surface->feedback_list);
 
-	pixman_region32_fini(&surface->pending.input);
-	pixman_region32_fini(&surface->pending.opaque);
+	surface_pending_region_free(&surface->pending.input);
+	surface_pending_region_free(&surface->pending.opaque);
 	pixman_region32_fini(&surface->pending.damage);
 
 	if (surface->pending.buffer)
@@ -1038,6 +1683,10 @@ destroy_surface(struct wl_resource *resource)
 
 	weston_surface_set_transform_parent(surface, NULL);
 
+	wl_list_remove(&surface->hidden_link);
+	wl_list_remove(&surface->link);
+	weston_compositor_pick_dirty(compositor);
+
 	free(surface);
 }
 
@@ -1106,6 +1755,7 @@ weston_surface_restack(struct weston_surface *surface, struct wl_list *below)
 {
 	wl_list_remove(&surface->layer_link);
 	wl_list_insert(below, &surface->layer_link);
+	weston_compositor_stacking_dirty(surface->compositor);
 	weston_surface_damage_below(surface);
 	weston_surface_damage(surface);
 }
@@ -1130,6 +1780,89 @@ weston_output_damage(struct weston_output *output)
 	weston_output_schedule_repaint(output);
 }
 
+/* A black surface over the output, for renderers that can't fade. */
+static void
+weston_output_cover_fade(struct weston_output *output, float fade)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_surface *surface = output->fade_surface;
+
+	if (fade <= 0.0) {
+		if (surface)
+			weston_surface_destroy(surface);
+		output->fade_surface = NULL;
+		return;
+	}
+
+	if (surface == NULL) {
+		surface = weston_surface_create(ec);
+		if (surface == NULL)
+			return;
+
+		weston_surface_set_color(surface, 0.0, 0.0, 0.0, 1.0);
+		pixman_region32_fini(&surface->input);
+		pixman_region32_init(&surface->input);
+		wl_list_insert(&ec->fade_layer.surface_list,
+			       &surface->layer_link);
+		weston_compositor_stacking_dirty(ec);
+		output->fade_surface = surface;
+	}
+
+	weston_surface_configure(surface, output->x, output->y,
+				 output->width, output->height);
+	surface->alpha = fade;
+	weston_surface_update_transform(surface);
+	weston_surface_damage(surface);
+}
+
+static void
+weston_output_apply_fade(struct weston_output *output, float fade)
+{
+	struct weston_compositor *ec = output->compositor;
+
+	if (output->set_fade && output->set_fade(output, fade) == 0) {
+		fade = 0.0;
+	} else if (!ec->renderer->output_fade) {
+		weston_output_cover_fade(output, fade);
+		return;
+	}
+
+	if (output->fade == fade)
+		return;
+
+	if (fade > 0.0 && output->fade > 0.0) {
+		/* only the renderer's last pass changes */
+		output->fade = fade;
+		output->dirty = 1;
+		weston_output_schedule_repaint(output);
+	} else {
+		output->fade = fade;
+		weston_output_damage(output);
+	}
+}
+
+/*
+ * Fades every output to black by tint, from 0 (not at all) to 1.
+ * Called for each frame of a fade animation, it only costs a gamma
+ * ramp update on backends that do it that way, or one textured quad
+ * over an offscreen copy of the scene with renderers that can.  Only
+ * otherwise is a black surface of that alpha put over each output.
+ */
+WL_EXPORT void
+weston_compositor_fade(struct weston_compositor *compositor, float tint)
+{
+	struct weston_output *output;
+
+	if (tint < 0.0)
+		tint = 0.0;
+	else if (tint > 1.0)
+		tint = 1.0;
+
+	compositor->fade = tint;
+	wl_list_for_each(output, &compositor->output_list, link)
+		weston_output_apply_fade(output, tint);
+}
+
 static void
 surface_accumulate_damage(struct weston_surface *surface,
 			  pixman_region32_t *opaque)
@@ -1138,14 +1871,15 @@ surface_accumulate_damage(struct weston_surface *surface,
 	    wl_buffer_is_shm(surface->buffer_ref.buffer))
 		surface->compositor->renderer->flush_damage(surface);
 
-	if (surface->transform.enabled) {
-		pixman_box32_t *extents;
-
-		extents = pixman_region32_extents(&surface->damage);
-		surface_compute_bbox(surface, extents->x1, extents->y1,
-				     extents->x2 - extents->x1,
-				     extents->y2 - extents->y1,
-				     &surface->damage);
+	if (surface->transform.enabled &&
+	    surface->transform.integer_translation) {
+		pixman_region32_translate(&surface->damage,
+					  surface->transform.offset_x -
+					  surface->plane->x,
+					  surface->transform.offset_y -
+					  surface->plane->y);
+	} else if (surface->transform.enabled) {
+		surface_transform_damage(surface, &surface->damage);
 		pixman_region32_translate(&surface->damage,
 					  -surface->plane->x,
 					  -surface->plane->y);
@@ -1164,11 +1898,13 @@ surface_accumulate_damage(struct weston_surface *surface,
 }
 
 static void
-compositor_accumulate_damage(struct weston_compositor *ec)
+compositor_accumulate_damage(struct weston_compositor *ec,
+			     struct weston_output *output)
 {
 	struct weston_plane *plane;
 	struct weston_surface *es;
 	pixman_region32_t opaque, clip;
+	uint32_t output_bit = 1 << output->id;
 
 	pixman_region32_init(&clip);
 
@@ -1177,8 +1913,12 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 
 		pixman_region32_init(&opaque);
 
+		/* Surfaces not on this output keep their damage (and
+		 * their buffer) until an output they are visible on
+		 * repaints. */
 		wl_list_for_each(es, &ec->surface_list, link) {
-			if (es->plane != plane)
+			if (es->plane != plane ||
+			    !(es->output_mask & output_bit))
 				continue;
 
 			surface_accumulate_damage(es, &opaque);
@@ -1191,6 +1931,9 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 	pixman_region32_fini(&clip);
 
 	wl_list_for_each(es, &ec->surface_list, link) {
+		if (!(es->output_mask & output_bit))
+			continue;
+
 		/* Both the renderer and the backend have seen the buffer
 		 * by now. If renderer needs the buffer, it has its own
 		 * reference set. If the backend wants to keep the buffer
@@ -1204,41 +1947,430 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 	}
 }
 
+static uint32_t
+timespec_elapsed_usec(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000 +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+}
+
 static void
-weston_output_repaint(struct weston_output *output, uint32_t msecs)
+timing_mark(struct weston_repaint_timing *frame,
+	    enum weston_repaint_phase phase, struct timespec *last)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	frame->phase[phase] = timespec_elapsed_usec(last, &now);
+	*last = now;
+}
+
+static struct weston_repaint_timing *
+weston_output_timing_begin(struct weston_output *output, uint32_t msecs)
+{
+	struct weston_output_timing *timing = &output->timing;
+	struct weston_repaint_timing *frame;
+
+	frame = &timing->frames[timing->head];
+	memset(frame, 0, sizeof *frame);
+	frame->msecs = msecs;
+
+	timing->head = (timing->head + 1) % WESTON_REPAINT_TIMING_FRAMES;
+	if (timing->count < WESTON_REPAINT_TIMING_FRAMES)
+		timing->count++;
+
+	return frame;
+}
+
+/* Drops the frame weston_output_timing_begin() just added, for a
+ * repaint that turned out to have nothing to do.  When the ring is
+ * full the slot it reused is lost along with it. */
+static void
+weston_output_timing_cancel(struct weston_output *output)
+{
+	struct weston_output_timing *timing = &output->timing;
+
+	timing->head = (timing->head + WESTON_REPAINT_TIMING_FRAMES - 1) %
+		WESTON_REPAINT_TIMING_FRAMES;
+	timing->count--;
+}
+
+static void
+weston_output_timing_flip_done(struct weston_output *output)
+{
+	struct weston_output_timing *timing = &output->timing;
+	struct weston_repaint_timing *frame;
+	struct timespec now;
+	unsigned int last;
+
+	if (!timing->flip_pending)
+		return;
+
+	timing->flip_pending = 0;
+	last = (timing->head + WESTON_REPAINT_TIMING_FRAMES - 1) %
+		WESTON_REPAINT_TIMING_FRAMES;
+	frame = &timing->frames[last];
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	frame->flip = timespec_elapsed_usec(&timing->repaint_end, &now);
+
+	if (output->current && output->current->refresh)
+		output->stats.frames_missed += frame->flip /
+			(1000000000 / output->current->refresh);
+}
+
+/* Predict the duration of the next repaint up to and including the
+ * render phase as the worst of the last few frames, in usec.  Returns
+ * 0 until enough frames have been measured. */
+static uint32_t
+weston_output_predict_repaint(struct weston_output *output)
+{
+	struct weston_output_timing *timing = &output->timing;
+	struct weston_repaint_timing *frame;
+	uint32_t total, worst = 0;
+	unsigned int i, j, index;
+
+	if (timing->count < 8)
+		return 0;
+
+	for (i = 1; i <= 16 && i <= timing->count; i++) {
+		index = (timing->head + WESTON_REPAINT_TIMING_FRAMES - i) %
+			WESTON_REPAINT_TIMING_FRAMES;
+		frame = &timing->frames[index];
+
+		total = 0;
+		for (j = 0; j <= WESTON_REPAINT_PHASE_RENDER; j++)
+			total += frame->phase[j];
+		if (total > worst)
+			worst = total;
+	}
+
+	return worst;
+}
+
+static const char *repaint_phase_names[] = {
+	[WESTON_REPAINT_PHASE_SURFACE_LIST] = "list",
+	[WESTON_REPAINT_PHASE_ASSIGN_PLANES] = "planes",
+	[WESTON_REPAINT_PHASE_ACCUMULATE_DAMAGE] = "damage",
+	[WESTON_REPAINT_PHASE_RENDER] = "render",
+	[WESTON_REPAINT_PHASE_FRAME_CALLBACKS] = "frame",
+};
+
+WL_EXPORT void
+weston_output_dump_timing(struct weston_output *output)
+{
+	struct weston_output_timing *timing = &output->timing;
+	struct weston_repaint_timing *frame;
+	uint32_t total[WESTON_REPAINT_PHASE_COUNT], total_flip;
+	uint32_t worst[WESTON_REPAINT_PHASE_COUNT], worst_flip;
+	unsigned int i, j, index;
+
+	weston_log("repaint timing for output %d (%s), last %u frames, usec\n",
+		   output->id, output->model ? output->model : "unknown",
+		   timing->count);
+	if (timing->count == 0)
+		return;
+
+	memset(total, 0, sizeof total);
+	memset(worst, 0, sizeof worst);
+	total_flip = worst_flip = 0;
+
+	index = (timing->head + WESTON_REPAINT_TIMING_FRAMES -
+		 timing->count) % WESTON_REPAINT_TIMING_FRAMES;
+	for (i = 0; i < timing->count; i++) {
+		frame = &timing->frames[index];
+		weston_log_continue(STAMP_SPACE "%10u:", frame->msecs);
+		for (j = 0; j < WESTON_REPAINT_PHASE_COUNT; j++) {
+			weston_log_continue(" %s %u", repaint_phase_names[j],
+					    frame->phase[j]);
+			total[j] += frame->phase[j];
+			if (frame->phase[j] > worst[j])
+				worst[j] = frame->phase[j];
+		}
+		weston_log_continue(" flip %u\n", frame->flip);
+		total_flip += frame->flip;
+		if (frame->flip > worst_flip)
+			worst_flip = frame->flip;
+
+		index = (index + 1) % WESTON_REPAINT_TIMING_FRAMES;
+	}
+
+	weston_log_continue(STAMP_SPACE "   average:");
+	for (j = 0; j < WESTON_REPAINT_PHASE_COUNT; j++)
+		weston_log_continue(" %s %u", repaint_phase_names[j],
+				    total[j] / timing->count);
+	weston_log_continue(" flip %u\n", total_flip / timing->count);
+
+	weston_log_continue(STAMP_SPACE "     worst:");
+	for (j = 0; j < WESTON_REPAINT_PHASE_COUNT; j++)
+		weston_log_continue(" %s %u", repaint_phase_names[j],
+				    worst[j]);
+	weston_log_continue(" flip %u\n", worst_flip);
+}
+
+static void
+timing_debug_binding(struct wl_seat *seat, uint32_t time, uint32_t key,
+		     void *data)
+{
+	struct weston_compositor *ec = data;
+	struct weston_output *output;
+
+	wl_list_for_each(output, &ec->output_list, link)
+		weston_output_dump_timing(output);
+
+	weston_log("%u surface commits, %u left the regions alone\n",
+		   ec->commit_stats.total, ec->commit_stats.fast);
+	if (ec->layer_cache_frames > 0)
+		weston_log("layer cache: %u hits, %u misses\n",
+			   ec->layer_cache_stats.hits,
+			   ec->layer_cache_stats.misses);
+	if (ec->shader_stats.alpha_one || ec->shader_stats.alpha)
+		weston_log("surface draws: %u at full alpha, %u with alpha\n",
+			   ec->shader_stats.alpha_one,
+			   ec->shader_stats.alpha);
+}
+
+static void
+weston_compositor_flush_motion(struct weston_compositor *ec);
+
+static void
+weston_layer_update_idle(struct weston_layer *layer, int changed)
+{
+	struct weston_surface *es;
+
+	if (!changed)
+		wl_list_for_each(es, &layer->surface_list, layer_link)
+			if (es->transform.dirty ||
+			    pixman_region32_not_empty(&es->damage)) {
+				changed = 1;
+				break;
+			}
+
+	if (changed) {
+		layer->idle_frames = 0;
+		layer->serial++;
+	} else {
+		layer->idle_frames++;
+	}
+}
+
+/* Whether the opaque surfaces above, on this and higher planes, cover
+ * all of the surface, as of the last compositor_accumulate_damage(). */
+static int
+weston_surface_is_occluded(struct weston_surface *surface)
+{
+	pixman_region32_t visible;
+	int occluded;
+
+	if (!pixman_region32_not_empty(&surface->transform.boundingbox))
+		return 0;
+
+	pixman_region32_init(&visible);
+	pixman_region32_subtract(&visible, &surface->transform.boundingbox,
+				 &surface->clip);
+	pixman_region32_subtract(&visible, &visible, &surface->plane->clip);
+	occluded = !pixman_region32_not_empty(&visible);
+	pixman_region32_fini(&visible);
+
+	return occluded;
+}
+
+/*
+ * Hidden clients need not render at the full frame rate, so occluded
+ * surfaces keep their frame callbacks until occluded_frame_interval
+ * has passed since they last got any.  Returns the ms until that is
+ * the case, or 0 if the callbacks can go out now.
+ */
+static uint32_t
+weston_surface_throttle_frame(struct weston_surface *surface, uint32_t msecs)
+{
+	uint32_t interval = surface->compositor->occluded_frame_interval;
+	uint32_t elapsed = msecs - surface->occluded_frame_time;
+
+	if (interval == 0 ||
+	    (!surface->hidden && !weston_surface_is_occluded(surface))) {
+		surface->occluded_frame_time = msecs;
+		return 0;
+	}
+
+	if (elapsed < interval)
+		return interval - elapsed;
+
+	surface->occluded_frame_time = msecs;
+
+	return 0;
+}
+
+/* Moves the frame callbacks of es on output to list, unless they are
+ * throttled; then next_frame becomes the earliest delay until they
+ * can go out. */
+static void
+output_take_frame_callbacks(struct weston_output *output,
+			    struct weston_surface *es, uint32_t msecs,
+			    struct wl_list *list, uint32_t *next_frame)
+{
+	uint32_t delay;
+
+	if (es->output != output || wl_list_empty(&es->frame_callback_list))
+		return;
+
+	delay = weston_surface_throttle_frame(es, msecs);
+	if (delay > 0) {
+		if (*next_frame == 0 || delay < *next_frame)
+			*next_frame = delay;
+		return;
+	}
+
+	wl_list_insert_list(list, &es->frame_callback_list);
+	wl_list_init(&es->frame_callback_list);
+}
+
+/* Moves the presentation feedback of es to the output's list, to be
+ * sent when the frame that shows it is on screen. */
+static void
+output_take_feedback(struct weston_output *output, struct weston_surface *es)
+{
+	struct weston_presentation_feedback *feedback;
+	uint32_t flags = 0;
+
+	if (es->output != output || wl_list_empty(&es->feedback_list))
+		return;
+
+	if (es->plane_kind == WESTON_PLANE_KIND_SCANOUT ||
+	    es->plane_kind == WESTON_PLANE_KIND_OVERLAY)
+		flags = PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
+	wl_list_for_each(feedback, &es->feedback_list, link)
+		feedback->flags = flags;
+
+	wl_list_insert_list(output->feedback_list.prev, &es->feedback_list);
+	wl_list_init(&es->feedback_list);
+}
+
+static int
+occluded_frame_handler(void *data)
+{
+	struct weston_compositor *ec = data;
+
+	weston_compositor_schedule_repaint(ec);
+
+	return 1;
+}
+
+/* Whether the repaint would show nothing the output does not show
+ * already: no damage on the planes of its surfaces, no frame
+ * callbacks to send and no animations to run. */
+static int
+weston_output_is_idle(struct weston_output *output,
+		      pixman_region32_t *output_damage,
+		      struct wl_list *frame_callback_list)
 {
 	struct weston_compositor *ec = output->compositor;
 	struct weston_surface *es;
+
+	if (output->dirty || pixman_region32_not_empty(output_damage) ||
+	    !wl_list_empty(frame_callback_list) ||
+	    !wl_list_empty(&output->animation_list))
+		return 0;
+
+	if (output->assign_planes && !output->disable_planes &&
+	    (!output->idle_skip ||
+	     output->stats.planes[WESTON_PLANE_KIND_SCANOUT] ||
+	     output->stats.planes[WESTON_PLANE_KIND_OVERLAY]))
+		return 0;
+
+	wl_list_for_each(es, &ec->surface_list, link)
+		if (es->plane != &ec->primary_plane &&
+		    (es->output_mask & (1u << output->id)) &&
+		    pixman_region32_not_empty(&es->plane->damage))
+			return 0;
+
+	return 1;
+}
+
+static void
+weston_output_repaint(struct weston_output *output, uint32_t msecs)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_surface *es, *next_es;
 	struct weston_layer *layer;
 	struct weston_animation *animation, *next;
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
 	pixman_region32_t output_damage;
+	struct weston_repaint_timing *timing;
+	struct timespec last;
+	uint32_t latency, next_frame = 0;
+	int restacked = 0;
+
+	WESTON_TRACE_BEGIN(WESTON_TRACE_REPAINT, "weston_output_repaint");
+
+	timing = weston_output_timing_begin(output, msecs);
+	clock_gettime(CLOCK_MONOTONIC, &last);
 
 	weston_compositor_update_drag_surfaces(ec);
 
-	/* Rebuild the surface list and update surface transforms up front. */
-	wl_list_init(&ec->surface_list);
-	wl_list_init(&frame_callback_list);
-	wl_list_for_each(layer, &ec->layer_list, link) {
-		wl_list_for_each(es, &layer->surface_list, layer_link) {
-			weston_surface_update_transform(es);
-			wl_list_insert(ec->surface_list.prev, &es->link);
-			if (es->output == output) {
-				wl_list_insert_list(&frame_callback_list,
-						    &es->frame_callback_list);
-				wl_list_init(&es->frame_callback_list);
+	/* Rebuild the surface list only if the stacking changed since
+	 * the last repaint, then update surface transforms up front. */
+	if (ec->surface_list_dirty) {
+		wl_list_for_each_safe(es, next_es, &ec->surface_list, link)
+			wl_list_init(&es->link);
+		wl_list_init(&ec->surface_list);
+		wl_list_for_each(layer, &ec->layer_list, link)
+			wl_list_for_each(es, &layer->surface_list, layer_link) {
+				if (es->hidden)
+					weston_surface_set_hidden(es, 0);
+				wl_list_insert(ec->surface_list.prev,
+					       &es->link);
 			}
-		}
+		ec->surface_list_dirty = 0;
+		restacked = 1;
+		weston_compositor_pick_dirty(ec);
+	}
+
+	wl_list_for_each(layer, &ec->layer_list, link)
+		weston_layer_update_idle(layer, restacked);
+
+	wl_list_for_each(es, &ec->surface_list, link) {
+		weston_surface_update_transform(es);
+		if (es->output == output)
+			es->damage_history = (es->damage_history << 1) |
+				!!pixman_region32_not_empty(&es->damage);
 	}
 
-	if (output->assign_planes && !output->disable_planes)
+	timing_mark(timing, WESTON_REPAINT_PHASE_SURFACE_LIST, &last);
+
+	WESTON_TRACE_BEGIN(WESTON_TRACE_PLANE, "assign_planes");
+	if (output->assign_planes && !output->disable_planes) {
 		output->assign_planes(output);
-	else
-		wl_list_for_each(es, &ec->surface_list, link)
+	} else {
+		memset(output->stats.planes, 0, sizeof output->stats.planes);
+		wl_list_for_each(es, &ec->surface_list, link) {
 			weston_surface_move_to_plane(es, &ec->primary_plane);
+			es->plane_kind = WESTON_PLANE_KIND_PRIMARY;
+			if (es->output_mask & (1u << output->id))
+				output->stats.planes[WESTON_PLANE_KIND_PRIMARY]++;
+		}
+	}
+	WESTON_TRACE_END(WESTON_TRACE_PLANE, "assign_planes");
+
+	timing_mark(timing, WESTON_REPAINT_PHASE_ASSIGN_PLANES, &last);
 
-	compositor_accumulate_damage(ec);
+	compositor_accumulate_damage(ec, output);
+
+	wl_list_init(&frame_callback_list);
+	wl_list_for_each(es, &ec->surface_list, link)
+		output_take_frame_callbacks(output, es, msecs,
+					    &frame_callback_list, &next_frame);
+	wl_list_for_each(es, &ec->hidden_surface_list, hidden_link)
+		output_take_frame_callbacks(output, es, msecs,
+					    &frame_callback_list, &next_frame);
+	wl_list_for_each(es, &ec->surface_list, link)
+		output_take_feedback(output, es);
+	if (next_frame > 0)
+		wl_event_source_timer_update(ec->occluded_frame_source,
+					     next_frame);
+
+	timing_mark(timing, WESTON_REPAINT_PHASE_ACCUMULATE_DAMAGE, &last);
 
 	pixman_region32_init(&output_damage);
 	pixman_region32_intersect(&output_damage,
@@ -1246,6 +2378,21 @@ weston_output_repaint(struct weston_output *output, uint32_t msecs)
 	pixman_region32_subtract(&output_damage,
 				 &output_damage, &ec->primary_plane.clip);
 
+	/* Skip the renderer and the flip; no flip event will end the
+	 * frame either, so end it here, which stops the repaint loop. */
+	if (weston_output_is_idle(output, &output_damage,
+				  &frame_callback_list)) {
+		pixman_region32_fini(&output_damage);
+		weston_output_timing_cancel(output);
+		output->repaint_needed = 0;
+		output->stats.frames_idle++;
+		weston_compositor_repick(ec);
+		WESTON_TRACE_END(WESTON_TRACE_REPAINT,
+				 "weston_output_repaint");
+		weston_output_finish_frame(output, msecs);
+		return;
+	}
+
 	if (output->dirty)
 		weston_output_update_matrix(output);
 
@@ -1253,20 +2400,44 @@ weston_output_repaint(struct weston_output *output, uint32_t msecs)
 
 	pixman_region32_fini(&output_damage);
 
+	if (!ec->first_frame_done) {
+		ec->first_frame_done = 1;
+		weston_log_startup_phase("first frame");
+	}
+
+	timing_mark(timing, WESTON_REPAINT_PHASE_RENDER, &last);
+
 	output->repaint_needed = 0;
 
 	weston_compositor_repick(ec);
 	wl_event_loop_dispatch(ec->input_loop, 0);
+	weston_compositor_flush_motion(ec);
 
 	wl_list_for_each_safe(cb, cnext, &frame_callback_list, link) {
 		wl_callback_send_done(&cb->resource, msecs);
 		wl_resource_destroy(&cb->resource);
 	}
 
+	timing_mark(timing, WESTON_REPAINT_PHASE_FRAME_CALLBACKS, &last);
+	output->timing.repaint_end = last;
+	output->timing.flip_pending = 1;
+
+	output->stats.frames++;
+	if (ec->input_stamped) {
+		latency = timespec_elapsed_usec(&ec->input_time, &last);
+		output->stats.input_latency_count++;
+		output->stats.input_latency_total += latency;
+		if (latency > output->stats.input_latency_max)
+			output->stats.input_latency_max = latency;
+		ec->input_stamped = 0;
+	}
+
 	wl_list_for_each_safe(animation, next, &output->animation_list, link) {
 		animation->frame_counter++;
 		animation->frame(animation, output, msecs);
 	}
+
+	WESTON_TRACE_END(WESTON_TRACE_REPAINT, "weston_output_repaint");
 }
 
 static int
@@ -1279,21 +2450,168 @@ weston_compositor_read_input(int fd, uint32_t mask, void *data)
 	return 1;
 }
 
+/* Usec from now until the repaint timer of output fires, negative if
+ * that is past. */
+static int64_t
+weston_output_repaint_timer_left(struct weston_output *output,
+				 const struct timespec *now)
+{
+	return (int64_t) (output->repaint_start.tv_sec - now->tv_sec) *
+		1000000 + (output->repaint_start.tv_nsec - now->tv_nsec) / 1000;
+}
+
+/*
+ * All outputs repaint on this one thread, so a repaint due while
+ * another output's runs starts late by what is left of that one, and
+ * with repaint-deadline that makes it miss its vblank.  Outputs whose
+ * timers are armed remember when they fire and for how long they are
+ * predicted to repaint; a repaint that would overlap one of those is
+ * moved to end before it starts instead.  start and the result are in
+ * usec from now.
+ */
+static uint32_t
+weston_output_repaint_avoid_others(struct weston_output *output,
+				   uint32_t start, uint32_t predicted)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_output *other;
+	struct timespec now;
+	int64_t begin = start, other_begin;
+	int moved, i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* Moving may make it overlap another, so go round a few times. */
+	for (i = 0, moved = 1; moved && i < 4; i++) {
+		moved = 0;
+		wl_list_for_each(other, &compositor->output_list, link) {
+			if (other == output || !other->repaint_timer_armed)
+				continue;
+
+			other_begin = weston_output_repaint_timer_left(other,
+								       &now);
+			if (begin < other_begin + other->repaint_predicted &&
+			    other_begin < begin + predicted) {
+				begin = other_begin - predicted;
+				moved = 1;
+			}
+		}
+	}
+
+	if (begin < 0)
+		return 0;
+
+	return begin;
+}
+
+static void
+weston_output_arm_repaint_timer(struct weston_output *output,
+				uint32_t delay, uint32_t predicted)
+{
+	clock_gettime(CLOCK_MONOTONIC, &output->repaint_start);
+	output->repaint_start.tv_sec += delay / 1000;
+	output->repaint_start.tv_nsec += (delay % 1000) * 1000000;
+	if (output->repaint_start.tv_nsec >= 1000000000) {
+		output->repaint_start.tv_sec++;
+		output->repaint_start.tv_nsec -= 1000000000;
+	}
+	output->repaint_predicted = predicted;
+	output->repaint_timer_armed = 1;
+
+	wl_event_source_timer_update(output->repaint_timer, delay);
+}
+
+/* Sends presented to the feedback of the frame just shown on output.
+ * stamp is on compositor->presentation_clock, seq the output's vblank
+ * counter if it has one, flags the presentation_feedback_kind that
+ * hold for the whole frame.  Backends call this before
+ * weston_output_finish_frame(), which otherwise does it with the time
+ * it is called at. */
+WL_EXPORT void
+weston_output_present(struct weston_output *output,
+		      const struct timespec *stamp, uint64_t seq,
+		      uint32_t flags)
+{
+	struct weston_presentation_feedback *feedback, *next;
+	struct wl_resource *resource;
+	struct wl_client *client;
+	uint32_t refresh = 0;
+	uint64_t sec = stamp->tv_sec;
+
+	if (output->current && output->current->refresh)
+		refresh = 1000000000000ULL / output->current->refresh;
+
+	wl_list_for_each_safe(feedback, next, &output->feedback_list, link) {
+		client = feedback->resource.client;
+		wl_list_for_each(resource, &output->resource_list, link)
+			if (resource->client == client)
+				presentation_feedback_send_sync_output(
+					&feedback->resource, resource);
+
+		presentation_feedback_send_presented(&feedback->resource,
+						     sec >> 32, sec,
+						     stamp->tv_nsec, refresh,
+						     seq >> 32, seq,
+						     flags | feedback->flags);
+		wl_resource_destroy(&feedback->resource);
+	}
+}
+
+/* For backends whose frame never made it to the screen. */
+WL_EXPORT void
+weston_output_discard_feedback(struct weston_output *output)
+{
+	weston_presentation_feedback_discard_list(&output->feedback_list);
+}
+
 WL_EXPORT void
 weston_output_finish_frame(struct weston_output *output, uint32_t msecs)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct wl_event_loop *loop =
 		wl_display_get_event_loop(compositor->wl_display);
+	struct timespec now;
 	int fd;
 
+	uint32_t period, predicted, delay;
+
+	weston_output_timing_flip_done(output);
+
+	if (!wl_list_empty(&output->feedback_list)) {
+		clock_gettime(compositor->presentation_clock, &now);
+		weston_output_present(output, &now, 0, 0);
+	}
+
 	output->frame_time = msecs;
 	if (output->repaint_needed) {
+		/* Rather than repainting right after the flip, which
+		 * leaves the new frame waiting for almost a full refresh
+		 * period, start as late as the measured repaint time
+		 * allows, so the frame picks up more recent input and
+		 * client content. */
+		predicted = weston_output_predict_repaint(output);
+		if (compositor->repaint_deadline && predicted &&
+		    output->current && output->current->refresh) {
+			period = 1000000000 / output->current->refresh;
+			delay = predicted + compositor->repaint_margin * 1000;
+			if (delay < period) {
+				delay = weston_output_repaint_avoid_others(
+					output, period - delay, predicted);
+				delay /= 1000;
+				if (delay > 0) {
+					weston_output_arm_repaint_timer(
+						output, delay, predicted);
+					return;
+				}
+			}
+		}
+
 		weston_output_repaint(output, msecs);
 		return;
 	}
 
 	output->repaint_scheduled = 0;
+	weston_compositor_flush_motion(compositor);
 	if (compositor->input_loop_source)
 		return;
 
@@ -1303,20 +2621,81 @@ weston_output_finish_frame(struct weston_output *output, uint32_t msecs)
 				     weston_compositor_read_input, compositor);
 }
 
+static int
+output_repaint_timer_handler(void *data)
+{
+	struct weston_output *output = data;
+
+	output->repaint_timer_armed = 0;
+	weston_output_repaint(output, output->frame_time);
+
+	return 1;
+}
+
 static void
 idle_repaint(void *data)
 {
 	struct weston_output *output = data;
 
-	weston_output_finish_frame(output, weston_compositor_get_time());
-}
+	weston_output_finish_frame(output, weston_compositor_get_time());
+}
+
+WL_EXPORT void
+weston_compositor_stacking_dirty(struct weston_compositor *compositor)
+{
+	compositor->surface_list_dirty = 1;
+}
+
+WL_EXPORT void
+weston_layer_init(struct weston_layer *layer, struct wl_list *below)
+{
+	wl_list_init(&layer->surface_list);
+	layer->idle_frames = 0;
+	layer->serial = 0;
+	if (below != NULL)
+		wl_list_insert(below, &layer->link);
+}
+
+/*
+ * A surface covering the output that shows what the surfaces of the
+ * layer looked like on it, so the layer can be animated as a whole
+ * without repainting each of them.  The caller adds it to a layer and
+ * destroys it.  Returns NULL if the renderer cannot do this.
+ */
+WL_EXPORT struct weston_surface *
+weston_layer_snapshot(struct weston_layer *layer,
+		      struct weston_output *output)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_surface *snapshot, *es;
+
+	if (ec->renderer->snapshot_layer == NULL)
+		return NULL;
+
+	snapshot = weston_surface_create(ec);
+	if (snapshot == NULL)
+		return NULL;
+
+	weston_surface_configure(snapshot, output->x, output->y,
+				 output->width, output->height);
+
+	/* the clip is what covered the surface in the last repaint, the
+	 * snapshot shows all of the layer; the next repaint the surface
+	 * is part of sets it again */
+	wl_list_for_each(es, &layer->surface_list, layer_link) {
+		weston_surface_update_transform(es);
+		if (es->buffer_ref.buffer &&
+		    wl_buffer_is_shm(es->buffer_ref.buffer))
+			ec->renderer->flush_damage(es);
+		empty_region(&es->clip);
+	}
+
+	if (ec->renderer->snapshot_layer(snapshot, layer, output) < 0) {
+		weston_surface_destroy(snapshot);
+		return NULL;
+	}
 
-WL_EXPORT void
-weston_layer_init(struct weston_layer *layer, struct wl_list *below)
-{
-	wl_list_init(&layer->surface_list);
-	if (below != NULL)
-		wl_list_insert(below, &layer->link);
+	return snapshot;
 }
 
 WL_EXPORT void
@@ -1384,6 +2763,113 @@ surface_attach(struct wl_client *client,
 	}
 }
 
+static void
+client_stats_destroy(struct wl_listener *listener, void *data)
+{
+	struct weston_client_stats *stats =
+		container_of(listener, struct weston_client_stats,
+			     destroy_listener);
+
+	wl_list_remove(&stats->link);
+	free(stats);
+}
+
+WL_EXPORT struct weston_client_stats *
+weston_client_stats_get(struct weston_compositor *ec,
+			struct wl_client *client)
+{
+	struct weston_client_stats *stats;
+	struct wl_listener *listener;
+
+	listener = wl_client_get_destroy_listener(client,
+						  client_stats_destroy);
+	if (listener)
+		return container_of(listener, struct weston_client_stats,
+				    destroy_listener);
+
+	stats = calloc(1, sizeof *stats);
+	if (stats == NULL)
+		return NULL;
+
+	stats->client = client;
+	stats->destroy_listener.notify = client_stats_destroy;
+	wl_client_add_destroy_listener(client, &stats->destroy_listener);
+	wl_list_insert(&ec->client_stats_list, &stats->link);
+
+	return stats;
+}
+
+/* Runs once the main loop is done dispatching what woke it. */
+static void
+client_budget_reset(void *data)
+{
+	struct weston_compositor *ec = data;
+	struct weston_client_stats *stats;
+
+	ec->client_budget_idle = NULL;
+	wl_list_for_each(stats, &ec->client_stats_list, link)
+		stats->iteration_requests = 0;
+}
+
+/* Counts a damage or region request of client, and returns 0 if it is
+ * over its budget for this main loop iteration. */
+static int
+client_request_in_budget(struct weston_compositor *ec,
+			 struct wl_client *client)
+{
+	struct weston_client_stats *stats;
+	struct wl_event_loop *loop;
+
+	stats = weston_client_stats_get(ec, client);
+	if (stats == NULL)
+		return 1;
+
+	stats->requests++;
+	if (ec->client_request_budget <= 0)
+		return 1;
+
+	if (!ec->client_budget_idle) {
+		loop = wl_display_get_event_loop(ec->wl_display);
+		ec->client_budget_idle =
+			wl_event_loop_add_idle(loop, client_budget_reset, ec);
+	}
+
+	if (++stats->iteration_requests <= (uint32_t) ec->client_request_budget)
+		return 1;
+
+	stats->throttled++;
+
+	return 0;
+}
+
+/* Grows region to the bounding box of itself and the rectangle, at a
+ * constant cost however many rectangles it has. */
+static void
+region_extend(pixman_region32_t *region,
+	      int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	pixman_box32_t box = *pixman_region32_extents(region);
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	if (!pixman_region32_not_empty(region)) {
+		box.x1 = x;
+		box.y1 = y;
+		box.x2 = x + width;
+		box.y2 = y + height;
+	} else {
+		box.x1 = min(box.x1, x);
+		box.y1 = min(box.y1, y);
+		box.x2 = max(box.x2, x + width);
+		box.y2 = max(box.y2, y + height);
+	}
+
+	pixman_region32_fini(region);
+	pixman_region32_init_rect(region, box.x1, box.y1,
+				  box.x2 - box.x1, box.y2 - box.y1);
+}
+
 static void
 surface_damage(struct wl_client *client,
 	       struct wl_resource *resource,
@@ -1391,9 +2877,12 @@ surface_damage(struct wl_client *client,
 {
 	struct weston_surface *surface = resource->data;
 
-	pixman_region32_union_rect(&surface->pending.damage,
-				   &surface->pending.damage,
-				   x, y, width, height);
+	if (client_request_in_budget(surface->compositor, client))
+		pixman_region32_union_rect(&surface->pending.damage,
+					   &surface->pending.damage,
+					   x, y, width, height);
+	else
+		region_extend(&surface->pending.damage, x, y, width, height);
 }
 
 static void
@@ -1402,7 +2891,7 @@ destroy_frame_callback(struct wl_resource *resource)
 	struct weston_frame_callback *cb = resource->data;
 
 	wl_list_remove(&cb->link);
-	free(cb);
+	weston_slab_free(&frame_callback_slab, cb);
 }
 
 static void
@@ -1412,7 +2901,7 @@ surface_frame(struct wl_client *client,
 	struct weston_frame_callback *cb;
 	struct weston_surface *surface = resource->data;
 
-	cb = malloc(sizeof *cb);
+	cb = weston_slab_alloc(&frame_callback_slab);
 	if (cb == NULL) {
 		wl_resource_post_no_memory(resource);
 		return;
@@ -1428,6 +2917,27 @@ surface_frame(struct wl_client *client,
 	wl_list_insert(surface->pending.frame_callback_list.prev, &cb->link);
 }
 
+/* Merges the rectangles added over budget, letting pixman sort them
+ * all at once rather than redo the region for each. */
+static void
+weston_region_flush(struct weston_region *region)
+{
+	pixman_box32_t *boxes;
+	pixman_region32_t deferred;
+	int n;
+
+	if (region->deferred.size == 0)
+		return;
+
+	boxes = region->deferred.data;
+	n = region->deferred.size / sizeof *boxes;
+	pixman_region32_init_rects(&deferred, boxes, n);
+	pixman_region32_union(&region->region, &region->region, &deferred);
+	pixman_region32_fini(&deferred);
+
+	region->deferred.size = 0;
+}
+
 static void
 surface_set_opaque_region(struct wl_client *client,
 			  struct wl_resource *resource,
@@ -1436,13 +2946,12 @@ surface_set_opaque_region(struct wl_client *client,
 	struct weston_surface *surface = resource->data;
 	struct weston_region *region;
 
-	if (region_resource) {
-		region = region_resource->data;
-		pixman_region32_copy(&surface->pending.opaque,
-				     &region->region);
-	} else {
-		empty_region(&surface->pending.opaque);
-	}
+	region = region_resource ? region_resource->data : NULL;
+	if (region)
+		weston_region_flush(region);
+	if (weston_surface_set_pending_opaque(surface,
+					      region ? &region->region : NULL) < 0)
+		wl_resource_post_no_memory(resource);
 }
 
 static void
@@ -1453,28 +2962,111 @@ surface_set_input_region(struct wl_client *client,
 	struct weston_surface *surface = resource->data;
 	struct weston_region *region;
 
-	if (region_resource) {
-		region = region_resource->data;
-		pixman_region32_copy(&surface->pending.input,
-				     &region->region);
-	} else {
-		pixman_region32_fini(&surface->pending.input);
-		region_init_infinite(&surface->pending.input);
+	region = region_resource ? region_resource->data : NULL;
+	if (region)
+		weston_region_flush(region);
+	if (weston_surface_set_pending_input(surface,
+					     region ? &region->region : NULL) < 0)
+		wl_resource_post_no_memory(resource);
+}
+
+/*
+ * Trade a little overdraw for fewer texture uploads and draws: damage
+ * that covers most of its bounding box becomes that box, and damage
+ * with too many rectangles is cut down to one box per horizontal band
+ * of the region, and then to boxes over runs of adjacent bands.
+ */
+
+static void
+simplify_damage(struct weston_compositor *ec, pixman_region32_t *region)
+{
+	pixman_box32_t *rects, *boxes, extents, box;
+	uint64_t area = 0, bbox_area;
+	int i, j, k, n, nboxes, run;
+
+	if (ec->damage_max_rectangles <= 0)
+		return;
+
+	rects = pixman_region32_rectangles(region, &n);
+	if (n <= 1)
+		return;
+
+	extents = *pixman_region32_extents(region);
+	for (i = 0; i < n; i++)
+		area += (uint64_t) (rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+	bbox_area = (uint64_t) (extents.x2 - extents.x1) *
+		(extents.y2 - extents.y1);
+
+	if ((bbox_area - area) * 100 <= bbox_area * ec->damage_max_waste)
+		goto bbox;
+
+	if (n <= ec->damage_max_rectangles)
+		return;
+
+	boxes = malloc(n * sizeof *boxes);
+	if (boxes == NULL)
+		goto bbox;
+
+	/* pixman keeps the rectangles of a band next to each other */
+	nboxes = 0;
+	for (i = 0; i < n; i++) {
+		if (nboxes > 0 && boxes[nboxes - 1].y1 == rects[i].y1) {
+			boxes[nboxes - 1].x1 = min(boxes[nboxes - 1].x1,
+						   rects[i].x1);
+			boxes[nboxes - 1].x2 = max(boxes[nboxes - 1].x2,
+						   rects[i].x2);
+		} else {
+			boxes[nboxes++] = rects[i];
+		}
 	}
+
+	if (nboxes > ec->damage_max_rectangles) {
+		run = (nboxes + ec->damage_max_rectangles - 1) /
+			ec->damage_max_rectangles;
+		for (i = 0, j = 0; i < nboxes; i += run, j++) {
+			box = boxes[i];
+			for (k = i + 1; k < i + run && k < nboxes; k++) {
+				box.x1 = min(box.x1, boxes[k].x1);
+				box.x2 = max(box.x2, boxes[k].x2);
+				box.y2 = boxes[k].y2;
+			}
+			boxes[j] = box;
+		}
+		nboxes = j;
+	}
+
+	pixman_region32_fini(region);
+	pixman_region32_init_rects(region, boxes, nboxes);
+	free(boxes);
+
+	return;
+
+bbox:
+	pixman_region32_fini(region);
+	pixman_region32_init_rect(region, extents.x1, extents.y1,
+				  extents.x2 - extents.x1,
+				  extents.y2 - extents.y1);
 }
 
 static void
 surface_commit(struct wl_client *client, struct wl_resource *resource)
 {
 	struct weston_surface *surface = resource->data;
-	pixman_region32_t opaque;
+	pixman_region32_t opaque, input;
 	int buffer_width = 0;
 	int buffer_height = 0;
+	int resized;
+
+	WESTON_TRACE_BEGIN(WESTON_TRACE_SURFACE, "surface_commit");
 
 	/* wl_surface.set_buffer_rotation */
 	surface->buffer_transform = surface->pending.buffer_transform;
 
-	/* wl_surface.attach */
+	/* wl_surface.attach; the content the feedback of the previous
+	 * commit was for is gone unless a repaint took it already. */
+	if (surface->pending.newly_attached)
+		weston_presentation_feedback_discard_list(&surface->feedback_list);
 	if (surface->pending.buffer || surface->pending.newly_attached)
 		weston_surface_attach(surface, surface->pending.buffer);
 
@@ -1495,43 +3087,83 @@ surface_commit(struct wl_client *client, struct wl_resource *resource)
 	surface->pending.sy = 0;
 	surface->pending.newly_attached = 0;
 
+	/* The committed regions are the pending ones clipped to the
+	 * surface, so they only need redoing when either changes. */
+	resized = surface->pending.region_width != surface->geometry.width ||
+		surface->pending.region_height != surface->geometry.height;
+	if (resized) {
+		surface->pending.region_width = surface->geometry.width;
+		surface->pending.region_height = surface->geometry.height;
+		surface->pending.opaque_dirty = 1;
+		surface->pending.input_dirty = 1;
+	}
+
+	surface->compositor->commit_stats.total++;
+	if (!surface->pending.opaque_dirty && !surface->pending.input_dirty)
+		surface->compositor->commit_stats.fast++;
+
 	/* wl_surface.damage */
-	pixman_region32_union(&surface->damage, &surface->damage,
-			      &surface->pending.damage);
-	pixman_region32_intersect_rect(&surface->damage, &surface->damage,
-				       0, 0,
-				       surface->geometry.width,
-				       surface->geometry.height);
+	if (resized || pixman_region32_not_empty(&surface->pending.damage)) {
+		pixman_region32_union(&surface->damage, &surface->damage,
+				      &surface->pending.damage);
+		pixman_region32_intersect_rect(&surface->damage,
+					       &surface->damage, 0, 0,
+					       surface->geometry.width,
+					       surface->geometry.height);
+		simplify_damage(surface->compositor, &surface->damage);
+	}
+	surface->compositor->renderer->commit(surface,
+					      &surface->pending.damage);
 	empty_region(&surface->pending.damage);
 
 	/* wl_surface.set_opaque_region */
-	pixman_region32_init_rect(&opaque, 0, 0,
-				  surface->geometry.width,
-				  surface->geometry.height);
-	pixman_region32_intersect(&opaque,
-				  &opaque, &surface->pending.opaque);
+	if (surface->pending.opaque_dirty) {
+		pixman_region32_init(&opaque);
+		if (surface->pending.opaque)
+			pixman_region32_intersect_rect(&opaque,
+						       surface->pending.opaque,
+						       0, 0,
+						       surface->geometry.width,
+						       surface->geometry.height);
+
+		if (!pixman_region32_equal(&opaque, &surface->opaque)) {
+			pixman_region32_copy(&surface->opaque, &opaque);
+			weston_surface_geometry_dirty(surface);
+		}
 
-	if (!pixman_region32_equal(&opaque, &surface->opaque)) {
-		pixman_region32_copy(&surface->opaque, &opaque);
-		weston_surface_geometry_dirty(surface);
+		pixman_region32_fini(&opaque);
+		surface->pending.opaque_dirty = 0;
 	}
 
-	pixman_region32_fini(&opaque);
-
 	/* wl_surface.set_input_region */
-	pixman_region32_fini(&surface->input);
-	pixman_region32_init_rect(&surface->input, 0, 0,
-				  surface->geometry.width,
-				  surface->geometry.height);
-	pixman_region32_intersect(&surface->input,
-				  &surface->input, &surface->pending.input);
+	if (surface->pending.input_dirty) {
+		pixman_region32_init_rect(&input, 0, 0,
+					  surface->geometry.width,
+					  surface->geometry.height);
+		if (surface->pending.input)
+			pixman_region32_intersect(&input, &input,
+						  surface->pending.input);
+		if (!pixman_region32_equal(&input, &surface->input)) {
+			pixman_region32_copy(&surface->input, &input);
+			weston_compositor_pick_dirty(surface->compositor);
+		}
+		pixman_region32_fini(&input);
+		surface->pending.input_dirty = 0;
+	}
 
 	/* wl_surface.frame */
 	wl_list_insert_list(&surface->frame_callback_list,
 			    &surface->pending.frame_callback_list);
 	wl_list_init(&surface->pending.frame_callback_list);
 
+	/* presentation.feedback */
+	wl_list_insert_list(&surface->feedback_list,
+			    &surface->pending.feedback_list);
+	wl_list_init(&surface->pending.feedback_list);
+
 	weston_surface_schedule_repaint(surface);
+
+	WESTON_TRACE_END(WESTON_TRACE_SURFACE, "surface_commit");
 }
 
 static void
@@ -1585,7 +3217,8 @@ destroy_region(struct wl_resource *resource)
 		container_of(resource, struct weston_region, resource);
 
 	pixman_region32_fini(&region->region);
-	free(region);
+	wl_array_release(&region->deferred);
+	weston_slab_free(&region_slab, region);
 }
 
 static void
@@ -1599,9 +3232,28 @@ region_add(struct wl_client *client, struct wl_resource *resource,
 	   int32_t x, int32_t y, int32_t width, int32_t height)
 {
 	struct weston_region *region = resource->data;
+	struct weston_compositor *ec = region->compositor;
+	pixman_box32_t *box;
+
+	if (client_request_in_budget(ec, client)) {
+		pixman_region32_union_rect(&region->region, &region->region,
+					   x, y, width, height);
+		return;
+	}
+
+	if (width <= 0 || height <= 0)
+		return;
 
-	pixman_region32_union_rect(&region->region, &region->region,
-				   x, y, width, height);
+	box = wl_array_add(&region->deferred, sizeof *box);
+	if (box == NULL) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	box->x1 = x;
+	box->y1 = y;
+	box->x2 = x + width;
+	box->y2 = y + height;
 }
 
 static void
@@ -1611,6 +3263,9 @@ region_subtract(struct wl_client *client, struct wl_resource *resource,
 	struct weston_region *region = resource->data;
 	pixman_region32_t rect;
 
+	client_request_in_budget(region->compositor, client);
+	weston_region_flush(region);
+
 	pixman_region32_init_rect(&rect, x, y, width, height);
 	pixman_region32_subtract(&region->region, &region->region, &rect);
 	pixman_region32_fini(&rect);
@@ -1628,7 +3283,7 @@ compositor_create_region(struct wl_client *client,
 {
 	struct weston_region *region;
 
-	region = malloc(sizeof *region);
+	region = weston_slab_alloc(&region_slab);
 	if (region == NULL) {
 		wl_resource_post_no_memory(resource);
 		return;
@@ -1641,8 +3296,10 @@ compositor_create_region(struct wl_client *client,
 	region->resource.object.implementation =
 		(void (**)(void)) &region_interface;
 	region->resource.data = region;
+	region->compositor = resource->data;
 
 	pixman_region32_init(&region->region);
+	wl_array_init(&region->deferred);
 
 	wl_client_add_resource(client, &region->resource);
 }
@@ -1800,6 +3457,26 @@ clip_pointer_motion(struct weston_seat *seat, wl_fixed_t *fx, wl_fixed_t *fy)
 	}
 }
 
+/* When a pointer sprite or drag icon only moved within the cursor
+ * plane of its output, the backend can put it there directly, ahead of
+ * any repaint. */
+static int
+move_surface_cursor(struct weston_surface *surface)
+{
+	struct weston_output *output;
+
+	wl_list_for_each(output, &surface->compositor->output_list, link) {
+		if (surface->output_mask != (1u << output->id))
+			continue;
+		if (output->move_cursor == NULL || output->zoom.active)
+			return -1;
+
+		return output->move_cursor(output, surface);
+	}
+
+	return -1;
+}
+
 /* Takes absolute values */
 static void
 move_pointer(struct weston_seat *seat, wl_fixed_t x, wl_fixed_t y)
@@ -1831,8 +3508,199 @@ move_pointer(struct weston_seat *seat, wl_fixed_t x, wl_fixed_t y)
 		weston_surface_set_position(seat->sprite,
 					    ix - seat->hotspot_x,
 					    iy - seat->hotspot_y);
-		weston_surface_schedule_repaint(seat->sprite);
+		if (move_surface_cursor(seat->sprite) < 0)
+			weston_surface_schedule_repaint(seat->sprite);
+	}
+}
+
+/*
+ * With input-batching, the motion the default pointer and touch grabs
+ * send is held back while the compositor is repainting, keeping only
+ * the latest position, and goes out just before the frame callbacks.
+ * Clients then get at most one motion event per frame.  Everything a
+ * client could order against the motion sends it first.
+ */
+struct weston_touch_motion {
+	int32_t touch_id;
+	uint32_t time;
+	wl_fixed_t sx, sy;
+};
+
+static int
+weston_compositor_batching_motion(struct weston_compositor *ec)
+{
+	struct weston_output *output;
+
+	wl_list_for_each(output, &ec->output_list, link)
+		if (output->repaint_scheduled)
+			return 1;
+
+	return 0;
+}
+
+static void
+weston_seat_flush_motion(struct weston_seat *seat)
+{
+	struct weston_touch_motion *m, *end;
+
+	if (seat->batch.pointer_pending) {
+		seat->batch.pointer_pending = 0;
+		/* unless the focus changed behind the grab's back */
+		if (seat->pointer.focus_resource == seat->batch.pointer_resource)
+			seat->batch.pointer_interface->motion(
+				&seat->pointer.default_grab,
+				seat->batch.pointer_time,
+				seat->batch.pointer_sx,
+				seat->batch.pointer_sy);
+	}
+
+	if (seat->batch.touch.size == 0)
+		return;
+
+	end = seat->batch.touch.data + seat->batch.touch.size;
+	if (seat->touch.focus_resource == seat->batch.touch_resource)
+		for (m = seat->batch.touch.data; m < end; m++)
+			seat->batch.touch_interface->motion(
+				&seat->touch.default_grab,
+				m->time, m->touch_id, m->sx, m->sy);
+	seat->batch.touch.size = 0;
+}
+
+static void
+weston_compositor_flush_motion(struct weston_compositor *ec)
+{
+	struct weston_seat *seat;
+
+	if (!ec->input_batching)
+		return;
+
+	wl_list_for_each(seat, &ec->seat_list, link)
+		weston_seat_flush_motion(seat);
+}
+
+static void
+batch_pointer_focus(struct wl_pointer_grab *grab,
+		    struct wl_surface *surface, wl_fixed_t x, wl_fixed_t y)
+{
+	struct weston_seat *seat =
+		container_of(grab->pointer, struct weston_seat, pointer);
+
+	if (surface != grab->pointer->focus)
+		weston_seat_flush_motion(seat);
+	seat->batch.pointer_interface->focus(grab, surface, x, y);
+}
+
+static void
+batch_pointer_motion(struct wl_pointer_grab *grab,
+		     uint32_t time, wl_fixed_t x, wl_fixed_t y)
+{
+	struct weston_seat *seat =
+		container_of(grab->pointer, struct weston_seat, pointer);
+
+	if (!weston_compositor_batching_motion(seat->compositor)) {
+		weston_seat_flush_motion(seat);
+		seat->batch.pointer_interface->motion(grab, time, x, y);
+		return;
+	}
+
+	seat->batch.pointer_pending = 1;
+	seat->batch.pointer_resource = grab->pointer->focus_resource;
+	seat->batch.pointer_time = time;
+	seat->batch.pointer_sx = x;
+	seat->batch.pointer_sy = y;
+}
+
+static void
+batch_pointer_button(struct wl_pointer_grab *grab,
+		     uint32_t time, uint32_t button, uint32_t state)
+{
+	struct weston_seat *seat =
+		container_of(grab->pointer, struct weston_seat, pointer);
+
+	weston_seat_flush_motion(seat);
+	seat->batch.pointer_interface->button(grab, time, button, state);
+}
+
+static const struct wl_pointer_grab_interface batch_pointer_interface = {
+	batch_pointer_focus,
+	batch_pointer_motion,
+	batch_pointer_button
+};
+
+static void
+batch_touch_down(struct wl_touch_grab *grab, uint32_t time,
+		 int touch_id, wl_fixed_t sx, wl_fixed_t sy)
+{
+	struct weston_seat *seat =
+		container_of(grab->touch, struct weston_seat, touch);
+
+	weston_seat_flush_motion(seat);
+	seat->batch.touch_interface->down(grab, time, touch_id, sx, sy);
+}
+
+static void
+batch_touch_up(struct wl_touch_grab *grab, uint32_t time, int touch_id)
+{
+	struct weston_seat *seat =
+		container_of(grab->touch, struct weston_seat, touch);
+
+	weston_seat_flush_motion(seat);
+	seat->batch.touch_interface->up(grab, time, touch_id);
+}
+
+static void
+batch_touch_motion(struct wl_touch_grab *grab, uint32_t time,
+		   int touch_id, wl_fixed_t sx, wl_fixed_t sy)
+{
+	struct weston_seat *seat =
+		container_of(grab->touch, struct weston_seat, touch);
+	struct weston_touch_motion *m, *end;
+
+	if (!weston_compositor_batching_motion(seat->compositor)) {
+		weston_seat_flush_motion(seat);
+		seat->batch.touch_interface->motion(grab, time,
+						    touch_id, sx, sy);
+		return;
+	}
+
+	if (seat->batch.touch_resource != grab->touch->focus_resource) {
+		weston_seat_flush_motion(seat);
+		seat->batch.touch_resource = grab->touch->focus_resource;
+	}
+
+	end = seat->batch.touch.data + seat->batch.touch.size;
+	for (m = seat->batch.touch.data; m < end; m++)
+		if (m->touch_id == touch_id)
+			break;
+
+	if (m == end) {
+		m = wl_array_add(&seat->batch.touch, sizeof *m);
+		if (m == NULL)
+			return;
+		m->touch_id = touch_id;
 	}
+
+	m->time = time;
+	m->sx = sx;
+	m->sy = sy;
+}
+
+static const struct wl_touch_grab_interface batch_touch_interface = {
+	batch_touch_down,
+	batch_touch_up,
+	batch_touch_motion
+};
+
+/* Remembers when the first input event since the last repaint came
+ * in, for the input latency in weston_output_stats. */
+static void
+weston_compositor_stamp_input(struct weston_compositor *ec)
+{
+	if (ec->input_stamped)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ec->input_time);
+	ec->input_stamped = 1;
 }
 
 WL_EXPORT void
@@ -1843,6 +3711,9 @@ notify_motion(struct weston_seat *seat,
 	struct weston_compositor *ec = seat->compositor;
 	struct wl_pointer *pointer = seat->seat.pointer;
 
+	WESTON_TRACE_INSTANT(WESTON_TRACE_INPUT, "notify_motion", time);
+	weston_compositor_stamp_input(ec);
+
 	weston_compositor_wake(ec);
 
 	move_pointer(seat, pointer->x + dx, pointer->y + dy);
@@ -1860,6 +3731,9 @@ notify_motion_absolute(struct weston_seat *seat,
 	struct weston_compositor *ec = seat->compositor;
 	struct wl_pointer *pointer = seat->seat.pointer;
 
+	WESTON_TRACE_INSTANT(WESTON_TRACE_INPUT, "notify_motion_absolute", time);
+	weston_compositor_stamp_input(ec);
+
 	weston_compositor_wake(ec);
 
 	move_pointer(seat, x, y);
@@ -1893,6 +3767,9 @@ notify_button(struct weston_seat *seat, uint32_t time, int32_t button,
 		(struct weston_surface *) pointer->focus;
 	uint32_t serial = wl_display_next_serial(compositor->wl_display);
 
+	WESTON_TRACE_INSTANT(WESTON_TRACE_INPUT, "notify_button", button);
+	weston_compositor_stamp_input(compositor);
+
 	if (state == WL_POINTER_BUTTON_STATE_PRESSED) {
 		if (compositor->ping_handler && focus)
 			compositor->ping_handler(focus, serial);
@@ -1909,6 +3786,7 @@ notify_button(struct weston_seat *seat, uint32_t time, int32_t button,
 		pointer->button_count--;
 	}
 
+	weston_seat_flush_motion(seat);
 	weston_compositor_run_button_binding(compositor, seat, time, button,
 					     state);
 
@@ -1929,6 +3807,9 @@ notify_axis(struct weston_seat *seat, uint32_t time, uint32_t axis,
 		(struct weston_surface *) pointer->focus;
 	uint32_t serial = wl_display_next_serial(compositor->wl_display);
 
+	WESTON_TRACE_INSTANT(WESTON_TRACE_INPUT, "notify_axis", axis);
+	weston_compositor_stamp_input(compositor);
+
 	if (compositor->ping_handler && focus)
 		compositor->ping_handler(focus, serial);
 
@@ -1941,6 +3822,7 @@ notify_axis(struct weston_seat *seat, uint32_t time, uint32_t axis,
 						   time, axis, value))
 		return;
 
+	weston_seat_flush_motion(seat);
 	if (pointer->focus_resource)
 		wl_pointer_send_axis(pointer->focus_resource, time, axis,
 				     value);
@@ -2045,6 +3927,9 @@ notify_key(struct weston_seat *seat, uint32_t time, uint32_t key,
 	uint32_t serial = wl_display_next_serial(compositor->wl_display);
 	uint32_t *k, *end;
 
+	WESTON_TRACE_INSTANT(WESTON_TRACE_INPUT, "notify_key", key);
+	weston_compositor_stamp_input(compositor);
+
 	if (state == WL_KEYBOARD_KEY_STATE_PRESSED) {
 		if (compositor->ping_handler && focus)
 			compositor->ping_handler(focus, serial);
@@ -2078,6 +3963,7 @@ notify_key(struct weston_seat *seat, uint32_t time, uint32_t key,
 		grab = keyboard->keyboard.grab;
 	}
 
+	weston_seat_flush_motion(seat);
 	grab->interface->key(grab, time, key, state);
 
 	if (update_state == STATE_UPDATE_AUTOMATIC) {
@@ -2227,6 +4113,9 @@ notify_touch(struct weston_seat *seat, uint32_t time, int touch_id,
 	struct weston_surface *es;
 	wl_fixed_t sx, sy;
 
+	WESTON_TRACE_INSTANT(WESTON_TRACE_INPUT, "notify_touch", touch_id);
+	weston_compositor_stamp_input(ec);
+
 	/* Update grab's global coordinates. */
 	touch->grab_x = x;
 	touch->grab_y = y;
@@ -2276,6 +4165,32 @@ notify_touch(struct weston_seat *seat, uint32_t time, int touch_id,
 	}
 }
 
+/* There is no gesture protocol, they only go to the shell and other
+ * listeners of the compositor's gesture_signal. */
+WL_EXPORT void
+notify_gesture(struct weston_seat *seat, uint32_t time,
+	       enum weston_gesture_type type, enum weston_gesture_state state,
+	       int fingers, wl_fixed_t dx, wl_fixed_t dy, wl_fixed_t scale)
+{
+	struct weston_compositor *ec = seat->compositor;
+	struct weston_gesture_event event;
+
+	WESTON_TRACE_INSTANT(WESTON_TRACE_INPUT, "notify_gesture", type);
+
+	weston_compositor_wake(ec);
+
+	event.seat = seat;
+	event.time = time;
+	event.type = type;
+	event.state = state;
+	event.fingers = fingers;
+	event.dx = dx;
+	event.dy = dy;
+	event.scale = scale;
+
+	wl_signal_emit(&ec->gesture_signal, &event);
+}
+
 static void
 pointer_handle_sprite_destroy(struct wl_listener *listener, void *data)
 {
@@ -2306,11 +4221,12 @@ pointer_cursor_surface_configure(struct weston_surface *es,
 	weston_surface_configure(seat->sprite, x, y,
 				 width, height);
 
-	empty_region(&es->pending.input);
+	weston_surface_clear_pending_input(es);
 
 	if (!weston_surface_is_mapped(es)) {
 		wl_list_insert(&es->compositor->cursor_layer.surface_list,
 			       &es->layer_link);
+		weston_compositor_stacking_dirty(es->compositor);
 		weston_surface_update_transform(es);
 	}
 }
@@ -2496,18 +4412,52 @@ bind_seat(struct wl_client *client, void *data, uint32_t version, uint32_t id)
 	if (seat->touch)
 		caps |= WL_SEAT_CAPABILITY_TOUCH;
 
-	wl_seat_send_capabilities(resource, caps);
+	wl_seat_send_capabilities(resource, caps);
+}
+
+static void
+device_handle_new_drag_icon(struct wl_listener *listener, void *data)
+{
+	struct weston_seat *seat;
+
+	seat = container_of(listener, struct weston_seat,
+			    new_drag_icon_listener);
+
+	weston_seat_update_drag_surface(seat, 0, 0);
+}
+
+static void
+weston_compositor_start_keymap(struct weston_compositor *ec);
+static void
+weston_compositor_wait_keymap(struct weston_compositor *ec);
+
+static void
+read_keymap_names(const char *config_file, struct xkb_rule_names *names)
+{
+        const struct config_key keyboard_config_keys[] = {
+		{ "keymap_rules", CONFIG_KEY_STRING, &names->rules },
+		{ "keymap_model", CONFIG_KEY_STRING, &names->model },
+		{ "keymap_layout", CONFIG_KEY_STRING, &names->layout },
+		{ "keymap_variant", CONFIG_KEY_STRING, &names->variant },
+		{ "keymap_options", CONFIG_KEY_STRING, &names->options },
+        };
+	const struct config_section cs[] = {
+                { "keyboard",
+                  keyboard_config_keys, ARRAY_LENGTH(keyboard_config_keys) },
+	};
+
+	memset(names, 0, sizeof *names);
+	parse_config_file(config_file, cs, ARRAY_LENGTH(cs), NULL);
 }
 
 static void
-device_handle_new_drag_icon(struct wl_listener *listener, void *data)
+free_keymap_names(struct xkb_rule_names *names)
 {
-	struct weston_seat *seat;
-
-	seat = container_of(listener, struct weston_seat,
-			    new_drag_icon_listener);
-
-	weston_seat_update_drag_surface(seat, 0, 0);
+	free((char *) names->rules);
+	free((char *) names->model);
+	free((char *) names->layout);
+	free((char *) names->variant);
+	free((char *) names->options);
 }
 
 static int
@@ -2531,6 +4481,8 @@ weston_compositor_xkb_init(struct weston_compositor *ec,
 	if (!ec->xkb_names.layout)
 		ec->xkb_names.layout = strdup("us");
 
+	weston_compositor_start_keymap(ec);
+
 	return 0;
 }
 
@@ -2539,19 +4491,15 @@ static void xkb_info_destroy(struct weston_xkb_info *xkb_info)
 	if (xkb_info->keymap)
 		xkb_map_unref(xkb_info->keymap);
 
-	if (xkb_info->keymap_area)
-		munmap(xkb_info->keymap_area, xkb_info->keymap_size);
 	if (xkb_info->keymap_fd >= 0)
 		close(xkb_info->keymap_fd);
 }
 
 static void weston_compositor_xkb_destroy(struct weston_compositor *ec)
 {
-	free((char *) ec->xkb_names.rules);
-	free((char *) ec->xkb_names.model);
-	free((char *) ec->xkb_names.layout);
-	free((char *) ec->xkb_names.variant);
-	free((char *) ec->xkb_names.options);
+	weston_compositor_wait_keymap(ec);
+
+	free_keymap_names(&ec->xkb_names);
 
 	xkb_info_destroy(&ec->xkb_info);
 	xkb_context_unref(ec->xkb_context);
@@ -2590,43 +4538,251 @@ weston_xkb_info_new_keymap(struct weston_xkb_info *xkb_info)
 	}
 	xkb_info->keymap_size = strlen(keymap_str) + 1;
 
-	xkb_info->keymap_fd = os_create_anonymous_file(xkb_info->keymap_size);
+	/* sealed, so every seat and client can share the one file */
+	xkb_info->keymap_fd = os_create_sealed_file(keymap_str,
+						    xkb_info->keymap_size);
+	free(keymap_str);
 	if (xkb_info->keymap_fd < 0) {
 		weston_log("creating a keymap file for %lu bytes failed: %m\n",
 			(unsigned long) xkb_info->keymap_size);
-		goto err_keymap_str;
+		return -1;
 	}
 
-	xkb_info->keymap_area = mmap(NULL, xkb_info->keymap_size,
-				     PROT_READ | PROT_WRITE,
-				     MAP_SHARED, xkb_info->keymap_fd, 0);
-	if (xkb_info->keymap_area == MAP_FAILED) {
-		weston_log("failed to mmap() %lu bytes\n",
-			(unsigned long) xkb_info->keymap_size);
-		goto err_dev_zero;
-	}
-	strcpy(xkb_info->keymap_area, keymap_str);
-	free(keymap_str);
+	return 0;
+}
+
+#define KEYMAP_CACHE_MAGIC 0x314b5857	/* "WXK1" */
+
+struct keymap_cache_header {
+	uint32_t magic;
+	uint32_t length;
+	uint64_t key;
+};
+
+static uint64_t
+fnv1a(uint64_t hash, const char *str)
+{
+	const unsigned char *p = (const unsigned char *) (str ? str : "");
+
+	/* the terminator goes in too, so "ab" "c" and "a" "bc" differ */
+	do {
+		hash ^= *p;
+		hash *= 0x100000001b3ULL;
+	} while (*p++);
+
+	return hash;
+}
+
+static uint64_t
+keymap_cache_key(const struct xkb_rule_names *names)
+{
+	uint64_t key = 0xcbf29ce484222325ULL;
+
+	key = fnv1a(key, XKBCOMMON_VERSION);
+	key = fnv1a(key, names->rules);
+	key = fnv1a(key, names->model);
+	key = fnv1a(key, names->layout);
+	key = fnv1a(key, names->variant);
+	key = fnv1a(key, names->options);
+
+	return key;
+}
+
+static int
+keymap_cache_path(uint64_t key, int create, char *path, size_t size)
+{
+	const char *base, *home;
+	char dir[PATH_MAX];
+
+	base = getenv("XDG_CACHE_HOME");
+	if (base)
+		snprintf(dir, sizeof dir, "%s", base);
+	else if ((home = getenv("HOME")))
+		snprintf(dir, sizeof dir, "%s/.cache", home);
+	else
+		return -1;
+
+	if (create)
+		mkdir(dir, 0700);
+	strncat(dir, "/weston", sizeof dir - strlen(dir) - 1);
+	if (create && mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return -1;
+
+	snprintf(path, size, "%s/keymap-%016llx",
+		 dir, (unsigned long long) key);
 
 	return 0;
+}
 
-err_dev_zero:
-	close(xkb_info->keymap_fd);
-	xkb_info->keymap_fd = -1;
-err_keymap_str:
-	free(keymap_str);
-	return -1;
+/*
+ * Compiling a keymap from RMLVO names is one of the slowest parts of
+ * start up, so the serialized result is kept on disk.  The key covers
+ * the names and the libxkbcommon version; when the XKB data files
+ * change underneath, delete ~/.cache/weston/keymap-*.
+ */
+static struct xkb_keymap *
+keymap_cache_load(struct xkb_context *context, uint64_t key)
+{
+	struct keymap_cache_header header;
+	struct xkb_keymap *keymap;
+	char path[PATH_MAX];
+	struct stat st;
+	char *str;
+	int fd;
+
+	if (keymap_cache_path(key, 0, path, sizeof path) < 0)
+		return NULL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 ||
+	    read(fd, &header, sizeof header) != sizeof header ||
+	    header.magic != KEYMAP_CACHE_MAGIC || header.key != key ||
+	    header.length == 0 ||
+	    st.st_size != (off_t) (sizeof header + header.length)) {
+		close(fd);
+		return NULL;
+	}
+
+	str = malloc(header.length);
+	if (!str ||
+	    read(fd, str, header.length) != (ssize_t) header.length ||
+	    str[header.length - 1] != '\0') {
+		free(str);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	keymap = xkb_map_new_from_string(context, str,
+					 XKB_KEYMAP_FORMAT_TEXT_V1, 0);
+	free(str);
+
+	return keymap;
+}
+
+static void
+keymap_cache_store(struct xkb_keymap *keymap, uint64_t key)
+{
+	struct keymap_cache_header header;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	char *str;
+	int fd, ret;
+
+	if (keymap_cache_path(key, 1, path, sizeof path) < 0)
+		return;
+
+	str = xkb_map_get_as_string(keymap);
+	if (!str)
+		return;
+
+	memset(&header, 0, sizeof header);
+	header.magic = KEYMAP_CACHE_MAGIC;
+	header.length = strlen(str) + 1;
+	header.key = key;
+
+	/* written aside and renamed, another compositor may be reading */
+	snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0) {
+		free(str);
+		return;
+	}
+
+	ret = write(fd, &header, sizeof header) == sizeof header &&
+		write(fd, str, header.length) == (ssize_t) header.length;
+	close(fd);
+	free(str);
+
+	if (!ret || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+static struct xkb_keymap *
+keymap_new_from_names(struct xkb_context *context,
+		      const struct xkb_rule_names *names)
+{
+	struct xkb_keymap *keymap;
+	uint64_t key;
+
+	key = keymap_cache_key(names);
+	keymap = keymap_cache_load(context, key);
+	if (keymap)
+		return keymap;
+
+	keymap = xkb_map_new_from_names(context, names, 0);
+	if (keymap)
+		keymap_cache_store(keymap, key);
+
+	return keymap;
+}
+
+/* The global keymap is compiled on a thread of its own from
+ * weston_compositor_init() on, while the backend sets up outputs,
+ * and the first seat that needs it waits for it. */
+static struct {
+	pthread_t thread;
+	int running;
+} keymap_thread;
+
+static void *
+keymap_thread_run(void *data)
+{
+	struct weston_compositor *ec = data;
+	struct xkb_context *context;
+	struct xkb_keymap *keymap;
+
+	/* contexts are not thread safe and the backend may be using
+	 * ec->xkb_context meanwhile */
+	context = xkb_context_new(0);
+	if (context == NULL)
+		return NULL;
+
+	keymap = keymap_new_from_names(context, &ec->xkb_names);
+	xkb_context_unref(context);
+	if (keymap == NULL)
+		return NULL;
+
+	ec->xkb_info.keymap = keymap;
+	if (weston_xkb_info_new_keymap(&ec->xkb_info) < 0) {
+		/* try again, and log why, on the compositor's thread */
+		xkb_map_unref(keymap);
+		ec->xkb_info.keymap = NULL;
+	}
+
+	return NULL;
+}
+
+static void
+weston_compositor_start_keymap(struct weston_compositor *ec)
+{
+	if (pthread_create(&keymap_thread.thread, NULL,
+			   keymap_thread_run, ec) == 0)
+		keymap_thread.running = 1;
+}
+
+static void
+weston_compositor_wait_keymap(struct weston_compositor *ec)
+{
+	if (!keymap_thread.running)
+		return;
+
+	pthread_join(keymap_thread.thread, NULL);
+	keymap_thread.running = 0;
 }
 
 static int
 weston_compositor_build_global_keymap(struct weston_compositor *ec)
 {
+	weston_compositor_wait_keymap(ec);
+
 	if (ec->xkb_info.keymap != NULL)
 		return 0;
 
-	ec->xkb_info.keymap = xkb_map_new_from_names(ec->xkb_context,
-						     &ec->xkb_names,
-						     0);
+	ec->xkb_info.keymap = keymap_new_from_names(ec->xkb_context,
+						    &ec->xkb_names);
 	if (ec->xkb_info.keymap == NULL) {
 		weston_log("failed to compile global XKB keymap\n");
 		weston_log("  tried rules %s, model %s, layout %s, variant %s, "
@@ -2643,6 +4799,88 @@ weston_compositor_build_global_keymap(struct weston_compositor *ec)
 	return 0;
 }
 
+static int
+weston_seat_share_global_keymap(struct weston_seat *seat)
+{
+	seat->xkb_info = seat->compositor->xkb_info;
+	seat->xkb_info.keymap = xkb_map_ref(seat->xkb_info.keymap);
+	/* the same sealed file, but the seat owns its descriptor */
+	seat->xkb_info.keymap_fd =
+		fcntl(seat->xkb_info.keymap_fd, F_DUPFD_CLOEXEC, 0);
+	if (seat->xkb_info.keymap_fd < 0) {
+		weston_log("failed to share the keymap file: %m\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Compiles the keymap of the [keyboard] section anew and hands it to
+ * the seats that use the global keymap and to their clients.  Seats
+ * with a keymap of their own, from the x11 or wayland backends, keep
+ * it.  On failure everything stays with the old keymap. */
+static void
+weston_compositor_reload_keymap(struct weston_compositor *ec)
+{
+	struct weston_xkb_info old_info, seat_info;
+	struct xkb_rule_names old_names;
+	struct weston_seat *seat;
+	struct xkb_state *state;
+	struct wl_resource *resource;
+
+	weston_compositor_wait_keymap(ec);
+
+	old_info = ec->xkb_info;
+	old_names = ec->xkb_names;
+	ec->xkb_info.keymap = NULL;
+	ec->xkb_info.keymap_fd = -1;
+	read_keymap_names(ec->config_file, &ec->xkb_names);
+	weston_compositor_xkb_init(ec, NULL);
+
+	if (weston_compositor_build_global_keymap(ec) < 0) {
+		xkb_info_destroy(&ec->xkb_info);
+		free_keymap_names(&ec->xkb_names);
+		ec->xkb_info = old_info;
+		ec->xkb_names = old_names;
+		return;
+	}
+
+	wl_list_for_each(seat, &ec->seat_list, link) {
+		if (!seat->has_keyboard ||
+		    seat->xkb_info.keymap != old_info.keymap)
+			continue;
+
+		seat_info = seat->xkb_info;
+		state = NULL;
+		if (weston_seat_share_global_keymap(seat) == 0)
+			state = xkb_state_new(seat->xkb_info.keymap);
+		if (state == NULL) {
+			weston_log("failed to switch a seat to the new "
+				   "keymap\n");
+			xkb_info_destroy(&seat->xkb_info);
+			seat->xkb_info = seat_info;
+			continue;
+		}
+		xkb_info_destroy(&seat_info);
+		xkb_state_unref(seat->xkb_state.state);
+		seat->xkb_state.state = state;
+
+		wl_list_for_each(resource,
+				 &seat->seat.keyboard->resource_list, link)
+			wl_keyboard_send_keymap(resource,
+						WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
+						seat->xkb_info.keymap_fd,
+						seat->xkb_info.keymap_size);
+		notify_modifiers(seat,
+				 wl_display_next_serial(ec->wl_display));
+	}
+
+	weston_log("keymap changed to layout %s\n", ec->xkb_names.layout);
+
+	xkb_info_destroy(&old_info);
+	free_keymap_names(&old_names);
+}
+
 WL_EXPORT int
 weston_seat_init_keyboard(struct weston_seat *seat, struct xkb_keymap *keymap)
 {
@@ -2656,8 +4894,8 @@ weston_seat_init_keyboard(struct weston_seat *seat, struct xkb_keymap *keymap)
 	} else {
 		if (weston_compositor_build_global_keymap(seat->compositor) < 0)
 			return -1;
-		seat->xkb_info = seat->compositor->xkb_info;
-		seat->xkb_info.keymap = xkb_map_ref(seat->xkb_info.keymap);
+		if (weston_seat_share_global_keymap(seat) < 0)
+			return -1;
 	}
 
 	seat->xkb_state.state = xkb_state_new(seat->xkb_info.keymap);
@@ -2685,6 +4923,13 @@ weston_seat_init_pointer(struct weston_seat *seat)
 	wl_pointer_init(&seat->pointer);
 	wl_seat_set_pointer(&seat->seat, &seat->pointer);
 
+	if (seat->compositor->input_batching) {
+		seat->batch.pointer_interface =
+			seat->pointer.default_grab.interface;
+		seat->pointer.default_grab.interface =
+			&batch_pointer_interface;
+	}
+
 	seat->has_pointer = 1;
 }
 
@@ -2697,6 +4942,12 @@ weston_seat_init_touch(struct weston_seat *seat)
 	wl_touch_init(&seat->touch);
 	wl_seat_set_touch(&seat->seat, &seat->touch);
 
+	if (seat->compositor->input_batching) {
+		seat->batch.touch_interface =
+			seat->touch.default_grab.interface;
+		seat->touch.default_grab.interface = &batch_touch_interface;
+	}
+
 	seat->has_touch = 1;
 }
 
@@ -2715,10 +4966,13 @@ weston_seat_init(struct weston_seat *seat, struct weston_compositor *ec)
 	seat->sprite_destroy_listener.notify = pointer_handle_sprite_destroy;
 
 	seat->compositor = ec;
+	seat->pick_generation = ec->pick_generation - 1;
 	seat->hotspot_x = 16;
 	seat->hotspot_y = 16;
 	seat->modifier_state = 0;
 	seat->num_tp = 0;
+	memset(&seat->batch, 0, sizeof seat->batch);
+	wl_array_init(&seat->batch.touch);
 
 	seat->drag_surface_destroy_listener.notify =
 		handle_drag_surface_destroy;
@@ -2744,6 +4998,8 @@ weston_seat_release(struct weston_seat *seat)
 	if (seat->sprite)
 		pointer_unmap_sprite(seat);
 
+	wl_array_release(&seat->batch.touch);
+
 	if (seat->xkb_state.state != NULL)
 		xkb_state_unref(seat->xkb_state.state);
 	xkb_info_destroy(&seat->xkb_info);
@@ -2755,7 +5011,7 @@ weston_seat_release(struct weston_seat *seat)
 static void
 drag_surface_configure(struct weston_surface *es, int32_t sx, int32_t sy, int32_t width, int32_t height)
 {
-	empty_region(&es->pending.input);
+	weston_surface_clear_pending_input(es);
 
 	weston_surface_configure(es,
 				 es->geometry.x + sx, es->geometry.y + sy,
@@ -2796,7 +5052,7 @@ device_release_drag_surface(struct weston_seat *seat)
 		weston_surface_unmap(seat->drag_surface);
 
 	seat->drag_surface->configure = NULL;
-	empty_region(&seat->drag_surface->pending.input);
+	weston_surface_clear_pending_input(seat->drag_surface);
 	wl_list_remove(&seat->drag_surface_destroy_listener.link);
 	seat->drag_surface = NULL;
 }
@@ -2816,6 +5072,7 @@ device_map_drag_surface(struct weston_seat *seat)
 		list = &seat->compositor->cursor_layer.surface_list;
 
 	wl_list_insert(list, &seat->drag_surface->layer_link);
+	weston_compositor_stacking_dirty(seat->compositor);
 	weston_surface_update_transform(seat->drag_surface);
 	empty_region(&seat->drag_surface->input);
 }
@@ -2858,6 +5115,12 @@ weston_seat_update_drag_surface(struct weston_seat *seat,
 	weston_surface_set_position(seat->drag_surface,
 				    seat->drag_surface->geometry.x + wl_fixed_to_double(dx),
 				    seat->drag_surface->geometry.y + wl_fixed_to_double(dy));
+
+	/* Like the pointer sprite, an icon on a cursor plane is just
+	 * moved; otherwise the repaint damages its old and new place. */
+	if (weston_surface_is_mapped(seat->drag_surface) &&
+	    move_surface_cursor(seat->drag_surface) < 0)
+		weston_surface_schedule_repaint(seat->drag_surface);
 }
 
 WL_EXPORT void
@@ -2905,6 +5168,17 @@ WL_EXPORT void
 weston_output_destroy(struct weston_output *output)
 {
 	struct weston_compositor *c = output->compositor;
+	struct weston_surface *es;
+
+	wl_list_for_each(es, &c->hidden_surface_list, hidden_link)
+		if (es->output == output)
+			es->output = NULL;
+
+	if (output->fade_surface)
+		weston_surface_destroy(output->fade_surface);
+
+	wl_event_source_remove(output->repaint_timer);
+	weston_output_discard_feedback(output);
 
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
@@ -3046,6 +5320,8 @@ WL_EXPORT void
 weston_output_init(struct weston_output *output, struct weston_compositor *c,
 		   int x, int y, int width, int height, uint32_t transform)
 {
+	struct wl_event_loop *loop;
+
 	output->compositor = c;
 	output->x = x;
 	output->y = y;
@@ -3056,6 +5332,11 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	output->mm_width = width;
 	output->mm_height = height;
 	output->dirty = 1;
+	memset(&output->timing, 0, sizeof output->timing);
+	loop = wl_display_get_event_loop(c->wl_display);
+	output->repaint_timer =
+		wl_event_loop_add_timer(loop, output_repaint_timer_handler,
+					output);
 
 	weston_output_transform_init(output, transform);
 	weston_output_init_zoom(output);
@@ -3065,6 +5346,7 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 
 	wl_signal_init(&output->frame_signal);
 	wl_list_init(&output->animation_list);
+	wl_list_init(&output->feedback_list);
 	wl_list_init(&output->resource_list);
 
 	output->id = ffs(~output->compositor->output_id_pool) - 1;
@@ -3073,6 +5355,61 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	output->global =
 		wl_display_add_global(c->wl_display, &wl_output_interface,
 				      output, bind_output);
+
+	/* the backend's set_fade is not there yet */
+	if (c->fade > 0.0)
+		weston_output_apply_fade(output, c->fade);
+}
+
+static void
+destroy_presentation_feedback(struct wl_resource *resource)
+{
+	struct weston_presentation_feedback *feedback =
+		container_of(resource, struct weston_presentation_feedback,
+			     resource);
+
+	wl_list_remove(&feedback->link);
+	free(feedback);
+}
+
+static void
+presentation_feedback(struct wl_client *client, struct wl_resource *resource,
+		      struct wl_resource *surface_resource, uint32_t id)
+{
+	struct weston_surface *surface = surface_resource->data;
+	struct weston_presentation_feedback *feedback;
+
+	feedback = calloc(1, sizeof *feedback);
+	if (feedback == NULL) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	feedback->resource.object.interface = &presentation_feedback_interface;
+	feedback->resource.object.id = id;
+	feedback->resource.destroy = destroy_presentation_feedback;
+	feedback->resource.client = client;
+	feedback->resource.data = feedback;
+
+	wl_client_add_resource(client, &feedback->resource);
+	wl_list_insert(surface->pending.feedback_list.prev, &feedback->link);
+}
+
+static const struct presentation_interface presentation_implementation = {
+	presentation_feedback
+};
+
+static void
+presentation_bind(struct wl_client *client,
+		  void *data, uint32_t version, uint32_t id)
+{
+	struct weston_compositor *compositor = data;
+	struct wl_resource *resource;
+
+	resource = wl_client_add_object(client, &presentation_interface,
+					&presentation_implementation,
+					id, compositor);
+	presentation_send_clock_id(resource, compositor->presentation_clock);
 }
 
 static void
@@ -3119,6 +5456,220 @@ weston_environment_get_fd(const char *env)
 	return fd;
 }
 
+/* The [core] section, at start up and again on reload, so keys taken
+ * out of the file fall back to their defaults. */
+static void
+weston_compositor_read_config(struct weston_compositor *ec)
+{
+	const struct config_key core_config_keys[] = {
+		{ "repaint-deadline", CONFIG_KEY_BOOLEAN, &ec->repaint_deadline },
+		{ "repaint-margin", CONFIG_KEY_INTEGER, &ec->repaint_margin },
+		{ "renderer-threads", CONFIG_KEY_INTEGER,
+		  &ec->renderer_threads },
+		{ "input-thread", CONFIG_KEY_BOOLEAN, &ec->input_thread },
+		{ "motion-coalescing", CONFIG_KEY_BOOLEAN,
+		  &ec->motion_coalescing },
+		{ "input-batching", CONFIG_KEY_BOOLEAN, &ec->input_batching },
+		{ "damage-max-rectangles", CONFIG_KEY_INTEGER,
+		  &ec->damage_max_rectangles },
+		{ "damage-max-waste", CONFIG_KEY_INTEGER,
+		  &ec->damage_max_waste },
+		{ "occluded-frame-interval", CONFIG_KEY_INTEGER,
+		  &ec->occluded_frame_interval },
+		{ "layer-cache-frames", CONFIG_KEY_INTEGER,
+		  &ec->layer_cache_frames },
+		{ "layer-cache-budget", CONFIG_KEY_INTEGER,
+		  &ec->layer_cache_budget },
+		{ "buffer-texture-budget", CONFIG_KEY_INTEGER,
+		  &ec->buffer_texture_budget },
+		{ "clipboard-max-size", CONFIG_KEY_INTEGER,
+		  &ec->clipboard_max_size },
+		{ "client-request-budget", CONFIG_KEY_INTEGER,
+		  &ec->client_request_budget },
+	};
+	const struct config_section cs[] = {
+		{ "core",
+		  core_config_keys, ARRAY_LENGTH(core_config_keys) },
+	};
+
+	ec->repaint_deadline = 0;
+	ec->repaint_margin = 2;
+	ec->renderer_threads = 0;
+	ec->input_thread = 0;
+	ec->motion_coalescing = 0;
+	ec->input_batching = 0;
+	ec->damage_max_rectangles = 0;
+	ec->damage_max_waste = 25;
+	ec->occluded_frame_interval = 1000;
+	ec->layer_cache_frames = 0;
+	ec->layer_cache_budget = 32;
+	ec->buffer_texture_budget = 0;
+	ec->clipboard_max_size = 64;
+	ec->client_request_budget = 0;
+	parse_config_file(ec->config_file, cs, ARRAY_LENGTH(cs), ec);
+	if (ec->repaint_margin < 0)
+		ec->repaint_margin = 0;
+	if (ec->damage_max_waste < 0)
+		ec->damage_max_waste = 0;
+	else if (ec->damage_max_waste > 100)
+		ec->damage_max_waste = 100;
+	if (ec->occluded_frame_interval < 0)
+		ec->occluded_frame_interval = 0;
+	if (ec->layer_cache_frames < 0)
+		ec->layer_cache_frames = 0;
+	if (ec->layer_cache_budget < 0)
+		ec->layer_cache_budget = 0;
+	if (ec->clipboard_max_size < 0)
+		ec->clipboard_max_size = 0;
+}
+
+/* The parses before and after a reload, while config_signal is
+ * emitted. */
+static struct {
+	struct weston_config *old, *new;
+} config_diff;
+
+/* For config_signal listeners: whether the sections named section
+ * differ from before the reload. */
+WL_EXPORT int
+weston_compositor_config_changed(struct weston_compositor *ec,
+				 const char *section)
+{
+	return !weston_config_section_equal(config_diff.old, config_diff.new,
+					    section);
+}
+
+static void
+weston_compositor_reload_keymap(struct weston_compositor *ec);
+
+/* Reads weston.ini again, for SIGHUP and when the file changes, and
+ * applies what changed.  The [core] keys take effect right away, but
+ * for the threads and the texture budget that are set up once at
+ * start; listeners of config_signal pick up their own sections. */
+WL_EXPORT void
+weston_compositor_reload_config(struct weston_compositor *ec)
+{
+	int renderer_threads = ec->renderer_threads;
+	int input_thread = ec->input_thread;
+	int buffer_texture_budget = ec->buffer_texture_budget;
+
+	config_diff.new = config_cache_reload(ec->config_file,
+					      &config_diff.old);
+	if (config_diff.new == NULL) {
+		weston_log("failed to read %s, configuration unchanged\n",
+			   ec->config_file);
+		return;
+	}
+
+	weston_log("reloaded %s\n", ec->config_file);
+
+	if (weston_compositor_config_changed(ec, "core")) {
+		weston_compositor_read_config(ec);
+
+		if (ec->renderer_threads != renderer_threads ||
+		    ec->input_thread != input_thread ||
+		    ec->buffer_texture_budget != buffer_texture_budget)
+			weston_log("renderer-threads, input-thread and "
+				   "buffer-texture-budget need a restart\n");
+		ec->renderer_threads = renderer_threads;
+		ec->input_thread = input_thread;
+		ec->buffer_texture_budget = buffer_texture_budget;
+	}
+
+	if (weston_compositor_config_changed(ec, "keyboard"))
+		weston_compositor_reload_keymap(ec);
+
+	wl_signal_emit(&ec->config_signal, ec);
+
+	weston_config_destroy(config_diff.old);
+	config_diff.old = NULL;
+	config_diff.new = NULL;
+}
+
+/* Editors either rewrite weston.ini in place or rename a new file
+ * over it, so the directory is watched for both; the reload waits for
+ * the events of one save to settle. */
+#define CONFIG_RELOAD_DELAY 200 /* ms */
+
+static int
+config_watch_handle_event(int fd, uint32_t mask, void *data)
+{
+	struct weston_compositor *ec = data;
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	const char *name;
+	ssize_t len;
+	char *p;
+
+	name = strrchr(ec->config_file, '/');
+	name = name ? name + 1 : ec->config_file;
+
+	while ((len = read(fd, buf, sizeof buf)) > 0) {
+		for (p = buf; p < buf + len;
+		     p += sizeof *event + event->len) {
+			event = (const struct inotify_event *) p;
+			if (event->len && strcmp(event->name, name) == 0)
+				wl_event_source_timer_update(
+					ec->config_reload_timer,
+					CONFIG_RELOAD_DELAY);
+		}
+	}
+
+	return 1;
+}
+
+static int
+config_reload_timer_handler(void *data)
+{
+	struct weston_compositor *ec = data;
+
+	weston_compositor_reload_config(ec);
+
+	return 1;
+}
+
+static void
+weston_compositor_watch_config(struct weston_compositor *ec)
+{
+	struct wl_event_loop *loop = wl_display_get_event_loop(ec->wl_display);
+	char *dir, *p;
+
+	ec->config_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ec->config_watch_fd < 0)
+		return;
+
+	dir = strdup(ec->config_file);
+	if (dir == NULL)
+		goto err;
+	p = strrchr(dir, '/');
+	if (p)
+		*p = '\0';
+	if (inotify_add_watch(ec->config_watch_fd, p ? dir : ".",
+			      IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		weston_log("not watching %s for changes: %m\n",
+			   ec->config_file);
+		free(dir);
+		goto err;
+	}
+	free(dir);
+
+	ec->config_reload_timer =
+		wl_event_loop_add_timer(loop, config_reload_timer_handler, ec);
+	ec->config_watch_source =
+		wl_event_loop_add_fd(loop, ec->config_watch_fd,
+				     WL_EVENT_READABLE,
+				     config_watch_handle_event, ec);
+	if (ec->config_watch_source)
+		return;
+
+	if (ec->config_reload_timer)
+		wl_event_source_remove(ec->config_reload_timer);
+	ec->config_reload_timer = NULL;
+err:
+	close(ec->config_watch_fd);
+	ec->config_watch_fd = -1;
+}
+
 WL_EXPORT int
 weston_compositor_init(struct weston_compositor *ec,
 		       struct wl_display *display,
@@ -3127,20 +5678,12 @@ weston_compositor_init(struct weston_compositor *ec,
 {
 	struct wl_event_loop *loop;
 	struct xkb_rule_names xkb_names;
-        const struct config_key keyboard_config_keys[] = {
-		{ "keymap_rules", CONFIG_KEY_STRING, &xkb_names.rules },
-		{ "keymap_model", CONFIG_KEY_STRING, &xkb_names.model },
-		{ "keymap_layout", CONFIG_KEY_STRING, &xkb_names.layout },
-		{ "keymap_variant", CONFIG_KEY_STRING, &xkb_names.variant },
-		{ "keymap_options", CONFIG_KEY_STRING, &xkb_names.options },
-        };
-	const struct config_section cs[] = {
-                { "keyboard",
-                  keyboard_config_keys, ARRAY_LENGTH(keyboard_config_keys) },
-	};
 
-	memset(&xkb_names, 0, sizeof(xkb_names));
-	parse_config_file(config_file, cs, ARRAY_LENGTH(cs), ec);
+	ec->config_file = strdup(config_file);
+	if (ec->config_file == NULL)
+		return -1;
+	weston_compositor_read_config(ec);
+	read_keymap_names(config_file, &xkb_names);
 
 	ec->wl_display = display;
 	wl_signal_init(&ec->destroy_signal);
@@ -3151,15 +5694,34 @@ weston_compositor_init(struct weston_compositor *ec,
 	wl_signal_init(&ec->show_input_panel_signal);
 	wl_signal_init(&ec->hide_input_panel_signal);
 	wl_signal_init(&ec->seat_created_signal);
+	wl_signal_init(&ec->gesture_signal);
+	wl_signal_init(&ec->config_signal);
+	weston_compositor_watch_config(ec);
 	ec->launcher_sock = weston_environment_get_fd("WESTON_LAUNCHER_SOCK");
 
 	ec->output_id_pool = 0;
 
+	weston_slab_init(&frame_callback_slab,
+			 sizeof(struct weston_frame_callback));
+	weston_slab_init(&region_slab, sizeof(struct weston_region));
+
 	if (!wl_display_add_global(display, &wl_compositor_interface,
 				   ec, compositor_bind))
 		return -1;
 
+	ec->presentation_clock = CLOCK_MONOTONIC;
+	if (!wl_display_add_global(display, &presentation_interface,
+				   ec, presentation_bind))
+		return -1;
+
 	wl_list_init(&ec->surface_list);
+	wl_list_init(&ec->hidden_surface_list);
+	ec->surface_list_dirty = 1;
+	ec->pick_grid.dirty = 1;
+	ec->pick_generation = 0;
+	wl_array_init(&ec->pick_grid.cells);
+	wl_array_init(&ec->pick_grid.entries);
+	wl_array_init(&ec->pick_grid.unbounded);
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -3168,6 +5730,7 @@ weston_compositor_init(struct weston_compositor *ec,
 	wl_list_init(&ec->button_binding_list);
 	wl_list_init(&ec->axis_binding_list);
 	wl_list_init(&ec->debug_binding_list);
+	wl_list_init(&ec->client_stats_list);
 
 	weston_plane_init(&ec->primary_plane, 0, 0);
 	weston_compositor_stack_plane(ec, &ec->primary_plane, NULL);
@@ -3177,10 +5740,14 @@ weston_compositor_init(struct weston_compositor *ec,
 
 	ec->ping_handler = NULL;
 
-	screenshooter_create(ec);
+	screenshooter_create(ec, config_file);
 	text_cursor_position_notifier_create(ec);
 	text_backend_init(ec);
 
+	weston_compositor_add_debug_binding(ec, KEY_T,
+					    timing_debug_binding, ec);
+	weston_trace_init(ec);
+
 	wl_data_device_manager_init(ec->wl_display);
 
 	wl_display_init_shm(display);
@@ -3188,6 +5755,11 @@ weston_compositor_init(struct weston_compositor *ec,
 	loop = wl_display_get_event_loop(ec->wl_display);
 	ec->idle_source = wl_event_loop_add_timer(loop, idle_handler, ec);
 	wl_event_source_timer_update(ec->idle_source, ec->idle_time * 1000);
+	ec->occluded_frame_source =
+		wl_event_loop_add_timer(loop, occluded_frame_handler, ec);
+	ec->timer_wheel = weston_timer_wheel_create(loop);
+	if (ec->timer_wheel == NULL)
+		return -1;
 
 	ec->input_loop = wl_event_loop_create();
 
@@ -3205,6 +5777,10 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 	struct weston_output *output, *next;
 
 	wl_event_source_remove(ec->idle_source);
+	wl_event_source_remove(ec->occluded_frame_source);
+	if (ec->client_budget_idle)
+		wl_event_source_remove(ec->client_budget_idle);
+	weston_timer_wheel_destroy(ec->timer_wheel);
 	if (ec->input_loop_source)
 		wl_event_source_remove(ec->input_loop_source);
 
@@ -3216,6 +5792,9 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 	weston_binding_list_destroy_all(&ec->button_binding_list);
 	weston_binding_list_destroy_all(&ec->axis_binding_list);
 	weston_binding_list_destroy_all(&ec->debug_binding_list);
+	weston_binding_table_release(&ec->key_binding_table);
+	weston_binding_table_release(&ec->button_binding_table);
+	weston_binding_table_release(&ec->axis_binding_table);
 
 	weston_plane_release(&ec->primary_plane);
 
@@ -3223,7 +5802,18 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 	wl_array_release(&ec->indices);
 	wl_array_release(&ec->vtxcnt);
 
+	wl_array_release(&ec->pick_grid.cells);
+	wl_array_release(&ec->pick_grid.entries);
+	wl_array_release(&ec->pick_grid.unbounded);
+
 	wl_event_loop_destroy(ec->input_loop);
+
+	if (ec->config_watch_source) {
+		wl_event_source_remove(ec->config_watch_source);
+		wl_event_source_remove(ec->config_reload_timer);
+		close(ec->config_watch_fd);
+	}
+	free(ec->config_file);
 }
 
 WL_EXPORT void
@@ -3244,6 +5834,15 @@ static int on_term_signal(int signal_number, void *data)
 	return 1;
 }
 
+static int on_hup_signal(int signal_number, void *data)
+{
+	struct weston_compositor *ec = data;
+
+	weston_compositor_reload_config(ec);
+
+	return 1;
+}
+
 #ifdef HAVE_LIBUNWIND
 
 static void
@@ -3334,6 +5933,7 @@ on_caught_signal(int s, siginfo_t *siginfo, void *context)
 	 * will allow weston to switch back to gdb on crash and then
 	 * gdb will catch the crash with SIGTRAP.*/
 
+	weston_log_sync();
 	weston_log("caught signal: %d\n", s);
 
 	print_backtrace();
@@ -3476,7 +6076,8 @@ usage(int error_code)
 		"  --seat=SEAT\t\tThe seat that weston should run on\n"
 		"  --tty=TTY\t\tThe tty to use\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
-		"  --current-mode\tPrefer current KMS mode over EDID preferred mode\n\n");
+		"  --current-mode\tPrefer current KMS mode over EDID preferred mode\n"
+		"  --secondary-gpus\tAlso drive the outputs of the seat's other GPUs\n\n");
 
 	fprintf(stderr,
 		"Options for fbdev-backend.so:\n\n"
@@ -3496,8 +6097,16 @@ usage(int error_code)
 		"Options for wayland-backend.so:\n\n"
 		"  --width=WIDTH\t\tWidth of Wayland surface\n"
 		"  --height=HEIGHT\tHeight of Wayland surface\n"
+		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
 		"  --display=DISPLAY\tWayland display to connect to\n\n");
 
+	fprintf(stderr,
+		"Options for headless-backend.so:\n\n"
+		"  --width=WIDTH\t\tWidth of the output\n"
+		"  --height=HEIGHT\tHeight of the output\n"
+		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
+		"  --clock=CLOCK\t\tFrame clock, timer (60 Hz) or fast\n\n");
+
 	exit(error_code);
 }
 
@@ -3518,7 +6127,7 @@ int main(int argc, char *argv[])
 	int ret = EXIT_SUCCESS;
 	struct wl_display *display;
 	struct weston_compositor *ec;
-	struct wl_event_source *signals[4];
+	struct wl_event_source *signals[5];
 	struct wl_event_loop *loop;
 	struct weston_compositor
 		*(*backend_init)(struct wl_display *display,
@@ -3604,15 +6213,23 @@ int main(int argc, char *argv[])
 	if (!backend_init)
 		exit(EXIT_FAILURE);
 
+	/* the desktop shell client loads while the backend starts */
+	if (strstr(modules, "desktop-shell.so"))
+		weston_client_prelaunch(LIBEXECDIR "/weston-desktop-shell",
+					socket_name);
+
 	ec = backend_init(display, &argc, argv, config_file);
 	if (ec == NULL) {
 		weston_log("fatal: failed to create compositor\n");
 		exit(EXIT_FAILURE);
 	}
+	weston_log_startup_phase("backend");
 
 	catch_signals();
 	segv_compositor = ec;
 
+	signals[4] = wl_event_loop_add_signal(loop, SIGHUP, on_hup_signal, ec);
+
 	ec->idle_time = idle_time;
 
 	setenv("WAYLAND_DISPLAY", socket_name, 1);
@@ -3621,6 +6238,7 @@ int main(int argc, char *argv[])
 		goto out;
 	if (load_modules(ec, option_modules, &argc, argv, config_file) < 0)
 		goto out;
+	weston_log_startup_phase("modules");
 
 	free(config_file);
 
@@ -3652,6 +6270,10 @@ int main(int argc, char *argv[])
 
 	weston_compositor_xkb_destroy(ec);
 
+	/* nobody took it over */
+	if (prelaunched.fd >= 0)
+		close(prelaunched.fd);
+
 	ec->destroy(ec);
 	wl_display_destroy(display);
 
@@ -28,6 +28,7 @@
 extern "C" {
 #endif
 
+#include <time.h>
 #include <pixman.h>
 #include <xkbcommon/xkbcommon.h>
 #include <wayland-server.h>
@@ -146,6 +147,60 @@ struct weston_output_zoom {
 	struct weston_fixed_point text_cursor;
 };
 
+enum weston_repaint_phase {
+	WESTON_REPAINT_PHASE_SURFACE_LIST,
+	WESTON_REPAINT_PHASE_ASSIGN_PLANES,
+	WESTON_REPAINT_PHASE_ACCUMULATE_DAMAGE,
+	WESTON_REPAINT_PHASE_RENDER,
+	WESTON_REPAINT_PHASE_FRAME_CALLBACKS,
+	WESTON_REPAINT_PHASE_COUNT
+};
+
+#define WESTON_REPAINT_TIMING_FRAMES 64
+
+/* Timing of one weston_output_repaint() call, all values in
+ * microseconds.  flip is the time from the end of the repaint until
+ * the backend reported the frame as finished. */
+struct weston_repaint_timing {
+	uint32_t msecs;
+	uint32_t phase[WESTON_REPAINT_PHASE_COUNT];
+	uint32_t flip;
+};
+
+struct weston_output_timing {
+	struct weston_repaint_timing frames[WESTON_REPAINT_TIMING_FRAMES];
+	unsigned int head;
+	unsigned int count;
+	struct timespec repaint_end;
+	int flip_pending;
+};
+
+enum weston_plane_kind {
+	WESTON_PLANE_KIND_PRIMARY,
+	WESTON_PLANE_KIND_CURSOR,
+	WESTON_PLANE_KIND_SCANOUT,
+	WESTON_PLANE_KIND_OVERLAY,
+	WESTON_PLANE_KIND_COUNT
+};
+
+/* Counters of an output since it was created, for the perf-counters
+ * module.  frames_idle are repaints skipped for lack of anything to
+ * show, see weston_output_is_idle(); frames_missed counts refresh
+ * periods a flip came late by;
+ * planes is the output's surfaces on each kind of plane as of the
+ * last repaint; input latency is from the first input event after a
+ * repaint to the end of the next, usec. */
+struct weston_output_stats {
+	uint32_t frames;
+	uint32_t frames_idle;
+	uint32_t frames_missed;
+	uint32_t planes[WESTON_PLANE_KIND_COUNT];
+	uint64_t upload_bytes;
+	uint32_t input_latency_count;
+	uint64_t input_latency_total;
+	uint32_t input_latency_max;
+};
+
 /* bit compatible with drm definitions. */
 enum dpms_enum {
 	WESTON_DPMS_ON,
@@ -173,10 +228,27 @@ struct weston_output {
 	int repaint_needed;
 	int repaint_scheduled;
 	struct weston_output_zoom zoom;
+	/* How far the renderer fades the output to black, 0 to 1, see
+	 * weston_compositor_fade().  Without a renderer that can,
+	 * fade_surface covers the output instead. */
+	float fade;
+	struct weston_surface *fade_surface;
 	int dirty;
 	struct wl_signal frame_signal;
 	uint32_t frame_time;
 	int disable_planes;
+	struct weston_output_timing timing;
+	struct weston_output_stats stats;
+	struct wl_event_source *repaint_timer;
+	/* While repaint_timer is armed: when it fires, CLOCK_MONOTONIC,
+	 * and the repaint time predicted then, usec. */
+	int repaint_timer_armed;
+	struct timespec repaint_start;
+	uint32_t repaint_predicted;
+
+	/* presentation_feedback of the surfaces in the frame that is on
+	 * its way to the screen, see weston_output_present(). */
+	struct wl_list feedback_list;
 
 	char *make, *model;
 	uint32_t subpixel;
@@ -190,19 +262,33 @@ struct weston_output {
 			pixman_region32_t *damage);
 	void (*destroy)(struct weston_output *output);
 	void (*assign_planes)(struct weston_output *output);
+	/* Set by backends whose assign_planes leaves nothing for repaint
+	 * to pick up while no surface is on a scanout or overlay plane,
+	 * so frames without damage can be skipped. */
+	int idle_skip;
 	int (*switch_mode)(struct weston_output *output, struct weston_mode *mode);
 
+	/* Moves surface, on the output's cursor plane since the last
+	 * repaint, to its new position without a repaint.  Returns 0
+	 * if it did, -1 if the output has to be repainted. */
+	int (*move_cursor)(struct weston_output *output,
+			   struct weston_surface *surface);
+
 	/* backlight values are on 0-255 range, where higher is brighter */
 	uint32_t backlight_current;
 	void (*set_backlight)(struct weston_output *output, uint32_t value);
 	void (*set_dpms)(struct weston_output *output, enum dpms_enum level);
+
+	/* Fades the output to black by fade, 0 to 1, without a
+	 * repaint, like through the CRTC gamma ramp.  Returns -1 if it
+	 * can't.  Optional. */
+	int (*set_fade)(struct weston_output *output, float fade);
 };
 
 struct weston_xkb_info {
 	struct xkb_keymap *keymap;
 	int keymap_fd;
 	size_t keymap_size;
-	char *keymap_area;
 	xkb_mod_index_t shift_mod;
 	xkb_mod_index_t caps_mod;
 	xkb_mod_index_t ctrl_mod;
@@ -246,6 +332,22 @@ struct weston_seat {
 
 	uint32_t num_tp;
 
+	/* compositor pick_generation at the last repick */
+	uint32_t pick_generation;
+
+	/* motion held back until the next frame, see input-batching */
+	struct {
+		const struct wl_pointer_grab_interface *pointer_interface;
+		int pointer_pending;
+		struct wl_resource *pointer_resource;
+		uint32_t pointer_time;
+		wl_fixed_t pointer_sx, pointer_sy;
+
+		const struct wl_touch_grab_interface *touch_interface;
+		struct wl_resource *touch_resource;
+		struct wl_array touch;	/* struct weston_touch_motion */
+	} batch;
+
 	struct wl_listener new_drag_icon_listener;
 
 	void (*led_update)(struct weston_seat *ws, enum weston_led leds);
@@ -270,6 +372,11 @@ enum {
 struct weston_layer {
 	struct wl_list surface_list;
 	struct wl_list link;
+
+	/* repaints since any of its surfaces last changed, and a count
+	 * of the changes, for renderers caching whole layers */
+	uint32_t idle_frames;
+	uint32_t serial;
 };
 
 struct weston_plane {
@@ -279,21 +386,84 @@ struct weston_plane {
 	struct wl_list link;
 };
 
+/* A copy of part of an output, in the renderer, that is read back on a
+ * later frame; see weston_renderer.capture_start. */
+struct weston_capture;
+
 struct weston_renderer {
 	int (*read_pixels)(struct weston_output *output,
 			       pixman_format_code_t format, void *pixels,
 			       uint32_t x, uint32_t y,
 			       uint32_t width, uint32_t height);
+	/* Like read_pixels, for the rectangle at x, y from the top
+	 * left, shrunk by scale and written top row first with stride,
+	 * for renderers that can read the output right away.
+	 * Optional. */
+	int (*read_pixels_scaled)(struct weston_output *output,
+				  pixman_format_code_t format,
+				  void *pixels, int32_t stride,
+				  int32_t x, int32_t y,
+				  int32_t width, int32_t height,
+				  int32_t scale);
 	void (*repaint_output)(struct weston_output *output,
 			       pixman_region32_t *output_damage);
 	void (*flush_damage)(struct weston_surface *surface);
 	void (*attach)(struct weston_surface *es, struct wl_buffer *buffer);
+	/* Called from wl_surface.commit with the newly committed
+	 * damage, in surface coordinates. */
+	void (*commit)(struct weston_surface *surface,
+		       pixman_region32_t *damage);
 	int (*create_surface)(struct weston_surface *surface);
 	void (*surface_set_color)(struct weston_surface *surface,
 			       float red, float green,
 			       float blue, float alpha);
 	void (*destroy_surface)(struct weston_surface *surface);
 	void (*destroy)(struct weston_compositor *ec);
+	/* Render the surfaces of layer on output into an image of the
+	 * output's size that snapshot then shows, see
+	 * weston_layer_snapshot().  Optional. */
+	int (*snapshot_layer)(struct weston_surface *snapshot,
+			      struct weston_layer *layer,
+			      struct weston_output *output);
+	/* Start copying the width x height rectangle at x, y (from the
+	 * top left, in framebuffer pixels) of what was just rendered
+	 * into output, shrunk by scale.  Called from the output's
+	 * frame_signal; the copy is read back, without waiting for
+	 * the GPU, by capture_finish on a later frame.  Optional. */
+	struct weston_capture *(*capture_start)(struct weston_output *output,
+						int32_t x, int32_t y,
+						int32_t width, int32_t height,
+						int32_t scale);
+	/* Write the capture, top row first, into pixels of format and
+	 * stride, and free it.  With pixels NULL, only free it. */
+	int (*capture_finish)(struct weston_capture *capture,
+			      pixman_format_code_t format,
+			      void *pixels, int32_t stride);
+	/* Set by renderers whose repaint_output darkens each output by
+	 * its weston_output::fade as a last pass, so that a change of
+	 * the fade needs a repaint but no damage. */
+	int output_fade;
+};
+
+/* Candidates for picking, bucketed by the cells of a uniform grid over
+ * the surface bounding boxes. Each cell lists the surfaces that may
+ * contain a point in it, in stacking order. Rebuilt on the next pick
+ * after geometry, stacking or input regions change. */
+struct weston_pick_grid {
+	int dirty;
+	int x, y;			/* global position of the first cell */
+	int cell_size, columns, rows;
+	struct wl_array cells;		/* columns * rows + 1 offsets */
+	struct wl_array entries;	/* struct weston_surface * */
+	struct wl_array unbounded;	/* surfaces not confined to a box */
+};
+
+/* The key, button or axis bindings hashed by code and modifier mask.
+ * Rebuilt on the next event after a binding is added or destroyed. */
+struct weston_binding_table {
+	int dirty;
+	uint32_t mask;			/* bucket count - 1 */
+	struct weston_binding **buckets;
 };
 
 struct weston_compositor {
@@ -311,31 +481,121 @@ struct weston_compositor {
 	struct wl_signal hide_input_panel_signal;
 
 	struct wl_signal seat_created_signal;
+	struct wl_signal gesture_signal;	/* struct weston_gesture_event */
+
+	/* weston.ini, and the signal emitted after it was read again on
+	 * SIGHUP or a change to it, for modules to apply what changed of
+	 * their sections, see weston_compositor_config_changed(). */
+	char *config_file;
+	struct wl_signal config_signal;
+	int config_watch_fd;
+	struct wl_event_source *config_watch_source;
+	struct wl_event_source *config_reload_timer;
 
 	struct wl_event_loop *input_loop;
 	struct wl_event_source *input_loop_source;
 
 	struct weston_layer fade_layer;
 	struct weston_layer cursor_layer;
+	float fade;			/* see weston_compositor_fade() */
 
 	struct wl_list output_list;
 	struct wl_list seat_list;
 	struct wl_list layer_list;
 	struct wl_list surface_list;
+	int surface_list_dirty;
+	struct wl_list hidden_surface_list;
+	struct weston_pick_grid pick_grid;
+	uint32_t pick_generation;	/* bumped when picking may change */
+
+	/* commits, and those that left the opaque and input regions alone */
+	struct {
+		uint32_t total;
+		uint32_t fast;
+	} commit_stats;
+
+	/* layers drawn from, and layers drawn into, the layer cache */
+	struct {
+		uint32_t hits;
+		uint32_t misses;
+	} layer_cache_stats;
+
+	/* gl-renderer draws with the shaders at full alpha, and with
+	 * the alpha ones */
+	struct {
+		uint32_t alpha_one;
+		uint32_t alpha;
+	} shader_stats;
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list button_binding_list;
 	struct wl_list axis_binding_list;
 	struct wl_list debug_binding_list;
+	struct weston_binding_table key_binding_table;
+	struct weston_binding_table button_binding_table;
+	struct weston_binding_table axis_binding_table;
 
 	uint32_t state;
 	struct wl_event_source *idle_source;
+	struct weston_timer_wheel *timer_wheel;
 	uint32_t idle_inhibit;
 	int idle_time;			/* timeout, s */
 
+	/* Delay repaints to just before the next vblank, see
+	 * weston_output_finish_frame(). */
+	int repaint_deadline;
+	int repaint_margin;		/* safety margin, ms */
+
+	/* Threads software renderers may composite with. */
+	int renderer_threads;
+
+	/* Read evdev devices on a thread of their own. */
+	int input_thread;
+
+	/* Merge evdev motion over everything read in one go. */
+	int motion_coalescing;
+
+	/* Send clients pointer and touch motion once per frame. */
+	int input_batching;
+
+	/* Merge surface damage over this many rectangles, or that wastes
+	 * at most damage_max_waste percent of its bounding box. */
+	int damage_max_rectangles;
+	int damage_max_waste;
+
+	/* Frame callbacks of fully covered surfaces go out at most this
+	 * often, ms; the timer repaints for those held back. */
+	int occluded_frame_interval;
+	struct wl_event_source *occluded_frame_source;
+
+	/* The clock of the timestamps backends pass to
+	 * weston_output_present(). */
+	clockid_t presentation_clock;
+
+	/* gl-renderer: draw layers of surfaces unchanged in this many
+	 * repaints from one texture each, within a budget of MiB. */
+	int layer_cache_frames;
+	int layer_cache_budget;
+
+	/* gl-renderer: MiB of textures kept for SHM buffers surfaces
+	 * showed before, so going back to one uploads only the damage
+	 * since; 0 keeps none. */
+	int buffer_texture_budget;
+
+	/* Largest selection in MiB the clipboard keeps after its
+	 * client is gone, 0 to keep none. */
+	int clipboard_max_size;
+
+	/* Damage and region requests a client gets handled exactly per
+	 * main loop iteration, see weston_client_stats; 0 for no
+	 * limit. */
+	int client_request_budget;
+	struct wl_list client_stats_list;
+	struct wl_event_source *client_budget_idle;
+
 	/* Repaint state. */
 	struct wl_array vertices;
-	struct wl_array indices; /* only used in compositor-wayland */
+	struct wl_array indices;
 	struct wl_array vtxcnt;
 	struct weston_plane primary_plane;
 	int fan_debug;
@@ -356,6 +616,13 @@ struct weston_compositor {
 
 	uint32_t output_id_pool;
 
+	int first_frame_done;
+
+	/* first input event since the last repaint, for
+	 * weston_output_stats */
+	int input_stamped;
+	struct timespec input_time;
+
 	struct xkb_rule_names xkb_names;
 	struct xkb_context *xkb_context;
 	struct weston_xkb_info xkb_info;
@@ -368,7 +635,25 @@ struct weston_buffer_reference {
 
 struct weston_region {
 	struct wl_resource resource;
+	struct weston_compositor *compositor;
 	pixman_region32_t region;
+	/* pixman_box32_t added over the client's request budget, merged
+	 * into region in one go when it is used */
+	struct wl_array deferred;
+};
+
+/* Requests that cost the compositor region arithmetic, wl_surface.damage
+ * and wl_region.add and subtract, counted per client.  Past
+ * client_request_budget of them in one main loop iteration, damage is
+ * merged into its bounding box and region adds are deferred, so a
+ * client flooding them costs little more than one that does not. */
+struct weston_client_stats {
+	struct wl_list link;		/* weston_compositor::client_stats_list */
+	struct wl_listener destroy_listener;
+	struct wl_client *client;
+	uint32_t requests;		/* since the client connected */
+	uint32_t throttled;		/* of those, over budget */
+	uint32_t iteration_requests;
 };
 
 /* Using weston_surface transformations
@@ -404,16 +689,28 @@ struct weston_region {
 struct weston_surface {
 	struct wl_surface surface;
 	struct weston_compositor *compositor;
-	pixman_region32_t clip;
-	pixman_region32_t damage;
-	pixman_region32_t opaque;        /* part of geometry, see below */
-	pixman_region32_t input;
+
+	/* What repaint, assign_planes and picking read of every surface
+	 * comes first, so that walking the surface list touches about
+	 * one cache line per surface: link through geometry.height. */
 	struct wl_list link;
-	struct wl_list layer_link;
-	float alpha;                     /* part of geometry, see below */
 	struct weston_plane *plane;
 
-	void *renderer_state;
+	/*
+	 * Which output to vsync this surface to.
+	 * Used to determine, whether to send or queue frame events.
+	 * Must be NULL, if 'link' is not in weston_compositor::surface_list,
+	 * unless the surface is hidden.
+	 */
+	struct weston_output *output;
+
+	/*
+	 * A more complete representation of all outputs this surface is
+	 * displayed on.
+	 */
+	uint32_t output_mask;
+
+	float alpha;                     /* part of geometry, see below */
 
 	/* Surface geometry state, mutable.
 	 * If you change anything, call weston_surface_geometry_dirty().
@@ -439,31 +736,33 @@ struct weston_surface {
 	struct {
 		int dirty;
 
-		pixman_region32_t boundingbox;
-		pixman_region32_t opaque;
-
 		/* matrix and inverse are used only if enabled = 1.
 		 * If enabled = 0, use x, y, width, height directly.
 		 */
 		int enabled;
+
+		/* Set when matrix is only a translation by the whole
+		 * pixels offset_x, offset_y, enabled or not; converting
+		 * coordinates is then just adding those. */
+		int integer_translation;
+		int32_t offset_x, offset_y;
+
+		pixman_region32_t boundingbox;
+		pixman_region32_t opaque;
+
 		struct weston_matrix matrix;
 		struct weston_matrix inverse;
 
 		struct weston_transform position; /* matrix from x, y */
 	} transform;
 
-	/*
-	 * Which output to vsync this surface to.
-	 * Used to determine, whether to send or queue frame events.
-	 * Must be NULL, if 'link' is not in weston_compositor::surface_list.
-	 */
-	struct weston_output *output;
+	pixman_region32_t clip;
+	pixman_region32_t damage;
+	pixman_region32_t opaque;        /* part of geometry, see below */
+	pixman_region32_t input;
+	struct wl_list layer_link;
 
-	/*
-	 * A more complete representation of all outputs this surface is
-	 * displayed on.
-	 */
-	uint32_t output_mask;
+	void *renderer_state;
 
 	struct wl_list frame_callback_list;
 
@@ -471,6 +770,28 @@ struct weston_surface {
 	uint32_t buffer_transform;
 	int keep_buffer; /* bool for backends to prevent early release */
 
+	/* One bit per repaint of the primary output, most recent in
+	 * bit 0, set when the surface had new damage in that frame.
+	 * Backends use it to tell often updated surfaces from static
+	 * ones when assigning planes. */
+	uint32_t damage_history;
+
+	/* When the surface last got frame callbacks while occluded. */
+	uint32_t occluded_frame_time;
+
+	/* The kind of plane assign_planes last put the surface on. */
+	enum weston_plane_kind plane_kind;
+
+	/* presentation_feedback for the committed content, until a
+	 * repaint of its output takes it. */
+	struct wl_list feedback_list;
+
+	/* Set while the surface is in a layer taken out of the layer
+	 * list, like an inactive workspace, see weston_surface_set_hidden().
+	 * hidden_link is in weston_compositor::hidden_surface_list then. */
+	int hidden;
+	struct wl_list hidden_link;
+
 	/* All the pending state, that wl_surface.commit will apply. */
 	struct {
 		/* wl_surface.attach */
@@ -483,15 +804,27 @@ struct weston_surface {
 		/* wl_surface.damage */
 		pixman_region32_t damage;
 
-		/* wl_surface.set_opaque_region */
-		pixman_region32_t opaque;
+		/* wl_surface.set_opaque_region, NULL while empty; most
+		 * surfaces never get one, so it is only allocated when
+		 * needed.  Set it with weston_surface_set_pending_opaque(). */
+		pixman_region32_t *opaque;
+		int opaque_dirty;
+
+		/* wl_surface.set_input_region, NULL while infinite; set
+		 * it with weston_surface_set_pending_input(). */
+		pixman_region32_t *input;
+		int input_dirty;
 
-		/* wl_surface.set_input_region */
-		pixman_region32_t input;
+		/* the size opaque and input were last clipped to */
+		int32_t region_width;
+		int32_t region_height;
 
 		/* wl_surface.frame */
 		struct wl_list frame_callback_list;
 
+		/* presentation.feedback */
+		struct wl_list feedback_list;
+
 		/* wl_surface.set_buffer_transform */
 		uint32_t buffer_transform;
 	} pending;
@@ -510,6 +843,29 @@ enum weston_key_state_update {
 	STATE_UPDATE_NONE,
 };
 
+enum weston_gesture_type {
+	WESTON_GESTURE_SWIPE,
+	WESTON_GESTURE_PINCH,
+};
+
+enum weston_gesture_state {
+	WESTON_GESTURE_BEGIN,
+	WESTON_GESTURE_UPDATE,
+	WESTON_GESTURE_END,
+};
+
+/* dx and dy are the motion since the previous event of the gesture,
+ * scale the finger spread relative to the one at its begin. */
+struct weston_gesture_event {
+	struct weston_seat *seat;
+	uint32_t time;
+	enum weston_gesture_type type;
+	enum weston_gesture_state state;
+	int fingers;
+	wl_fixed_t dx, dy;
+	wl_fixed_t scale;
+};
+
 void
 weston_version(int *major, int *minor, int *micro);
 
@@ -593,9 +949,24 @@ void
 notify_touch(struct weston_seat *seat, uint32_t time, int touch_id,
 	     wl_fixed_t x, wl_fixed_t y, int touch_type);
 
+void
+notify_gesture(struct weston_seat *seat, uint32_t time,
+	       enum weston_gesture_type type, enum weston_gesture_state state,
+	       int fingers, wl_fixed_t dx, wl_fixed_t dy, wl_fixed_t scale);
+
 void
 weston_layer_init(struct weston_layer *layer, struct wl_list *below);
 
+struct weston_surface *
+weston_layer_snapshot(struct weston_layer *layer,
+		      struct weston_output *output);
+
+/* Must be called whenever surfaces are added to or removed from a
+ * layer, or layers are added to or removed from the layer list, so
+ * that the compositor surface list is rebuilt on the next repaint. */
+void
+weston_compositor_stacking_dirty(struct weston_compositor *compositor);
+
 void
 weston_plane_init(struct weston_plane *plane, int32_t x, int32_t y);
 void
@@ -609,6 +980,14 @@ weston_compositor_stack_plane(struct weston_compositor *ec,
 void
 weston_output_finish_frame(struct weston_output *output, uint32_t msecs);
 void
+weston_output_present(struct weston_output *output,
+		      const struct timespec *stamp, uint64_t seq,
+		      uint32_t flags);
+void
+weston_output_discard_feedback(struct weston_output *output);
+void
+weston_output_dump_timing(struct weston_output *output);
+void
 weston_output_schedule_repaint(struct weston_output *output);
 void
 weston_output_damage(struct weston_output *output);
@@ -670,6 +1049,8 @@ weston_binding_destroy(struct weston_binding *binding);
 
 void
 weston_binding_list_destroy_all(struct wl_list *list);
+void
+weston_binding_table_release(struct weston_binding_table *table);
 
 void
 weston_compositor_run_key_binding(struct weston_compositor *compositor,
@@ -715,6 +1096,17 @@ void
 weston_surface_set_transform_parent(struct weston_surface *surface,
 				    struct weston_surface *parent);
 
+int
+weston_surface_set_pending_opaque(struct weston_surface *surface,
+				  pixman_region32_t *region);
+
+int
+weston_surface_set_pending_input(struct weston_surface *surface,
+				 pixman_region32_t *region);
+
+int
+weston_surface_clear_pending_input(struct weston_surface *surface);
+
 int
 weston_surface_is_mapped(struct weston_surface *surface);
 
@@ -733,6 +1125,9 @@ weston_surface_move_to_plane(struct weston_surface *surface,
 void
 weston_surface_unmap(struct weston_surface *surface);
 
+void
+weston_surface_set_hidden(struct weston_surface *surface, int hidden);
+
 void
 weston_buffer_reference(struct weston_buffer_reference *ref,
 			struct wl_buffer *buffer);
@@ -746,6 +1141,11 @@ weston_compositor_init(struct weston_compositor *ec, struct wl_display *display,
 void
 weston_compositor_shutdown(struct weston_compositor *ec);
 void
+weston_compositor_reload_config(struct weston_compositor *ec);
+int
+weston_compositor_config_changed(struct weston_compositor *ec,
+				 const char *section);
+void
 weston_text_cursor_position_notify(struct weston_surface *surface,
 						wl_fixed_t x, wl_fixed_t y);
 void
@@ -787,6 +1187,68 @@ weston_log(const char *fmt, ...)
 int
 weston_log_continue(const char *fmt, ...)
 	__attribute__ ((format (printf, 1, 2)));
+void
+weston_log_startup_phase(const char *phase);
+void
+weston_log_sync(void);
+
+/* Free lists of fixed size objects that come and go at high rates,
+ * carved from page sized chunks that are kept for the life of the
+ * process.  Not thread safe; define them static (zeroed) before
+ * weston_slab_init(), as objects may be freed as late as
+ * wl_display_destroy(). */
+struct weston_slab {
+	struct wl_list link;
+	size_t size;
+	void *free_list;
+	uint32_t allocs;	/* since start */
+	uint32_t live;
+	uint32_t chunks;
+};
+
+void
+weston_slab_init(struct weston_slab *slab, size_t size);
+void *
+weston_slab_alloc(struct weston_slab *slab);
+void
+weston_slab_free(struct weston_slab *slab, void *object);
+void
+weston_slab_totals(uint32_t *allocs, uint32_t *live);
+
+struct weston_client_stats *
+weston_client_stats_get(struct weston_compositor *ec,
+			struct wl_client *client);
+
+/* One shot timeouts kept in a hierarchical timer wheel, ms
+ * resolution, that one timerfd on the wheel's event loop drives.
+ * Timers are embedded in their owner and cost no syscall or
+ * allocation to arm.  A wheel is only used from its loop's thread. */
+struct weston_timer_wheel;
+typedef void (*weston_timer_func_t)(void *data);
+
+struct weston_timer {
+	struct weston_timer_wheel *wheel;	/* NULL when disarmed */
+	struct wl_list link;
+	uint64_t expires;
+	uint8_t level, slot;
+	weston_timer_func_t func;
+	void *data;
+};
+
+struct weston_timer_wheel *
+weston_timer_wheel_create(struct wl_event_loop *loop);
+void
+weston_timer_wheel_destroy(struct weston_timer_wheel *wheel);
+void
+weston_timer_init(struct weston_timer *timer,
+		  weston_timer_func_t func, void *data);
+void
+weston_timer_arm(struct weston_timer_wheel *wheel,
+		 struct weston_timer *timer, uint32_t msecs);
+void
+weston_timer_disarm(struct weston_timer *timer);
+int
+weston_timer_is_armed(struct weston_timer *timer);
 
 enum {
 	TTY_ENTER_VT,
@@ -809,7 +1271,7 @@ int
 tty_activate_vt(struct tty *tty, int vt);
 
 void
-screenshooter_create(struct weston_compositor *ec);
+screenshooter_create(struct weston_compositor *ec, const char *config_file);
 
 struct clipboard *
 clipboard_create(struct weston_seat *seat);
@@ -867,6 +1329,9 @@ weston_surface_destroy(struct weston_surface *surface);
 
 int
 weston_output_switch_mode(struct weston_output *output, struct weston_mode *mode);
+void
+weston_output_set_transform(struct weston_output *output,
+			    uint32_t transform);
 
 int
 noop_renderer_init(struct weston_compositor *ec);
@@ -0,0 +1,295 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "compositor.h"
+#include "evdev.h"
+
+/* must be a power of two */
+#define EVDEV_QUEUE_LENGTH 4096
+
+/*
+ * The input thread dispatches its own event loop, holding the evdev
+ * fds and touchpad timers of all devices, and runs the evdev
+ * processing there.  The resulting notifications go to the compositor
+ * through a single producer, single consumer ring: the thread only
+ * writes tail, the compositor only writes head, and an eventfd in the
+ * compositor's input loop tells it there is something to deliver.
+ *
+ * The thread dispatches its loop with mutex held, so the compositor
+ * takes it to add or remove sources and to create or destroy devices.
+ */
+struct evdev_input_thread {
+	struct weston_compositor *compositor;
+	int users;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	struct wl_event_loop *loop;
+	struct weston_timer_wheel *timer_wheel;
+	int quit_fd;
+	int quit;
+
+	int notify_fd;
+	struct wl_event_source *notify_source;
+	struct evdev_notify queue[EVDEV_QUEUE_LENGTH];
+	uint32_t head, tail;
+	int overflow;
+};
+
+/* one thread is shared by all evdev devices of the compositor */
+static struct evdev_input_thread *input_thread;
+
+static void
+evdev_notify_deliver(struct evdev_notify *n)
+{
+	switch (n->type) {
+	case EVDEV_NOTIFY_MOTION:
+		notify_motion(n->seat, n->time, n->x, n->y);
+		break;
+	case EVDEV_NOTIFY_MOTION_ABSOLUTE:
+		notify_motion_absolute(n->seat, n->time, n->x, n->y);
+		break;
+	case EVDEV_NOTIFY_BUTTON:
+		notify_button(n->seat, n->time, n->code, n->state);
+		break;
+	case EVDEV_NOTIFY_AXIS:
+		notify_axis(n->seat, n->time, n->code, n->x);
+		break;
+	case EVDEV_NOTIFY_KEY:
+		notify_key(n->seat, n->time, n->code, n->state,
+			   STATE_UPDATE_AUTOMATIC);
+		break;
+	case EVDEV_NOTIFY_TOUCH:
+		notify_touch(n->seat, n->time, n->code, n->x, n->y, n->state);
+		break;
+	case EVDEV_NOTIFY_GESTURE:
+		notify_gesture(n->seat, n->time, n->code, n->state,
+			       n->fingers, n->x, n->y, n->scale);
+		break;
+	}
+}
+
+static void
+evdev_input_thread_drain(struct evdev_input_thread *thread)
+{
+	uint32_t head, tail;
+
+	head = thread->head;
+	tail = __atomic_load_n(&thread->tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		evdev_notify_deliver(&thread->queue[head &
+						    (EVDEV_QUEUE_LENGTH - 1)]);
+		head++;
+		__atomic_store_n(&thread->head, head, __ATOMIC_RELEASE);
+	}
+}
+
+static int
+evdev_input_thread_notify(int fd, uint32_t mask, void *data)
+{
+	struct evdev_input_thread *thread = data;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) != sizeof count)
+		return 1;
+
+	evdev_input_thread_drain(thread);
+
+	return 1;
+}
+
+/* Called on the input thread, from the evdev processing. */
+void
+evdev_input_thread_queue(struct evdev_input_thread *thread,
+			 const struct evdev_notify *n)
+{
+	uint32_t head, tail;
+
+	tail = thread->tail;
+	head = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+	if (tail - head == EVDEV_QUEUE_LENGTH) {
+		/* takes seconds of a stuck compositor to get here */
+		if (!thread->overflow)
+			weston_log("evdev: input queue full, "
+				   "dropping events\n");
+		thread->overflow = 1;
+		return;
+	}
+
+	thread->queue[tail & (EVDEV_QUEUE_LENGTH - 1)] = *n;
+	__atomic_store_n(&thread->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *
+evdev_input_thread_run(void *data)
+{
+	struct evdev_input_thread *thread = data;
+	struct pollfd fds[2];
+	uint32_t tail;
+	uint64_t one = 1;
+
+	fds[0].fd = wl_event_loop_get_fd(thread->loop);
+	fds[0].events = POLLIN;
+	fds[1].fd = thread->quit_fd;
+	fds[1].events = POLLIN;
+
+	while (1) {
+		if (poll(fds, ARRAY_LENGTH(fds), -1) < 0)
+			continue;
+
+		pthread_mutex_lock(&thread->mutex);
+		if (thread->quit) {
+			pthread_mutex_unlock(&thread->mutex);
+			break;
+		}
+		tail = thread->tail;
+		wl_event_loop_dispatch(thread->loop, 0);
+		pthread_mutex_unlock(&thread->mutex);
+
+		/* one wakeup for everything read in this round */
+		if (thread->tail != tail &&
+		    write(thread->notify_fd, &one, sizeof one) < 0)
+			weston_log("evdev: failed to wake compositor: %m\n");
+	}
+
+	return NULL;
+}
+
+static void
+evdev_input_thread_destroy(struct evdev_input_thread *thread)
+{
+	if (thread->quit_fd >= 0)
+		close(thread->quit_fd);
+	if (thread->notify_source)
+		wl_event_source_remove(thread->notify_source);
+	if (thread->notify_fd >= 0)
+		close(thread->notify_fd);
+	if (thread->timer_wheel)
+		weston_timer_wheel_destroy(thread->timer_wheel);
+	if (thread->loop)
+		wl_event_loop_destroy(thread->loop);
+	pthread_mutex_destroy(&thread->mutex);
+	free(thread);
+}
+
+struct evdev_input_thread *
+evdev_input_thread_get(struct weston_compositor *compositor)
+{
+	struct evdev_input_thread *thread;
+
+	if (input_thread) {
+		input_thread->users++;
+		return input_thread;
+	}
+
+	thread = malloc(sizeof *thread);
+	if (thread == NULL)
+		return NULL;
+	memset(thread, 0, sizeof *thread);
+
+	thread->compositor = compositor;
+	thread->users = 1;
+	pthread_mutex_init(&thread->mutex, NULL);
+	thread->quit_fd = eventfd(0, EFD_CLOEXEC);
+	thread->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	thread->loop = wl_event_loop_create();
+	if (thread->quit_fd < 0 || thread->notify_fd < 0 || !thread->loop)
+		goto err;
+
+	thread->timer_wheel = weston_timer_wheel_create(thread->loop);
+	if (thread->timer_wheel == NULL)
+		goto err;
+
+	thread->notify_source =
+		wl_event_loop_add_fd(compositor->input_loop, thread->notify_fd,
+				     WL_EVENT_READABLE,
+				     evdev_input_thread_notify, thread);
+	if (thread->notify_source == NULL)
+		goto err;
+
+	if (pthread_create(&thread->thread, NULL,
+			   evdev_input_thread_run, thread) != 0)
+		goto err;
+
+	input_thread = thread;
+
+	return thread;
+
+err:
+	weston_log("evdev: failed to start input thread\n");
+	evdev_input_thread_destroy(thread);
+
+	return NULL;
+}
+
+void
+evdev_input_thread_put(struct evdev_input_thread *thread)
+{
+	uint64_t one = 1;
+
+	if (--thread->users > 0)
+		return;
+
+	pthread_mutex_lock(&thread->mutex);
+	thread->quit = 1;
+	pthread_mutex_unlock(&thread->mutex);
+	if (write(thread->quit_fd, &one, sizeof one) < 0)
+		weston_log("evdev: failed to stop input thread: %m\n");
+	pthread_join(thread->thread, NULL);
+
+	/* whatever was read before the last device went away */
+	evdev_input_thread_drain(thread);
+
+	input_thread = NULL;
+	evdev_input_thread_destroy(thread);
+}
+
+void
+evdev_input_thread_lock(struct evdev_input_thread *thread)
+{
+	pthread_mutex_lock(&thread->mutex);
+}
+
+void
+evdev_input_thread_unlock(struct evdev_input_thread *thread)
+{
+	pthread_mutex_unlock(&thread->mutex);
+}
+
+struct wl_event_loop *
+evdev_input_thread_get_loop(struct evdev_input_thread *thread)
+{
+	return thread->loop;
+}
+
+struct weston_timer_wheel *
+evdev_input_thread_get_timer_wheel(struct evdev_input_thread *thread)
+{
+	return thread->timer_wheel;
+}
@@ -38,6 +38,13 @@
 #define DEFAULT_TOUCHPAD_SINGLE_TAP_BUTTON BTN_LEFT
 #define DEFAULT_TOUCHPAD_SINGLE_TAP_TIMEOUT 100
 
+#define DEFAULT_GESTURE_SCROLL_THRESHOLD 3.0
+#define DEFAULT_GESTURE_PINCH_DENOMINATOR 25.0
+#define DEFAULT_KINETIC_INTERVAL 16
+#define DEFAULT_KINETIC_TIMEOUT 50
+#define DEFAULT_KINETIC_FRICTION 0.95
+#define DEFAULT_KINETIC_MIN_VELOCITY 0.05
+
 enum touchpad_model {
 	TOUCHPAD_MODEL_UNKNOWN = 0,
 	TOUCHPAD_MODEL_SYNAPTICS,
@@ -87,6 +94,24 @@ enum touchpad_fingers_state {
 	TOUCHPAD_FINGERS_THREE = (1 << 2)
 };
 
+#define TOUCHPAD_MAX_FINGERS 5
+
+struct touchpad_finger {
+	bool active;
+	int32_t x;
+	int32_t y;
+};
+
+enum touchpad_gesture {
+	TOUCHPAD_GESTURE_NONE,
+	TOUCHPAD_GESTURE_UNDECIDED,
+	TOUCHPAD_GESTURE_SCROLL,
+	TOUCHPAD_GESTURE_PINCH,
+	TOUCHPAD_GESTURE_SWIPE
+};
+
+#define TOUCHPAD_FSM_MAX_EVENTS 16
+
 enum fsm_event {
 	FSM_EVENT_TOUCH,
 	FSM_EVENT_RELEASE,
@@ -105,6 +130,7 @@ enum fsm_state {
 struct touchpad_dispatch {
 	struct evdev_dispatch base;
 	struct evdev_device *device;
+	struct weston_timer_wheel *timer_wheel;
 
 	enum touchpad_model model;
 	unsigned int state;
@@ -123,9 +149,10 @@ struct touchpad_dispatch {
 	struct {
 		bool enable;
 
-		struct wl_array events;
+		enum fsm_event events[TOUCHPAD_FSM_MAX_EVENTS];
+		int nevents;
 		enum fsm_state state;
-		struct wl_event_source *timer_source;
+		struct weston_timer timer;
 	} fsm;
 
 	struct {
@@ -151,6 +178,27 @@ struct touchpad_dispatch {
 	unsigned int motion_count;
 
 	struct weston_motion_filter *filter;
+
+	struct {
+		enum touchpad_gesture state;
+
+		/* from the ABS_MT_* events, if the touchpad has them */
+		bool has_mt;
+		int slot;
+		struct touchpad_finger finger[TOUCHPAD_MAX_FINGERS];
+
+		/* two fingers, until it is clear what they are doing */
+		double moved;
+		double start_spread;
+		double pinch_threshold;
+		double scale;
+
+		/* scroll velocity in units per ms, for kinetic scrolling */
+		double velocity_x;
+		double velocity_y;
+		uint32_t last_time;
+		struct weston_timer kinetic_timer;
+	} gesture;
 };
 
 static enum touchpad_model
@@ -201,9 +249,21 @@ touchpad_profile(struct weston_motion_filter *filter,
 {
 	struct touchpad_dispatch *touchpad =
 		(struct touchpad_dispatch *) data;
+	struct evdev_device *device = touchpad->device;
 
 	double accel_factor;
 
+	/* touchpad coordinates always need scaling, so without
+	 * acceleration they move at the slowest accelerated speed */
+	switch (device->accel_profile) {
+	case EVDEV_ACCEL_PROFILE_NONE:
+		return touchpad->min_accel_factor;
+	case EVDEV_ACCEL_PROFILE_FLAT:
+		return touchpad->min_accel_factor * device->accel_speed;
+	default:
+		break;
+	}
+
 	accel_factor = velocity * touchpad->constant_accel_factor;
 
 	if (accel_factor > touchpad->max_accel_factor)
@@ -211,7 +271,7 @@ touchpad_profile(struct weston_motion_filter *filter,
 	else if (accel_factor < touchpad->min_accel_factor)
 		accel_factor = touchpad->min_accel_factor;
 
-	return accel_factor;
+	return accel_factor * device->accel_speed;
 }
 
 static inline struct touchpad_motion *
@@ -275,17 +335,17 @@ filter_motion(struct touchpad_dispatch *touchpad,
 static void
 notify_button_pressed(struct touchpad_dispatch *touchpad, uint32_t time)
 {
-	notify_button(touchpad->device->seat, time,
-		      DEFAULT_TOUCHPAD_SINGLE_TAP_BUTTON,
-		      WL_POINTER_BUTTON_STATE_PRESSED);
+	evdev_notify_button(touchpad->device, time,
+			    DEFAULT_TOUCHPAD_SINGLE_TAP_BUTTON,
+			    WL_POINTER_BUTTON_STATE_PRESSED);
 }
 
 static void
 notify_button_released(struct touchpad_dispatch *touchpad, uint32_t time)
 {
-	notify_button(touchpad->device->seat, time,
-		      DEFAULT_TOUCHPAD_SINGLE_TAP_BUTTON,
-		      WL_POINTER_BUTTON_STATE_RELEASED);
+	evdev_notify_button(touchpad->device, time,
+			    DEFAULT_TOUCHPAD_SINGLE_TAP_BUTTON,
+			    WL_POINTER_BUTTON_STATE_RELEASED);
 }
 
 static void
@@ -299,17 +359,17 @@ static void
 process_fsm_events(struct touchpad_dispatch *touchpad, uint32_t time)
 {
 	uint32_t timeout = UINT32_MAX;
-	enum fsm_event *pevent;
 	enum fsm_event event;
+	int i;
 
 	if (!touchpad->fsm.enable)
 		return;
 
-	if (touchpad->fsm.events.size == 0)
+	if (touchpad->fsm.nevents == 0)
 		return;
 
-	wl_array_for_each(pevent, &touchpad->fsm.events) {
-		event = *pevent;
+	for (i = 0; i < touchpad->fsm.nevents; i++) {
+		event = touchpad->fsm.events[i];
 		timeout = 0;
 
 		switch (touchpad->fsm.state) {
@@ -383,40 +443,273 @@ process_fsm_events(struct touchpad_dispatch *touchpad, uint32_t time)
 	}
 
 	if (timeout != UINT32_MAX)
-		wl_event_source_timer_update(touchpad->fsm.timer_source,
-					     timeout);
+		weston_timer_arm(touchpad->timer_wheel, &touchpad->fsm.timer,
+				 timeout);
 
-	wl_array_release(&touchpad->fsm.events);
-	wl_array_init(&touchpad->fsm.events);
+	touchpad->fsm.nevents = 0;
 }
 
 static void
 push_fsm_event(struct touchpad_dispatch *touchpad,
 	       enum fsm_event event)
 {
-	enum fsm_event *pevent;
-
 	if (!touchpad->fsm.enable)
 		return;
 
-	pevent = wl_array_add(&touchpad->fsm.events, sizeof event);
-	if (pevent)
-		*pevent = event;
+	if (touchpad->fsm.nevents < TOUCHPAD_FSM_MAX_EVENTS)
+		touchpad->fsm.events[touchpad->fsm.nevents++] = event;
 	else
 		touchpad->fsm.state = FSM_IDLE;
 }
 
-static int
+static void
 fsm_timout_handler(void *data)
 {
 	struct touchpad_dispatch *touchpad = data;
 
-	if (touchpad->fsm.events.size == 0) {
+	if (touchpad->fsm.nevents == 0) {
 		push_fsm_event(touchpad, FSM_EVENT_TIMEOUT);
 		process_fsm_events(touchpad, weston_compositor_get_time());
 	}
+}
+
+static int
+finger_count(int finger_state)
+{
+	if (finger_state & TOUCHPAD_FINGERS_THREE)
+		return 3;
+	else if (finger_state & TOUCHPAD_FINGERS_TWO)
+		return 2;
+	else if (finger_state & TOUCHPAD_FINGERS_ONE)
+		return 1;
+	return 0;
+}
+
+/* Distance between the first two tracked fingers, -1 without two. */
+static double
+gesture_spread(struct touchpad_dispatch *touchpad)
+{
+	struct touchpad_finger *f[2];
+	double dx, dy;
+	int i, n = 0;
+
+	if (!touchpad->gesture.has_mt)
+		return -1.0;
+
+	for (i = 0; i < TOUCHPAD_MAX_FINGERS && n < 2; i++)
+		if (touchpad->gesture.finger[i].active)
+			f[n++] = &touchpad->gesture.finger[i];
+
+	if (n < 2)
+		return -1.0;
+
+	dx = f[0]->x - f[1]->x;
+	dy = f[0]->y - f[1]->y;
+
+	return sqrt(dx * dx + dy * dy);
+}
+
+static void
+touchpad_notify_gesture(struct touchpad_dispatch *touchpad, uint32_t time,
+			enum weston_gesture_type type,
+			enum weston_gesture_state state,
+			double dx, double dy)
+{
+	evdev_notify_gesture(touchpad->device, time, type, state,
+			     finger_count(touchpad->last_finger_state),
+			     wl_fixed_from_double(dx),
+			     wl_fixed_from_double(dy),
+			     wl_fixed_from_double(touchpad->gesture.scale));
+}
+
+static void
+notify_scroll(struct touchpad_dispatch *touchpad, uint32_t time,
+	      double dx, double dy)
+{
+	if (dx != 0.0)
+		evdev_notify_axis(touchpad->device,
+				  time,
+				  WL_POINTER_AXIS_HORIZONTAL_SCROLL,
+				  wl_fixed_from_double(dx));
+	if (dy != 0.0)
+		evdev_notify_axis(touchpad->device,
+				  time,
+				  WL_POINTER_AXIS_VERTICAL_SCROLL,
+				  wl_fixed_from_double(dy));
+}
+
+static void
+kinetic_stop(struct touchpad_dispatch *touchpad)
+{
+	touchpad->gesture.velocity_x = 0.0;
+	touchpad->gesture.velocity_y = 0.0;
+	weston_timer_disarm(&touchpad->gesture.kinetic_timer);
+}
+
+static void
+kinetic_handler(void *data)
+{
+	struct touchpad_dispatch *touchpad = data;
+	double vx, vy;
+
+	vx = touchpad->gesture.velocity_x * DEFAULT_KINETIC_FRICTION;
+	vy = touchpad->gesture.velocity_y * DEFAULT_KINETIC_FRICTION;
+	if (sqrt(vx * vx + vy * vy) < DEFAULT_KINETIC_MIN_VELOCITY) {
+		kinetic_stop(touchpad);
+		return;
+	}
 
-	return 1;
+	touchpad->gesture.velocity_x = vx;
+	touchpad->gesture.velocity_y = vy;
+	notify_scroll(touchpad, weston_compositor_get_time(),
+		      vx * DEFAULT_KINETIC_INTERVAL,
+		      vy * DEFAULT_KINETIC_INTERVAL);
+	weston_timer_arm(touchpad->timer_wheel,
+			 &touchpad->gesture.kinetic_timer,
+			 DEFAULT_KINETIC_INTERVAL);
+}
+
+static void
+gesture_scroll(struct touchpad_dispatch *touchpad, uint32_t time,
+	       double dx, double dy)
+{
+	double dt = time - touchpad->gesture.last_time;
+
+	if (touchpad->gesture.last_time == 0 || dt > DEFAULT_KINETIC_TIMEOUT)
+		dt = DEFAULT_KINETIC_TIMEOUT;
+	else if (dt < 1.0)
+		dt = 1.0;
+
+	touchpad->gesture.velocity_x =
+		(touchpad->gesture.velocity_x + dx / dt) / 2.0;
+	touchpad->gesture.velocity_y =
+		(touchpad->gesture.velocity_y + dy / dt) / 2.0;
+	touchpad->gesture.last_time = time;
+
+	notify_scroll(touchpad, time, dx, dy);
+}
+
+static void
+gesture_begin(struct touchpad_dispatch *touchpad)
+{
+	touchpad->gesture.moved = 0.0;
+	touchpad->gesture.start_spread = -1.0;
+	touchpad->gesture.scale = 1.0;
+	touchpad->gesture.last_time = 0;
+
+	/* gestures begin with the first motion, so the finger changes
+	 * around a release do not start any */
+	if (finger_count(touchpad->finger_state) >= 2)
+		touchpad->gesture.state = TOUCHPAD_GESTURE_UNDECIDED;
+	else
+		touchpad->gesture.state = TOUCHPAD_GESTURE_NONE;
+}
+
+static void
+gesture_end(struct touchpad_dispatch *touchpad, uint32_t time)
+{
+	double vx = touchpad->gesture.velocity_x;
+	double vy = touchpad->gesture.velocity_y;
+
+	switch (touchpad->gesture.state) {
+	case TOUCHPAD_GESTURE_SCROLL:
+		/* keep scrolling only if the fingers were still moving
+		 * when they left the touchpad */
+		if (time - touchpad->gesture.last_time <
+		    DEFAULT_KINETIC_TIMEOUT &&
+		    sqrt(vx * vx + vy * vy) > DEFAULT_KINETIC_MIN_VELOCITY)
+			weston_timer_arm(touchpad->timer_wheel,
+					 &touchpad->gesture.kinetic_timer,
+					 DEFAULT_KINETIC_INTERVAL);
+		else
+			kinetic_stop(touchpad);
+		break;
+	case TOUCHPAD_GESTURE_PINCH:
+		touchpad_notify_gesture(touchpad, time,
+					WESTON_GESTURE_PINCH,
+					WESTON_GESTURE_END, 0.0, 0.0);
+		break;
+	case TOUCHPAD_GESTURE_SWIPE:
+		touchpad_notify_gesture(touchpad, time,
+					WESTON_GESTURE_SWIPE,
+					WESTON_GESTURE_END, 0.0, 0.0);
+		break;
+	default:
+		break;
+	}
+
+	touchpad->gesture.state = TOUCHPAD_GESTURE_NONE;
+}
+
+/*
+ * Two fingers scroll, unless their distance changes before they have
+ * moved far together, which makes it a pinch.  Without per-finger
+ * positions it is always a scroll.
+ */
+static void
+gesture_two_finger_motion(struct touchpad_dispatch *touchpad, uint32_t time,
+			  double dx, double dy)
+{
+	double spread;
+
+	switch (touchpad->gesture.state) {
+	case TOUCHPAD_GESTURE_UNDECIDED:
+		spread = gesture_spread(touchpad);
+		if (spread < 0.0) {
+			touchpad->gesture.state = TOUCHPAD_GESTURE_SCROLL;
+			gesture_scroll(touchpad, time, dx, dy);
+			break;
+		}
+
+		if (touchpad->gesture.start_spread <= 0.0) {
+			touchpad->gesture.start_spread = spread;
+			break;
+		}
+
+		touchpad->gesture.moved += fabs(dx) + fabs(dy);
+		if (fabs(spread - touchpad->gesture.start_spread) >
+		    touchpad->gesture.pinch_threshold) {
+			touchpad->gesture.state = TOUCHPAD_GESTURE_PINCH;
+			touchpad_notify_gesture(touchpad, time,
+						WESTON_GESTURE_PINCH,
+						WESTON_GESTURE_BEGIN, 0.0, 0.0);
+		} else if (touchpad->gesture.moved >
+			   DEFAULT_GESTURE_SCROLL_THRESHOLD) {
+			touchpad->gesture.state = TOUCHPAD_GESTURE_SCROLL;
+			gesture_scroll(touchpad, time, dx, dy);
+		}
+		break;
+	case TOUCHPAD_GESTURE_SCROLL:
+		gesture_scroll(touchpad, time, dx, dy);
+		break;
+	case TOUCHPAD_GESTURE_PINCH:
+		spread = gesture_spread(touchpad);
+		if (spread > 0.0)
+			touchpad->gesture.scale =
+				spread / touchpad->gesture.start_spread;
+		touchpad_notify_gesture(touchpad, time,
+					WESTON_GESTURE_PINCH,
+					WESTON_GESTURE_UPDATE, dx, dy);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+gesture_swipe_motion(struct touchpad_dispatch *touchpad, uint32_t time,
+		     double dx, double dy)
+{
+	if (touchpad->gesture.state == TOUCHPAD_GESTURE_UNDECIDED) {
+		touchpad->gesture.state = TOUCHPAD_GESTURE_SWIPE;
+		touchpad_notify_gesture(touchpad, time,
+					WESTON_GESTURE_SWIPE,
+					WESTON_GESTURE_BEGIN, 0.0, 0.0);
+	}
+
+	touchpad_notify_gesture(touchpad, time,
+				WESTON_GESTURE_SWIPE,
+				WESTON_GESTURE_UPDATE, dx, dy);
 }
 
 static void
@@ -434,7 +727,9 @@ touchpad_update_state(struct touchpad_dispatch *touchpad, uint32_t time)
 		touchpad->event_mask_filter =
 			TOUCHPAD_EVENT_ABSOLUTE_X | TOUCHPAD_EVENT_ABSOLUTE_Y;
 
+		gesture_end(touchpad, time);
 		touchpad->last_finger_state = touchpad->finger_state;
+		gesture_begin(touchpad);
 
 		process_fsm_events(touchpad, time);
 
@@ -486,21 +781,14 @@ touchpad_update_state(struct touchpad_dispatch *touchpad, uint32_t time)
 		filter_motion(touchpad, &dx, &dy, time);
 
 		if (touchpad->finger_state == TOUCHPAD_FINGERS_ONE) {
-			touchpad->device->rel.dx = wl_fixed_from_double(dx);
-			touchpad->device->rel.dy = wl_fixed_from_double(dy);
+			touchpad->device->rel.dx += wl_fixed_from_double(dx);
+			touchpad->device->rel.dy += wl_fixed_from_double(dy);
 			touchpad->device->pending_events |=
 				EVDEV_RELATIVE_MOTION | EVDEV_SYN;
 		} else if (touchpad->finger_state == TOUCHPAD_FINGERS_TWO) {
-			if (dx != 0.0)
-				notify_axis(touchpad->device->seat,
-					    time,
-					    WL_POINTER_AXIS_HORIZONTAL_SCROLL,
-					    wl_fixed_from_double(dx));
-			if (dy != 0.0)
-				notify_axis(touchpad->device->seat,
-					    time,
-					    WL_POINTER_AXIS_VERTICAL_SCROLL,
-					    wl_fixed_from_double(dy));
+			gesture_two_finger_motion(touchpad, time, dx, dy);
+		} else if (touchpad->finger_state & TOUCHPAD_FINGERS_THREE) {
+			gesture_swipe_motion(touchpad, time, dx, dy);
 		}
 	}
 
@@ -518,6 +806,8 @@ on_touch(struct touchpad_dispatch *touchpad)
 {
 	touchpad->state |= TOUCHPAD_STATE_TOUCH;
 
+	kinetic_stop(touchpad);
+
 	push_fsm_event(touchpad, FSM_EVENT_TOUCH);
 }
 
@@ -536,7 +826,28 @@ process_absolute(struct touchpad_dispatch *touchpad,
 		 struct evdev_device *device,
 		 struct input_event *e)
 {
+	struct touchpad_finger *finger = NULL;
+
+	if (touchpad->gesture.slot >= 0 &&
+	    touchpad->gesture.slot < TOUCHPAD_MAX_FINGERS)
+		finger = &touchpad->gesture.finger[touchpad->gesture.slot];
+
 	switch (e->code) {
+	case ABS_MT_SLOT:
+		touchpad->gesture.slot = e->value;
+		break;
+	case ABS_MT_TRACKING_ID:
+		if (finger)
+			finger->active = e->value >= 0;
+		break;
+	case ABS_MT_POSITION_X:
+		if (finger)
+			finger->x = e->value;
+		break;
+	case ABS_MT_POSITION_Y:
+		if (finger)
+			finger->y = e->value;
+		break;
 	case ABS_PRESSURE:
 		if (e->value > touchpad->pressure.touch_high &&
 		    !(touchpad->state & TOUCHPAD_STATE_TOUCH))
@@ -586,10 +897,10 @@ process_key(struct touchpad_dispatch *touchpad,
 	case BTN_FORWARD:
 	case BTN_BACK:
 	case BTN_TASK:
-		notify_button(device->seat,
-			      time, e->code,
-			      e->value ? WL_POINTER_BUTTON_STATE_PRESSED :
-			                 WL_POINTER_BUTTON_STATE_RELEASED);
+		evdev_notify_button(device,
+				    time, e->code,
+				    e->value ? WL_POINTER_BUTTON_STATE_PRESSED :
+					       WL_POINTER_BUTTON_STATE_RELEASED);
 		break;
 	case BTN_TOOL_PEN:
 	case BTN_TOOL_RUBBER:
@@ -653,7 +964,8 @@ touchpad_destroy(struct evdev_dispatch *dispatch)
 		(struct touchpad_dispatch *) dispatch;
 
 	touchpad->filter->interface->destroy(touchpad->filter);
-	wl_event_source_remove(touchpad->fsm.timer_source);
+	weston_timer_disarm(&touchpad->fsm.timer);
+	weston_timer_disarm(&touchpad->gesture.kinetic_timer);
 	free(dispatch);
 }
 
@@ -667,7 +979,6 @@ touchpad_init(struct touchpad_dispatch *touchpad,
 	      struct evdev_device *device)
 {
 	struct weston_motion_filter *accel;
-	struct wl_event_loop *loop;
 
 	unsigned long prop_bits[INPUT_PROP_MAX];
 	struct input_absinfo absinfo;
@@ -715,8 +1026,15 @@ touchpad_init(struct touchpad_dispatch *touchpad,
 	touchpad->hysteresis.center_x = 0;
 	touchpad->hysteresis.center_y = 0;
 
+	memset(&touchpad->gesture, 0, sizeof touchpad->gesture);
+	touchpad->gesture.has_mt = device->is_mt;
+	touchpad->gesture.pinch_threshold =
+		diagonal / DEFAULT_GESTURE_PINCH_DENOMINATOR;
+
 	/* Configure acceleration profile */
-	accel = create_pointer_accelator_filter(touchpad_profile);
+	accel = create_pointer_accelator_filter(touchpad_profile, touchpad,
+						touchpad->max_accel_factor /
+						touchpad->constant_accel_factor);
 	if (accel == NULL)
 		return -1;
 	touchpad->filter = accel;
@@ -732,16 +1050,13 @@ touchpad_init(struct touchpad_dispatch *touchpad,
 	touchpad->last_finger_state = 0;
 	touchpad->finger_state = 0;
 
-	wl_array_init(&touchpad->fsm.events);
+	touchpad->fsm.nevents = 0;
 	touchpad->fsm.state = FSM_IDLE;
 
-	loop = wl_display_get_event_loop(device->seat->compositor->wl_display);
-	touchpad->fsm.timer_source =
-		wl_event_loop_add_timer(loop, fsm_timout_handler, touchpad);
-	if (touchpad->fsm.timer_source == NULL) {
-		accel->interface->destroy(accel);
-		return -1;
-	}
+	touchpad->timer_wheel = evdev_device_get_timer_wheel(device);
+	weston_timer_init(&touchpad->fsm.timer, fsm_timout_handler, touchpad);
+	weston_timer_init(&touchpad->gesture.kinetic_timer,
+			  kinetic_handler, touchpad);
 
 	/* Configure */
 	touchpad->fsm.enable = !has_buttonpad;
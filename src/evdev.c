@@ -29,9 +29,248 @@
 
 #include "compositor.h"
 #include "evdev.h"
+#include "filter.h"
+#include "../shared/config-parser.h"
 
 #define DEFAULT_AXIS_STEP_DISTANCE wl_fixed_from_int(10)
 
+/* linear acceleration of relative pointers, velocity in counts per ms */
+#define DEFAULT_MOUSE_ACCEL_SLOPE 0.5
+#define DEFAULT_MOUSE_MIN_ACCEL_FACTOR 1.0
+#define DEFAULT_MOUSE_MAX_ACCEL_FACTOR 2.5
+
+/* input events per read, the buffer doubles while reads fill it */
+#define EVDEV_READ_MIN 32
+#define EVDEV_READ_MAX 1024
+
+/* [input-device] sections, matched against the device name or node */
+struct evdev_configured_device {
+	char *name;
+	enum evdev_accel_profile accel_profile;
+	double accel_speed;
+	struct wl_list link;
+};
+
+static char *device_name;
+static char *device_accel_profile;
+static char *device_accel_speed;
+static struct wl_list configured_device_list;
+
+static void
+device_section_done(void *data)
+{
+	struct evdev_configured_device *device;
+	char *end;
+
+	device = malloc(sizeof *device);
+	if (!device || !device_name) {
+		free(device);
+		goto out;
+	}
+
+	device->name = device_name;
+	device_name = NULL;
+
+	if (!device_accel_profile)
+		device->accel_profile = EVDEV_ACCEL_PROFILE_DEFAULT;
+	else if (strcmp(device_accel_profile, "none") == 0)
+		device->accel_profile = EVDEV_ACCEL_PROFILE_NONE;
+	else if (strcmp(device_accel_profile, "flat") == 0)
+		device->accel_profile = EVDEV_ACCEL_PROFILE_FLAT;
+	else if (strcmp(device_accel_profile, "linear") == 0)
+		device->accel_profile = EVDEV_ACCEL_PROFILE_LINEAR;
+	else {
+		weston_log("Invalid accel-profile \"%s\" for input device %s\n",
+			   device_accel_profile, device->name);
+		device->accel_profile = EVDEV_ACCEL_PROFILE_DEFAULT;
+	}
+
+	device->accel_speed = 1.0;
+	if (device_accel_speed) {
+		device->accel_speed = strtod(device_accel_speed, &end);
+		if (*end != '\0' || device->accel_speed <= 0.0) {
+			weston_log("Invalid accel-speed \"%s\" "
+				   "for input device %s\n",
+				   device_accel_speed, device->name);
+			device->accel_speed = 1.0;
+		}
+	}
+
+	wl_list_insert(configured_device_list.prev, &device->link);
+
+out:
+	free(device_name);
+	free(device_accel_profile);
+	free(device_accel_speed);
+	device_name = NULL;
+	device_accel_profile = NULL;
+	device_accel_speed = NULL;
+}
+
+void
+evdev_config_parse(const char *config_file)
+{
+	const struct config_key device_config_keys[] = {
+		{ "name", CONFIG_KEY_STRING, &device_name },
+		{ "accel-profile", CONFIG_KEY_STRING, &device_accel_profile },
+		{ "accel-speed", CONFIG_KEY_STRING, &device_accel_speed },
+	};
+	const struct config_section config_section[] = {
+		{ "input-device", device_config_keys,
+		  ARRAY_LENGTH(device_config_keys), device_section_done },
+	};
+
+	wl_list_init(&configured_device_list);
+	parse_config_file(config_file, config_section,
+			  ARRAY_LENGTH(config_section), NULL);
+}
+
+void
+evdev_config_release(void)
+{
+	struct evdev_configured_device *device, *next;
+
+	if (configured_device_list.next == NULL)
+		return;
+
+	wl_list_for_each_safe(device, next, &configured_device_list, link) {
+		free(device->name);
+		free(device);
+	}
+	wl_list_init(&configured_device_list);
+}
+
+/* The evdev processing reports through these, which hand the event over
+ * to the compositor thread when the device is read on the input thread. */
+static void
+evdev_notify_queue(struct evdev_device *device,
+		   enum evdev_notify_type type, uint32_t time,
+		   uint32_t code, uint32_t state, wl_fixed_t x, wl_fixed_t y)
+{
+	struct evdev_notify n;
+
+	n.type = type;
+	n.seat = device->seat;
+	n.time = time;
+	n.code = code;
+	n.state = state;
+	n.x = x;
+	n.y = y;
+	n.fingers = 0;
+	n.scale = 0;
+	evdev_input_thread_queue(device->thread, &n);
+}
+
+void
+evdev_notify_motion(struct evdev_device *device, uint32_t time,
+		    wl_fixed_t dx, wl_fixed_t dy)
+{
+	device->stats.delivered++;
+	if (device->thread)
+		evdev_notify_queue(device, EVDEV_NOTIFY_MOTION,
+				   time, 0, 0, dx, dy);
+	else
+		notify_motion(device->seat, time, dx, dy);
+}
+
+void
+evdev_notify_motion_absolute(struct evdev_device *device, uint32_t time,
+			     wl_fixed_t x, wl_fixed_t y)
+{
+	device->stats.delivered++;
+	if (device->thread)
+		evdev_notify_queue(device, EVDEV_NOTIFY_MOTION_ABSOLUTE,
+				   time, 0, 0, x, y);
+	else
+		notify_motion_absolute(device->seat, time, x, y);
+}
+
+void
+evdev_notify_button(struct evdev_device *device, uint32_t time,
+		    int32_t button, enum wl_pointer_button_state state)
+{
+	device->stats.delivered++;
+	if (device->thread)
+		evdev_notify_queue(device, EVDEV_NOTIFY_BUTTON,
+				   time, button, state, 0, 0);
+	else
+		notify_button(device->seat, time, button, state);
+}
+
+void
+evdev_notify_axis(struct evdev_device *device, uint32_t time,
+		  uint32_t axis, wl_fixed_t value)
+{
+	device->stats.delivered++;
+	if (device->thread)
+		evdev_notify_queue(device, EVDEV_NOTIFY_AXIS,
+				   time, axis, 0, value, 0);
+	else
+		notify_axis(device->seat, time, axis, value);
+}
+
+void
+evdev_notify_key(struct evdev_device *device, uint32_t time,
+		 uint32_t key, enum wl_keyboard_key_state state)
+{
+	device->stats.delivered++;
+	if (device->thread)
+		evdev_notify_queue(device, EVDEV_NOTIFY_KEY,
+				   time, key, state, 0, 0);
+	else
+		notify_key(device->seat, time, key, state,
+			   STATE_UPDATE_AUTOMATIC);
+}
+
+void
+evdev_notify_touch(struct evdev_device *device, uint32_t time,
+		   int touch_id, wl_fixed_t x, wl_fixed_t y, int touch_type)
+{
+	device->stats.delivered++;
+	if (device->thread)
+		evdev_notify_queue(device, EVDEV_NOTIFY_TOUCH,
+				   time, touch_id, touch_type, x, y);
+	else
+		notify_touch(device->seat, time, touch_id, x, y, touch_type);
+}
+
+void
+evdev_notify_gesture(struct evdev_device *device, uint32_t time,
+		     enum weston_gesture_type type,
+		     enum weston_gesture_state state, int fingers,
+		     wl_fixed_t dx, wl_fixed_t dy, wl_fixed_t scale)
+{
+	struct evdev_notify n;
+
+	device->stats.delivered++;
+	if (!device->thread) {
+		notify_gesture(device->seat, time, type, state,
+			       fingers, dx, dy, scale);
+		return;
+	}
+
+	n.type = EVDEV_NOTIFY_GESTURE;
+	n.seat = device->seat;
+	n.time = time;
+	n.code = type;
+	n.state = state;
+	n.x = dx;
+	n.y = dy;
+	n.fingers = fingers;
+	n.scale = scale;
+	evdev_input_thread_queue(device->thread, &n);
+}
+
+/* Where a device's timers go, they run alongside its event processing. */
+struct weston_timer_wheel *
+evdev_device_get_timer_wheel(struct evdev_device *device)
+{
+	if (device->thread)
+		return evdev_input_thread_get_timer_wheel(device->thread);
+
+	return device->seat->compositor->timer_wheel;
+}
+
 void
 evdev_led_update(struct evdev_device *device, enum weston_led leds)
 {
@@ -75,22 +314,42 @@ evdev_process_key(struct evdev_device *device, struct input_event *e, int time)
 	case BTN_FORWARD:
 	case BTN_BACK:
 	case BTN_TASK:
-		notify_button(device->seat,
-			      time, e->code,
-			      e->value ? WL_POINTER_BUTTON_STATE_PRESSED :
-					 WL_POINTER_BUTTON_STATE_RELEASED);
+		evdev_notify_button(device,
+				    time, e->code,
+				    e->value ? WL_POINTER_BUTTON_STATE_PRESSED :
+					       WL_POINTER_BUTTON_STATE_RELEASED);
 		break;
 
 	default:
-		notify_key(device->seat,
-			   time, e->code,
-			   e->value ? WL_KEYBOARD_KEY_STATE_PRESSED :
-				      WL_KEYBOARD_KEY_STATE_RELEASED,
-			   STATE_UPDATE_AUTOMATIC);
+		evdev_notify_key(device,
+				 time, e->code,
+				 e->value ? WL_KEYBOARD_KEY_STATE_PRESSED :
+					    WL_KEYBOARD_KEY_STATE_RELEASED);
 		break;
 	}
 }
 
+/* When coalescing, touch motion is sent per slot at the end of the read
+ * and only with the latest position, instead of with the next EV_SYN. */
+static void
+evdev_touch_moved(struct evdev_device *device)
+{
+	uint32_t bit = 1 << device->mt.slot;
+
+	if (!device->coalesce_motion) {
+		device->pending_events |= EVDEV_ABSOLUTE_MT_MOTION;
+		return;
+	}
+
+	if (device->mt.frame_slots & bit)
+		return;
+
+	if (device->mt.motion_slots & bit)
+		device->stats.coalesced++;
+	device->mt.frame_slots |= bit;
+	device->mt.motion_slots |= bit;
+}
+
 static void
 evdev_process_touch(struct evdev_device *device, struct input_event *e)
 {
@@ -112,14 +371,14 @@ evdev_process_touch(struct evdev_device *device, struct input_event *e)
 			(e->value - device->abs.min_x) * screen_width /
 			(device->abs.max_x - device->abs.min_x) +
 			device->output->x;
-		device->pending_events |= EVDEV_ABSOLUTE_MT_MOTION;
+		evdev_touch_moved(device);
 		break;
 	case ABS_MT_POSITION_Y:
 		device->mt.y[device->mt.slot] =
 			(e->value - device->abs.min_y) * screen_height /
 			(device->abs.max_y - device->abs.min_y) +
 			device->output->y;
-		device->pending_events |= EVDEV_ABSOLUTE_MT_MOTION;
+		evdev_touch_moved(device);
 		break;
 	}
 }
@@ -168,10 +427,11 @@ evdev_process_relative(struct evdev_device *device,
 			/* Scroll down */
 		case 1:
 			/* Scroll up */
-			notify_axis(device->seat,
-				    time,
-				    WL_POINTER_AXIS_VERTICAL_SCROLL,
-				    -1 * e->value * DEFAULT_AXIS_STEP_DISTANCE);
+			evdev_notify_axis(device,
+					  time,
+					  WL_POINTER_AXIS_VERTICAL_SCROLL,
+					  -1 * e->value *
+					  DEFAULT_AXIS_STEP_DISTANCE);
 			break;
 		default:
 			break;
@@ -183,10 +443,10 @@ evdev_process_relative(struct evdev_device *device,
 			/* Scroll left */
 		case 1:
 			/* Scroll right */
-			notify_axis(device->seat,
-				    time,
-				    WL_POINTER_AXIS_HORIZONTAL_SCROLL,
-				    e->value * DEFAULT_AXIS_STEP_DISTANCE);
+			evdev_notify_axis(device,
+					  time,
+					  WL_POINTER_AXIS_HORIZONTAL_SCROLL,
+					  e->value * DEFAULT_AXIS_STEP_DISTANCE);
 			break;
 		default:
 			break;
@@ -245,48 +505,80 @@ transform_absolute(struct evdev_device *device)
 }
 
 static void
-evdev_flush_motion(struct evdev_device *device, uint32_t time)
+evdev_flush_touch_motion(struct evdev_device *device, int slot, uint32_t time)
+{
+	uint32_t bit = 1 << slot;
+
+	if (!(device->mt.motion_slots & bit))
+		return;
+
+	evdev_notify_touch(device, time, slot,
+			   wl_fixed_from_int(device->mt.x[slot]),
+			   wl_fixed_from_int(device->mt.y[slot]),
+			   WL_TOUCH_MOTION);
+	device->mt.motion_slots &= ~bit;
+}
+
+static void
+evdev_filter_motion(struct evdev_device *device, uint32_t time)
 {
-	struct weston_seat *master = device->seat;
+	struct weston_motion_params motion;
+
+	motion.dx = wl_fixed_to_double(device->rel.dx);
+	motion.dy = wl_fixed_to_double(device->rel.dy);
+
+	weston_filter_dispatch(device->filter, &motion, device, time);
 
+	device->rel.dx = wl_fixed_from_double(motion.dx);
+	device->rel.dy = wl_fixed_from_double(motion.dy);
+}
+
+static void
+evdev_flush_motion(struct evdev_device *device, uint32_t time)
+{
 	if (!(device->pending_events & EVDEV_SYN))
 		return;
 
 	device->pending_events &= ~EVDEV_SYN;
 	if (device->pending_events & EVDEV_RELATIVE_MOTION) {
-		notify_motion(master, time, device->rel.dx, device->rel.dy);
+		if (device->filter)
+			evdev_filter_motion(device, time);
+		evdev_notify_motion(device, time,
+				    device->rel.dx, device->rel.dy);
 		device->pending_events &= ~EVDEV_RELATIVE_MOTION;
 		device->rel.dx = 0;
 		device->rel.dy = 0;
 	}
 	if (device->pending_events & EVDEV_ABSOLUTE_MT_DOWN) {
-		notify_touch(master, time,
-			     device->mt.slot,
-			     wl_fixed_from_int(device->mt.x[device->mt.slot]),
-			     wl_fixed_from_int(device->mt.y[device->mt.slot]),
-			     WL_TOUCH_DOWN);
+		evdev_notify_touch(device, time,
+				   device->mt.slot,
+				   wl_fixed_from_int(device->mt.x[device->mt.slot]),
+				   wl_fixed_from_int(device->mt.y[device->mt.slot]),
+				   WL_TOUCH_DOWN);
+		device->mt.motion_slots &= ~(1 << device->mt.slot);
 		device->pending_events &= ~EVDEV_ABSOLUTE_MT_DOWN;
 		device->pending_events &= ~EVDEV_ABSOLUTE_MT_MOTION;
 	}
 	if (device->pending_events & EVDEV_ABSOLUTE_MT_MOTION) {
-		notify_touch(master, time,
-			     device->mt.slot,
-			     wl_fixed_from_int(device->mt.x[device->mt.slot]),
-			     wl_fixed_from_int(device->mt.y[device->mt.slot]),
-			     WL_TOUCH_MOTION);
+		evdev_notify_touch(device, time,
+				   device->mt.slot,
+				   wl_fixed_from_int(device->mt.x[device->mt.slot]),
+				   wl_fixed_from_int(device->mt.y[device->mt.slot]),
+				   WL_TOUCH_MOTION);
 		device->pending_events &= ~EVDEV_ABSOLUTE_MT_DOWN;
 		device->pending_events &= ~EVDEV_ABSOLUTE_MT_MOTION;
 	}
 	if (device->pending_events & EVDEV_ABSOLUTE_MT_UP) {
-		notify_touch(master, time, device->mt.slot, 0, 0,
-			     WL_TOUCH_UP);
+		evdev_flush_touch_motion(device, device->mt.slot, time);
+		evdev_notify_touch(device, time, device->mt.slot, 0, 0,
+				   WL_TOUCH_UP);
 		device->pending_events &= ~EVDEV_ABSOLUTE_MT_UP;
 	}
 	if (device->pending_events & EVDEV_ABSOLUTE_MOTION) {
 		transform_absolute(device);
-		notify_motion_absolute(master, time,
-			      wl_fixed_from_int(device->abs.x),
-			      wl_fixed_from_int(device->abs.y));
+		evdev_notify_motion_absolute(device, time,
+					     wl_fixed_from_int(device->abs.x),
+					     wl_fixed_from_int(device->abs.y));
 		device->pending_events &= ~EVDEV_ABSOLUTE_MOTION;
 	}
 }
@@ -324,8 +616,27 @@ struct evdev_dispatch_interface fallback_interface = {
 	fallback_destroy
 };
 
+static double
+fallback_accel_profile(struct weston_motion_filter *filter,
+		       void *data, double velocity, uint32_t time)
+{
+	struct evdev_device *device = data;
+	double accel_factor;
+
+	if (device->accel_profile == EVDEV_ACCEL_PROFILE_FLAT)
+		return device->accel_speed;
+
+	accel_factor = velocity * DEFAULT_MOUSE_ACCEL_SLOPE;
+	if (accel_factor > DEFAULT_MOUSE_MAX_ACCEL_FACTOR)
+		accel_factor = DEFAULT_MOUSE_MAX_ACCEL_FACTOR;
+	else if (accel_factor < DEFAULT_MOUSE_MIN_ACCEL_FACTOR)
+		accel_factor = DEFAULT_MOUSE_MIN_ACCEL_FACTOR;
+
+	return accel_factor * device->accel_speed;
+}
+
 static struct evdev_dispatch *
-fallback_dispatch_create(void)
+fallback_dispatch_create(struct evdev_device *device)
 {
 	struct evdev_dispatch *dispatch = malloc(sizeof *dispatch);
 	if (dispatch == NULL)
@@ -333,10 +644,49 @@ fallback_dispatch_create(void)
 
 	dispatch->interface = &fallback_interface;
 
+	/* relative motion is only accelerated when configured to */
+	if ((device->caps & EVDEV_MOTION_REL) &&
+	    (device->accel_profile == EVDEV_ACCEL_PROFILE_FLAT ||
+	     device->accel_profile == EVDEV_ACCEL_PROFILE_LINEAR)) {
+		device->filter = create_pointer_accelator_filter(
+			fallback_accel_profile, device,
+			DEFAULT_MOUSE_MAX_ACCEL_FACTOR /
+			DEFAULT_MOUSE_ACCEL_SLOPE);
+		if (device->filter == NULL) {
+			free(dispatch);
+			return NULL;
+		}
+	}
+
 	return dispatch;
 }
 
+/* Sends what motion coalescing held back until the end of the read. */
+static void
+evdev_flush_coalesced_motion(struct evdev_device *device, uint32_t time)
+{
+	int slot;
+
+	evdev_flush_motion(device, time);
+	for (slot = 0; device->mt.motion_slots; slot++)
+		evdev_flush_touch_motion(device, slot, time);
+}
+
 static void
+evdev_count_coalesced(struct evdev_device *device)
+{
+	const enum evdev_event_type motion =
+		EVDEV_RELATIVE_MOTION | EVDEV_ABSOLUTE_MOTION;
+
+	/* the report before is still pending, this one merges into it */
+	if ((device->pending_events & EVDEV_SYN) &&
+	    (device->pending_events & motion))
+		device->stats.coalesced++;
+
+	device->mt.frame_slots = 0;
+}
+
+static uint32_t
 evdev_process_events(struct evdev_device *device,
 		     struct input_event *ev, int count)
 {
@@ -344,7 +694,10 @@ evdev_process_events(struct evdev_device *device,
 	struct input_event *e, *end;
 	uint32_t time = 0;
 
-	device->pending_events = 0;
+	/* when coalescing, motion stays pending across reads until the
+	 * end of evdev_device_data() */
+	if (!device->coalesce_motion)
+		device->pending_events = 0;
 
 	e = ev;
 	end = e + count;
@@ -353,14 +706,20 @@ evdev_process_events(struct evdev_device *device,
 
 		/* we try to minimize the amount of notifications to be
 		 * forwarded to the compositor, so we accumulate motion
-		 * events and send as a bunch */
-		if (!is_motion_event(e))
+		 * events and send as a bunch; when coalescing, the bunch
+		 * goes on over EV_SYN */
+		if (device->coalesce_motion && e->type == EV_SYN)
+			evdev_count_coalesced(device);
+		else if (!is_motion_event(e))
 			evdev_flush_motion(device, time);
 
 		dispatch->interface->process(dispatch, device, e, time);
 	}
 
-	evdev_flush_motion(device, time);
+	if (!device->coalesce_motion)
+		evdev_flush_motion(device, time);
+
+	return time;
 }
 
 static int
@@ -368,11 +727,12 @@ evdev_device_data(int fd, uint32_t mask, void *data)
 {
 	struct weston_compositor *ec;
 	struct evdev_device *device = data;
-	struct input_event ev[32];
-	int len;
+	struct input_event *ev;
+	uint32_t time = 0;
+	int len, count, processed = 0;
 
 	ec = device->seat->compositor;
-	if (!ec->focus)
+	if (!ec->focus && !device->thread)
 		return 1;
 
 	/* If the compositor is repainting, this function is called only once
@@ -380,32 +740,92 @@ evdev_device_data(int fd, uint32_t mask, void *data)
 	 * fd, otherwise there will be input lag. */
 	do {
 		if (device->mtdev)
-			len = mtdev_get(device->mtdev, fd, ev,
-					ARRAY_LENGTH(ev)) *
+			len = mtdev_get(device->mtdev, fd, device->ev,
+					device->ev_size) *
 				sizeof (struct input_event);
 		else
-			len = read(fd, &ev, sizeof ev);
+			len = read(fd, device->ev,
+				   device->ev_size * sizeof device->ev[0]);
 
-		if (len < 0 || len % sizeof ev[0] != 0) {
+		if (len < 0 || len % sizeof device->ev[0] != 0) {
 			/* FIXME: call evdev_device_destroy when errno is ENODEV. */
-			return 1;
+			break;
 		}
 
-		evdev_process_events(device, ev, len / sizeof ev[0]);
+		count = len / sizeof device->ev[0];
+		device->stats.read += count;
+
+		/* the input thread drains what comes in while we are
+		 * switched away, instead of spinning on it */
+		if (ec->focus && count > 0) {
+			time = evdev_process_events(device, device->ev, count);
+			processed += count;
+		}
 
+		/* a full buffer means more is queued, read more at once */
+		if (count == device->ev_size &&
+		    device->ev_size < EVDEV_READ_MAX) {
+			ev = realloc(device->ev,
+				     2 * device->ev_size * sizeof *ev);
+			if (ev) {
+				device->ev = ev;
+				device->ev_size *= 2;
+			}
+		}
 	} while (len > 0);
 
+	if (device->coalesce_motion && processed)
+		evdev_flush_coalesced_motion(device, time);
+
 	return 1;
 }
 
+void
+evdev_device_probe(int fd, struct evdev_probe *probe)
+{
+	memset(probe, 0, sizeof *probe);
+	strcpy(probe->name, "unknown");
+
+	ioctl(fd, EVIOCGNAME(sizeof(probe->name)), probe->name);
+	ioctl(fd, EVIOCGBIT(0, sizeof(probe->ev_bits)), probe->ev_bits);
+	if (TEST_BIT(probe->ev_bits, EV_ABS)) {
+		ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(probe->abs_bits)),
+		      probe->abs_bits);
+		if (TEST_BIT(probe->abs_bits, ABS_X))
+			ioctl(fd, EVIOCGABS(ABS_X), &probe->abs_x);
+		if (TEST_BIT(probe->abs_bits, ABS_Y))
+			ioctl(fd, EVIOCGABS(ABS_Y), &probe->abs_y);
+		if (TEST_BIT(probe->abs_bits, ABS_MT_SLOT)) {
+			ioctl(fd, EVIOCGABS(ABS_MT_POSITION_X),
+			      &probe->mt_x);
+			ioctl(fd, EVIOCGABS(ABS_MT_POSITION_Y),
+			      &probe->mt_y);
+			probe->mtdev = mtdev_new_open(fd);
+		}
+	}
+	if (TEST_BIT(probe->ev_bits, EV_REL))
+		ioctl(fd, EVIOCGBIT(EV_REL, sizeof(probe->rel_bits)),
+		      probe->rel_bits);
+	if (TEST_BIT(probe->ev_bits, EV_KEY))
+		ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(probe->key_bits)),
+		      probe->key_bits);
+}
+
+void
+evdev_probe_release(struct evdev_probe *probe)
+{
+	if (probe->mtdev)
+		mtdev_close_delete(probe->mtdev);
+	probe->mtdev = NULL;
+}
+
 static int
-evdev_handle_device(struct evdev_device *device)
+evdev_handle_device(struct evdev_device *device, struct evdev_probe *probe)
 {
-	struct input_absinfo absinfo;
-	unsigned long ev_bits[NBITS(EV_MAX)];
-	unsigned long abs_bits[NBITS(ABS_MAX)];
-	unsigned long rel_bits[NBITS(REL_MAX)];
-	unsigned long key_bits[NBITS(KEY_MAX)];
+	unsigned long *ev_bits = probe->ev_bits;
+	unsigned long *abs_bits = probe->abs_bits;
+	unsigned long *rel_bits = probe->rel_bits;
+	unsigned long *key_bits = probe->key_bits;
 	int has_key, has_abs;
 	unsigned int i;
 
@@ -413,48 +833,35 @@ evdev_handle_device(struct evdev_device *device)
 	has_abs = 0;
 	device->caps = 0;
 
-	ioctl(device->fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits);
 	if (TEST_BIT(ev_bits, EV_ABS)) {
 		has_abs = 1;
 
-		ioctl(device->fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)),
-		      abs_bits);
 		if (TEST_BIT(abs_bits, ABS_X)) {
-			ioctl(device->fd, EVIOCGABS(ABS_X), &absinfo);
-			device->abs.min_x = absinfo.minimum;
-			device->abs.max_x = absinfo.maximum;
+			device->abs.min_x = probe->abs_x.minimum;
+			device->abs.max_x = probe->abs_x.maximum;
 			device->caps |= EVDEV_MOTION_ABS;
 		}
 		if (TEST_BIT(abs_bits, ABS_Y)) {
-			ioctl(device->fd, EVIOCGABS(ABS_Y), &absinfo);
-			device->abs.min_y = absinfo.minimum;
-			device->abs.max_y = absinfo.maximum;
+			device->abs.min_y = probe->abs_y.minimum;
+			device->abs.max_y = probe->abs_y.maximum;
 			device->caps |= EVDEV_MOTION_ABS;
 		}
 		if (TEST_BIT(abs_bits, ABS_MT_SLOT)) {
-			ioctl(device->fd, EVIOCGABS(ABS_MT_POSITION_X),
-			      &absinfo);
-			device->abs.min_x = absinfo.minimum;
-			device->abs.max_x = absinfo.maximum;
-			ioctl(device->fd, EVIOCGABS(ABS_MT_POSITION_Y),
-			      &absinfo);
-			device->abs.min_y = absinfo.minimum;
-			device->abs.max_y = absinfo.maximum;
+			device->abs.min_x = probe->mt_x.minimum;
+			device->abs.max_x = probe->mt_x.maximum;
+			device->abs.min_y = probe->mt_y.minimum;
+			device->abs.max_y = probe->mt_y.maximum;
 			device->is_mt = 1;
 			device->mt.slot = 0;
 			device->caps |= EVDEV_TOUCH;
 		}
 	}
 	if (TEST_BIT(ev_bits, EV_REL)) {
-		ioctl(device->fd, EVIOCGBIT(EV_REL, sizeof(rel_bits)),
-		      rel_bits);
 		if (TEST_BIT(rel_bits, REL_X) || TEST_BIT(rel_bits, REL_Y))
 			device->caps |= EVDEV_MOTION_REL;
 	}
 	if (TEST_BIT(ev_bits, EV_KEY)) {
 		has_key = 1;
-		ioctl(device->fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)),
-		      key_bits);
 		if (TEST_BIT(key_bits, BTN_TOOL_FINGER) &&
 		    !TEST_BIT(key_bits, BTN_TOOL_PEN) &&
 		    has_abs)
@@ -518,12 +925,34 @@ evdev_configure_device(struct evdev_device *device)
 	return 0;
 }
 
-struct evdev_device *
-evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
+static void
+evdev_device_configure_accel(struct evdev_device *device)
+{
+	struct evdev_configured_device *config;
+
+	device->accel_profile = EVDEV_ACCEL_PROFILE_DEFAULT;
+	device->accel_speed = 1.0;
+
+	if (configured_device_list.next == NULL)
+		return;
+
+	wl_list_for_each(config, &configured_device_list, link) {
+		if (strcmp(config->name, device->devname) == 0 ||
+		    strcmp(config->name, device->devnode) == 0) {
+			device->accel_profile = config->accel_profile;
+			device->accel_speed = config->accel_speed;
+			return;
+		}
+	}
+}
+
+static struct evdev_device *
+evdev_device_open(struct weston_seat *seat, const char *path, int device_fd,
+		  struct evdev_probe *probe, struct evdev_input_thread *thread)
 {
 	struct evdev_device *device;
 	struct weston_compositor *ec;
-	char devname[256] = "unknown";
+	struct wl_event_loop *loop;
 
 	device = malloc(sizeof *device);
 	if (device == NULL)
@@ -543,11 +972,14 @@ evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
 	device->rel.dy = 0;
 	device->dispatch = NULL;
 	device->fd = device_fd;
+	device->thread = thread;
+	device->coalesce_motion = ec->motion_coalescing;
+
+	device->devname = strdup(probe->name);
 
-	ioctl(device->fd, EVIOCGNAME(sizeof(devname)), devname);
-	device->devname = strdup(devname);
+	evdev_device_configure_accel(device);
 
-	if (!evdev_handle_device(device)) {
+	if (!evdev_handle_device(device, probe)) {
 		free(device->devnode);
 		free(device->devname);
 		free(device);
@@ -559,18 +991,27 @@ evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
 
 	/* If the dispatch was not set up use the fallback. */
 	if (device->dispatch == NULL)
-		device->dispatch = fallback_dispatch_create();
+		device->dispatch = fallback_dispatch_create(device);
 	if (device->dispatch == NULL)
 		goto err1;
 
+	device->ev_size = EVDEV_READ_MIN;
+	device->ev = malloc(device->ev_size * sizeof *device->ev);
+	if (device->ev == NULL)
+		goto err2;
 
 	if (device->is_mt) {
-		device->mtdev = mtdev_new_open(device->fd);
+		device->mtdev = probe->mtdev;
+		probe->mtdev = NULL;
 		if (!device->mtdev)
 			weston_log("mtdev failed to open for %s\n", path);
 	}
 
-	device->source = wl_event_loop_add_fd(ec->input_loop, device->fd,
+	if (thread)
+		loop = evdev_input_thread_get_loop(thread);
+	else
+		loop = ec->input_loop;
+	device->source = wl_event_loop_add_fd(loop, device->fd,
 					      WL_EVENT_READABLE,
 					      evdev_device_data, device);
 	if (device->source == NULL)
@@ -579,31 +1020,85 @@ evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
 	return device;
 
 err2:
+	free(device->ev);
 	device->dispatch->interface->destroy(device->dispatch);
 err1:
+	if (device->filter)
+		device->filter->interface->destroy(device->filter);
 	free(device->devname);
 	free(device->devnode);
 	free(device);
 	return NULL;
 }
 
+/* Takes the mtdev of probe if the device is created. */
+struct evdev_device *
+evdev_device_create_probed(struct weston_seat *seat, const char *path,
+			   int device_fd, struct evdev_probe *probe)
+{
+	struct evdev_input_thread *thread = NULL;
+	struct evdev_device *device;
+
+	if (seat->compositor->input_thread)
+		thread = evdev_input_thread_get(seat->compositor);
+
+	/* the sources and timers of the device go to the thread's loop */
+	if (thread)
+		evdev_input_thread_lock(thread);
+
+	device = evdev_device_open(seat, path, device_fd, probe, thread);
+
+	if (thread) {
+		evdev_input_thread_unlock(thread);
+		if (device == NULL || device == EVDEV_UNHANDLED_DEVICE)
+			evdev_input_thread_put(thread);
+	}
+
+	return device;
+}
+
+struct evdev_device *
+evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
+{
+	struct evdev_device *device;
+	struct evdev_probe probe;
+
+	evdev_device_probe(device_fd, &probe);
+	device = evdev_device_create_probed(seat, path, device_fd, &probe);
+	evdev_probe_release(&probe);
+
+	return device;
+}
+
 void
 evdev_device_destroy(struct evdev_device *device)
 {
+	struct evdev_input_thread *thread = device->thread;
 	struct evdev_dispatch *dispatch;
 
+	if (thread)
+		evdev_input_thread_lock(thread);
+
 	dispatch = device->dispatch;
 	if (dispatch)
 		dispatch->interface->destroy(dispatch);
+	if (device->filter)
+		device->filter->interface->destroy(device->filter);
 
 	wl_event_source_remove(device->source);
 	wl_list_remove(&device->link);
 	if (device->mtdev)
 		mtdev_close_delete(device->mtdev);
 	close(device->fd);
+	free(device->ev);
 	free(device->devname);
 	free(device->devnode);
 	free(device);
+
+	if (thread) {
+		evdev_input_thread_unlock(thread);
+		evdev_input_thread_put(thread);
+	}
 }
 
 void
@@ -648,3 +1143,23 @@ evdev_notify_keyboard_focus(struct weston_seat *seat,
 
 	wl_array_release(&keys);
 }
+
+void
+evdev_log_device_stats(struct wl_list *evdev_devices)
+{
+	struct evdev_device *device;
+
+	wl_list_for_each(device, evdev_devices, link) {
+		/* the counters are updated while the thread reads */
+		if (device->thread)
+			evdev_input_thread_lock(device->thread);
+		weston_log("input device %s, %s: %u events read, "
+			   "%u motion reports coalesced, "
+			   "%u notifications delivered, %d events per read\n",
+			   device->devname, device->devnode,
+			   device->stats.read, device->stats.coalesced,
+			   device->stats.delivered, device->ev_size);
+		if (device->thread)
+			evdev_input_thread_unlock(device->thread);
+	}
+}
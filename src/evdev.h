@@ -45,10 +45,21 @@ enum evdev_device_capability {
 	EVDEV_TOUCH = (1 << 4),
 };
 
+enum evdev_accel_profile {
+	EVDEV_ACCEL_PROFILE_DEFAULT,	/* linear for touchpads, else none */
+	EVDEV_ACCEL_PROFILE_NONE,
+	EVDEV_ACCEL_PROFILE_FLAT,
+	EVDEV_ACCEL_PROFILE_LINEAR,
+};
+
+struct evdev_input_thread;
+struct weston_motion_filter;
+
 struct evdev_device {
 	struct weston_seat *seat;
 	struct wl_list link;
 	struct wl_event_source *source;
+	struct evdev_input_thread *thread;	/* NULL when read in-loop */
 	struct weston_output *output;
 	struct evdev_dispatch *dispatch;
 	char *devnode;
@@ -66,6 +77,8 @@ struct evdev_device {
 		int slot;
 		int32_t x[MAX_SLOTS];
 		int32_t y[MAX_SLOTS];
+		uint32_t motion_slots;	/* motion not sent yet, coalescing */
+		uint32_t frame_slots;	/* moved since the last EV_SYN */
 	} mt;
 	struct mtdev *mtdev;
 
@@ -73,10 +86,26 @@ struct evdev_device {
 		wl_fixed_t dx, dy;
 	} rel;
 
+	/* from the device's [input-device] section */
+	enum evdev_accel_profile accel_profile;
+	double accel_speed;
+	struct weston_motion_filter *filter;	/* relative motion, if any */
+
 	enum evdev_event_type pending_events;
 	enum evdev_device_capability caps;
 
 	int is_mt;
+	int coalesce_motion;
+
+	/* grows while reads keep filling it */
+	struct input_event *ev;
+	int ev_size;
+
+	struct {
+		uint32_t read;		/* input events read */
+		uint32_t coalesced;	/* motion reports merged into later ones */
+		uint32_t delivered;	/* notifications sent to the compositor */
+	} stats;
 };
 
 /* copied from udev/extras/input_id/input_id.c */
@@ -91,6 +120,21 @@ struct evdev_device {
 
 #define EVDEV_UNHANDLED_DEVICE ((struct evdev_device *) 1)
 
+/* What the ioctls of a device, and mtdev's, tell about it.  Reading it
+ * touches nothing of the compositor, so it can be done on any thread
+ * and handed to evdev_device_create_probed(). */
+struct evdev_probe {
+	char name[256];
+	unsigned long ev_bits[NBITS(EV_MAX)];
+	unsigned long abs_bits[NBITS(ABS_MAX)];
+	unsigned long rel_bits[NBITS(REL_MAX)];
+	unsigned long key_bits[NBITS(KEY_MAX)];
+	struct input_absinfo abs_x, abs_y;
+	struct input_absinfo mt_x, mt_y;
+	/* for multitouch devices, NULL once a device took it */
+	struct mtdev *mtdev;
+};
+
 struct evdev_dispatch;
 
 struct evdev_dispatch_interface {
@@ -111,12 +155,102 @@ struct evdev_dispatch {
 struct evdev_dispatch *
 evdev_touchpad_create(struct evdev_device *device);
 
+enum evdev_notify_type {
+	EVDEV_NOTIFY_MOTION,
+	EVDEV_NOTIFY_MOTION_ABSOLUTE,
+	EVDEV_NOTIFY_BUTTON,
+	EVDEV_NOTIFY_AXIS,
+	EVDEV_NOTIFY_KEY,
+	EVDEV_NOTIFY_TOUCH,
+	EVDEV_NOTIFY_GESTURE,
+};
+
+/* A notify_*() call queued by the input thread. code is the button,
+ * axis, key, touch id or gesture type, state the button, key, touch or
+ * gesture state, x and y the motion or axis value. fingers and scale
+ * are only used by gestures. */
+struct evdev_notify {
+	enum evdev_notify_type type;
+	struct weston_seat *seat;
+	uint32_t time;
+	uint32_t code;
+	uint32_t state;
+	wl_fixed_t x, y;
+	int fingers;
+	wl_fixed_t scale;
+};
+
+void
+evdev_notify_motion(struct evdev_device *device, uint32_t time,
+		    wl_fixed_t dx, wl_fixed_t dy);
+
+void
+evdev_notify_motion_absolute(struct evdev_device *device, uint32_t time,
+			     wl_fixed_t x, wl_fixed_t y);
+
+void
+evdev_notify_button(struct evdev_device *device, uint32_t time,
+		    int32_t button, enum wl_pointer_button_state state);
+
+void
+evdev_notify_axis(struct evdev_device *device, uint32_t time,
+		  uint32_t axis, wl_fixed_t value);
+
+void
+evdev_notify_key(struct evdev_device *device, uint32_t time,
+		 uint32_t key, enum wl_keyboard_key_state state);
+
+void
+evdev_notify_touch(struct evdev_device *device, uint32_t time,
+		   int touch_id, wl_fixed_t x, wl_fixed_t y, int touch_type);
+
+void
+evdev_notify_gesture(struct evdev_device *device, uint32_t time,
+		     enum weston_gesture_type type,
+		     enum weston_gesture_state state, int fingers,
+		     wl_fixed_t dx, wl_fixed_t dy, wl_fixed_t scale);
+
+struct weston_timer_wheel *
+evdev_device_get_timer_wheel(struct evdev_device *device);
+
+struct evdev_input_thread *
+evdev_input_thread_get(struct weston_compositor *compositor);
+
+void
+evdev_input_thread_put(struct evdev_input_thread *thread);
+
+void
+evdev_input_thread_lock(struct evdev_input_thread *thread);
+
+void
+evdev_input_thread_unlock(struct evdev_input_thread *thread);
+
+struct wl_event_loop *
+evdev_input_thread_get_loop(struct evdev_input_thread *thread);
+
+struct weston_timer_wheel *
+evdev_input_thread_get_timer_wheel(struct evdev_input_thread *thread);
+
+void
+evdev_input_thread_queue(struct evdev_input_thread *thread,
+			 const struct evdev_notify *n);
+
 void
 evdev_led_update(struct evdev_device *device, enum weston_led leds);
 
+void
+evdev_device_probe(int fd, struct evdev_probe *probe);
+
+void
+evdev_probe_release(struct evdev_probe *probe);
+
 struct evdev_device *
 evdev_device_create(struct weston_seat *seat, const char *path, int device_fd);
 
+struct evdev_device *
+evdev_device_create_probed(struct weston_seat *seat, const char *path,
+			   int device_fd, struct evdev_probe *probe);
+
 void
 evdev_device_destroy(struct evdev_device *device);
 
@@ -124,4 +258,13 @@ void
 evdev_notify_keyboard_focus(struct weston_seat *seat,
 			    struct wl_list *evdev_devices);
 
+void
+evdev_log_device_stats(struct wl_list *evdev_devices);
+
+void
+evdev_config_parse(const char *config_file);
+
+void
+evdev_config_release(void);
+
 #endif /* EVDEV_H */
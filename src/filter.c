@@ -45,7 +45,12 @@ weston_filter_dispatch(struct weston_motion_filter *filter,
 #define MAX_VELOCITY_DIFF	1.0
 #define MOTION_TIMEOUT		300 /* (ms) */
 #define NUM_POINTER_TRACKERS	16
+#define ACCEL_TABLE_SIZE	256
+#define TRACKER_REBASE		1e6
+#define DIRECTION_TABLE_RANGE	16	/* |dx|, |dy| looked up below this */
 
+/* dx and dy are the motion summed over all events up to this one, so the
+ * motion since any tracker is a subtraction */
 struct pointer_tracker {
 	double dx;
 	double dy;
@@ -57,8 +62,6 @@ struct pointer_accelerator;
 struct pointer_accelerator {
 	struct weston_motion_filter base;
 
-	accel_profile_func_t profile;
-
 	double velocity;
 	double last_velocity;
 	int last_dx;
@@ -66,6 +69,10 @@ struct pointer_accelerator {
 
 	struct pointer_tracker *trackers;
 	int cur_tracker;
+
+	/* the profile sampled over [0, max_velocity] at creation */
+	double table[ACCEL_TABLE_SIZE];
+	double table_scale;
 };
 
 enum directions {
@@ -126,6 +133,37 @@ get_direction(int dx, int dy)
 	return dir;
 }
 
+static uint8_t direction_table[2 * DIRECTION_TABLE_RANGE - 1]
+			      [2 * DIRECTION_TABLE_RANGE - 1];
+static int direction_table_ready;
+
+static void
+init_direction_table(void)
+{
+	const int r = DIRECTION_TABLE_RANGE - 1;
+	int dx, dy;
+
+	if (direction_table_ready)
+		return;
+
+	for (dx = -r; dx <= r; dx++)
+		for (dy = -r; dy <= r; dy++)
+			direction_table[dx + r][dy + r] =
+				get_direction(dx, dy);
+	direction_table_ready = 1;
+}
+
+static int
+lookup_direction(int dx, int dy)
+{
+	const int r = DIRECTION_TABLE_RANGE - 1;
+
+	if (abs(dx) <= r && abs(dy) <= r)
+		return direction_table[dx + r][dy + r];
+
+	return get_direction(dx, dy);
+}
+
 static void
 feed_trackers(struct pointer_accelerator *accel,
 	      double dx, double dy,
@@ -133,19 +171,28 @@ feed_trackers(struct pointer_accelerator *accel,
 {
 	int i, current;
 	struct pointer_tracker *trackers = accel->trackers;
-
-	for (i = 0; i < NUM_POINTER_TRACKERS; i++) {
-		trackers[i].dx += dx;
-		trackers[i].dy += dy;
+	double sum_dx, sum_dy;
+
+	sum_dx = trackers[accel->cur_tracker].dx + dx;
+	sum_dy = trackers[accel->cur_tracker].dy + dy;
+
+	/* keep the sums small enough not to lose precision */
+	if (fabs(sum_dx) > TRACKER_REBASE || fabs(sum_dy) > TRACKER_REBASE) {
+		for (i = 0; i < NUM_POINTER_TRACKERS; i++) {
+			trackers[i].dx -= sum_dx;
+			trackers[i].dy -= sum_dy;
+		}
+		sum_dx = 0.0;
+		sum_dy = 0.0;
 	}
 
 	current = (accel->cur_tracker + 1) % NUM_POINTER_TRACKERS;
 	accel->cur_tracker = current;
 
-	trackers[current].dx = 0.0;
-	trackers[current].dy = 0.0;
+	trackers[current].dx = sum_dx;
+	trackers[current].dy = sum_dy;
 	trackers[current].time = time;
-	trackers[current].dir = get_direction(dx, dy);
+	trackers[current].dir = lookup_direction(dx, dy);
 }
 
 static struct pointer_tracker *
@@ -158,14 +205,15 @@ tracker_by_offset(struct pointer_accelerator *accel, unsigned int offset)
 }
 
 static double
-calculate_tracker_velocity(struct pointer_tracker *tracker, uint32_t time)
+calculate_tracker_velocity(struct pointer_tracker *current,
+			   struct pointer_tracker *tracker, uint32_t time)
 {
 	int dx;
 	int dy;
 	double distance;
 
-	dx = tracker->dx;
-	dy = tracker->dy;
+	dx = current->dx - tracker->dx;
+	dy = current->dy - tracker->dy;
 	distance = sqrt(dx*dx + dy*dy);
 	return distance / (double)(time - tracker->time);
 }
@@ -180,7 +228,8 @@ calculate_velocity(struct pointer_accelerator *accel, uint32_t time)
 	double velocity_diff;
 	unsigned int offset;
 
-	unsigned int dir = tracker_by_offset(accel, 0)->dir;
+	struct pointer_tracker *current = tracker_by_offset(accel, 0);
+	unsigned int dir = current->dir;
 
 	/* Find first velocity */
 	for (offset = 1; offset < NUM_POINTER_TRACKERS; offset++) {
@@ -190,7 +239,7 @@ calculate_velocity(struct pointer_accelerator *accel, uint32_t time)
 			continue;
 
 		result = initial_velocity =
-			calculate_tracker_velocity(tracker, time);
+			calculate_tracker_velocity(current, tracker, time);
 		if (initial_velocity > 0.0)
 			break;
 	}
@@ -210,7 +259,7 @@ calculate_velocity(struct pointer_accelerator *accel, uint32_t time)
 		if (dir == 0)
 			break;
 
-		velocity = calculate_tracker_velocity(tracker, time);
+		velocity = calculate_tracker_velocity(current, tracker, time);
 
 		/* Stop if velocity differs too much from initial */
 		velocity_diff = fabs(initial_velocity - velocity);
@@ -224,26 +273,31 @@ calculate_velocity(struct pointer_accelerator *accel, uint32_t time)
 }
 
 static double
-acceleration_profile(struct pointer_accelerator *accel,
-		     void *data, double velocity, uint32_t time)
+acceleration_profile(struct pointer_accelerator *accel, double velocity)
 {
-	return accel->profile(&accel->base, data, velocity, time);
+	double position = velocity * accel->table_scale;
+	int i;
+
+	if (position >= ACCEL_TABLE_SIZE - 1)
+		return accel->table[ACCEL_TABLE_SIZE - 1];
+
+	i = position;
+	return accel->table[i] +
+		(position - i) * (accel->table[i + 1] - accel->table[i]);
 }
 
 static double
-calculate_acceleration(struct pointer_accelerator *accel,
-		       void *data, double velocity, uint32_t time)
+calculate_acceleration(struct pointer_accelerator *accel, double velocity)
 {
 	double factor;
 
 	/* Use Simpson's rule to calculate the avarage acceleration between
 	 * the previous motion and the most recent. */
-	factor = acceleration_profile(accel, data, velocity, time);
-	factor += acceleration_profile(accel, data, accel->last_velocity, time);
+	factor = acceleration_profile(accel, velocity);
+	factor += acceleration_profile(accel, accel->last_velocity);
 	factor += 4.0 *
-		acceleration_profile(accel, data,
-				     (accel->last_velocity + velocity) / 2,
-				     time);
+		acceleration_profile(accel,
+				     (accel->last_velocity + velocity) / 2);
 
 	factor = factor / 6.0;
 
@@ -283,7 +337,7 @@ accelerator_filter(struct weston_motion_filter *filter,
 
 	feed_trackers(accel, motion->dx, motion->dy, time);
 	velocity = calculate_velocity(accel, time);
-	accel_value = calculate_acceleration(accel, data, velocity, time);
+	accel_value = calculate_acceleration(accel, velocity);
 
 	motion->dx = accel_value * motion->dx;
 	motion->dy = accel_value * motion->dy;
@@ -311,10 +365,17 @@ struct weston_motion_filter_interface accelerator_interface = {
 	accelerator_destroy
 };
 
+/*
+ * The profile is only evaluated here, into a table that the filter
+ * interpolates linearly.  Above max_velocity the factor is taken to be
+ * constant, so it should be where the profile levels off.
+ */
 struct weston_motion_filter *
-create_pointer_accelator_filter(accel_profile_func_t profile)
+create_pointer_accelator_filter(accel_profile_func_t profile, void *data,
+				double max_velocity)
 {
 	struct pointer_accelerator *filter;
+	int i;
 
 	filter = malloc(sizeof *filter);
 	if (filter == NULL)
@@ -323,14 +384,25 @@ create_pointer_accelator_filter(accel_profile_func_t profile)
 	filter->base.interface = &accelerator_interface;
 	wl_list_init(&filter->base.link);
 
-	filter->profile = profile;
 	filter->last_velocity = 0.0;
 	filter->last_dx = 0;
 	filter->last_dy = 0;
 
 	filter->trackers =
 		calloc(NUM_POINTER_TRACKERS, sizeof *filter->trackers);
+	if (filter->trackers == NULL) {
+		free(filter);
+		return NULL;
+	}
 	filter->cur_tracker = 0;
 
+	init_direction_table();
+
+	for (i = 0; i < ACCEL_TABLE_SIZE; i++)
+		filter->table[i] =
+			profile(&filter->base, data,
+				i * max_velocity / (ACCEL_TABLE_SIZE - 1), 0);
+	filter->table_scale = (ACCEL_TABLE_SIZE - 1) / max_velocity;
+
 	return &filter->base;
 }
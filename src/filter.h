@@ -60,6 +60,7 @@ typedef double (*accel_profile_func_t)(struct weston_motion_filter *filter,
 				       uint32_t time);
 
 WL_EXPORT struct weston_motion_filter *
-create_pointer_accelator_filter(accel_profile_func_t filter);
+create_pointer_accelator_filter(accel_profile_func_t filter, void *data,
+				double max_velocity);
 
 #endif // _FILTER_H_
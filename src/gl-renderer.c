@@ -26,10 +26,18 @@
 #include <GLES2/gl2ext.h>
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <float.h>
 #include <assert.h>
+#include <signal.h>
+#include <pthread.h>
 #include <linux/input.h>
 
 #include "gl-renderer.h"
@@ -37,7 +45,35 @@
 #include <EGL/eglext.h>
 #include "weston-egl-ext.h"
 
+/* GLES 3.0 and GL_NV_pixel_buffer_object, not in the GLES 2 headers */
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#endif
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ 0x88E1
+#endif
+#ifndef GL_MAP_READ_BIT
+#define GL_MAP_READ_BIT 0x0001
+#endif
+#ifndef GL_PACK_ROW_LENGTH
+#define GL_PACK_ROW_LENGTH 0x0D02
+#endif
+#ifndef GL_READ_FRAMEBUFFER
+#define GL_READ_FRAMEBUFFER 0x8CA8
+#endif
+#ifndef GL_DRAW_FRAMEBUFFER
+#define GL_DRAW_FRAMEBUFFER 0x8CA9
+#endif
+
+/* Compiled by use_shader() the first time something draws with it. */
 struct gl_shader {
+	const char *vertex_source, *fragment_source;
+	const char *defines;
+	int failed;
+
+	/* the same without alpha math, for surfaces at full alpha */
+	struct gl_shader *alpha_one;
+
 	GLuint program;
 	GLuint vertex_shader, fragment_shader;
 	GLint proj_uniform;
@@ -46,11 +82,87 @@ struct gl_shader {
 	GLint color_uniform;
 };
 
-#define BUFFER_DAMAGE_COUNT 2
+/* How an SHM format goes into textures, one per plane.  Every plane
+ * samples the same stride * height bytes, the only part of the pool
+ * wl_shm checks a buffer against, so formats with planes after those
+ * rows (NV12, YUV420) can't be taken.  Plane strides derive from the
+ * buffer stride by the bytes per texel and the subsampling. */
+struct gl_shm_plane {
+	GLenum format;		/* of both the texture and the data */
+	int cpp;		/* bytes per texel */
+	int hsub, vsub;		/* subsampling against plane 0 */
+};
+
+struct gl_shm_format {
+	uint32_t format;	/* WL_SHM_FORMAT_* */
+	int num_planes;
+	struct gl_shm_plane planes[2];
+};
+
+/* Deepest swap chain repainted by buffer age, older buffers are
+ * repainted whole. */
+#define BUFFER_DAMAGE_COUNT 8
 
 struct gl_output_state {
 	EGLSurface egl_surface;
+
+	/* Damage of the last frames, a ring with the newest at head and
+	 * count of them known. */
 	pixman_region32_t buffer_damage[BUFFER_DAMAGE_COUNT];
+	int buffer_damage_head;
+	int buffer_damage_count;
+	struct wl_list layer_cache_list;
+
+	/* the next swap must damage the whole surface, border too */
+	int swap_full;
+
+	/* the output unzoomed while zoomed, see repaint_zoomed() */
+	struct {
+		GLuint fbo;
+		GLuint texture;
+		struct weston_surface *surface;
+		struct weston_plane plane;
+	} zoom;
+};
+
+/* A layer drawn from one texture of all of its surfaces while none of
+ * them changes, see layer-cache-frames.  The surface showing it is
+ * never mapped; its damage goes to a plane of its own. */
+struct gl_layer_cache {
+	struct weston_layer *layer;
+	struct weston_surface *surface;
+	struct weston_plane plane;
+	uint32_t serial;	/* layer serial the texture shows */
+	uint32_t size;		/* of the texture in bytes, 0 if none */
+	int seen;
+	struct wl_list link;
+};
+
+enum gl_upload_state {
+	GL_UPLOAD_QUEUED,
+	GL_UPLOAD_RUNNING,
+	GL_UPLOAD_DONE
+};
+
+/* An SHM texture upload handed to the upload thread at commit time.
+ * state is protected by the upload mutex, everything else is only
+ * written by the main thread before the job is queued. */
+struct gl_upload_job {
+	struct wl_list link;
+	enum gl_upload_state state;
+	struct gl_renderer *renderer;
+	struct gl_surface_state *gs;
+
+	GLuint texture;
+	const struct gl_shm_plane *plane;
+	void *data;
+	int pitch, height;
+	pixman_region32_t region; /* buffer coordinates */
+	pixman_region32_t damage; /* surface coordinates */
+	EGLSyncKHR fence;
+	uint64_t bytes;
+
+	struct wl_listener buffer_destroy_listener;
 };
 
 struct gl_surface_state {
@@ -61,12 +173,49 @@ struct gl_surface_state {
 	int num_textures;
 	pixman_region32_t texture_damage;
 
+	/* Pending upload on the upload thread, and the damage of the
+	 * current buffer that it already put into the texture. */
+	struct gl_upload_job *upload;
+	pixman_region32_t staged_damage;
+
 	EGLImageKHR images[3];
 	GLenum target;
 	int num_images;
 
 	struct weston_buffer_reference buffer_ref;
 	int pitch; /* in pixels */
+
+	/* Storage of textures[0] for SHM buffers, kept across attaches
+	 * of same sized buffers so damage uploads stay valid.  When it is
+	 * (re)allocated the whole buffer is uploaded at the next flush. */
+	int shm_pitch, shm_height;
+	const struct gl_shm_format *shm_format;
+	int needs_full_upload;
+
+	/* The SHM buffer textures[0] shows, and the textures of the ones
+	 * shown before it, see buffer-texture-budget. */
+	struct wl_buffer *texture_buffer;
+	struct wl_listener texture_buffer_destroy_listener;
+	struct wl_list buffer_texture_list;
+};
+
+/* The texture of an SHM buffer a surface showed before, kept while the
+ * client draws into its other buffers.  damage is what the surface got
+ * since the texture was last brought up to date, in surface
+ * coordinates. */
+struct gl_buffer_texture {
+	struct gl_renderer *renderer;
+	struct wl_list link;	/* gl_surface_state::buffer_texture_list */
+	struct wl_list lru_link;	/* gl_renderer, most recent first */
+	struct wl_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
+
+	GLuint texture;
+	int shm_pitch, shm_height;
+	const struct gl_shm_format *shm_format;
+	int needs_full_upload;
+	pixman_region32_t damage;
+	uint32_t size;		/* bytes */
 };
 
 struct gl_renderer {
@@ -98,6 +247,45 @@ struct gl_renderer {
 
 	int has_egl_buffer_age;
 
+	PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC swap_buffers_with_damage;
+
+	/* glReadPixels into a pixel pack buffer, mapped frames later */
+	void *(*map_buffer_range)(GLenum target, GLintptr offset,
+				  GLsizeiptr length, GLbitfield access);
+	GLboolean (*unmap_buffer)(GLenum target);
+	int has_pack_buffer;
+	int has_pack_row_length;
+
+	void (*blit_framebuffer)(GLint src_x0, GLint src_y0,
+				 GLint src_x1, GLint src_y1,
+				 GLint dst_x0, GLint dst_y0,
+				 GLint dst_x1, GLint dst_y1,
+				 GLbitfield mask, GLenum filter);
+
+	/* linked programs saved by GL_OES_get_program_binary */
+	void (*get_program_binary)(GLuint program, GLsizei size,
+				   GLsizei *length, GLenum *format,
+				   void *binary);
+	void (*program_binary)(GLuint program, GLenum format,
+			       const void *binary, GLint length);
+	char *shader_cache_dir;
+	uint64_t shader_cache_seed;
+
+	PFNEGLCREATESYNCKHRPROC create_sync;
+	PFNEGLDESTROYSYNCKHRPROC destroy_sync;
+	PFNEGLCLIENTWAITSYNCKHRPROC client_wait_sync;
+
+	struct {
+		int enabled;
+		EGLContext context;
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t queue_cond;
+		pthread_cond_t done_cond;
+		struct wl_list queue;
+		int quit;
+	} upload;
+
 	struct gl_shader texture_shader_rgba;
 	struct gl_shader texture_shader_rgbx;
 	struct gl_shader texture_shader_egl_external;
@@ -106,7 +294,13 @@ struct gl_renderer {
 	struct gl_shader texture_shader_y_xuxv;
 	struct gl_shader invert_color_shader;
 	struct gl_shader solid_shader;
+	struct gl_shader alpha_one_shaders[7];
 	struct gl_shader *current_shader;
+
+	uint64_t layer_cache_size;	/* of all textures, in bytes */
+
+	struct wl_list buffer_texture_list;
+	uint64_t buffer_texture_size;	/* bytes */
 };
 
 static inline struct gl_output_state *
@@ -483,7 +677,7 @@ calculate_edges(struct weston_surface *es, pixman_box32_t *rect,
 	 * there will be only four edges.  We just need to clip the surface
 	 * vertices to the clip rect bounds:
 	 */
-	if (!es->transform.enabled) {
+	if (!es->transform.enabled || es->transform.integer_translation) {
 		for (i = 0; i < surf.n; i++) {
 			ex[i] = clip(surf.x[i], ctx.clip.x1, ctx.clip.x2);
 			ey[i] = clip(surf.y[i], ctx.clip.y1, ctx.clip.y2);
@@ -603,6 +797,9 @@ texture_region(struct weston_surface *es, pixman_region32_t *region,
 	return nvtx;
 }
 
+static int
+shader_ensure(struct gl_renderer *gr, struct gl_shader *shader);
+
 static void
 triangle_fan_debug(struct weston_surface *surface, int first, int count)
 {
@@ -635,22 +832,74 @@ triangle_fan_debug(struct weston_surface *surface, int first, int count)
 		*index++ = first + i;
 	}
 
+	if (shader_ensure(gr, &gr->solid_shader) < 0)
+		goto out;
+
 	glUseProgram(gr->solid_shader.program);
 	glUniform4fv(gr->solid_shader.color_uniform, 1,
 			color[color_idx++ % ARRAY_LENGTH(color)]);
 	glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, buffer);
 	glUseProgram(gr->current_shader->program);
+out:
 	free(buffer);
 }
 
+/* Draw fans [first_fan, last_fan) as one indexed triangle list.  Their
+ * vertices start at vertex first_vertex in ec->vertices. */
+static void
+draw_fans(struct weston_surface *es, int first_fan, int last_fan,
+	  int first_vertex)
+{
+	struct weston_compositor *ec = es->compositor;
+	GLfloat *v = ec->vertices.data;
+	unsigned int *vtxcnt = ec->vtxcnt.data;
+	GLushort *index;
+	int i, k, first;
+
+	v += first_vertex * 4;
+
+	/* position: */
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
+	glEnableVertexAttribArray(0);
+
+	/* texcoord: */
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
+	glEnableVertexAttribArray(1);
+
+	for (i = first_fan, first = 0; i < last_fan; i++) {
+		index = wl_array_add(&ec->indices,
+				     (vtxcnt[i] - 2) * 3 * sizeof *index);
+		for (k = 1; k < (int) vtxcnt[i] - 1; k++) {
+			*index++ = first;
+			*index++ = first + k;
+			*index++ = first + k + 1;
+		}
+		first += vtxcnt[i];
+	}
+
+	glDrawElements(GL_TRIANGLES, ec->indices.size / sizeof *index,
+		       GL_UNSIGNED_SHORT, ec->indices.data);
+
+	if (ec->fan_debug) {
+		for (i = first_fan, first = 0; i < last_fan; i++) {
+			triangle_fan_debug(es, first, vtxcnt[i]);
+			first += vtxcnt[i];
+		}
+	}
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+
+	ec->indices.size = 0;
+}
+
 static void
 repaint_region(struct weston_surface *es, pixman_region32_t *region,
 		pixman_region32_t *surf_region)
 {
 	struct weston_compositor *ec = es->compositor;
-	GLfloat *v;
 	unsigned int *vtxcnt;
-	int i, first, nfans;
+	int i, first, nfans, batch_fan, batch_vertex;
 
 	/* The final region to be painted is the intersection of
 	 * 'region' and 'surf_region'. However, 'region' is in the global
@@ -662,26 +911,24 @@ repaint_region(struct weston_surface *es, pixman_region32_t *region,
 	 */
 	nfans = texture_region(es, region, surf_region);
 
-	v = ec->vertices.data;
 	vtxcnt = ec->vtxcnt.data;
 
-	/* position: */
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
-	glEnableVertexAttribArray(0);
-
-	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
-	glEnableVertexAttribArray(1);
-
+	/* All fans share the shader, textures and uniforms, so instead
+	 * of one glDrawArrays() per fan, submit them as a single indexed
+	 * draw.  Only split when the indices no longer fit in a
+	 * GLushort. */
+	batch_fan = 0;
+	batch_vertex = 0;
 	for (i = 0, first = 0; i < nfans; i++) {
-		glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
-		if (ec->fan_debug)
-			triangle_fan_debug(es, first, vtxcnt[i]);
+		if (first + vtxcnt[i] - batch_vertex > 65536) {
+			draw_fans(es, batch_fan, i, batch_vertex);
+			batch_fan = i;
+			batch_vertex = first;
+		}
 		first += vtxcnt[i];
 	}
-
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(0);
+	if (batch_fan < nfans)
+		draw_fans(es, batch_fan, nfans, batch_vertex);
 
 	ec->vertices.size = 0;
 	ec->vtxcnt.size = 0;
@@ -717,6 +964,8 @@ use_shader(struct gl_renderer *gr,
 	if (gr->current_shader == shader)
 		return;
 
+	shader_ensure(gr, shader);
+
 	glUseProgram(shader->program);
 	gr->current_shader = shader;
 }
@@ -738,6 +987,20 @@ shader_uniforms(struct gl_shader *shader,
 		glUniform1i(shader->tex_uniforms[i], i);
 }
 
+/* The cheapest variant of shader that draws es right. */
+static struct gl_shader *
+surface_shader(struct weston_compositor *ec, struct gl_shader *shader,
+	       struct weston_surface *es)
+{
+	if (es->alpha >= 1.0 && shader->alpha_one) {
+		ec->shader_stats.alpha_one++;
+		return shader->alpha_one;
+	}
+
+	ec->shader_stats.alpha++;
+	return shader;
+}
+
 static void
 draw_surface(struct weston_surface *es, struct weston_output *output,
 	     pixman_region32_t *damage) /* in global coordinates */
@@ -749,6 +1012,7 @@ draw_surface(struct weston_surface *es, struct weston_output *output,
 	pixman_region32_t repaint;
 	/* non-opaque region in surface coordinates: */
 	pixman_region32_t surface_blend;
+	struct gl_shader *shader;
 	GLint filter;
 	int i;
 
@@ -767,8 +1031,9 @@ draw_surface(struct weston_surface *es, struct weston_output *output,
 		shader_uniforms(&gr->solid_shader, es, output);
 	}
 
-	use_shader(gr, gs->shader);
-	shader_uniforms(gs->shader, es, output);
+	shader = surface_shader(ec, gs->shader, es);
+	use_shader(gr, shader);
+	shader_uniforms(shader, es, output);
 
 	if (es->transform.enabled || output->zoom.active)
 		filter = GL_LINEAR;
@@ -794,8 +1059,10 @@ draw_surface(struct weston_surface *es, struct weston_output *output,
 			 * that forces texture alpha = 1.0.
 			 * Xwayland surfaces need this.
 			 */
-			use_shader(gr, &gr->texture_shader_rgbx);
-			shader_uniforms(&gr->texture_shader_rgbx, es, output);
+			shader = surface_shader(ec, &gr->texture_shader_rgbx,
+						es);
+			use_shader(gr, shader);
+			shader_uniforms(shader, es, output);
 		}
 
 		if (es->alpha < 1.0)
@@ -807,7 +1074,9 @@ draw_surface(struct weston_surface *es, struct weston_output *output,
 	}
 
 	if (pixman_region32_not_empty(&surface_blend)) {
-		use_shader(gr, gs->shader);
+		shader = surface_shader(ec, gs->shader, es);
+		use_shader(gr, shader);
+		shader_uniforms(shader, es, output);
 		glEnable(GL_BLEND);
 		repaint_region(es, &repaint, &surface_blend);
 	}
@@ -818,15 +1087,341 @@ out:
 	pixman_region32_fini(&repaint);
 }
 
+/* Global coordinates of the output to a texture of its size, with the
+ * top row first like client buffers and no output transform.  The
+ * shaders take the projection from the output, so this stands in for
+ * output->matrix while drawing into the texture. */
+static void
+output_texture_matrix(struct weston_output *output,
+		      struct weston_matrix *matrix)
+{
+	weston_matrix_init(matrix);
+	weston_matrix_translate(matrix,
+				-(output->x + output->width / 2.0),
+				-(output->y + output->height / 2.0), 0);
+	weston_matrix_scale(matrix,
+			    2.0 / output->width, 2.0 / output->height, 1);
+}
+
+/* A texture of the output size, and a framebuffer drawing into it.
+ * Returns 0 on failure, leaving the framebuffer binding alone. */
+static GLuint
+output_texture_create(struct weston_output *output, GLuint *fbo)
+{
+	GLuint texture;
+	GLint current;
+
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
+		     output->width, output->height, 0,
+		     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &current);
+	glGenFramebuffers(1, fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, *fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, texture, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+	    GL_FRAMEBUFFER_COMPLETE) {
+		glBindFramebuffer(GL_FRAMEBUFFER, current);
+		glDeleteFramebuffers(1, fbo);
+		glDeleteTextures(1, &texture);
+		return 0;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, current);
+
+	return texture;
+}
+
+/* Draw all of the layer on the output, regardless of what covers it,
+ * into a new texture of the output size.  Called while repainting too,
+ * so it puts back the framebuffer and viewport it found.  Returns 0 on
+ * failure. */
+static GLuint
+layer_render_to_texture(struct weston_layer *layer,
+			struct weston_output *output)
+{
+	struct weston_surface *es;
+	struct weston_matrix matrix;
+	pixman_region32_t clip;
+	GLuint fbo, texture;
+	GLint current, viewport[4];
+
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &current);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+
+	texture = output_texture_create(output, &fbo);
+	if (texture == 0)
+		return 0;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glViewport(0, 0, output->width, output->height);
+	glClearColor(0.0, 0.0, 0.0, 0.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	matrix = output->matrix;
+	output_texture_matrix(output, &output->matrix);
+
+	wl_list_for_each_reverse(es, &layer->surface_list, layer_link) {
+		clip = es->clip;
+		pixman_region32_init(&es->clip);
+		draw_surface(es, output, &output->region);
+		pixman_region32_fini(&es->clip);
+		es->clip = clip;
+	}
+
+	output->matrix = matrix;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, current);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+	glDeleteFramebuffers(1, &fbo);
+
+	return texture;
+}
+
+static void
+surface_attach_layer_texture(struct gl_renderer *gr,
+			     struct gl_surface_state *gs,
+			     GLuint texture, int32_t width)
+{
+	gs->textures[0] = texture;
+	gs->num_textures = 1;
+	gs->target = GL_TEXTURE_2D;
+	gs->shader = &gr->texture_shader_rgba;
+	gs->pitch = width;
+}
+
+static int
+gl_renderer_snapshot_layer(struct weston_surface *snapshot,
+			   struct weston_layer *layer,
+			   struct weston_output *output)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	GLuint texture;
+
+	if (use_output(output) < 0)
+		return -1;
+
+	texture = layer_render_to_texture(layer, output);
+	if (texture == 0)
+		return -1;
+
+	surface_attach_layer_texture(gr, get_surface_state(snapshot),
+				     texture, output->width);
+
+	return 0;
+}
+
+static void
+set_output_viewport(struct weston_output *output)
+{
+	glViewport(0, 0,
+		   output->current->width +
+		   output->border.left + output->border.right,
+		   output->current->height +
+		   output->border.top + output->border.bottom);
+}
+
+static struct gl_layer_cache *
+layer_cache_create(struct weston_output *output, struct weston_layer *layer)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_layer_cache *cache;
+
+	cache = calloc(1, sizeof *cache);
+	if (cache == NULL)
+		return NULL;
+
+	cache->surface = weston_surface_create(output->compositor);
+	if (cache->surface == NULL) {
+		free(cache);
+		return NULL;
+	}
+
+	weston_plane_init(&cache->plane, 0, 0);
+	cache->surface->plane = &cache->plane;
+	cache->layer = layer;
+	wl_list_insert(&go->layer_cache_list, &cache->link);
+
+	return cache;
+}
+
+static void
+layer_cache_release(struct gl_renderer *gr, struct gl_layer_cache *cache)
+{
+	struct gl_surface_state *gs = get_surface_state(cache->surface);
+
+	if (cache->size == 0)
+		return;
+
+	glDeleteTextures(gs->num_textures, gs->textures);
+	gs->num_textures = 0;
+	gr->layer_cache_size -= cache->size;
+	cache->size = 0;
+}
+
+static void
+layer_cache_destroy(struct gl_renderer *gr, struct gl_layer_cache *cache)
+{
+	layer_cache_release(gr, cache);
+	weston_surface_destroy(cache->surface);
+	weston_plane_release(&cache->plane);
+	wl_list_remove(&cache->link);
+	free(cache);
+}
+
+static int
+layer_cache_valid(struct gl_layer_cache *cache, struct weston_output *output)
+{
+	struct weston_surface *es = cache->surface;
+
+	return cache->size > 0 && cache->serial == cache->layer->serial &&
+		es->geometry.x == output->x && es->geometry.y == output->y &&
+		es->geometry.width == output->width &&
+		es->geometry.height == output->height;
+}
+
+static struct gl_layer_cache *
+layer_cache_build(struct weston_output *output, struct weston_layer *layer,
+		  struct gl_layer_cache *cache)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct weston_surface *es;
+	uint32_t size = output->width * output->height * 4;
+	GLuint texture;
+
+	if (cache)
+		layer_cache_release(gr, cache);
+
+	if (gr->layer_cache_size + size >
+	    (uint64_t) ec->layer_cache_budget << 20)
+		return NULL;
+
+	if (cache == NULL)
+		cache = layer_cache_create(output, layer);
+	if (cache == NULL)
+		return NULL;
+
+	es = cache->surface;
+	if (es->geometry.x != output->x || es->geometry.y != output->y ||
+	    es->geometry.width != output->width ||
+	    es->geometry.height != output->height) {
+		weston_surface_configure(es, output->x, output->y,
+					 output->width, output->height);
+		weston_surface_update_transform(es);
+	}
+
+	texture = layer_render_to_texture(layer, output);
+	if (texture == 0)
+		return NULL;
+
+	surface_attach_layer_texture(gr, get_surface_state(es),
+				     texture, output->width);
+	cache->serial = layer->serial;
+	cache->size = size;
+	gr->layer_cache_size += size;
+
+	return cache;
+}
+
+/* Draw the layer from its cached texture if none of its surfaces changed
+ * in the last layer_cache_frames repaints, building the cache the first
+ * time.  Only layers of several surfaces all on the primary plane are
+ * worth it.  Returns 0 if the caller is to draw the surfaces. */
+static int
+draw_layer_cached(struct weston_output *output, struct weston_layer *layer,
+		  pixman_region32_t *damage)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_layer_cache *cache = NULL, *c;
+	struct weston_surface *es, *top = NULL;
+	int count = 0;
+
+	wl_list_for_each(c, &go->layer_cache_list, link)
+		if (c->layer == layer) {
+			cache = c;
+			cache->seen = 1;
+			break;
+		}
+
+	if (layer->idle_frames < (uint32_t) ec->layer_cache_frames)
+		goto uncached;
+
+	wl_list_for_each(es, &layer->surface_list, layer_link) {
+		if (es->plane != &ec->primary_plane)
+			goto uncached;
+		if (top == NULL)
+			top = es;
+		count++;
+	}
+	if (count < 2)
+		goto uncached;
+
+	if (cache && layer_cache_valid(cache, output)) {
+		ec->layer_cache_stats.hits++;
+	} else {
+		ec->layer_cache_stats.misses++;
+		cache = layer_cache_build(output, layer, cache);
+		if (cache == NULL)
+			return 0;
+		cache->seen = 1;
+	}
+
+	/* what covers the top surface of the layer covers all of it */
+	pixman_region32_copy(&cache->surface->clip, &top->clip);
+	draw_surface(cache->surface, output, damage);
+
+	return 1;
+
+uncached:
+	if (cache)
+		layer_cache_release(gr, cache);
+
+	return 0;
+}
+
 static void
 repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_layer_cache *cache, *next;
 	struct weston_surface *surface;
+	struct weston_layer *layer;
 
-	wl_list_for_each_reverse(surface, &compositor->surface_list, link)
-		if (surface->plane == &compositor->primary_plane)
-			draw_surface(surface, output, damage);
+	if (compositor->layer_cache_frames == 0 || compositor->fan_debug) {
+		wl_list_for_each_reverse(surface, &compositor->surface_list,
+					 link)
+			if (surface->plane == &compositor->primary_plane)
+				draw_surface(surface, output, damage);
+		return;
+	}
+
+	/* the surface list is the layers' surfaces, in the same order */
+	wl_list_for_each_reverse(layer, &compositor->layer_list, link) {
+		if (draw_layer_cached(output, layer, damage))
+			continue;
+
+		wl_list_for_each_reverse(surface, &layer->surface_list,
+					 layer_link)
+			if (surface->plane == &compositor->primary_plane)
+				draw_surface(surface, output, damage);
+	}
+
+	/* and the caches of layers that went away */
+	wl_list_for_each_safe(cache, next, &go->layer_cache_list, link) {
+		if (cache->seen)
+			cache->seen = 0;
+		else
+			layer_cache_destroy(gr, cache);
+	}
 }
 
 
@@ -953,23 +1548,28 @@ output_get_buffer_damage(struct weston_output *output,
 	struct gl_renderer *gr = get_renderer(output->compositor);
 	EGLint buffer_age = 0;
 	EGLBoolean ret;
+	static int errored;
 	int i;
 
 	if (gr->has_egl_buffer_age) {
 		ret = eglQuerySurface(gr->egl_display, go->egl_surface,
 				      EGL_BUFFER_AGE_EXT, &buffer_age);
-		if (ret == EGL_FALSE) {
+		if (ret == EGL_FALSE && !errored) {
+			errored = 1;
 			weston_log("buffer age query failed.\n");
 			gl_renderer_print_egl_error_state();
 		}
 	}
 
-	if (buffer_age == 0 || buffer_age - 1 > BUFFER_DAMAGE_COUNT)
+	/* an age of n has the frame from n swaps ago, missing the
+	 * damage of the n - 1 frames since */
+	if (buffer_age == 0 || buffer_age - 1 > go->buffer_damage_count)
 		pixman_region32_copy(buffer_damage, &output->region);
 	else
 		for (i = 0; i < buffer_age - 1; i++)
 			pixman_region32_union(buffer_damage, buffer_damage,
-					      &go->buffer_damage[i]);
+				&go->buffer_damage[(go->buffer_damage_head + i) %
+						   BUFFER_DAMAGE_COUNT]);
 }
 
 static void
@@ -978,74 +1578,242 @@ output_rotate_damage(struct weston_output *output,
 {
 	struct gl_output_state *go = get_output_state(output);
 	struct gl_renderer *gr = get_renderer(output->compositor);
-	int i;
 
 	if (!gr->has_egl_buffer_age)
 		return;
 
-	for (i = BUFFER_DAMAGE_COUNT - 1; i >= 1; i--)
-		pixman_region32_copy(&go->buffer_damage[i],
-				     &go->buffer_damage[i - 1]);
-
-	pixman_region32_copy(&go->buffer_damage[0], output_damage);
+	go->buffer_damage_head = (go->buffer_damage_head +
+				  BUFFER_DAMAGE_COUNT - 1) % BUFFER_DAMAGE_COUNT;
+	pixman_region32_copy(&go->buffer_damage[go->buffer_damage_head],
+			     output_damage);
+	if (go->buffer_damage_count < BUFFER_DAMAGE_COUNT)
+		go->buffer_damage_count++;
 }
 
-static void
-gl_renderer_repaint_output(struct weston_output *output,
-			      pixman_region32_t *output_damage)
+/*
+ * Tells the other end of the surface, a parent compositor for the
+ * wayland backend, what changed since the last frame.  The rectangles
+ * are in surface coordinates with the origin at the bottom left.
+ */
+static EGLBoolean
+output_swap_buffers(struct weston_output *output,
+		    pixman_region32_t *output_damage)
 {
 	struct gl_output_state *go = get_output_state(output);
-	struct weston_compositor *compositor = output->compositor;
-	struct gl_renderer *gr = get_renderer(compositor);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	pixman_box32_t *rects, rect, b;
+	EGLint *damage, *d;
 	EGLBoolean ret;
-	static int errored;
-	int32_t width, height;
-	pixman_region32_t buffer_damage, total_damage;
-
-	width = output->current->width +
-		output->border.left + output->border.right;
-	height = output->current->height +
-		output->border.top + output->border.bottom;
+	int i, nrects, height;
 
-	glViewport(0, 0, width, height);
+	if (!gr->swap_buffers_with_damage || go->swap_full ||
+	    output->compositor->fan_debug) {
+		go->swap_full = 0;
+		return eglSwapBuffers(gr->egl_display, go->egl_surface);
+	}
 
-	if (use_output(output) < 0)
-		return;
+	rects = pixman_region32_rectangles(output_damage, &nrects);
+	damage = malloc(nrects * 4 * sizeof *damage);
+	if (damage == NULL)
+		return eglSwapBuffers(gr->egl_display, go->egl_surface);
 
-	/* if debugging, redraw everything outside the damage to clean up
-	 * debug lines from the previous draw on this buffer:
-	 */
-	if (compositor->fan_debug) {
-		pixman_region32_t undamaged;
-		pixman_region32_init(&undamaged);
-		pixman_region32_subtract(&undamaged, &output->region,
-					 output_damage);
-		compositor->fan_debug = 0;
-		repaint_surfaces(output, &undamaged);
-		compositor->fan_debug = 1;
-		pixman_region32_fini(&undamaged);
+	height = output->current->height +
+		output->border.top + output->border.bottom;
+	for (i = 0, d = damage; i < nrects; i++, d += 4) {
+		rect.x1 = rects[i].x1 - output->x;
+		rect.y1 = rects[i].y1 - output->y;
+		rect.x2 = rects[i].x2 - output->x;
+		rect.y2 = rects[i].y2 - output->y;
+		b = weston_transformed_rect(output->width, output->height,
+					    output->transform, rect);
+		d[0] = b.x1 + output->border.left;
+		d[1] = height - (b.y2 + output->border.top);
+		d[2] = b.x2 - b.x1;
+		d[3] = b.y2 - b.y1;
 	}
 
-	pixman_region32_init(&total_damage);
-	pixman_region32_init(&buffer_damage);
+	ret = gr->swap_buffers_with_damage(gr->egl_display, go->egl_surface,
+					   damage, nrects);
+	free(damage);
 
-	output_get_buffer_damage(output, &buffer_damage);
-	output_rotate_damage(output, output_damage);
+	return ret;
+}
 
-	pixman_region32_union(&total_damage, &buffer_damage, output_damage);
+static void
+zoom_release(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
 
-	repaint_surfaces(output, &total_damage);
+	if (go->zoom.surface == NULL)
+		return;
 
-	pixman_region32_fini(&total_damage);
-	pixman_region32_fini(&buffer_damage);
+	/* the surface deletes the texture */
+	weston_surface_destroy(go->zoom.surface);
+	weston_plane_release(&go->zoom.plane);
+	glDeleteFramebuffers(1, &go->zoom.fbo);
+	go->zoom.surface = NULL;
+	go->zoom.texture = 0;
+}
+
+static int
+zoom_create(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct weston_surface *es;
+
+	go->zoom.texture = output_texture_create(output, &go->zoom.fbo);
+	if (go->zoom.texture == 0)
+		return -1;
+
+	es = weston_surface_create(output->compositor);
+	if (es == NULL) {
+		glDeleteFramebuffers(1, &go->zoom.fbo);
+		glDeleteTextures(1, &go->zoom.texture);
+		go->zoom.texture = 0;
+		return -1;
+	}
+
+	/* never mapped, its damage goes nowhere */
+	weston_plane_init(&go->zoom.plane, 0, 0);
+	es->plane = &go->zoom.plane;
+	weston_surface_configure(es, output->x, output->y,
+				 output->width, output->height);
+	weston_surface_update_transform(es);
+	pixman_region32_fini(&es->opaque);
+	pixman_region32_init_rect(&es->opaque, 0, 0,
+				  output->width, output->height);
+	surface_attach_layer_texture(gr, get_surface_state(es),
+				     go->zoom.texture, output->width);
+	go->zoom.surface = es;
+
+	return 0;
+}
+
+/*
+ * While zoomed, the surfaces are drawn unzoomed into a texture of the
+ * output, where only the damage needs repainting, and the zoomed part
+ * of that texture is drawn to the output.  Changing the zoom level or
+ * moving the zoomed area then only redraws this one quad, so zoom.c
+ * only schedules a repaint for it.  The whole output buffer is drawn
+ * each time, as far as buffer age is concerned.
+ *
+ * Fading the output goes the same way, with the quad drawn at the
+ * alpha of the fade over black.
+ */
+static int
+repaint_zoomed(struct weston_output *output, pixman_region32_t *output_damage)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct weston_surface *es = go->zoom.surface;
+	struct weston_matrix matrix;
+	pixman_region32_t *damage = output_damage;
+
+	if (es && (es->geometry.x != output->x ||
+		   es->geometry.y != output->y ||
+		   es->geometry.width != output->width ||
+		   es->geometry.height != output->height))
+		zoom_release(output);
+
+	if (go->zoom.surface == NULL) {
+		if (zoom_create(output) < 0)
+			return -1;
+		damage = &output->region;
+	}
+
+	if (pixman_region32_not_empty(damage)) {
+		glBindFramebuffer(GL_FRAMEBUFFER, go->zoom.fbo);
+		glViewport(0, 0, output->width, output->height);
+		matrix = output->matrix;
+		output_texture_matrix(output, &output->matrix);
+
+		repaint_surfaces(output, damage);
+
+		output->matrix = matrix;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		set_output_viewport(output);
+	}
+
+	if (output->fade > 0.0) {
+		glClearColor(0.0, 0.0, 0.0, 1.0);
+		glClear(GL_COLOR_BUFFER_BIT);
+	}
+	go->zoom.surface->alpha = 1.0 - output->fade;
+	draw_surface(go->zoom.surface, output, &output->region);
+	output_rotate_damage(output, &output->region);
 
+	return 0;
+}
+
+static void
+gl_renderer_repaint_output(struct weston_output *output,
+			      pixman_region32_t *output_damage)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
+	EGLBoolean ret;
+	static int errored;
+	pixman_region32_t buffer_damage, total_damage;
+	int zoomed;
+
+	set_output_viewport(output);
+
+	if (use_output(output) < 0)
+		return;
+
+	if (!output->zoom.active && output->fade == 0.0) {
+		/* the last faded or zoomed frame differs from this one
+		 * all over */
+		if (go->zoom.surface)
+			output_damage = &output->region;
+		zoom_release(output);
+	} else {
+		zoomed = repaint_zoomed(output, output_damage) == 0;
+
+		/* zoom.c no longer damages what moving the zoom changes,
+		 * and a zoomed repaint draws all of the output again, so
+		 * does every step of a fade */
+		output_damage = &output->region;
+		if (zoomed)
+			goto out;
+	}
+
+	/* if debugging, redraw everything outside the damage to clean up
+	 * debug lines from the previous draw on this buffer:
+	 */
+	if (compositor->fan_debug) {
+		pixman_region32_t undamaged;
+		pixman_region32_init(&undamaged);
+		pixman_region32_subtract(&undamaged, &output->region,
+					 output_damage);
+		compositor->fan_debug = 0;
+		repaint_surfaces(output, &undamaged);
+		compositor->fan_debug = 1;
+		pixman_region32_fini(&undamaged);
+	}
+
+	pixman_region32_init(&total_damage);
+	pixman_region32_init(&buffer_damage);
+
+	output_get_buffer_damage(output, &buffer_damage);
+	output_rotate_damage(output, output_damage);
+
+	pixman_region32_union(&total_damage, &buffer_damage, output_damage);
+
+	repaint_surfaces(output, &total_damage);
+
+	pixman_region32_fini(&total_damage);
+	pixman_region32_fini(&buffer_damage);
+
+out:
 	if (gr->border.texture)
 		draw_border(output);
 
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
 
-	ret = eglSwapBuffers(gr->egl_display, go->egl_surface);
+	ret = output_swap_buffers(output, output_damage);
 	if (ret == EGL_FALSE && !errored) {
 		errored = 1;
 		weston_log("Failed in eglSwapBuffers.\n");
@@ -1083,21 +1851,565 @@ gl_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+struct weston_capture {
+	struct weston_output *output;
+	GLuint fbo, texture, pack_buffer;
+	int32_t width, height;
+};
+
+static GLenum
+gl_read_format(struct weston_compositor *ec)
+{
+	return ec->read_format == PIXMAN_a8r8g8b8 ? GL_BGRA_EXT : GL_RGBA;
+}
+
 static void
-gl_renderer_flush_damage(struct weston_surface *surface)
+capture_destroy(struct weston_capture *capture)
 {
-	struct gl_renderer *gr = get_renderer(surface->compositor);
-	struct gl_surface_state *gs = get_surface_state(surface);
-	struct wl_buffer *buffer = gs->buffer_ref.buffer;
+	if (capture->pack_buffer)
+		glDeleteBuffers(1, &capture->pack_buffer);
+	if (capture->fbo)
+		glDeleteFramebuffers(1, &capture->fbo);
+	if (capture->texture)
+		glDeleteTextures(1, &capture->texture);
+	free(capture);
+}
+
+/* Copy the rectangle out of the back buffer and draw it, scaled and
+ * upside down, into the capture's framebuffer, for when it cannot be
+ * blitted there. */
+static void
+capture_draw(struct weston_capture *capture, int32_t x, int32_t y,
+	     int32_t width, int32_t height)
+{
+	struct weston_output *output = capture->output;
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_shader *shader = &gr->texture_shader_rgbx;
+	struct weston_matrix matrix;
+	GLuint source;
+	static const GLfloat verts[] = {
+		/* x, y, s, t */
+		-1.0f, -1.0f, 0.0f, 1.0f,
+		 1.0f, -1.0f, 1.0f, 1.0f,
+		 1.0f,  1.0f, 1.0f, 0.0f,
+		-1.0f,  1.0f, 0.0f, 0.0f,
+	};
+
+	glActiveTexture(GL_TEXTURE0);
+	glGenTextures(1, &source);
+	glBindTexture(GL_TEXTURE_2D, source);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, x, y, width, height, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, capture->fbo);
+	glViewport(0, 0, capture->width, capture->height);
+	glDisable(GL_BLEND);
+	use_shader(gr, shader);
+	weston_matrix_init(&matrix);
+	glUniformMatrix4fv(shader->proj_uniform, 1, GL_FALSE, matrix.d);
+	glUniform1i(shader->tex_uniforms[0], 0);
+	glUniform1f(shader->alpha_uniform, 1);
 
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE,
+			      4 * sizeof *verts, &verts[0]);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE,
+			      4 * sizeof *verts, &verts[2]);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+
+	glDeleteTextures(1, &source);
+}
+
+/*
+ * The rectangle is blitted or drawn, scaled and upside down, from the
+ * back buffer before the swap into a texture of the capture's size,
+ * so glReadPixels of that gives the rows top first.  With pixel pack
+ * buffers, that read is started here and only mapped when the capture
+ * is finished; without, the read waits until then, by when the GPU
+ * should long be done with the drawing.
+ */
+static struct weston_capture *
+gl_renderer_capture_start(struct weston_output *output,
+			  int32_t x, int32_t y,
+			  int32_t width, int32_t height, int32_t scale)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct weston_capture *capture;
+
+	if (use_output(output) < 0)
+		return NULL;
+
+	capture = calloc(1, sizeof *capture);
+	if (capture == NULL)
+		return NULL;
+
+	capture->output = output;
+	capture->width = width / scale > 0 ? width / scale : 1;
+	capture->height = height / scale > 0 ? height / scale : 1;
+
+	/* in framebuffer coordinates, from the bottom */
+	x += output->border.left;
+	y = output->border.bottom + output->current->height - y - height;
+
+	glGenTextures(1, &capture->texture);
+	glBindTexture(GL_TEXTURE_2D, capture->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
+		     capture->width, capture->height, 0,
+		     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+	glGenFramebuffers(1, &capture->fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, capture->fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, capture->texture, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+	    GL_FRAMEBUFFER_COMPLETE) {
+		weston_log("capture framebuffer incomplete\n");
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		capture_destroy(capture);
+		return NULL;
+	}
+
+	if (gr->blit_framebuffer) {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, capture->fbo);
+		gr->blit_framebuffer(x, y, x + width, y + height,
+				     0, capture->height, capture->width, 0,
+				     GL_COLOR_BUFFER_BIT,
+				     scale > 1 ? GL_LINEAR : GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, capture->fbo);
+	} else {
+		capture_draw(capture, x, y, width, height);
+	}
+
+	if (gr->has_pack_buffer) {
+		glGenBuffers(1, &capture->pack_buffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, capture->pack_buffer);
+		glBufferData(GL_PIXEL_PACK_BUFFER,
+			     capture->width * capture->height * 4,
+			     NULL, GL_STREAM_READ);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, capture->width, capture->height,
+			     gl_read_format(ec), GL_UNSIGNED_BYTE, NULL);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	set_output_viewport(output);
+
+	return capture;
+}
+
+static int
+gl_renderer_capture_finish(struct weston_capture *capture,
+			   pixman_format_code_t format,
+			   void *pixels, int32_t stride)
+{
+	struct weston_compositor *ec = capture->output->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	pixman_image_t *src, *dst;
+	int32_t size = capture->width * capture->height * 4;
+	void *data = NULL;
+	int ret = -1;
+
+	if (pixels == NULL || use_output(capture->output) < 0)
+		goto out;
+
+	/* straight into the caller's memory, when only the stride
+	 * may differ */
+	if (!capture->pack_buffer && format == ec->read_format &&
+	    (stride == capture->width * 4 || gr->has_pack_row_length)) {
+		glBindFramebuffer(GL_FRAMEBUFFER, capture->fbo);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		if (stride != capture->width * 4)
+			glPixelStorei(GL_PACK_ROW_LENGTH, stride / 4);
+		glReadPixels(0, 0, capture->width, capture->height,
+			     gl_read_format(ec), GL_UNSIGNED_BYTE, pixels);
+		if (stride != capture->width * 4)
+			glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		ret = 0;
+		goto out;
+	}
+
+	if (capture->pack_buffer) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, capture->pack_buffer);
+		data = gr->map_buffer_range(GL_PIXEL_PACK_BUFFER, 0, size,
+					    GL_MAP_READ_BIT);
+		if (data == NULL) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			goto out;
+		}
+	} else {
+		data = malloc(size);
+		if (data == NULL)
+			goto out;
+		glBindFramebuffer(GL_FRAMEBUFFER, capture->fbo);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, capture->width, capture->height,
+			     gl_read_format(ec), GL_UNSIGNED_BYTE, data);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	/* to the caller's stride and channel order */
+	src = pixman_image_create_bits(ec->read_format,
+				       capture->width, capture->height,
+				       data, capture->width * 4);
+	dst = pixman_image_create_bits(format,
+				       capture->width, capture->height,
+				       pixels, stride);
+	if (src && dst) {
+		pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst,
+					 0, 0, 0, 0, 0, 0,
+					 capture->width, capture->height);
+		ret = 0;
+	}
+	if (src)
+		pixman_image_unref(src);
+	if (dst)
+		pixman_image_unref(dst);
+
+	if (capture->pack_buffer) {
+		gr->unmap_buffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	} else {
+		free(data);
+	}
+
+out:
+	capture_destroy(capture);
+
+	return ret;
+}
+
+static const struct gl_shm_format gl_shm_formats[] = {
+	{ WL_SHM_FORMAT_ARGB8888, 1, {
+		{ GL_BGRA_EXT, 4, 1, 1 } } },
+	{ WL_SHM_FORMAT_XRGB8888, 1, {
+		{ GL_BGRA_EXT, 4, 1, 1 } } },
+	/* Y from every texel pair, U and V from every texel quad */
+	{ WL_SHM_FORMAT_YUYV, 2, {
+		{ GL_LUMINANCE_ALPHA, 2, 1, 1 },
+		{ GL_RGBA, 4, 2, 1 } } },
+};
+
+static const struct gl_shm_format *
+gl_shm_format_lookup(uint32_t format)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(gl_shm_formats); i++)
+		if (gl_shm_formats[i].format == format)
+			return &gl_shm_formats[i];
+
+	return NULL;
+}
+
+/* Upload region (in plane 0 texels of the buffer) of an SHM buffer
+ * plane into texture.  Runs in whichever context is current, the main
+ * one or the upload thread's. */
+/* Returns the number of bytes uploaded. */
+static uint64_t
+texture_upload_region(struct gl_renderer *gr, GLuint texture,
+		      const struct gl_shm_plane *plane,
+		      void *data, int pitch, int height,
+		      pixman_region32_t *region)
+{
+	uint64_t bytes = 0;
 #ifdef GL_UNPACK_ROW_LENGTH
 	pixman_box32_t *rectangles;
-	void *data;
-	int i, n;
+	int i, n, x1, y1, x2, y2;
+#endif
+
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, plane->cpp == 4 ? 4 : 1);
+
+	if (!gr->has_unpack_subimage) {
+		glTexImage2D(GL_TEXTURE_2D, 0, plane->format,
+			     pitch, height, 0,
+			     plane->format, GL_UNSIGNED_BYTE, data);
+		return (uint64_t) pitch * height * plane->cpp;
+	}
+
+#ifdef GL_UNPACK_ROW_LENGTH
+	/* Mesa does not define GL_EXT_unpack_subimage */
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch);
+	rectangles = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++) {
+		x1 = rectangles[i].x1 / plane->hsub;
+		y1 = rectangles[i].y1 / plane->vsub;
+		x2 = (rectangles[i].x2 + plane->hsub - 1) / plane->hsub;
+		y2 = (rectangles[i].y2 + plane->vsub - 1) / plane->vsub;
+		if (x2 > pitch)
+			x2 = pitch;
+		if (y2 > height)
+			y2 = height;
+
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS, x1);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS, y1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x1, y1, x2 - x1, y2 - y1,
+				plane->format, GL_UNSIGNED_BYTE, data);
+		bytes += (uint64_t) (x2 - x1) * (y2 - y1) * plane->cpp;
+	}
 #endif
 
+	return bytes;
+}
+
+/* Walk the planes of an SHM buffer: their data, pitch in texels and
+ * height.  Returns 0 past the last plane. */
+static int
+shm_plane_layout(const struct gl_shm_format *f, struct wl_buffer *buffer,
+		 int i, uint8_t **data, int *pitch, int *height)
+{
+	const struct gl_shm_plane *p;
+
+	if (i >= f->num_planes)
+		return 0;
+
+	p = &f->planes[i];
+	*data = wl_shm_buffer_get_data(buffer);
+	*pitch = wl_shm_buffer_get_stride(buffer) /
+		(f->planes[0].cpp * p->hsub);
+	*height = (buffer->height + p->vsub - 1) / p->vsub;
+
+	return 1;
+}
+
+static uint64_t
+surface_upload_planes(struct gl_renderer *gr, struct gl_surface_state *gs,
+		      struct wl_buffer *buffer, pixman_region32_t *region)
+{
+	uint8_t *data;
+	int i, pitch, height;
+	uint64_t bytes = 0;
+
+	for (i = 0; shm_plane_layout(gs->shm_format, buffer, i,
+				     &data, &pitch, &height); i++)
+		bytes += texture_upload_region(gr, gs->textures[i],
+					       &gs->shm_format->planes[i],
+					       data, pitch, height, region);
+
+	return bytes;
+}
+
+static void
+surface_damage_to_buffer_region(struct weston_surface *surface,
+				pixman_region32_t *damage,
+				pixman_region32_t *region)
+{
+	pixman_box32_t *rectangles, r;
+	int i, n;
+
+	rectangles = pixman_region32_rectangles(damage, &n);
+	for (i = 0; i < n; i++) {
+		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
+		pixman_region32_union_rect(region, region, r.x1, r.y1,
+					   r.x2 - r.x1, r.y2 - r.y1);
+	}
+}
+
+static void *
+upload_thread(void *data)
+{
+	struct gl_renderer *gr = data;
+	struct gl_upload_job *job;
+	sigset_t mask;
+
+	/* Leave all signal handling to the main thread's signalfds. */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		       gr->upload.context);
+
+	pthread_mutex_lock(&gr->upload.mutex);
+	while (!gr->upload.quit) {
+		if (wl_list_empty(&gr->upload.queue)) {
+			pthread_cond_wait(&gr->upload.queue_cond,
+					  &gr->upload.mutex);
+			continue;
+		}
+
+		job = container_of(gr->upload.queue.next,
+				   struct gl_upload_job, link);
+		wl_list_remove(&job->link);
+		job->state = GL_UPLOAD_RUNNING;
+		pthread_mutex_unlock(&gr->upload.mutex);
+
+		job->bytes = texture_upload_region(gr, job->texture,
+						   job->plane, job->data,
+						   job->pitch, job->height,
+						   &job->region);
+		job->fence = gr->create_sync(gr->egl_display,
+					     EGL_SYNC_FENCE_KHR, NULL);
+		glFlush();
+
+		pthread_mutex_lock(&gr->upload.mutex);
+		job->state = GL_UPLOAD_DONE;
+		pthread_cond_broadcast(&gr->upload.done_cond);
+	}
+	pthread_mutex_unlock(&gr->upload.mutex);
+
+	eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		       EGL_NO_CONTEXT);
+	eglReleaseThread();
+
+	return NULL;
+}
+
+/* Take the surface's upload job back from the upload thread.  If the
+ * thread already started on it, wait for it to finish and for the GPU
+ * to complete the upload; damage that made it into the texture is
+ * added to staged_damage.  A job that did not start yet is simply
+ * dropped and its damage gets uploaded synchronously at flush time.
+ * Returns the bytes the thread uploaded. */
+static uint64_t
+surface_retire_upload(struct gl_surface_state *gs)
+{
+	struct gl_upload_job *job = gs->upload;
+	struct gl_renderer *gr;
+	uint64_t bytes = 0;
+	int started;
+
+	if (!job)
+		return 0;
+
+	gr = job->renderer;
+
+	pthread_mutex_lock(&gr->upload.mutex);
+	started = job->state != GL_UPLOAD_QUEUED;
+	if (started) {
+		while (job->state != GL_UPLOAD_DONE)
+			pthread_cond_wait(&gr->upload.done_cond,
+					  &gr->upload.mutex);
+	} else {
+		wl_list_remove(&job->link);
+	}
+	pthread_mutex_unlock(&gr->upload.mutex);
+
+	if (started && job->fence != EGL_NO_SYNC_KHR) {
+		gr->client_wait_sync(gr->egl_display, job->fence,
+				     EGL_SYNC_FLUSH_COMMANDS_BIT_KHR,
+				     EGL_FOREVER_KHR);
+		gr->destroy_sync(gr->egl_display, job->fence);
+		pixman_region32_union(&gs->staged_damage,
+				      &gs->staged_damage, &job->damage);
+		bytes = job->bytes;
+	}
+
+	wl_list_remove(&job->buffer_destroy_listener.link);
+	pixman_region32_fini(&job->region);
+	pixman_region32_fini(&job->damage);
+	free(job);
+	gs->upload = NULL;
+
+	return bytes;
+}
+
+static void
+upload_job_handle_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct gl_upload_job *job =
+		container_of(listener, struct gl_upload_job,
+			     buffer_destroy_listener);
+
+	/* The pool may be unmapped once the buffer is gone, so the upload
+	 * thread must be done reading from it. */
+	surface_retire_upload(job->gs);
+}
+
+static void
+gl_renderer_commit(struct weston_surface *surface, pixman_region32_t *damage)
+{
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(surface);
+	struct wl_buffer *buffer = gs->buffer_ref.buffer;
+	struct gl_upload_job *job;
+
+	if (!gr->upload.enabled || !buffer || !wl_buffer_is_shm(buffer) ||
+	    surface->plane != &surface->compositor->primary_plane ||
+	    gs->needs_full_upload || gs->shm_format->num_planes > 1)
+		return;
+
+	/* Only one upload in flight per surface.  Whatever this commit
+	 * damaged must not be taken from the previous upload, it is left
+	 * for flush_damage. */
+	if (gs->upload) {
+		pixman_region32_subtract(&gs->upload->damage,
+					 &gs->upload->damage, damage);
+		pixman_region32_subtract(&gs->staged_damage,
+					 &gs->staged_damage, damage);
+		return;
+	}
+
+	job = malloc(sizeof *job);
+	if (job == NULL)
+		return;
+
+	pixman_region32_init(&job->damage);
+	pixman_region32_intersect_rect(&job->damage, damage, 0, 0,
+				       surface->geometry.width,
+				       surface->geometry.height);
+	pixman_region32_subtract(&job->damage, &job->damage,
+				 &gs->staged_damage);
+	if (!pixman_region32_not_empty(&job->damage)) {
+		pixman_region32_fini(&job->damage);
+		free(job);
+		return;
+	}
+
+	pixman_region32_init(&job->region);
+	surface_damage_to_buffer_region(surface, &job->damage, &job->region);
+
+	job->renderer = gr;
+	job->gs = gs;
+	job->texture = gs->textures[0];
+	job->plane = &gs->shm_format->planes[0];
+	job->data = wl_shm_buffer_get_data(buffer);
+	job->pitch = gs->pitch;
+	job->height = buffer->height;
+	job->fence = EGL_NO_SYNC_KHR;
+	job->buffer_destroy_listener.notify =
+		upload_job_handle_buffer_destroy;
+	wl_signal_add(&buffer->resource.destroy_signal,
+		      &job->buffer_destroy_listener);
+	gs->upload = job;
+
+	/* Make sure the texture storage allocated in attach is visible
+	 * to the upload context. */
+	glFlush();
+
+	pthread_mutex_lock(&gr->upload.mutex);
+	job->state = GL_UPLOAD_QUEUED;
+	wl_list_insert(gr->upload.queue.prev, &job->link);
+	pthread_cond_signal(&gr->upload.queue_cond);
+	pthread_mutex_unlock(&gr->upload.mutex);
+}
+
+static void
+gl_renderer_flush_damage(struct weston_surface *surface)
+{
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(surface);
+	struct wl_buffer *buffer = gs->buffer_ref.buffer;
+	struct gl_buffer_texture *bt;
+	pixman_region32_t region;
+	uint64_t bytes;
+
 	pixman_region32_union(&gs->texture_damage,
 			      &gs->texture_damage, &surface->damage);
+	wl_list_for_each(bt, &gs->buffer_texture_list, link)
+		pixman_region32_union(&bt->damage,
+				      &bt->damage, &surface->damage);
 
 	if (!buffer)
 		return;
@@ -1110,45 +2422,54 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	if (surface->plane != &surface->compositor->primary_plane)
 		return;
 
-	if (!pixman_region32_not_empty(&gs->texture_damage))
-		goto done;
-
-	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
-
-	if (!gr->has_unpack_subimage) {
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT,
-			     gs->pitch, buffer->height, 0,
-			     GL_BGRA_EXT, GL_UNSIGNED_BYTE,
-			     wl_shm_buffer_get_data(buffer));
-
+	/* Whatever the upload thread already staged only needs the
+	 * fence wait; upload the rest here. */
+	bytes = surface_retire_upload(gs);
+	pixman_region32_subtract(&gs->texture_damage,
+				 &gs->texture_damage, &gs->staged_damage);
+	pixman_region32_fini(&gs->staged_damage);
+	pixman_region32_init(&gs->staged_damage);
+
+	if (gs->needs_full_upload) {
+		pixman_region32_init_rect(&region, 0, 0,
+					  gs->pitch, buffer->height);
+		bytes += surface_upload_planes(gr, gs, buffer, &region);
+		pixman_region32_fini(&region);
+		gs->needs_full_upload = 0;
 		goto done;
 	}
 
-#ifdef GL_UNPACK_ROW_LENGTH
-	/* Mesa does not define GL_EXT_unpack_subimage */
-	glPixelStorei(GL_UNPACK_ROW_LENGTH, gs->pitch);
-	data = wl_shm_buffer_get_data(buffer);
-	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
-	for (i = 0; i < n; i++) {
-		pixman_box32_t r;
-
-		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
+	if (!pixman_region32_not_empty(&gs->texture_damage))
+		goto done;
 
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS, r.x1);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS, r.y1);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, r.x1, r.y1,
-				r.x2 - r.x1, r.y2 - r.y1,
-				GL_BGRA_EXT, GL_UNSIGNED_BYTE, data);
-	}
-#endif
+	pixman_region32_init(&region);
+	surface_damage_to_buffer_region(surface, &gs->texture_damage, &region);
+	bytes += surface_upload_planes(gr, gs, buffer, &region);
+	pixman_region32_fini(&region);
 
 done:
+	if (surface->output)
+		surface->output->stats.upload_bytes += bytes;
+
 	pixman_region32_fini(&gs->texture_damage);
 	pixman_region32_init(&gs->texture_damage);
 
 	weston_buffer_reference(&gs->buffer_ref, NULL);
 }
 
+static GLuint
+texture_create(GLenum target)
+{
+	GLuint texture;
+
+	glGenTextures(1, &texture);
+	glBindTexture(target, texture);
+	glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	return texture;
+}
+
 static void
 ensure_textures(struct gl_surface_state *gs, int num_textures)
 {
@@ -1157,26 +2478,170 @@ ensure_textures(struct gl_surface_state *gs, int num_textures)
 	if (num_textures <= gs->num_textures)
 		return;
 
-	for (i = gs->num_textures; i < num_textures; i++) {
-		glGenTextures(1, &gs->textures[i]);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target,
-				GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(gs->target,
-				GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	}
+	for (i = gs->num_textures; i < num_textures; i++)
+		gs->textures[i] = texture_create(gs->target);
 	gs->num_textures = num_textures;
 	glBindTexture(gs->target, 0);
 }
 
+static void
+buffer_texture_destroy(struct gl_buffer_texture *bt, int keep_texture)
+{
+	if (!keep_texture)
+		glDeleteTextures(1, &bt->texture);
+	bt->renderer->buffer_texture_size -= bt->size;
+	wl_list_remove(&bt->link);
+	wl_list_remove(&bt->lru_link);
+	wl_list_remove(&bt->buffer_destroy_listener.link);
+	pixman_region32_fini(&bt->damage);
+	free(bt);
+}
+
+static void
+buffer_texture_handle_buffer_destroy(struct wl_listener *listener,
+				     void *data)
+{
+	struct gl_buffer_texture *bt =
+		container_of(listener, struct gl_buffer_texture,
+			     buffer_destroy_listener);
+
+	buffer_texture_destroy(bt, 0);
+}
+
+static void
+surface_release_buffer_textures(struct gl_surface_state *gs)
+{
+	struct gl_buffer_texture *bt, *next;
+
+	wl_list_for_each_safe(bt, next, &gs->buffer_texture_list, link)
+		buffer_texture_destroy(bt, 0);
+}
+
+static void
+texture_buffer_handle_destroy(struct wl_listener *listener, void *data)
+{
+	struct gl_surface_state *gs =
+		container_of(listener, struct gl_surface_state,
+			     texture_buffer_destroy_listener);
+
+	gs->texture_buffer = NULL;
+}
+
+static void
+surface_set_texture_buffer(struct gl_surface_state *gs,
+			   struct wl_buffer *buffer)
+{
+	if (gs->texture_buffer == buffer)
+		return;
+
+	if (gs->texture_buffer)
+		wl_list_remove(&gs->texture_buffer_destroy_listener.link);
+	gs->texture_buffer = buffer;
+	if (buffer) {
+		gs->texture_buffer_destroy_listener.notify =
+			texture_buffer_handle_destroy;
+		wl_signal_add(&buffer->resource.destroy_signal,
+			      &gs->texture_buffer_destroy_listener);
+	}
+}
+
+/* Put textures[0] aside for the buffer it shows, along with the damage
+ * it has not seen yet, and drop the least recently parked textures
+ * over the budget.  Leaves textures[0] at 0. */
+static void
+surface_park_texture(struct gl_renderer *gr, struct gl_surface_state *gs,
+		     uint64_t budget)
+{
+	struct gl_buffer_texture *bt;
+	uint32_t size = gs->shm_pitch * gs->shm_height * 4;
+
+	if (size > budget)
+		return;
+
+	bt = malloc(sizeof *bt);
+	if (bt == NULL)
+		return;
+
+	bt->renderer = gr;
+	bt->buffer = gs->texture_buffer;
+	bt->texture = gs->textures[0];
+	bt->shm_pitch = gs->shm_pitch;
+	bt->shm_height = gs->shm_height;
+	bt->shm_format = gs->shm_format;
+	bt->needs_full_upload = gs->needs_full_upload;
+	bt->size = size;
+	pixman_region32_init(&bt->damage);
+	pixman_region32_copy(&bt->damage, &gs->texture_damage);
+	bt->buffer_destroy_listener.notify =
+		buffer_texture_handle_buffer_destroy;
+	wl_signal_add(&bt->buffer->resource.destroy_signal,
+		      &bt->buffer_destroy_listener);
+	wl_list_insert(&gs->buffer_texture_list, &bt->link);
+	wl_list_insert(&gr->buffer_texture_list, &bt->lru_link);
+	gr->buffer_texture_size += size;
+
+	gs->textures[0] = 0;
+
+	while (gr->buffer_texture_size > budget) {
+		bt = container_of(gr->buffer_texture_list.prev,
+				  struct gl_buffer_texture, lru_link);
+		buffer_texture_destroy(bt, 0);
+	}
+}
+
+/* Make textures[0] the one for buffer: the texture it had when it was
+ * shown last, with the damage since, or a new one. */
+static void
+surface_switch_texture(struct gl_renderer *gr, struct gl_surface_state *gs,
+		       struct wl_buffer *buffer, uint64_t budget)
+{
+	struct gl_buffer_texture *bt, *found = NULL;
+
+	if (gs->texture_buffer && gs->shm_format &&
+	    gs->shm_format->num_planes == 1)
+		surface_park_texture(gr, gs, budget);
+
+	wl_list_for_each(bt, &gs->buffer_texture_list, link)
+		if (bt->buffer == buffer) {
+			found = bt;
+			break;
+		}
+
+	if (found) {
+		if (gs->textures[0])
+			glDeleteTextures(1, &gs->textures[0]);
+		gs->textures[0] = found->texture;
+		gs->shm_pitch = found->shm_pitch;
+		gs->shm_height = found->shm_height;
+		gs->shm_format = found->shm_format;
+		gs->needs_full_upload = found->needs_full_upload;
+		pixman_region32_copy(&gs->texture_damage, &found->damage);
+		buffer_texture_destroy(found, 1);
+	} else if (!gs->textures[0]) {
+		gs->textures[0] = texture_create(GL_TEXTURE_2D);
+		gs->shm_format = NULL;
+		pixman_region32_fini(&gs->texture_damage);
+		pixman_region32_init(&gs->texture_damage);
+	}
+
+	surface_set_texture_buffer(gs, buffer);
+}
+
 static void
 gl_renderer_attach(struct weston_surface *es, struct wl_buffer *buffer)
 {
 	struct weston_compositor *ec = es->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
 	struct gl_surface_state *gs = get_surface_state(es);
+	const struct gl_shm_format *shm_format;
 	EGLint attribs[3], format;
-	int i, num_planes;
+	int i, num_planes, pitch, height;
+	uint8_t *data;
+
+	/* The texture is about to be respecified for the new buffer. */
+	surface_retire_upload(gs);
+	pixman_region32_fini(&gs->staged_damage);
+	pixman_region32_init(&gs->staged_damage);
 
 	weston_buffer_reference(&gs->buffer_ref, buffer);
 
@@ -1188,28 +2653,74 @@ gl_renderer_attach(struct weston_surface *es, struct wl_buffer *buffer)
 		gs->num_images = 0;
 		glDeleteTextures(gs->num_textures, gs->textures);
 		gs->num_textures = 0;
+		gs->shm_format = NULL;
+		surface_set_texture_buffer(gs, NULL);
+		surface_release_buffer_textures(gs);
 		return;
 	}
 
 	if (wl_buffer_is_shm(buffer)) {
-		gs->pitch = wl_shm_buffer_get_stride(buffer) / 4;
+		shm_format =
+			gl_shm_format_lookup(wl_shm_buffer_get_format(buffer));
+		if (!shm_format) {
+			weston_log("Unsupported SHM buffer format\n");
+			weston_buffer_reference(&gs->buffer_ref, NULL);
+			return;
+		}
+
+		gs->pitch = wl_shm_buffer_get_stride(buffer) /
+			shm_format->planes[0].cpp;
 		gs->target = GL_TEXTURE_2D;
 
-		ensure_textures(gs, 1);
-		glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT,
-			     gs->pitch, buffer->height, 0,
-			     GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
-		if (wl_shm_buffer_get_format(buffer) == WL_SHM_FORMAT_XRGB8888)
-			gs->shader = &gr->texture_shader_rgbx;
+		ensure_textures(gs, shm_format->num_planes);
+		if (ec->buffer_texture_budget > 0 &&
+		    shm_format->num_planes == 1 &&
+		    gs->texture_buffer != buffer)
+			surface_switch_texture(gr, gs, buffer,
+				(uint64_t) ec->buffer_texture_budget << 20);
 		else
+			surface_set_texture_buffer(gs, buffer);
+		if (gs->shm_format != shm_format ||
+		    gs->shm_pitch != gs->pitch ||
+		    gs->shm_height != buffer->height) {
+			gs->shm_format = shm_format;
+			for (i = 0; shm_plane_layout(shm_format, buffer, i,
+						     &data, &pitch, &height);
+			     i++) {
+				glBindTexture(GL_TEXTURE_2D, gs->textures[i]);
+				glTexImage2D(GL_TEXTURE_2D, 0,
+					     shm_format->planes[i].format,
+					     pitch, height, 0,
+					     shm_format->planes[i].format,
+					     GL_UNSIGNED_BYTE, NULL);
+			}
+			gs->shm_pitch = gs->pitch;
+			gs->shm_height = buffer->height;
+			gs->needs_full_upload = 1;
+		}
+
+		switch (shm_format->format) {
+		case WL_SHM_FORMAT_XRGB8888:
+			gs->shader = &gr->texture_shader_rgbx;
+			break;
+		case WL_SHM_FORMAT_ARGB8888:
+		default:
 			gs->shader = &gr->texture_shader_rgba;
+			break;
+		case WL_SHM_FORMAT_YUYV:
+			gs->shader = &gr->texture_shader_y_xuxv;
+			break;
+		}
 	} else if (gr->query_buffer(gr->egl_display, buffer,
 				    EGL_TEXTURE_FORMAT, &format)) {
 		for (i = 0; i < gs->num_images; i++)
 			gr->destroy_image(gr->egl_display, gs->images[i]);
 		gs->num_images = 0;
 		gs->target = GL_TEXTURE_2D;
+		gs->shm_format = NULL;
+		/* their damage goes untracked without flush_damage */
+		surface_set_texture_buffer(gs, NULL);
+		surface_release_buffer_textures(gs);
 		switch (format) {
 		case EGL_TEXTURE_RGB:
 		case EGL_TEXTURE_RGBA:
@@ -1294,7 +2805,9 @@ gl_renderer_create_surface(struct weston_surface *surface)
 	 */
 	gs->pitch = 1;
 
+	wl_list_init(&gs->buffer_texture_list);
 	pixman_region32_init(&gs->texture_damage);
+	pixman_region32_init(&gs->staged_damage);
 	surface->renderer_state = gs;
 
 	return 0;
@@ -1307,6 +2820,10 @@ gl_renderer_destroy_surface(struct weston_surface *surface)
 	struct gl_renderer *gr = get_renderer(surface->compositor);
 	int i;
 
+	surface_retire_upload(gs);
+
+	surface_set_texture_buffer(gs, NULL);
+	surface_release_buffer_textures(gs);
 	glDeleteTextures(gs->num_textures, gs->textures);
 
 	for (i = 0; i < gs->num_images; i++)
@@ -1314,6 +2831,7 @@ gl_renderer_destroy_surface(struct weston_surface *surface)
 
 	weston_buffer_reference(&gs->buffer_ref, NULL);
 	pixman_region32_fini(&gs->texture_damage);
+	pixman_region32_fini(&gs->staged_damage);
 	free(gs);
 }
 
@@ -1328,6 +2846,15 @@ static const char vertex_shader[] =
 	"   v_texcoord = texcoord;\n"
 	"}\n";
 
+/* The variants built with ALPHA_ONE draw surfaces at full alpha, and
+ * the compiler drops the multiplications by the constant. */
+#define FRAGMENT_ALPHA							\
+	"#ifdef ALPHA_ONE\n"						\
+	"#define alpha 1.0\n"						\
+	"#else\n"							\
+	"uniform float alpha;\n"						\
+	"#endif\n"
+
 /* Declare common fragment shader uniforms */
 #define FRAGMENT_CONVERT_YUV						\
 	"  y *= alpha;\n"						\
@@ -1348,7 +2875,7 @@ static const char texture_fragment_shader_rgba[] =
 	"precision mediump float;\n"
 	"varying vec2 v_texcoord;\n"
 	"uniform sampler2D tex;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main()\n"
 	"{\n"
 	"   gl_FragColor = alpha * texture2D(tex, v_texcoord)\n;"
@@ -1358,7 +2885,7 @@ static const char texture_fragment_shader_rgbx[] =
 	"precision mediump float;\n"
 	"varying vec2 v_texcoord;\n"
 	"uniform sampler2D tex;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main()\n"
 	"{\n"
 	"   gl_FragColor.rgb = alpha * texture2D(tex, v_texcoord).rgb\n;"
@@ -1370,7 +2897,7 @@ static const char texture_fragment_shader_egl_external[] =
 	"precision mediump float;\n"
 	"varying vec2 v_texcoord;\n"
 	"uniform samplerExternalOES tex;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main()\n"
 	"{\n"
 	"   gl_FragColor = alpha * texture2D(tex, v_texcoord)\n;"
@@ -1381,7 +2908,7 @@ static const char texture_fragment_shader_y_uv[] =
 	"uniform sampler2D tex;\n"
 	"uniform sampler2D tex1;\n"
 	"varying vec2 v_texcoord;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main() {\n"
 	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
 	"  float u = texture2D(tex1, v_texcoord).r - 0.5;\n"
@@ -1395,7 +2922,7 @@ static const char texture_fragment_shader_y_u_v[] =
 	"uniform sampler2D tex1;\n"
 	"uniform sampler2D tex2;\n"
 	"varying vec2 v_texcoord;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main() {\n"
 	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
 	"  float u = texture2D(tex1, v_texcoord).x - 0.5;\n"
@@ -1408,7 +2935,7 @@ static const char texture_fragment_shader_y_xuxv[] =
 	"uniform sampler2D tex;\n"
 	"uniform sampler2D tex1;\n"
 	"varying vec2 v_texcoord;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main() {\n"
 	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
 	"  float u = texture2D(tex1, v_texcoord).g - 0.5;\n"
@@ -1419,12 +2946,200 @@ static const char texture_fragment_shader_y_xuxv[] =
 static const char solid_fragment_shader[] =
 	"precision mediump float;\n"
 	"uniform vec4 color;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main()\n"
 	"{\n"
 	"   gl_FragColor = alpha * color\n;"
 	;
 
+#ifndef GL_PROGRAM_BINARY_LENGTH_OES
+#define GL_PROGRAM_BINARY_LENGTH_OES 0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS_OES
+#define GL_NUM_PROGRAM_BINARY_FORMATS_OES 0x87FE
+#endif
+
+#define SHADER_CACHE_MAGIC 0x31425057	/* "WPB1" */
+
+struct shader_cache_header {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t length;
+	uint32_t pad;
+	uint64_t key;
+};
+
+static uint64_t
+fnv1a(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static void
+shader_cache_path(struct gl_renderer *gr, uint64_t key,
+		  char *path, size_t size)
+{
+	snprintf(path, size, "%s/program-%016llx",
+		 gr->shader_cache_dir, (unsigned long long) key);
+}
+
+/*
+ * The key covers the driver strings and the shader sources, so a driver
+ * update or a changed shader just misses.  A driver may still refuse a
+ * binary it wrote itself, then the program gets compiled and the entry
+ * replaced.
+ */
+static int
+shader_cache_load(struct gl_renderer *gr, GLuint program, uint64_t key)
+{
+	struct shader_cache_header header;
+	char path[PATH_MAX];
+	struct stat st;
+	void *binary;
+	GLint status;
+	int fd;
+
+	if (!gr->shader_cache_dir)
+		return -1;
+
+	shader_cache_path(gr, key, path, sizeof path);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 ||
+	    read(fd, &header, sizeof header) != sizeof header ||
+	    header.magic != SHADER_CACHE_MAGIC || header.key != key ||
+	    st.st_size != (off_t) (sizeof header + header.length)) {
+		close(fd);
+		return -1;
+	}
+
+	binary = malloc(header.length);
+	if (!binary ||
+	    read(fd, binary, header.length) != (ssize_t) header.length) {
+		free(binary);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	gr->program_binary(program, header.format, binary, header.length);
+	free(binary);
+
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+
+	return status ? 0 : -1;
+}
+
+static void
+shader_cache_store(struct gl_renderer *gr, GLuint program, uint64_t key)
+{
+	struct shader_cache_header header;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	GLint length;
+	GLenum format;
+	void *binary;
+	int fd, ret;
+
+	if (!gr->shader_cache_dir)
+		return;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+	binary = malloc(length);
+	if (!binary)
+		return;
+	gr->get_program_binary(program, length, &length, &format, binary);
+
+	memset(&header, 0, sizeof header);
+	header.magic = SHADER_CACHE_MAGIC;
+	header.format = format;
+	header.length = length;
+	header.key = key;
+
+	/* written aside and renamed, another compositor may be reading */
+	shader_cache_path(gr, key, path, sizeof path);
+	snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0) {
+		free(binary);
+		return;
+	}
+
+	ret = write(fd, &header, sizeof header) == sizeof header &&
+		write(fd, binary, length) == length;
+	close(fd);
+	free(binary);
+
+	if (!ret || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+static void
+shader_cache_init(struct gl_renderer *gr, const char *extensions)
+{
+	const char *name[3];
+	const char *base, *home;
+	char *cache_home = NULL;
+	GLint formats = 0;
+	unsigned int i;
+
+	if (!strstr(extensions, "GL_OES_get_program_binary"))
+		return;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+	if (formats <= 0)
+		return;
+
+	gr->get_program_binary =
+		(void *) eglGetProcAddress("glGetProgramBinaryOES");
+	gr->program_binary = (void *) eglGetProcAddress("glProgramBinaryOES");
+	if (!gr->get_program_binary || !gr->program_binary)
+		return;
+
+	base = getenv("XDG_CACHE_HOME");
+	if (!base) {
+		home = getenv("HOME");
+		if (!home || asprintf(&cache_home, "%s/.cache", home) < 0)
+			return;
+		base = cache_home;
+	}
+
+	mkdir(base, 0700);
+	if (asprintf(&gr->shader_cache_dir, "%s/weston", base) < 0)
+		gr->shader_cache_dir = NULL;
+	free(cache_home);
+	if (!gr->shader_cache_dir)
+		return;
+	if (mkdir(gr->shader_cache_dir, 0700) < 0 && errno != EEXIST) {
+		weston_log("failed to create shader cache %s: %m\n",
+			   gr->shader_cache_dir);
+		free(gr->shader_cache_dir);
+		gr->shader_cache_dir = NULL;
+		return;
+	}
+
+	name[0] = (const char *) glGetString(GL_VENDOR);
+	name[1] = (const char *) glGetString(GL_RENDERER);
+	name[2] = (const char *) glGetString(GL_VERSION);
+
+	gr->shader_cache_seed = 0xcbf29ce484222325ULL;
+	for (i = 0; i < ARRAY_LENGTH(name); i++)
+		if (name[i])
+			gr->shader_cache_seed =
+				fnv1a(gr->shader_cache_seed,
+				      name[i], strlen(name[i]) + 1);
+}
+
 static int
 compile_shader(GLenum type, int count, const char **sources)
 {
@@ -1446,33 +3161,36 @@ compile_shader(GLenum type, int count, const char **sources)
 }
 
 static int
-shader_init(struct gl_shader *shader, struct weston_compositor *ec,
-		   const char *vertex_source, const char *fragment_source)
+shader_init(struct gl_shader *shader, struct gl_renderer *renderer)
 {
 	char msg[512];
 	GLint status;
-	int count;
-	const char *sources[3];
-	struct gl_renderer *renderer = get_renderer(ec);
-
-	shader->vertex_shader =
-		compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
+	int count, i;
+	const char *sources[4];
+	uint64_t key;
+
+	count = 0;
+	if (shader->defines)
+		sources[count++] = shader->defines;
+	sources[count++] = shader->fragment_source;
+	if (renderer->fragment_shader_debug)
+		sources[count++] = fragment_debug;
+	sources[count++] = fragment_brace;
+
+	key = fnv1a(renderer->shader_cache_seed, shader->vertex_source,
+		    strlen(shader->vertex_source) + 1);
+	for (i = 0; i < count; i++)
+		key = fnv1a(key, sources[i], strlen(sources[i]));
 
-	if (renderer->fragment_shader_debug) {
-		sources[0] = fragment_source;
-		sources[1] = fragment_debug;
-		sources[2] = fragment_brace;
-		count = 3;
-	} else {
-		sources[0] = fragment_source;
-		sources[1] = fragment_brace;
-		count = 2;
-	}
+	shader->program = glCreateProgram();
+	if (shader_cache_load(renderer, shader->program, key) == 0)
+		goto uniforms;
 
+	shader->vertex_shader =
+		compile_shader(GL_VERTEX_SHADER, 1, &shader->vertex_source);
 	shader->fragment_shader =
 		compile_shader(GL_FRAGMENT_SHADER, count, sources);
 
-	shader->program = glCreateProgram();
 	glAttachShader(shader->program, shader->vertex_shader);
 	glAttachShader(shader->program, shader->fragment_shader);
 	glBindAttribLocation(shader->program, 0, "position");
@@ -1486,6 +3204,9 @@ shader_init(struct gl_shader *shader, struct weston_compositor *ec,
 		return -1;
 	}
 
+	shader_cache_store(renderer, shader->program, key);
+
+uniforms:
 	shader->proj_uniform = glGetUniformLocation(shader->program, "proj");
 	shader->tex_uniforms[0] = glGetUniformLocation(shader->program, "tex");
 	shader->tex_uniforms[1] = glGetUniformLocation(shader->program, "tex1");
@@ -1506,6 +3227,25 @@ shader_release(struct gl_shader *shader)
 	shader->vertex_shader = 0;
 	shader->fragment_shader = 0;
 	shader->program = 0;
+	shader->failed = 0;
+}
+
+static int
+shader_ensure(struct gl_renderer *gr, struct gl_shader *shader)
+{
+	if (shader->program)
+		return 0;
+	if (shader->failed)
+		return -1;
+
+	if (shader_init(shader, gr) < 0) {
+		shader_release(shader);
+		shader->failed = 1;
+		weston_log("failed to build shader program\n");
+		return -1;
+	}
+
+	return 0;
 }
 
 static void
@@ -1625,8 +3365,10 @@ gl_renderer_set_border(struct weston_compositor *ec, int32_t width, int32_t heig
 		     0, GL_BGRA_EXT, GL_UNSIGNED_BYTE,
 		     data);
 
-	wl_list_for_each(output, &ec->output_list, link)
+	wl_list_for_each(output, &ec->output_list, link) {
 		output_apply_border(output, gr);
+		get_output_state(output)->swap_full = 1;
+	}
 }
 
 static int
@@ -1664,6 +3406,9 @@ gl_renderer_output_create(struct weston_output *output,
 	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
 		pixman_region32_init(&go->buffer_damage[i]);
 
+	wl_list_init(&go->layer_cache_list);
+	go->swap_full = 1;
+
 	output->renderer_state = go;
 
 	output_apply_border(output, gr);
@@ -1676,8 +3421,13 @@ gl_renderer_output_destroy(struct weston_output *output)
 {
 	struct gl_renderer *gr = get_renderer(output->compositor);
 	struct gl_output_state *go = get_output_state(output);
+	struct gl_layer_cache *cache, *next;
 	int i;
 
+	wl_list_for_each_safe(cache, next, &go->layer_cache_list, link)
+		layer_cache_destroy(gr, cache);
+	zoom_release(output);
+
 	for (i = 0; i < 2; i++)
 		pixman_region32_fini(&go->buffer_damage[i]);
 
@@ -1697,6 +3447,19 @@ gl_renderer_destroy(struct weston_compositor *ec)
 {
 	struct gl_renderer *gr = get_renderer(ec);
 
+	if (gr->upload.enabled) {
+		pthread_mutex_lock(&gr->upload.mutex);
+		gr->upload.quit = 1;
+		pthread_cond_signal(&gr->upload.queue_cond);
+		pthread_mutex_unlock(&gr->upload.mutex);
+		pthread_join(gr->upload.thread, NULL);
+
+		eglDestroyContext(gr->egl_display, gr->upload.context);
+		pthread_mutex_destroy(&gr->upload.mutex);
+		pthread_cond_destroy(&gr->upload.queue_cond);
+		pthread_cond_destroy(&gr->upload.done_cond);
+	}
+
 	if (gr->has_bind_display)
 		gr->unbind_display(gr->egl_display, ec->wl_display);
 
@@ -1708,6 +3471,7 @@ gl_renderer_destroy(struct weston_compositor *ec)
 	eglTerminate(gr->egl_display);
 	eglReleaseThread();
 
+	free(gr->shader_cache_dir);
 	free(gr);
 }
 
@@ -1787,14 +3551,21 @@ gl_renderer_create(struct weston_compositor *ec, EGLNativeDisplayType display,
 	if (gr == NULL)
 		return -1;
 
+	wl_list_init(&gr->buffer_texture_list);
+
 	gr->base.read_pixels = gl_renderer_read_pixels;
 	gr->base.repaint_output = gl_renderer_repaint_output;
 	gr->base.flush_damage = gl_renderer_flush_damage;
 	gr->base.attach = gl_renderer_attach;
+	gr->base.commit = gl_renderer_commit;
 	gr->base.create_surface = gl_renderer_create_surface;
 	gr->base.surface_set_color = gl_renderer_surface_set_color;
 	gr->base.destroy_surface = gl_renderer_destroy_surface;
 	gr->base.destroy = gl_renderer_destroy;
+	gr->base.snapshot_layer = gl_renderer_snapshot_layer;
+	gr->base.capture_start = gl_renderer_capture_start;
+	gr->base.capture_finish = gl_renderer_capture_finish;
+	gr->base.output_fade = 1;
 
 	gr->egl_display = eglGetDisplay(display);
 	if (gr->egl_display == EGL_NO_DISPLAY) {
@@ -1828,35 +3599,56 @@ gl_renderer_display(struct weston_compositor *ec)
 	return get_renderer(ec)->egl_display;
 }
 
+static void
+shader_set_sources(struct gl_shader *shader,
+		   const char *vertex_source, const char *fragment_source)
+{
+	shader->vertex_source = vertex_source;
+	shader->fragment_source = fragment_source;
+}
+
+/* Only the sources here, each program is built on first use. */
 static int
 compile_shaders(struct weston_compositor *ec)
 {
 	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_shader *shaders[] = {
+		&gr->texture_shader_rgba,
+		&gr->texture_shader_rgbx,
+		&gr->texture_shader_egl_external,
+		&gr->texture_shader_y_uv,
+		&gr->texture_shader_y_u_v,
+		&gr->texture_shader_y_xuxv,
+		&gr->solid_shader,
+	};
+	struct gl_shader *variant;
+	unsigned int i;
+
+	shader_set_sources(&gr->texture_shader_rgba,
+			   vertex_shader, texture_fragment_shader_rgba);
+	shader_set_sources(&gr->texture_shader_rgbx,
+			   vertex_shader, texture_fragment_shader_rgbx);
+	shader_set_sources(&gr->texture_shader_egl_external,
+			   vertex_shader, texture_fragment_shader_egl_external);
+	shader_set_sources(&gr->texture_shader_y_uv,
+			   vertex_shader, texture_fragment_shader_y_uv);
+	shader_set_sources(&gr->texture_shader_y_u_v,
+			   vertex_shader, texture_fragment_shader_y_u_v);
+	shader_set_sources(&gr->texture_shader_y_xuxv,
+			   vertex_shader, texture_fragment_shader_y_xuxv);
+	shader_set_sources(&gr->solid_shader,
+			   vertex_shader, solid_fragment_shader);
+
+	for (i = 0; i < ARRAY_LENGTH(shaders); i++) {
+		variant = &gr->alpha_one_shaders[i];
+		shader_set_sources(variant, shaders[i]->vertex_source,
+				   shaders[i]->fragment_source);
+		variant->defines = "#define ALPHA_ONE\n";
+		shaders[i]->alpha_one = variant;
+	}
 
-	if (shader_init(&gr->texture_shader_rgba, ec,
-			     vertex_shader, texture_fragment_shader_rgba) < 0)
-		return -1;
-	if (shader_init(&gr->texture_shader_rgbx, ec,
-			     vertex_shader, texture_fragment_shader_rgbx) < 0)
-		return -1;
-	if (gr->has_egl_image_external &&
-			shader_init(&gr->texture_shader_egl_external, ec,
-				vertex_shader, texture_fragment_shader_egl_external) < 0)
-		return -1;
-	if (shader_init(&gr->texture_shader_y_uv, ec,
-			       vertex_shader, texture_fragment_shader_y_uv) < 0)
-		return -1;
-	if (shader_init(&gr->texture_shader_y_u_v, ec,
-			       vertex_shader, texture_fragment_shader_y_u_v) < 0)
-		return -1;
-	if (shader_init(&gr->texture_shader_y_xuxv, ec,
-			       vertex_shader, texture_fragment_shader_y_xuxv) < 0)
-		return -1;
-	if (shader_init(&gr->solid_shader, ec,
-			     vertex_shader, solid_fragment_shader) < 0)
-		return -1;
-
-	return 0;
+	/* a broken driver should still fail at startup, not first frame */
+	return shader_ensure(gr, &gr->texture_shader_rgba);
 }
 
 static void
@@ -1866,6 +3658,7 @@ fragment_debug_binding(struct wl_seat *seat, uint32_t time, uint32_t key,
 	struct weston_compositor *ec = data;
 	struct gl_renderer *gr = get_renderer(ec);
 	struct weston_output *output;
+	unsigned int i;
 
 	gr->fragment_shader_debug ^= 1;
 
@@ -1876,17 +3669,62 @@ fragment_debug_binding(struct wl_seat *seat, uint32_t time, uint32_t key,
 	shader_release(&gr->texture_shader_y_u_v);
 	shader_release(&gr->texture_shader_y_xuxv);
 	shader_release(&gr->solid_shader);
+	for (i = 0; i < ARRAY_LENGTH(gr->alpha_one_shaders); i++)
+		shader_release(&gr->alpha_one_shaders[i]);
 
-	compile_shaders(ec);
-
-	/* Force use_shader() to call glUseProgram(), since we need to use
-	 * the recompiled version of the shader. */
+	/* Force use_shader() to call glUseProgram(), since the shaders
+	 * get recompiled on their next use. */
 	gr->current_shader = NULL;
 
 	wl_list_for_each(output, &ec->output_list, link)
 		weston_output_damage(output);
 }
 
+static void
+upload_thread_init(struct gl_renderer *gr, const char *extensions)
+{
+	static const EGLint context_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+
+	if (!strstr(extensions, "EGL_KHR_fence_sync") ||
+	    !strstr(extensions, "EGL_KHR_surfaceless_context"))
+		return;
+
+	gr->create_sync = (void *) eglGetProcAddress("eglCreateSyncKHR");
+	gr->destroy_sync = (void *) eglGetProcAddress("eglDestroySyncKHR");
+	gr->client_wait_sync =
+		(void *) eglGetProcAddress("eglClientWaitSyncKHR");
+	if (!gr->create_sync || !gr->destroy_sync || !gr->client_wait_sync)
+		return;
+
+	gr->upload.context = eglCreateContext(gr->egl_display, gr->egl_config,
+					      gr->egl_context,
+					      context_attribs);
+	if (gr->upload.context == EGL_NO_CONTEXT) {
+		weston_log("failed to create upload context\n");
+		return;
+	}
+
+	wl_list_init(&gr->upload.queue);
+	gr->upload.quit = 0;
+	pthread_mutex_init(&gr->upload.mutex, NULL);
+	pthread_cond_init(&gr->upload.queue_cond, NULL);
+	pthread_cond_init(&gr->upload.done_cond, NULL);
+
+	if (pthread_create(&gr->upload.thread, NULL, upload_thread, gr)) {
+		weston_log("failed to start upload thread\n");
+		pthread_mutex_destroy(&gr->upload.mutex);
+		pthread_cond_destroy(&gr->upload.queue_cond);
+		pthread_cond_destroy(&gr->upload.done_cond);
+		eglDestroyContext(gr->egl_display, gr->upload.context);
+		return;
+	}
+
+	gr->upload.enabled = 1;
+}
+
 static int
 gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 {
@@ -1958,6 +3796,31 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	if (strstr(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = 1;
 
+	if (strstr((const char *) glGetString(GL_VERSION), "OpenGL ES 3")) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRange");
+		gr->unmap_buffer = (void *) eglGetProcAddress("glUnmapBuffer");
+		gr->blit_framebuffer =
+			(void *) eglGetProcAddress("glBlitFramebuffer");
+		gr->has_pack_row_length = 1;
+	} else if (strstr(extensions, "GL_NV_pixel_buffer_object") &&
+		   strstr(extensions, "GL_EXT_map_buffer_range")) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRangeEXT");
+		gr->unmap_buffer =
+			(void *) eglGetProcAddress("glUnmapBufferOES");
+	}
+	if (gr->map_buffer_range && gr->unmap_buffer)
+		gr->has_pack_buffer = 1;
+	if (!gr->blit_framebuffer &&
+	    strstr(extensions, "GL_NV_framebuffer_blit"))
+		gr->blit_framebuffer =
+			(void *) eglGetProcAddress("glBlitFramebufferNV");
+	if (strstr(extensions, "GL_NV_pack_subimage"))
+		gr->has_pack_row_length = 1;
+
+	shader_cache_init(gr, extensions);
+
 	extensions =
 		(const char *) eglQueryString(gr->egl_display, EGL_EXTENSIONS);
 	if (!extensions) {
@@ -1973,12 +3836,18 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 			gr->has_bind_display = 0;
 	}
 
+	if (strstr(extensions, "EGL_EXT_swap_buffers_with_damage"))
+		gr->swap_buffers_with_damage =
+			(void *) eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+
 	if (strstr(extensions, "EGL_EXT_buffer_age"))
 		gr->has_egl_buffer_age = 1;
 	else
 		weston_log("warning: EGL_EXT_buffer_age not supported. "
 			   "Performance could be affected.\n");
 
+	upload_thread_init(gr, extensions);
+
 	glActiveTexture(GL_TEXTURE0);
 
 	if (compile_shaders(ec))
@@ -1987,13 +3856,26 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	weston_compositor_add_debug_binding(ec, KEY_S,
 					    fragment_debug_binding, ec);
 
+	/* uploaded twice and converted by the y_xuxv shader */
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUYV);
+
 	weston_log("GL ES 2 renderer features:\n");
 	weston_log_continue(STAMP_SPACE "read-back format: %s\n",
 		ec->read_format == PIXMAN_a8r8g8b8 ? "BGRA" : "RGBA");
 	weston_log_continue(STAMP_SPACE "wl_shm sub-image to texture: %s\n",
 			    gr->has_unpack_subimage ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "EGL buffer age: %s\n",
+			    gr->has_egl_buffer_age ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "swap buffers with damage: %s\n",
+			    gr->swap_buffers_with_damage ? "yes" : "no");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm upload thread: %s\n",
+			    gr->upload.enabled ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "asynchronous read-back: %s\n",
+			    gr->has_pack_buffer ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "shader cache: %s\n",
+			    gr->shader_cache_dir ? gr->shader_cache_dir : "no");
 
 
 	return 0;
@@ -103,6 +103,120 @@ weston_launcher_open(struct weston_compositor *compositor,
 	return data->fd;
 }
 
+/* Opens up to WESTON_LAUNCHER_MAX_BATCH paths in one round trip. */
+static int
+launcher_open_batch(int sock, const char **paths, int count, int flags,
+		    int *fds)
+{
+	int ret[WESTON_LAUNCHER_MAX_BATCH];
+	char control[CMSG_SPACE(sizeof ret)];
+	struct weston_launcher_open_batch *message;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int *received = NULL;
+	int i, j, n, nfds = 0;
+	char *p;
+	ssize_t len;
+
+	n = sizeof *message;
+	for (i = 0; i < count; i++)
+		n += strlen(paths[i]) + 1;
+	message = malloc(n);
+	if (!message)
+		return -1;
+
+	message->header.opcode = WESTON_LAUNCHER_OPEN_BATCH;
+	message->flags = flags;
+	message->count = count;
+	p = message->paths;
+	for (i = 0; i < count; i++) {
+		strcpy(p, paths[i]);
+		p += strlen(paths[i]) + 1;
+	}
+
+	do {
+		len = send(sock, message, n, 0);
+	} while (len < 0 && errno == EINTR);
+	free(message);
+	if (len < 0)
+		return -1;
+
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = ret;
+	iov.iov_len = count * sizeof ret[0];
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+
+	do {
+		len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (len < 0 && errno == EINTR);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg &&
+	    cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS) {
+		received = (int *) CMSG_DATA(cmsg);
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof received[0];
+	}
+
+	if (len != (ssize_t) (count * sizeof ret[0])) {
+		for (j = 0; j < nfds; j++)
+			close(received[j]);
+		return -1;
+	}
+
+	for (i = 0, j = 0; i < count; i++) {
+		if (ret[i] == 0 && j < nfds)
+			fds[i] = received[j++];
+		else
+			fds[i] = -1;
+	}
+
+	return 0;
+}
+
+/* Opens count paths, through as few round trips to weston-launch as
+ * its message sizes allow, and stores their fds, or -1 for paths that
+ * could not be opened, in fds.  Returns -1 if talking to the launcher
+ * failed. */
+int
+weston_launcher_open_batch(struct weston_compositor *compositor,
+			   const char **paths, int count, int flags, int *fds)
+{
+	int sock = compositor->launcher_sock;
+	int i, n, size;
+
+	if (sock == -1) {
+		for (i = 0; i < count; i++)
+			fds[i] = open(paths[i], flags | O_CLOEXEC);
+		return 0;
+	}
+
+	for (i = 0; i < count; i += n) {
+		size = sizeof(struct weston_launcher_open_batch);
+		for (n = 0; n < WESTON_LAUNCHER_MAX_BATCH && i + n < count;
+		     n++) {
+			size += strlen(paths[i + n]) + 1;
+			/* weston-launch reads requests into BUFSIZ */
+			if (size > BUFSIZ && n > 0)
+				break;
+		}
+
+		if (launcher_open_batch(sock, paths + i, n, flags,
+					fds + i) < 0) {
+			for (n = 0; n < i; n++)
+				if (fds[n] >= 0)
+					close(fds[n]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 int
 weston_launcher_drm_set_master(struct weston_compositor *compositor,
 			       int drm_fd, char master)
@@ -29,6 +29,9 @@ int
 weston_launcher_open(struct weston_compositor *compositor,
 		     const char *path, int flags);
 int
+weston_launcher_open_batch(struct weston_compositor *compositor,
+			   const char **paths, int count, int flags, int *fds);
+int
 weston_launcher_drm_set_master(struct weston_compositor *compositor,
 			       int drm_fd, char master);
 
@@ -42,6 +42,9 @@
 #include <malloc.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 static long backlight_get(struct backlight *backlight, char *node)
 {
@@ -132,6 +135,191 @@ out:
 	return ret;
 }
 
+/* about a frame, the smallest step of a ramp */
+#define BACKLIGHT_RAMP_STEP_MS 16
+
+struct backlight_controller {
+	struct backlight *backlight;
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	/* under mutex */
+	long from, target;
+	struct timespec start;
+	uint32_t duration_ms;
+	long current;		/* the ramp's value as last computed */
+	int quit;
+};
+
+static int64_t timespec_ms_since(const struct timespec *start,
+				 const struct timespec *now)
+{
+	return (int64_t) (now->tv_sec - start->tv_sec) * 1000 +
+		(now->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Where the ramp is at now, and whether it is done */
+static long backlight_ramp_value(struct backlight_controller *controller,
+				 int *done)
+{
+	struct timespec now;
+	int64_t elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = timespec_ms_since(&controller->start, &now);
+
+	if (controller->duration_ms == 0 ||
+	    elapsed >= controller->duration_ms) {
+		*done = 1;
+		return controller->target;
+	}
+
+	*done = 0;
+	return controller->from + (controller->target - controller->from) *
+		elapsed / (int64_t) controller->duration_ms;
+}
+
+static void *backlight_controller_run(void *data)
+{
+	struct backlight_controller *controller = data;
+	long value, written = -1;
+	struct timespec deadline;
+	char buffer[32];
+	sigset_t mask;
+	int done, len, failed = 0;
+
+	/* Leave all signals to the threads of the caller */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pthread_mutex_lock(&controller->mutex);
+	while (!controller->quit) {
+		value = backlight_ramp_value(controller, &done);
+		controller->current = value;
+
+		if (value == written) {
+			if (done) {
+				pthread_cond_wait(&controller->cond,
+						  &controller->mutex);
+			} else {
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				deadline.tv_nsec +=
+					BACKLIGHT_RAMP_STEP_MS * 1000000;
+				if (deadline.tv_nsec >= 1000000000) {
+					deadline.tv_sec++;
+					deadline.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&controller->cond,
+						       &controller->mutex,
+						       &deadline);
+			}
+			continue;
+		}
+
+		/* Steps of the ramp that went by while writing are not
+		 * written at all */
+		pthread_mutex_unlock(&controller->mutex);
+		len = snprintf(buffer, sizeof buffer, "%ld", value);
+		/* A failed write is not retried until the ramp moves on
+		 * or the brightness is set again, and only the first of
+		 * a row of failures is reported */
+		if (pwrite(controller->fd, buffer, len, 0) < 0) {
+			if (!failed)
+				fprintf(stderr, "libbacklight: setting "
+					"brightness %ld failed: %m\n", value);
+			failed = 1;
+		} else {
+			failed = 0;
+		}
+		pthread_mutex_lock(&controller->mutex);
+		written = value;
+	}
+	pthread_mutex_unlock(&controller->mutex);
+
+	return NULL;
+}
+
+struct backlight_controller *
+backlight_controller_create(struct backlight *backlight)
+{
+	struct backlight_controller *controller;
+	char *path;
+
+	controller = calloc(1, sizeof *controller);
+	if (!controller)
+		return NULL;
+
+	if (asprintf(&path, "%s/%s", backlight->path, "brightness") < 0)
+		goto err;
+
+	controller->fd = open(path, O_WRONLY | O_CLOEXEC);
+	free(path);
+	if (controller->fd < 0)
+		goto err;
+
+	controller->backlight = backlight;
+	controller->from = backlight->brightness;
+	controller->target = backlight->brightness;
+	controller->current = backlight->brightness;
+	clock_gettime(CLOCK_MONOTONIC, &controller->start);
+	pthread_mutex_init(&controller->mutex, NULL);
+	pthread_cond_init(&controller->cond, NULL);
+
+	if (pthread_create(&controller->thread, NULL,
+			   backlight_controller_run, controller) != 0) {
+		pthread_cond_destroy(&controller->cond);
+		pthread_mutex_destroy(&controller->mutex);
+		close(controller->fd);
+		goto err;
+	}
+
+	return controller;
+
+err:
+	free(controller);
+	return NULL;
+}
+
+void backlight_controller_destroy(struct backlight_controller *controller)
+{
+	if (!controller)
+		return;
+
+	pthread_mutex_lock(&controller->mutex);
+	controller->quit = 1;
+	pthread_cond_signal(&controller->cond);
+	pthread_mutex_unlock(&controller->mutex);
+	pthread_join(controller->thread, NULL);
+
+	pthread_cond_destroy(&controller->cond);
+	pthread_mutex_destroy(&controller->mutex);
+	close(controller->fd);
+	free(controller);
+}
+
+void backlight_controller_set(struct backlight_controller *controller,
+			      long brightness, uint32_t duration_ms)
+{
+	if (brightness < 0)
+		brightness = 0;
+	if (brightness > controller->backlight->max_brightness)
+		brightness = controller->backlight->max_brightness;
+
+	/* The thread never touches the struct backlight, the caller
+	 * owns it */
+	controller->backlight->brightness = brightness;
+
+	pthread_mutex_lock(&controller->mutex);
+	controller->from = controller->current;
+	controller->target = brightness;
+	controller->duration_ms = duration_ms;
+	clock_gettime(CLOCK_MONOTONIC, &controller->start);
+	pthread_cond_signal(&controller->cond);
+	pthread_mutex_unlock(&controller->mutex);
+}
+
 void backlight_destroy(struct backlight *backlight)
 {
 	if (!backlight)
@@ -42,6 +42,27 @@ long backlight_get_actual_brightness(struct backlight *backlight);
 /* Set the backlight to a value between 0 and max */
 long backlight_set_brightness(struct backlight *backlight, long brightness);
 
+/*
+ * A thread that keeps the brightness file of a backlight open and does
+ * the writes to it, some drivers taking tens of milliseconds for one,
+ * so that setting the brightness never blocks the caller.  Ramps write
+ * the brightness the ramp is at whenever the previous write is done,
+ * skipping the steps a slow driver could not keep up with.
+ */
+struct backlight_controller;
+
+struct backlight_controller *
+backlight_controller_create(struct backlight *backlight);
+
+/* Waits for the write in progress, if any */
+void backlight_controller_destroy(struct backlight_controller *controller);
+
+/* Ramp from where the backlight is now to brightness, between 0 and
+ * max, over duration_ms; 0 sets it at once.  backlight->brightness is
+ * the brightness last asked for from then on. */
+void backlight_controller_set(struct backlight_controller *controller,
+			      long brightness, uint32_t duration_ms);
+
 #ifdef __cplusplus
 }
 #endif
@@ -20,11 +20,19 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <time.h>
 
 #include <wayland-server.h>
@@ -32,62 +40,456 @@
 
 #include "compositor.h"
 
-static FILE *weston_logfile = NULL;
+/* must be a power of two */
+#define LOG_RING_LENGTH 256
+#define LOG_RECORD_SIZE 1024
+
+/*
+ * weston_log() only formats the message into a slot of a ring and
+ * returns; a writer thread turns the records into lines and writes
+ * them out, so a slow log device never stalls the compositor.
+ *
+ * Any thread may log, so slots are claimed with a compare-and-swap on
+ * tail and each slot carries a sequence number telling whether it is
+ * free, being filled or ready, as in Vyukov's bounded queue.  When
+ * the ring is full the message is counted and dropped.  The writer
+ * only sleeps on the eventfd after announcing it in 'sleeping', so
+ * producers only pay for the wake up when it is needed.
+ *
+ * Before the log is opened, after it is closed, in forked children
+ * and once weston_log_sync() was called, messages are written
+ * synchronously instead.
+ */
+struct log_record {
+	uint32_t seq;
+	int stamped;
+	struct timespec time;
+	int length;
+	char text[LOG_RECORD_SIZE];
+};
+
+/* the broken down time of the last second formatted */
+struct log_clock {
+	time_t sec;
+	int mday;
+	char hms[16];
+};
+
+static struct {
+	struct log_record ring[LOG_RING_LENGTH];
+	uint32_t head, tail;
+	uint32_t dropped;
+	int sleeping;
+
+	int async;
+	int fd;
+	int wake_fd;
+	int quit;
+	pthread_t thread;
+	struct log_clock clock;
+} logger;
+
+static int weston_log_fd = STDERR_FILENO;
+
+/* wall clock minus monotonic clock, when the log was opened */
+static struct timespec realtime_offset;
+
+static struct log_clock sync_clock = { -1, -1, "" };
+
+static struct timespec startup_begin, startup_last;
+
+static void
+write_all(int fd, const char *buf, size_t size)
+{
+	ssize_t len;
+
+	while (size > 0) {
+		len = write(fd, buf, size);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += len;
+		size -= len;
+	}
+}
+
+/* EAGAIN only means the eventfd counter is already nonzero, the
+ * thread wakes up either way. */
+static void
+log_wake(void)
+{
+	uint64_t one = 1;
+
+	while (write(logger.wake_fd, &one, sizeof one) < 0 && errno == EINTR)
+		continue;
+}
+
+/* Formats "[HH:MM:SS.mmm] ", preceded by a "Date:" line when the day
+ * changed.  localtime_r() and strftime() only run once per second. */
+static int
+log_format_timestamp(struct log_clock *clock, const struct timespec *ts,
+		     char *buf, size_t size)
+{
+	struct tm tm;
+	char date[64];
+	int len = 0;
+
+	if (ts->tv_sec != clock->sec) {
+		localtime_r(&ts->tv_sec, &tm);
+		strftime(clock->hms, sizeof clock->hms, "%H:%M:%S", &tm);
+		clock->sec = ts->tv_sec;
+
+		if (tm.tm_mday != clock->mday) {
+			strftime(date, sizeof date, "%Y-%m-%d %Z", &tm);
+			len = snprintf(buf, size, "Date: %s\n", date);
+			clock->mday = tm.tm_mday;
+		}
+	}
+
+	len += snprintf(buf + len, size - len, "[%s.%03li] ",
+			clock->hms, ts->tv_nsec / 1000000);
+
+	return len;
+}
+
+static void
+log_write_sync(int stamped, const char *fmt, va_list arg)
+{
+	char buf[LOG_RECORD_SIZE + 96];
+	struct timespec now;
+	int len = 0, l;
+
+	if (stamped) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		len = log_format_timestamp(&sync_clock, &now, buf, 96);
+	}
+
+	l = vsnprintf(buf + len, sizeof buf - len, fmt, arg);
+	if (l < 0)
+		l = 0;
+	else if (l >= (int) sizeof buf - len)
+		l = sizeof buf - len - 1;
+
+	write_all(weston_log_fd, buf, len + l);
+}
+
+/* Returns the length of the message, even when it was dropped. */
+static int
+log_queue(int stamped, const char *fmt, va_list arg)
+{
+	static const char truncated[] = "[...]\n";
+	struct log_record *rec;
+	uint32_t pos, seq;
+	int len;
+
+	pos = __atomic_load_n(&logger.tail, __ATOMIC_RELAXED);
+	for (;;) {
+		rec = &logger.ring[pos & (LOG_RING_LENGTH - 1)];
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&logger.tail, &pos,
+							pos + 1, 1,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if ((int32_t) (seq - pos) < 0) {
+			/* full, the writer has not caught up */
+			__atomic_fetch_add(&logger.dropped, 1, __ATOMIC_RELAXED);
+			return vsnprintf(NULL, 0, fmt, arg);
+		} else {
+			pos = __atomic_load_n(&logger.tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	rec->stamped = stamped;
+	if (stamped)
+		clock_gettime(CLOCK_MONOTONIC, &rec->time);
+	len = vsnprintf(rec->text, sizeof rec->text, fmt, arg);
+	if (len < 0) {
+		rec->length = 0;
+	} else if (len >= (int) sizeof rec->text) {
+		rec->length = sizeof rec->text - 1;
+		memcpy(rec->text + rec->length - (sizeof truncated - 1),
+		       truncated, sizeof truncated - 1);
+	} else {
+		rec->length = len;
+	}
+
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+	if (__atomic_exchange_n(&logger.sleeping, 0, __ATOMIC_SEQ_CST))
+		log_wake();
+
+	return len;
+}
+
+static int
+log_vprintf(int stamped, const char *fmt, va_list arg)
+{
+	va_list copy;
+	int len;
+
+	if (!__atomic_load_n(&logger.async, __ATOMIC_ACQUIRE)) {
+		va_copy(copy, arg);
+		len = vsnprintf(NULL, 0, fmt, copy);
+		va_end(copy);
+		log_write_sync(stamped, fmt, arg);
+	} else {
+		len = log_queue(stamped, fmt, arg);
+	}
+
+	return (stamped ? (int) strlen(STAMP_SPACE) : 0) + len;
+}
+
+/* Takes the oldest ready record out of the ring and appends it to
+ * buf; returns 0 when there is none. */
+static int
+log_dequeue(struct log_clock *clock, char *buf, size_t size, size_t *len)
+{
+	struct log_record *rec;
+	struct timespec ts;
+	uint32_t pos, seq;
+
+	pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+	for (;;) {
+		rec = &logger.ring[pos & (LOG_RING_LENGTH - 1)];
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if ((int32_t) (seq - (pos + 1)) < 0)
+			return 0;
+		if (seq == pos + 1 &&
+		    __atomic_compare_exchange_n(&logger.head, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			break;
+		pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+	}
+
+	if (rec->stamped) {
+		/* stamped with the monotonic clock, shown as wall time */
+		ts.tv_sec = rec->time.tv_sec + realtime_offset.tv_sec;
+		ts.tv_nsec = rec->time.tv_nsec + realtime_offset.tv_nsec;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		*len += log_format_timestamp(clock, &ts,
+					     buf + *len, size - *len);
+	}
+	memcpy(buf + *len, rec->text, rec->length);
+	*len += rec->length;
+
+	__atomic_store_n(&rec->seq, pos + LOG_RING_LENGTH, __ATOMIC_RELEASE);
 
-static int cached_tm_mday = -1;
+	return 1;
+}
 
-static int weston_log_timestamp(void)
+/* Writes out everything in the ring, in batches. */
+static void
+log_drain(struct log_clock *clock)
 {
-	struct timeval tv;
-	struct tm *brokendown_time;
-	char string[128];
+	char buf[16 * 1024];
+	uint32_t dropped;
+	size_t len = 0;
 
-	gettimeofday(&tv, NULL);
+	for (;;) {
+		if (len > sizeof buf - LOG_RECORD_SIZE - 96) {
+			write_all(logger.fd, buf, len);
+			len = 0;
+		}
+		if (!log_dequeue(clock, buf, sizeof buf, &len))
+			break;
+	}
+
+	dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		len += snprintf(buf + len, sizeof buf - len,
+				"log: %u messages dropped, "
+				"the log device is too slow\n", dropped);
 
-	brokendown_time = localtime(&tv.tv_sec);
+	if (len)
+		write_all(logger.fd, buf, len);
+}
 
-	strftime(string, sizeof string, "%H:%M:%S", brokendown_time);
+static int
+log_ring_empty(void)
+{
+	struct log_record *rec;
+	uint32_t pos;
 
-	if (brokendown_time->tm_mday != cached_tm_mday) {
-		char date_string[128];
+	pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+	rec = &logger.ring[pos & (LOG_RING_LENGTH - 1)];
 
-		strftime(date_string, sizeof string, "%Y-%m-%d %Z", brokendown_time);
-		fprintf(weston_logfile, "Date: %s\n", date_string);
+	return __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != pos + 1 &&
+		__atomic_load_n(&logger.dropped, __ATOMIC_RELAXED) == 0;
+}
+
+static void *
+log_thread_run(void *data)
+{
+	struct pollfd pfd;
+	uint64_t count;
 
-		cached_tm_mday = brokendown_time->tm_mday;
+	pfd.fd = logger.wake_fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		log_drain(&logger.clock);
+
+		__atomic_store_n(&logger.sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!log_ring_empty()) {
+			__atomic_store_n(&logger.sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if (__atomic_load_n(&logger.quit, __ATOMIC_ACQUIRE))
+			break;
+
+		if (poll(&pfd, 1, -1) <= 0)
+			continue;
+		while (read(logger.wake_fd, &count, sizeof count) < 0 &&
+		       errno == EINTR)
+			continue;
 	}
 
-	return fprintf(weston_logfile, "[%s.%03li] ", string, tv.tv_usec/1000);
+	return NULL;
+}
+
+/* a forked child has no writer thread */
+static void
+log_atfork_child(void)
+{
+	logger.async = 0;
+}
+
+static void
+log_start_thread(void)
+{
+	static int atfork_registered;
+	uint32_t i;
+
+	for (i = 0; i < LOG_RING_LENGTH; i++)
+		logger.ring[i].seq = i;
+	logger.head = logger.tail = 0;
+	logger.dropped = 0;
+	logger.sleeping = 0;
+	logger.quit = 0;
+	logger.fd = weston_log_fd;
+	logger.clock = sync_clock;
+
+	logger.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (logger.wake_fd < 0)
+		return;
+
+	if (!atfork_registered) {
+		pthread_atfork(NULL, NULL, log_atfork_child);
+		atfork_registered = 1;
+	}
+
+	if (pthread_create(&logger.thread, NULL, log_thread_run, NULL) != 0) {
+		close(logger.wake_fd);
+		return;
+	}
+
+	__atomic_store_n(&logger.async, 1, __ATOMIC_RELEASE);
+}
+
+static void
+log_stop_thread(void)
+{
+	if (!logger.async)
+		return;
+
+	/* anything logged from here on goes out synchronously */
+	__atomic_store_n(&logger.async, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&logger.quit, 1, __ATOMIC_RELEASE);
+	log_wake();
+	pthread_join(logger.thread, NULL);
+	close(logger.wake_fd);
+
+	/* records claimed before async was cleared */
+	log_drain(&sync_clock);
+}
+
+/* Stops queueing and writes out what is still in the ring from the
+ * calling thread.  Meant for the crash handler, where the writer
+ * thread may never get to run again. */
+WL_EXPORT void
+weston_log_sync(void)
+{
+	if (!__atomic_exchange_n(&logger.async, 0, __ATOMIC_ACQ_REL))
+		return;
+
+	log_drain(&sync_clock);
 }
 
 static void
 custom_handler(const char *fmt, va_list arg)
 {
-	weston_log_timestamp();
-	fprintf(weston_logfile, "libwayland: ");
-	vfprintf(weston_logfile, fmt, arg);
+	char buf[512];
+
+	snprintf(buf, sizeof buf, "libwayland: %s", fmt);
+	log_vprintf(1, buf, arg);
 }
 
 void
 weston_log_file_open(const char *filename)
 {
+	struct timespec mono, real;
+	int fd = -1;
+
 	wl_log_set_handler_server(custom_handler);
 
 	if (filename != NULL)
-		weston_logfile = fopen(filename, "a");
+		fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+			  0666);
+
+	weston_log_fd = fd >= 0 ? fd : STDERR_FILENO;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	realtime_offset.tv_sec = real.tv_sec - mono.tv_sec;
+	realtime_offset.tv_nsec = real.tv_nsec - mono.tv_nsec;
+	if (realtime_offset.tv_nsec < 0) {
+		realtime_offset.tv_sec--;
+		realtime_offset.tv_nsec += 1000000000;
+	}
+
+	startup_begin = mono;
+	startup_last = startup_begin;
+
+	log_start_thread();
+}
 
-	if (weston_logfile == NULL)
-		weston_logfile = stderr;
-	else
-		setvbuf(weston_logfile, NULL, _IOLBF, 256);
+static double
+timespec_sub_ms(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000.0 +
+		(a->tv_nsec - b->tv_nsec) / 1000000.0;
+}
+
+/* Log how long the startup phase that just ended took, since the
+ * previous one ended or the log was opened. */
+WL_EXPORT void
+weston_log_startup_phase(const char *phase)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	weston_log("startup: %s took %.1f ms, %.1f ms in total\n", phase,
+		   timespec_sub_ms(&now, &startup_last),
+		   timespec_sub_ms(&now, &startup_begin));
+	startup_last = now;
 }
 
 void
 weston_log_file_close()
 {
-	if ((weston_logfile != stderr) && (weston_logfile != NULL))
-		fclose(weston_logfile);
-	weston_logfile = stderr;
+	log_stop_thread();
+
+	if (weston_log_fd != STDERR_FILENO)
+		close(weston_log_fd);
+	weston_log_fd = STDERR_FILENO;
 }
 
 WL_EXPORT int
@@ -96,8 +498,7 @@ weston_log(const char *fmt, ...)
 	int l;
 	va_list argp;
 	va_start(argp, fmt);
-	l = weston_log_timestamp();
-	l += vfprintf(weston_logfile, fmt, argp);
+	l = log_vprintf(1, fmt, argp);
 	va_end(argp);
 	return l;
 }
@@ -108,7 +509,7 @@ weston_log_continue(const char *fmt, ...)
 	int l;
 	va_list argp;
 	va_start(argp, fmt);
-	l = vfprintf(weston_logfile, fmt, argp);
+	l = log_vprintf(0, fmt, argp);
 	va_end(argp);
 	return l;
 }
@@ -57,6 +57,12 @@ noop_renderer_create_surface(struct weston_surface *surface)
 	return 0;
 }
 
+static void
+noop_renderer_commit(struct weston_surface *surface,
+		     pixman_region32_t *damage)
+{
+}
+
 static void
 noop_renderer_surface_set_color(struct weston_surface *surface,
 		 float red, float green, float blue, float alpha)
@@ -88,10 +94,12 @@ noop_renderer_init(struct weston_compositor *ec)
 	renderer->repaint_output = noop_renderer_repaint_output;
 	renderer->flush_damage = noop_renderer_flush_damage;
 	renderer->attach = noop_renderer_attach;
+	renderer->commit = noop_renderer_commit;
 	renderer->create_surface = noop_renderer_create_surface;
 	renderer->surface_set_color = noop_renderer_surface_set_color;
 	renderer->destroy_surface = noop_renderer_destroy_surface;
 	renderer->destroy = noop_renderer_destroy;
+	renderer->snapshot_layer = NULL;
 	ec->renderer = renderer;
 
 	return 0;
@@ -0,0 +1,224 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <linux/input.h>
+
+#include "compositor.h"
+#include "perf-counters-server-protocol.h"
+
+/*
+ * Exposes the weston_output_stats counters, and the repaint timing
+ * the compositor keeps anyway, to clients.  The counters are kept
+ * whether or not this module is loaded; loading it is what allows
+ * clients to read them.  Since the samples include the pid of every
+ * client, only weston-perf launched by the debug binding, P, may bind
+ * the global, like the screenshooter.
+ */
+struct perf_counters {
+	struct weston_compositor *compositor;
+	struct wl_global *global;
+	struct wl_client *client;
+	struct weston_process process;
+	struct wl_listener destroy_listener;
+};
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Average and 99th percentile of the total repaint time of the frames
+ * in the timing ring, usec. */
+static void
+repaint_time(struct weston_output *output, uint32_t *avg, uint32_t *p99)
+{
+	struct weston_output_timing *timing = &output->timing;
+	uint32_t total[WESTON_REPAINT_TIMING_FRAMES];
+	uint64_t sum = 0;
+	unsigned int i, j;
+
+	*avg = *p99 = 0;
+	if (timing->count == 0)
+		return;
+
+	for (i = 0; i < timing->count; i++) {
+		total[i] = 0;
+		for (j = 0; j < WESTON_REPAINT_PHASE_COUNT; j++)
+			total[i] += timing->frames[i].phase[j];
+		sum += total[i];
+	}
+
+	qsort(total, timing->count, sizeof total[0], compare_uint32);
+	*avg = sum / timing->count;
+	*p99 = total[(timing->count * 99 + 99) / 100 - 1];
+}
+
+static void
+perf_counters_sample(struct wl_client *client, struct wl_resource *resource,
+		     struct wl_resource *output_resource)
+{
+	struct weston_output *output = output_resource->data;
+	struct weston_output_stats *stats = &output->stats;
+	uint32_t avg, p99, latency_avg = 0, slab_allocs, slab_live;
+
+	repaint_time(output, &avg, &p99);
+	weston_slab_totals(&slab_allocs, &slab_live);
+	if (stats->input_latency_count)
+		latency_avg = stats->input_latency_total /
+			stats->input_latency_count;
+
+	perf_counters_send_counters(resource, output_resource,
+				    stats->frames, stats->frames_idle,
+				    stats->frames_missed,
+				    avg, p99,
+				    stats->planes[WESTON_PLANE_KIND_PRIMARY],
+				    stats->planes[WESTON_PLANE_KIND_CURSOR],
+				    stats->planes[WESTON_PLANE_KIND_SCANOUT],
+				    stats->planes[WESTON_PLANE_KIND_OVERLAY],
+				    stats->upload_bytes / 1024,
+				    latency_avg, stats->input_latency_max,
+				    slab_allocs, slab_live);
+}
+
+static void
+perf_counters_sample_clients(struct wl_client *client,
+			     struct wl_resource *resource)
+{
+	struct perf_counters *counters = resource->data;
+	struct weston_client_stats *stats;
+	pid_t pid;
+	uid_t uid;
+	gid_t gid;
+
+	wl_list_for_each(stats, &counters->compositor->client_stats_list,
+			 link) {
+		wl_client_get_credentials(stats->client, &pid, &uid, &gid);
+		perf_counters_send_client(resource, pid, stats->requests,
+					  stats->throttled);
+	}
+}
+
+static const struct perf_counters_interface perf_counters_implementation = {
+	perf_counters_sample,
+	perf_counters_sample_clients
+};
+
+static void
+bind_perf_counters(struct wl_client *client,
+		   void *data, uint32_t version, uint32_t id)
+{
+	struct perf_counters *counters = data;
+	struct wl_resource *resource;
+
+	resource = wl_client_add_object(client, &perf_counters_interface,
+					&perf_counters_implementation,
+					id, data);
+
+	if (client != counters->client) {
+		wl_resource_post_error(resource, WL_DISPLAY_ERROR_INVALID_OBJECT,
+				       "perf_counters failed: permission denied");
+		wl_resource_destroy(resource);
+	}
+}
+
+static void
+perf_counters_sigchld(struct weston_process *process, int status)
+{
+	struct perf_counters *counters =
+		container_of(process, struct perf_counters, process);
+
+	counters->client = NULL;
+}
+
+/* Starts weston-perf, printing to the stdout of the compositor, or
+ * stops it when it is already running. */
+static void
+perf_counters_binding(struct wl_seat *seat, uint32_t time, uint32_t key,
+		      void *data)
+{
+	struct perf_counters *counters = data;
+	const char *perf_exe = LIBEXECDIR "/weston-perf";
+
+	if (counters->client) {
+		kill(counters->process.pid, SIGTERM);
+		return;
+	}
+
+	counters->client = weston_client_launch(counters->compositor,
+						&counters->process,
+						perf_exe,
+						perf_counters_sigchld);
+}
+
+static void
+perf_counters_destroy(struct wl_listener *listener, void *data)
+{
+	struct perf_counters *counters =
+		container_of(listener, struct perf_counters,
+			     destroy_listener);
+
+	if (counters->client) {
+		wl_list_remove(&counters->process.link);
+		kill(counters->process.pid, SIGTERM);
+	}
+
+	wl_display_remove_global(counters->compositor->wl_display,
+				 counters->global);
+	free(counters);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor,
+	    int *argc, char *argv[], const char *config_file)
+{
+	struct perf_counters *counters;
+
+	counters = malloc(sizeof *counters);
+	if (counters == NULL)
+		return -1;
+
+	memset(counters, 0, sizeof *counters);
+	counters->compositor = compositor;
+	counters->global = wl_display_add_global(compositor->wl_display,
+						 &perf_counters_interface,
+						 counters,
+						 bind_perf_counters);
+	if (counters->global == NULL) {
+		free(counters);
+		return -1;
+	}
+
+	weston_compositor_add_debug_binding(compositor, KEY_P,
+					    perf_counters_binding, counters);
+
+	counters->destroy_listener.notify = perf_counters_destroy;
+	wl_signal_add(&compositor->destroy_signal,
+		      &counters->destroy_listener);
+
+	return 0;
+}
@@ -25,6 +25,10 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "pixman-renderer.h"
 
@@ -41,10 +45,36 @@ struct pixman_surface_state {
 	struct weston_buffer_reference buffer_ref;
 };
 
+/* Output damage is split into TILE_SIZE squares for the tile pool. */
+#define TILE_SIZE 128
+
+/*
+ * Worker threads compositing the tiles of one output repaint.  The
+ * thread calling pixman_renderer_repaint_output() picks up tiles too,
+ * then waits for the workers to finish theirs.
+ */
+struct pixman_tile_pool {
+	pthread_t *threads;
+	int count;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	int quit;
+
+	/* The current job, all protected by the mutex. */
+	struct weston_output *output;
+	pixman_region32_t *damage;
+	pixman_box32_t extents;
+	int tiles_x, tile_count;
+	int next_tile, done_tiles;
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 	int repaint_debug;
 	pixman_image_t *debug_color;
+	struct pixman_tile_pool *tile_pool;
 };
 
 static inline struct pixman_output_state *
@@ -104,6 +134,60 @@ pixman_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+static int
+pixman_renderer_read_pixels_scaled(struct weston_output *output,
+				   pixman_format_code_t format,
+				   void *pixels, int32_t stride,
+				   int32_t x, int32_t y,
+				   int32_t width, int32_t height,
+				   int32_t scale)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_image_t *src, *dst;
+	pixman_transform_t transform;
+	int ret = -1;
+
+	if (!po->hw_buffer) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	/* a second image on the same pixels, so the hw_buffer keeps its
+	 * transform and filter */
+	src = pixman_image_create_bits(pixman_image_get_format(po->hw_buffer),
+				       pixman_image_get_width(po->hw_buffer),
+				       pixman_image_get_height(po->hw_buffer),
+				       pixman_image_get_data(po->hw_buffer),
+				       pixman_image_get_stride(po->hw_buffer));
+	dst = pixman_image_create_bits(format, width / scale, height / scale,
+				       pixels, stride);
+	if (src == NULL || dst == NULL)
+		goto out;
+
+	pixman_transform_init_scale(&transform,
+				    pixman_int_to_fixed(scale),
+				    pixman_int_to_fixed(scale));
+	pixman_transform_translate(&transform, NULL,
+				   pixman_int_to_fixed(x),
+				   pixman_int_to_fixed(y));
+	pixman_image_set_transform(src, &transform);
+	if (scale > 1)
+		pixman_image_set_filter(src, PIXMAN_FILTER_BILINEAR, NULL, 0);
+
+	pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst,
+				 0, 0, 0, 0, 0, 0,
+				 width / scale, height / scale);
+	ret = 0;
+
+out:
+	if (src)
+		pixman_image_unref(src);
+	if (dst)
+		pixman_image_unref(dst);
+
+	return ret;
+}
+
 static void
 box_translate(pixman_box32_t *dst, const pixman_box32_t *src, int x, int y)
 {
@@ -117,7 +201,7 @@ box_translate(pixman_box32_t *dst, const pixman_box32_t *src, int x, int y)
 
 static void
 repaint_region_complex(struct weston_surface *es, struct weston_output *output,
-		pixman_region32_t *region)
+		pixman_region32_t *region, pixman_op_t pixman_op)
 {
 	struct pixman_renderer *pr =
 		(struct pixman_renderer *) output->compositor->renderer;
@@ -126,33 +210,10 @@ repaint_region_complex(struct weston_surface *es, struct weston_output *output,
 	int nrects, i;
 	pixman_box32_t *rects, rect;
 
-	/* Pixman supports only 2D transform matrix, but Weston uses 3D,
-	 * so we're omitting Z coordinate here
-	 */
-	pixman_transform_t transform = {{
-		{ D2F(es->transform.matrix.d[0]),
-		  D2F(es->transform.matrix.d[4]),
-		  D2F(es->transform.matrix.d[12]),
-		},
-		{ D2F(es->transform.matrix.d[1]),
-		  D2F(es->transform.matrix.d[5]),
-		  D2F(es->transform.matrix.d[13]),
-		},
-		{ D2F(es->transform.matrix.d[3]),
-		  D2F(es->transform.matrix.d[7]),
-		  D2F(es->transform.matrix.d[15]),
-		}
-	}};
-
-	pixman_transform_invert(&transform, &transform);
-
-	pixman_image_set_transform(ps->image, &transform);
-	pixman_image_set_filter(ps->image, PIXMAN_FILTER_BILINEAR, NULL, 0);
-
 	rects = pixman_region32_rectangles(region, &nrects);
 	for (i = 0; i < nrects; i++) {
 		box_translate(&rect, &rects[i], -output->x, -output->y);
-		pixman_image_composite32(PIXMAN_OP_OVER,
+		pixman_image_composite32(pixman_op,
 			ps->image, /* src */
 			NULL /* mask */,
 			po->shadow_image, /* dest */
@@ -200,9 +261,6 @@ repaint_region_simple(struct weston_surface *es, struct weston_output *output,
 	pixman_region32_init(&final_region);
 	pixman_region32_copy(&final_region, surf_region);
 
-	pixman_image_set_filter(ps->image, PIXMAN_FILTER_NEAREST, NULL, 0);
-	pixman_image_set_transform(ps->image, NULL);
-
 	if (!es->transform.enabled) {
 		pixman_region32_translate(&final_region, es->geometry.x, es->geometry.y);
 	} else {
@@ -243,6 +301,125 @@ repaint_region_simple(struct weston_surface *es, struct weston_output *output,
 	pixman_region32_fini(&final_region);
 }
 
+static int
+surface_needs_transform(struct weston_surface *es)
+{
+	return es->transform.enabled &&
+		es->transform.matrix.type != WESTON_MATRIX_TRANSFORM_TRANSLATE;
+}
+
+static int
+is_unit_or_zero(float v)
+{
+	return v == 0.0f || v == 1.0f || v == -1.0f;
+}
+
+static int
+is_integer(float v)
+{
+	return v == (float) (int) v;
+}
+
+/*
+ * Whether the surface transform maps pixels onto pixels exactly: a
+ * rotation by a multiple of 90 degrees, possibly flipped, with an
+ * integer translation.  Nearest sampling then gives the same result
+ * as bilinear filtering at a fraction of the cost.
+ */
+static int
+surface_transform_is_pixel_exact(struct weston_surface *es)
+{
+	const float *d = es->transform.matrix.d;
+
+	if (d[3] != 0.0f || d[7] != 0.0f || d[15] != 1.0f)
+		return 0;
+
+	if (!is_unit_or_zero(d[0]) || !is_unit_or_zero(d[1]) ||
+	    !is_unit_or_zero(d[4]) || !is_unit_or_zero(d[5]))
+		return 0;
+
+	/* exactly one non-zero entry per row and column */
+	if (!((d[0] != 0.0f && d[5] != 0.0f && d[1] == 0.0f && d[4] == 0.0f) ||
+	      (d[1] != 0.0f && d[4] != 0.0f && d[0] == 0.0f && d[5] == 0.0f)))
+		return 0;
+
+	return is_integer(d[12]) && is_integer(d[13]);
+}
+
+/* Fully covered by opaque surfaces above it, per the clip computed in
+ * surface_accumulate_damage(). */
+static int
+surface_is_occluded(struct weston_surface *es)
+{
+	pixman_box32_t *box = pixman_region32_extents(&es->transform.boundingbox);
+
+	return pixman_region32_contains_rectangle(&es->clip, box) ==
+		PIXMAN_REGION_IN;
+}
+
+static int
+surface_is_opaque(struct weston_surface *es)
+{
+	pixman_box32_t box = { 0, 0, es->geometry.width, es->geometry.height };
+
+	return es->alpha == 1.0f &&
+		pixman_region32_contains_rectangle(&es->opaque, &box) ==
+		PIXMAN_REGION_IN;
+}
+
+/*
+ * Set up the surface image for this repaint.  This is done once per
+ * surface before any tile is drawn, so that the tile workers only
+ * ever read the image state.
+ */
+static void
+prepare_surface(struct weston_surface *es, struct weston_output *output)
+{
+	struct pixman_surface_state *ps = get_surface_state(es);
+	struct pixman_output_state *po = get_output_state(output);
+
+	if (!ps->image)
+		return;
+
+	if (surface_needs_transform(es)) {
+		/* Pixman supports only 2D transform matrix, but Weston uses 3D,
+		 * so we're omitting Z coordinate here
+		 */
+		pixman_transform_t transform = {{
+			{ D2F(es->transform.matrix.d[0]),
+			  D2F(es->transform.matrix.d[4]),
+			  D2F(es->transform.matrix.d[12]),
+			},
+			{ D2F(es->transform.matrix.d[1]),
+			  D2F(es->transform.matrix.d[5]),
+			  D2F(es->transform.matrix.d[13]),
+			},
+			{ D2F(es->transform.matrix.d[3]),
+			  D2F(es->transform.matrix.d[7]),
+			  D2F(es->transform.matrix.d[15]),
+			}
+		}};
+
+		pixman_transform_invert(&transform, &transform);
+
+		pixman_image_set_transform(ps->image, &transform);
+		pixman_image_set_filter(ps->image,
+					surface_transform_is_pixel_exact(es) ?
+					PIXMAN_FILTER_NEAREST :
+					PIXMAN_FILTER_BILINEAR,
+					NULL, 0);
+	} else {
+		pixman_image_set_filter(ps->image, PIXMAN_FILTER_NEAREST,
+					NULL, 0);
+		pixman_image_set_transform(ps->image, NULL);
+	}
+
+	/* pixman validates image state lazily on the first composite,
+	 * an empty composite does that here rather than in a worker. */
+	pixman_image_composite32(PIXMAN_OP_OVER, ps->image, NULL,
+				 po->shadow_image, 0, 0, 0, 0, 0, 0, 0, 0);
+}
+
 static void
 draw_surface(struct weston_surface *es, struct weston_output *output,
 	     pixman_region32_t *damage) /* in global coordinates */
@@ -265,15 +442,17 @@ draw_surface(struct weston_surface *es, struct weston_output *output,
 	if (!pixman_region32_not_empty(&repaint))
 		goto out;
 
-	if (output->zoom.active) {
-		weston_log("pixman renderer does not support zoom\n");
-		goto out;
-	}
-
 	/* TODO: Implement repaint_region_complex() using pixman_composite_trapezoids() */
-	if (es->transform.enabled &&
-	    es->transform.matrix.type != WESTON_MATRIX_TRANSFORM_TRANSLATE) {
-		repaint_region_complex(es, output, &repaint);
+	if (surface_needs_transform(es)) {
+		/* Rotated by multiples of 90 degrees, an opaque surface
+		 * covers whole pixels and can simply be copied. */
+		if (surface_transform_is_pixel_exact(es) &&
+		    surface_is_opaque(es))
+			repaint_region_complex(es, output, &repaint,
+					       PIXMAN_OP_SRC);
+		else
+			repaint_region_complex(es, output, &repaint,
+					       PIXMAN_OP_OVER);
 	} else {
 		/* blended region is whole surface minus opaque region: */
 		pixman_region32_init_rect(&surface_blend, 0, 0,
@@ -294,6 +473,39 @@ draw_surface(struct weston_surface *es, struct weston_output *output,
 out:
 	pixman_region32_fini(&repaint);
 }
+
+static int
+pixman_renderer_snapshot_layer(struct weston_surface *snapshot,
+			       struct weston_layer *layer,
+			       struct weston_output *output)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_surface_state *ps = get_surface_state(snapshot);
+	struct weston_surface *es;
+	pixman_image_t *image, *shadow;
+
+	image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+					 output->width, output->height,
+					 NULL, 0);
+	if (image == NULL)
+		return -1;
+
+	/* draw as if repainting all of the output, into the image */
+	shadow = po->shadow_image;
+	po->shadow_image = image;
+	wl_list_for_each_reverse(es, &layer->surface_list, layer_link) {
+		prepare_surface(es, output);
+		draw_surface(es, output, &output->region);
+	}
+	po->shadow_image = shadow;
+
+	if (ps->image)
+		pixman_image_unref(ps->image);
+	ps->image = image;
+
+	return 0;
+}
+
 static void
 repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
 {
@@ -301,20 +513,161 @@ repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
 	struct weston_surface *surface;
 
 	wl_list_for_each_reverse(surface, &compositor->surface_list, link)
-		if (surface->plane == &compositor->primary_plane)
+		if (surface->plane == &compositor->primary_plane &&
+		    !surface_is_occluded(surface))
 			draw_surface(surface, output, damage);
 }
 
+static void
+repaint_tile(struct pixman_tile_pool *pool, int tile)
+{
+	pixman_region32_t damage;
+	int x, y;
+
+	x = pool->extents.x1 + (tile % pool->tiles_x) * TILE_SIZE;
+	y = pool->extents.y1 + (tile / pool->tiles_x) * TILE_SIZE;
+
+	pixman_region32_init_rect(&damage, x, y, TILE_SIZE, TILE_SIZE);
+	pixman_region32_intersect(&damage, &damage, pool->damage);
+	if (pixman_region32_not_empty(&damage))
+		repaint_surfaces(pool->output, &damage);
+	pixman_region32_fini(&damage);
+}
+
+/* Called and returns with the pool mutex held. */
+static void
+tile_pool_run(struct pixman_tile_pool *pool)
+{
+	int tile;
+
+	while (pool->next_tile < pool->tile_count) {
+		tile = pool->next_tile++;
+
+		pthread_mutex_unlock(&pool->mutex);
+		repaint_tile(pool, tile);
+		pthread_mutex_lock(&pool->mutex);
+
+		if (++pool->done_tiles == pool->tile_count)
+			pthread_cond_signal(&pool->done_cond);
+	}
+}
+
+static void *
+tile_worker(void *data)
+{
+	struct pixman_tile_pool *pool = data;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (!pool->quit) {
+		tile_pool_run(pool);
+		pthread_cond_wait(&pool->work_cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+static void
+repaint_surfaces_tiled(struct pixman_tile_pool *pool,
+		       struct weston_output *output, pixman_region32_t *damage)
+{
+	pixman_box32_t *extents = pixman_region32_extents(damage);
+	int tiles_y;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->output = output;
+	pool->damage = damage;
+	pool->extents = *extents;
+	pool->tiles_x = (extents->x2 - extents->x1 + TILE_SIZE - 1) / TILE_SIZE;
+	tiles_y = (extents->y2 - extents->y1 + TILE_SIZE - 1) / TILE_SIZE;
+	pool->tile_count = pool->tiles_x * tiles_y;
+	pool->next_tile = 0;
+	pool->done_tiles = 0;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	tile_pool_run(pool);
+	while (pool->done_tiles < pool->tile_count)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void
+repaint_output_surfaces(struct weston_output *output,
+			pixman_region32_t *damage, int tiled)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct pixman_renderer *pr = get_renderer(compositor);
+	struct pixman_output_state *po = get_output_state(output);
+	struct weston_surface *surface;
+
+	if (output->zoom.active) {
+		weston_log("pixman renderer does not support zoom\n");
+		return;
+	}
+
+	if (!pixman_region32_not_empty(damage))
+		return;
+
+	wl_list_for_each(surface, &compositor->surface_list, link)
+		if (surface->plane == &compositor->primary_plane &&
+		    !surface_is_occluded(surface))
+			prepare_surface(surface, output);
+	if (pr->repaint_debug)
+		pixman_image_composite32(PIXMAN_OP_OVER, pr->debug_color, NULL,
+					 po->shadow_image,
+					 0, 0, 0, 0, 0, 0, 0, 0);
+
+	if (tiled && pr->tile_pool)
+		repaint_surfaces_tiled(pr->tile_pool, output, damage);
+	else
+		repaint_surfaces(output, damage);
+}
+
+/* Rotated copies are split into blocks of this size, so that the
+ * column-wise reads of the shadow image stay within the cache. */
+#define ROTATE_BLOCK_SIZE 64
+
+#define min(a, b) (((a) > (b)) ? (b) : (a))
+
+static int
+transform_is_rotated(uint32_t transform)
+{
+	switch (transform) {
+	case WL_OUTPUT_TRANSFORM_90:
+	case WL_OUTPUT_TRANSFORM_270:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void
+copy_box_to_hw_buffer(struct pixman_output_state *po, pixman_box32_t *b)
+{
+	pixman_image_composite32(PIXMAN_OP_SRC,
+		po->shadow_image, /* src */
+		NULL /* mask */,
+		po->hw_buffer, /* dest */
+		b->x1, b->y1, /* src_x, src_y */
+		0, 0, /* mask_x, mask_y */
+		b->x1, b->y1, /* dest_x, dest_y */
+		b->x2 - b->x1, /* width */
+		b->y2 - b->y1 /* height */);
+}
+
 static void
 copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 {
 	struct pixman_output_state *po = get_output_state(output);
-	int nrects, i, width, height;
+	int nrects, i, width, height, rotated, x, y;
 	pixman_box32_t *rects;
-	pixman_box32_t b, rect;
+	pixman_box32_t b, rect, block;
 
 	width = pixman_image_get_width(po->shadow_image);
 	height = pixman_image_get_height(po->shadow_image);
+	rotated = transform_is_rotated(output->transform);
 
 	rects = pixman_region32_rectangles(region, &nrects);
 	for (i = 0; i < nrects; i++) {
@@ -322,17 +675,21 @@ copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 		b = weston_transformed_rect(width, height,
 					    output->transform, rect);
 
-		pixman_image_composite32(PIXMAN_OP_SRC,
-			po->shadow_image, /* src */
-			NULL /* mask */,
-			po->hw_buffer, /* dest */
-			b.x1, b.y1, /* src_x, src_y */
-			0, 0, /* mask_x, mask_y */
-			b.x1, b.y1, /* dest_x, dest_y */
-			b.x2 - b.x1, /* width */
-			b.y2 - b.y1 /* height */);
-	}
+		if (!rotated) {
+			copy_box_to_hw_buffer(po, &b);
+			continue;
+		}
 
+		for (y = b.y1; y < b.y2; y += ROTATE_BLOCK_SIZE) {
+			for (x = b.x1; x < b.x2; x += ROTATE_BLOCK_SIZE) {
+				block.x1 = x;
+				block.y1 = y;
+				block.x2 = min(x + ROTATE_BLOCK_SIZE, b.x2);
+				block.y2 = min(y + ROTATE_BLOCK_SIZE, b.y2);
+				copy_box_to_hw_buffer(po, &block);
+			}
+		}
+	}
 }
 
 static void
@@ -344,7 +701,7 @@ pixman_renderer_repaint_output(struct weston_output *output,
 	if (!po->hw_buffer)
 		return;
 
-	repaint_surfaces(output, output_damage);
+	repaint_output_surfaces(output, output_damage, 1);
 	copy_to_hw_buffer(output, output_damage);
 
 	pixman_region32_copy(&output->previous_damage, output_damage);
@@ -388,6 +745,9 @@ pixman_renderer_attach(struct weston_surface *es, struct wl_buffer *buffer)
 	case WL_SHM_FORMAT_ARGB8888:
 		pixman_format = PIXMAN_a8r8g8b8;
 		break;
+	case WL_SHM_FORMAT_YUYV:
+		pixman_format = PIXMAN_yuy2;
+		break;
 	default:
 		weston_log("Unsupported SHM buffer format\n");
 		weston_buffer_reference(&ps->buffer_ref, NULL);
@@ -401,6 +761,13 @@ pixman_renderer_attach(struct weston_surface *es, struct wl_buffer *buffer)
 		wl_shm_buffer_get_stride(buffer));
 }
 
+static void
+pixman_renderer_commit(struct weston_surface *surface,
+		       pixman_region32_t *damage)
+{
+	/* No-op for pixman renderer, it samples the buffer directly */
+}
+
 static int
 pixman_renderer_create_surface(struct weston_surface *surface)
 {
@@ -448,13 +815,123 @@ pixman_renderer_destroy_surface(struct weston_surface *surface)
 	free(ps);
 }
 
+static struct pixman_tile_pool *
+tile_pool_create(int count)
+{
+	struct pixman_tile_pool *pool;
+	sigset_t set, old;
+	int i;
+
+	pool = calloc(1, sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->threads = calloc(count, sizeof *pool->threads);
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	/* Leave signal handling to the main loop. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&pool->threads[i], NULL,
+				   tile_worker, pool) != 0)
+			break;
+		pool->count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return pool;
+}
+
+static void
+tile_pool_destroy(struct pixman_tile_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->count; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
 static void
 pixman_renderer_destroy(struct weston_compositor *ec)
 {
+	struct pixman_renderer *pr = get_renderer(ec);
+
+	if (pr->tile_pool)
+		tile_pool_destroy(pr->tile_pool);
+
 	free(ec->renderer);
 	ec->renderer = NULL;
 }
 
+static double
+benchmark_repaint(struct weston_output *output, int tiled, int frames)
+{
+	pixman_region32_t damage;
+	struct timespec begin, end;
+	int i;
+
+	pixman_region32_init(&damage);
+	pixman_region32_copy(&damage, &output->region);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < frames; i++)
+		repaint_output_surfaces(output, &damage, tiled);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pixman_region32_fini(&damage);
+
+	return ((end.tv_sec - begin.tv_sec) * 1000.0 +
+		(end.tv_nsec - begin.tv_nsec) / 1000000.0) / frames;
+}
+
+/* Time full output repaints into the shadow buffer, single threaded
+ * and tiled, on whatever the outputs currently show. */
+static void
+benchmark_binding(struct wl_seat *seat, uint32_t time, uint32_t key,
+		  void *data)
+{
+	struct weston_compositor *ec = data;
+	struct pixman_renderer *pr = get_renderer(ec);
+	struct weston_output *output;
+	const int frames = 20;
+	double single, tiled;
+
+	wl_list_for_each(output, &ec->output_list, link) {
+		single = benchmark_repaint(output, 0, frames);
+		weston_log("pixman benchmark, output %d, %d frames: "
+			   "single threaded %.2f ms/frame",
+			   output->id, frames, single);
+
+		if (pr->tile_pool) {
+			tiled = benchmark_repaint(output, 1, frames);
+			weston_log_continue(", %d threads %.2f ms/frame",
+					    pr->tile_pool->count + 1, tiled);
+		}
+		weston_log_continue("\n");
+	}
+
+	weston_compositor_damage_all(ec);
+}
+
 static void
 debug_binding(struct wl_seat *seat, uint32_t time, uint32_t key,
 	      void *data)
@@ -487,18 +964,40 @@ pixman_renderer_init(struct weston_compositor *ec)
 
 	renderer->repaint_debug = 0;
 	renderer->debug_color = NULL;
+	renderer->tile_pool = NULL;
 	renderer->base.read_pixels = pixman_renderer_read_pixels;
+	renderer->base.read_pixels_scaled = pixman_renderer_read_pixels_scaled;
 	renderer->base.repaint_output = pixman_renderer_repaint_output;
 	renderer->base.flush_damage = pixman_renderer_flush_damage;
 	renderer->base.attach = pixman_renderer_attach;
+	renderer->base.commit = pixman_renderer_commit;
 	renderer->base.create_surface = pixman_renderer_create_surface;
 	renderer->base.surface_set_color = pixman_renderer_surface_set_color;
 	renderer->base.destroy_surface = pixman_renderer_destroy_surface;
 	renderer->base.destroy = pixman_renderer_destroy;
+	renderer->base.snapshot_layer = pixman_renderer_snapshot_layer;
 	ec->renderer = &renderer->base;
 
+	/* NV12 and YUV420 keep their chroma after the stride * height
+	 * bytes wl_shm checks against the pool, they are not safe to
+	 * read */
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUYV);
+
 	weston_compositor_add_debug_binding(ec, KEY_R,
 					    debug_binding, ec);
+	weston_compositor_add_debug_binding(ec, KEY_B,
+					    benchmark_binding, ec);
+
+	/* The calling thread takes tiles too, so one thread less. */
+	if (ec->renderer_threads > 1) {
+		renderer->tile_pool = tile_pool_create(ec->renderer_threads - 1);
+		if (!renderer->tile_pool)
+			weston_log("failed to create pixman tile workers\n");
+		else
+			weston_log("pixman renderer using %d threads\n",
+				   renderer->tile_pool->count + 1);
+	}
+
 	return 0;
 }
 
@@ -20,13 +20,28 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "config.h"
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/uio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "compositor.h"
 #include "screenshooter-server-protocol.h"
@@ -40,55 +55,76 @@ struct screenshooter {
 	struct wl_client *client;
 	struct weston_process process;
 	struct wl_listener destroy_listener;
+	uint32_t recorder_compression;
+	uint32_t recorder_keyframe_interval;
+	char *recorder_path;
 };
 
 struct screenshooter_frame_listener {
 	struct wl_listener listener;
+	struct wl_listener buffer_destroy_listener;
+	struct wl_listener resource_destroy_listener;
+	struct weston_output *output;
 	struct wl_buffer *buffer;
 	struct wl_resource *resource;
+	int32_t x, y, width, height, scale;
+	struct weston_capture *capture;
+	struct wl_event_source *idle;
 };
 
+/* One per screenshot request, at up to the frame rate when recording
+ * through the protocol. */
+static struct weston_slab frame_listener_slab;
+
 static void
-copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+screenshooter_frame_listener_destroy(struct screenshooter_frame_listener *l)
 {
-	uint8_t *end;
+	wl_list_remove(&l->listener.link);
+	if (l->buffer)
+		wl_list_remove(&l->buffer_destroy_listener.link);
+	if (l->resource)
+		wl_list_remove(&l->resource_destroy_listener.link);
+	if (l->idle)
+		wl_event_source_remove(l->idle);
+	weston_slab_free(&frame_listener_slab, l);
+}
 
-	end = dst + height * stride;
-	while (dst < end) {
-		memcpy(dst, src, stride);
-		dst += stride;
-		src -= stride;
-	}
+static void
+screenshooter_done(struct screenshooter_frame_listener *l)
+{
+	if (l->resource && l->buffer)
+		screenshooter_send_done(l->resource);
+	screenshooter_frame_listener_destroy(l);
 }
 
 static void
-copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
+screenshooter_capture_notify(struct wl_listener *listener, void *data)
 {
-	uint32_t *dst = vdst;
-	uint32_t *src = vsrc;
-	uint32_t *end = dst + bytes / 4;
+	struct screenshooter_frame_listener *l =
+		container_of(listener,
+			     struct screenshooter_frame_listener, listener);
+	struct weston_output *output = data;
+	struct weston_renderer *renderer = output->compositor->renderer;
 
-	while (dst < end) {
-		uint32_t v = *src++;
-		/*                    A R G B */
-		uint32_t tmp = v & 0xff00ff00;
-		tmp |= (v >> 16) & 0x000000ff;
-		tmp |= (v << 16) & 0x00ff0000;
-		*dst++ = tmp;
-	}
+	if (l->buffer)
+		renderer->capture_finish(l->capture, PIXMAN_a8r8g8b8,
+					 wl_shm_buffer_get_data(l->buffer),
+					 wl_shm_buffer_get_stride(l->buffer));
+	else
+		renderer->capture_finish(l->capture, 0, NULL, 0);
+
+	screenshooter_done(l);
 }
 
+/* The repaint that emitted frame_signal clears repaint_needed after
+ * it, so the next frame is scheduled from here. */
 static void
-copy_rgba_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+screenshooter_schedule_repaint(void *data)
 {
-	uint8_t *end;
+	struct screenshooter_frame_listener *l = data;
 
-	end = dst + height * stride;
-	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src -= stride;
-	}
+	l->idle = NULL;
+	weston_output_schedule_repaint(l->output);
 }
 
 static void
@@ -98,53 +134,71 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 		container_of(listener,
 			     struct screenshooter_frame_listener, listener);
 	struct weston_output *output = data;
-	int32_t stride;
-	uint8_t *pixels, *d, *s;
+	struct weston_compositor *ec = output->compositor;
+	struct weston_renderer *renderer = ec->renderer;
+	struct wl_event_loop *loop;
 
 	output->disable_planes--;
-	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(output->compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
 
-	if (pixels == NULL) {
-		wl_resource_post_no_memory(l->resource);
-		free(l);
+	if (l->buffer == NULL || l->resource == NULL) {
+		screenshooter_frame_listener_destroy(l);
 		return;
 	}
 
-	output->compositor->renderer->read_pixels(output,
-			     output->compositor->read_format, pixels,
-			     0, 0, output->current->width,
-			     output->current->height);
+	/* renderers that can read the output now write straight into
+	 * the client's buffer */
+	if (renderer->read_pixels_scaled) {
+		renderer->read_pixels_scaled(output, PIXMAN_a8r8g8b8,
+					     wl_shm_buffer_get_data(l->buffer),
+					     wl_shm_buffer_get_stride(l->buffer),
+					     l->x, l->y, l->width, l->height,
+					     l->scale);
+		screenshooter_done(l);
+		return;
+	}
 
-	stride = wl_shm_buffer_get_stride(l->buffer);
+	if (renderer->capture_start)
+		l->capture = renderer->capture_start(output, l->x, l->y,
+						     l->width, l->height,
+						     l->scale);
+	if (l->capture == NULL) {
+		weston_log("screenshooter: failed to read output\n");
+		screenshooter_done(l);
+		return;
+	}
 
-	d = wl_shm_buffer_get_data(l->buffer);
-	s = pixels + stride * (l->buffer->height - 1);
+	l->listener.notify = screenshooter_capture_notify;
+	loop = wl_display_get_event_loop(ec->wl_display);
+	l->idle = wl_event_loop_add_idle(loop, screenshooter_schedule_repaint, l);
+}
 
-	switch (output->compositor->read_format) {
-	case PIXMAN_a8r8g8b8:
-	case PIXMAN_x8r8g8b8:
-		copy_bgra_yflip(d, s, output->current->height, stride);
-		break;
-	case PIXMAN_x8b8g8r8:
-	case PIXMAN_a8b8g8r8:
-		copy_rgba_yflip(d, s, output->current->height, stride);
-		break;
-	default:
-		break;
-	}
+static void
+screenshooter_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener, struct screenshooter_frame_listener,
+			     buffer_destroy_listener);
 
-	screenshooter_send_done(l->resource);
-	free(pixels);
-	free(l);
+	l->buffer = NULL;
 }
 
 static void
-screenshooter_shoot(struct wl_client *client,
-		    struct wl_resource *resource,
-		    struct wl_resource *output_resource,
-		    struct wl_resource *buffer_resource)
+screenshooter_resource_destroy(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener, struct screenshooter_frame_listener,
+			     resource_destroy_listener);
+
+	l->resource = NULL;
+}
+
+static void
+screenshooter_shoot_region(struct wl_client *client,
+			   struct wl_resource *resource,
+			   struct wl_resource *output_resource,
+			   struct wl_resource *buffer_resource,
+			   int32_t x, int32_t y,
+			   int32_t width, int32_t height, int32_t scale)
 {
 	struct weston_output *output = output_resource->data;
 	struct screenshooter_frame_listener *l;
@@ -153,18 +207,38 @@ screenshooter_shoot(struct wl_client *client,
 	if (!wl_buffer_is_shm(buffer))
 		return;
 
-	if (buffer->width < output->current->width ||
-	    buffer->height < output->current->height)
+	if (x < 0 || y < 0 || width < 1 || height < 1 || scale < 1 ||
+	    x + width > output->current->width ||
+	    y + height > output->current->height ||
+	    width < scale || height < scale)
 		return;
 
-	l = malloc(sizeof *l);
+	if (buffer->width < width / scale || buffer->height < height / scale)
+		return;
+
+	weston_slab_init(&frame_listener_slab, sizeof *l);
+	l = weston_slab_alloc(&frame_listener_slab);
 	if (l == NULL) {
 		wl_resource_post_no_memory(resource);
 		return;
 	}
+	memset(l, 0, sizeof *l);
 
+	l->output = output;
 	l->buffer = buffer;
 	l->resource = resource;
+	l->x = x;
+	l->y = y;
+	l->width = width;
+	l->height = height;
+	l->scale = scale;
+
+	l->buffer_destroy_listener.notify = screenshooter_buffer_destroy;
+	wl_signal_add(&buffer->resource.destroy_signal,
+		      &l->buffer_destroy_listener);
+	l->resource_destroy_listener.notify = screenshooter_resource_destroy;
+	wl_signal_add(&resource->destroy_signal,
+		      &l->resource_destroy_listener);
 
 	l->listener.notify = screenshooter_frame_notify;
 	wl_signal_add(&output->frame_signal, &l->listener);
@@ -172,8 +246,23 @@ screenshooter_shoot(struct wl_client *client,
 	weston_output_schedule_repaint(output);
 }
 
+static void
+screenshooter_shoot(struct wl_client *client,
+		    struct wl_resource *resource,
+		    struct wl_resource *output_resource,
+		    struct wl_resource *buffer_resource)
+{
+	struct weston_output *output = output_resource->data;
+
+	screenshooter_shoot_region(client, resource,
+				   output_resource, buffer_resource,
+				   0, 0, output->current->width,
+				   output->current->height, 1);
+}
+
 struct screenshooter_interface screenshooter_implementation = {
-	screenshooter_shoot
+	screenshooter_shoot,
+	screenshooter_shoot_region
 };
 
 static void
@@ -215,13 +304,70 @@ screenshooter_binding(struct wl_seat *seat, uint32_t time, uint32_t key,
 					screenshooter_exe, screenshooter_sigchld);
 }
 
+/* frames read back but not yet encoded; when the encoder falls this far
+ * behind, damage is held back and read with the next frame instead */
+#define RECORDER_QUEUE_LENGTH 3
+
+struct weston_recorder_frame {
+	uint32_t msecs;
+	int keyframe;
+	int nrects;
+	pixman_box32_t *rects;
+	uint32_t *pixels;
+};
+
+/*
+ * The repaint only reads the damaged pixels back into a free slot of
+ * the queue; the delta and run-length coding, compression and writes
+ * happen on the encoder thread. frame, rect and compressed belong to
+ * that thread, the queue indices and counters are protected by mutex.
+ *
+ * The thread may block writing to a slow socket or pipe; the repaint
+ * never does. Frames are never dropped since every frame is a delta
+ * against the previous one, the damage of frames that find the queue
+ * full is folded into the next frame that fits instead.
+ *
+ * With a keyframe interval, a frame of the whole output coded against
+ * black is written that often, and a regular file gets the index of
+ * them when the recording stops, so that decoders can start from the
+ * keyframe nearest to where they are asked to.
+ */
 struct weston_recorder {
 	struct weston_output *output;
 	uint32_t *frame, *rect;
-	uint32_t total;
+	uint64_t total;
 	int fd;
 	struct wl_listener frame_listener;
 	int count;
+	int coalesced;
+
+	struct wcap_header header;
+	struct wcap_header_v2 header_v2;
+	uint32_t compression;
+	void *compressed;
+	size_t compressed_size;
+
+	uint32_t keyframe_interval;
+	uint32_t keyframe_msecs;
+	int keyframe_due;
+	int write_index;
+	struct wcap_index_entry *index;
+	uint32_t index_count, index_size;
+
+	pixman_region32_t pending;
+	struct weston_recorder_frame queue[RECORDER_QUEUE_LENGTH];
+	int head, length;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int quit;
+	int broken;
+
+	/* the thread wakes the main loop through it when the output
+	 * breaks, to have the recorder destroyed */
+	int broken_fd;
+	struct wl_event_source *broken_source;
 };
 
 static uint32_t *
@@ -304,149 +450,584 @@ transform_rect(struct weston_output *output, pixman_box32_t *r)
         }
 }
 
+static int
+write_all(int fd, const void *data, size_t size)
+{
+	const char *p = data;
+	ssize_t len;
+
+	while (size > 0) {
+		len = write(fd, p, size);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			return -1;
+		p += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+static uint32_t *
+weston_recorder_encode_rect(struct weston_recorder *recorder,
+			    pixman_box32_t *r, uint32_t *s, uint32_t *p)
+{
+	int j, k, width, height, run, stride;
+	uint32_t delta, prev, *d, next;
+
+	width = r->x2 - r->x1;
+	height = r->y2 - r->y1;
+	stride = recorder->output->current->width;
+
+	run = prev = 0; /* quiet gcc */
+	for (j = 0; j < height; j++) {
+		d = recorder->frame + stride * (r->y2 - j - 1) + r->x1;
+		for (k = 0; k < width; k++) {
+			next = *s++;
+			delta = component_delta(next, *d);
+			*d++ = next;
+			if (run == 0 || delta == prev) {
+				run++;
+			} else {
+				p = output_run(p, prev, run);
+				run = 1;
+			}
+			prev = delta;
+		}
+	}
+
+	return output_run(p, prev, run);
+}
+
+static size_t
+weston_recorder_compress(struct weston_recorder *recorder, size_t size)
+{
+	size_t bound = 0, len = 0;
+	void *compressed;
+
+	switch (recorder->compression) {
+#ifdef HAVE_LZ4
+	case WCAP_COMPRESSION_LZ4:
+		bound = LZ4_compressBound(size);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case WCAP_COMPRESSION_ZSTD:
+		bound = ZSTD_compressBound(size);
+		break;
+#endif
+	default:
+		return 0;
+	}
+
+	if (bound > recorder->compressed_size) {
+		compressed = realloc(recorder->compressed, bound);
+		if (!compressed)
+			return 0;
+		recorder->compressed = compressed;
+		recorder->compressed_size = bound;
+	}
+
+	switch (recorder->compression) {
+#ifdef HAVE_LZ4
+	case WCAP_COMPRESSION_LZ4:
+		len = LZ4_compress_default((const char *) recorder->rect,
+					   recorder->compressed, size, bound);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case WCAP_COMPRESSION_ZSTD:
+		len = ZSTD_compress(recorder->compressed, bound,
+				    recorder->rect, size, 1);
+		if (ZSTD_isError(len))
+			len = 0;
+		break;
+#endif
+	}
+
+	return len;
+}
+
+static int
+weston_recorder_add_keyframe(struct weston_recorder *recorder,
+			     struct weston_recorder_frame *frame)
+{
+	struct wcap_index_entry *index, *entry;
+	uint32_t size;
+
+	if (!recorder->write_index)
+		return 0;
+
+	if (recorder->index_count == recorder->index_size) {
+		size = recorder->index_size ? recorder->index_size * 2 : 64;
+		index = realloc(recorder->index, size * sizeof *index);
+		if (index == NULL)
+			return -1;
+		recorder->index = index;
+		recorder->index_size = size;
+	}
+
+	entry = &recorder->index[recorder->index_count++];
+	entry->msecs = frame->msecs;
+	entry->frame = recorder->count;
+	entry->offset_lo = recorder->total;
+	entry->offset_hi = recorder->total >> 32;
+
+	return 0;
+}
+
+static int
+weston_recorder_write_index(struct weston_recorder *recorder)
+{
+	struct wcap_index_trailer trailer;
+
+	trailer.count = recorder->index_count;
+	trailer.magic = WCAP_INDEX_MAGIC;
+	if (trailer.count == 0)
+		return 0;
+
+	if (write_all(recorder->fd, recorder->index,
+		      trailer.count * sizeof *recorder->index) < 0 ||
+	    write_all(recorder->fd, &trailer, sizeof trailer) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int
+weston_recorder_write_frame(struct weston_recorder *recorder,
+			    struct weston_recorder_frame *frame)
+{
+	struct wcap_frame_header header;
+	struct wcap_block_header block;
+	static const uint32_t pad;
+	uint32_t *s, *p;
+	const void *data;
+	size_t size;
+	int i;
+
+	header.msecs = frame->msecs;
+	header.nrects = frame->nrects;
+	if (frame->keyframe) {
+		if (weston_recorder_add_keyframe(recorder, frame) < 0)
+			return -1;
+		header.nrects |= WCAP_FRAME_KEY;
+		memset(recorder->frame, 0,
+		       recorder->output->current->width *
+		       recorder->output->current->height * 4);
+	}
+	size = frame->nrects * sizeof *frame->rects;
+	if (write_all(recorder->fd, &header, sizeof header) < 0 ||
+	    write_all(recorder->fd, frame->rects, size) < 0)
+		return -1;
+	recorder->total += sizeof header + size;
+
+	s = frame->pixels;
+	p = recorder->rect;
+	for (i = 0; i < frame->nrects; i++) {
+		p = weston_recorder_encode_rect(recorder, &frame->rects[i],
+						s, p);
+		s += (frame->rects[i].x2 - frame->rects[i].x1) *
+			(frame->rects[i].y2 - frame->rects[i].y1);
+	}
+	size = (p - recorder->rect) * 4;
+
+	if (recorder->compression == WCAP_COMPRESSION_NONE) {
+		if (write_all(recorder->fd, recorder->rect, size) < 0)
+			return -1;
+		recorder->total += size;
+		return 0;
+	}
+
+	/* a block that does not shrink is stored as is */
+	block.size = size;
+	block.compressed_size = weston_recorder_compress(recorder, size);
+	if (block.compressed_size == 0 || block.compressed_size >= size) {
+		block.compressed_size = size;
+		data = recorder->rect;
+	} else {
+		data = recorder->compressed;
+	}
+
+	if (write_all(recorder->fd, &block, sizeof block) < 0 ||
+	    write_all(recorder->fd, data, block.compressed_size) < 0 ||
+	    write_all(recorder->fd, &pad, -block.compressed_size & 3) < 0)
+		return -1;
+	recorder->total += sizeof block + ((block.compressed_size + 3) & ~3);
+
+	return 0;
+}
+
+static void *
+weston_recorder_thread(void *data)
+{
+	struct weston_recorder *recorder = data;
+	struct weston_recorder_frame *frame;
+	uint64_t one = 1;
+	sigset_t mask;
+	int ret;
+
+	/* a consumer going away shows up as EPIPE on this thread
+	 * instead of taking the compositor down */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	ret = write_all(recorder->fd, &recorder->header,
+			sizeof recorder->header);
+	if (ret == 0 && recorder->header.magic == WCAP_HEADER_MAGIC_V2)
+		ret = write_all(recorder->fd, &recorder->header_v2,
+				sizeof recorder->header_v2);
+	if (ret < 0)
+		weston_log("recorder output failed: %m, not recording\n");
+
+	pthread_mutex_lock(&recorder->mutex);
+	while (ret == 0) {
+		while (!recorder->quit && recorder->length == 0)
+			pthread_cond_wait(&recorder->cond, &recorder->mutex);
+		if (recorder->length == 0)
+			break;
+
+		frame = &recorder->queue[recorder->head];
+		pthread_mutex_unlock(&recorder->mutex);
+
+		ret = weston_recorder_write_frame(recorder, frame);
+		if (ret < 0)
+			weston_log("recorder output failed: %m, "
+				   "no longer recording\n");
+
+		pthread_mutex_lock(&recorder->mutex);
+		recorder->head = (recorder->head + 1) % RECORDER_QUEUE_LENGTH;
+		recorder->length--;
+		if (ret < 0)
+			break;
+		recorder->count++;
+	}
+	recorder->broken = 1;
+	pthread_mutex_unlock(&recorder->mutex);
+
+	if (ret < 0 &&
+	    write(recorder->broken_fd, &one, sizeof one) != sizeof one)
+		weston_log("unable to stop the recorder: %m\n");
+
+	/* only a recording that got to the end is indexed */
+	if (ret == 0 && recorder->write_index &&
+	    weston_recorder_write_index(recorder) < 0)
+		weston_log("recorder output failed: %m, no keyframe index\n");
+
+	return NULL;
+}
+
 static void
 weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 {
 	struct weston_recorder *recorder =
 		container_of(listener, struct weston_recorder, frame_listener);
 	struct weston_output *output = data;
-	uint32_t msecs = output->frame_time;
+	struct weston_recorder_frame *frame;
 	pixman_box32_t *r;
 	pixman_region32_t damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
+	uint32_t *pixels;
+	int i, n, width, height, keyframe;
 
 	pixman_region32_init(&damage);
 	pixman_region32_intersect(&damage, &output->region,
 				  &output->previous_damage);
+	pixman_region32_union(&recorder->pending, &recorder->pending, &damage);
+	pixman_region32_fini(&damage);
 
-	r = pixman_region32_rectangles(&damage, &n);
+	/* until one is queued, every frame is to be the keyframe */
+	keyframe = recorder->keyframe_interval &&
+		(recorder->keyframe_due ||
+		 output->frame_time - recorder->keyframe_msecs >=
+		 recorder->keyframe_interval);
+	if (keyframe)
+		pixman_region32_copy(&recorder->pending, &output->region);
+
+	r = pixman_region32_rectangles(&recorder->pending, &n);
 	if (n == 0)
 		return;
 
-	for (i = 0; i < n; i++)
-		transform_rect(output, &r[i]);
-
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current->width;
+	pthread_mutex_lock(&recorder->mutex);
+	if (recorder->broken) {
+		pthread_mutex_unlock(&recorder->mutex);
+		return;
+	}
+	if (recorder->length == RECORDER_QUEUE_LENGTH) {
+		recorder->coalesced++;
+		pthread_mutex_unlock(&recorder->mutex);
+		return;
+	}
+	frame = &recorder->queue[(recorder->head + recorder->length) %
+				 RECORDER_QUEUE_LENGTH];
+	pthread_mutex_unlock(&recorder->mutex);
+
+	/* the free slot is ours until it is queued */
+	free(frame->rects);
+	frame->rects = malloc(n * sizeof *frame->rects);
+	if (frame->rects == NULL)
+		return;
 
+	frame->msecs = output->frame_time;
+	frame->keyframe = keyframe;
+	if (keyframe) {
+		recorder->keyframe_msecs = frame->msecs;
+		recorder->keyframe_due = 0;
+	}
+	frame->nrects = n;
+	pixels = frame->pixels;
 	for (i = 0; i < n; i++) {
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
+		frame->rects[i] = r[i];
+		transform_rect(output, &frame->rects[i]);
+
+		width = frame->rects[i].x2 - frame->rects[i].x1;
+		height = frame->rects[i].y2 - frame->rects[i].y1;
 		output->compositor->renderer->read_pixels(output,
-			     output->compositor->read_format, recorder->rect,
-			     r[i].x1, output->current->height - r[i].y2,
+			     output->compositor->read_format, pixels,
+			     frame->rects[i].x1,
+			     output->current->height - frame->rects[i].y2,
 			     width, height);
+		pixels += width * height;
+	}
 
-		s = recorder->rect;
-		p = recorder->rect;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			d = recorder->frame +
-				stride * (r[i].y2 - j - 1) + r[i].x1;
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
-		}
+	pixman_region32_fini(&recorder->pending);
+	pixman_region32_init(&recorder->pending);
 
-		p = output_run(p, prev, run);
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->length++;
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
+}
 
-		recorder->total += write(recorder->fd,
-					 recorder->rect,
-					 (p - recorder->rect) * 4);
+static int
+weston_recorder_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
 
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - recorder->rect) * 4,
-			(float) (p - recorder->rect) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
+	if (strlen(path) >= sizeof addr.sun_path) {
+		weston_log("recorder socket path %s too long\n", path);
+		return -1;
 	}
 
-	pixman_region32_fini(&damage);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		weston_log("unable to create recorder socket: %m\n");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+		weston_log("unable to connect to recorder socket %s: %m\n",
+			   path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Recording goes to a regular file unless the path names an existing
+ * UNIX socket, which is connected to, or a FIFO, which needs a reader
+ * already waiting on the other end.
+ */
+static int
+weston_recorder_open(const char *path)
+{
+	struct stat buf;
+	int fd, flags;
+
+	if (stat(path, &buf) < 0)
+		buf.st_mode = 0;
+
+	if (S_ISSOCK(buf.st_mode))
+		return weston_recorder_connect(path);
+
+	if (S_ISFIFO(buf.st_mode)) {
+		fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0) {
+			weston_log("unable to open recorder pipe %s: %m\n",
+				   path);
+			return -1;
+		}
+
+		/* only the recorder thread writes, it may block */
+		flags = fcntl(fd, F_GETFL);
+		fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+		return fd;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		weston_log("problem opening output file %s: %m\n", path);
+
+	return fd;
+}
+
+static void
+weston_recorder_destroy(struct weston_recorder *recorder);
+
+static int
+weston_recorder_broken_handler(int fd, uint32_t mask, void *data)
+{
+	struct weston_recorder *recorder = data;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) != sizeof count)
+		return 0;
+
+	/* the next press of the binding starts a new recorder */
+	fprintf(stderr,
+		"recorder output broken, total file size %dM, %d frames, "
+		"%d coalesced\n",
+		(int) (recorder->total / (1024 * 1024)), recorder->count,
+		recorder->coalesced);
+
+	weston_recorder_destroy(recorder);
+
+	return 0;
 }
 
 static void
-weston_recorder_create(struct weston_output *output, const char *filename)
+weston_recorder_create(struct weston_output *output, const char *filename,
+		       uint32_t compression, uint32_t keyframe_interval)
 {
 	struct weston_recorder *recorder;
-	int stride, size;
-	struct { uint32_t magic, format, width, height; } header;
+	struct wcap_header *header;
+	struct wl_event_loop *loop;
+	struct stat buf;
+	int i, stride, size;
 
 	recorder = malloc(sizeof *recorder);
+	if (recorder == NULL)
+		return;
+	memset(recorder, 0, sizeof *recorder);
 
 	stride = output->current->width;
 	size = stride * 4 * output->current->height;
 	recorder->frame = malloc(size);
 	recorder->rect = malloc(size);
-	recorder->total = 0;
-	recorder->count = 0;
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++)
+		recorder->queue[i].pixels = malloc(size);
 	recorder->output = output;
+	recorder->compression = compression;
+	recorder->keyframe_interval = keyframe_interval;
+	recorder->keyframe_due = 1;
 	memset(recorder->frame, 0, size);
-
-	header.magic = WCAP_HEADER_MAGIC;
+	pixman_region32_init(&recorder->pending);
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->cond, NULL);
+
+	/* version 1 files stay readable by older decoders */
+	header = &recorder->header;
+	if (compression == WCAP_COMPRESSION_NONE && keyframe_interval == 0)
+		header->magic = WCAP_HEADER_MAGIC;
+	else
+		header->magic = WCAP_HEADER_MAGIC_V2;
+	header->width = output->current->width;
+	header->height = output->current->height;
+	recorder->header_v2.compression = compression;
+	recorder->header_v2.flags = keyframe_interval ? WCAP_FLAG_KEYFRAMES : 0;
+	recorder->total = sizeof *header;
+	if (header->magic == WCAP_HEADER_MAGIC_V2)
+		recorder->total += sizeof recorder->header_v2;
 
 	switch (output->compositor->read_format) {
 	case PIXMAN_a8r8g8b8:
-		header.format = WCAP_FORMAT_XRGB8888;
+		header->format = WCAP_FORMAT_XRGB8888;
 		break;
 	case PIXMAN_a8b8g8r8:
-		header.format = WCAP_FORMAT_XBGR8888;
+		header->format = WCAP_FORMAT_XBGR8888;
 		break;
 	default:
 		weston_log("unknown recorder format\n");
-		free(recorder);
-		return;
+		goto err;
 	}
 
-	recorder->fd = open(filename,
-			    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	recorder->fd = weston_recorder_open(filename);
+	if (recorder->fd < 0)
+		goto err;
 
-	if (recorder->fd < 0) {
-		weston_log("problem opening output file %s: %m\n", filename);
-		free(recorder);
-		return;
+	/* a socket or pipe reader has no end of file to find it at */
+	recorder->write_index = keyframe_interval &&
+		fstat(recorder->fd, &buf) == 0 && S_ISREG(buf.st_mode);
+
+	recorder->broken_fd = eventfd(0, EFD_CLOEXEC);
+	if (recorder->broken_fd < 0) {
+		weston_log("unable to create recorder eventfd: %m\n");
+		close(recorder->fd);
+		goto err;
+	}
+	loop = wl_display_get_event_loop(output->compositor->wl_display);
+	recorder->broken_source =
+		wl_event_loop_add_fd(loop, recorder->broken_fd,
+				     WL_EVENT_READABLE,
+				     weston_recorder_broken_handler, recorder);
+	if (recorder->broken_source == NULL) {
+		close(recorder->broken_fd);
+		close(recorder->fd);
+		goto err;
 	}
 
-	header.width = output->current->width;
-	header.height = output->current->height;
-	recorder->total += write(recorder->fd, &header, sizeof header);
+	if (pthread_create(&recorder->thread, NULL,
+			   weston_recorder_thread, recorder) != 0) {
+		weston_log("unable to start the recorder thread\n");
+		wl_event_source_remove(recorder->broken_source);
+		close(recorder->broken_fd);
+		close(recorder->fd);
+		goto err;
+	}
 
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
 	output->disable_planes++;
 	weston_output_damage(output);
+	return;
+
+err:
+	pixman_region32_fini(&recorder->pending);
+	pthread_mutex_destroy(&recorder->mutex);
+	pthread_cond_destroy(&recorder->cond);
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++)
+		free(recorder->queue[i].pixels);
+	free(recorder->frame);
+	free(recorder->rect);
+	free(recorder);
 }
 
 static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
+	int i;
+
 	wl_list_remove(&recorder->frame_listener.link);
+
+	/* the thread drains the queue before it leaves */
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->quit = 1;
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->mutex);
+	pthread_join(recorder->thread, NULL);
+
+	wl_event_source_remove(recorder->broken_source);
+	close(recorder->broken_fd);
 	close(recorder->fd);
+	pixman_region32_fini(&recorder->pending);
+	pthread_mutex_destroy(&recorder->mutex);
+	pthread_cond_destroy(&recorder->cond);
+	for (i = 0; i < RECORDER_QUEUE_LENGTH; i++) {
+		free(recorder->queue[i].rects);
+		free(recorder->queue[i].pixels);
+	}
 	free(recorder->frame);
 	free(recorder->rect);
+	free(recorder->compressed);
+	free(recorder->index);
 	recorder->output->disable_planes--;
 	free(recorder);
 }
@@ -459,9 +1040,10 @@ recorder_binding(struct wl_seat *seat, uint32_t time, uint32_t key, void *data)
 	struct weston_output *output =
 		container_of(ec->output_list.next,
 			     struct weston_output, link);
+	struct screenshooter *shooter = data;
 	struct wl_listener *listener;
 	struct weston_recorder *recorder;
-	static const char filename[] = "capture.wcap";
+	const char *filename = "capture.wcap";
 
 	listener = wl_signal_get(&output->frame_signal,
 				 weston_recorder_frame_notify);
@@ -470,13 +1052,19 @@ recorder_binding(struct wl_seat *seat, uint32_t time, uint32_t key, void *data)
 					frame_listener);
 
 		fprintf(stderr,
-			"stopping recorder, total file size %dM, %d frames\n",
-			recorder->total / (1024 * 1024), recorder->count);
+			"stopping recorder, total file size %dM, %d frames, "
+			"%d coalesced\n",
+			(int) (recorder->total / (1024 * 1024)), recorder->count,
+			recorder->coalesced);
 
 		weston_recorder_destroy(recorder);
 	} else {
+		if (shooter->recorder_path)
+			filename = shooter->recorder_path;
 		fprintf(stderr, "starting recorder, file %s\n", filename);
-		weston_recorder_create(output, filename);
+		weston_recorder_create(output, filename,
+				       shooter->recorder_compression,
+				       shooter->recorder_keyframe_interval);
 	}
 }
 
@@ -487,18 +1075,57 @@ screenshooter_destroy(struct wl_listener *listener, void *data)
 		container_of(listener, struct screenshooter, destroy_listener);
 
 	wl_display_remove_global(shooter->ec->wl_display, shooter->global);
+	free(shooter->recorder_path);
 	free(shooter);
 }
 
+static uint32_t
+recorder_compression_from_string(const char *name)
+{
+	if (name == NULL || strcmp(name, "none") == 0)
+		return WCAP_COMPRESSION_NONE;
+#ifdef HAVE_LZ4
+	if (strcmp(name, "lz4") == 0)
+		return WCAP_COMPRESSION_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+	if (strcmp(name, "zstd") == 0)
+		return WCAP_COMPRESSION_ZSTD;
+#endif
+
+	weston_log("recorder compression '%s' not supported\n", name);
+
+	return WCAP_COMPRESSION_NONE;
+}
+
 void
-screenshooter_create(struct weston_compositor *ec)
+screenshooter_create(struct weston_compositor *ec, const char *config_file)
 {
 	struct screenshooter *shooter;
+	char *compression = NULL, *path = NULL;
+	unsigned int keyframe_interval = 0;
+	const struct config_key recorder_config_keys[] = {
+		{ "compression", CONFIG_KEY_STRING, &compression },
+		{ "path", CONFIG_KEY_STRING, &path },
+		{ "keyframe-interval", CONFIG_KEY_UNSIGNED_INTEGER,
+		  &keyframe_interval },
+	};
+	const struct config_section cs[] = {
+		{ "recorder",
+		  recorder_config_keys, ARRAY_LENGTH(recorder_config_keys) },
+	};
 
 	shooter = malloc(sizeof *shooter);
 	if (shooter == NULL)
 		return;
 
+	parse_config_file(config_file, cs, ARRAY_LENGTH(cs), shooter);
+	shooter->recorder_path = path;
+	shooter->recorder_compression =
+		recorder_compression_from_string(compression);
+	free(compression);
+	shooter->recorder_keyframe_interval = keyframe_interval * 1000;
+
 	shooter->base.interface = &screenshooter_interface;
 	shooter->base.implementation =
 		(void(**)(void)) &screenshooter_implementation;
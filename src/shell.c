@@ -66,6 +66,12 @@ struct focus_state {
 struct workspace {
 	struct weston_layer layer;
 
+	/* While a workspace change animates, the snapshot of the layer
+	 * takes its place in the layer list. */
+	struct weston_layer snapshot_layer;
+	struct weston_surface *snapshot;
+	struct weston_transform snapshot_transform;
+
 	struct wl_list focus_list;
 	struct wl_listener seat_destroyed_listener;
 };
@@ -88,6 +94,8 @@ struct desktop_shell {
 	struct wl_listener destroy_listener;
 	struct wl_listener show_input_panel_listener;
 	struct wl_listener hide_input_panel_listener;
+	struct wl_listener gesture_listener;
+	struct wl_listener config_listener;
 
 	struct weston_layer fullscreen_layer;
 	struct weston_layer panel_layer;
@@ -128,6 +136,10 @@ struct desktop_shell {
 		double anim_current;
 		struct workspace *anim_from;
 		struct workspace *anim_to;
+
+		/* motion of the current touchpad swipe */
+		double swipe_dx;
+		double swipe_dy;
 	} workspaces;
 
 	struct {
@@ -135,7 +147,7 @@ struct desktop_shell {
 		int duration;
 		struct wl_resource *binding;
 		struct weston_process process;
-		struct wl_event_source *timer;
+		struct weston_timer timer;
 	} screensaver;
 
 	struct {
@@ -144,8 +156,8 @@ struct desktop_shell {
 	} input_panel;
 
 	struct {
-		struct weston_surface *surface;
-		struct weston_surface_animation *animation;
+		struct weston_animation animation;
+		struct weston_spring spring;
 		enum fade_type type;
 	} fade;
 
@@ -163,8 +175,9 @@ enum shell_surface_type {
 };
 
 struct ping_timer {
-	struct wl_event_source *source;
+	struct weston_timer timer;
 	uint32_t serial;
+	int pending;		/* until the pong, even once timed out */
 };
 
 struct shell_surface {
@@ -206,7 +219,17 @@ struct shell_surface {
 		struct weston_surface *black_surface;
 	} fullscreen;
 
-	struct ping_timer *ping_timer;
+	struct ping_timer ping_timer;
+
+	/* interactive resize: no new configure before the client
+	 * committed a buffer for the last one, only the latest size
+	 * is kept meanwhile */
+	struct {
+		int waiting;
+		int pending;
+		uint32_t edges;
+		int32_t width, height;
+	} resize_configure;
 
 	struct weston_transform workspace_transform;
 
@@ -394,11 +417,40 @@ shell_configuration(struct desktop_shell *shell, const char *config_file)
 
 	parse_config_file(config_file, cs, ARRAY_LENGTH(cs), shell);
 
+	free(shell->screensaver.path);
 	shell->screensaver.path = path;
 	shell->screensaver.duration = duration * 1000;
 	shell->binding_modifier = get_modifier(modifier);
 	shell->win_animation_type = get_animation_type(win_animation);
 	shell->workspaces.num = num_workspaces > 0 ? num_workspaces : 1;
+
+	free(modifier);
+	free(win_animation);
+}
+
+/* The animation and the screensaver take effect on reload, the
+ * binding modifier and the number of workspaces only at start. */
+static void
+shell_config_reloaded(struct wl_listener *listener, void *data)
+{
+	struct desktop_shell *shell =
+		container_of(listener, struct desktop_shell, config_listener);
+	uint32_t binding_modifier = shell->binding_modifier;
+	unsigned int num_workspaces = shell->workspaces.num;
+
+	if (!weston_compositor_config_changed(shell->compositor, "shell") &&
+	    !weston_compositor_config_changed(shell->compositor,
+					      "screensaver"))
+		return;
+
+	shell_configuration(shell, shell->compositor->config_file);
+
+	if (shell->binding_modifier != binding_modifier ||
+	    shell->workspaces.num != num_workspaces)
+		weston_log("binding-modifier and num-workspaces "
+			   "need a restart\n");
+	shell->binding_modifier = binding_modifier;
+	shell->workspaces.num = num_workspaces;
 }
 
 static void
@@ -535,6 +587,9 @@ workspace_destroy(struct workspace *ws)
 	wl_list_for_each_safe(state, next, &ws->focus_list, link)
 		focus_state_destroy(state);
 
+	if (ws->snapshot)
+		weston_surface_destroy(ws->snapshot);
+
 	free(ws);
 }
 
@@ -560,6 +615,9 @@ workspace_create(void)
 		return NULL;
 
 	weston_layer_init(&ws->layer, NULL);
+	wl_list_init(&ws->layer.link);
+	weston_layer_init(&ws->snapshot_layer, NULL);
+	ws->snapshot = NULL;
 
 	wl_list_init(&ws->focus_list);
 	wl_list_init(&ws->seat_destroyed_listener.link);
@@ -589,6 +647,20 @@ get_current_workspace(struct desktop_shell *shell)
 	return get_workspace(shell, shell->workspaces.current);
 }
 
+/* Takes a workspace out of the layer list, so its surfaces cost
+ * nothing per frame until it is inserted again. */
+static void
+workspace_detach(struct desktop_shell *shell, struct workspace *ws)
+{
+	struct weston_surface *surface;
+
+	wl_list_remove(&ws->layer.link);
+	wl_list_init(&ws->layer.link);
+	wl_list_for_each(surface, &ws->layer.surface_list, layer_link)
+		weston_surface_set_hidden(surface, 1);
+	weston_compositor_stacking_dirty(shell->compositor);
+}
+
 static void
 activate_workspace(struct desktop_shell *shell, unsigned int index)
 {
@@ -596,6 +668,7 @@ activate_workspace(struct desktop_shell *shell, unsigned int index)
 
 	ws = get_workspace(shell, index);
 	wl_list_insert(&shell->panel_layer.link, &ws->layer.link);
+	weston_compositor_stacking_dirty(shell->compositor);
 
 	shell->workspaces.current = index;
 }
@@ -623,6 +696,59 @@ surface_translate(struct weston_surface *surface, double d)
 	weston_surface_geometry_dirty(surface);
 }
 
+/* Replace the layer by a snapshot of it on output, in the layer list. */
+static void
+workspace_snapshot_begin(struct workspace *ws, struct weston_output *output)
+{
+	if (workspace_is_empty(ws))
+		return;
+
+	ws->snapshot = weston_layer_snapshot(&ws->layer, output);
+	if (ws->snapshot == NULL)
+		return;
+
+	/* Never committed, so clear the input region directly: the
+	 * animation must not catch picks or pointer focus. */
+	pixman_region32_fini(&ws->snapshot->input);
+	pixman_region32_init(&ws->snapshot->input);
+
+	wl_list_insert(&ws->snapshot_layer.surface_list,
+		       &ws->snapshot->layer_link);
+	weston_matrix_init(&ws->snapshot_transform.matrix);
+	wl_list_insert(ws->snapshot->geometry.transformation_list.prev,
+		       &ws->snapshot_transform.link);
+	weston_surface_update_transform(ws->snapshot);
+
+	wl_list_insert(&ws->layer.link, &ws->snapshot_layer.link);
+	wl_list_remove(&ws->layer.link);
+	weston_compositor_stacking_dirty(ws->snapshot->compositor);
+}
+
+static void
+workspace_snapshot_end(struct workspace *ws)
+{
+	struct weston_compositor *compositor;
+
+	if (ws->snapshot == NULL)
+		return;
+
+	compositor = ws->snapshot->compositor;
+	wl_list_insert(&ws->snapshot_layer.link, &ws->layer.link);
+	wl_list_remove(&ws->snapshot_layer.link);
+
+	weston_surface_destroy(ws->snapshot);
+	ws->snapshot = NULL;
+	weston_compositor_stacking_dirty(compositor);
+}
+
+static void
+workspace_translate(struct workspace *ws, double d)
+{
+	weston_matrix_init(&ws->snapshot_transform.matrix);
+	weston_matrix_translate(&ws->snapshot_transform.matrix, 0.0, d, 0.0);
+	weston_surface_geometry_dirty(ws->snapshot);
+}
+
 static void
 workspace_translate_out(struct workspace *ws, double fraction)
 {
@@ -630,6 +756,12 @@ workspace_translate_out(struct workspace *ws, double fraction)
 	unsigned int height;
 	double d;
 
+	if (ws->snapshot) {
+		workspace_translate(ws, ws->snapshot->geometry.height *
+				    fraction);
+		return;
+	}
+
 	wl_list_for_each(surface, &ws->layer.surface_list, layer_link) {
 		height = get_output_height(surface->output);
 		d = height * fraction;
@@ -645,6 +777,16 @@ workspace_translate_in(struct workspace *ws, double fraction)
 	unsigned int height;
 	double d;
 
+	if (ws->snapshot) {
+		height = ws->snapshot->geometry.height;
+		if (fraction > 0)
+			d = -(height - height * fraction);
+		else
+			d = height + height * fraction;
+		workspace_translate(ws, d);
+		return;
+	}
+
 	wl_list_for_each(surface, &ws->layer.surface_list, layer_link) {
 		height = get_output_height(surface->output);
 
@@ -708,11 +850,13 @@ finish_workspace_change_animation(struct desktop_shell *shell,
 	weston_compositor_schedule_repaint(shell->compositor);
 
 	wl_list_remove(&shell->workspaces.animation.link);
+	workspace_snapshot_end(from);
+	workspace_snapshot_end(to);
 	workspace_deactivate_transforms(from);
 	workspace_deactivate_transforms(to);
 	shell->workspaces.anim_to = NULL;
 
-	wl_list_remove(&shell->workspaces.anim_from->layer.link);
+	workspace_detach(shell, shell->workspaces.anim_from);
 }
 
 static void
@@ -795,6 +939,14 @@ animate_workspace_change(struct desktop_shell *shell,
 		       &shell->workspaces.animation.link);
 
 	wl_list_insert(from->layer.link.prev, &to->layer.link);
+	weston_compositor_stacking_dirty(shell->compositor);
+
+	/* With a single output, slide snapshots of the two workspaces
+	 * rather than every surface on them. */
+	if (output->link.next == &shell->compositor->output_list) {
+		workspace_snapshot_begin(from, output);
+		workspace_snapshot_begin(to, output);
+	}
 
 	workspace_translate_in(to, 0);
 
@@ -809,7 +961,7 @@ update_workspace(struct desktop_shell *shell, unsigned int index,
 {
 	shell->workspaces.current = index;
 	wl_list_insert(&from->layer.link, &to->layer.link);
-	wl_list_remove(&from->layer.link);
+	workspace_detach(shell, from);
 }
 
 static void
@@ -888,6 +1040,8 @@ move_surface_to_workspace(struct desktop_shell *shell,
 
 	wl_list_remove(&surface->layer_link);
 	wl_list_insert(&to->layer.surface_list, &surface->layer_link);
+	weston_surface_set_hidden(surface, 1);
+	weston_compositor_stacking_dirty(shell->compositor);
 
 	drop_focus_state(shell, from, surface);
 	wl_list_for_each(seat, &shell->compositor->seat_list, link)
@@ -920,14 +1074,20 @@ take_surface_to_workspace_by_seat(struct desktop_shell *shell,
 
 	wl_list_remove(&surface->layer_link);
 	wl_list_insert(&to->layer.surface_list, &surface->layer_link);
+	weston_compositor_stacking_dirty(shell->compositor);
 
 	replace_focus_state(shell, to, seat);
 	drop_focus_state(shell, from, surface);
 
 	if (shell->workspaces.anim_from == to &&
 	    shell->workspaces.anim_to == from) {
+		/* the snapshots no longer show what is where */
+		workspace_snapshot_end(from);
+		workspace_snapshot_end(to);
+
 		wl_list_remove(&to->layer.link);
 		wl_list_insert(from->layer.link.prev, &to->layer.link);
+		weston_compositor_stacking_dirty(shell->compositor);
 
 		reverse_workspace_change_animation(shell, index, from, to);
 		broadcast_current_workspace_state(shell);
@@ -1106,6 +1266,44 @@ struct weston_resize_grab {
 	int32_t width, height;
 };
 
+static void
+send_configure(struct weston_surface *surface,
+	       uint32_t edges, int32_t width, int32_t height)
+{
+	struct shell_surface *shsurf = get_shell_surface(surface);
+
+	wl_shell_surface_send_configure(&shsurf->resource,
+					edges, width, height);
+}
+
+static const struct weston_shell_client shell_client = {
+	send_configure
+};
+
+static void
+shell_surface_send_resize_configure(struct shell_surface *shsurf,
+				    uint32_t edges,
+				    int32_t width, int32_t height)
+{
+	/* xwayland throttles its own configures */
+	if (shsurf->client != &shell_client) {
+		shsurf->client->send_configure(shsurf->surface,
+					       edges, width, height);
+		return;
+	}
+
+	if (shsurf->resize_configure.waiting) {
+		shsurf->resize_configure.pending = 1;
+		shsurf->resize_configure.edges = edges;
+		shsurf->resize_configure.width = width;
+		shsurf->resize_configure.height = height;
+		return;
+	}
+
+	shsurf->resize_configure.waiting = 1;
+	send_configure(shsurf->surface, edges, width, height);
+}
+
 static void
 resize_grab_motion(struct wl_pointer_grab *grab,
 		   uint32_t time, wl_fixed_t x, wl_fixed_t y)
@@ -1140,24 +1338,10 @@ resize_grab_motion(struct wl_pointer_grab *grab,
 		height += wl_fixed_to_int(to_y - from_y);
 	}
 
-	shsurf->client->send_configure(shsurf->surface,
-				       resize->edges, width, height);
+	shell_surface_send_resize_configure(shsurf,
+					    resize->edges, width, height);
 }
 
-static void
-send_configure(struct weston_surface *surface,
-	       uint32_t edges, int32_t width, int32_t height)
-{
-	struct shell_surface *shsurf = get_shell_surface(surface);
-
-	wl_shell_surface_send_configure(&shsurf->resource,
-					edges, width, height);
-}
-
-static const struct weston_shell_client shell_client = {
-	send_configure
-};
-
 static void
 resize_grab_button(struct wl_pointer_grab *grab,
 		   uint32_t time, uint32_t button, uint32_t state_w)
@@ -1297,19 +1481,16 @@ end_busy_cursor(struct shell_surface *shsurf, struct wl_pointer *pointer)
 }
 
 static void
-ping_timer_destroy(struct shell_surface *shsurf)
+ping_timer_stop(struct shell_surface *shsurf)
 {
-	if (!shsurf || !shsurf->ping_timer)
+	if (!shsurf)
 		return;
 
-	if (shsurf->ping_timer->source)
-		wl_event_source_remove(shsurf->ping_timer->source);
-
-	free(shsurf->ping_timer);
-	shsurf->ping_timer = NULL;
+	weston_timer_disarm(&shsurf->ping_timer.timer);
+	shsurf->ping_timer.pending = 0;
 }
 
-static int
+static void
 ping_timeout_handler(void *data)
 {
 	struct shell_surface *shsurf = data;
@@ -1321,15 +1502,12 @@ ping_timeout_handler(void *data)
 	wl_list_for_each(seat, &shsurf->surface->compositor->seat_list, link)
 		if (seat->seat.pointer->focus == &shsurf->surface->surface)
 			set_busy_cursor(shsurf, seat->seat.pointer);
-
-	return 1;
 }
 
 static void
 ping_handler(struct weston_surface *surface, uint32_t serial)
 {
 	struct shell_surface *shsurf = get_shell_surface(surface);
-	struct wl_event_loop *loop;
 	int ping_timeout = 200;
 
 	if (!shsurf)
@@ -1340,16 +1518,11 @@ ping_handler(struct weston_surface *surface, uint32_t serial)
 	if (shsurf->surface == shsurf->shell->grab_surface)
 		return;
 
-	if (!shsurf->ping_timer) {
-		shsurf->ping_timer = malloc(sizeof *shsurf->ping_timer);
-		if (!shsurf->ping_timer)
-			return;
-
-		shsurf->ping_timer->serial = serial;
-		loop = wl_display_get_event_loop(surface->compositor->wl_display);
-		shsurf->ping_timer->source =
-			wl_event_loop_add_timer(loop, ping_timeout_handler, shsurf);
-		wl_event_source_timer_update(shsurf->ping_timer->source, ping_timeout);
+	if (!shsurf->ping_timer.pending) {
+		shsurf->ping_timer.pending = 1;
+		shsurf->ping_timer.serial = serial;
+		weston_timer_arm(surface->compositor->timer_wheel,
+				 &shsurf->ping_timer.timer, ping_timeout);
 
 		wl_shell_surface_send_ping(&shsurf->resource, serial);
 	}
@@ -1403,11 +1576,11 @@ shell_surface_pong(struct wl_client *client, struct wl_resource *resource,
 	struct wl_pointer *pointer;
 	int was_unresponsive;
 
-	if (shsurf->ping_timer == NULL)
+	if (!shsurf->ping_timer.pending)
 		/* Just ignore unsolicited pong. */
 		return;
 
-	if (shsurf->ping_timer->serial == serial) {
+	if (shsurf->ping_timer.serial == serial) {
 		was_unresponsive = shsurf->unresponsive;
 		shsurf->unresponsive = 0;
 		if (was_unresponsive) {
@@ -1421,7 +1594,7 @@ shell_surface_pong(struct wl_client *client, struct wl_resource *resource,
 					end_busy_cursor(shsurf, pointer);
 			}
 		}
-		ping_timer_destroy(shsurf);
+		ping_timer_stop(shsurf);
 	}
 }
 
@@ -1481,6 +1654,7 @@ shell_unset_fullscreen(struct shell_surface *shsurf)
 	ws = get_current_workspace(shsurf->shell);
 	wl_list_remove(&shsurf->surface->layer_link);
 	wl_list_insert(&ws->layer.surface_list, &shsurf->surface->layer_link);
+	weston_compositor_stacking_dirty(shsurf->surface->compositor);
 }
 
 static void
@@ -1502,6 +1676,7 @@ shell_unset_maximized(struct shell_surface *shsurf)
 	ws = get_current_workspace(shsurf->shell);
 	wl_list_remove(&shsurf->surface->layer_link);
 	wl_list_insert(&ws->layer.surface_list, &shsurf->surface->layer_link);
+	weston_compositor_stacking_dirty(shsurf->surface->compositor);
 }
 
 static int
@@ -1708,6 +1883,7 @@ shell_configure_fullscreen(struct shell_surface *shsurf)
 	wl_list_remove(&shsurf->fullscreen.black_surface->layer_link);
 	wl_list_insert(&surface->layer_link,
 		       &shsurf->fullscreen.black_surface->layer_link);
+	weston_compositor_stacking_dirty(surface->compositor);
 	shsurf->fullscreen.black_surface->output = output;
 
 	switch (shsurf->fullscreen.type) {
@@ -1781,6 +1957,7 @@ shell_stack_fullscreen(struct shell_surface *shsurf)
 	wl_list_remove(&surface->layer_link);
 	wl_list_insert(&shell->fullscreen_layer.surface_list,
 		       &surface->layer_link);
+	weston_compositor_stacking_dirty(surface->compositor);
 	weston_surface_damage(surface);
 
 	if (!shsurf->fullscreen.black_surface)
@@ -1794,6 +1971,7 @@ shell_stack_fullscreen(struct shell_surface *shsurf)
 	wl_list_remove(&shsurf->fullscreen.black_surface->layer_link);
 	wl_list_insert(&surface->layer_link,
 		       &shsurf->fullscreen.black_surface->layer_link);
+	weston_compositor_stacking_dirty(surface->compositor);
 	weston_surface_damage(shsurf->fullscreen.black_surface);
 }
 
@@ -2104,7 +2282,7 @@ destroy_shell_surface(struct shell_surface *shsurf)
 	 */
 	wl_list_remove(&shsurf->surface_destroy_listener.link);
 	shsurf->surface->configure = NULL;
-	ping_timer_destroy(shsurf);
+	ping_timer_stop(shsurf);
 	free(shsurf->title);
 
 	wl_list_remove(&shsurf->link);
@@ -2175,7 +2353,9 @@ create_shell_surface(void *shell, struct weston_surface *surface,
 	shsurf->fullscreen.type = WL_SHELL_SURFACE_FULLSCREEN_METHOD_DEFAULT;
 	shsurf->fullscreen.framerate = 0;
 	shsurf->fullscreen.black_surface = NULL;
-	shsurf->ping_timer = NULL;
+	weston_timer_init(&shsurf->ping_timer.timer,
+			  ping_timeout_handler, shsurf);
+	shsurf->ping_timer.pending = 0;
 	wl_list_init(&shsurf->fullscreen.transform.link);
 
 	wl_signal_init(&shsurf->resource.destroy_signal);
@@ -2243,14 +2423,12 @@ static const struct wl_shell_interface shell_implementation = {
 static void
 shell_fade(struct desktop_shell *shell, enum fade_type type);
 
-static int
+static void
 screensaver_timeout(void *data)
 {
 	struct desktop_shell *shell = data;
 
 	shell_fade(shell, FADE_OUT);
-
-	return 1;
 }
 
 static void
@@ -2315,6 +2493,7 @@ configure_static_surface(struct weston_surface *es, struct weston_layer *layer,
 
 	if (wl_list_empty(&es->layer_link)) {
 		wl_list_insert(&layer->surface_list, &es->layer_link);
+		weston_compositor_stacking_dirty(es->compositor);
 		weston_compositor_schedule_repaint(es->compositor);
 	}
 }
@@ -2398,6 +2577,7 @@ lock_surface_configure(struct weston_surface *surface, int32_t sx, int32_t sy, i
 	if (!weston_surface_is_mapped(surface)) {
 		wl_list_insert(&shell->lock_layer.surface_list,
 			       &surface->layer_link);
+		weston_compositor_stacking_dirty(shell->compositor);
 		weston_surface_update_transform(surface);
 		shell_fade(shell, FADE_IN);
 	}
@@ -2456,12 +2636,16 @@ resume_desktop(struct desktop_shell *shell)
 	} else {
 		wl_list_insert(&shell->panel_layer.link, &ws->layer.link);
 	}
+	weston_compositor_stacking_dirty(shell->compositor);
 
 	restore_focus_state(shell, get_current_workspace(shell));
 
 	shell->locked = false;
 	shell_fade(shell, FADE_IN);
 	weston_compositor_damage_all(shell->compositor);
+
+	if (shell->child.desktop_shell)
+		desktop_shell_send_idle(shell->child.desktop_shell, 0);
 }
 
 static void
@@ -2899,6 +3083,11 @@ lock(struct desktop_shell *shell)
 
 	shell->locked = true;
 
+	if (shell->workspaces.anim_to != NULL)
+		finish_workspace_change_animation(shell,
+						  shell->workspaces.anim_from,
+						  shell->workspaces.anim_to);
+
 	/* Hide all surfaces by removing the fullscreen, panel and
 	 * toplevel layers.  This way nothing else can show or receive
 	 * input events while we are locked. */
@@ -2907,12 +3096,16 @@ lock(struct desktop_shell *shell)
 	wl_list_remove(&shell->fullscreen_layer.link);
 	if (shell->showing_input_panels)
 		wl_list_remove(&shell->input_panel_layer.link);
-	wl_list_remove(&ws->layer.link);
+	workspace_detach(shell, ws);
 	wl_list_insert(&shell->compositor->cursor_layer.link,
 		       &shell->lock_layer.link);
+	weston_compositor_stacking_dirty(shell->compositor);
 
 	launch_screensaver(shell);
 
+	if (shell->child.desktop_shell)
+		desktop_shell_send_idle(shell->child.desktop_shell, 1);
+
 	/* TODO: disable bindings that should not work while locked. */
 
 	/* All this must be undone in resume_desktop(). */
@@ -2940,16 +3133,13 @@ unlock(struct desktop_shell *shell)
 }
 
 static void
-shell_fade_done(struct weston_surface_animation *animation, void *data)
+shell_fade_done(struct desktop_shell *shell)
 {
-	struct desktop_shell *shell = data;
-
-	shell->fade.animation = NULL;
+	wl_list_remove(&shell->fade.animation.link);
+	wl_list_init(&shell->fade.animation.link);
 
 	switch (shell->fade.type) {
 	case FADE_IN:
-		weston_surface_destroy(shell->fade.surface);
-		shell->fade.surface = NULL;
 		break;
 	case FADE_OUT:
 		lock(shell);
@@ -2957,11 +3147,36 @@ shell_fade_done(struct weston_surface_animation *animation, void *data)
 	}
 }
 
+static void
+shell_fade_frame(struct weston_animation *animation,
+		 struct weston_output *output, uint32_t msecs)
+{
+	struct desktop_shell *shell =
+		container_of(animation, struct desktop_shell, fade.animation);
+
+	if (animation->frame_counter <= 1)
+		shell->fade.spring.timestamp = msecs;
+
+	weston_spring_update(&shell->fade.spring, msecs);
+
+	if (weston_spring_done(&shell->fade.spring)) {
+		weston_compositor_fade(shell->compositor,
+				       shell->fade.spring.target);
+		shell_fade_done(shell);
+		return;
+	}
+
+	weston_compositor_fade(shell->compositor, shell->fade.spring.current);
+	weston_compositor_schedule_repaint(shell->compositor);
+}
+
+/* The fade is the compositor's, which the backend or renderer apply
+ * for the whole output; the shell only animates its level. */
 static void
 shell_fade(struct desktop_shell *shell, enum fade_type type)
 {
 	struct weston_compositor *compositor = shell->compositor;
-	struct weston_surface *surface;
+	struct weston_output *output;
 	float tint;
 
 	switch (type) {
@@ -2977,30 +3192,23 @@ shell_fade(struct desktop_shell *shell, enum fade_type type)
 	}
 
 	shell->fade.type = type;
+	weston_spring_init(&shell->fade.spring, 30.0, compositor->fade, tint);
 
-	if (shell->fade.surface == NULL) {
-		surface = weston_surface_create(compositor);
-		if (!surface)
-			return;
+	if (!wl_list_empty(&shell->fade.animation.link))
+		return;
 
-		weston_surface_configure(surface, 0, 0, 8192, 8192);
-		weston_surface_set_color(surface, 0.0, 0.0, 0.0, 1.0);
-		surface->alpha = 1.0 - tint;
-		wl_list_insert(&compositor->fade_layer.surface_list,
-			       &surface->layer_link);
-		weston_surface_update_transform(surface);
-		shell->fade.surface = surface;
-		pixman_region32_init(&surface->input);
+	if (compositor->fade == tint ||
+	    wl_list_empty(&compositor->output_list)) {
+		weston_compositor_fade(compositor, tint);
+		shell_fade_done(shell);
+		return;
 	}
 
-	if (shell->fade.animation)
-		weston_fade_update(shell->fade.animation,
-				   shell->fade.surface->alpha, tint, 30.0);
-	else
-		shell->fade.animation =
-			weston_fade_run(shell->fade.surface,
-					1.0 - tint, tint, 30.0,
-					shell_fade_done, shell);
+	output = container_of(compositor->output_list.next,
+			      struct weston_output, link);
+	shell->fade.animation.frame_counter = 0;
+	wl_list_insert(&output->animation_list, &shell->fade.animation.link);
+	weston_compositor_schedule_repaint(compositor);
 }
 
 static void
@@ -3039,6 +3247,7 @@ show_input_panels(struct wl_listener *listener, void *data)
 	if (!shell->locked)
 		wl_list_insert(&shell->panel_layer.link,
 			       &shell->input_panel_layer.link);
+	weston_compositor_stacking_dirty(shell->compositor);
 
 	wl_list_for_each_safe(surface, next,
 			      &shell->input_panel.surfaces, link) {
@@ -3067,6 +3276,7 @@ hide_input_panels(struct wl_listener *listener, void *data)
 
 	if (!shell->locked)
 		wl_list_remove(&shell->input_panel_layer.link);
+	weston_compositor_stacking_dirty(shell->compositor);
 
 	wl_list_for_each_safe(surface, next,
 			      &shell->input_panel_layer.surface_list, layer_link)
@@ -3206,6 +3416,7 @@ map(struct desktop_shell *shell, struct weston_surface *surface,
 		wl_list_insert(&ws->layer.surface_list, &surface->layer_link);
 		break;
 	}
+	weston_compositor_stacking_dirty(shell->compositor);
 
 	if (surface_type != SHELL_SURFACE_NONE) {
 		weston_surface_update_transform(surface);
@@ -3292,6 +3503,17 @@ shell_surface_configure(struct weston_surface *es, int32_t sx, int32_t sy, int32
 
 	int type_changed = 0;
 
+	if (shsurf->resize_configure.waiting) {
+		shsurf->resize_configure.waiting = 0;
+		if (shsurf->resize_configure.pending) {
+			shsurf->resize_configure.pending = 0;
+			shell_surface_send_resize_configure(shsurf,
+				shsurf->resize_configure.edges,
+				shsurf->resize_configure.width,
+				shsurf->resize_configure.height);
+		}
+	}
+
 	if (!weston_surface_is_mapped(es) && !wl_list_empty(&shsurf->popup.grab_link)) {
 		remove_popup_grab(shsurf);
 	}
@@ -3427,9 +3649,11 @@ screensaver_configure(struct weston_surface *surface, int32_t sx, int32_t sy, in
 	if (wl_list_empty(&surface->layer_link)) {
 		wl_list_insert(shell->lock_layer.surface_list.prev,
 			       &surface->layer_link);
+		weston_compositor_stacking_dirty(shell->compositor);
 		weston_surface_update_transform(surface);
-		wl_event_source_timer_update(shell->screensaver.timer,
-					     shell->screensaver.duration);
+		weston_timer_arm(shell->compositor->timer_wheel,
+				 &shell->screensaver.timer,
+				 shell->screensaver.duration);
 		shell_fade(shell, FADE_IN);
 	}
 }
@@ -4023,6 +4247,49 @@ workspace_down_binding(struct wl_seat *seat, uint32_t time,
 	change_workspace(shell, new_index);
 }
 
+/* A vertical three finger swipe moves to the workspace above or below,
+ * the way scrolling moves the content. */
+#define WORKSPACE_SWIPE_DISTANCE 100.0
+
+static void
+gesture_handler(struct wl_listener *listener, void *data)
+{
+	struct desktop_shell *shell =
+		container_of(listener, struct desktop_shell, gesture_listener);
+	struct weston_gesture_event *event = data;
+	unsigned int new_index = shell->workspaces.current;
+	double dx, dy;
+
+	if (event->type != WESTON_GESTURE_SWIPE || event->fingers < 3)
+		return;
+
+	switch (event->state) {
+	case WESTON_GESTURE_BEGIN:
+		shell->workspaces.swipe_dx = 0.0;
+		shell->workspaces.swipe_dy = 0.0;
+		return;
+	case WESTON_GESTURE_UPDATE:
+		shell->workspaces.swipe_dx += wl_fixed_to_double(event->dx);
+		shell->workspaces.swipe_dy += wl_fixed_to_double(event->dy);
+		return;
+	case WESTON_GESTURE_END:
+		break;
+	}
+
+	dx = shell->workspaces.swipe_dx;
+	dy = shell->workspaces.swipe_dy;
+	if (shell->locked || fabs(dy) < WORKSPACE_SWIPE_DISTANCE ||
+	    fabs(dy) < fabs(dx))
+		return;
+
+	if (dy < 0 && new_index < shell->workspaces.num - 1)
+		new_index++;
+	else if (dy > 0 && new_index != 0)
+		new_index--;
+
+	change_workspace(shell, new_index);
+}
+
 static void
 workspace_f_binding(struct wl_seat *seat, uint32_t time,
 		    uint32_t key, void *data)
@@ -4078,6 +4345,8 @@ shell_destroy(struct wl_listener *listener, void *data)
 		container_of(listener, struct desktop_shell, destroy_listener);
 	struct workspace **ws;
 
+	weston_timer_disarm(&shell->screensaver.timer);
+	wl_list_remove(&shell->fade.animation.link);
 	if (shell->child.client)
 		wl_client_destroy(shell->child.client);
 
@@ -4085,6 +4354,8 @@ shell_destroy(struct wl_listener *listener, void *data)
 	wl_list_remove(&shell->wake_listener.link);
 	wl_list_remove(&shell->show_input_panel_listener.link);
 	wl_list_remove(&shell->hide_input_panel_listener.link);
+	wl_list_remove(&shell->gesture_listener.link);
+	wl_list_remove(&shell->config_listener.link);
 
 	wl_array_for_each(ws, &shell->workspaces.array)
 		workspace_destroy(*ws);
@@ -4194,6 +4465,10 @@ module_init(struct weston_compositor *ec,
 	wl_signal_add(&ec->show_input_panel_signal, &shell->show_input_panel_listener);
 	shell->hide_input_panel_listener.notify = hide_input_panels;
 	wl_signal_add(&ec->hide_input_panel_signal, &shell->hide_input_panel_listener);
+	shell->gesture_listener.notify = gesture_handler;
+	wl_signal_add(&ec->gesture_signal, &shell->gesture_listener);
+	shell->config_listener.notify = shell_config_reloaded;
+	wl_signal_add(&ec->config_signal, &shell->config_listener);
 	ec->ping_handler = ping_handler;
 	ec->shell_interface.shell = shell;
 	ec->shell_interface.create_shell_surface = create_shell_surface;
@@ -4257,14 +4532,17 @@ module_init(struct weston_compositor *ec,
 	loop = wl_display_get_event_loop(ec->wl_display);
 	wl_event_loop_add_idle(loop, launch_desktop_shell_process, shell);
 
-	shell->screensaver.timer =
-		wl_event_loop_add_timer(loop, screensaver_timeout, shell);
+	weston_timer_init(&shell->screensaver.timer,
+			  screensaver_timeout, shell);
 
 	wl_list_for_each(seat, &ec->seat_list, link)
 		create_pointer_focus_listener(seat);
 
 	shell_add_bindings(ec, shell);
 
+	shell->fade.animation.frame = shell_fade_frame;
+	wl_list_init(&shell->fade.animation.link);
+	weston_compositor_fade(ec, 1.0);
 	shell_fade(shell, FADE_IN);
 
 	return 0;
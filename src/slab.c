@@ -0,0 +1,115 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "compositor.h"
+
+#define SLAB_CHUNK_SIZE 4096
+
+/* Every slab, for weston_slab_totals(). */
+static struct wl_list slab_list = { &slab_list, &slab_list };
+
+/* Does nothing on a slab set up already, so one defined static may
+ * be initialized wherever it is first needed. */
+WL_EXPORT void
+weston_slab_init(struct weston_slab *slab, size_t size)
+{
+	if (slab->link.next)
+		return;
+
+	/* room for the free list link, and its alignment */
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	slab->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	slab->free_list = NULL;
+	slab->allocs = 0;
+	slab->live = 0;
+	slab->chunks = 0;
+
+	wl_list_insert(&slab_list, &slab->link);
+}
+
+static int
+slab_grow(struct weston_slab *slab)
+{
+	unsigned int i, count;
+	char *chunk;
+
+	count = SLAB_CHUNK_SIZE / slab->size;
+	if (count == 0)
+		count = 1;
+
+	chunk = malloc(count * slab->size);
+	if (chunk == NULL)
+		return -1;
+
+	/* thread the objects in address order */
+	for (i = count; i-- > 0; ) {
+		*(void **) (chunk + i * slab->size) = slab->free_list;
+		slab->free_list = chunk + i * slab->size;
+	}
+	slab->chunks++;
+
+	return 0;
+}
+
+WL_EXPORT void *
+weston_slab_alloc(struct weston_slab *slab)
+{
+	void *object;
+
+	if (slab->free_list == NULL && slab_grow(slab) < 0)
+		return NULL;
+
+	object = slab->free_list;
+	slab->free_list = *(void **) object;
+	slab->allocs++;
+	slab->live++;
+
+	return object;
+}
+
+WL_EXPORT void
+weston_slab_free(struct weston_slab *slab, void *object)
+{
+	if (object == NULL)
+		return;
+
+	/* most recently freed first, it is the most likely in cache */
+	*(void **) object = slab->free_list;
+	slab->free_list = object;
+	slab->live--;
+}
+
+WL_EXPORT void
+weston_slab_totals(uint32_t *allocs, uint32_t *live)
+{
+	struct weston_slab *slab;
+
+	*allocs = 0;
+	*live = 0;
+	wl_list_for_each(slab, &slab_list, link) {
+		*allocs += slab->allocs;
+		*live += slab->live;
+	}
+}
@@ -158,6 +158,7 @@ tablet_shell_surface_configure(struct weston_surface *surface,
 			       &surface->layer_link);
 	}
 
+	weston_compositor_stacking_dirty(surface->compositor);
 	weston_surface_update_transform(surface);
 }
 
@@ -23,8 +23,11 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <linux/input.h>
 
 #include "compositor.h"
+#include "trace.h"
 #include "text-server-protocol.h"
 #include "input-method-server-protocol.h"
 
@@ -42,6 +45,10 @@ struct text_model {
 	struct wl_surface *surface;
 
 	uint32_t input_panel_visible;
+
+	/* the surrounding text as last set or updated, for the input
+	 * methods that only take the whole of it */
+	char *surrounding_text;
 };
 
 struct text_model_factory {
@@ -66,6 +73,7 @@ struct input_method {
 	int focus_listener_initialized;
 
 	struct input_method_context *context;
+	uint32_t version;	/* of the input_method binding */
 
 	struct text_backend *text_backend;
 };
@@ -79,6 +87,21 @@ struct input_method_context {
 	struct wl_list link;
 
 	struct wl_resource *keyboard;
+
+	/* set_compose_only: keys only go to the input method while
+	 * composing, the keys pressed then are marked in im_keys so that
+	 * their releases go the same way. */
+	int compose_only;
+	int composing;
+	uint32_t im_keys[(KEY_MAX + 32) / 32];
+
+	/* when the last key went to the input method, usec, 0 once it
+	 * responded */
+	uint64_t key_sent;
+
+	/* the input method was sent a surrounding text that updates can
+	 * apply to */
+	int has_surrounding_text;
 };
 
 struct text_backend {
@@ -133,6 +156,7 @@ destroy_text_model(struct wl_resource *resource)
 	wl_list_for_each_safe(input_method, next, &text_model->input_methods, link)
 		deactivate_text_model(text_model, input_method);
 
+	free(text_model->surrounding_text);
 	free(text_model);
 }
 
@@ -146,9 +170,13 @@ text_model_set_surrounding_text(struct wl_client *client,
 	struct text_model *text_model = resource->data;
 	struct input_method *input_method, *next;
 
+	free(text_model->surrounding_text);
+	text_model->surrounding_text = strdup(text);
+
 	wl_list_for_each_safe(input_method, next, &text_model->input_methods, link) {
 		if (!input_method->context)
 			continue;
+		input_method->context->has_surrounding_text = 1;
 		input_method_context_send_surrounding_text(&input_method->context->resource,
 							   text,
 							   cursor,
@@ -156,6 +184,76 @@ text_model_set_surrounding_text(struct wl_client *client,
 	}
 }
 
+/* Applies an update to the surrounding text kept by the model.
+ * Returns -1 if it does not fit the text or there is none. */
+static int
+text_model_apply_update(struct text_model *text_model, uint32_t index,
+			uint32_t length, const char *text)
+{
+	char *old = text_model->surrounding_text, *new;
+	size_t old_len, text_len;
+
+	if (!old)
+		return -1;
+
+	old_len = strlen(old);
+	text_len = strlen(text);
+	if (index > old_len || length > old_len - index)
+		return -1;
+
+	new = malloc(old_len - length + text_len + 1);
+	if (!new)
+		return -1;
+
+	memcpy(new, old, index);
+	memcpy(new + index, text, text_len);
+	strcpy(new + index + text_len, old + index + length);
+
+	free(old);
+	text_model->surrounding_text = new;
+
+	return 0;
+}
+
+/* Version 2 input methods get the change as is, the others the whole
+ * text it makes. */
+static void
+text_model_update_surrounding_text(struct wl_client *client,
+				   struct wl_resource *resource,
+				   uint32_t index,
+				   uint32_t length,
+				   const char *text,
+				   uint32_t cursor,
+				   uint32_t anchor)
+{
+	struct text_model *text_model = resource->data;
+	struct input_method *input_method, *next;
+
+	/* ignored, like for the input methods, without a text set first */
+	if (text_model_apply_update(text_model, index, length, text) < 0) {
+		free(text_model->surrounding_text);
+		text_model->surrounding_text = NULL;
+	}
+
+	wl_list_for_each_safe(input_method, next, &text_model->input_methods, link) {
+		if (!input_method->context ||
+		    !input_method->context->has_surrounding_text)
+			continue;
+		if (input_method->version >= 2)
+			input_method_context_send_surrounding_text_update(&input_method->context->resource,
+									  index,
+									  length,
+									  text,
+									  cursor,
+									  anchor);
+		else if (text_model->surrounding_text)
+			input_method_context_send_surrounding_text(&input_method->context->resource,
+								   text_model->surrounding_text,
+								   cursor,
+								   anchor);
+	}
+}
+
 static void
 text_model_activate(struct wl_client *client,
 	            struct wl_resource *resource,
@@ -214,6 +312,7 @@ text_model_reset(struct wl_client *client,
 	wl_list_for_each_safe(input_method, next, &text_model->input_methods, link) {
 		if (!input_method->context)
 			continue;
+		input_method->context->composing = 0;
 		input_method_context_send_reset(&input_method->context->resource, serial);
 	}
 }
@@ -310,7 +409,8 @@ static const struct text_model_interface text_model_implementation = {
 	text_model_invoke_action,
 	text_model_commit,
 	text_model_show_input_panel,
-	text_model_hide_input_panel
+	text_model_hide_input_panel,
+	text_model_update_surrounding_text
 };
 
 static void text_model_factory_create_text_model(struct wl_client *client,
@@ -386,6 +486,29 @@ text_model_factory_create(struct weston_compositor *ec)
 	wl_signal_add(&ec->destroy_signal, &text_model_factory->destroy_listener);
 }
 
+static uint64_t
+input_method_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Traces the time from the last key sent to the input method to its
+ * first response, which is what the round trip adds to typing. */
+static void
+input_method_context_responded(struct input_method_context *context)
+{
+	if (context->key_sent == 0)
+		return;
+
+	WESTON_TRACE_INSTANT(WESTON_TRACE_INPUT, "input_method_latency",
+			     input_method_time() - context->key_sent);
+	context->key_sent = 0;
+}
+
 static void
 input_method_context_destroy(struct wl_client *client,
 			     struct wl_resource *resource)
@@ -401,6 +524,8 @@ input_method_context_commit_string(struct wl_client *client,
 {
 	struct input_method_context *context = resource->data;
 
+	input_method_context_responded(context);
+	context->composing = 0;
 	text_model_send_commit_string(&context->model->resource, serial, text);
 }
 
@@ -413,6 +538,9 @@ input_method_context_preedit_string(struct wl_client *client,
 {
 	struct input_method_context *context = resource->data;
 
+	input_method_context_responded(context);
+	if (text[0] == '\0')
+		context->composing = 0;
 	text_model_send_preedit_string(&context->model->resource, serial, text, commit);
 }
 
@@ -485,6 +613,7 @@ input_method_context_keysym(struct wl_client *client,
 {
 	struct input_method_context *context = resource->data;
 
+	input_method_context_responded(context);
 	text_model_send_keysym(&context->model->resource, serial, time,
 			       sym, state, modifiers);
 }
@@ -500,17 +629,77 @@ unbind_keyboard(struct wl_resource *resource)
 	free(resource);
 }
 
+static int
+keysym_starts_compose(xkb_keysym_t sym)
+{
+	return sym == XKB_KEY_Multi_key ||
+		(sym >= XKB_KEY_dead_grave && sym <= XKB_KEY_dead_currency) ||
+		(sym >= XKB_KEY_dead_a && sym <= XKB_KEY_dead_greek);
+}
+
+/* With set_compose_only, whether key goes to the input method rather
+ * than straight to the application. */
+static int
+input_method_context_wants_key(struct input_method_context *context,
+			       struct weston_seat *seat,
+			       uint32_t key, uint32_t state_w)
+{
+	uint32_t *word, bit;
+	xkb_keysym_t sym;
+
+	if (key > KEY_MAX)
+		return 1;
+
+	word = &context->im_keys[key / 32];
+	bit = 1u << (key % 32);
+
+	if (state_w == WL_KEYBOARD_KEY_STATE_RELEASED) {
+		if (!(*word & bit))
+			return 0;
+		*word &= ~bit;
+		return 1;
+	}
+
+	if (!context->composing) {
+		sym = xkb_state_key_get_one_sym(seat->xkb_state.state,
+						key + 8);
+		if (!keysym_starts_compose(sym))
+			return 0;
+		context->composing = 1;
+	}
+
+	*word |= bit;
+
+	return 1;
+}
+
 static void
 input_method_context_grab_key(struct wl_keyboard_grab *grab,
 			      uint32_t time, uint32_t key, uint32_t state_w)
 {
 	struct weston_keyboard *keyboard = (struct weston_keyboard *)grab->keyboard;
+	struct weston_seat *seat =
+		container_of(keyboard, struct weston_seat, keyboard);
+	struct input_method_context *context = seat->input_method->context;
+	struct wl_keyboard_grab *default_grab;
 	struct wl_display *display;
 	uint32_t serial;
 
 	if (!keyboard->input_method_resource)
 		return;
 
+	if (context && context->compose_only &&
+	    !input_method_context_wants_key(context, seat, key, state_w)) {
+		WESTON_TRACE_INSTANT(WESTON_TRACE_INPUT,
+				     "input_method_pass", key);
+		default_grab = &keyboard->keyboard.default_grab;
+		default_grab->interface->key(default_grab, time, key, state_w);
+		return;
+	}
+
+	if (context)
+		context->key_sent = input_method_time();
+
 	display = wl_client_get_display(keyboard->input_method_resource->client);
 	serial = wl_display_next_serial(display);
 	wl_keyboard_send_key(keyboard->input_method_resource,
@@ -523,6 +712,10 @@ input_method_context_grab_modifier(struct wl_keyboard_grab *grab, uint32_t seria
 				   uint32_t mods_locked, uint32_t group)
 {
 	struct weston_keyboard *keyboard = (struct weston_keyboard *)grab->keyboard;
+	struct weston_seat *seat =
+		container_of(keyboard, struct weston_seat, keyboard);
+	struct input_method_context *context = seat->input_method->context;
+	struct wl_keyboard_grab *default_grab;
 
 	if (!keyboard->input_method_resource)
 		return;
@@ -530,6 +723,14 @@ input_method_context_grab_modifier(struct wl_keyboard_grab *grab, uint32_t seria
 	wl_keyboard_send_modifiers(keyboard->input_method_resource,
 				   serial, mods_depressed, mods_latched,
 				   mods_locked, group);
+
+	if (context && context->compose_only) {
+		default_grab = &keyboard->keyboard.default_grab;
+		default_grab->interface->modifiers(default_grab, serial,
+						   mods_depressed,
+						   mods_latched,
+						   mods_locked, group);
+	}
 }
 
 static const struct wl_keyboard_grab_interface input_method_context_grab = {
@@ -577,6 +778,7 @@ input_method_context_key(struct wl_client *client,
 	struct wl_keyboard *keyboard = seat->seat.keyboard;
 	struct wl_keyboard_grab *default_grab = &keyboard->default_grab;
 
+	input_method_context_responded(context);
 	default_grab->interface->key(default_grab, time, key, state_w);
 }
 
@@ -601,6 +803,15 @@ input_method_context_modifiers(struct wl_client *client,
 					   group);
 }
 
+static void
+input_method_context_set_compose_only(struct wl_client *client,
+				      struct wl_resource *resource)
+{
+	struct input_method_context *context = resource->data;
+
+	context->compose_only = 1;
+}
+
 static const struct input_method_context_interface input_method_context_implementation = {
 	input_method_context_destroy,
 	input_method_context_commit_string,
@@ -613,7 +824,8 @@ static const struct input_method_context_interface input_method_context_implemen
 	input_method_context_keysym,
 	input_method_context_grab_keyboard,
 	input_method_context_key,
-	input_method_context_modifiers
+	input_method_context_modifiers,
+	input_method_context_set_compose_only
 };
 
 static void
@@ -705,6 +917,7 @@ bind_input_method(struct wl_client *client,
 	if (input_method->input_method_binding == NULL) {
 		resource->destroy = unbind_input_method;
 		input_method->input_method_binding = resource;
+		input_method->version = version;
 
 		text_backend->input_method.binding = resource;
 		return;
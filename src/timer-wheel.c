@@ -0,0 +1,338 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "compositor.h"
+
+/*
+ * Four levels of 64 slots with a 1 ms tick.  A timer goes into the
+ * lowest level whose span covers its timeout; the slots of the levels
+ * above are moved down a level whenever the level below wraps.  One
+ * bit per slot tells which are occupied, so long idle stretches are
+ * skipped a slot at a time and the next wake up is found without
+ * walking the timers.
+ */
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+#define WHEEL_SPAN	(1ull << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct weston_timer_wheel {
+	struct wl_event_source *source;
+	uint64_t now;		/* ms, every slot up to it has run */
+	uint64_t wake;		/* ms the timerfd is set to, 0 for none */
+	uint32_t count;
+	uint64_t occupied[WHEEL_LEVELS];
+	struct wl_list slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+static uint64_t
+wheel_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+wheel_insert(struct weston_timer_wheel *wheel, struct weston_timer *timer)
+{
+	uint64_t expires = timer->expires;
+	int level, slot;
+
+	/* only a cascade puts one into the slot about to run */
+	if (expires < wheel->now)
+		expires = wheel->now;
+	if (expires - wheel->now >= WHEEL_SPAN)
+		expires = wheel->now + WHEEL_SPAN - 1;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (expires - wheel->now <
+		    1ull << (WHEEL_BITS * (level + 1)))
+			break;
+
+	slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	timer->level = level;
+	timer->slot = slot;
+	wl_list_insert(wheel->slots[level][slot].prev, &timer->link);
+	wheel->occupied[level] |= 1ull << slot;
+}
+
+static void
+wheel_remove(struct weston_timer_wheel *wheel, struct weston_timer *timer)
+{
+	wl_list_remove(&timer->link);
+	wl_list_init(&timer->link);
+	if (wl_list_empty(&wheel->slots[timer->level][timer->slot]))
+		wheel->occupied[timer->level] &= ~(1ull << timer->slot);
+}
+
+/* Moves the timers in slot of level into list. */
+static void
+wheel_take_slot(struct weston_timer_wheel *wheel, int level, int slot,
+		struct wl_list *list)
+{
+	struct wl_list *head = &wheel->slots[level][slot];
+
+	wl_list_init(list);
+	if (wl_list_empty(head))
+		return;
+
+	wl_list_insert_list(list, head);
+	wl_list_init(head);
+	wheel->occupied[level] &= ~(1ull << slot);
+}
+
+/* Distance from slot to the next occupied slot of level after it,
+ * 1 to WHEEL_SIZE, or 0 if the level is empty. */
+static int
+wheel_next_slot(struct weston_timer_wheel *wheel, int level, int slot)
+{
+	uint64_t bits = wheel->occupied[level];
+	int shift = (slot + 1) & WHEEL_MASK;
+
+	if (bits == 0)
+		return 0;
+
+	bits = (bits >> shift) | (shift ? bits << (WHEEL_SIZE - shift) : 0);
+
+	return __builtin_ctzll(bits) + 1;
+}
+
+/* The earliest tick at which a slot has to be looked at: the next
+ * occupied slot of level 0, or the next cascade of an occupied slot
+ * of a level above, whichever comes first. */
+static uint64_t
+wheel_next_tick(struct weston_timer_wheel *wheel)
+{
+	int level, shift, distance;
+	uint64_t index, tick, next = 0;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		shift = WHEEL_BITS * level;
+		index = wheel->now >> shift;
+		distance = wheel_next_slot(wheel, level, index & WHEEL_MASK);
+		if (distance == 0)
+			continue;
+
+		tick = (index + distance) << shift;
+		if (next == 0 || tick < next)
+			next = tick;
+	}
+
+	return next;
+}
+
+static void
+wheel_update_source(struct weston_timer_wheel *wheel)
+{
+	uint64_t next, time;
+
+	if (wheel->count == 0)
+		return;
+
+	next = wheel_next_tick(wheel);
+	if (wheel->wake && wheel->wake <= next)
+		return;
+
+	time = wheel_time();
+	wheel->wake = next;
+	wl_event_source_timer_update(wheel->source,
+				     next > time ? next - time : 1);
+}
+
+static void
+wheel_cascade(struct weston_timer_wheel *wheel)
+{
+	struct weston_timer *timer, *next;
+	struct wl_list list;
+	int level, slot;
+
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		slot = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+		wheel_take_slot(wheel, level, slot, &list);
+		wl_list_for_each_safe(timer, next, &list, link)
+			wheel_insert(wheel, timer);
+		if (slot != 0)
+			break;
+	}
+}
+
+static void
+wheel_run_slot(struct weston_timer_wheel *wheel)
+{
+	struct weston_timer *timer;
+	struct wl_list list;
+
+	wheel_take_slot(wheel, 0, wheel->now & WHEEL_MASK, &list);
+
+	/* A handler may arm or disarm any timer, this list included. */
+	while (!wl_list_empty(&list)) {
+		timer = container_of(list.next, struct weston_timer, link);
+		wl_list_remove(&timer->link);
+		wl_list_init(&timer->link);
+
+		if (timer->expires > wheel->now) {
+			/* clamped to the span of the wheel */
+			wheel_insert(wheel, timer);
+			continue;
+		}
+
+		timer->wheel = NULL;
+		wheel->count--;
+		timer->func(timer->data);
+	}
+}
+
+static void
+wheel_advance(struct weston_timer_wheel *wheel, uint64_t time)
+{
+	uint64_t next;
+
+	while (wheel->now < time && wheel->count > 0) {
+		next = wheel_next_tick(wheel);
+		if (next > time) {
+			wheel->now = time;
+			break;
+		}
+
+		/* every slot in between is empty */
+		wheel->now = next;
+		if ((wheel->now & WHEEL_MASK) == 0)
+			wheel_cascade(wheel);
+		wheel_run_slot(wheel);
+	}
+
+	if (wheel->count == 0)
+		wheel->now = time;
+}
+
+static int
+wheel_timer_handler(void *data)
+{
+	struct weston_timer_wheel *wheel = data;
+
+	wheel->wake = 0;
+	wheel_advance(wheel, wheel_time());
+	wheel_update_source(wheel);
+
+	return 1;
+}
+
+WL_EXPORT struct weston_timer_wheel *
+weston_timer_wheel_create(struct wl_event_loop *loop)
+{
+	struct weston_timer_wheel *wheel;
+	int i, j;
+
+	wheel = calloc(1, sizeof *wheel);
+	if (wheel == NULL)
+		return NULL;
+
+	for (i = 0; i < WHEEL_LEVELS; i++)
+		for (j = 0; j < WHEEL_SIZE; j++)
+			wl_list_init(&wheel->slots[i][j]);
+
+	wheel->now = wheel_time();
+	wheel->source = wl_event_loop_add_timer(loop, wheel_timer_handler,
+						wheel);
+	if (wheel->source == NULL) {
+		free(wheel);
+		return NULL;
+	}
+
+	return wheel;
+}
+
+/* Timers still armed are left disarmed. */
+WL_EXPORT void
+weston_timer_wheel_destroy(struct weston_timer_wheel *wheel)
+{
+	struct weston_timer *timer, *next;
+	int i, j;
+
+	for (i = 0; i < WHEEL_LEVELS; i++)
+		for (j = 0; j < WHEEL_SIZE; j++)
+			wl_list_for_each_safe(timer, next,
+					      &wheel->slots[i][j], link) {
+				wl_list_init(&timer->link);
+				timer->wheel = NULL;
+			}
+
+	wl_event_source_remove(wheel->source);
+	free(wheel);
+}
+
+WL_EXPORT void
+weston_timer_init(struct weston_timer *timer,
+		  weston_timer_func_t func, void *data)
+{
+	wl_list_init(&timer->link);
+	timer->wheel = NULL;
+	timer->func = func;
+	timer->data = data;
+}
+
+WL_EXPORT void
+weston_timer_disarm(struct weston_timer *timer)
+{
+	if (timer->wheel == NULL)
+		return;
+
+	wheel_remove(timer->wheel, timer);
+	timer->wheel->count--;
+	timer->wheel = NULL;
+}
+
+/* Runs func msecs from now, once; 0 disarms the timer like it does
+ * for wl_event_source_timer_update(). */
+WL_EXPORT void
+weston_timer_arm(struct weston_timer_wheel *wheel,
+		 struct weston_timer *timer, uint32_t msecs)
+{
+	uint64_t time;
+
+	weston_timer_disarm(timer);
+	if (msecs == 0)
+		return;
+
+	time = wheel_time();
+	if (wheel->count == 0)
+		wheel->now = time;
+
+	timer->expires = time + msecs;
+	timer->wheel = wheel;
+	wheel->count++;
+	wheel_insert(wheel, timer);
+	wheel_update_source(wheel);
+}
+
+WL_EXPORT int
+weston_timer_is_armed(struct weston_timer *timer)
+{
+	return timer->wheel != NULL;
+}
@@ -0,0 +1,228 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/input.h>
+
+#include "compositor.h"
+#include "trace.h"
+#include "../shared/os-compatibility.h"
+
+#ifdef ENABLE_TRACING
+
+/* must be a power of two */
+#define TRACE_RING_LENGTH 65536
+
+/*
+ * The ring is a flight recorder: slots are claimed with an atomic
+ * increment and the oldest events are overwritten.  seq is stored
+ * last, so the dump can skip a slot that is being rewritten under it.
+ */
+struct trace_event {
+	uint64_t time;		/* CLOCK_MONOTONIC, ns */
+	const char *name;
+	uint32_t arg;
+	uint32_t seq;
+	int32_t tid;
+	uint8_t category;
+	char phase;
+};
+
+WL_EXPORT uint32_t weston_trace_categories;
+
+static struct trace_event trace_ring[TRACE_RING_LENGTH];
+static uint32_t trace_pos;
+static int trace_dumps;
+
+static __thread int32_t trace_tid;
+
+static const struct {
+	const char *name;
+	uint32_t category;
+} trace_category_names[] = {
+	{ "surface", WESTON_TRACE_SURFACE },
+	{ "repaint", WESTON_TRACE_REPAINT },
+	{ "plane", WESTON_TRACE_PLANE },
+	{ "flip", WESTON_TRACE_FLIP },
+	{ "input", WESTON_TRACE_INPUT },
+	{ "xwayland", WESTON_TRACE_XWAYLAND },
+};
+
+WL_EXPORT void
+weston_trace_event(uint32_t category, char phase,
+		   const char *name, uint32_t arg)
+{
+	struct trace_event *ev;
+	struct timespec ts;
+	uint32_t pos;
+
+	if (trace_tid == 0)
+		trace_tid = syscall(SYS_gettid);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	pos = __atomic_fetch_add(&trace_pos, 1, __ATOMIC_RELAXED);
+	ev = &trace_ring[pos & (TRACE_RING_LENGTH - 1)];
+	__atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+	ev->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	ev->name = name;
+	ev->arg = arg;
+	ev->tid = trace_tid;
+	ev->category = category;
+	ev->phase = phase;
+	__atomic_store_n(&ev->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static const char *
+trace_category_name(uint32_t category)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(trace_category_names); i++)
+		if (trace_category_names[i].category == category)
+			return trace_category_names[i].name;
+
+	return "weston";
+}
+
+static int
+trace_dump(const char *filename)
+{
+	struct trace_event *ev;
+	uint32_t end, pos, count = 0;
+	const char *sep = "";
+	FILE *fp;
+	pid_t pid;
+
+	fp = fopen(filename, "w");
+	if (!fp)
+		return -1;
+
+	pid = getpid();
+	end = __atomic_load_n(&trace_pos, __ATOMIC_ACQUIRE);
+	pos = end > TRACE_RING_LENGTH ? end - TRACE_RING_LENGTH : 0;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (; pos != end; pos++) {
+		ev = &trace_ring[pos & (TRACE_RING_LENGTH - 1)];
+		if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			continue;
+
+		fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"%s\","
+			"\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,"
+			"\"tid\":%d", sep, ev->name,
+			trace_category_name(ev->category), ev->phase,
+			(unsigned long long) (ev->time / 1000),
+			(unsigned int) (ev->time % 1000), pid, ev->tid);
+		if (ev->phase == 'i')
+			fprintf(fp, ",\"s\":\"t\",\"args\":{\"arg\":%u}",
+				ev->arg);
+		fprintf(fp, "}");
+		sep = ",";
+		count++;
+	}
+	fprintf(fp, "\n]}\n");
+
+	if (fclose(fp) != 0)
+		return -1;
+
+	return count;
+}
+
+static void
+trace_debug_binding(struct wl_seat *seat, uint32_t time, uint32_t key,
+		    void *data)
+{
+	char filename[64];
+	int count;
+
+	if (weston_trace_categories == 0) {
+		weston_trace_categories = ~0u;
+		weston_log("tracing all categories\n");
+		return;
+	}
+
+	snprintf(filename, sizeof filename, "weston-trace-%d-%d.json",
+		 getpid(), trace_dumps++);
+	count = trace_dump(filename);
+	if (count < 0)
+		weston_log("failed to write trace to %s: %m\n", filename);
+	else
+		weston_log("wrote %d trace events to %s\n", count, filename);
+}
+
+static void
+trace_parse_categories(const char *spec)
+{
+	const char *p, *end;
+	unsigned int i;
+	size_t len;
+
+	if (strcmp(spec, "all") == 0) {
+		weston_trace_categories = ~0u;
+		return;
+	}
+
+	for (p = spec; *p; p = *end ? end + 1 : end) {
+		end = strchrnul(p, ',');
+		len = end - p;
+		for (i = 0; i < ARRAY_LENGTH(trace_category_names); i++)
+			if (strlen(trace_category_names[i].name) == len &&
+			    strncmp(trace_category_names[i].name, p, len) == 0)
+				break;
+		if (i == ARRAY_LENGTH(trace_category_names)) {
+			weston_log("unknown trace category '%.*s'\n",
+				   (int) len, p);
+			continue;
+		}
+		weston_trace_categories |= trace_category_names[i].category;
+	}
+}
+
+void
+weston_trace_init(struct weston_compositor *ec)
+{
+	const char *spec;
+
+	spec = getenv("WESTON_TRACE");
+	if (spec)
+		trace_parse_categories(spec);
+
+	weston_compositor_add_debug_binding(ec, KEY_J,
+					    trace_debug_binding, ec);
+}
+
+#else
+
+void
+weston_trace_init(struct weston_compositor *ec)
+{
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _WESTON_TRACE_H_
+#define _WESTON_TRACE_H_
+
+#include <stdint.h>
+
+#include <config.h>
+
+/*
+ * Trace points record into an in-memory ring that the mod+shift+space, J
+ * debug binding writes out as a Chrome trace event file, which
+ * chrome://tracing and Perfetto load.
+ *
+ * Without --enable-tracing the macros compile to nothing.  With it, a
+ * trace point whose category is not active costs one test of
+ * weston_trace_categories.  WESTON_TRACE=all or a comma separated list
+ * of category names activates categories at start up; the binding
+ * activates all of them when none are.
+ *
+ * Names must be string literals, only the pointer is recorded.
+ */
+enum weston_trace_category {
+	WESTON_TRACE_SURFACE	= (1 << 0),
+	WESTON_TRACE_REPAINT	= (1 << 1),
+	WESTON_TRACE_PLANE	= (1 << 2),
+	WESTON_TRACE_FLIP	= (1 << 3),
+	WESTON_TRACE_INPUT	= (1 << 4),
+	WESTON_TRACE_XWAYLAND	= (1 << 5),
+};
+
+#ifdef ENABLE_TRACING
+
+extern uint32_t weston_trace_categories;
+
+void
+weston_trace_event(uint32_t category, char phase,
+		   const char *name, uint32_t arg);
+
+#define WESTON_TRACE(cat, phase, name, arg)				\
+	do {								\
+		if (__builtin_expect(weston_trace_categories & (cat), 0)) \
+			weston_trace_event((cat), (phase), (name), (arg)); \
+	} while (0)
+
+#else
+
+#define WESTON_TRACE(cat, phase, name, arg) do { } while (0)
+
+#endif
+
+/* a duration, begin and end must nest on the same thread */
+#define WESTON_TRACE_BEGIN(cat, name)	WESTON_TRACE(cat, 'B', name, 0)
+#define WESTON_TRACE_END(cat, name)	WESTON_TRACE(cat, 'E', name, 0)
+/* a point in time, with one integer argument */
+#define WESTON_TRACE_INSTANT(cat, name, arg) \
+	WESTON_TRACE(cat, 'i', name, arg)
+
+struct weston_compositor;
+
+void
+weston_trace_init(struct weston_compositor *ec);
+
+#endif
@@ -24,6 +24,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 
 #include "compositor.h"
 #include "launcher-util.h"
@@ -33,35 +36,54 @@
 static const char default_seat[] = "seat0";
 
 static int
-device_added(struct udev_device *udev_device, struct udev_seat *master)
+device_on_seat(struct udev_device *udev_device, struct udev_seat *master)
 {
-	struct weston_compositor *c;
-	struct evdev_device *device;
-	const char *devnode;
 	const char *device_seat;
-	const char *calibration_values;
-	int fd;
 
 	device_seat = udev_device_get_property_value(udev_device, "ID_SEAT");
 	if (!device_seat)
 		device_seat = default_seat;
 
-	if (strcmp(device_seat, master->seat_id))
+	return strcmp(device_seat, master->seat_id) == 0;
+}
+
+/* Use non-blocking mode so that we can loop on read on
+ * evdev_device_data() until all events on the fd are read.  mtdev_get()
+ * also expects this. */
+#define DEVICE_OPEN_FLAGS (O_RDWR | O_NONBLOCK)
+
+/* Takes fd, opened with DEVICE_OPEN_FLAGS, or opens the device itself
+ * if it is -1, and probes it unless that was done already. */
+static int
+device_added(struct udev_device *udev_device, struct udev_seat *master,
+	     int fd, struct evdev_probe *probe)
+{
+	struct weston_compositor *c;
+	struct evdev_device *device;
+	const char *devnode;
+	const char *calibration_values;
+
+	if (!device_on_seat(udev_device, master)) {
+		if (fd >= 0)
+			close(fd);
 		return 0;
+	}
 
 	c = master->base.compositor;
 	devnode = udev_device_get_devnode(udev_device);
 
-	/* Use non-blocking mode so that we can loop on read on
-	 * evdev_device_data() until all events on the fd are
-	 * read.  mtdev_get() also expects this. */
-	fd = weston_launcher_open(c, devnode, O_RDWR | O_NONBLOCK);
+	if (fd < 0)
+		fd = weston_launcher_open(c, devnode, DEVICE_OPEN_FLAGS);
 	if (fd < 0) {
 		weston_log("opening input device '%s' failed.\n", devnode);
 		return -1;
 	}
 
-	device = evdev_device_create(&master->base, devnode, fd);
+	if (probe)
+		device = evdev_device_create_probed(&master->base, devnode,
+						    fd, probe);
+	else
+		device = evdev_device_create(&master->base, devnode, fd);
 	if (device == EVDEV_UNHANDLED_DEVICE) {
 		close(fd);
 		weston_log("not using input device '%s'.\n", devnode);
@@ -99,37 +121,83 @@ device_added(struct udev_device *udev_device, struct udev_seat *master)
 	return 0;
 }
 
+/* All devices of the seat are opened in one go, which through
+ * weston-launch is one round trip rather than one per device. */
 static int
 udev_seat_add_devices(struct udev_seat *seat, struct udev *udev)
 {
 	struct udev_enumerate *e;
 	struct udev_list_entry *entry;
-	struct udev_device *device;
-	const char *path, *sysname;
+	struct udev_device *device, **devices;
+	struct wl_array array;
+	const char *path, *sysname, **devnodes = NULL;
+	int *fds = NULL;
+	int i, count, opened, ret = 0;
 
+	wl_array_init(&array);
 	e = udev_enumerate_new(udev);
 	udev_enumerate_add_match_subsystem(e, "input");
 	udev_enumerate_scan_devices(e);
 	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(e)) {
 		path = udev_list_entry_get_name(entry);
 		device = udev_device_new_from_syspath(udev, path);
+		if (!device)
+			continue;
 
 		sysname = udev_device_get_sysname(device);
-		if (strncmp("event", sysname, 5) != 0) {
+		if (strncmp("event", sysname, 5) != 0 ||
+		    !udev_device_get_devnode(device) ||
+		    !device_on_seat(device, seat)) {
 			udev_device_unref(device);
 			continue;
 		}
 
-		if (device_added(device, seat) < 0) {
+		devices = wl_array_add(&array, sizeof *devices);
+		if (!devices) {
 			udev_device_unref(device);
-			udev_enumerate_unref(e);
-			return -1;
+			ret = -1;
+			break;
 		}
-
-		udev_device_unref(device);
+		*devices = device;
 	}
 	udev_enumerate_unref(e);
 
+	devices = array.data;
+	count = array.size / sizeof *devices;
+	if (ret == 0 && count > 0) {
+		devnodes = malloc(count * sizeof *devnodes);
+		fds = malloc(count * sizeof *fds);
+		if (!devnodes || !fds)
+			ret = -1;
+	}
+
+	if (ret == 0 && count > 0) {
+		for (i = 0; i < count; i++)
+			devnodes[i] = udev_device_get_devnode(devices[i]);
+		ret = weston_launcher_open_batch(seat->base.compositor,
+						 devnodes, count,
+						 DEVICE_OPEN_FLAGS, fds);
+	}
+
+	/* Devices the batch failed to open are tried once more on their
+	 * own by device_added(). */
+	opened = ret == 0;
+	for (i = 0; i < count; i++) {
+		if (ret == 0 &&
+		    device_added(devices[i], seat, fds[i], NULL) < 0)
+			ret = -1;
+		else if (ret < 0 && opened && fds[i] >= 0)
+			close(fds[i]);
+		udev_device_unref(devices[i]);
+	}
+
+	free(devnodes);
+	free(fds);
+	wl_array_release(&array);
+
+	if (ret < 0)
+		return -1;
+
 	evdev_notify_keyboard_focus(&seat->base, &seat->devices_list);
 
 	if (wl_list_empty(&seat->devices_list)) {
@@ -145,12 +213,138 @@ udev_seat_add_devices(struct udev_seat *seat, struct udev *udev)
 	return 0;
 }
 
+/*
+ * A hotplugged device is opened on the main loop, which through
+ * weston-launch is one round trip, but its ioctls and mtdev setup,
+ * slow for some devices, run on a thread of their own.  Devices are
+ * created from the probes in the order these finish.
+ */
+struct udev_seat_probe {
+	struct wl_list link;		/* udev_seat::probe_list */
+	struct udev_seat *seat;
+	struct udev_device *device;
+	int fd;
+	pthread_t thread;
+	struct evdev_probe probe;
+	int done;			/* set by the thread, atomically */
+	int removed;
+};
+
+static void *
+udev_seat_probe_run(void *data)
+{
+	struct udev_seat_probe *probe = data;
+	uint64_t one = 1;
+	sigset_t mask;
+
+	/* Leave all signal handling to the main thread's signalfds. */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	evdev_device_probe(probe->fd, &probe->probe);
+	__atomic_store_n(&probe->done, 1, __ATOMIC_RELEASE);
+
+	if (write(probe->seat->probe_fd, &one, sizeof one) < 0)
+		weston_log("failed to wake compositor after probe: %m\n");
+
+	return NULL;
+}
+
+static void
+udev_seat_probe_destroy(struct udev_seat_probe *probe)
+{
+	wl_list_remove(&probe->link);
+	udev_device_unref(probe->device);
+	free(probe);
+}
+
+/* Drops the probes still running, with their fds. */
+static void
+udev_seat_cancel_probes(struct udev_seat *seat)
+{
+	struct udev_seat_probe *probe, *next;
+
+	wl_list_for_each_safe(probe, next, &seat->probe_list, link) {
+		pthread_join(probe->thread, NULL);
+		evdev_probe_release(&probe->probe);
+		close(probe->fd);
+		udev_seat_probe_destroy(probe);
+	}
+}
+
+static int
+udev_seat_probe_done(int fd, uint32_t mask, void *data)
+{
+	struct udev_seat *seat = data;
+	struct udev_seat_probe *probe, *next;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) != sizeof count)
+		return 1;
+
+	wl_list_for_each_safe(probe, next, &seat->probe_list, link) {
+		if (!__atomic_load_n(&probe->done, __ATOMIC_ACQUIRE))
+			continue;
+
+		pthread_join(probe->thread, NULL);
+		if (probe->removed)
+			close(probe->fd);
+		else
+			device_added(probe->device, seat, probe->fd,
+				     &probe->probe);
+		evdev_probe_release(&probe->probe);
+		udev_seat_probe_destroy(probe);
+	}
+
+	return 1;
+}
+
+static void
+device_probe_start(struct udev_device *udev_device, struct udev_seat *seat)
+{
+	struct udev_seat_probe *probe;
+	const char *devnode;
+	int fd;
+
+	if (!device_on_seat(udev_device, seat))
+		return;
+
+	devnode = udev_device_get_devnode(udev_device);
+	fd = weston_launcher_open(seat->base.compositor, devnode,
+				  DEVICE_OPEN_FLAGS);
+	if (fd < 0) {
+		weston_log("opening input device '%s' failed.\n", devnode);
+		return;
+	}
+
+	probe = calloc(1, sizeof *probe);
+	if (probe == NULL) {
+		close(fd);
+		return;
+	}
+
+	probe->seat = seat;
+	probe->device = udev_device_ref(udev_device);
+	probe->fd = fd;
+	if (seat->probe_source == NULL ||
+	    pthread_create(&probe->thread, NULL,
+			   udev_seat_probe_run, probe) != 0) {
+		udev_device_unref(probe->device);
+		free(probe);
+		device_added(udev_device, seat, fd, NULL);
+		return;
+	}
+
+	wl_list_insert(seat->probe_list.prev, &probe->link);
+}
+
 static int
 evdev_udev_handler(int fd, uint32_t mask, void *data)
 {
 	struct udev_seat *seat = data;
 	struct udev_device *udev_device;
 	struct evdev_device *device, *next;
+	struct udev_seat_probe *probe;
 	const char *action;
 	const char *devnode;
 
@@ -166,10 +360,14 @@ evdev_udev_handler(int fd, uint32_t mask, void *data)
 		goto out;
 
 	if (!strcmp(action, "add")) {
-		device_added(udev_device, seat);
+		device_probe_start(udev_device, seat);
 	}
 	else if (!strcmp(action, "remove")) {
 		devnode = udev_device_get_devnode(udev_device);
+		wl_list_for_each(probe, &seat->probe_list, link)
+			if (!strcmp(udev_device_get_devnode(probe->device),
+				    devnode))
+				probe->removed = 1;
 		wl_list_for_each_safe(device, next, &seat->devices_list, link)
 			if (!strcmp(device->devnode, devnode)) {
 				weston_log("input device %s, %s removed\n",
@@ -246,6 +444,7 @@ udev_seat_disable(struct udev_seat *seat)
 	wl_event_source_remove(seat->udev_monitor_source);
 	seat->udev_monitor_source = NULL;
 
+	udev_seat_cancel_probes(seat);
 	udev_seat_remove_devices(seat);
 }
 
@@ -259,11 +458,21 @@ drm_led_update(struct weston_seat *seat_base, enum weston_led leds)
 		evdev_led_update(device, leds);
 }
 
+static void
+evdev_stats_binding(struct wl_seat *wl_seat, uint32_t time, uint32_t key,
+		    void *data)
+{
+	struct udev_seat *seat = data;
+
+	evdev_log_device_stats(&seat->devices_list);
+}
+
 struct udev_seat *
 udev_seat_create(struct weston_compositor *c, struct udev *udev,
 		const char *seat_id)
 {
 	struct udev_seat *seat;
+	struct wl_event_loop *loop;
 
 	seat = malloc(sizeof *seat);
 	if (seat == NULL)
@@ -274,13 +483,32 @@ udev_seat_create(struct weston_compositor *c, struct udev *udev,
 	seat->base.led_update = drm_led_update;
 
 	wl_list_init(&seat->devices_list);
+	wl_list_init(&seat->probe_list);
 	seat->seat_id = strdup(seat_id);
+
+	/* without it, hotplugged devices are probed on the main loop */
+	loop = wl_display_get_event_loop(c->wl_display);
+	seat->probe_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (seat->probe_fd >= 0)
+		seat->probe_source =
+			wl_event_loop_add_fd(loop, seat->probe_fd,
+					     WL_EVENT_READABLE,
+					     udev_seat_probe_done, seat);
+
 	if (udev_seat_enable(seat, udev) < 0)
 		goto err;
 
+	seat->stats_binding =
+		weston_compositor_add_debug_binding(c, KEY_I,
+						    evdev_stats_binding, seat);
+
 	return seat;
 
  err:
+	if (seat->probe_source)
+		wl_event_source_remove(seat->probe_source);
+	if (seat->probe_fd >= 0)
+		close(seat->probe_fd);
 	free(seat->seat_id);
 	free(seat);
 	return NULL;
@@ -291,6 +519,12 @@ udev_seat_destroy(struct udev_seat *seat)
 {
 	udev_seat_disable(seat);
 
+	if (seat->probe_source)
+		wl_event_source_remove(seat->probe_source);
+	if (seat->probe_fd >= 0)
+		close(seat->probe_fd);
+	if (seat->stats_binding)
+		weston_binding_destroy(seat->stats_binding);
 	weston_seat_release(&seat->base);
 	free(seat->seat_id);
 	free(seat);
@@ -32,7 +32,12 @@ struct udev_seat {
 	struct wl_list devices_list;
 	struct udev_monitor *udev_monitor;
 	struct wl_event_source *udev_monitor_source;
+	/* hotplugged devices being probed, see udev_seat_probe */
+	struct wl_list probe_list;
+	int probe_fd;
+	struct wl_event_source *probe_source;
 	char *seat_id;
+	struct weston_binding *stats_binding;
 };
 
 int udev_seat_enable(struct udev_seat *seat, struct udev *udev);
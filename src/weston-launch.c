@@ -295,13 +295,34 @@ out:
 	return 0;
 }
 
+/* Only input devices are handed out. */
+static int
+open_input_device(const char *path, int flags)
+{
+	struct stat s;
+	int fd;
+
+	if (stat(path, &s) < 0)
+		return -1;
+
+	fd = open(path, flags);
+	if (fd < 0)
+		return -1;
+
+	if (major(s.st_rdev) != INPUT_MAJOR) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
 static int
 handle_open(struct weston_launch *wl, struct msghdr *msg, ssize_t len)
 {
 	int fd = -1, ret = -1;
 	char control[CMSG_SPACE(sizeof(fd))];
 	struct cmsghdr *cmsg;
-	struct stat s;
 	struct msghdr nmsg;
 	struct iovec iov;
 	struct weston_launcher_open *message;
@@ -314,18 +335,7 @@ handle_open(struct weston_launch *wl, struct msghdr *msg, ssize_t len)
 	/* Ensure path is null-terminated */
 	((char *) message)[len-1] = '\0';
 
-	if (stat(message->path, &s) < 0)
-		goto err0;
-
-	fd = open(message->path, message->flags);
-	if (fd < 0)
-		goto err0;
-
-	if (major(s.st_rdev) != INPUT_MAJOR) {
-		close(fd);
-		fd = -1;
-		goto err0;
-	}
+	fd = open_input_device(message->path, message->flags);
 
 err0:
 	memset(&nmsg, 0, sizeof nmsg);
@@ -359,6 +369,75 @@ err0:
 	return 0;
 }
 
+static int
+handle_open_batch(struct weston_launch *wl, struct msghdr *msg, ssize_t len)
+{
+	int fds[WESTON_LAUNCHER_MAX_BATCH];
+	int ret[WESTON_LAUNCHER_MAX_BATCH];
+	char control[CMSG_SPACE(sizeof fds)];
+	struct weston_launcher_open_batch *message;
+	struct cmsghdr *cmsg;
+	struct msghdr nmsg;
+	struct iovec iov;
+	char *path, *end;
+	int i, count = 0, nfds = 0;
+
+	message = msg->msg_iov->iov_base;
+	if ((size_t) len > sizeof *message &&
+	    message->count > 0 &&
+	    message->count <= WESTON_LAUNCHER_MAX_BATCH)
+		count = message->count;
+
+	/* Ensure the last path is null-terminated */
+	end = (char *) message + len;
+	end[-1] = '\0';
+
+	path = message->paths;
+	for (i = 0; i < count; i++) {
+		ret[i] = -1;
+		if (path < end) {
+			fds[nfds] = open_input_device(path, message->flags);
+			if (fds[nfds] >= 0) {
+				ret[i] = 0;
+				nfds++;
+			}
+			if (wl->verbose)
+				fprintf(stderr, "weston-launch: opened %s: "
+					"ret: %d\n", path, ret[i]);
+			path += strlen(path) + 1;
+		}
+	}
+
+	memset(&nmsg, 0, sizeof nmsg);
+	iov.iov_base = ret;
+	iov.iov_len = count * sizeof ret[0];
+	nmsg.msg_iov = &iov;
+	nmsg.msg_iovlen = 1;
+	if (nfds > 0) {
+		nmsg.msg_control = control;
+		nmsg.msg_controllen = sizeof control;
+		cmsg = CMSG_FIRSTHDR(&nmsg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof fds[0]);
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof fds[0]);
+		nmsg.msg_controllen = cmsg->cmsg_len;
+	}
+
+	do {
+		len = sendmsg(wl->sock[0], &nmsg, 0);
+	} while (len < 0 && errno == EINTR);
+
+	/* the compositor has its own copies now */
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+
+	if (len < 0)
+		return -1;
+
+	return 0;
+}
+
 static int
 handle_socket_msg(struct weston_launch *wl)
 {
@@ -393,6 +472,9 @@ handle_socket_msg(struct weston_launch *wl)
 	case WESTON_LAUNCHER_DRM_SET_MASTER:
 		ret = handle_setmaster(wl, &msg, len);
 		break;
+	case WESTON_LAUNCHER_OPEN_BATCH:
+		ret = handle_open_batch(wl, &msg, len);
+		break;
 	}
 
 	return ret;
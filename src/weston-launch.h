@@ -25,9 +25,14 @@
 
 enum weston_launcher_opcode {
 	WESTON_LAUNCHER_OPEN,
-	WESTON_LAUNCHER_DRM_SET_MASTER
+	WESTON_LAUNCHER_DRM_SET_MASTER,
+	WESTON_LAUNCHER_OPEN_BATCH
 };
 
+/* Most paths in one WESTON_LAUNCHER_OPEN_BATCH, well under the fds
+ * the kernel passes in one SCM_RIGHTS message. */
+#define WESTON_LAUNCHER_MAX_BATCH 32
+
 struct weston_launcher_message {
 	int opcode;
 };
@@ -38,6 +43,16 @@ struct weston_launcher_open {
 	char path[0];
 };
 
+/* count nul terminated paths, one after the other.  The reply is an
+ * int per path, 0 if it was opened, and the fds of those opened in
+ * path order, in one SCM_RIGHTS message. */
+struct weston_launcher_open_batch {
+	struct weston_launcher_message header;
+	int flags;
+	int count;
+	char paths[0];
+};
+
 struct weston_launcher_set_master {
 	struct weston_launcher_message header;
 	int set_master;
@@ -37,83 +37,66 @@
 
 #include "hash.h"
 
+/*
+ * Open addressing with linear probing over a power of two sized table,
+ * robin hood style: an entry is kept at most as far from its home slot
+ * as the entry it would displace, which keeps probe sequences short and
+ * lets a lookup stop as soon as it passes where its key would be.
+ * Removal shifts the rest of the run back by one instead of leaving a
+ * tombstone, so churn does not slow lookups down or force rehashes.
+ *
+ * X resource ids are a client base plus a mostly sequential counter, so
+ * the key is spread with a multiplicative hash before taking the top
+ * bits.  Entries are 16 bytes on 64 bit, four to a cache line, and a
+ * probe walks them in order.
+ */
+
 struct hash_entry {
 	uint32_t hash;
-	void *data;
+	void *data;		/* NULL if free */
 };
 
 struct hash_table {
 	struct hash_entry *table;
-	uint32_t size;
-	uint32_t rehash;
-	uint32_t max_entries;
-	uint32_t size_index;
+	uint32_t size;		/* power of two */
+	uint32_t shift;		/* 32 - log2(size) */
 	uint32_t entries;
-	uint32_t deleted_entries;
 };
 
-#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
-
-/*
- * From Knuth -- a good choice for hash/rehash values is p, p-2 where
- * p and p-2 are both prime.  These tables are sized to have an extra 10%
- * free to avoid exponential performance degradation as the hash table fills
- */
-
-static const uint32_t deleted_data;
-
-static const struct {
-   uint32_t max_entries, size, rehash;
-} hash_sizes[] = {
-    { 2,		5,		3	  },
-    { 4,		7,		5	  },
-    { 8,		13,		11	  },
-    { 16,		19,		17	  },
-    { 32,		43,		41        },
-    { 64,		73,		71        },
-    { 128,		151,		149       },
-    { 256,		283,		281       },
-    { 512,		571,		569       },
-    { 1024,		1153,		1151      },
-    { 2048,		2269,		2267      },
-    { 4096,		4519,		4517      },
-    { 8192,		9013,		9011      },
-    { 16384,		18043,		18041     },
-    { 32768,		36109,		36107     },
-    { 65536,		72091,		72089     },
-    { 131072,		144409,		144407    },
-    { 262144,		288361,		288359    },
-    { 524288,		576883,		576881    },
-    { 1048576,		1153459,	1153457   },
-    { 2097152,		2307163,	2307161   },
-    { 4194304,		4613893,	4613891   },
-    { 8388608,		9227641,	9227639   },
-    { 16777216,		18455029,	18455027  },
-    { 33554432,		36911011,	36911009  },
-    { 67108864,		73819861,	73819859  },
-    { 134217728,	147639589,	147639587 },
-    { 268435456,	295279081,	295279079 },
-    { 536870912,	590559793,	590559791 },
-    { 1073741824,	1181116273,	1181116271},
-    { 2147483648ul,	2362232233ul,	2362232231ul}
-};
+#define HASH_MIN_SIZE 8
 
-static int
-entry_is_free(struct hash_entry *entry)
+static uint32_t
+hash_home(struct hash_table *ht, uint32_t hash)
 {
-	return entry->data == NULL;
+	return (hash * 2654435769u) >> ht->shift;
 }
 
-static int
-entry_is_deleted(struct hash_entry *entry)
+/* how far the entry in slot i is from its home slot */
+static uint32_t
+hash_distance(struct hash_table *ht, uint32_t i)
 {
-	return entry->data == &deleted_data;
+	return (i - hash_home(ht, ht->table[i].hash)) & (ht->size - 1);
 }
 
 static int
-entry_is_present(struct hash_entry *entry)
+hash_table_alloc(struct hash_table *ht, uint32_t size)
 {
-	return entry->data != NULL && entry->data != &deleted_data;
+	struct hash_entry *table;
+	uint32_t shift = 32;
+
+	table = calloc(size, sizeof *table);
+	if (table == NULL)
+		return -1;
+
+	while ((1u << (32 - shift)) < size)
+		shift--;
+
+	ht->table = table;
+	ht->size = size;
+	ht->shift = shift;
+	ht->entries = 0;
+
+	return 0;
 }
 
 struct hash_table *
@@ -125,15 +108,7 @@ hash_table_create(void)
 	if (ht == NULL)
 		return NULL;
 
-	ht->size_index = 0;
-	ht->size = hash_sizes[ht->size_index].size;
-	ht->rehash = hash_sizes[ht->size_index].rehash;
-	ht->max_entries = hash_sizes[ht->size_index].max_entries;
-	ht->table = calloc(ht->size, sizeof(*ht->table));
-	ht->entries = 0;
-	ht->deleted_entries = 0;
-
-	if (ht->table == NULL) {
+	if (hash_table_alloc(ht, HASH_MIN_SIZE) < 0) {
 		free(ht);
 		return NULL;
 	}
@@ -155,153 +130,155 @@ hash_table_destroy(struct hash_table *ht)
 }
 
 /**
- * Finds a hash table entry with the given key and hash of that key.
- *
- * Returns NULL if no entry is found.  Note that the data pointer may be
- * modified by the user.
+ * Finds the slot of the given hash, or returns -1.
  */
-static void *
+static int64_t
 hash_table_search(struct hash_table *ht, uint32_t hash)
 {
-	uint32_t hash_address;
-
-	hash_address = hash % ht->size;
-	do {
-		uint32_t double_hash;
-
-		struct hash_entry *entry = ht->table + hash_address;
-
-		if (entry_is_free(entry)) {
-			return NULL;
-		} else if (entry_is_present(entry) && entry->hash == hash) {
-			return entry;
-		}
-
-		double_hash = 1 + hash % ht->rehash;
-
-		hash_address = (hash_address + double_hash) % ht->size;
-	} while (hash_address != hash % ht->size);
+	uint32_t mask = ht->size - 1;
+	uint32_t i, d;
+
+	i = hash_home(ht, hash);
+	for (d = 0; ht->table[i].data != NULL; d++) {
+		if (ht->table[i].hash == hash)
+			return i;
+		/* ours would have displaced this one */
+		if (hash_distance(ht, i) < d)
+			break;
+		i = (i + 1) & mask;
+	}
 
-	return NULL;
+	return -1;
 }
 
+/**
+ * Calls func for the data of each entry, in no particular order.  func
+ * must not insert into or remove from the table.
+ */
 void
 hash_table_for_each(struct hash_table *ht,
 		    hash_table_iterator_func_t func, void *data)
 {
-	struct hash_entry *entry;
 	uint32_t i;
 
-	for (i = 0; i < ht->size; i++) {
-		entry = ht->table + i;
-		if (entry_is_present(entry))
-			func(entry->data, data);
-	}
+	for (i = 0; i < ht->size; i++)
+		if (ht->table[i].data != NULL)
+			func(ht->table[i].data, data);
 }
 
 void *
 hash_table_lookup(struct hash_table *ht, uint32_t hash)
 {
-	struct hash_entry *entry;
+	int64_t i;
 
-	entry = hash_table_search(ht, hash);
-	if (entry != NULL)
-		return entry->data;
+	i = hash_table_search(ht, hash);
+	if (i < 0)
+		return NULL;
 
-	return NULL;
+	return ht->table[i].data;
 }
 
+/* Place an entry whose hash is not in the table, which has room. */
 static void
-hash_table_rehash(struct hash_table *ht, unsigned int new_size_index)
+hash_table_place(struct hash_table *ht, uint32_t hash, void *data)
 {
-	struct hash_table old_ht;
-	struct hash_entry *table, *entry;
+	struct hash_entry entry = { hash, data }, tmp;
+	uint32_t mask = ht->size - 1;
+	uint32_t i, d, e;
+
+	i = hash_home(ht, hash);
+	for (d = 0; ht->table[i].data != NULL; d++) {
+		e = hash_distance(ht, i);
+		if (e < d) {
+			/* the richer entry moves on */
+			tmp = ht->table[i];
+			ht->table[i] = entry;
+			entry = tmp;
+			d = e;
+		}
+		i = (i + 1) & mask;
+	}
 
-	if (new_size_index >= ARRAY_SIZE(hash_sizes))
-		return;
+	ht->table[i] = entry;
+	ht->entries++;
+}
 
-	table = calloc(hash_sizes[new_size_index].size, sizeof(*ht->table));
-	if (table == NULL)
-		return;
+static int
+hash_table_resize(struct hash_table *ht, uint32_t size)
+{
+	struct hash_table old = *ht;
+	uint32_t i;
 
-	old_ht = *ht;
+	if (hash_table_alloc(ht, size) < 0) {
+		*ht = old;
+		return -1;
+	}
 
-	ht->table = table;
-	ht->size_index = new_size_index;
-	ht->size = hash_sizes[ht->size_index].size;
-	ht->rehash = hash_sizes[ht->size_index].rehash;
-	ht->max_entries = hash_sizes[ht->size_index].max_entries;
-	ht->entries = 0;
-	ht->deleted_entries = 0;
+	for (i = 0; i < old.size; i++)
+		if (old.table[i].data != NULL)
+			hash_table_place(ht, old.table[i].hash,
+					 old.table[i].data);
 
-	for (entry = old_ht.table;
-	     entry != old_ht.table + old_ht.size;
-	     entry++) {
-		if (entry_is_present(entry)) {
-			hash_table_insert(ht, entry->hash, entry->data);
-		}
-	}
+	free(old.table);
 
-	free(old_ht.table);
+	return 0;
 }
 
 /**
- * Inserts the data with the given hash into the table.
+ * Inserts the data with the given hash into the table, replacing what
+ * was there for the hash.  data must not be NULL.
  *
- * Note that insertion may rearrange the table on a resize or rehash,
- * so previously found hash_entries are no longer valid after this function.
+ * Returns -1 if the table had to grow and could not.
  */
 int
 hash_table_insert(struct hash_table *ht, uint32_t hash, void *data)
 {
-	uint32_t hash_address;
+	int64_t i;
 
-	if (ht->entries >= ht->max_entries) {
-		hash_table_rehash(ht, ht->size_index + 1);
-	} else if (ht->deleted_entries + ht->entries >= ht->max_entries) {
-		hash_table_rehash(ht, ht->size_index);
+	i = hash_table_search(ht, hash);
+	if (i >= 0) {
+		ht->table[i].data = data;
+		return 0;
 	}
 
-	hash_address = hash % ht->size;
-	do {
-		struct hash_entry *entry = ht->table + hash_address;
-		uint32_t double_hash;
-
-		if (!entry_is_present(entry)) {
-			if (entry_is_deleted(entry))
-				ht->deleted_entries--;
-			entry->hash = hash;
-			entry->data = data;
-			ht->entries++;
-			return 0;
-		}
-
-		double_hash = 1 + hash % ht->rehash;
+	/* keep the load at most 7/8 */
+	if ((ht->entries + 1) * 8 > ht->size * 7 &&
+	    hash_table_resize(ht, ht->size * 2) < 0)
+		return -1;
 
-		hash_address = (hash_address + double_hash) % ht->size;
-	} while (hash_address != hash % ht->size);
+	hash_table_place(ht, hash, data);
 
-	/* We could hit here if a required resize failed. An unchecked-malloc
-	 * application could ignore this result.
-	 */
-	return -1;
+	return 0;
 }
 
 /**
- * This function deletes the given hash table entry.
+ * Removes the entry with the given hash, if there is one.
  *
- * Note that deletion doesn't otherwise modify the table, so an iteration over
- * the table deleting entries is safe.
+ * The table shrinks once a spike of windows has gone away, down to
+ * twice what is left.
  */
 void
 hash_table_remove(struct hash_table *ht, uint32_t hash)
 {
-	struct hash_entry *entry;
+	uint32_t mask = ht->size - 1;
+	int64_t found;
+	uint32_t i, next;
 
-	entry = hash_table_search(ht, hash);
-	if (entry != NULL) {
-		entry->data = (void *) &deleted_data;
-		ht->entries--;
-		ht->deleted_entries++;
+	found = hash_table_search(ht, hash);
+	if (found < 0)
+		return;
+
+	/* shift the rest of the run back over the hole */
+	i = found;
+	next = (i + 1) & mask;
+	while (ht->table[next].data != NULL && hash_distance(ht, next) > 0) {
+		ht->table[i] = ht->table[next];
+		i = next;
+		next = (i + 1) & mask;
 	}
+	ht->table[i].data = NULL;
+	ht->entries--;
+
+	if (ht->size > HASH_MIN_SIZE && ht->entries * 8 < ht->size)
+		hash_table_resize(ht, ht->size / 2);
 }
@@ -31,21 +31,22 @@
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sched.h>
 
 #include "xwayland.h"
 #include "xserver-server-protocol.h"
 
 
-static int
-weston_xserver_handle_event(int listen_fd, uint32_t mask, void *data)
+static void
+weston_xserver_start(struct weston_xserver *wxs, int idle_priority)
 {
-	struct weston_xserver *wxs = data;
+	struct sched_param param;
 	char display[8], s[8];
 	int sv[2], client_fd;
 
 	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
 		weston_log("socketpair failed\n");
-		return 1;
+		return;
 	}
 
 	wxs->process.pid = fork();
@@ -55,7 +56,12 @@ weston_xserver_handle_event(int listen_fd, uint32_t mask, void *data)
 		 * the flag on the client fd. */
 		client_fd = dup(sv[1]);
 		if (client_fd < 0)
-			return 1;
+			exit(-1);
+
+		memset(&param, 0, sizeof param);
+		if (idle_priority &&
+		    sched_setscheduler(0, SCHED_IDLE, &param) < 0)
+			weston_log("failed to set idle priority: %m\n");
 
 		snprintf(s, sizeof s, "%d", client_fd);
 		setenv("WAYLAND_SOCKET", s, 1);
@@ -79,6 +85,7 @@ weston_xserver_handle_event(int listen_fd, uint32_t mask, void *data)
 
 		close(sv[1]);
 		wxs->client = wl_client_create(wxs->wl_display, sv[0]);
+		wxs->idle_priority = idle_priority;
 
 		weston_watch_process(&wxs->process);
 
@@ -88,12 +95,34 @@ weston_xserver_handle_event(int listen_fd, uint32_t mask, void *data)
 
 	case -1:
 		weston_log( "failed to fork\n");
+		close(sv[0]);
+		close(sv[1]);
 		break;
 	}
+}
+
+static int
+weston_xserver_handle_event(int listen_fd, uint32_t mask, void *data)
+{
+	struct weston_xserver *wxs = data;
+
+	weston_xserver_start(wxs, 0);
 
 	return 1;
 }
 
+static void
+weston_xserver_prestart(void *data)
+{
+	struct weston_xserver *wxs = data;
+
+	wxs->prestart_source = NULL;
+
+	/* an X client may have beaten us to it */
+	if (wxs->process.pid == 0)
+		weston_xserver_start(wxs, 1);
+}
+
 static void
 weston_xserver_shutdown(struct weston_xserver *wxs)
 {
@@ -107,6 +136,8 @@ weston_xserver_shutdown(struct weston_xserver *wxs)
 		wl_event_source_remove(wxs->abstract_source);
 		wl_event_source_remove(wxs->unix_source);
 	}
+	if (wxs->prestart_source)
+		wl_event_source_remove(wxs->prestart_source);
 	close(wxs->abstract_fd);
 	close(wxs->unix_fd);
 	if (wxs->wm)
@@ -123,6 +154,7 @@ weston_xserver_cleanup(struct weston_process *process, int status)
 	wxs->process.pid = 0;
 	wxs->client = NULL;
 	wxs->resource = NULL;
+	wxs->idle_priority = 0;
 
 	wxs->abstract_source =
 		wl_event_loop_add_fd(wxs->loop, wxs->abstract_fd,
@@ -152,12 +184,23 @@ bind_xserver(struct wl_client *client,
 	     void *data, uint32_t version, uint32_t id)
 {
 	struct weston_xserver *wxs = data;
+	struct sched_param param;
 
 	/* If it's a different client than the xserver we launched,
 	 * don't start the wm. */
 	if (client != wxs->client)
 		return;
 
+	/* Started ahead of time, it is up now and X clients must not
+	 * wait behind everything else. */
+	if (wxs->idle_priority) {
+		memset(&param, 0, sizeof param);
+		if (sched_setscheduler(wxs->process.pid,
+				       SCHED_OTHER, &param) < 0)
+			weston_log("failed to reset X server priority: %m\n");
+		wxs->idle_priority = 0;
+	}
+
 	wxs->resource = 
 		wl_client_add_object(client, &xserver_interface,
 				     &xserver_implementation, id, wxs);
@@ -322,6 +365,14 @@ module_init(struct weston_compositor *compositor,
 	struct wl_display *display = compositor->wl_display;
 	struct weston_xserver *wxs;
 	char lockfile[256], display_name[8];
+	int prestart = 0;
+	const struct config_key xwayland_config_keys[] = {
+		{ "prestart", CONFIG_KEY_BOOLEAN, &prestart },
+	};
+	const struct config_section cs[] = {
+		{ "xwayland",
+		  xwayland_config_keys, ARRAY_LENGTH(xwayland_config_keys) },
+	};
 
 	wxs = malloc(sizeof *wxs);
 	memset(wxs, 0, sizeof *wxs);
@@ -379,5 +430,11 @@ module_init(struct weston_compositor *compositor,
 	wxs->destroy_listener.notify = weston_xserver_destroy;
 	wl_signal_add(&compositor->destroy_signal, &wxs->destroy_listener);
 
+	parse_config_file(config_file, cs, ARRAY_LENGTH(cs), NULL);
+	if (prestart)
+		wxs->prestart_source =
+			wl_event_loop_add_idle(wxs->loop,
+					       weston_xserver_prestart, wxs);
+
 	return 0;
 }
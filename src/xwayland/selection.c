@@ -29,12 +29,52 @@
 
 #include "xwayland.h"
 
+static const size_t incr_chunk_size = 64 * 1024;
+
+static int
+weston_wm_write_property(int fd, uint32_t mask, void *data);
+
+/* Properties are read at most incr_chunk_size at a time, however large
+ * a piece the selection owner put there, and the next piece is only
+ * requested once the last one is written out. */
+static void
+weston_wm_write_selection_reply(struct weston_wm *wm,
+				xcb_get_property_reply_t *reply)
+{
+	wm->property_start = 0;
+	wm->property_source =
+		wl_event_loop_add_fd(wm->server->loop,
+				     wm->data_source_fd,
+				     WL_EVENT_WRITABLE,
+				     weston_wm_write_property,
+				     wm);
+	wm->property_reply = reply;
+}
+
+static xcb_get_property_reply_t *
+weston_wm_get_selection_piece(struct weston_wm *wm, int delete)
+{
+	xcb_get_property_cookie_t cookie;
+
+	/* The server only deletes the property along with its last
+	 * piece. */
+	cookie = xcb_get_property(wm->conn,
+				  delete,
+				  wm->selection_window,
+				  wm->atom.wl_selection,
+				  XCB_GET_PROPERTY_TYPE_ANY,
+				  wm->property_offset,
+				  incr_chunk_size / 4 /* length */);
+
+	return xcb_get_property_reply(wm->conn, cookie, NULL);
+}
+
 static int
 weston_wm_write_property(int fd, uint32_t mask, void *data)
 {
 	struct weston_wm *wm = data;
 	unsigned char *property;
-	int len, remainder;
+	int len, remainder, more;
 
 	property = xcb_get_property_value(wm->property_reply);
 	remainder = xcb_get_property_value_length(wm->property_reply) -
@@ -55,10 +95,15 @@ weston_wm_write_property(int fd, uint32_t mask, void *data)
 
 	wm->property_start += len;
 	if (len == remainder) {
+		more = wm->property_reply->bytes_after > 0;
+		wm->property_offset += wm->property_start / 4;
 		free(wm->property_reply);
 		wl_event_source_remove(wm->property_source);
 
-		if (wm->incr) {
+		if (more) {
+			weston_wm_write_selection_reply(wm,
+				weston_wm_get_selection_piece(wm, !wm->incr));
+		} else if (wm->incr) {
 			xcb_delete_property(wm->conn,
 					    wm->selection_window,
 					    wm->atom.wl_selection);
@@ -74,30 +119,16 @@ weston_wm_write_property(int fd, uint32_t mask, void *data)
 static void
 weston_wm_get_incr_chunk(struct weston_wm *wm)
 {
-	xcb_get_property_cookie_t cookie;
 	xcb_get_property_reply_t *reply;
 
-	cookie = xcb_get_property(wm->conn,
-				  0, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  0x1fffffff /* length */);
-
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	/* deleted by hand once written, that asks for the next chunk */
+	wm->property_offset = 0;
+	reply = weston_wm_get_selection_piece(wm, 0);
 
 	dump_property(wm, wm->atom.wl_selection, reply);
 
 	if (xcb_get_property_value_length(reply) > 0) {
-		wm->property_start = 0;
-		wm->property_source =
-			wl_event_loop_add_fd(wm->server->loop,
-					     wm->data_source_fd,
-					     WL_EVENT_WRITABLE,
-					     weston_wm_write_property,
-					     wm);
-		wm->property_reply = reply;
+		weston_wm_write_selection_reply(wm, reply);
 	} else {
 		weston_log("transfer complete\n");
 		close(wm->data_source_fd);
@@ -204,18 +235,10 @@ weston_wm_get_selection_targets(struct weston_wm *wm)
 static void
 weston_wm_get_selection_data(struct weston_wm *wm)
 {
-	xcb_get_property_cookie_t cookie;
 	xcb_get_property_reply_t *reply;
 
-	cookie = xcb_get_property(wm->conn,
-				  1, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  0x1fffffff /* length */);
-
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	wm->property_offset = 0;
+	reply = weston_wm_get_selection_piece(wm, 1);
 
 	if (reply->type == wm->atom.incr) {
 		dump_property(wm, wm->atom.wl_selection, reply);
@@ -224,14 +247,7 @@ weston_wm_get_selection_data(struct weston_wm *wm)
 	} else {
 		dump_property(wm, wm->atom.wl_selection, reply);
 		wm->incr = 0;
-		wm->property_start = 0;
-		wm->property_source =
-			wl_event_loop_add_fd(wm->server->loop,
-					     wm->data_source_fd,
-					     WL_EVENT_WRITABLE,
-					     weston_wm_write_property,
-					     wm);
-		wm->property_reply = reply;
+		weston_wm_write_selection_reply(wm, reply);
 	}
 }
 
@@ -251,8 +267,6 @@ weston_wm_handle_selection_notify(struct weston_wm *wm,
 	}
 }
 
-static const size_t incr_chunk_size = 64 * 1024;
-
 static void
 weston_wm_send_selection_notify(struct weston_wm *wm, xcb_atom_t property)
 {
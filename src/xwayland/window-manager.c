@@ -39,6 +39,7 @@
 #include "../compositor.h"
 #include "xserver-server-protocol.h"
 #include "hash.h"
+#include "../trace.h"
 
 struct motif_wm_hints {
 	uint32_t flags;
@@ -99,7 +100,11 @@ struct weston_wm_window {
 	struct wl_listener surface_destroy_listener;
 	struct wl_event_source *repaint_source;
 	struct wl_event_source *configure_source;
-	int properties_dirty;
+	/* a configure went out in the coming frame of this output */
+	struct weston_output *configure_output;
+	struct wl_listener configure_frame_listener;
+	int configure_pending;
+	uint32_t properties_dirty;	/* bits of the properties to read */
 	int pid;
 	char *machine;
 	char *class;
@@ -113,6 +118,9 @@ struct weston_wm_window {
 	int decorate;
 	int override_redirect;
 	int fullscreen;
+	/* what the frame has on it, see draw_decoration() */
+	int drawn_width, drawn_height;
+	int drawn_flags;
 };
 
 static struct weston_wm_window *
@@ -289,17 +297,24 @@ read_and_dump_property(struct weston_wm *wm,
 #define TYPE_MOTIF_WM_HINTS	XCB_ATOM_CUT_BUFFER1
 #define TYPE_NET_WM_STATE	XCB_ATOM_CUT_BUFFER2
 
+struct weston_wm_property {
+	xcb_atom_t atom;
+	xcb_atom_t type;
+	int offset;
+};
+
+#define WM_PROPERTY_COUNT	10
+#define WM_PROPERTIES_ALL	((1 << WM_PROPERTY_COUNT) - 1)
+
+/* The properties the window manager keeps track of, with the field of
+ * the window each goes to.  Later ones win over earlier ones filling
+ * the same field. */
 static void
-weston_wm_window_read_properties(struct weston_wm_window *window)
+weston_wm_get_properties(struct weston_wm *wm,
+			 struct weston_wm_property props[WM_PROPERTY_COUNT])
 {
-	struct weston_wm *wm = window->wm;
-
 #define F(field) offsetof(struct weston_wm_window, field)
-	const struct {
-		xcb_atom_t atom;
-		xcb_atom_t type;
-		int offset;
-	} props[] = {
+	const struct weston_wm_property p[WM_PROPERTY_COUNT] = {
 		{ XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, F(class) },
 		{ XCB_ATOM_WM_NAME, XCB_ATOM_STRING, F(name) },
 		{ XCB_ATOM_WM_TRANSIENT_FOR, XCB_ATOM_WINDOW, F(transient_for) },
@@ -313,27 +328,72 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	};
 #undef F
 
-	xcb_get_property_cookie_t cookie[ARRAY_LENGTH(props)];
+	memcpy(props, p, sizeof p);
+}
+
+/* Mark the property for reading, along with those filling the same
+ * field, so the one that wins still does. */
+static void
+weston_wm_window_property_dirty(struct weston_wm_window *window,
+				xcb_atom_t atom)
+{
+	struct weston_wm_property props[WM_PROPERTY_COUNT];
+	uint32_t i, j;
+
+	weston_wm_get_properties(window->wm, props);
+
+	for (i = 0; i < WM_PROPERTY_COUNT; i++) {
+		if (props[i].atom != atom)
+			continue;
+		window->properties_dirty |= 1 << i;
+		if (props[i].offset == 0)
+			continue;
+		for (j = 0; j < WM_PROPERTY_COUNT; j++)
+			if (props[j].offset == props[i].offset)
+				window->properties_dirty |= 1 << j;
+	}
+}
+
+/* Reads the properties changed since the last time, all of the
+ * requests going out before waiting for the first reply. */
+static void
+weston_wm_window_read_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct weston_wm_property props[WM_PROPERTY_COUNT];
+	xcb_get_property_cookie_t cookie[WM_PROPERTY_COUNT];
 	xcb_get_property_reply_t *reply;
 	void *p;
 	uint32_t *xid;
 	xcb_atom_t *atom;
-	uint32_t i;
+	uint32_t i, j, dirty;
 	struct motif_wm_hints *hints;
 
 	if (!window->properties_dirty)
 		return;
+	dirty = window->properties_dirty;
 	window->properties_dirty = 0;
 
-	for (i = 0; i < ARRAY_LENGTH(props); i++)
-		cookie[i] = xcb_get_property(wm->conn,
-					     0, /* delete */
-					     window->id,
-					     props[i].atom,
-					     XCB_ATOM_ANY, 0, 2048);
+	weston_wm_get_properties(wm, props);
+
+	for (i = 0; i < WM_PROPERTY_COUNT; i++)
+		if (dirty & (1 << i))
+			cookie[i] = xcb_get_property(wm->conn,
+						     0, /* delete */
+						     window->id,
+						     props[i].atom,
+						     XCB_ATOM_ANY, 0, 2048);
+
+	for (i = 0; i < WM_PROPERTY_COUNT; i++)  {
+		if (!(dirty & (1 << i)))
+			continue;
+
+		/* what holds without the property */
+		if (props[i].type == TYPE_MOTIF_WM_HINTS)
+			window->decorate = !window->override_redirect;
+		else if (props[i].type == TYPE_NET_WM_STATE)
+			window->fullscreen = 0;
 
-	window->decorate = !window->override_redirect;
-	for (i = 0; i < ARRAY_LENGTH(props); i++)  {
 		reply = xcb_get_property_reply(wm->conn, cookie[i], NULL);
 		if (!reply)
 			/* Bad window, typically */
@@ -371,10 +431,9 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 		case TYPE_WM_PROTOCOLS:
 			break;
 		case TYPE_NET_WM_STATE:
-			window->fullscreen = 0;
 			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++)
-				if (atom[i] == wm->atom.net_wm_state_fullscreen)
+			for (j = 0; j < reply->value_len; j++)
+				if (atom[j] == wm->atom.net_wm_state_fullscreen)
 					window->fullscreen = 1;
 			break;
 		case TYPE_MOTIF_WM_HINTS:
@@ -710,6 +769,7 @@ weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
 							     window->frame_id,
 							     &wm->format_rgb,
 							     width, height);
+	window->drawn_flags = -1;
 
 	hash_table_insert(wm->window_hash, window->frame_id, window);
 }
@@ -776,6 +836,7 @@ weston_wm_window_draw_decoration(void *data)
 	struct weston_wm *wm = window->wm;
 	struct theme *t = wm->theme;
 	cairo_t *cr;
+	pixman_region32_t region;
 	int x, y, width, height;
 	const char *title;
 	uint32_t flags = 0;
@@ -792,6 +853,7 @@ weston_wm_window_draw_decoration(void *data)
 
 	if (window->fullscreen) {
 		/* nothing */
+		window->drawn_flags = -1;
 	} else if (window->decorate) {
 		if (wm->focus_window == window)
 			flags |= THEME_FRAME_ACTIVE;
@@ -801,8 +863,22 @@ weston_wm_window_draw_decoration(void *data)
 		else
 			title = "untitled";
 
+		/* if the frame is the same, just the title changed */
+		if (window->drawn_width == width &&
+		    window->drawn_height == height &&
+		    window->drawn_flags == (int) flags) {
+			cairo_rectangle(cr, t->margin, t->margin,
+					width - 2 * t->margin,
+					t->titlebar_height);
+			cairo_clip(cr);
+		}
+
 		theme_render_frame(t, cr, width, height, title, flags);
+		window->drawn_width = width;
+		window->drawn_height = height;
+		window->drawn_flags = flags;
 	} else {
+		window->drawn_flags = -1;
 		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 		cairo_set_source_rgba(cr, 0, 0, 0, 0);
 		cairo_paint(cr);
@@ -815,23 +891,23 @@ weston_wm_window_draw_decoration(void *data)
 	cairo_destroy(cr);
 
 	if (window->surface) {
-		pixman_region32_fini(&window->surface->pending.opaque);
 		/* We leave an extra pixel around the X window area to
 		 * make sure we don't sample from the undefined alpha
 		 * channel when filtering. */
-		pixman_region32_init_rect(&window->surface->pending.opaque, 
-					  x - 1, y - 1,
+		pixman_region32_init_rect(&region, x - 1, y - 1,
 					  window->width + 2,
 					  window->height + 2);
+		weston_surface_set_pending_opaque(window->surface, &region);
+		pixman_region32_fini(&region);
 		weston_surface_geometry_dirty(window->surface);
 	}
 
 	if (window->surface && !window->fullscreen) {
-		pixman_region32_fini(&window->surface->pending.input);
-		pixman_region32_init_rect(&window->surface->pending.input,
-					  t->margin, t->margin,
+		pixman_region32_init_rect(&region, t->margin, t->margin,
 					  width - 2 * t->margin,
 					  height - 2 * t->margin);
+		weston_surface_set_pending_input(window->surface, &region);
+		pixman_region32_fini(&region);
 	}
 }
 
@@ -839,14 +915,16 @@ static void
 weston_wm_window_schedule_repaint(struct weston_wm_window *window)
 {
 	struct weston_wm *wm = window->wm;
+	pixman_region32_t opaque;
 	int width, height;
 
 	if (window->frame_id == XCB_WINDOW_NONE) {
 		if (window->surface != NULL) {
 			weston_wm_window_get_frame_size(window, &width, &height);
-			pixman_region32_fini(&window->surface->pending.opaque);
-			pixman_region32_init_rect(&window->surface->pending.opaque, 0, 0,
-						  width, height);
+			pixman_region32_init_rect(&opaque, 0, 0, width, height);
+			weston_surface_set_pending_opaque(window->surface,
+							  &opaque);
+			pixman_region32_fini(&opaque);
 			weston_surface_geometry_dirty(window->surface);
 		}
 		return;
@@ -872,7 +950,7 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 	if (!window)
 		return;
 
-	window->properties_dirty = 1;
+	weston_wm_window_property_dirty(window, property_notify->atom);
 
 	weston_log("XCB_PROPERTY_NOTIFY: window %d, ",
 		property_notify->window);
@@ -906,7 +984,7 @@ weston_wm_window_create(struct weston_wm *wm,
 	memset(window, 0, sizeof *window);
 	window->wm = wm;
 	window->id = id;
-	window->properties_dirty = 1;
+	window->properties_dirty = WM_PROPERTIES_ALL;
 	window->override_redirect = override;
 	window->width = width;
 	window->height = height;
@@ -917,6 +995,10 @@ weston_wm_window_create(struct weston_wm *wm,
 static void
 weston_wm_window_destroy(struct weston_wm_window *window)
 {
+	if (window->configure_source)
+		wl_event_source_remove(window->configure_source);
+	if (window->configure_output)
+		wl_list_remove(&window->configure_frame_listener.link);
 	hash_table_remove(window->wm->window_hash, window->id);
 	free(window);
 }
@@ -1321,7 +1403,12 @@ weston_wm_handle_event(int fd, uint32_t mask, void *data)
 	xcb_generic_event_t *event;
 	int count = 0;
 
+	WESTON_TRACE_BEGIN(WESTON_TRACE_XWAYLAND, "weston_wm_handle_event");
+
 	while (event = xcb_poll_for_event(wm->conn), event != NULL) {
+		WESTON_TRACE_INSTANT(WESTON_TRACE_XWAYLAND, "xcb_event",
+				     event->response_type & ~0x80);
+
 		if (weston_wm_handle_selection_event(wm, event)) {
 			free(event);
 			count++;
@@ -1383,6 +1470,8 @@ weston_wm_handle_event(int fd, uint32_t mask, void *data)
 
 	xcb_flush(wm->conn);
 
+	WESTON_TRACE_END(WESTON_TRACE_XWAYLAND, "weston_wm_handle_event");
+
 	return count;
 }
 
@@ -1454,6 +1543,8 @@ weston_wm_get_resources(struct weston_wm *wm)
 	xcb_render_pictforminfo_t *formats;
 	uint32_t i;
 
+	/* Everything goes out before waiting for any reply, so this
+	 * costs the first X client about one round trip. */
 	xcb_prefetch_extension_data (wm->conn, &xcb_xfixes_id);
 
 	formats_cookie = xcb_render_query_pict_formats(wm->conn);
@@ -1463,12 +1554,6 @@ weston_wm_get_resources(struct weston_wm *wm)
 					      strlen(atoms[i].name),
 					      atoms[i].name);
 
-	for (i = 0; i < ARRAY_LENGTH(atoms); i++) {
-		reply = xcb_intern_atom_reply (wm->conn, cookies[i], NULL);
-		*(xcb_atom_t *) ((char *) wm + atoms[i].offset) = reply->atom;
-		free(reply);
-	}
-
 	wm->xfixes = xcb_get_extension_data(wm->conn, &xcb_xfixes_id);
 	if (!wm->xfixes || !wm->xfixes->present)
 		weston_log("xfixes not available\n");
@@ -1476,6 +1561,13 @@ weston_wm_get_resources(struct weston_wm *wm)
 	xfixes_cookie = xcb_xfixes_query_version(wm->conn,
 						 XCB_XFIXES_MAJOR_VERSION,
 						 XCB_XFIXES_MINOR_VERSION);
+
+	for (i = 0; i < ARRAY_LENGTH(atoms); i++) {
+		reply = xcb_intern_atom_reply (wm->conn, cookies[i], NULL);
+		*(xcb_atom_t *) ((char *) wm + atoms[i].offset) = reply->atom;
+		free(reply);
+	}
+
 	xfixes_reply = xcb_xfixes_query_version_reply(wm->conn,
 						      xfixes_cookie, NULL);
 
@@ -1722,9 +1814,33 @@ weston_wm_window_configure(void *data)
 
 	window->configure_source = NULL;
 
+	/* The client won't see another configure before the output
+	 * shows a frame, however fast the pointer moves. */
+	if (window->surface && window->surface->output) {
+		window->configure_output = window->surface->output;
+		wl_signal_add(&window->configure_output->frame_signal,
+			      &window->configure_frame_listener);
+	}
+
 	weston_wm_window_schedule_repaint(window);
 }
 
+static void
+weston_wm_window_configure_frame(struct wl_listener *listener, void *data)
+{
+	struct weston_wm_window *window =
+		container_of(listener, struct weston_wm_window,
+			     configure_frame_listener);
+
+	wl_list_remove(&window->configure_frame_listener.link);
+	window->configure_output = NULL;
+
+	if (window->configure_pending) {
+		window->configure_pending = 0;
+		weston_wm_window_configure(window);
+	}
+}
+
 static void
 send_configure(struct weston_surface *surface,
 	       uint32_t edges, int32_t width, int32_t height)
@@ -1748,6 +1864,15 @@ send_configure(struct weston_surface *surface,
 	if (window->configure_source)
 		return;
 
+	if (window->configure_output) {
+		/* sent with the latest size once the frame is out */
+		window->configure_pending = 1;
+		weston_output_schedule_repaint(window->configure_output);
+		return;
+	}
+
+	window->configure_frame_listener.notify =
+		weston_wm_window_configure_frame;
 	window->configure_source =
 		wl_event_loop_add_idle(wm->server->loop,
 				       weston_wm_window_configure, window);
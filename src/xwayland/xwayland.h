@@ -42,6 +42,10 @@ struct weston_xserver {
 	struct weston_compositor *compositor;
 	struct weston_wm *wm;
 	struct wl_listener destroy_listener;
+	/* [xwayland] prestart: started from an idle callback at
+	 * SCHED_IDLE, back to normal priority once it is up */
+	struct wl_event_source *prestart_source;
+	int idle_priority;
 };
 
 struct weston_wm {
@@ -68,6 +72,7 @@ struct weston_wm {
 	struct wl_event_source *property_source;
 	xcb_get_property_reply_t *property_reply;
 	int property_start;
+	uint32_t property_offset;
 	struct wl_array source_data;
 	xcb_selection_request_event_t selection_request;
 	xcb_atom_t selection_target;
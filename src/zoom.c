@@ -25,6 +25,19 @@
 #include "compositor.h"
 #include "text-cursor-position-server-protocol.h"
 
+/* The renderer draws the zoomed output from an unzoomed copy, whose
+ * damage the surfaces track as ever, so a change of the zoom itself
+ * only needs a repaint.  Leaving zoom repaints all of the output. */
+static void
+weston_zoom_schedule_repaint(struct weston_output *output)
+{
+	output->dirty = 1;
+	if (output->zoom.active)
+		weston_output_schedule_repaint(output);
+	else
+		weston_output_damage(output);
+}
+
 struct text_cursor_position {
 	struct wl_object base;
 	struct weston_compositor *ec;
@@ -132,8 +145,7 @@ weston_zoom_frame_z(struct weston_animation *animation,
 		wl_list_init(&animation->link);
 	}
 
-	output->dirty = 1;
-	weston_output_damage(output);
+	weston_zoom_schedule_repaint(output);
 }
 
 static struct weston_seat *
@@ -176,8 +188,7 @@ weston_zoom_frame_xy(struct weston_animation *animation,
 		wl_list_init(&animation->link);
 	}
 
-	output->dirty = 1;
-	weston_output_damage(output);
+	weston_zoom_schedule_repaint(output);
 }
 
 static void
@@ -329,8 +340,7 @@ weston_zoom_transition(struct weston_output *output, uint32_t type,
 		}
 	}
 
-	output->dirty = 1;
-	weston_output_damage(output);
+	weston_zoom_schedule_repaint(output);
 }
 
 WL_EXPORT void
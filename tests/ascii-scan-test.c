@@ -0,0 +1,200 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#include "../clients/ascii-scan.h"
+
+/*
+ * Log output as weston-terminal sees it from a build or a tail -f:
+ * lines of printable text, the odd tab, and colour escapes around
+ * some of the words.
+ */
+#define LOG_SIZE	(4 * 1024 * 1024)
+
+static const char *words[] = {
+	"[", "]", "compositor:", "output", "DRM", "mode", "1920x1080",
+	"libtool:", "compile:", "gcc", "-DHAVE_CONFIG_H", "-I.", "-O2",
+	"-Wall", "src/compositor.c", "-o", "weston-compositor.o", "warning:",
+	"unused", "variable", "ret", "Loading", "module", "'/usr/lib/foo.so'",
+	"0x7f3a2c001200", "12:34:56.789", "usb", "1-1:", "new", "device"
+};
+
+static char *log_data;
+
+static void
+make_log(void)
+{
+	size_t i = 0, len;
+	const char *w;
+
+	log_data = malloc(LOG_SIZE);
+	while (1) {
+		w = words[random() % (sizeof words / sizeof words[0])];
+		len = strlen(w);
+		if (i + len + 16 > LOG_SIZE)
+			break;
+
+		if (random() % 16 == 0) {
+			memcpy(log_data + i, "\e[1;31m", 7);
+			i += 7;
+			memcpy(log_data + i, w, len);
+			i += len;
+			memcpy(log_data + i, "\e[0m", 4);
+			i += 4;
+		} else {
+			memcpy(log_data + i, w, len);
+			i += len;
+		}
+
+		switch (random() % 12) {
+		case 0:
+			log_data[i++] = '\r';
+			log_data[i++] = '\n';
+			break;
+		case 1:
+			log_data[i++] = '\t';
+			break;
+		default:
+			log_data[i++] = ' ';
+			break;
+		}
+	}
+	memset(log_data + i, '\n', LOG_SIZE - i);
+}
+
+static struct timespec begin_time;
+
+static void
+reset_timer(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &begin_time);
+}
+
+static double
+read_timer(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)(t.tv_sec - begin_time.tv_sec) +
+	       1e-9 * (t.tv_nsec - begin_time.tv_nsec);
+}
+
+static size_t
+bytewise_run(const char *data, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		if ((unsigned char) data[i] < 0x20 ||
+		    (unsigned char) data[i] >= 0x7f)
+			break;
+
+	return i;
+}
+
+/* Every offset of every byte value around a word boundary. */
+static int
+test_exact(void)
+{
+	char buffer[24];
+	int c, pos, len, errors = 0;
+
+	for (c = 0; c < 256; c++)
+		for (len = 0; len <= (int) sizeof buffer; len++)
+			for (pos = 0; pos < len; pos++) {
+				memset(buffer, 'a', sizeof buffer);
+				buffer[pos] = c;
+				if (ascii_printable_run(buffer, len) !=
+				    bytewise_run(buffer, len))
+					errors++;
+			}
+
+	printf("exact test: %d errors\n", errors);
+
+	return errors;
+}
+
+static int running;
+static void
+stopme(int n)
+{
+	running = 0;
+}
+
+/* Split the log into runs the way terminal_data does. */
+static void __attribute__((noinline))
+test_loop_speed(const char *name,
+		size_t (*scan)(const char *data, size_t length))
+{
+	unsigned long count = 0;
+	size_t i, runs, text = 0;
+	double t;
+
+	printf("\nRunning 3 s test on %s scan...\n", name);
+
+	running = 1;
+	alarm(3);
+	reset_timer();
+	while (running) {
+		runs = 0;
+		for (i = 0; i < LOG_SIZE; i++) {
+			i += scan(log_data + i, LOG_SIZE - i);
+			runs++;
+		}
+		text += runs;
+		count++;
+	}
+	t = read_timer();
+
+	printf("%lu passes in %f seconds, %.1f MB/s (%zu runs)\n",
+	       count, t, count * (LOG_SIZE / 1e6) / t, text / count);
+}
+
+int main(void)
+{
+	struct sigaction ding;
+
+	ding.sa_handler = stopme;
+	sigemptyset(&ding.sa_mask);
+	ding.sa_flags = 0;
+	sigaction(SIGALRM, &ding, NULL);
+
+	srandom(13);
+
+	if (test_exact() != 0)
+		return 1;
+
+	make_log();
+	test_loop_speed("bytewise", bytewise_run);
+	test_loop_speed("word", ascii_printable_run);
+
+	free(log_data);
+
+	return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#include "../src/xwayland/hash.h"
+
+/*
+ * X resource ids as the window manager sees them: the resource id base
+ * of a client, 2^21 apart, plus a counter that grows with each resource
+ * the client creates.  Clients like Java IDEs keep creating and
+ * destroying override-redirect windows for popups and tooltips, and
+ * every event of such a window is looked up by id.
+ */
+#define CLIENT_BASE(n)	(0x00200000 * ((n) + 1))
+#define CLIENTS		8
+#define LIVE_WINDOWS	4096
+#define LOOKUPS		8	/* per window created */
+
+struct window {
+	uint32_t id;
+};
+
+static struct timespec begin_time;
+
+static void
+reset_timer(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &begin_time);
+}
+
+static double
+read_timer(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)(t.tv_sec - begin_time.tv_sec) +
+	       1e-9 * (t.tv_nsec - begin_time.tv_nsec);
+}
+
+static uint32_t counter[CLIENTS];
+
+static uint32_t
+next_id(void)
+{
+	int client = random() % CLIENTS;
+
+	return CLIENT_BASE(client) + counter[client]++;
+}
+
+/* Random churn checked against the array of live windows. */
+static int
+test_churn(void)
+{
+	static struct window windows[LIVE_WINDOWS];
+	struct hash_table *ht;
+	struct window *w;
+	int i, j, live = 0, errors = 0;
+
+	ht = hash_table_create();
+
+	for (i = 0; i < 1000000; i++) {
+		if (live < LIVE_WINDOWS && (live == 0 || random() % 2)) {
+			w = &windows[live++];
+			w->id = next_id();
+			hash_table_insert(ht, w->id, w);
+		} else {
+			j = random() % live;
+			hash_table_remove(ht, windows[j].id);
+			if (hash_table_lookup(ht, windows[j].id) != NULL)
+				errors++;
+			windows[j] = windows[--live];
+			/* the moved window has a new address */
+			if (j < live)
+				hash_table_insert(ht, windows[j].id,
+						  &windows[j]);
+		}
+
+		if (live > 0) {
+			j = random() % live;
+			if (hash_table_lookup(ht, windows[j].id) !=
+			    &windows[j])
+				errors++;
+		}
+		if (hash_table_lookup(ht, next_id() | 0x00100000) != NULL)
+			errors++;
+	}
+
+	for (j = 0; j < live; j++)
+		if (hash_table_lookup(ht, windows[j].id) != &windows[j])
+			errors++;
+
+	hash_table_destroy(ht);
+
+	printf("churn test: %d errors\n", errors);
+
+	return errors;
+}
+
+static int running;
+static void
+stopme(int n)
+{
+	running = 0;
+}
+
+static void __attribute__((noinline))
+test_loop_speed_churn(void)
+{
+	static struct window windows[LIVE_WINDOWS];
+	struct hash_table *ht;
+	unsigned long count = 0, found = 0;
+	double t;
+	int i, j;
+
+	printf("\nRunning 3 s test on create, %d lookups, destroy...\n",
+	       LOOKUPS);
+
+	ht = hash_table_create();
+	for (i = 0; i < LIVE_WINDOWS; i++) {
+		windows[i].id = next_id();
+		hash_table_insert(ht, windows[i].id, &windows[i]);
+	}
+
+	running = 1;
+	alarm(3);
+	reset_timer();
+	i = 0;
+	while (running) {
+		/* the oldest popup goes, a new one comes */
+		hash_table_remove(ht, windows[i].id);
+		windows[i].id = next_id();
+		hash_table_insert(ht, windows[i].id, &windows[i]);
+
+		for (j = 0; j < LOOKUPS; j++)
+			found += hash_table_lookup(ht,
+				windows[(i * 31 + j * 97) % LIVE_WINDOWS].id)
+				!= NULL;
+
+		i = (i + 1) % LIVE_WINDOWS;
+		count++;
+	}
+	t = read_timer();
+
+	hash_table_destroy(ht);
+
+	printf("%lu iterations in %f seconds, avg. %.1f ns/iter.\n",
+	       count, t, 1e9 * t / count);
+	if (found != count * LOOKUPS)
+		printf("lookups failed: %lu\n", count * LOOKUPS - found);
+}
+
+int main(void)
+{
+	struct sigaction ding;
+
+	ding.sa_handler = stopme;
+	sigemptyset(&ding.sa_mask);
+	ding.sa_flags = 0;
+	sigaction(SIGALRM, &ding, NULL);
+
+	srandom(13);
+
+	if (test_churn() != 0)
+		return 1;
+
+	test_loop_speed_churn();
+
+	return 0;
+}
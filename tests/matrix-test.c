@@ -177,6 +177,97 @@ randomize_matrix(struct weston_matrix *m)
 #else
 		m->d[i] = frand();
 #endif
+	m->type = WESTON_MATRIX_TRANSFORM_OTHER;
+}
+
+/* A product of translations and scalings, and rotations if allowed,
+ * built through the API so that type says what it is. */
+static void
+randomize_typed_matrix(struct weston_matrix *m, int rotate)
+{
+	int i, n = 1 + random() % 4;
+	double a;
+
+	weston_matrix_init(m);
+	for (i = 0; i < n; i++) {
+		switch (random() % (rotate ? 3 : 2)) {
+		case 0:
+			weston_matrix_translate(m, 1000 * frand(),
+						1000 * frand(), frand());
+			break;
+		case 1:
+			weston_matrix_scale(m, 0.25 + 2 * fabs(frand()),
+					    -0.25 - 2 * fabs(frand()),
+					    0.5 + fabs(frand()));
+			break;
+		case 2:
+			a = M_PI * frand();
+			weston_matrix_rotate_xy(m, cos(a), sin(a));
+			break;
+		}
+	}
+}
+
+static double
+matrix_difference(const struct weston_matrix *a,
+		  const struct weston_matrix *b)
+{
+	double err, errsup = 0.0;
+	unsigned i;
+
+	for (i = 0; i < 16; ++i) {
+		err = fabs(a->d[i] - b->d[i]) / fmax(1.0, fabs(b->d[i]));
+		if (err > errsup)
+			errsup = err;
+	}
+
+	return errsup;
+}
+
+/* Compare the closed-form multiply and invert against the general
+ * code, which marking a matrix OTHER forces. */
+static int
+test_fast_paths(void)
+{
+	struct weston_matrix m, n, fast, general, fast_inv, general_inv;
+	int i, failed = 0;
+
+	printf("\nComparing the fast paths against the general code...\n");
+
+	for (i = 0; i < 100000; i++) {
+		randomize_typed_matrix(&m, i & 1);
+		randomize_typed_matrix(&n, i & 2);
+
+		fast = m;
+		general = m;
+		general.type |= WESTON_MATRIX_TRANSFORM_OTHER;
+		weston_matrix_multiply(&fast, &n);
+		weston_matrix_multiply(&general, &n);
+		if (matrix_difference(&fast, &general) > 1e-6) {
+			printf("multiply mismatch, type %u:\n", fast.type);
+			print_matrix(&fast);
+			print_matrix(&general);
+			failed++;
+			continue;
+		}
+
+		if (weston_matrix_invert(&fast_inv, &fast) < 0 ||
+		    weston_matrix_invert(&general_inv, &general) < 0) {
+			printf("not invertible, type %u\n", fast.type);
+			failed++;
+			continue;
+		}
+		if (matrix_difference(&fast_inv, &general_inv) > 1e-4) {
+			printf("invert mismatch, type %u:\n", fast.type);
+			print_matrix(&fast_inv);
+			print_matrix(&general_inv);
+			failed++;
+		}
+	}
+
+	printf("%d of %d failed.\n", failed, i);
+
+	return failed;
 }
 
 /* Take a matrix, compute inverse, multiply together
@@ -409,6 +500,9 @@ int main(void)
 	print_matrix(&M);
 	printf("max abs error: %g, original determinant %g\n", errsup, det);
 
+	if (test_fast_paths())
+		return 1;
+
 	test_loop_precision();
 	test_loop_speed_matrixvector();
 	test_loop_speed_inversetransform();
@@ -0,0 +1,363 @@
+/*
+ * Copyright © 2013 Intel Corporation
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Workloads for the compositor, run with "make bench".  Each one
+ * prints a line of JSON with the compositor's CPU time per frame,
+ * the time from commit to frame callback as seen by the clients, and
+ * the compositor's memory use at the end.  The compositor is found
+ * through the credentials on the display socket.
+ *
+ * WESTON_BENCH_FRAMES and WESTON_BENCH_CLIENTS override the number of
+ * frames and of clients.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "weston-test-client-helper.h"
+
+struct bench;
+
+struct bench_surface {
+	struct bench *bench;
+	struct client *client;
+	struct wl_buffer *buffers[2];
+	void *data;
+	int width, height;
+	int frame;
+	struct timespec commit;
+};
+
+struct bench {
+	const char *name;
+	struct bench_surface *surfaces;
+	int count;
+	int frames;
+	int remaining;
+
+	/* called before each commit */
+	void (*prepare)(struct bench_surface *surface);
+
+	uint32_t *latency;	/* us */
+	int samples;
+};
+
+struct bench_usage {
+	struct timespec time;
+	uint64_t cpu;		/* us */
+	long rss, hwm;		/* kB */
+};
+
+static int
+env_int(const char *name, int value)
+{
+	const char *s = getenv(name);
+
+	return s ? atoi(s) : value;
+}
+
+static uint64_t
+timespec_sub_us(const struct timespec *a, const struct timespec *b)
+{
+	return (uint64_t) (a->tv_sec - b->tv_sec) * 1000000 +
+		(a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+static pid_t
+compositor_pid(struct client *client)
+{
+	struct ucred ucred;
+	socklen_t len = sizeof ucred;
+
+	assert(getsockopt(wl_display_get_fd(client->wl_display),
+			  SOL_SOCKET, SO_PEERCRED, &ucred, &len) == 0);
+
+	return ucred.pid;
+}
+
+static void
+read_usage(pid_t pid, struct bench_usage *usage)
+{
+	unsigned long utime, stime;
+	char path[64], line[1024], *p;
+	FILE *fp;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &usage->time);
+
+	snprintf(path, sizeof path, "/proc/%d/stat", pid);
+	fp = fopen(path, "r");
+	assert(fp);
+	assert(fgets(line, sizeof line, fp));
+	fclose(fp);
+
+	/* utime and stime are fields 14 and 15, after the comm */
+	p = strrchr(line, ')');
+	assert(p);
+	for (i = 0; i < 12; i++)
+		p = strchr(p + 1, ' ');
+	assert(sscanf(p, "%lu %lu", &utime, &stime) == 2);
+	usage->cpu = (uint64_t) (utime + stime) * 1000000 /
+		sysconf(_SC_CLK_TCK);
+
+	usage->rss = usage->hwm = 0;
+	snprintf(path, sizeof path, "/proc/%d/status", pid);
+	fp = fopen(path, "r");
+	assert(fp);
+	while (fgets(line, sizeof line, fp)) {
+		sscanf(line, "VmRSS: %ld", &usage->rss);
+		sscanf(line, "VmHWM: %ld", &usage->hwm);
+	}
+	fclose(fp);
+}
+
+static void
+bench_commit(struct bench_surface *surface);
+
+static void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct bench_surface *surface = data;
+	struct bench *bench = surface->bench;
+	struct timespec now;
+
+	wl_callback_destroy(callback);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bench->latency[bench->samples++] =
+		timespec_sub_us(&now, &surface->commit);
+
+	if (++surface->frame < bench->frames)
+		bench_commit(surface);
+	else
+		bench->remaining--;
+}
+
+static const struct wl_callback_listener frame_listener = {
+	frame_done
+};
+
+static void
+bench_commit(struct bench_surface *surface)
+{
+	struct wl_callback *callback;
+
+	surface->bench->prepare(surface);
+
+	callback = wl_surface_frame(surface->client->surface->wl_surface);
+	wl_callback_add_listener(callback, &frame_listener, surface);
+	clock_gettime(CLOCK_MONOTONIC, &surface->commit);
+	wl_surface_commit(surface->client->surface->wl_surface);
+}
+
+static void
+bench_init(struct bench *bench, const char *name, int count,
+	   int width, int height)
+{
+	struct bench_surface *surface;
+	int i;
+
+	bench->name = name;
+	bench->count = count;
+	bench->frames = env_int("WESTON_BENCH_FRAMES", 300);
+	bench->surfaces = calloc(count, sizeof *bench->surfaces);
+	bench->latency = calloc(count * bench->frames,
+				sizeof *bench->latency);
+	assert(bench->surfaces && bench->latency);
+
+	for (i = 0; i < count; i++) {
+		surface = &bench->surfaces[i];
+		surface->bench = bench;
+		surface->width = width;
+		surface->height = height;
+		surface->client = client_create((i * 37) % 800,
+						(i * 23) % 500,
+						width, height);
+		surface->buffers[0] = surface->client->surface->wl_buffer;
+		surface->data = surface->client->surface->data;
+	}
+}
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench_run(struct bench *bench)
+{
+	struct pollfd *fds;
+	struct bench_usage start, end;
+	uint64_t elapsed;
+	pid_t pid;
+	int i, n;
+
+	fds = calloc(bench->count, sizeof *fds);
+	assert(fds);
+	for (i = 0; i < bench->count; i++) {
+		fds[i].fd =
+			wl_display_get_fd(bench->surfaces[i].client->wl_display);
+		fds[i].events = POLLIN;
+	}
+
+	pid = compositor_pid(bench->surfaces[0].client);
+	read_usage(pid, &start);
+
+	bench->remaining = bench->count;
+	for (i = 0; i < bench->count; i++)
+		bench_commit(&bench->surfaces[i]);
+
+	while (bench->remaining > 0) {
+		for (i = 0; i < bench->count; i++)
+			wl_display_flush(bench->surfaces[i].client->wl_display);
+
+		n = poll(fds, bench->count, 5000);
+		assert(n > 0);
+
+		for (i = 0; i < bench->count; i++)
+			if (fds[i].revents & POLLIN)
+				assert(wl_display_dispatch(bench->surfaces[i].client->wl_display) >= 0);
+	}
+
+	read_usage(pid, &end);
+	free(fds);
+
+	qsort(bench->latency, bench->samples, sizeof *bench->latency,
+	      compare_uint32);
+	elapsed = timespec_sub_us(&end.time, &start.time);
+
+	printf("{\"bench\": \"%s\", \"clients\": %d, \"frames\": %d, "
+	       "\"elapsed_us\": %llu, \"fps\": %.1f, "
+	       "\"cpu_us_per_frame\": %.1f, "
+	       "\"latency_us_p50\": %u, \"latency_us_p99\": %u, "
+	       "\"latency_us_max\": %u, "
+	       "\"rss_kb\": %ld, \"hwm_kb\": %ld}\n",
+	       bench->name, bench->count, bench->frames,
+	       (unsigned long long) elapsed,
+	       elapsed ? bench->frames * 1e6 / elapsed : 0.0,
+	       (double) (end.cpu - start.cpu) / bench->frames,
+	       bench->latency[bench->samples / 2],
+	       bench->latency[bench->samples * 99 / 100],
+	       bench->latency[bench->samples - 1],
+	       end.rss, end.hwm);
+	fflush(stdout);
+}
+
+/* an 8x8 square moving through the surface */
+static void
+prepare_damage(struct bench_surface *surface)
+{
+	struct wl_surface *wl_surface = surface->client->surface->wl_surface;
+	int columns = surface->width / 8, rows = surface->height / 8;
+	int x, y, i;
+
+	x = surface->frame % columns * 8;
+	y = surface->frame / columns % rows * 8;
+	for (i = 0; i < 8; i++)
+		memset((char *) surface->data +
+		       (y + i) * surface->width * 4 + x * 4,
+		       surface->frame, 8 * 4);
+
+	wl_surface_attach(wl_surface, surface->buffers[0], 0, 0);
+	wl_surface_damage(wl_surface, x, y, 8, 8);
+}
+
+TEST(shm_damage)
+{
+	struct bench bench = { .prepare = prepare_damage };
+
+	bench_init(&bench, "shm_damage",
+		   env_int("WESTON_BENCH_CLIENTS", 16), 128, 128);
+	bench_run(&bench);
+}
+
+/* moves every frame and flips between two sizes */
+static void
+prepare_move_resize(struct bench_surface *surface)
+{
+	struct client *client = surface->client;
+	struct wl_surface *wl_surface = client->surface->wl_surface;
+	int b = surface->frame & 1;
+
+	wl_test_move_surface(client->test->wl_test, wl_surface,
+			     (surface->frame * 7) % 600,
+			     (surface->frame * 5) % 400);
+	wl_surface_attach(wl_surface, surface->buffers[b], 0, 0);
+	wl_surface_damage(wl_surface, 0, 0,
+			  surface->width << b, surface->height << b);
+}
+
+TEST(move_resize)
+{
+	struct bench bench = { .prepare = prepare_move_resize };
+	struct bench_surface *surface;
+	void *data;
+	int i;
+
+	bench_init(&bench, "move_resize", 4, 100, 80);
+	for (i = 0; i < bench.count; i++) {
+		surface = &bench.surfaces[i];
+		surface->buffers[1] =
+			create_shm_buffer(surface->client,
+					  surface->width * 2,
+					  surface->height * 2, &data);
+		memset(data, 128, surface->width * surface->height * 16);
+	}
+	bench_run(&bench);
+}
+
+/* a burst of pointer motion over the surface for every frame */
+static void
+prepare_motion(struct bench_surface *surface)
+{
+	struct client *client = surface->client;
+	struct wl_surface *wl_surface = client->surface->wl_surface;
+	int i, x, y;
+
+	for (i = 0; i < 16; i++) {
+		x = client->surface->x + (surface->frame * 16 + i) % 400;
+		y = client->surface->y + (surface->frame + i * 13) % 300;
+		wl_test_move_pointer(client->test->wl_test, x, y);
+	}
+
+	wl_surface_attach(wl_surface, surface->buffers[0], 0, 0);
+	wl_surface_damage(wl_surface, 0, 0, 1, 1);
+}
+
+TEST(pointer_motion)
+{
+	struct bench bench = { .prepare = prepare_motion };
+
+	bench_init(&bench, "pointer_motion", 1, 400, 300);
+	bench_run(&bench);
+}
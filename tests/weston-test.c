@@ -79,9 +79,11 @@ test_surface_configure(struct weston_surface *surface, int32_t sx, int32_t sy, i
 	struct weston_test_surface *test_surface = surface->configure_private;
 	struct weston_test *test = test_surface->test;
 
-	if (wl_list_empty(&surface->layer_link))
+	if (wl_list_empty(&surface->layer_link)) {
 		wl_list_insert(&test->layer.surface_list,
 			       &surface->layer_link);
+		weston_compositor_stacking_dirty(surface->compositor);
+	}
 
 	weston_surface_configure(surface, test_surface->x, test_surface->y,
 				 width, height);
@@ -31,17 +31,22 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <cairo.h>
 
 #include "wcap-decode.h"
 
 static void
-write_png(struct wcap_decoder *decoder, const char *filename)
+write_png(struct wcap_decoder *decoder, uint32_t *frame, const char *filename)
 {
 	cairo_surface_t *surface;
 
-	surface = cairo_image_surface_create_for_data((unsigned char *) decoder->frame,
+	surface = cairo_image_surface_create_for_data((unsigned char *) frame,
 						      CAIRO_FORMAT_ARGB32,
 						      decoder->width,
 						      decoder->height,
@@ -93,8 +98,110 @@ int clamp_uv(int u)
 		return clamp;
 }
 
+#ifdef __SSE2__
+
+/*
+ * Converts eight pixels of each of two rows, the same fixed point math
+ * as rgb_to_yuv() and clamp_uv().  Coefficients that do not fit in a
+ * signed 16 bit word are split as c = 65536 - (65536 - c), so that
+ * pmaddwd can do the multiplies and the chroma sums of pixel pairs.
+ */
+static inline void
+convert_pixels_sse2(uint32_t format, const uint32_t *p1, const uint32_t *p2,
+		    unsigned char *y1, unsigned char *y2,
+		    unsigned char *u, unsigned char *v)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rg_coeff = _mm_set_epi16(-27067, 19595, -27067, 19595,
+					       -27067, 19595, -27067, 19595);
+	const __m128i b_coeff = _mm_set1_epi32(7472);
+	const __m128i u_coeff = _mm_set1_epi16(-18809);
+	const __m128i v_coeff = _mm_set1_epi16(-28574);
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i bias = _mm_set1_epi32(128);
+	__m128i px[4], r[2], g[2], b[2], y[2], lo, hi, du, dv, us, vs;
+	int rshift, bshift, i;
+
+	switch (format) {
+	case WCAP_FORMAT_XRGB8888:
+		rshift = 16;
+		bshift = 0;
+		break;
+	case WCAP_FORMAT_XBGR8888:
+		rshift = 0;
+		bshift = 16;
+		break;
+	default:
+		assert(0);
+	}
+
+	px[0] = _mm_loadu_si128((const __m128i *) p1);
+	px[1] = _mm_loadu_si128((const __m128i *) (p1 + 4));
+	px[2] = _mm_loadu_si128((const __m128i *) p2);
+	px[3] = _mm_loadu_si128((const __m128i *) (p2 + 4));
+
+	us = zero;
+	vs = zero;
+	for (i = 0; i < 2; i++) {
+		r[i] = _mm_packs_epi32(
+			_mm_and_si128(_mm_srli_epi32(px[2 * i], rshift), mask),
+			_mm_and_si128(_mm_srli_epi32(px[2 * i + 1], rshift),
+				      mask));
+		g[i] = _mm_packs_epi32(
+			_mm_and_si128(_mm_srli_epi32(px[2 * i], 8), mask),
+			_mm_and_si128(_mm_srli_epi32(px[2 * i + 1], 8), mask));
+		b[i] = _mm_packs_epi32(
+			_mm_and_si128(_mm_srli_epi32(px[2 * i], bshift), mask),
+			_mm_and_si128(_mm_srli_epi32(px[2 * i + 1], bshift),
+				      mask));
+
+		/* y = (19595 * r + 38469 * g + 7472 * b) >> 16 */
+		lo = _mm_add_epi32(
+			_mm_madd_epi16(_mm_unpacklo_epi16(r[i], g[i]),
+				       rg_coeff),
+			_mm_slli_epi32(_mm_unpacklo_epi16(g[i], zero), 16));
+		lo = _mm_add_epi32(lo,
+			_mm_madd_epi16(_mm_unpacklo_epi16(b[i], zero),
+				       b_coeff));
+		hi = _mm_add_epi32(
+			_mm_madd_epi16(_mm_unpackhi_epi16(r[i], g[i]),
+				       rg_coeff),
+			_mm_slli_epi32(_mm_unpackhi_epi16(g[i], zero), 16));
+		hi = _mm_add_epi32(hi,
+			_mm_madd_epi16(_mm_unpackhi_epi16(b[i], zero),
+				       b_coeff));
+		y[i] = _mm_packs_epi32(_mm_srli_epi32(lo, 16),
+				       _mm_srli_epi32(hi, 16));
+
+		/* the sums over each pixel pair of 46727 * (r - y) and
+		 * 36962 * (b - y), the rows are added up below */
+		du = _mm_sub_epi16(r[i], y[i]);
+		dv = _mm_sub_epi16(b[i], y[i]);
+		us = _mm_add_epi32(us, _mm_add_epi32(
+			_mm_madd_epi16(du, u_coeff),
+			_mm_slli_epi32(_mm_madd_epi16(du, one), 16)));
+		vs = _mm_add_epi32(vs, _mm_add_epi32(
+			_mm_madd_epi16(dv, v_coeff),
+			_mm_slli_epi32(_mm_madd_epi16(dv, one), 16)));
+	}
+
+	_mm_storel_epi64((__m128i *) y1, _mm_packus_epi16(y[0], zero));
+	_mm_storel_epi64((__m128i *) y2, _mm_packus_epi16(y[1], zero));
+
+	us = _mm_add_epi32(_mm_srai_epi32(us, 18), bias);
+	vs = _mm_add_epi32(_mm_srai_epi32(vs, 18), bias);
+	us = _mm_packus_epi16(_mm_packs_epi32(us, zero), zero);
+	vs = _mm_packus_epi16(_mm_packs_epi32(vs, zero), zero);
+	*(uint32_t *) u = _mm_cvtsi128_si32(us);
+	*(uint32_t *) v = _mm_cvtsi128_si32(vs);
+}
+
+#endif
+
 static void
-convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
+convert_to_yv12(struct wcap_decoder *decoder, uint32_t *frame,
+		unsigned char *out)
 {
 	unsigned char *y1, *y2, *u, *v;
 	uint32_t *p1, *p2, *end;
@@ -108,10 +215,23 @@ convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
 		y2 = y1 + stride0;
 		v = out + stride0 * decoder->height + stride1 * i / 2;
 		u = v + stride1 * decoder->height / 2;
-		p1 = decoder->frame + decoder->width * i;
+		p1 = frame + decoder->width * i;
 		p2 = p1 + decoder->width;
 		end = p1 + decoder->width;
 
+#ifdef __SSE2__
+		while (p1 + 8 <= end) {
+			convert_pixels_sse2(format, p1, p2, y1, y2, u, v);
+
+			y1 += 8;
+			p1 += 8;
+			y2 += 8;
+			p2 += 8;
+			u += 4;
+			v += 4;
+		}
+#endif
+
 		while (p1 < end) {
 			u_accum = 0;
 			v_accum = 0;
@@ -133,7 +253,7 @@ convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
 }
 
 static void
-output_yuv_frame(struct wcap_decoder *decoder)
+output_yuv_frame(struct wcap_decoder *decoder, uint32_t *frame)
 {
 	static unsigned char *out;
 	int size;
@@ -142,23 +262,254 @@ output_yuv_frame(struct wcap_decoder *decoder)
 	if (out == NULL)
 		out = malloc(size);
 
-	convert_to_yv12(decoder, out);
+	convert_to_yv12(decoder, frame, out);
 	printf("FRAME\n");
 	fwrite(out, 1, size, stdout);
 }
 
+/* decoded frames waiting for conversion and output */
+#define FRAME_QUEUE_LENGTH 4
+
+/*
+ * The run-length decoding runs on its own thread, a step ahead of the
+ * colour conversion and writing on the main thread.  The decoding
+ * thread resamples to the output rate and hands over copies of the
+ * frames that are written out, the -1 index marks the end.
+ */
+struct frame_queue {
+	struct wcap_decoder *decoder;
+	uint32_t frame_time;
+	int output_frame, all_frames;
+	int first, last;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint32_t *frames[FRAME_QUEUE_LENGTH];
+	int index[FRAME_QUEUE_LENGTH];
+	int head, length;
+	int count;
+};
+
+static void
+frame_queue_push(struct frame_queue *queue, int index)
+{
+	struct wcap_decoder *decoder = queue->decoder;
+	int slot;
+
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->length == FRAME_QUEUE_LENGTH)
+		pthread_cond_wait(&queue->cond, &queue->mutex);
+	slot = (queue->head + queue->length) % FRAME_QUEUE_LENGTH;
+	pthread_mutex_unlock(&queue->mutex);
+
+	/* the free slot is only touched by this thread until pushed */
+	if (index >= 0)
+		memcpy(queue->frames[slot], decoder->frame,
+		       decoder->width * decoder->height * 4);
+
+	pthread_mutex_lock(&queue->mutex);
+	queue->index[slot] = index;
+	queue->length++;
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * Decodes frames first to last, to the end of the file if last is
+ * negative, of the capture resampled to one frame every frame_time:
+ * frame i is the first one at or after start_msecs + i * frame_time.
+ * Decoding starts from the nearest keyframe before frame first.  Calls
+ * emit with each and returns the index after the last one.
+ */
+static int
+decode_frames(struct wcap_decoder *decoder, uint32_t frame_time,
+	      int first, int last,
+	      void (*emit)(struct wcap_decoder *decoder, int index, void *data),
+	      void *data)
+{
+	uint32_t msecs;
+	int i, has_frame;
+
+	i = first;
+	msecs = decoder->start_msecs + i * frame_time;
+	wcap_decoder_seek(decoder, msecs);
+	has_frame = wcap_decoder_get_frame(decoder);
+	while (has_frame && decoder->msecs < msecs)
+		has_frame = wcap_decoder_get_frame(decoder);
+
+	while (has_frame && (last < 0 || i <= last)) {
+		emit(decoder, i, data);
+		i++;
+		msecs += frame_time;
+		while (decoder->msecs < msecs && has_frame)
+			has_frame = wcap_decoder_get_frame(decoder);
+	}
+
+	return i;
+}
+
+static void
+queue_frame(struct wcap_decoder *decoder, int index, void *data)
+{
+	struct frame_queue *queue = data;
+
+	if (queue->all_frames || index == queue->output_frame)
+		frame_queue_push(queue, index);
+}
+
+static void *
+decode_thread(void *data)
+{
+	struct frame_queue *queue = data;
+
+	queue->count = decode_frames(queue->decoder, queue->frame_time,
+				     queue->first, queue->last,
+				     queue_frame, queue) - queue->first;
+	frame_queue_push(queue, -1);
+
+	return NULL;
+}
+
+static void
+write_png_frame(struct wcap_decoder *decoder, int index, void *data)
+{
+	char filename[200];
+
+	snprintf(filename, sizeof filename, "wcap-frame-%d.png", index);
+	write_png(decoder, decoder->frame, filename);
+	fprintf(stderr, "wrote %s\n", filename);
+}
+
+/*
+ * Writing out frames as pngs needs no ordering, so with a keyframe
+ * index each thread takes the frames from one keyframe to the next at
+ * a time, decoded with a decoder of its own.
+ */
+struct extract {
+	const char *filename;
+	uint32_t frame_time;
+	int first, last;
+
+	pthread_mutex_t mutex;
+	uint32_t next_keyframe;
+	int end;
+};
+
+/* The first resampled frame decoded from keyframe k on. */
+static int
+keyframe_first_frame(struct wcap_decoder *decoder, uint32_t k,
+		     uint32_t frame_time)
+{
+	if (k == 0)
+		return 0;
+
+	return (decoder->index[k].msecs - decoder->start_msecs +
+		frame_time - 1) / frame_time;
+}
+
+static void *
+extract_thread(void *data)
+{
+	struct extract *extract = data;
+	struct wcap_decoder *decoder;
+	uint32_t k;
+	int first, last, end;
+
+	decoder = wcap_decoder_create(extract->filename);
+	if (decoder == NULL)
+		return NULL;
+
+	while (1) {
+		pthread_mutex_lock(&extract->mutex);
+		k = extract->next_keyframe++;
+		pthread_mutex_unlock(&extract->mutex);
+		if (k >= decoder->index_count)
+			break;
+
+		first = keyframe_first_frame(decoder, k, extract->frame_time);
+		if (first < extract->first)
+			first = extract->first;
+		last = extract->last;
+		if (k + 1 < decoder->index_count) {
+			end = keyframe_first_frame(decoder, k + 1,
+						   extract->frame_time);
+			if (last < 0 || end - 1 < last)
+				last = end - 1;
+		}
+		if (last >= 0 && first > last)
+			continue;
+
+		end = decode_frames(decoder, extract->frame_time,
+				    first, last, write_png_frame, NULL);
+
+		pthread_mutex_lock(&extract->mutex);
+		if (end > extract->end)
+			extract->end = end;
+		pthread_mutex_unlock(&extract->mutex);
+	}
+
+	wcap_decoder_destroy(decoder);
+
+	return NULL;
+}
+
+/* Returns the number of frames written. */
+static int
+extract_frames(const char *filename, uint32_t frame_time,
+	       int first, int last, int nthreads)
+{
+	struct extract extract;
+	pthread_t *threads;
+	int i, started;
+
+	extract.filename = filename;
+	extract.frame_time = frame_time;
+	extract.first = first;
+	extract.last = last;
+	extract.next_keyframe = 0;
+	extract.end = first;
+	pthread_mutex_init(&extract.mutex, NULL);
+
+	threads = malloc(nthreads * sizeof *threads);
+	if (threads == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (started = 0; started < nthreads; started++)
+		if (pthread_create(&threads[started], NULL,
+				   extract_thread, &extract) != 0)
+			break;
+	if (started == 0) {
+		fprintf(stderr, "failed to start decoding threads\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	pthread_mutex_destroy(&extract.mutex);
+
+	return extract.end - first;
+}
+
 static void
 usage(int exit_code)
 {
 	fprintf(stderr, "usage: wcap-decode "
 		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] \n"
-		"\t[--rate=<num:denom>] <wcap file>\n\n"
+		"\t[--rate=<num:denom>] [--from=<msecs>] [--to=<msecs>]\n"
+		"\t[--threads=<n>] <wcap file>\n\n"
 		"\t--help\t\t\tthis help text\n"
 		"\t--yuv4mpeg2\t\tdump wcap file to stdout in yuv4mpeg2 format\n"
 		"\t--frame=<frame>\t\twrite out the given frame number as png\n"
 		"\t--all\t\t\twrite all frames as pngs\n"
 		"\t--rate=<num:denom>\treplay frame rate for yuv4mpeg2,\n"
-		"\t\t\t\tspecified as an integer fraction\n\n");
+		"\t\t\t\tspecified as an integer fraction\n"
+		"\t--from=<msecs>\t\tstart this far into the capture\n"
+		"\t--to=<msecs>\t\tstop this far into the capture\n"
+		"\t--threads=<n>\t\tthreads writing pngs with --all,\n"
+		"\t\t\t\tif the capture has keyframes\n\n");
 
 	exit(exit_code);
 }
@@ -166,10 +517,13 @@ usage(int exit_code)
 int main(int argc, char *argv[])
 {
 	struct wcap_decoder *decoder;
-	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, has_frame;
-	int num = 30, denom = 1;
+	struct frame_queue queue;
+	pthread_t thread;
+	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, index;
+	int num = 30, denom = 1, from = 0, to = -1, first, last;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
 	char filename[200];
-	uint32_t msecs, frame_time, *frame, frame_size;
+	uint32_t *frame, frame_time;
 
 	for (i = 1, j = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--yuv4mpeg2") == 0) {
@@ -184,6 +538,12 @@ int main(int argc, char *argv[])
 			;
 		} else if (sscanf(argv[i], "--rate=%d:%d", &num, &denom) == 2) {
 			;
+		} else if (sscanf(argv[i], "--from=%d", &from) == 1) {
+			;
+		} else if (sscanf(argv[i], "--to=%d", &to) == 1) {
+			;
+		} else if (sscanf(argv[i], "--threads=%d", &nthreads) == 1) {
+			;
 		} else if (strcmp(argv[i], "--") == 0) {
 			break;
 		} else if (argv[i][0] == '-') {
@@ -202,8 +562,20 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "invalid rate, denom can not be 0\n");
 		exit(EXIT_FAILURE);
 	}
+	if (num <= 0 || 1000 * denom / num == 0) {
+		fprintf(stderr, "invalid rate, at most 1000 frames a second\n");
+		exit(EXIT_FAILURE);
+	}
+	if (from < 0 || (to >= 0 && to < from)) {
+		fprintf(stderr, "invalid range %d to %d\n", from, to);
+		exit(EXIT_FAILURE);
+	}
 
 	decoder = wcap_decoder_create(argv[1]);
+	if (decoder == NULL) {
+		fprintf(stderr, "failed to open %s\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
 
 	if (yuv4mpeg2 && isatty(1)) {
 		fprintf(stderr, "Not dumping yuv4mpeg2 data to terminal.  Pipe output to a file or a process.\n");
@@ -220,31 +592,83 @@ int main(int argc, char *argv[])
 		fflush(stdout);
 	}
 
-	i = 0;
-	has_frame = wcap_decoder_get_frame(decoder);
-	msecs = decoder->msecs;
+	/* only decode what is asked for, from the nearest keyframe */
 	frame_time = 1000 * denom / num;
-	frame_size = decoder->width * decoder->height * 4;
-	frame = malloc(frame_size);
-	while (has_frame) {
-		if (decoder->msecs >= msecs)
-			memcpy(frame, decoder->frame, frame_size);
-		if (all || i == output_frame) {
+	first = (from + frame_time - 1) / frame_time;
+	last = to < 0 ? -1 : to / frame_time;
+	if (!all && !yuv4mpeg2 && output_frame >= 0) {
+		if (output_frame > first)
+			first = output_frame;
+		if (last < 0 || output_frame < last)
+			last = output_frame;
+	}
+
+	if (all && !yuv4mpeg2 && nthreads > 1 && decoder->index_count > 1) {
+		i = extract_frames(argv[1], frame_time, first, last, nthreads);
+		goto out;
+	}
+
+	queue.decoder = decoder;
+	queue.frame_time = frame_time;
+	queue.output_frame = output_frame;
+	queue.all_frames = all || yuv4mpeg2;
+	queue.first = first;
+	queue.last = last;
+	queue.head = 0;
+	queue.length = 0;
+	for (i = 0; i < FRAME_QUEUE_LENGTH; i++)
+		queue.frames[i] =
+			malloc(decoder->width * decoder->height * 4);
+	pthread_mutex_init(&queue.mutex, NULL);
+	pthread_cond_init(&queue.cond, NULL);
+
+	if (pthread_create(&thread, NULL, decode_thread, &queue) != 0) {
+		fprintf(stderr, "failed to start decoding thread\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (1) {
+		pthread_mutex_lock(&queue.mutex);
+		while (queue.length == 0)
+			pthread_cond_wait(&queue.cond, &queue.mutex);
+		frame = queue.frames[queue.head];
+		index = queue.index[queue.head];
+		pthread_mutex_unlock(&queue.mutex);
+
+		if (index < 0)
+			break;
+
+		if (all || index == output_frame) {
 			snprintf(filename, sizeof filename,
-				 "wcap-frame-%d.png", i);
-			write_png(decoder, filename);
+				 "wcap-frame-%d.png", index);
+			write_png(decoder, frame, filename);
 			fprintf(stderr, "wrote %s\n", filename);
 		}
 		if (yuv4mpeg2)
-			output_yuv_frame(decoder);
-		i++;
-		msecs += frame_time;
-		while (decoder->msecs < msecs && has_frame)
-			has_frame = wcap_decoder_get_frame(decoder);
+			output_yuv_frame(decoder, frame);
+
+		pthread_mutex_lock(&queue.mutex);
+		queue.head = (queue.head + 1) % FRAME_QUEUE_LENGTH;
+		queue.length--;
+		pthread_cond_signal(&queue.cond);
+		pthread_mutex_unlock(&queue.mutex);
 	}
 
-	fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
-		decoder->width, decoder->height, i);
+	pthread_join(thread, NULL);
+	i = queue.count;
+	for (j = 0; j < FRAME_QUEUE_LENGTH; j++)
+		free(queue.frames[j]);
+	pthread_mutex_destroy(&queue.mutex);
+	pthread_cond_destroy(&queue.cond);
+
+out:
+	if (first == 0 && last < 0)
+		fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
+			decoder->width, decoder->height, i);
+	else
+		fprintf(stderr, "wcap file: size %dx%d, "
+			"%d frames decoded from frame %d\n",
+			decoder->width, decoder->height, i, first);
 
 	wcap_decoder_destroy(decoder);
 
@@ -20,6 +20,8 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "config.h"
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -33,13 +35,20 @@
 
 #include <cairo.h>
 
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #include "wcap-decode.h"
 
-static void
+static uint32_t *
 wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
-			      struct wcap_rectangle *rect)
+			      struct wcap_rectangle *rect, uint32_t *p)
 {
-	uint32_t v, *p = decoder->p, *d;
+	uint32_t v, *d;
 	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
 	int x, i, j, k, l, count = width * height;
 	unsigned char r, g, b, dr, dg, db;
@@ -77,7 +86,53 @@ wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 		printf("rle encoding longer than expected (%d expected %d)\n",
 		       i, count);
 
-	decoder->p = p;
+	return p;
+}
+
+static int
+wcap_decoder_decompress(struct wcap_decoder *decoder,
+			struct wcap_block_header *block)
+{
+	const char *src = (const char *) (block + 1);
+	uint32_t *data;
+	size_t len = 0;
+
+	if (block->size > decoder->block_size) {
+		data = realloc(decoder->block, block->size);
+		if (data == NULL)
+			return -1;
+		decoder->block = data;
+		decoder->block_size = block->size;
+	}
+
+	if (block->compressed_size == block->size) {
+		memcpy(decoder->block, src, block->size);
+		return 0;
+	}
+
+	switch (decoder->compression) {
+#ifdef HAVE_LZ4
+	case WCAP_COMPRESSION_LZ4:
+		len = LZ4_decompress_safe(src, (char *) decoder->block,
+					  block->compressed_size, block->size);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case WCAP_COMPRESSION_ZSTD:
+		len = ZSTD_decompress(decoder->block, block->size,
+				      src, block->compressed_size);
+		if (ZSTD_isError(len))
+			len = 0;
+		break;
+#endif
+	}
+
+	if (len != block->size) {
+		printf("corrupt block in frame %d\n", decoder->count);
+		return -1;
+	}
+
+	return 0;
 }
 
 int
@@ -85,7 +140,8 @@ wcap_decoder_get_frame(struct wcap_decoder *decoder)
 {
 	struct wcap_rectangle *rects;
 	struct wcap_frame_header *header;
-	uint32_t i;
+	struct wcap_block_header *block;
+	uint32_t i, nrects, *p;
 
 	if (decoder->p == decoder->end)
 		return 0;
@@ -94,10 +150,112 @@ wcap_decoder_get_frame(struct wcap_decoder *decoder)
 	decoder->msecs = header->msecs;
 	decoder->count++;
 
+	nrects = header->nrects;
+	if (decoder->flags & WCAP_FLAG_KEYFRAMES) {
+		nrects &= ~WCAP_FRAME_KEY;
+		if (header->nrects & WCAP_FRAME_KEY)
+			memset(decoder->frame, 0,
+			       decoder->width * decoder->height * 4);
+	}
+
 	rects = (void *) (header + 1);
-	decoder->p = (uint32_t *) (rects + header->nrects);
-	for (i = 0; i < header->nrects; i++)
-		wcap_decoder_decode_rectangle(decoder, &rects[i]);
+	p = (uint32_t *) (rects + nrects);
+	if (decoder->compression == WCAP_COMPRESSION_NONE) {
+		for (i = 0; i < nrects; i++)
+			p = wcap_decoder_decode_rectangle(decoder,
+							  &rects[i], p);
+		decoder->p = p;
+		return 1;
+	}
+
+	block = (struct wcap_block_header *) p;
+	decoder->p = (char *) (block + 1) +
+		((block->compressed_size + 3) & ~3);
+	if (wcap_decoder_decompress(decoder, block) < 0)
+		return 0;
+
+	p = decoder->block;
+	for (i = 0; i < nrects; i++)
+		p = wcap_decoder_decode_rectangle(decoder, &rects[i], p);
+
+	return 1;
+}
+
+static uint64_t
+index_entry_offset(struct wcap_index_entry *entry)
+{
+	return (uint64_t) entry->offset_hi << 32 | entry->offset_lo;
+}
+
+/* Points decoder->index at the keyframe index at the end of the file
+ * and ends the frames before it, if there is one that makes sense. */
+static void
+wcap_decoder_read_index(struct wcap_decoder *decoder)
+{
+	struct wcap_index_trailer *trailer;
+	struct wcap_index_entry *index;
+	size_t frames, data;
+	uint32_t i;
+
+	frames = (char *) decoder->end - (char *) decoder->start;
+	if (frames < sizeof *trailer)
+		return;
+
+	trailer = (void *) ((char *) decoder->end - sizeof *trailer);
+	if (trailer->magic != WCAP_INDEX_MAGIC ||
+	    trailer->count == 0 ||
+	    trailer->count > (frames - sizeof *trailer) / sizeof *index)
+		return;
+
+	index = (void *) ((char *) trailer - trailer->count * sizeof *index);
+	data = (char *) decoder->start - (char *) decoder->map;
+	frames = (char *) index - (char *) decoder->map;
+	for (i = 0; i < trailer->count; i++) {
+		if (index_entry_offset(&index[i]) < data ||
+		    index_entry_offset(&index[i]) >= frames ||
+		    (i > 0 && index[i].msecs < index[i - 1].msecs))
+			return;
+	}
+
+	decoder->index = index;
+	decoder->index_count = trailer->count;
+	decoder->end = index;
+}
+
+/*
+ * Makes the next wcap_decoder_get_frame() start over from the last
+ * keyframe before msecs, so that decoding on from there reaches the
+ * first frame at or after msecs without the frames before the
+ * keyframe.  Without an index, or before the first keyframe, that is
+ * the start of the file.  Returns 1 if it moved to a keyframe.
+ */
+int
+wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t msecs)
+{
+	struct wcap_index_entry *entry;
+	uint32_t low = 0, high = decoder->index_count, mid;
+
+	/* the first entry with msecs at or after the one asked for */
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (decoder->index[mid].msecs < msecs)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low == 0) {
+		decoder->p = decoder->start;
+		decoder->count = 0;
+		memset(decoder->frame, 0,
+		       decoder->width * decoder->height * 4);
+		return 0;
+	}
+
+	/* the frame is decoded against black, nothing else to reset */
+	entry = &decoder->index[low - 1];
+	decoder->p = (char *) decoder->map + index_entry_offset(entry);
+	decoder->count = entry->frame;
 
 	return 1;
 }
@@ -107,6 +265,7 @@ wcap_decoder_create(const char *filename)
 {
 	struct wcap_decoder *decoder;
 	struct wcap_header *header;
+	struct wcap_header_v2 *header_v2;
 	int frame_size;
 	struct stat buf;
 
@@ -124,6 +283,8 @@ wcap_decoder_create(const char *filename)
 	decoder->size = buf.st_size;
 	decoder->map = mmap(NULL, decoder->size,
 			    PROT_READ, MAP_PRIVATE, decoder->fd, 0);
+	/* frames are decoded front to back, from a keyframe when seeking */
+	madvise(decoder->map, decoder->size, MADV_SEQUENTIAL);
 		
 	header = decoder->map;
 	decoder->format = header->format;
@@ -132,6 +293,45 @@ wcap_decoder_create(const char *filename)
 	decoder->height = header->height;
 	decoder->p = header + 1;
 	decoder->end = decoder->map + decoder->size;
+	decoder->compression = WCAP_COMPRESSION_NONE;
+	decoder->flags = 0;
+	decoder->block = NULL;
+	decoder->block_size = 0;
+	decoder->index = NULL;
+	decoder->index_count = 0;
+
+	if (header->magic == WCAP_HEADER_MAGIC_V2) {
+		header_v2 = decoder->p;
+		decoder->compression = header_v2->compression;
+		decoder->flags = header_v2->flags;
+		decoder->p = header_v2 + 1;
+	}
+
+	decoder->start = decoder->p;
+	if (decoder->flags & WCAP_FLAG_KEYFRAMES)
+		wcap_decoder_read_index(decoder);
+	decoder->start_msecs = 0;
+	if (decoder->p != decoder->end)
+		decoder->start_msecs =
+			((struct wcap_frame_header *) decoder->p)->msecs;
+
+	switch (decoder->compression) {
+	case WCAP_COMPRESSION_NONE:
+#ifdef HAVE_LZ4
+	case WCAP_COMPRESSION_LZ4:
+#endif
+#ifdef HAVE_ZSTD
+	case WCAP_COMPRESSION_ZSTD:
+#endif
+		break;
+	default:
+		fprintf(stderr, "unsupported compression %d in %s\n",
+			decoder->compression, filename);
+		munmap(decoder->map, decoder->size);
+		close(decoder->fd);
+		free(decoder);
+		return NULL;
+	}
 
 	frame_size = header->width * header->height * 4;
 	decoder->frame = malloc(frame_size);
@@ -144,6 +344,8 @@ void
 wcap_decoder_destroy(struct wcap_decoder *decoder)
 {
 	munmap(decoder->map, decoder->size);
+	close(decoder->fd);
 	free(decoder->frame);
+	free(decoder->block);
 	free(decoder);
 }
@@ -24,6 +24,7 @@
 #define _WCAP_DECODE_
 
 #define WCAP_HEADER_MAGIC	0x57434150
+#define WCAP_HEADER_MAGIC_V2	0x57434151
 
 #define WCAP_FORMAT_XRGB8888	0x34325258
 #define WCAP_FORMAT_XBGR8888	0x34324258
@@ -36,6 +37,48 @@ struct wcap_header {
 	uint32_t width, height;
 };
 
+#define WCAP_COMPRESSION_NONE	0
+#define WCAP_COMPRESSION_LZ4	1
+#define WCAP_COMPRESSION_ZSTD	2
+
+/* Version 2 files follow the header with this one.  Each frame header
+ * and its rectangles are then followed by a block header and the run
+ * length data for all rectangles of the frame, compressed and padded
+ * to four bytes.  A block with compressed_size equal to size is
+ * stored uncompressed. */
+struct wcap_header_v2 {
+	uint32_t compression;
+	uint32_t flags;
+};
+
+/* Set in flags when the recorder writes keyframes: frames with
+ * WCAP_FRAME_KEY or'ed into nrects cover the whole output and are coded
+ * against a frame of all 0x00000000 pixels instead of the previous one.
+ * A file closed cleanly then ends in an index of its keyframes, in
+ * order, followed by a wcap_index_trailer. */
+#define WCAP_FLAG_KEYFRAMES	0x1
+
+#define WCAP_FRAME_KEY		0x80000000
+
+#define WCAP_INDEX_MAGIC	0x57434149
+
+struct wcap_index_entry {
+	uint32_t msecs;
+	uint32_t frame;
+	/* of the frame header from the start of the file */
+	uint32_t offset_lo, offset_hi;
+};
+
+struct wcap_index_trailer {
+	uint32_t count;
+	uint32_t magic;
+};
+
+struct wcap_block_header {
+	uint32_t size;
+	uint32_t compressed_size;
+};
+
 struct wcap_frame_header {
 	uint32_t msecs;
 	uint32_t nrects;
@@ -48,15 +91,23 @@ struct wcap_rectangle {
 struct wcap_decoder {
 	int fd;
 	size_t size;
-	void *map, *p, *end;
+	void *map, *p, *start, *end;
 	uint32_t *frame;
+	uint32_t *block;
+	size_t block_size;
+	uint32_t compression;
+	uint32_t flags;
 	uint32_t format;
+	uint32_t start_msecs;
+	struct wcap_index_entry *index;
+	uint32_t index_count;
 	uint32_t msecs;
 	uint32_t count;
 	int width, height;
 };
 
 int wcap_decoder_get_frame(struct wcap_decoder *decoder);
+int wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t msecs);
 struct wcap_decoder *wcap_decoder_create(const char *filename);
 void wcap_decoder_destroy(struct wcap_decoder *decoder);
 